@@ -0,0 +1,32 @@
+#!/bin/sh
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Validate a recorded range of blocks into a fresh datadir and print how fast
+# it went. The blocks are in the blk*.dat format -loadblock reads, starting at
+# the genesis block: a blk00000.dat, or a bootstrap.dat from linearize.
+#
+#   replay-blocks.sh <blocks file> [par] [dbcache] [extra mild arguments...]
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <blocks file> [par] [dbcache] [extra mild arguments...]"
+    exit 1
+fi
+
+BLOCKS="$1"
+PAR="${2:-0}"
+DBCACHE="${3:-300}"
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+MILD="${MILD:-$(dirname "$0")/../../src/mild}"
+
+DATADIR=$(mktemp -d "${TMPDIR:-/tmp}/replay-blocks.XXXXXX")
+trap 'rm -rf "$DATADIR"' EXIT
+
+"$MILD" -datadir="$DATADIR" -loadblock="$BLOCKS" -stopafterblockimport \
+    -par="$PAR" -dbcache="$DBCACHE" -connect=0 -listen=0 -server=0 -disablewallet \
+    -persistmempool=0 -debug=bench "$@" || exit $?
+
+grep -A1 "Imported [0-9]* blocks" "$DATADIR/debug.log" | cut -d' ' -f2-
@@ -57,7 +57,14 @@ class BlockchainTest(BitcoinTestFramework):
         assert_equal(res['txouts'], 200)
         assert_equal(res['bytes_serialized'], 13924),
         assert_equal(len(res['bestblock']), 64)
-        assert_equal(len(res['hash_serialized']), 64)
+        assert_equal(len(res['hash_set']), 64)
+        assert('hash_serialized' not in res)
+
+        # A full scan agrees with the statistics kept block by block
+        full = node.gettxoutsetinfo(True)
+        assert_equal(len(full['hash_serialized']), 64)
+        del full['hash_serialized']
+        assert_equal(full, res)
 
     def _test_getblockheader(self):
         node = self.nodes[0]
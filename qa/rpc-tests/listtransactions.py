@@ -98,6 +98,14 @@ class ListTransactionsTest(BitcoinTestFramework):
                            {"category":"receive","amount":Decimal("0.1")},
                            {"txid":txid, "account" : "watchonly"} )
 
+        # paging with the orderpos cursor gives the same entries as from/count
+        everything = self.nodes[1].listtransactions("*", 1000)
+        page = self.nodes[1].listtransactions("*", 3)
+        assert_equal(page, everything[-3:])
+        older = self.nodes[1].listtransactions("*", 3, 0, False, page[0]["orderpos"])
+        assert(all(entry["orderpos"] < page[0]["orderpos"] for entry in older))
+        assert_equal(older, [entry for entry in everything if entry["orderpos"] < page[0]["orderpos"]][-3:])
+
         #self.run_rbf_opt_in_test()
 
     # Check that the opt-in-rbf flag works properly, for sent and received
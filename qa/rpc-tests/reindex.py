@@ -4,7 +4,7 @@
 # file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #
-# Test -reindex and -reindex-chainstate with CheckBlockIndex
+# Test -reindex, with and without -reindexthreads, and -reindex-chainstate with CheckBlockIndex
 #
 from test_framework.test_framework import BitcoinTestFramework
 from test_framework.util import (
@@ -24,11 +24,13 @@ class ReindexTest(BitcoinTestFramework):
     def setup_network(self):
         self.nodes = start_nodes(self.num_nodes, self.options.tmpdir)
 
-    def reindex(self, justchainstate=False):
+    def reindex(self, justchainstate=False, reindexthreads=None):
         self.nodes[0].generate(3)
         blockcount = self.nodes[0].getblockcount()
         stop_nodes(self.nodes)
         extra_args = [["-debug", "-reindex-chainstate" if justchainstate else "-reindex", "-checkblockindex=1"]]
+        if reindexthreads is not None:
+            extra_args[0].append("-reindexthreads=%d" % reindexthreads)
         self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, extra_args)
         while self.nodes[0].getblockcount() < blockcount:
             time.sleep(0.1)
@@ -40,6 +42,8 @@ class ReindexTest(BitcoinTestFramework):
         self.reindex(True)
         self.reindex(False)
         self.reindex(True)
+        self.reindex(False, reindexthreads=0)
+        self.reindex(False, reindexthreads=1)
 
 if __name__ == '__main__':
     ReindexTest().main()
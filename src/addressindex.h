@@ -4,8 +4,12 @@
 #include "uint256.h"
 #include "amount.h"
 
+#include "primitives/transaction.h"
 #include "script/script.h"
 
+#include <string.h>
+#include <vector>
+
 struct CAddressUnspentKey {
     unsigned int type;
     uint160 hashBytes;
@@ -218,6 +222,135 @@ struct CAddressIndexIteratorHeightKey{
     }
 };
 
+/** Compact on-disk key of an address index delta. The address is replaced by its id and the txid by
+ * the position of the transaction, see CAddressTxPositionKey. Entries of an address sort like CAddressIndexKey. */
+struct CAddressDeltaDiskKey {
+    uint32_t addressId;
+    int blockHeight;
+    unsigned int txindex;
+    uint32_t index;
+    bool spending;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return 17;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata32be(s, addressId);
+        ser_writedata32be(s, blockHeight);
+        ser_writedata32be(s, txindex);
+        ser_writedata32be(s, index);
+        char f = spending;
+        ser_writedata8(s, f);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        addressId = ser_readdata32be(s);
+        blockHeight = ser_readdata32be(s);
+        txindex = ser_readdata32be(s);
+        index = ser_readdata32be(s);
+        char f = ser_readdata8(s);
+        spending = f;
+    }
+
+    CAddressDeltaDiskKey(uint32_t id, int height, unsigned int blockindex, uint32_t indexValue, bool isSpending) {
+        addressId = id;
+        blockHeight = height;
+        txindex = blockindex;
+        index = indexValue;
+        spending = isSpending;
+    }
+
+    CAddressDeltaDiskKey(uint32_t id, const CAddressIndexKey& key) {
+        addressId = id;
+        blockHeight = key.blockHeight;
+        txindex = key.txindex;
+        index = key.index;
+        spending = key.spending;
+    }
+
+    CAddressDeltaDiskKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        addressId = 0;
+        blockHeight = 0;
+        txindex = 0;
+        index = 0;
+        spending = false;
+    }
+};
+
+/** Position of a transaction in the active chain, the address index stores its txid once under this key */
+struct CAddressTxPositionKey {
+    int blockHeight;
+    unsigned int txindex;
+
+    size_t GetSerializeSize(int nType, int nVersion) const {
+        return 8;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ser_writedata32be(s, blockHeight);
+        ser_writedata32be(s, txindex);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        blockHeight = ser_readdata32be(s);
+        txindex = ser_readdata32be(s);
+    }
+
+    CAddressTxPositionKey(int height, unsigned int blockindex) {
+        blockHeight = height;
+        txindex = blockindex;
+    }
+
+    CAddressTxPositionKey() {
+        blockHeight = 0;
+        txindex = 0;
+    }
+
+    friend bool operator<(const CAddressTxPositionKey& a, const CAddressTxPositionKey& b) {
+        return a.blockHeight < b.blockHeight || (a.blockHeight == b.blockHeight && a.txindex < b.txindex);
+    }
+};
+
+struct CAddressBalanceValue {
+    CAmount balance;
+    CAmount received;
+    int64_t txCount;
+    int firstHeight;
+    int lastHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(balance);
+        READWRITE(received);
+        READWRITE(txCount);
+        READWRITE(firstHeight);
+        READWRITE(lastHeight);
+    }
+
+    CAddressBalanceValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        balance = 0;
+        received = 0;
+        txCount = 0;
+        firstHeight = 0;
+        lastHeight = 0;
+    }
+
+    bool IsNull() const {
+        return (txCount == 0);
+    }
+};
+
 struct CMempoolAddressDelta
 {
     int64_t time;
@@ -290,4 +423,56 @@ struct CMempoolAddressDeltaKeyCompare
     }
 };
 
+/** The address an index entry is filed under: type 1 for pay-to-pubkey-hash,
+ *  type 2 for pay-to-script-hash and type 0 for scripts that are not indexed. */
+struct CIndexAddress {
+    unsigned int type;
+    uint160 hashBytes;
+
+    CIndexAddress() : type(0) {}
+};
+
+inline CIndexAddress GetIndexAddress(const CScript& script)
+{
+    CIndexAddress address;
+    if (script.IsPayToScriptHash()) {
+        address.type = 2;
+        memcpy(address.hashBytes.begin(), &script[2], 20);
+    } else if (script.IsPayToPublicKeyHash()) {
+        address.type = 1;
+        memcpy(address.hashBytes.begin(), &script[3], 20);
+    }
+    return address;
+}
+
+/** Index addresses of every output in a block, classified in one pass ahead of
+ *  the index writers so each scriptPubKey is parsed only once. */
+class CBlockIndexAddresses
+{
+private:
+    std::vector<CIndexAddress> vAddresses;
+    std::vector<size_t> vOffsets;
+
+public:
+    explicit CBlockIndexAddresses(const std::vector<CTransactionRef>& vtx)
+    {
+        size_t nOutputs = 0;
+        vOffsets.reserve(vtx.size());
+        for (size_t i = 0; i < vtx.size(); i++) {
+            vOffsets.push_back(nOutputs);
+            nOutputs += vtx[i]->vout.size();
+        }
+        vAddresses.reserve(nOutputs);
+        for (size_t i = 0; i < vtx.size(); i++) {
+            for (size_t k = 0; k < vtx[i]->vout.size(); k++)
+                vAddresses.push_back(GetIndexAddress(vtx[i]->vout[k].scriptPubKey));
+        }
+    }
+
+    const CIndexAddress& Output(size_t nTx, size_t nOut) const
+    {
+        return vAddresses[vOffsets[nTx] + nOut];
+    }
+};
+
 #endif // BITCOIN_ADDRESSINDEX_H
\ No newline at end of file
@@ -139,20 +139,48 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
         CAddrInfo& infoDelete = mapInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
+        SetNew(nUBucket, nUBucketPos, -1);
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
         }
     }
 }
 
+/** Set position nPos of a table flattened to pTable, keeping its occupied positions listed in vOccupied and indexed in pOccupied */
+static void SetTablePosition(int* pTable, int* pOccupied, std::vector<int>& vOccupied, int nPos, int nId)
+{
+    bool fWasOccupied = pTable[nPos] != -1;
+    pTable[nPos] = nId;
+    if (nId != -1 && !fWasOccupied) {
+        pOccupied[nPos] = vOccupied.size();
+        vOccupied.push_back(nPos);
+    } else if (nId == -1 && fWasOccupied) {
+        // Move the last occupied position into the hole
+        int nIndex = pOccupied[nPos];
+        vOccupied[nIndex] = vOccupied.back();
+        pOccupied[vOccupied[nIndex]] = nIndex;
+        vOccupied.pop_back();
+        pOccupied[nPos] = -1;
+    }
+}
+
+void CAddrMan::SetTried(int nKBucket, int nKBucketPos, int nId)
+{
+    SetTablePosition(&vvTried[0][0], &vvTriedOccupied[0][0], vTriedOccupied, nKBucket * ADDRMAN_BUCKET_SIZE + nKBucketPos, nId);
+}
+
+void CAddrMan::SetNew(int nUBucket, int nUBucketPos, int nId)
+{
+    SetTablePosition(&vvNew[0][0], &vvNewOccupied[0][0], vNewOccupied, nUBucket * ADDRMAN_BUCKET_SIZE + nUBucketPos, nId);
+}
+
 void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 {
     // remove the entry from all new buckets
     for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
         int pos = info.GetBucketPosition(nKey, true, bucket);
         if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
+            SetNew(bucket, pos, -1);
             info.nRefCount--;
         }
     }
@@ -173,7 +201,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
-        vvTried[nKBucket][nKBucketPos] = -1;
+        SetTried(nKBucket, nKBucketPos, -1);
         nTried--;
 
         // find which new bucket it belongs to
@@ -184,12 +212,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Enter it into the new set again.
         infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        SetNew(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
-    vvTried[nKBucket][nKBucketPos] = nId;
+    SetTried(nKBucket, nKBucketPos, nId);
     nTried++;
     info.fInTried = true;
 }
@@ -304,7 +332,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            SetNew(nUBucket, nUBucketPos, nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -347,16 +375,11 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
     // Use a 50% chance for choosing between tried and new table entries.
     if (!newOnly &&
        (nTried > 0 && (nNew == 0 || RandomInt(2) == 0))) { 
-        // use a tried node
+        // use a tried node, drawn from the occupied positions rather than probing for one
         double fChanceFactor = 1.0;
         while (1) {
-            int nKBucket = RandomInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvTried[nKBucket][nKBucketPos] == -1) {
-                nKBucket = (nKBucket + insecure_rand()) % ADDRMAN_TRIED_BUCKET_COUNT;
-                nKBucketPos = (nKBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvTried[nKBucket][nKBucketPos];
+            int nPos = vTriedOccupied[RandomInt(vTriedOccupied.size())];
+            int nId = vvTried[nPos / ADDRMAN_BUCKET_SIZE][nPos % ADDRMAN_BUCKET_SIZE];
             assert(mapInfo.count(nId) == 1);
             CAddrInfo& info = mapInfo[nId];
             if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
@@ -364,16 +387,11 @@ CAddrInfo CAddrMan::Select_(bool newOnly)
             fChanceFactor *= 1.2;
         }
     } else {
-        // use a new node
+        // use a new node, drawn from the occupied positions rather than probing for one
         double fChanceFactor = 1.0;
         while (1) {
-            int nUBucket = RandomInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = RandomInt(ADDRMAN_BUCKET_SIZE);
-            while (vvNew[nUBucket][nUBucketPos] == -1) {
-                nUBucket = (nUBucket + insecure_rand()) % ADDRMAN_NEW_BUCKET_COUNT;
-                nUBucketPos = (nUBucketPos + insecure_rand()) % ADDRMAN_BUCKET_SIZE;
-            }
-            int nId = vvNew[nUBucket][nUBucketPos];
+            int nPos = vNewOccupied[RandomInt(vNewOccupied.size())];
+            int nId = vvNew[nPos / ADDRMAN_BUCKET_SIZE][nPos % ADDRMAN_BUCKET_SIZE];
             assert(mapInfo.count(nId) == 1);
             CAddrInfo& info = mapInfo[nId];
             if (RandomInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
@@ -428,6 +446,8 @@ int CAddrMan::Check_()
              if (vvTried[n][i] != -1) {
                  if (!setTried.count(vvTried[n][i]))
                      return -11;
+                 if (vvTriedOccupied[n][i] == -1)
+                     return -20;
                  if (mapInfo[vvTried[n][i]].GetTriedBucket(nKey) != n)
                      return -17;
                  if (mapInfo[vvTried[n][i]].GetBucketPosition(nKey, false, n) != i)
@@ -442,6 +462,8 @@ int CAddrMan::Check_()
             if (vvNew[n][i] != -1) {
                 if (!mapNew.count(vvNew[n][i]))
                     return -12;
+                if (vvNewOccupied[n][i] == -1)
+                    return -21;
                 if (mapInfo[vvNew[n][i]].GetBucketPosition(nKey, true, n) != i)
                     return -19;
                 if (--mapNew[vvNew[n][i]] == 0)
@@ -450,6 +472,17 @@ int CAddrMan::Check_()
         }
     }
 
+    for (unsigned int i = 0; i < vTriedOccupied.size(); i++) {
+        int nPos = vTriedOccupied[i];
+        if (vvTried[nPos / ADDRMAN_BUCKET_SIZE][nPos % ADDRMAN_BUCKET_SIZE] == -1 || vvTriedOccupied[nPos / ADDRMAN_BUCKET_SIZE][nPos % ADDRMAN_BUCKET_SIZE] != (int)i)
+            return -20;
+    }
+    for (unsigned int i = 0; i < vNewOccupied.size(); i++) {
+        int nPos = vNewOccupied[i];
+        if (vvNew[nPos / ADDRMAN_BUCKET_SIZE][nPos % ADDRMAN_BUCKET_SIZE] == -1 || vvNewOccupied[nPos / ADDRMAN_BUCKET_SIZE][nPos % ADDRMAN_BUCKET_SIZE] != (int)i)
+            return -21;
+    }
+
     if (setTried.size())
         return -13;
     if (mapNew.size())
@@ -204,6 +204,17 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! occupied positions of vvTried and vvNew, as bucket * ADDRMAN_BUCKET_SIZE + position, in no order
+    std::vector<int> vTriedOccupied;
+    std::vector<int> vNewOccupied;
+
+    //! index in vTriedOccupied or vNewOccupied of each occupied position, -1 for the others
+    int vvTriedOccupied[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+    int vvNewOccupied[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+
+    //! number of calls that may have changed the tables, to tell whether they need saving
+    uint64_t nChangeCount;
+
     //! last time Good was called (memory only)
     int64_t nLastGood;
 
@@ -230,6 +241,10 @@ protected:
     //! Clear a position in a "new" table. This is the only place where entries are actually deleted.
     void ClearNew(int nUBucket, int nUBucketPos);
 
+    //! Set a position of the "tried" or "new" table to nId, or to -1 to empty it, keeping the occupied positions indexed.
+    void SetTried(int nKBucket, int nKBucketPos, int nId);
+    void SetNew(int nUBucket, int nUBucketPos, int nId);
+
     //! Mark an entry "good", possibly moving it from "new" to "tried".
     void Good_(const CService &addr, int64_t nTime);
 
@@ -381,7 +396,7 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                    SetNew(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
@@ -401,7 +416,7 @@ public:
                 vRandom.push_back(nIdCount);
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
+                SetTried(nKBucket, nKBucketPos, nIdCount);
                 nIdCount++;
             } else {
                 nLost++;
@@ -421,7 +436,7 @@ public:
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNew(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -452,18 +467,25 @@ public:
 
     void Clear()
     {
+        LOCK(cs);
         std::vector<int>().swap(vRandom);
+        mapInfo.clear();
+        mapAddr.clear();
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvNew[bucket][entry] = -1;
+                vvNewOccupied[bucket][entry] = -1;
             }
         }
         for (size_t bucket = 0; bucket < ADDRMAN_TRIED_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvTried[bucket][entry] = -1;
+                vvTriedOccupied[bucket][entry] = -1;
             }
         }
+        std::vector<int>().swap(vTriedOccupied);
+        std::vector<int>().swap(vNewOccupied);
 
         nIdCount = 0;
         nTried = 0;
@@ -471,7 +493,7 @@ public:
         nLastGood = 1; //Initially at 1 so that "never" is strictly worse.
     }
 
-    CAddrMan()
+    CAddrMan() : nChangeCount(0)
     {
         Clear();
     }
@@ -487,6 +509,13 @@ public:
         return vRandom.size();
     }
 
+    //! Return a number that grows with each call that may have changed the tables.
+    uint64_t GetChangeCount() const
+    {
+        LOCK(cs);
+        return nChangeCount;
+    }
+
     //! Consistency check
     void Check()
     {
@@ -508,6 +537,7 @@ public:
             LOCK(cs);
             Check();
             fRet |= Add_(addr, source, nTimePenalty);
+            nChangeCount++;
             Check();
         }
         if (fRet)
@@ -524,6 +554,7 @@ public:
             Check();
             for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
                 nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+            nChangeCount++;
             Check();
         }
         if (nAdd)
@@ -538,6 +569,7 @@ public:
             LOCK(cs);
             Check();
             Good_(addr, nTime);
+            nChangeCount++;
             Check();
         }
     }
@@ -549,6 +581,7 @@ public:
             LOCK(cs);
             Check();
             Attempt_(addr, fCountFailure, nTime);
+            nChangeCount++;
             Check();
         }
     }
@@ -588,6 +621,7 @@ public:
             LOCK(cs);
             Check();
             Connected_(addr, nTime);
+            nChangeCount++;
             Check();
         }
     }
@@ -597,6 +631,7 @@ public:
         LOCK(cs);
         Check();
         SetServices_(addr, nServices);
+        nChangeCount++;
         Check();
     }
 
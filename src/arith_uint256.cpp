@@ -70,6 +70,8 @@ base_uint<BITS>& base_uint<BITS>::operator*=(const base_uint& b)
     base_uint<BITS> a = *this;
     *this = 0;
     for (int j = 0; j < WIDTH; j++) {
+        if (a.pn[j] == 0)
+            continue;
         uint64_t carry = 0;
         for (int i = 0; i + j < WIDTH; i++) {
             uint64_t n = carry + pn[i + j] + (uint64_t)a.pn[j] * b.pn[i];
@@ -80,29 +82,91 @@ base_uint<BITS>& base_uint<BITS>::operator*=(const base_uint& b)
     return *this;
 }
 
+/**
+ * Long division on 32 bit limbs, one limb of the quotient at a time (Knuth,
+ * TAOCP vol. 2, 4.3.1, algorithm D), rather than one bit at a time: dividing
+ * by a chain work or a target of around 2^224 takes a few steps instead of
+ * a shift and compare of the whole number for every bit of the quotient.
+ */
 template <unsigned int BITS>
 base_uint<BITS>& base_uint<BITS>::operator/=(const base_uint& b)
 {
-    base_uint<BITS> div = b;     // make a copy, so we can shift.
-    base_uint<BITS> num = *this; // make a copy, so we can subtract.
-    *this = 0;                   // the quotient.
-    int num_bits = num.bits();
-    int div_bits = div.bits();
-    if (div_bits == 0)
+    int n = WIDTH; // limbs of the divisor
+    while (n > 0 && b.pn[n - 1] == 0)
+        n--;
+    if (n == 0)
         throw uint_error("Division by zero");
-    if (div_bits > num_bits) // the result is certainly 0.
+    int m = WIDTH; // limbs of the dividend
+    while (m > 0 && pn[m - 1] == 0)
+        m--;
+    if (m < n) { // the result is certainly 0.
+        *this = 0;
         return *this;
-    int shift = num_bits - div_bits;
-    div <<= shift; // shift so that div and num align.
-    while (shift >= 0) {
-        if (num >= div) {
-            num -= div;
-            pn[shift / 32] |= (1 << (shift & 31)); // set a bit of the result.
+    }
+    if (n == 1) {
+        const uint64_t d = b.pn[0];
+        uint64_t rem = 0;
+        for (int i = m - 1; i >= 0; i--) {
+            uint64_t cur = (rem << 32) | pn[i];
+            pn[i] = cur / d;
+            rem = cur % d;
+        }
+        return *this;
+    }
+
+    // Shift both so the top limb of the divisor has its high bit set, which
+    // keeps the estimates of the quotient limbs off by at most 2.
+    int s = 0;
+    while ((b.pn[n - 1] << s & 0x80000000) == 0)
+        s++;
+    uint32_t vn[WIDTH];
+    uint32_t un[WIDTH + 1];
+    for (int i = n - 1; i > 0; i--)
+        vn[i] = b.pn[i] << s | (uint32_t)((uint64_t)b.pn[i - 1] >> (32 - s));
+    vn[0] = b.pn[0] << s;
+    un[m] = (uint32_t)((uint64_t)pn[m - 1] >> (32 - s));
+    for (int i = m - 1; i > 0; i--)
+        un[i] = pn[i] << s | (uint32_t)((uint64_t)pn[i - 1] >> (32 - s));
+    un[0] = pn[0] << s;
+
+    *this = 0; // the quotient.
+    for (int j = m - n; j >= 0; j--) {
+        // Estimate the quotient limb from the top two limbs of the remainder.
+        uint64_t num = (uint64_t)un[j + n] << 32 | un[j + n - 1];
+        uint64_t qhat = num / vn[n - 1];
+        uint64_t rhat = num % vn[n - 1];
+        while (qhat > 0xffffffff || qhat * vn[n - 2] > (rhat << 32 | un[j + n - 2])) {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat > 0xffffffff)
+                break;
+        }
+        // Subtract qhat times the divisor from the remainder.
+        uint64_t carry = 0;
+        uint64_t borrow = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t p = qhat * vn[i] + carry;
+            carry = p >> 32;
+            uint64_t sub = (uint64_t)un[i + j] - (p & 0xffffffff) - borrow;
+            un[i + j] = (uint32_t)sub;
+            borrow = sub >> 63;
+        }
+        uint64_t sub = (uint64_t)un[j + n] - carry - borrow;
+        un[j + n] = (uint32_t)sub;
+        if (sub >> 63) {
+            // qhat was one too large: add the divisor back.
+            qhat--;
+            carry = 0;
+            for (int i = 0; i < n; i++) {
+                uint64_t sum = (uint64_t)un[i + j] + vn[i] + carry;
+                un[i + j] = (uint32_t)sum;
+                carry = sum >> 32;
+            }
+            un[j + n] += carry;
         }
-        div >>= 1; // shift back.
-        shift--;
+        pn[j] = (uint32_t)qhat;
     }
-    // num now contains the remainder of the division.
+    // un now contains the remainder of the division, shifted left by s.
     return *this;
 }
 
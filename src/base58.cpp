@@ -17,6 +17,33 @@
 
 /** All alphanumeric characters except for "0", "I", "O", and "l" */
 static const char* pszBase58 = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+static const int8_t mapBase58[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1, 0, 1, 2, 3, 4, 5, 6,  7, 8,-1,-1,-1,-1,-1,-1,
+    -1, 9,10,11,12,13,14,15, 16,-1,17,18,19,20,21,-1,
+    22,23,24,25,26,27,28,29, 30,31,32,-1,-1,-1,-1,-1,
+    -1,33,34,35,36,37,38,39, 40,41,42,43,-1,44,45,46,
+    47,48,49,50,51,52,53,54, 55,56,57,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+/**
+ * The bignum conversions work on words rather than on single digits: base58 is
+ * handled five digits at a time, as words below 58^5, and base256 four bytes at
+ * a time, as 32 bit words, so every multiply-add of the quadratic loops moves
+ * several digits at once. Words are stored least significant first.
+ */
+static const int BASE58_WORD_DIGITS = 5;
+static const uint32_t BASE58_WORD = 58 * 58 * 58 * 58 * 58;
 
 bool DecodeBase58(const char* psz, std::vector<unsigned char>& vch)
 {
@@ -29,38 +56,47 @@ bool DecodeBase58(const char* psz, std::vector<unsigned char>& vch)
         zeroes++;
         psz++;
     }
-    // Allocate enough space in big-endian base256 representation.
-    std::vector<unsigned char> b256(strlen(psz) * 733 / 1000 + 1); // log(58) / log(256), rounded up.
-    // Process the characters.
-    while (*psz && !isspace(*psz)) {
-        // Decode base58 character
-        const char* ch = strchr(pszBase58, *psz);
-        if (ch == NULL)
-            return false;
-        // Apply "b256 = b256 * 58 + ch".
-        int carry = ch - pszBase58;
-        for (std::vector<unsigned char>::reverse_iterator it = b256.rbegin(); it != b256.rend(); it++) {
-            carry += 58 * (*it);
-            *it = carry % 256;
-            carry /= 256;
+    // The number in base 2^32, enough words for log(58) / log(256) bytes per character.
+    const char* pszEnd = psz;
+    while (*pszEnd && !isspace(*pszEnd))
+        pszEnd++;
+    std::vector<uint32_t> b32;
+    b32.reserve((pszEnd - psz) * 733 / 4000 + 1);
+    // Process the characters, up to BASE58_WORD_DIGITS at a time.
+    while (psz != pszEnd) {
+        uint64_t carry = 0;
+        uint64_t mul = 1;
+        for (int i = 0; i < BASE58_WORD_DIGITS && psz != pszEnd; i++, psz++) {
+            int digit = mapBase58[(uint8_t)*psz];
+            if (digit == -1)
+                return false;
+            carry = carry * 58 + digit;
+            mul *= 58;
         }
-        assert(carry == 0);
-        psz++;
+        // Apply "b32 = b32 * mul + carry".
+        for (std::vector<uint32_t>::iterator it = b32.begin(); it != b32.end(); it++) {
+            carry += mul * *it;
+            *it = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry != 0)
+            b32.push_back((uint32_t)carry);
     }
     // Skip trailing spaces.
     while (isspace(*psz))
         psz++;
     if (*psz != 0)
         return false;
-    // Skip leading zeroes in b256.
-    std::vector<unsigned char>::iterator it = b256.begin();
-    while (it != b256.end() && *it == 0)
-        it++;
-    // Copy result into output vector.
-    vch.reserve(zeroes + (b256.end() - it));
+    // Copy result into output vector, big-endian without leading zero bytes.
+    int shift = 24;
+    if (!b32.empty())
+        while ((b32.back() >> shift) == 0)
+            shift -= 8;
+    vch.reserve(zeroes + (b32.empty() ? 0 : b32.size() * 4 - 3 + shift / 8));
     vch.assign(zeroes, 0x00);
-    while (it != b256.end())
-        vch.push_back(*(it++));
+    for (std::vector<uint32_t>::reverse_iterator it = b32.rbegin(); it != b32.rend(); it++, shift = 24)
+        for (; shift >= 0; shift -= 8)
+            vch.push_back((unsigned char)(*it >> shift));
     return true;
 }
 
@@ -68,39 +104,47 @@ std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
 {
     // Skip & count leading zeroes.
     int zeroes = 0;
-    int length = 0;
     while (pbegin != pend && *pbegin == 0) {
         pbegin++;
         zeroes++;
     }
-    // Allocate enough space in big-endian base58 representation.
-    int size = (pend - pbegin) * 138 / 100 + 1; // log(256) / log(58), rounded up.
-    std::vector<unsigned char> b58(size);
-    // Process the bytes.
+    // The number in base 58^5, enough words for log(256) / log(58) digits per byte.
+    std::vector<uint32_t> b58;
+    b58.reserve((pend - pbegin) * 138 / 500 + 1);
+    // Process the bytes, up to four at a time.
     while (pbegin != pend) {
-        int carry = *pbegin;
-        int i = 0;
-        // Apply "b58 = b58 * 256 + ch".
-        for (std::vector<unsigned char>::reverse_iterator it = b58.rbegin(); (carry != 0 || i < length) && (it != b58.rend()); it++, i++) {
-            carry += 256 * (*it);
-            *it = carry % 58;
-            carry /= 58;
+        uint64_t carry = 0;
+        int bits = 0;
+        for (; bits < 32 && pbegin != pend; bits += 8)
+            carry = (carry << 8) | *pbegin++;
+        // Apply "b58 = b58 * 2^bits + carry".
+        for (std::vector<uint32_t>::iterator it = b58.begin(); it != b58.end(); it++) {
+            carry += (uint64_t)*it << bits;
+            *it = carry % BASE58_WORD;
+            carry /= BASE58_WORD;
+        }
+        while (carry != 0) {
+            b58.push_back(carry % BASE58_WORD);
+            carry /= BASE58_WORD;
         }
-
-        assert(carry == 0);
-        length = i;
-        pbegin++;
     }
-    // Skip leading zeroes in base58 result.
-    std::vector<unsigned char>::iterator it = b58.begin() + (size - length);
-    while (it != b58.end() && *it == 0)
-        it++;
-    // Translate the result into a string.
+    // Translate the result into a string, skipping leading zeroes of the base58 result.
     std::string str;
-    str.reserve(zeroes + (b58.end() - it));
+    str.reserve(zeroes + b58.size() * BASE58_WORD_DIGITS);
     str.assign(zeroes, '1');
-    while (it != b58.end())
-        str += pszBase58[*(it++)];
+    for (std::vector<uint32_t>::reverse_iterator it = b58.rbegin(); it != b58.rend(); it++) {
+        char digits[BASE58_WORD_DIGITS];
+        uint32_t word = *it;
+        for (int i = BASE58_WORD_DIGITS - 1; i >= 0; i--) {
+            digits[i] = pszBase58[word % 58];
+            word /= 58;
+        }
+        int skip = 0;
+        if (it == b58.rbegin())
+            while (digits[skip] == '1')
+                skip++;
+        str.append(digits + skip, BASE58_WORD_DIGITS - skip);
+    }
     return str;
 }
 
@@ -0,0 +1,216 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainstate.h"
+#include "addressindex.h"
+#include "arith_uint256.h"
+#include "base58.h"
+#include "main.h"
+#include "rpc/register.h"
+#include "rpc/server.h"
+#include "spentindex.h"
+#include "txdb.h"
+
+#include <univalue.h>
+
+/*
+ * Queries of the address and spent indexes on the regtest chainstate of
+ * GetBenchChainstate, filled once with the history of a hot address of
+ * HOT_DELTAS deltas and of a cold address of a single one. The reads go
+ * straight to the index database; the RPCs add the key parsing and the JSON
+ * formatting on top.
+ */
+static const int HOT_DELTAS = 1000000;
+/* Deltas per block of the hot address, and blocks per database batch */
+static const int DELTAS_PER_BLOCK = 100;
+static const int BLOCKS_PER_BATCH = 100;
+/* Unspent outputs of the hot address, and outputs with a spent index entry */
+static const int HOT_UNSPENT = 100000;
+static const int SPENT_OUTPUTS = 100000;
+/* Outputs looked up per iteration of the spent index benchmarks */
+static const int SPENT_LOOKUPS = 1000;
+
+class AddressIndexSetup
+{
+public:
+    uint160 hashHot;
+    uint160 hashCold;
+
+    AddressIndexSetup()
+    {
+        GetBenchChainstate();
+        fAddressIndex = true;
+        fSpentIndex = true;
+        RegisterAllCoreRPCCommands(tableRPC);
+        hashHot = uint160(std::vector<unsigned char>(20, 0x11));
+        hashCold = uint160(std::vector<unsigned char>(20, 0x22));
+
+        // Every other delta of the hot address spends the output received by the one before
+        int nHeight = 1;
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vDeltas;
+        for (int i = 0; i < HOT_DELTAS; i++) {
+            bool fSpending = i % 2 == 1;
+            uint256 txid = ArithToUint256(arith_uint256(i + 1));
+            vDeltas.push_back(std::make_pair(CAddressIndexKey(1, hashHot, nHeight, i % DELTAS_PER_BLOCK, txid, 0, fSpending), fSpending ? -100000 : 100000));
+            if (i % (DELTAS_PER_BLOCK * BLOCKS_PER_BATCH) == DELTAS_PER_BLOCK * BLOCKS_PER_BATCH - 1) {
+                // The balances are summed per batch, in height order
+                if (!paddressindexdb->WriteAddressIndex(vDeltas))
+                    throw std::runtime_error("WriteAddressIndex failed");
+                vDeltas.clear();
+            }
+            if (i % DELTAS_PER_BLOCK == DELTAS_PER_BLOCK - 1)
+                nHeight++;
+        }
+        vDeltas.push_back(std::make_pair(CAddressIndexKey(1, hashCold, nHeight, 0, ArithToUint256(arith_uint256(HOT_DELTAS + 1)), 0, false), 100000));
+        if (!paddressindexdb->WriteAddressIndex(vDeltas))
+            throw std::runtime_error("WriteAddressIndex failed");
+
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        CScript scriptHot = CScript() << OP_DUP << OP_HASH160 << ToByteVector(hashHot) << OP_EQUALVERIFY << OP_CHECKSIG;
+        for (int i = 0; i < HOT_UNSPENT; i++)
+            vUnspent.push_back(std::make_pair(CAddressUnspentKey(1, hashHot, ArithToUint256(arith_uint256(i + 1)), 0), CAddressUnspentValue(100000, scriptHot, 1 + i / DELTAS_PER_BLOCK)));
+        CScript scriptCold = CScript() << OP_DUP << OP_HASH160 << ToByteVector(hashCold) << OP_EQUALVERIFY << OP_CHECKSIG;
+        vUnspent.push_back(std::make_pair(CAddressUnspentKey(1, hashCold, ArithToUint256(arith_uint256(HOT_DELTAS + 1)), 0), CAddressUnspentValue(100000, scriptCold, nHeight)));
+        if (!paddressindexdb->UpdateAddressUnspentIndex(vUnspent))
+            throw std::runtime_error("UpdateAddressUnspentIndex failed");
+
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpent;
+        for (int i = 0; i < SPENT_OUTPUTS; i++)
+            vSpent.push_back(std::make_pair(CSpentIndexKey(ArithToUint256(arith_uint256(i + 1)), 0), CSpentIndexValue(ArithToUint256(arith_uint256(i + 2)), 0, 1 + i / DELTAS_PER_BLOCK, 100000, 1, hashHot)));
+        if (!pspentindexdb->UpdateSpentIndex(vSpent))
+            throw std::runtime_error("UpdateSpentIndex failed");
+    }
+
+    /* The argument of getaddressdeltas and getaddressutxos for one address */
+    UniValue AddressParams(const uint160& hash) const
+    {
+        UniValue addresses(UniValue::VARR);
+        addresses.push_back(CBitcoinAddress(CKeyID(hash)).ToString());
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("addresses", addresses));
+        UniValue params(UniValue::VARR);
+        params.push_back(obj);
+        return params;
+    }
+};
+
+static AddressIndexSetup& GetSetup()
+{
+    static AddressIndexSetup setup;
+    return setup;
+}
+
+static UniValue CallRPC(const std::string& strMethod, const UniValue& params)
+{
+    const CRPCCommand* pcmd = tableRPC[strMethod];
+    if (!pcmd)
+        throw std::runtime_error(strMethod + " not found");
+    return pcmd->actor(params, false);
+}
+
+static void AddressIndexReadHot(benchmark::State& state)
+{
+    const AddressIndexSetup& setup = GetSetup();
+    while (state.KeepRunning()) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vDeltas;
+        paddressindexdb->ReadAddressIndex(setup.hashHot, 1, vDeltas);
+    }
+}
+
+static void AddressIndexReadCold(benchmark::State& state)
+{
+    const AddressIndexSetup& setup = GetSetup();
+    while (state.KeepRunning()) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vDeltas;
+        paddressindexdb->ReadAddressIndex(setup.hashCold, 1, vDeltas);
+    }
+}
+
+static void AddressUnspentReadHot(benchmark::State& state)
+{
+    const AddressIndexSetup& setup = GetSetup();
+    while (state.KeepRunning()) {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        paddressindexdb->ReadAddressUnspentIndex(setup.hashHot, 1, vUnspent);
+    }
+}
+
+static void AddressUnspentReadCold(benchmark::State& state)
+{
+    const AddressIndexSetup& setup = GetSetup();
+    while (state.KeepRunning()) {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        paddressindexdb->ReadAddressUnspentIndex(setup.hashCold, 1, vUnspent);
+    }
+}
+
+// SPENT_LOOKUPS outputs spread over the index, one read each
+static void SpentIndexRead(benchmark::State& state)
+{
+    GetSetup();
+    while (state.KeepRunning()) {
+        for (int i = 0; i < SPENT_LOOKUPS; i++) {
+            CSpentIndexKey key(ArithToUint256(arith_uint256((uint64_t)i * (SPENT_OUTPUTS / SPENT_LOOKUPS) + 1)), 0);
+            CSpentIndexValue value;
+            pspentindexdb->ReadSpentIndex(key, value);
+        }
+    }
+}
+
+static void RPCGetAddressDeltasHot(benchmark::State& state)
+{
+    const UniValue params = GetSetup().AddressParams(GetSetup().hashHot);
+    while (state.KeepRunning())
+        CallRPC("getaddressdeltas", params);
+}
+
+static void RPCGetAddressDeltasCold(benchmark::State& state)
+{
+    const UniValue params = GetSetup().AddressParams(GetSetup().hashCold);
+    while (state.KeepRunning())
+        CallRPC("getaddressdeltas", params);
+}
+
+static void RPCGetAddressUtxosHot(benchmark::State& state)
+{
+    const UniValue params = GetSetup().AddressParams(GetSetup().hashHot);
+    while (state.KeepRunning())
+        CallRPC("getaddressutxos", params);
+}
+
+static void RPCGetAddressUtxosCold(benchmark::State& state)
+{
+    const UniValue params = GetSetup().AddressParams(GetSetup().hashCold);
+    while (state.KeepRunning())
+        CallRPC("getaddressutxos", params);
+}
+
+// The same outputs as SpentIndexRead, in one batched call
+static void RPCGetSpentInfo(benchmark::State& state)
+{
+    GetSetup();
+    UniValue keys(UniValue::VARR);
+    for (int i = 0; i < SPENT_LOOKUPS; i++) {
+        UniValue key(UniValue::VOBJ);
+        key.push_back(Pair("txid", ArithToUint256(arith_uint256((uint64_t)i * (SPENT_OUTPUTS / SPENT_LOOKUPS) + 1)).GetHex()));
+        key.push_back(Pair("index", 0));
+        keys.push_back(key);
+    }
+    UniValue params(UniValue::VARR);
+    params.push_back(keys);
+    while (state.KeepRunning())
+        CallRPC("getspentinfo", params);
+}
+
+BENCHMARK(AddressIndexReadHot);
+BENCHMARK(AddressIndexReadCold);
+BENCHMARK(AddressUnspentReadHot);
+BENCHMARK(AddressUnspentReadCold);
+BENCHMARK(SpentIndexRead);
+BENCHMARK(RPCGetAddressDeltasHot);
+BENCHMARK(RPCGetAddressDeltasCold);
+BENCHMARK(RPCGetAddressUtxosHot);
+BENCHMARK(RPCGetAddressUtxosCold);
+BENCHMARK(RPCGetSpentInfo);
@@ -6,6 +6,7 @@
 
 #include "main.h"
 #include "base58.h"
+#include "utilstrencodings.h"
 
 #include <vector>
 #include <string>
@@ -51,6 +52,43 @@ static void Base58Decode(benchmark::State& state)
 }
 
 
+static void Base58CheckDecode(benchmark::State& state)
+{
+    const char* addr = "17VZNX1SN5NtKa8UQFxwQbFeFc3iqRYhem";
+    std::vector<unsigned char> vch;
+    while (state.KeepRunning()) {
+        DecodeBase58Check(addr, vch);
+    }
+}
+
+
+// A raw transaction of 250 bytes, as getrawtransaction returns it
+static void HexStrEncode(benchmark::State& state)
+{
+    std::vector<unsigned char> vch(250);
+    for (size_t i = 0; i < vch.size(); i++)
+        vch[i] = i * 37;
+    while (state.KeepRunning()) {
+        HexStr(vch);
+    }
+}
+
+
+static void ParseHexDecode(benchmark::State& state)
+{
+    std::vector<unsigned char> vch(250);
+    for (size_t i = 0; i < vch.size(); i++)
+        vch[i] = i * 37;
+    const std::string str = HexStr(vch);
+    while (state.KeepRunning()) {
+        ParseHex(str);
+    }
+}
+
+
 BENCHMARK(Base58Encode);
 BENCHMARK(Base58CheckEncode);
 BENCHMARK(Base58Decode);
+BENCHMARK(Base58CheckDecode);
+BENCHMARK(HexStrEncode);
+BENCHMARK(ParseHexDecode);
@@ -4,12 +4,51 @@
 
 #include "bench.h"
 
+#include <univalue.h>
+
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
+#include <new>
+#include <regex>
+#include <stdlib.h>
 #include <sys/time.h>
 
 using namespace benchmark;
 
+// Count the allocations, to report them per iteration next to the times
+static std::atomic<uint64_t> nAllocations(0);
+
+void* operator new(size_t size)
+{
+    nAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+uint64_t benchmark::GetAllocationCount()
+{
+    return nAllocations.load(std::memory_order_relaxed);
+}
+
 std::map<std::string, BenchFunction> BenchRunner::benchmarks;
 
 static double gettimedouble(void) {
@@ -23,18 +62,97 @@ BenchRunner::BenchRunner(std::string name, BenchFunction func)
     benchmarks.insert(std::make_pair(name, func));
 }
 
-void
-BenchRunner::RunAll(double elapsedTimeForOne)
+std::vector<Result>
+BenchRunner::RunAll(double elapsedTimeForOne, const std::string& filter)
 {
-    std::cout << "#Benchmark" << "," << "count" << "," << "min" << "," << "max" << "," << "average" << "\n";
-
+    std::regex reFilter(filter);
+    std::vector<Result> results;
     for (std::map<std::string,BenchFunction>::iterator it = benchmarks.begin();
          it != benchmarks.end(); ++it) {
+        if (!std::regex_match(it->first, reFilter))
+            continue;
 
         State state(it->first, elapsedTimeForOne);
         BenchFunction& func = it->second;
         func(state);
+        results.push_back(state.GetResult());
     }
+    return results;
+}
+
+void benchmark::PrintCSV(const std::vector<Result>& results)
+{
+    std::cout << "#Benchmark" << "," << "count" << "," << "min" << "," << "max" << "," << "average" << "," << "stddev" << "," << "allocs" << "\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::cout << std::fixed << std::setprecision(15) << r.name << "," << r.count << "," << r.min << "," << r.max << "," << r.average << ","
+                  << r.stddev << "," << std::setprecision(1) << r.allocs << "\n";
+    }
+}
+
+UniValue benchmark::ResultsToJSON(const std::vector<Result>& results)
+{
+    UniValue benchmarks(UniValue::VARR);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", r.name));
+        obj.push_back(Pair("count", r.count));
+        obj.push_back(Pair("min", r.min));
+        obj.push_back(Pair("max", r.max));
+        obj.push_back(Pair("average", r.average));
+        obj.push_back(Pair("stddev", r.stddev));
+        obj.push_back(Pair("samples", r.samples));
+        obj.push_back(Pair("allocs", r.allocs));
+        benchmarks.push_back(obj);
+    }
+    UniValue report(UniValue::VOBJ);
+    report.push_back(Pair("benchmarks", benchmarks));
+    return report;
+}
+
+int benchmark::CompareResults(const std::vector<Result>& results, const UniValue& baseline, double threshold, std::ostream& out)
+{
+    // About the 99% quantile of the t distribution with the dozen or so samples a one second run takes
+    static const double T_CRITICAL = 3.0;
+
+    std::map<std::string, UniValue> mapBaseline;
+    const UniValue& benchmarks = find_value(baseline, "benchmarks");
+    for (size_t i = 0; i < benchmarks.size(); i++)
+        mapBaseline[find_value(benchmarks[i], "name").get_str()] = benchmarks[i];
+
+    int nRegressions = 0;
+    out << "#Benchmark" << "," << "baseline" << "," << "average" << "," << "change" << "," << "t" << "," << "verdict" << "\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        std::map<std::string, UniValue>::const_iterator it = mapBaseline.find(r.name);
+        if (it == mapBaseline.end())
+            continue;
+        double nBaseAverage = find_value(it->second, "average").get_real();
+        double nBaseStddev = find_value(it->second, "stddev").get_real();
+        int64_t nBaseSamples = find_value(it->second, "samples").get_int64();
+        if (nBaseAverage <= 0)
+            continue;
+
+        double nChange = r.average / nBaseAverage - 1;
+        double nVariance = 0;
+        if (r.samples > 1)
+            nVariance += r.stddev * r.stddev / r.samples;
+        if (nBaseSamples > 1)
+            nVariance += nBaseStddev * nBaseStddev / nBaseSamples;
+        // Without spread to go by, a change beyond the threshold is taken as significant
+        double t = nVariance > 0 ? (r.average - nBaseAverage) / std::sqrt(nVariance) : (nChange > 0 ? INFINITY : -INFINITY);
+        const char* pszVerdict = "same";
+        if (nChange > threshold && t > T_CRITICAL) {
+            pszVerdict = "REGRESSION";
+            nRegressions++;
+        } else if (nChange < -threshold && t < -T_CRITICAL) {
+            pszVerdict = "improvement";
+        }
+        out << std::fixed << std::setprecision(15) << r.name << "," << nBaseAverage << "," << r.average << ","
+                  << std::setprecision(1) << 100 * nChange << "%," << std::setprecision(2) << t << "," << pszVerdict << "\n";
+    }
+    return nRegressions;
 }
 
 bool State::KeepRunning()
@@ -46,6 +164,7 @@ bool State::KeepRunning()
     double now;
     if (count == 0) {
         lastTime = beginTime = now = gettimedouble();
+        beginAllocs = GetAllocationCount();
     }
     else {
         now = gettimedouble();
@@ -61,8 +180,10 @@ bool State::KeepRunning()
           count = 0;
           minTime = std::numeric_limits<double>::max();
           maxTime = std::numeric_limits<double>::min();
+          vSamples.clear();
           return true;
         }
+        vSamples.push_back(elapsedOne);
         if (elapsed*16 < maxElapsed) {
           uint64_t newCountMask = ((countMask<<1)|1) & ((1LL<<60)-1);
           if ((count & newCountMask)==0) {
@@ -78,9 +199,22 @@ bool State::KeepRunning()
 
     --count;
 
-    // Output results
-    double average = (now-beginTime)/count;
-    std::cout << std::fixed << std::setprecision(15) << name << "," << count << "," << minTime << "," << maxTime << "," << average << "\n";
+    result.name = name;
+    result.count = count;
+    result.min = minTime;
+    result.max = maxTime;
+    result.average = (now-beginTime)/count;
+    result.allocs = (double)(GetAllocationCount() - beginAllocs) / count;
+    result.samples = vSamples.size();
+    if (vSamples.size() > 1) {
+        double mean = 0, sumsq = 0;
+        for (size_t i = 0; i < vSamples.size(); i++)
+            mean += vSamples[i];
+        mean /= vSamples.size();
+        for (size_t i = 0; i < vSamples.size(); i++)
+            sumsq += (vSamples[i] - mean) * (vSamples[i] - mean);
+        result.stddev = std::sqrt(sumsq / (vSamples.size() - 1));
+    }
 
     return false;
 }
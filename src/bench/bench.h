@@ -5,8 +5,12 @@
 #ifndef BITCOIN_BENCH_BENCH_H
 #define BITCOIN_BENCH_BENCH_H
 
+#include <limits>
 #include <map>
+#include <ostream>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/preprocessor/cat.hpp>
@@ -34,8 +38,23 @@ BENCHMARK(CODE_TO_TIME);
 
  */
  
+class UniValue;
+
 namespace benchmark {
 
+    /** What one benchmark measured; times are in seconds per iteration */
+    struct Result {
+        std::string name;
+        int64_t count;
+        double min, max, average;
+        //! Standard deviation of the samples, each the average of a batch of iterations
+        double stddev;
+        int64_t samples;
+        double allocs;
+
+        Result() : count(0), min(0), max(0), average(0), stddev(0), samples(0), allocs(0) {}
+    };
+
     class State {
         std::string name;
         double maxElapsed;
@@ -43,16 +62,24 @@ namespace benchmark {
         double lastTime, minTime, maxTime, countMaskInv;
         int64_t count;
         int64_t countMask;
+        uint64_t beginAllocs;
+        std::vector<double> vSamples;
+        Result result;
     public:
-        State(std::string _name, double _maxElapsed) : name(_name), maxElapsed(_maxElapsed), count(0) {
+        State(std::string _name, double _maxElapsed) : name(_name), maxElapsed(_maxElapsed), count(0), beginAllocs(0) {
             minTime = std::numeric_limits<double>::max();
             maxTime = std::numeric_limits<double>::min();
             countMask = 1;
             countMaskInv = 1./(countMask + 1);
         }
         bool KeepRunning();
+        //! Set once KeepRunning returned false
+        const Result& GetResult() const { return result; }
     };
 
+    /** Heap allocations made through operator new since startup, by all threads */
+    uint64_t GetAllocationCount();
+
     typedef boost::function<void(State&)> BenchFunction;
 
     class BenchRunner
@@ -62,8 +89,20 @@ namespace benchmark {
     public:
         BenchRunner(std::string name, BenchFunction func);
 
-        static void RunAll(double elapsedTimeForOne=1.0);
+        /** Run the benchmarks whose name matches the regular expression filter, each for about elapsedTimeForOne seconds */
+        static std::vector<Result> RunAll(double elapsedTimeForOne=1.0, const std::string& filter=".*");
     };
+
+    void PrintCSV(const std::vector<Result>& results);
+    UniValue ResultsToJSON(const std::vector<Result>& results);
+
+    /**
+     * Compare results with a report ResultsToJSON made earlier. A benchmark
+     * regressed when its average is more than threshold (a fraction) above the
+     * baseline and Welch's t-test puts the difference beyond chance at 99%.
+     * Prints a line per benchmark found in both to out and returns the regressions.
+     */
+    int CompareResults(const std::vector<Result>& results, const UniValue& baseline, double threshold, std::ostream& out);
 }
 
 // BENCHMARK(foo) expands to:  benchmark::BenchRunner bench_11foo("foo", foo);
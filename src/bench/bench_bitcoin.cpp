@@ -4,18 +4,81 @@
 
 #include "bench.h"
 
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "util.h"
+#include "utilstrencodings.h"
+
+#include <univalue.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static const char* DEFAULT_BENCH_FILTER = ".*";
+static const char* DEFAULT_BENCH_PRINTER = "csv";
+static const int64_t DEFAULT_BENCH_THRESHOLD = 5;
 
 int
 main(int argc, char** argv)
 {
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("-h") || mapArgs.count("-help")) {
+        std::cout << "Usage: bench_einsteinium [options]\n\n"
+                  << HelpMessageOpt("-?", "Print this help message and exit")
+                  << HelpMessageOpt("-filter=<regex>", strprintf("Run only the benchmarks whose name matches <regex> (default: %s)", DEFAULT_BENCH_FILTER))
+                  << HelpMessageOpt("-mintime=<n>", "Run each benchmark for at least <n> seconds (default: 1)")
+                  << HelpMessageOpt("-printer=<csv|json>", strprintf("Print the results as CSV or as a JSON report for -compare (default: %s)", DEFAULT_BENCH_PRINTER))
+                  << HelpMessageOpt("-compare=<file>", "Compare the results with a JSON report of an earlier run, and exit with 1 if any benchmark regressed")
+                  << HelpMessageOpt("-threshold=<n>", strprintf("With -compare, the slowdown in percent below which a benchmark does not count as regressed (default: %d)", DEFAULT_BENCH_THRESHOLD));
+        return 0;
+    }
+
+    double nMinTime = 1.0;
+    if (mapArgs.count("-mintime") && !ParseDouble(mapArgs["-mintime"], &nMinTime)) {
+        std::cerr << "Invalid -mintime: " << mapArgs["-mintime"] << "\n";
+        return 1;
+    }
+    std::string strPrinter = GetArg("-printer", DEFAULT_BENCH_PRINTER);
+    if (strPrinter != "csv" && strPrinter != "json") {
+        std::cerr << "Unknown -printer: " << strPrinter << "\n";
+        return 1;
+    }
+    UniValue baseline;
+    if (mapArgs.count("-compare")) {
+        std::ifstream file(mapArgs["-compare"].c_str());
+        std::stringstream ss;
+        ss << file.rdbuf();
+        if (!file.is_open() || !baseline.read(ss.str()) || !baseline.isObject()) {
+            std::cerr << "Could not read the JSON report " << mapArgs["-compare"] << "\n";
+            return 1;
+        }
+    }
+
     ECC_Start();
     SetupEnvironment();
     fPrintToDebugLog = false; // don't want to write to debug.log file
 
-    benchmark::BenchRunner::RunAll();
+    // The hash benchmarks are only comparable between runs with the same transforms
+    if (strPrinter == "csv")
+        std::cout << "#SHA256 transforms: " << SHA256Implementation() << "\n";
+
+    std::vector<benchmark::Result> results = benchmark::BenchRunner::RunAll(nMinTime, GetArg("-filter", DEFAULT_BENCH_FILTER));
+    if (strPrinter == "json") {
+        UniValue report = benchmark::ResultsToJSON(results);
+        report.push_back(Pair("sha256", SHA256Implementation()));
+        std::cout << report.write(4) << "\n";
+    } else {
+        benchmark::PrintCSV(results);
+    }
+
+    // Keep the JSON report on stdout parseable
+    int nRegressions = 0;
+    if (!baseline.isNull())
+        nRegressions = benchmark::CompareResults(results, baseline, GetArg("-threshold", DEFAULT_BENCH_THRESHOLD) / 100.0,
+                                                 strPrinter == "json" ? std::cerr : std::cout);
 
     ECC_Stop();
+    return nRegressions ? 1 : 0;
 }
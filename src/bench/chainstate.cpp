@@ -0,0 +1,57 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainstate.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/filesystem.hpp>
+
+BenchChainstate::BenchChainstate()
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    InitSignatureCache();
+    InitScriptExecutionCache();
+    ClearDatadirCache();
+    pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_mil_%lu_%i", (unsigned long)GetTime(), (int)GetRand(100000));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    pblocktree = new CBlockTreeDB(1 << 20, true);
+    ptxindexdb = new CIndexDB("txindex", 1 << 20, true);
+    paddressindexdb = new CIndexDB("addressindex", 1 << 20, true);
+    pspentindexdb = new CIndexDB("spentindex", 1 << 20, true);
+    ptimestampindexdb = new CIndexDB("timestampindex", 1 << 20, true);
+    pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+    InitBlockIndex(Params());
+    // The regtest genesis block is old; without this the node would stay in initial block download and ignore transactions
+    nMaxTipAge = std::numeric_limits<int64_t>::max();
+    RegisterNodeSignals(GetNodeSignals());
+}
+
+BenchChainstate::~BenchChainstate()
+{
+    UnregisterNodeSignals(GetNodeSignals());
+    UnloadBlockIndex();
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    delete ptxindexdb;
+    delete paddressindexdb;
+    delete pspentindexdb;
+    delete ptimestampindexdb;
+    boost::filesystem::remove_all(pathTemp);
+}
+
+BenchChainstate& GetBenchChainstate()
+{
+    static BenchChainstate chainstate;
+    return chainstate;
+}
@@ -0,0 +1,31 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_CHAINSTATE_H
+#define BITCOIN_BENCH_CHAINSTATE_H
+
+#include <boost/filesystem/path.hpp>
+
+class CCoinsViewDB;
+
+/**
+ * A regtest node for the benchmarks that need one: the block tree, index and
+ * coins databases in memory, the genesis block in a temporary datadir and the
+ * node signals registered. Created by the first benchmark that calls
+ * GetBenchChainstate and torn down at exit.
+ */
+class BenchChainstate
+{
+private:
+    boost::filesystem::path pathTemp;
+    CCoinsViewDB* pcoinsdbview;
+
+public:
+    BenchChainstate();
+    ~BenchChainstate();
+};
+
+BenchChainstate& GetBenchChainstate();
+
+#endif // BITCOIN_BENCH_CHAINSTATE_H
@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "pow.h"
+
+#include <vector>
+
+/* Block indexes with targets around those of a mined chain, as the chain work
+ * pass of LoadBlockIndexDB sees them */
+static std::vector<CBlockIndex> MakeIndexes()
+{
+    std::vector<CBlockIndex> vIndex(1000);
+    for (size_t i = 0; i < vIndex.size(); i++)
+        vIndex[i].nBits = 0x1b0404cb + (uint32_t)(i * 7919);
+    return vIndex;
+}
+
+static void GetBlockProofs(benchmark::State& state)
+{
+    const std::vector<CBlockIndex> vIndex = MakeIndexes();
+    while (state.KeepRunning()) {
+        arith_uint256 nChainWork;
+        for (size_t i = 0; i < vIndex.size(); i++)
+            nChainWork += GetBlockProof(vIndex[i]);
+    }
+}
+
+// The work of a chain, scaled to a time as GetBlockProofEquivalentTime does
+static void ArithDivide(benchmark::State& state)
+{
+    arith_uint256 nChainWork = UintToArith256(uint256S("00000000000000000000000000000000000000000000000000c5a5f6d7b3e1f2"));
+    const arith_uint256 nProof = GetBlockProof(MakeIndexes()[0]);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++)
+            nChainWork += nChainWork * 150 / nProof;
+    }
+}
+
+static void ArithMultiply(benchmark::State& state)
+{
+    arith_uint256 a = UintToArith256(uint256S("7d1de5eaf9b156d53208f033b5aa8122d2d2355d5e12292b121156cfdb4a529c"));
+    const arith_uint256 b = UintToArith256(uint256S("00000000000000000000000000000000000000000000000000000002540be400"));
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++)
+            a *= b;
+    }
+}
+
+// The hashes of a run of headers, each checked against the target of its nBits
+static void CheckProofsOfWork(benchmark::State& state)
+{
+    const std::vector<CBlockIndex> vIndex = MakeIndexes();
+    const Consensus::Params& params = Params(CBaseChainParams::MAIN).GetConsensus();
+    const uint256 hash = uint256S("00000000000000000004a1b2c3d4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f6");
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vIndex.size(); i++)
+            CheckProofOfWork(hash, vIndex[i / 100].nBits, params);
+    }
+}
+
+BENCHMARK(GetBlockProofs);
+BENCHMARK(CheckProofsOfWork);
+BENCHMARK(ArithDivide);
+BENCHMARK(ArithMultiply);
@@ -0,0 +1,33 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "primitives/transaction.h"
+
+// A consolidation of many small outputs, the largest transactions a block holds
+static void CheckTransactionManyInputs(benchmark::State& state)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(2000);
+    for (size_t i = 0; i < mtx.vin.size(); i++) {
+        mtx.vin[i].prevout.hash = ArithToUint256(arith_uint256(i / 4 + 1));
+        mtx.vin[i].prevout.n = i % 4;
+        mtx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0) << std::vector<unsigned char>(33, 2);
+    }
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1;
+    const CTransaction tx(mtx);
+
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 100; i++) {
+            CValidationState stateCheck;
+            assert(CheckTransaction(tx, stateCheck));
+        }
+    }
+}
+
+BENCHMARK(CheckTransactionManyInputs);
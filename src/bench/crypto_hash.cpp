@@ -51,6 +51,14 @@ static void SHA256_32b(benchmark::State& state)
     }
 }
 
+static void SHA256D64_1024(benchmark::State& state)
+{
+    // A merkle tree level of 2048 transactions
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning())
+        SHA256D64(begin_ptr(in), begin_ptr(in), 1024);
+}
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -75,4 +83,5 @@ BENCHMARK(SHA256);
 BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
+BENCHMARK(SHA256D64_1024);
 BENCHMARK(SipHash_32b);
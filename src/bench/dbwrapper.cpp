@@ -0,0 +1,112 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <iostream>
+
+#include "bench.h"
+#include "dbwrapper.h"
+#include "random.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+// Records shaped like those of the address index: a key sorting the entries of an address
+// together, and a small value that repeats a lot
+static const int DB_BENCH_RECORDS = 100000;
+static const int DB_BENCH_BATCH = 1000;
+
+static std::pair<std::pair<char, int>, uint256> DBBenchKey(int n)
+{
+    uint256 txid;
+    txid.begin()[0] = n;
+    txid.begin()[1] = n >> 8;
+    txid.begin()[2] = n >> 16;
+    return std::make_pair(std::make_pair('d', n / 16), txid);
+}
+
+static std::pair<int64_t, int> DBBenchValue(int n)
+{
+    return std::make_pair((int64_t)(n % 7) * 100000000, n / 16);
+}
+
+static boost::filesystem::path DBBenchPath()
+{
+    return boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+}
+
+static void FillDB(CDBWrapper& db)
+{
+    for (int n = 0; n < DB_BENCH_RECORDS; n += DB_BENCH_BATCH) {
+        CDBBatch batch(db);
+        for (int i = n; i < n + DB_BENCH_BATCH; i++)
+            batch.Write(DBBenchKey(i), DBBenchValue(i));
+        db.WriteBatch(batch);
+    }
+}
+
+static uint64_t DirectorySize(const boost::filesystem::path& path)
+{
+    uint64_t nSize = 0;
+    for (boost::filesystem::directory_iterator it(path); it != boost::filesystem::directory_iterator(); ++it)
+        if (boost::filesystem::is_regular_file(it->status()))
+            nSize += boost::filesystem::file_size(it->path());
+    return nSize;
+}
+
+static void DBWrite(benchmark::State& state, const CDBOptions& options)
+{
+    boost::filesystem::path path = DBBenchPath();
+    {
+        CDBWrapper db(path, 8 << 20, false, true, false, options);
+        int n = 0;
+        while (state.KeepRunning()) {
+            CDBBatch batch(db);
+            for (int i = 0; i < DB_BENCH_BATCH; i++, n++)
+                batch.Write(DBBenchKey(n), DBBenchValue(n));
+            db.WriteBatch(batch);
+        }
+    }
+    boost::filesystem::remove_all(path);
+}
+
+static void DBRead(benchmark::State& state, const CDBOptions& options, const std::string& strName)
+{
+    boost::filesystem::path path = DBBenchPath();
+    {
+        // The block cache is kept small, so most reads go to the tables
+        CDBWrapper db(path, 1 << 20, false, true, false, options);
+        FillDB(db);
+        std::cout << strName << "-size," << DirectorySize(path) << "\n";
+        seed_insecure_rand(true);
+        std::pair<int64_t, int> value;
+        while (state.KeepRunning()) {
+            int n = insecure_rand() % DB_BENCH_RECORDS;
+            db.Read(DBBenchKey(n), value);
+        }
+    }
+    boost::filesystem::remove_all(path);
+}
+
+static CDBOptions DBBenchOptions(bool fCompression, size_t nBlockSize)
+{
+    CDBOptions options;
+    options.fCompression = fCompression;
+    options.nBlockSize = nBlockSize;
+    return options;
+}
+
+static void DBWriteUncompressed(benchmark::State& state) { DBWrite(state, DBBenchOptions(false, 4096)); }
+static void DBWriteCompressed(benchmark::State& state) { DBWrite(state, DBBenchOptions(true, 4096)); }
+static void DBWriteCompressed32K(benchmark::State& state) { DBWrite(state, DBBenchOptions(true, 32768)); }
+static void DBReadUncompressed(benchmark::State& state) { DBRead(state, DBBenchOptions(false, 4096), "DBReadUncompressed"); }
+static void DBReadCompressed(benchmark::State& state) { DBRead(state, DBBenchOptions(true, 4096), "DBReadCompressed"); }
+static void DBReadCompressed32K(benchmark::State& state) { DBRead(state, DBBenchOptions(true, 32768), "DBReadCompressed32K"); }
+
+BENCHMARK(DBWriteUncompressed);
+BENCHMARK(DBWriteCompressed);
+BENCHMARK(DBWriteCompressed32K);
+BENCHMARK(DBReadUncompressed);
+BENCHMARK(DBReadCompressed);
+BENCHMARK(DBReadCompressed32K);
@@ -0,0 +1,95 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "primitives/block.h"
+#include "crypto/ethash/ethashlib/ethash.h"
+#include "crypto/ethash/ethashlib/internal.h"
+
+#include <vector>
+
+/* A synthetic epoch: a 64 KiB cache and a 4 MiB dataset instead of the 16 MiB
+ * and 1 GiB of epoch 0, so a run takes seconds. Per-item costs do not depend
+ * on the sizes, only cache misses do. */
+static const uint64_t CACHE_SIZE = 1024 * sizeof(node);
+static const uint64_t FULL_SIZE = 65536 * sizeof(node);
+
+static ethash_light_t NewLight()
+{
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    return ethash_light_new_internal(CACHE_SIZE, &seed);
+}
+
+static void EthashLightNew(benchmark::State& state)
+{
+    while (state.KeepRunning())
+        ethash_light_delete(NewLight());
+}
+
+static void EthashDagItem(benchmark::State& state)
+{
+    ethash_light_t light = NewLight();
+    node item;
+    uint32_t nIndex = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++)
+            ethash_calculate_dag_item(&item, nIndex++, light);
+    }
+    ethash_light_delete(light);
+}
+
+static void EthashDagBuild(benchmark::State& state)
+{
+    ethash_light_t light = NewLight();
+    std::vector<node> vFull(FULL_SIZE / sizeof(node));
+    while (state.KeepRunning())
+        ethash_compute_full_data(&vFull[0], FULL_SIZE, light, NULL);
+    ethash_light_delete(light);
+}
+
+static void EthashLightCompute(benchmark::State& state)
+{
+    ethash_light_t light = NewLight();
+    ethash_h256_t header;
+    ethash_h256_reset(&header);
+    uint64_t nNonce = 0;
+    while (state.KeepRunning())
+        ethash_light_compute_internal(light, FULL_SIZE, header, nNonce++);
+    ethash_light_delete(light);
+}
+
+static void EthashFullCompute(benchmark::State& state)
+{
+    ethash_light_t light = NewLight();
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    ethash_full_t full = ethash_full_new_internal(NULL, seed, FULL_SIZE, light, NULL);
+    ethash_h256_t header;
+    ethash_h256_reset(&header);
+    uint64_t nNonce = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++)
+            ethash_full_compute(full, header, nNonce++);
+    }
+    ethash_full_delete(full);
+    ethash_light_delete(light);
+}
+
+// End to end through EthashAux, on the real epoch 0: the first iteration
+// builds its light cache, which the others reuse.
+static void GetPoWHash(benchmark::State& state)
+{
+    CBlockHeader header;
+    header.nHeight = 1;
+    while (state.KeepRunning())
+        header.GetPoWHash();
+}
+
+BENCHMARK(EthashLightNew);
+BENCHMARK(EthashDagItem);
+BENCHMARK(EthashDagBuild);
+BENCHMARK(EthashLightCompute);
+BENCHMARK(EthashFullCompute);
+BENCHMARK(GetPoWHash);
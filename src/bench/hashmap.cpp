@@ -0,0 +1,118 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "flathashmap.h"
+#include "hash.h"
+#include "hasher.h"
+#include "uint256.h"
+
+#include <assert.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
+/* About the number of transactions in the mempool, or of coins in a small cache */
+static const int MAP_SIZE = 100000;
+
+/* Hashes as the maps see them: uniform, like txids */
+static std::vector<uint256> MakeKeys(int nCount, uint32_t nSeed)
+{
+    std::vector<uint256> vKeys;
+    vKeys.reserve(nCount);
+    for (int i = 0; i < nCount; i++) {
+        uint32_t n[2] = {nSeed, (uint32_t)i};
+        vKeys.push_back(Hash(n, n + 2));
+    }
+    return vKeys;
+}
+
+/* All 32 bytes a byte at a time, as the Ethash caches hashed their seeds */
+struct HashRangeHasher
+{
+    size_t operator()(const uint256& hash) const { return boost::hash_range(hash.begin(), hash.end()); }
+};
+
+/* Half the lookups find their key, half do not */
+template <typename Map>
+static void RunLookups(benchmark::State& state, Map& map)
+{
+    std::vector<uint256> vKeys = MakeKeys(MAP_SIZE, 0);
+    std::vector<uint256> vMissing = MakeKeys(MAP_SIZE, 1);
+    for (int i = 0; i < MAP_SIZE; i++)
+        map[vKeys[i]] = i;
+    uint64_t nFound = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            nFound += map.count(vKeys[(i * 7919) % MAP_SIZE]);
+            nFound += map.count(vMissing[(i * 104729) % MAP_SIZE]);
+        }
+    }
+    assert(nFound > 0);
+}
+
+static void HashMapLookupBoostHashRange(benchmark::State& state)
+{
+    boost::unordered_map<uint256, int, HashRangeHasher> map;
+    RunLookups(state, map);
+}
+
+static void HashMapLookupBoostCheap(benchmark::State& state)
+{
+    boost::unordered_map<uint256, int, CheapUint256Hasher> map;
+    RunLookups(state, map);
+}
+
+static void HashMapLookupStdSalted(benchmark::State& state)
+{
+    std::unordered_map<uint256, int, SaltedUint256Hasher> map;
+    RunLookups(state, map);
+}
+
+static void HashMapLookupFlatSalted(benchmark::State& state)
+{
+    FlatHashMap<uint256, int, SaltedUint256Hasher> map;
+    RunLookups(state, map);
+}
+
+static void HashMapLookupFlatCheap(benchmark::State& state)
+{
+    FlatHashMap<uint256, int, CheapUint256Hasher> map;
+    RunLookups(state, map);
+}
+
+/* Filling a map and emptying it again, as the fee estimator does with every transaction */
+template <typename Map>
+static void RunInsertErase(benchmark::State& state)
+{
+    std::vector<uint256> vKeys = MakeKeys(10000, 0);
+    while (state.KeepRunning()) {
+        Map map;
+        for (size_t i = 0; i < vKeys.size(); i++)
+            map[vKeys[i]] = i;
+        for (size_t i = 0; i < vKeys.size(); i++)
+            map.erase(vKeys[i]);
+    }
+}
+
+static void HashMapInsertEraseStdSalted(benchmark::State& state)
+{
+    RunInsertErase<std::unordered_map<uint256, int, SaltedUint256Hasher> >(state);
+}
+
+static void HashMapInsertEraseFlatSalted(benchmark::State& state)
+{
+    RunInsertErase<FlatHashMap<uint256, int, SaltedUint256Hasher> >(state);
+}
+
+BENCHMARK(HashMapLookupBoostHashRange);
+BENCHMARK(HashMapLookupBoostCheap);
+BENCHMARK(HashMapLookupStdSalted);
+BENCHMARK(HashMapLookupFlatSalted);
+BENCHMARK(HashMapLookupFlatCheap);
+BENCHMARK(HashMapInsertEraseStdSalted);
+BENCHMARK(HashMapInsertEraseFlatSalted);
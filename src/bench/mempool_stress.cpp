@@ -0,0 +1,146 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "policy/policy.h"
+#include "txmempool.h"
+
+#include <list>
+#include <vector>
+
+/* Length of the ancestor chains; far past the default -limitancestorcount,
+ * as addUnchecked does not enforce it */
+static const int CHAIN_LENGTH = 200;
+/* Parents and children per parent of the fan-outs */
+static const int FANOUT_PARENTS = 50;
+static const int FANOUT_CHILDREN = 50;
+
+static CTransaction MakeTx(const uint256& hashPrev, int nPrevOuts, int nOuts)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(nPrevOuts);
+    for (int i = 0; i < nPrevOuts; i++) {
+        mtx.vin[i].prevout = COutPoint(hashPrev, i);
+        mtx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0);
+    }
+    mtx.vout.resize(nOuts);
+    for (int i = 0; i < nOuts; i++) {
+        mtx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+        mtx.vout[i].nValue = 1000;
+    }
+    return mtx;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx, CAmount nFee)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, 0, 0.0, 1, pool.HasNoInputsOf(tx), 0, false, 4, lp));
+}
+
+/* Chains of CHAIN_LENGTH transactions, each spending the one before */
+static std::vector<CTransaction> MakeChains(int nChains)
+{
+    std::vector<CTransaction> vtx;
+    for (int c = 0; c < nChains; c++) {
+        uint256 hashPrev = ArithToUint256(arith_uint256(c + 1));
+        for (int i = 0; i < CHAIN_LENGTH; i++) {
+            vtx.push_back(MakeTx(hashPrev, 1, 1));
+            hashPrev = vtx.back().GetHash();
+        }
+    }
+    return vtx;
+}
+
+/* FANOUT_PARENTS transactions with FANOUT_CHILDREN outputs, each spent by its own child */
+static std::vector<CTransaction> MakeFanOuts()
+{
+    std::vector<CTransaction> vtx;
+    for (int p = 0; p < FANOUT_PARENTS; p++) {
+        vtx.push_back(MakeTx(ArithToUint256(arith_uint256(p + 1)), 1, FANOUT_CHILDREN));
+        uint256 hashParent = vtx.back().GetHash();
+        for (int c = 0; c < FANOUT_CHILDREN; c++) {
+            CMutableTransaction child = MakeTx(hashParent, 1, 1);
+            child.vin[0].prevout.n = c;
+            vtx.push_back(child);
+        }
+    }
+    return vtx;
+}
+
+// addUnchecked, which walks the ancestors of every new transaction
+static void MempoolAddChain(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = MakeChains(1);
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(0));
+        for (size_t i = 0; i < vtx.size(); i++)
+            AddTx(pool, vtx[i], 1000);
+    }
+}
+
+static void MempoolAddFanOut(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = MakeFanOuts();
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(0));
+        for (size_t i = 0; i < vtx.size(); i++)
+            AddTx(pool, vtx[i], 1000 + i % 97);
+    }
+}
+
+// The ancestors of a transaction spending the end of a long chain
+static void MempoolCalculateAncestors(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = MakeChains(1);
+    CTxMemPool pool(CFeeRate(0));
+    for (size_t i = 0; i < vtx.size(); i++)
+        AddTx(pool, vtx[i], 1000);
+    CTransaction tx = MakeTx(vtx.back().GetHash(), 1, 1);
+    LockPoints lp;
+    CTxMemPoolEntry entry(tx, 1000, 0, 0.0, 1, false, 0, false, 4, lp);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 100; i++) {
+            CTxMemPool::setEntries setAncestors;
+            std::string strError;
+            pool.CalculateMemPoolAncestors(entry, setAncestors, CHAIN_LENGTH + 1, std::numeric_limits<uint64_t>::max(),
+                                           CHAIN_LENGTH + 1, std::numeric_limits<uint64_t>::max(), strError);
+        }
+    }
+}
+
+// Filling the pool with fan-outs and evicting half of it by descendant fee rate
+static void MempoolTrimToSize(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = MakeFanOuts();
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(0));
+        for (size_t i = 0; i < vtx.size(); i++)
+            AddTx(pool, vtx[i], 1000 + i % 97);
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+    }
+}
+
+// Filling the pool with chains and mining the first half of each
+static void MempoolRemoveForBlock(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = MakeChains(10);
+    std::vector<CTransactionRef> vtxBlock;
+    for (size_t i = 0; i < vtx.size(); i++)
+        if (i % CHAIN_LENGTH < CHAIN_LENGTH / 2)
+            vtxBlock.push_back(MakeTransactionRef(vtx[i]));
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(0));
+        for (size_t i = 0; i < vtx.size(); i++)
+            AddTx(pool, vtx[i], 1000);
+        std::list<CTransaction> conflicts;
+        pool.removeForBlock(vtxBlock, 2, conflicts);
+    }
+}
+
+BENCHMARK(MempoolAddChain);
+BENCHMARK(MempoolAddFanOut);
+BENCHMARK(MempoolCalculateAncestors);
+BENCHMARK(MempoolTrimToSize);
+BENCHMARK(MempoolRemoveForBlock);
@@ -0,0 +1,232 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainstate.h"
+#include "arith_uint256.h"
+#include "chainparams.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "pow.h"
+#include "random.h"
+#include "utiltime.h"
+#include "version.h"
+#include "versionbits.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * ProcessMessages and SendMessages on an inbound peer connected through a
+ * socket pair, on the regtest chainstate of GetBenchChainstate. Every iteration
+ * replays a batch of MESSAGES_PER_BATCH messages of one kind, so the time of a
+ * message is the average divided by MESSAGES_PER_BATCH; what the node sends
+ * back is read from the other end of the pair and dropped.
+ */
+static const int MESSAGES_PER_BATCH = 100;
+/* Headers per headers message, each of which has its proof of work checked */
+static const int HEADERS_PER_MESSAGE = 20;
+/* Headers messages take longer, so their batches are smaller */
+static const int HEADERS_MESSAGES_PER_BATCH = 10;
+
+/* A chain of headers with valid proofs of work on top of the genesis block */
+static std::vector<CBlockHeader> MineHeaders()
+{
+    std::vector<CBlockHeader> vHeaders;
+    CBlockHeader prev = Params().GenesisBlock().GetBlockHeader();
+    for (int nHeight = 1; nHeight <= HEADERS_PER_MESSAGE; nHeight++) {
+        CBlockHeader header;
+        header.nVersion = VERSIONBITS_TOP_BITS;
+        header.hashPrevBlock = prev.GetHash();
+        header.hashMerkleRoot = ArithToUint256(arith_uint256(nHeight));
+        header.nTime = prev.nTime + 1;
+        header.nBits = prev.nBits;
+        header.nHeight = nHeight;
+        uint256 seed = EthashAux::seedHash(nHeight);
+        for (header.nNonce = 0; ; header.nNonce++) {
+            EthashProofOfWork::Result result = EthashAux::eval(seed, header.hashPrevBlock, header.nNonce);
+            header.mixhash = result.mixHash;
+            if (CheckProofOfWork(result.value, header.nBits, Params().GetConsensus()))
+                break;
+        }
+        vHeaders.push_back(header);
+        prev = header;
+    }
+    return vHeaders;
+}
+
+/* Append a message as it comes off the wire */
+static void AppendMessage(std::vector<char>& vWire, const char* pszCommand, const CDataStream& payload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    hdr.nChecksum = ReadLE32(hash.begin());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    vWire.insert(vWire.end(), ss.begin(), ss.end());
+    vWire.insert(vWire.end(), payload.begin(), payload.end());
+}
+
+/* An inbound peer, past the version handshake */
+class BenchPeer
+{
+private:
+    int sv[2];
+
+public:
+    CNode* pnode;
+
+    BenchPeer()
+    {
+        GetBenchChainstate();
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            throw std::runtime_error("socketpair failed");
+        pnode = new CNode(sv[0], CAddress(CService("127.0.0.1", Params().GetDefaultPort()), NODE_NETWORK), "", true);
+
+        std::vector<char> vWire;
+        CDataStream version(SER_NETWORK, INIT_PROTO_VERSION);
+        CAddress addrMe(CService("127.0.0.2", Params().GetDefaultPort()), NODE_NONE);
+        CAddress addrYou(CService("127.0.0.1", Params().GetDefaultPort()), NODE_NETWORK);
+        version << PROTOCOL_VERSION << (uint64_t)NODE_NETWORK << GetTime() << addrMe << addrYou << GetRand(std::numeric_limits<uint64_t>::max())
+                << std::string("/bench/") << 0 << true;
+        AppendMessage(vWire, NetMsgType::VERSION, version);
+        Replay(vWire);
+        vWire.clear();
+        AppendMessage(vWire, NetMsgType::VERACK, CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+        Replay(vWire);
+    }
+
+    ~BenchPeer()
+    {
+        // Closes sv[0]
+        delete pnode;
+        close(sv[1]);
+    }
+
+    /* Hand the bytes to the node as its socket handler would, and process them as its message handler would */
+    void Replay(const std::vector<char>& vWire)
+    {
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            if (!pnode->ReceiveMsgBytes(&vWire[0], vWire.size()))
+                throw std::runtime_error("malformed message");
+        }
+        while (true) {
+            {
+                LOCK(pnode->cs_vRecvMsg);
+                if ((pnode->vRecvMsg.empty() && pnode->vRecvGetData.empty()) || pnode->fDisconnect)
+                    break;
+                ProcessMessages(pnode);
+            }
+            Flush();
+        }
+        Flush();
+    }
+
+    void Flush()
+    {
+        {
+            LOCK(pnode->cs_vSend);
+            SendMessages(pnode);
+            SocketSendData(pnode);
+        }
+        char buf[65536];
+        while (recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+    }
+};
+
+static void NetPing(benchmark::State& state)
+{
+    BenchPeer peer;
+    std::vector<char> vWire;
+    for (int i = 0; i < MESSAGES_PER_BATCH; i++) {
+        CDataStream ping(SER_NETWORK, PROTOCOL_VERSION);
+        ping << (uint64_t)(i + 1);
+        AppendMessage(vWire, NetMsgType::PING, ping);
+    }
+    while (state.KeepRunning())
+        peer.Replay(vWire);
+}
+
+// Announcements of transactions the node does not have, which it requests with getdata
+static void NetInvTx(benchmark::State& state)
+{
+    BenchPeer peer;
+    uint64_t nTx = 0;
+    while (state.KeepRunning()) {
+        std::vector<char> vWire;
+        for (int i = 0; i < MESSAGES_PER_BATCH; i++) {
+            std::vector<CInv> vInv;
+            for (int j = 0; j < 10; j++)
+                vInv.push_back(CInv(MSG_TX, ArithToUint256(arith_uint256(++nTx))));
+            CDataStream inv(SER_NETWORK, PROTOCOL_VERSION);
+            inv << vInv;
+            AppendMessage(vWire, NetMsgType::INV, inv);
+        }
+        peer.Replay(vWire);
+    }
+}
+
+// Transactions whose inputs the node does not know, which go through the mempool checks into the orphan pool
+static void NetTxOrphan(benchmark::State& state)
+{
+    BenchPeer peer;
+    uint64_t nTx = 0;
+    while (state.KeepRunning()) {
+        std::vector<char> vWire;
+        for (int i = 0; i < MESSAGES_PER_BATCH; i++) {
+            CMutableTransaction mtx;
+            mtx.vin.resize(1);
+            mtx.vin[0].prevout = COutPoint(ArithToUint256(arith_uint256(++nTx)), 0);
+            mtx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0) << std::vector<unsigned char>(33, 2);
+            mtx.vout.resize(1);
+            mtx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0) << OP_EQUALVERIFY << OP_CHECKSIG;
+            mtx.vout[0].nValue = 100000;
+            CDataStream tx(SER_NETWORK, PROTOCOL_VERSION);
+            tx << CTransaction(mtx);
+            AppendMessage(vWire, NetMsgType::TX, tx);
+        }
+        peer.Replay(vWire);
+    }
+}
+
+static void NetGetHeaders(benchmark::State& state)
+{
+    BenchPeer peer;
+    std::vector<char> vWire;
+    for (int i = 0; i < MESSAGES_PER_BATCH; i++) {
+        CDataStream getheaders(SER_NETWORK, PROTOCOL_VERSION);
+        getheaders << CBlockLocator(std::vector<uint256>(1, Params().GenesisBlock().GetHash())) << uint256();
+        AppendMessage(vWire, NetMsgType::GETHEADERS, getheaders);
+    }
+    while (state.KeepRunning())
+        peer.Replay(vWire);
+}
+
+// Headers the node already has after the first batch, as announced by each of its peers; their proofs of work are checked every time
+static void NetHeaders(benchmark::State& state)
+{
+    BenchPeer peer;
+    const std::vector<CBlockHeader> vHeaders = MineHeaders();
+    std::vector<char> vWire;
+    for (int i = 0; i < HEADERS_MESSAGES_PER_BATCH; i++) {
+        CDataStream headers(SER_NETWORK, PROTOCOL_VERSION);
+        WriteCompactSize(headers, vHeaders.size());
+        for (size_t j = 0; j < vHeaders.size(); j++) {
+            headers << vHeaders[j];
+            WriteCompactSize(headers, 0);
+        }
+        AppendMessage(vWire, NetMsgType::HEADERS, headers);
+    }
+    while (state.KeepRunning())
+        peer.Replay(vWire);
+}
+
+BENCHMARK(NetPing);
+BENCHMARK(NetInvTx);
+BENCHMARK(NetTxOrphan);
+BENCHMARK(NetGetHeaders);
+BENCHMARK(NetHeaders);
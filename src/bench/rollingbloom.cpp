@@ -5,12 +5,15 @@
 #include <iostream>
 
 #include "bench.h"
+#include "arith_uint256.h"
 #include "bloom.h"
+#include "uint256.h"
 #include "utiltime.h"
 
-static void RollingBloom(benchmark::State& state)
+template <typename RollingFilter>
+static void RunRollingBloom(benchmark::State& state, const char* pszName)
 {
-    CRollingBloomFilter filter(120000, 0.000001);
+    RollingFilter filter(120000, 0.000001);
     std::vector<unsigned char> data(32);
     uint32_t count = 0;
     uint32_t nEntriesPerGeneration = (120000 + 1) / 2;
@@ -26,7 +29,7 @@ static void RollingBloom(benchmark::State& state)
             int64_t b = GetTimeMicros();
             filter.insert(data);
             int64_t e = GetTimeMicros();
-            std::cout << "RollingBloom-refresh,1," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "\n";
+            std::cout << pszName << "-refresh,1," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "," << (e-b)*0.000001 << "\n";
             countnow = 0;
         } else {
             filter.insert(data);
@@ -40,4 +43,42 @@ static void RollingBloom(benchmark::State& state)
     }
 }
 
+static void RollingBloom(benchmark::State& state)
+{
+    RunRollingBloom<CRollingBloomFilter>(state, "RollingBloom");
+}
+
+static void RollingBlockedBloom(benchmark::State& state)
+{
+    RunRollingBloom<CRollingBlockedBloomFilter>(state, "RollingBlockedBloom");
+}
+
+// Lookups of inventory hashes, as for every inv a peer sends; most of them miss
+template <typename RollingFilter>
+static void RunRollingBloomLookup(benchmark::State& state)
+{
+    RollingFilter filter(50000, 0.000001);
+    for (uint32_t i = 0; i < 50000; i++)
+        filter.insert(ArithToUint256(arith_uint256(i)));
+    uint32_t count = 0;
+    uint64_t match = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++)
+            match += filter.contains(ArithToUint256(arith_uint256(count++)));
+    }
+}
+
+static void RollingBloomLookup(benchmark::State& state)
+{
+    RunRollingBloomLookup<CRollingBloomFilter>(state);
+}
+
+static void RollingBlockedBloomLookup(benchmark::State& state)
+{
+    RunRollingBloomLookup<CRollingBlockedBloomFilter>(state);
+}
+
 BENCHMARK(RollingBloom);
+BENCHMARK(RollingBlockedBloom);
+BENCHMARK(RollingBloomLookup);
+BENCHMARK(RollingBlockedBloomLookup);
@@ -0,0 +1,54 @@
+// Copyright (c) 2016 the Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "rpc/protocol.h"
+#include "tinyformat.h"
+
+#include <univalue.h>
+
+#include <string>
+
+// Shaped like a verbose getrawmempool reply
+static UniValue MakeMempoolReply(int nEntries)
+{
+    UniValue result(UniValue::VOBJ);
+    for (int i = 0; i < nEntries; i++) {
+        UniValue info(UniValue::VOBJ);
+        info.push_back(Pair("size", 225 + i % 100));
+        info.push_back(Pair("fee", 0.0001 * (i % 7 + 1)));
+        info.push_back(Pair("modifiedfee", 0.0001 * (i % 7 + 1)));
+        info.push_back(Pair("time", (int64_t)1480000000 + i));
+        info.push_back(Pair("height", 400000));
+        info.push_back(Pair("descendantcount", 1));
+        info.push_back(Pair("ancestorcount", 1));
+        UniValue depends(UniValue::VARR);
+        if (i > 0)
+            depends.push_back(strprintf("%064x", i - 1));
+        info.push_back(Pair("depends", depends));
+        result.push_back(Pair(strprintf("%064x", i), info));
+    }
+    return result;
+}
+
+static void RpcJsonEncode(benchmark::State& state)
+{
+    while (state.KeepRunning()) {
+        UniValue result = MakeMempoolReply(1000);
+        JSONRPCReply(result, NullUniValue, UniValue(1));
+    }
+}
+
+static void RpcJsonDecode(benchmark::State& state)
+{
+    std::string strReply = JSONRPCReply(MakeMempoolReply(1000), NullUniValue, UniValue(1));
+    while (state.KeepRunning()) {
+        UniValue reply;
+        reply.read(strReply);
+    }
+}
+
+BENCHMARK(RpcJsonEncode);
+BENCHMARK(RpcJsonDecode);
@@ -0,0 +1,124 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "chain.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "version.h"
+
+/* A transaction with two signed inputs and two pay-to-pubkey-hash outputs */
+static CMutableTransaction MakeTransaction(int n)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(2);
+    for (size_t i = 0; i < mtx.vin.size(); i++) {
+        mtx.vin[i].prevout = COutPoint(ArithToUint256(arith_uint256(n + 1)), i);
+        mtx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0) << std::vector<unsigned char>(33, 2);
+    }
+    mtx.vout.resize(2);
+    for (size_t i = 0; i < mtx.vout.size(); i++) {
+        mtx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, n) << OP_EQUALVERIFY << OP_CHECKSIG;
+        mtx.vout[i].nValue = 100000 * (n + 1);
+    }
+    return mtx;
+}
+
+/* A block of 2000 such transactions, about 750 kB */
+static CBlock MakeBlock()
+{
+    CBlock block;
+    for (int i = 0; i < 2000; i++)
+        block.vtx.push_back(MakeTransactionRef(MakeTransaction(i)));
+    return block;
+}
+
+static void SerializeBlock(benchmark::State& state)
+{
+    CBlock block = MakeBlock();
+    while (state.KeepRunning()) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+    }
+}
+
+static void DeserializeBlock(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << MakeBlock();
+    while (state.KeepRunning()) {
+        CDataStream ss(ssBlock);
+        CBlock block;
+        ss >> block;
+    }
+}
+
+static void HashBlockTransactions(benchmark::State& state)
+{
+    CBlock block = MakeBlock();
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < block.vtx.size(); i++)
+            SerializeHash(*block.vtx[i]);
+    }
+}
+
+static void RoundTripTransaction(benchmark::State& state)
+{
+    const CTransaction tx(MakeTransaction(0));
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << tx;
+            CTransaction txOut;
+            ss >> txOut;
+        }
+    }
+}
+
+// The outputs of a transaction as the coins database stores them, compressed by CTxOutCompressor
+static void RoundTripCoins(benchmark::State& state)
+{
+    CMutableTransaction mtx = MakeTransaction(0);
+    mtx.vout.resize(10, mtx.vout[0]);
+    const CCoins coins(mtx, 100000);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            ss << coins;
+            CCoins coinsOut;
+            ss >> coinsOut;
+        }
+    }
+}
+
+static void RoundTripDiskBlockIndex(benchmark::State& state)
+{
+    CBlockIndex index;
+    index.nHeight = 100000;
+    index.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+    index.nTx = 2000;
+    index.nFile = 10;
+    index.nDataPos = 100000000;
+    index.nUndoPos = 10000000;
+    const CDiskBlockIndex diskindex(&index);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            ss << diskindex;
+            CDiskBlockIndex diskindexOut;
+            ss >> diskindexOut;
+        }
+    }
+}
+
+BENCHMARK(SerializeBlock);
+BENCHMARK(DeserializeBlock);
+BENCHMARK(HashBlockTransactions);
+BENCHMARK(RoundTripTransaction);
+BENCHMARK(RoundTripCoins);
+BENCHMARK(RoundTripDiskBlockIndex);
@@ -0,0 +1,33 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "key.h"
+#include "pubkey.h"
+#include "uint256.h"
+
+#include <vector>
+
+// One signature verification per iteration on one core, so that the
+// verifications per second are 1 / the average time. Compare builds
+// configured with different --with-secp256k1-ecmult-window and
+// --enable-secp256k1-endomorphism settings.
+static void VerifyECDSA(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = Hash(pubkey.begin(), pubkey.end());
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+
+    while (state.KeepRunning()) {
+        pubkey.Verify(hash, vchSig);
+    }
+}
+
+BENCHMARK(VerifyECDSA);
@@ -0,0 +1,90 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "policy/policy.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+#include "script/standard.h"
+
+#include <vector>
+
+// Accepts every signature, so that only the interpreter itself is timed. The
+// cost of the signature checks is measured by VerifyECDSA.
+class AcceptingSignatureChecker : public BaseSignatureChecker
+{
+public:
+    bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+    {
+        return true;
+    }
+};
+
+static std::vector<unsigned char> SignInput(const CKey& key, const CScript& scriptCode, const CMutableTransaction& txSpend)
+{
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptCode, txSpend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    key.Sign(hash, vchSig);
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    return vchSig;
+}
+
+static CMutableTransaction BuildSpendingTransaction()
+{
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout.hash = uint256S("0x0100000000000000000000000000000000000000000000000000000000000000");
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 1;
+    return txSpend;
+}
+
+static void VerifyScriptP2PKH(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CScript scriptPubKey = GetScriptForDestination(pubkey.GetID());
+
+    CMutableTransaction txSpend = BuildSpendingTransaction();
+    CScript scriptSig = CScript() << SignInput(key, scriptPubKey, txSpend) << ToByteVector(pubkey);
+    AcceptingSignatureChecker checker;
+
+    while (state.KeepRunning()) {
+        ScriptError err;
+        bool success = VerifyScript(scriptSig, scriptPubKey, NULL, STANDARD_SCRIPT_VERIFY_FLAGS, checker, &err);
+        assert(success && err == SCRIPT_ERR_OK);
+    }
+}
+
+// A 2-of-3 multisig redeemed through P2SH
+static void VerifyScriptMultisig(benchmark::State& state)
+{
+    std::vector<CKey> keys(3);
+    std::vector<CPubKey> pubkeys;
+    for (unsigned int i = 0; i < keys.size(); i++) {
+        keys[i].MakeNewKey(true);
+        pubkeys.push_back(keys[i].GetPubKey());
+    }
+    CScript redeemScript = GetScriptForMultisig(2, pubkeys);
+    CScript scriptPubKey = GetScriptForDestination(CScriptID(redeemScript));
+
+    CMutableTransaction txSpend = BuildSpendingTransaction();
+    CScript scriptSig = CScript() << OP_0 << SignInput(keys[0], redeemScript, txSpend) << SignInput(keys[2], redeemScript, txSpend);
+    scriptSig << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end());
+    AcceptingSignatureChecker checker;
+
+    while (state.KeepRunning()) {
+        ScriptError err;
+        bool success = VerifyScript(scriptSig, scriptPubKey, NULL, STANDARD_SCRIPT_VERIFY_FLAGS, checker, &err);
+        assert(success && err == SCRIPT_ERR_OK);
+    }
+}
+
+BENCHMARK(VerifyScriptP2PKH);
+BENCHMARK(VerifyScriptMultisig);
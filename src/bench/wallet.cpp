@@ -0,0 +1,143 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainstate.h"
+#include "arith_uint256.h"
+#include "chainparams.h"
+#include "main.h"
+#include "rpc/server.h"
+#include "wallet/db.h"
+#include "wallet/rpcwallet.h"
+#include "wallet/wallet.h"
+
+#include <univalue.h>
+
+/*
+ * Wallet operations on a wallet in a mock database, on the regtest chainstate
+ * of GetBenchChainstate, holding WALLET_TXS confirmed transactions that each
+ * pay one output of a different amount to the same key of the wallet. The
+ * transactions are added as LoadWallet adds them, so filling the wallet does
+ * not write WALLET_TXS records.
+ */
+static const int WALLET_TXS = 100000;
+/* The amount sent by the coin selection and CreateTransaction benchmarks */
+static const CAmount SEND_AMOUNT = 50 * COIN;
+
+class WalletSetup
+{
+public:
+    CWallet* pwallet;
+    CScript scriptPubKey;
+
+    WalletSetup()
+    {
+        GetBenchChainstate();
+        bitdb.MakeMock();
+        bool fFirstRun;
+        pwallet = new CWallet("bench_wallet.dat");
+        pwallet->LoadWallet(fFirstRun);
+        pwalletMain = pwallet;
+        RegisterWalletRPCCommands(tableRPC);
+
+        LOCK2(cs_main, pwallet->cs_wallet);
+        scriptPubKey = GetScriptForDestination(pwallet->GenerateNewKey().GetID());
+        for (int i = 0; i < WALLET_TXS; i++) {
+            CMutableTransaction mtx;
+            mtx.vin.resize(1);
+            mtx.vin[0].prevout = COutPoint(ArithToUint256(arith_uint256(i + 1)), 0);
+            mtx.vout.resize(1);
+            mtx.vout[0].scriptPubKey = scriptPubKey;
+            mtx.vout[0].nValue = (1 + i % 100) * COIN / 100;
+            CWalletTx wtx(pwallet, mtx);
+            // Confirmed in the genesis block
+            wtx.hashBlock = Params().GenesisBlock().GetHash();
+            wtx.nIndex = 0;
+            wtx.nTimeReceived = GetTime();
+            wtx.nOrderPos = pwallet->nOrderPosNext++;
+            pwallet->AddToWallet(wtx, true, NULL);
+        }
+    }
+
+    ~WalletSetup()
+    {
+        pwalletMain = NULL;
+        delete pwallet;
+        bitdb.Flush(true);
+        bitdb.Reset();
+    }
+};
+
+static WalletSetup& GetSetup()
+{
+    static WalletSetup setup;
+    return setup;
+}
+
+static void WalletGetBalance(benchmark::State& state)
+{
+    CWallet* pwallet = GetSetup().pwallet;
+    while (state.KeepRunning())
+        pwallet->GetBalance();
+}
+
+static void WalletAvailableCoins(benchmark::State& state)
+{
+    CWallet* pwallet = GetSetup().pwallet;
+    while (state.KeepRunning()) {
+        std::vector<COutput> vCoins;
+        pwallet->AvailableCoins(vCoins);
+    }
+}
+
+static void WalletSelectCoinsMinConf(benchmark::State& state)
+{
+    CWallet* pwallet = GetSetup().pwallet;
+    std::vector<COutput> vCoins;
+    pwallet->AvailableCoins(vCoins);
+    LOCK(pwallet->cs_wallet);
+    while (state.KeepRunning()) {
+        std::set<std::pair<const CWalletTx*, unsigned int> > setCoins;
+        CAmount nValue;
+        if (!pwallet->SelectCoinsMinConf(SEND_AMOUNT, 1, 1, 0, vCoins, setCoins, nValue))
+            throw std::runtime_error("SelectCoinsMinConf failed");
+    }
+}
+
+// Built and signed, but neither committed nor broadcast
+static void WalletCreateTransaction(benchmark::State& state)
+{
+    WalletSetup& setup = GetSetup();
+    std::vector<CRecipient> vecSend;
+    CRecipient recipient = {CScript() << OP_TRUE, SEND_AMOUNT, false};
+    vecSend.push_back(recipient);
+    while (state.KeepRunning()) {
+        CWalletTx wtx;
+        CReserveKey reservekey(setup.pwallet);
+        CAmount nFee;
+        int nChangePos = -1;
+        std::string strError;
+        if (!setup.pwallet->CreateTransaction(vecSend, wtx, reservekey, nFee, nChangePos, strError))
+            throw std::runtime_error("CreateTransaction failed: " + strError);
+        reservekey.ReturnKey();
+    }
+}
+
+// listtransactions of the whole history
+static void WalletListTransactions(benchmark::State& state)
+{
+    GetSetup();
+    UniValue params(UniValue::VARR);
+    params.push_back("*");
+    params.push_back(WALLET_TXS);
+    const CRPCCommand* pcmd = tableRPC["listtransactions"];
+    while (state.KeepRunning())
+        pcmd->actor(params, false);
+}
+
+BENCHMARK(WalletGetBalance);
+BENCHMARK(WalletAvailableCoins);
+BENCHMARK(WalletSelectCoinsMinConf);
+BENCHMARK(WalletCreateTransaction);
+BENCHMARK(WalletListTransactions);
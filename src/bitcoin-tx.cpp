@@ -23,14 +23,26 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
 static bool fCreateBlank;
 static map<string,UniValue> registers;
 static const int CONTINUE_EXECUTION=-1;
+//! Set while the batch mode holds secp256k1 started for all of its transactions
+static bool fEccStarted = false;
+static const int DEFAULT_BATCH_THREADS = 1;
+static const int MAX_BATCH_THREADS = 64;
+//! Lines of a batch read ahead per worker thread, their results are written in input order
+static const size_t BATCH_LINES_PER_THREAD = 256;
 
 //
 // This function returns either one of EXIT_ codes when it's expected to stop the process or
@@ -60,12 +72,16 @@ static int AppInitRawTx(int argc, char* argv[])
             _("Usage:") + "\n" +
               "  mil-tx [options] <hex-tx> [commands]  " + _("Update hex-encoded MIL transaction") + "\n" +
               "  mil-tx [options] -create [commands]   " + _("Create hex-encoded MIL transaction") + "\n" +
+              "  mil-tx [options] -batch [commands]    " + _("Update or create a MIL transaction per line of standard input") + "\n" +
               "\n";
 
         fprintf(stdout, "%s", strUsage.c_str());
 
         strUsage = HelpMessageGroup(_("Options:"));
         strUsage += HelpMessageOpt("-?", _("This help message"));
+        strUsage += HelpMessageOpt("-batch", _("Read a hex-encoded TX and its commands per line of standard input, or with -create only commands, and write the result of each as a line of output; "
+            "the register commands given as arguments are run once and the other commands on every TX, before those of its line"));
+        strUsage += HelpMessageOpt("-batchthreads=<n>", strprintf(_("Set the number of threads the transactions of -batch are processed on (1 to %d, default: %d)"), MAX_BATCH_THREADS, DEFAULT_BATCH_THREADS));
         strUsage += HelpMessageOpt("-create", _("Create new, empty TX."));
         strUsage += HelpMessageOpt("-json", _("Select JSON output"));
         strUsage += HelpMessageOpt("-txid", _("Output only the hex-encoded transaction id of the resultant transaction."));
@@ -103,7 +119,7 @@ static int AppInitRawTx(int argc, char* argv[])
     return CONTINUE_EXECUTION;
 }
 
-static void RegisterSetJson(const string& key, const string& rawJson)
+static void RegisterSetJson(map<string,UniValue>& regs, const string& key, const string& rawJson)
 {
     UniValue val;
     if (!val.read(rawJson)) {
@@ -111,10 +127,10 @@ static void RegisterSetJson(const string& key, const string& rawJson)
         throw runtime_error(strErr);
     }
 
-    registers[key] = val;
+    regs[key] = val;
 }
 
-static void RegisterSet(const string& strInput)
+static void RegisterSet(map<string,UniValue>& regs, const string& strInput)
 {
     // separate NAME:VALUE in string
     size_t pos = strInput.find(':');
@@ -126,10 +142,10 @@ static void RegisterSet(const string& strInput)
     string key = strInput.substr(0, pos);
     string valStr = strInput.substr(pos + 1, string::npos);
 
-    RegisterSetJson(key, valStr);
+    RegisterSetJson(regs, key, valStr);
 }
 
-static void RegisterLoad(const string& strInput)
+static void RegisterLoad(map<string,UniValue>& regs, const string& strInput)
 {
     // separate NAME:FILENAME in string
     size_t pos = strInput.find(':');
@@ -167,7 +183,7 @@ static void RegisterLoad(const string& strInput)
     }
 
     // evaluate as JSON buffer register
-    RegisterSetJson(key, valStr);
+    RegisterSetJson(regs, key, valStr);
 }
 
 static void MutateTxVersion(CMutableTransaction& tx, const string& cmdVal)
@@ -384,7 +400,8 @@ static CAmount AmountFromValue(const UniValue& value)
     return amount;
 }
 
-static void MutateTxSign(CMutableTransaction& tx, const string& flagStr)
+// Only reads regs, so that the worker threads of a batch may share them
+static void MutateTxSign(CMutableTransaction& tx, const map<string,UniValue>& regs, const string& flagStr)
 {
     int nHashType = SIGHASH_ALL;
 
@@ -402,11 +419,12 @@ static void MutateTxSign(CMutableTransaction& tx, const string& flagStr)
     CCoinsView viewDummy;
     CCoinsViewCache view(&viewDummy);
 
-    if (!registers.count("privatekeys"))
+    map<string,UniValue>::const_iterator itKeys = regs.find("privatekeys");
+    if (itKeys == regs.end())
         throw runtime_error("privatekeys register variable must be set.");
     bool fGivenKeys = false;
     CBasicKeyStore tempKeystore;
-    UniValue keysObj = registers["privatekeys"];
+    const UniValue& keysObj = itKeys->second;
     fGivenKeys = true;
 
     for (unsigned int kidx = 0; kidx < keysObj.size(); kidx++) {
@@ -422,9 +440,10 @@ static void MutateTxSign(CMutableTransaction& tx, const string& flagStr)
     }
 
     // Add previous txouts given in the RPC call:
-    if (!registers.count("prevtxs"))
+    map<string,UniValue>::const_iterator itPrevtxs = regs.find("prevtxs");
+    if (itPrevtxs == regs.end())
         throw runtime_error("prevtxs register variable must be set.");
-    UniValue prevtxsObj = registers["prevtxs"];
+    const UniValue& prevtxsObj = itPrevtxs->second;
     {
         for (unsigned int previdx = 0; previdx < prevtxsObj.size(); previdx++) {
             UniValue prevOut = prevtxsObj[previdx];
@@ -523,7 +542,12 @@ public:
     }
 };
 
-static void MutateTx(CMutableTransaction& tx, const string& command,
+static bool IsRegisterCommand(const string& command)
+{
+    return command == "load" || command == "set";
+}
+
+static void MutateTx(CMutableTransaction& tx, map<string,UniValue>& regs, const string& command,
                      const string& commandVal)
 {
     boost::scoped_ptr<Secp256k1Init> ecc;
@@ -548,51 +572,52 @@ static void MutateTx(CMutableTransaction& tx, const string& command,
         MutateTxAddOutScript(tx, commandVal);
 
     else if (command == "sign") {
-        if (!ecc) { ecc.reset(new Secp256k1Init()); }
-        MutateTxSign(tx, commandVal);
+        if (!ecc && !fEccStarted) { ecc.reset(new Secp256k1Init()); }
+        MutateTxSign(tx, regs, commandVal);
     }
 
     else if (command == "load")
-        RegisterLoad(commandVal);
+        RegisterLoad(regs, commandVal);
 
     else if (command == "set")
-        RegisterSet(commandVal);
+        RegisterSet(regs, commandVal);
 
     else
         throw runtime_error("unknown command");
 }
 
-static void OutputTxJSON(const CTransaction& tx)
+// A batch writes its JSON on one line per transaction
+static string FormatTxJSON(const CTransaction& tx, bool fOneLine)
 {
     UniValue entry(UniValue::VOBJ);
     TxToUniv(tx, uint256(), entry);
 
-    string jsonOutput = entry.write(4);
-    fprintf(stdout, "%s\n", jsonOutput.c_str());
+    return entry.write(fOneLine ? 0 : 4);
 }
 
-static void OutputTxHash(const CTransaction& tx)
+static string FormatTxHash(const CTransaction& tx)
 {
-    string strHexHash = tx.GetHash().GetHex(); // the hex-encoded transaction hash (aka the transaction id)
-
-    fprintf(stdout, "%s\n", strHexHash.c_str());
+    return tx.GetHash().GetHex(); // the hex-encoded transaction hash (aka the transaction id)
 }
 
-static void OutputTxHex(const CTransaction& tx)
+static string FormatTxHex(const CTransaction& tx)
 {
-    string strHex = EncodeHexTx(tx);
-
-    fprintf(stdout, "%s\n", strHex.c_str());
+    return EncodeHexTx(tx);
 }
 
-static void OutputTx(const CTransaction& tx)
+static string FormatTx(const CTransaction& tx, bool fOneLine)
 {
     if (GetBoolArg("-json", false))
-        OutputTxJSON(tx);
+        return FormatTxJSON(tx, fOneLine);
     else if (GetBoolArg("-txid", false))
-        OutputTxHash(tx);
+        return FormatTxHash(tx);
     else
-        OutputTxHex(tx);
+        return FormatTxHex(tx);
+}
+
+static void OutputTx(const CTransaction& tx)
+{
+    fprintf(stdout, "%s\n", FormatTx(tx, false).c_str());
 }
 
 static string readStdin()
@@ -615,6 +640,139 @@ static string readStdin()
     return ret;
 }
 
+static void SplitCommand(const string& arg, string& key, string& value)
+{
+    size_t eqpos = arg.find('=');
+    if (eqpos == string::npos)
+        key = arg;
+    else {
+        key = arg.substr(0, eqpos);
+        value = arg.substr(eqpos + 1);
+    }
+}
+
+/** A line of a batch and what became of it */
+struct BatchLine
+{
+    string strLine;
+    string strResult;
+    bool fError;
+};
+
+static void ProcessBatchLine(BatchLine& line, const vector<pair<string, string> >& vCommands)
+{
+    line.fError = false;
+    try {
+        vector<string> vWords;
+        string strLine = boost::algorithm::trim_copy(line.strLine);
+        if (!strLine.empty())
+            boost::split(vWords, strLine, boost::is_any_of(" \t"), boost::token_compress_on);
+
+        CTransaction txDecodeTmp;
+        size_t nFirst = 0;
+        if (!fCreateBlank) {
+            if (vWords.empty())
+                throw runtime_error("too few parameters");
+            if (!DecodeHexTx(txDecodeTmp, vWords[0]))
+                throw runtime_error("invalid transaction encoding");
+            nFirst = 1;
+        }
+        CMutableTransaction tx(txDecodeTmp);
+
+        vector<pair<string, string> > vLineCommands;
+        bool fSetsRegisters = false;
+        for (size_t i = nFirst; i < vWords.size(); i++) {
+            vLineCommands.push_back(make_pair(string(), string()));
+            SplitCommand(vWords[i], vLineCommands.back().first, vLineCommands.back().second);
+            fSetsRegisters |= IsRegisterCommand(vLineCommands.back().first);
+        }
+
+        // The registers of the arguments are shared; a line that sets its own gets a copy
+        map<string,UniValue> lineRegisters;
+        if (fSetsRegisters)
+            lineRegisters = registers;
+        map<string,UniValue>& regs = fSetsRegisters ? lineRegisters : registers;
+
+        for (size_t i = 0; i < vCommands.size(); i++)
+            MutateTx(tx, regs, vCommands[i].first, vCommands[i].second);
+        for (size_t i = 0; i < vLineCommands.size(); i++)
+            MutateTx(tx, regs, vLineCommands[i].first, vLineCommands[i].second);
+
+        line.strResult = FormatTx(tx, true);
+    }
+    catch (const boost::thread_interrupted&) {
+        throw;
+    }
+    catch (const std::exception& e) {
+        line.strResult = string("error: ") + e.what();
+        line.fError = true;
+    }
+}
+
+static void ThreadBatch(vector<BatchLine>& vLines, std::atomic<size_t>& nNext, const vector<pair<string, string> >& vCommands)
+{
+    for (size_t i = nNext++; i < vLines.size(); i = nNext++)
+        ProcessBatchLine(vLines[i], vCommands);
+}
+
+/** -batch: a transaction per line of stdin, with secp256k1 and the registers of the arguments set up once */
+static int CommandLineBatchTx(int argc, char* argv[])
+{
+    int nThreads = std::max(1, std::min((int)GetArg("-batchthreads", DEFAULT_BATCH_THREADS), MAX_BATCH_THREADS));
+
+    // Register commands among the arguments run now, the others on every transaction
+    vector<pair<string, string> > vCommands;
+    for (int i = 1; i < argc; i++) {
+        string key, value;
+        SplitCommand(argv[i], key, value);
+        if (IsRegisterCommand(key)) {
+            CMutableTransaction txDummy;
+            MutateTx(txDummy, registers, key, value);
+        } else
+            vCommands.push_back(make_pair(key, value));
+    }
+
+    Secp256k1Init ecc;
+    fEccStarted = true;
+
+    int nRet = 0;
+    vector<BatchLine> vLines;
+    string strLine;
+    bool fEnd = false;
+    while (!fEnd) {
+        vLines.clear();
+        while (vLines.size() < BATCH_LINES_PER_THREAD * nThreads) {
+            if (!getline(cin, strLine)) {
+                fEnd = true;
+                break;
+            }
+            vLines.push_back(BatchLine());
+            vLines.back().strLine.swap(strLine);
+        }
+        if (cin.bad())
+            throw runtime_error("error reading stdin");
+
+        std::atomic<size_t> nNext(0);
+        if (nThreads > 1 && vLines.size() > 1) {
+            boost::thread_group threadGroup;
+            for (int i = 0; i < nThreads; i++)
+                threadGroup.create_thread(boost::bind(&ThreadBatch, boost::ref(vLines), boost::ref(nNext), boost::cref(vCommands)));
+            threadGroup.join_all();
+        } else
+            ThreadBatch(vLines, nNext, vCommands);
+
+        for (size_t i = 0; i < vLines.size(); i++) {
+            fprintf(stdout, "%s\n", vLines[i].strResult.c_str());
+            if (vLines[i].fError)
+                nRet = EXIT_FAILURE;
+        }
+        fflush(stdout);
+    }
+
+    fEccStarted = false;
+    return nRet;
+}
+
 static int CommandLineRawTx(int argc, char* argv[])
 {
     string strPrint;
@@ -627,6 +785,9 @@ static int CommandLineRawTx(int argc, char* argv[])
             argv++;
         }
 
+        if (GetBoolArg("-batch", false))
+            return CommandLineBatchTx(argc, argv);
+
         CTransaction txDecodeTmp;
         int startArg;
 
@@ -650,17 +811,10 @@ static int CommandLineRawTx(int argc, char* argv[])
         CMutableTransaction tx(txDecodeTmp);
 
         for (int i = startArg; i < argc; i++) {
-            string arg = argv[i];
             string key, value;
-            size_t eqpos = arg.find('=');
-            if (eqpos == string::npos)
-                key = arg;
-            else {
-                key = arg.substr(0, eqpos);
-                value = arg.substr(eqpos + 1);
-            }
+            SplitCommand(argv[i], key, value);
 
-            MutateTx(tx, key, value);
+            MutateTx(tx, registers, key, value);
         }
 
         OutputTx(tx);
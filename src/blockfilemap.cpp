@@ -0,0 +1,117 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "chain.h"
+#include "compressor.h"
+#include "consensus/consensus.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFileMapCache blockFileMaps;
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pdata, nSize);
+#endif
+}
+
+boost::shared_ptr<const CMappedBlockFile> CMappedBlockFile::Open(const boost::filesystem::path& path)
+{
+    boost::shared_ptr<const CMappedBlockFile> pmap;
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return pmap;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (pdata != MAP_FAILED) {
+            pmap.reset(new CMappedBlockFile((const char*)pdata, st.st_size));
+        } else {
+            LogPrintf("%s: cannot map %s\n", __func__, path.string());
+        }
+    }
+    // The mapping stays valid without the descriptor
+    close(fd);
+#endif
+    return pmap;
+}
+
+void CBlockFileMapCache::SetMaxFiles(size_t nMaxFilesIn)
+{
+    LOCK(cs);
+    nMaxFiles = nMaxFilesIn;
+    while (listMaps.size() > nMaxFiles)
+        listMaps.pop_back();
+}
+
+boost::shared_ptr<const CMappedBlockFile> CBlockFileMapCache::Get(int nFile, uint64_t nEnd)
+{
+    LOCK(cs);
+    boost::shared_ptr<const CMappedBlockFile> pmap;
+    if (nMaxFiles == 0)
+        return pmap;
+    for (std::list<std::pair<int, boost::shared_ptr<const CMappedBlockFile> > >::iterator it = listMaps.begin(); it != listMaps.end(); it++) {
+        if (it->first != nFile)
+            continue;
+        if (it->second->size() >= nEnd) {
+            listMaps.splice(listMaps.begin(), listMaps, it);
+            return it->second;
+        }
+        // The file grew since it was mapped, readers still holding the old mapping keep it
+        listMaps.erase(it);
+        break;
+    }
+    pmap = CMappedBlockFile::Open(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+    if (!pmap || pmap->size() < nEnd)
+        return boost::shared_ptr<const CMappedBlockFile>();
+    listMaps.push_front(std::make_pair(nFile, pmap));
+    while (listMaps.size() > nMaxFiles)
+        listMaps.pop_back();
+    return pmap;
+}
+
+bool CBlockFileMapCache::GetBlock(const CDiskBlockPos& pos, boost::shared_ptr<const CMappedBlockFile>& pmap, const char*& pbegin, unsigned int& nSize, bool& fCompressed)
+{
+    // The message start and the size come before the block
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+    pmap = Get(pos.nFile, pos.nPos);
+    if (!pmap)
+        return false;
+    nSize = ReadLE32((const unsigned char*)pmap->data() + pos.nPos - 4);
+    fCompressed = nSize & BLOCK_RECORD_COMPRESSED;
+    nSize &= ~BLOCK_RECORD_COMPRESSED;
+    if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+        return false;
+    if (pos.nPos + (uint64_t)nSize > pmap->size()) {
+        pmap = Get(pos.nFile, pos.nPos + (uint64_t)nSize);
+        if (!pmap)
+            return false;
+    }
+    pbegin = pmap->data() + pos.nPos;
+    return true;
+}
+
+void CBlockFileMapCache::Remove(int nFile)
+{
+    LOCK(cs);
+    for (std::list<std::pair<int, boost::shared_ptr<const CMappedBlockFile> > >::iterator it = listMaps.begin(); it != listMaps.end(); it++) {
+        if (it->first == nFile) {
+            listMaps.erase(it);
+            return;
+        }
+    }
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <list>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+
+/** -blockmapfiles default: block files kept mapped for reading, none where address space is short */
+static const int DEFAULT_BLOCK_MAP_FILES = sizeof(void*) >= 8 ? 8 : 0;
+/** Maximum of -blockmapfiles */
+static const int MAX_BLOCK_MAP_FILES = 64;
+
+/** A file mapped read-only into memory, unmapped with the last reference to it */
+class CMappedBlockFile
+{
+private:
+    const char* pdata;
+    size_t nSize;
+
+    CMappedBlockFile(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+public:
+    ~CMappedBlockFile();
+
+    /** Map the file at path as it is now, NULL if it cannot be mapped */
+    static boost::shared_ptr<const CMappedBlockFile> Open(const boost::filesystem::path& path);
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * The most recently read block files, mapped into memory. A block is read from a mapping
+ * without a system call or a copy through a FILE buffer, and its bytes can be used as
+ * they are. A mapping covers its file as it was when it was made; a read past its end, of
+ * a block appended since, maps the file again.
+ */
+class CBlockFileMapCache
+{
+private:
+    mutable CCriticalSection cs;
+    size_t nMaxFiles;
+    //! Most recently used first
+    std::list<std::pair<int, boost::shared_ptr<const CMappedBlockFile> > > listMaps;
+
+    boost::shared_ptr<const CMappedBlockFile> Get(int nFile, uint64_t nEnd);
+
+public:
+    CBlockFileMapCache() : nMaxFiles(DEFAULT_BLOCK_MAP_FILES) {}
+
+    /** Keep at most nMaxFilesIn files mapped, 0 turns mapping off */
+    void SetMaxFiles(size_t nMaxFilesIn);
+
+    /**
+     * The serialized block at pos, as WriteBlockToDisk stored it after its size, and whether
+     * it is stored with CBlockCompressor. pmap keeps the mapping alive while pbegin is used.
+     * False if mapping is off or the block is not in a file that can be mapped; the caller
+     * reads it from the file then.
+     */
+    bool GetBlock(const CDiskBlockPos& pos, boost::shared_ptr<const CMappedBlockFile>& pmap, const char*& pbegin, unsigned int& nSize, bool& fCompressed);
+
+    /** Drop the mapping of a block file, before it is deleted */
+    void Remove(int nFile);
+};
+
+/** The serialized bytes of a block, still in a mapped block file or copied out of the file */
+struct CRawBlock
+{
+    //! Keeps the mapping pbegin points into alive, NULL if the block was copied
+    boost::shared_ptr<const CMappedBlockFile> pmap;
+    std::vector<char> vchData;
+    const char* pbegin;
+    unsigned int nSize;
+
+    CRawBlock() : pbegin(NULL), nSize(0) {}
+};
+
+/** The mappings of the blk?????.dat files */
+extern CBlockFileMapCache blockFileMaps;
+
+#endif // BITCOIN_BLOCKFILEMAP_H
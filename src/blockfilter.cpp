@@ -0,0 +1,360 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "undo.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+/** Appends what is serialized to it to a byte vector */
+class CVectorAppender
+{
+private:
+    std::vector<unsigned char>& vData;
+
+public:
+    explicit CVectorAppender(std::vector<unsigned char>& vDataIn) : vData(vDataIn) {}
+
+    void write(const char* pch, size_t nSize)
+    {
+        vData.insert(vData.end(), (const unsigned char*)pch, (const unsigned char*)pch + nSize);
+    }
+};
+
+/** Writes bits to a byte vector, most significant bit first */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vData;
+    uint8_t nBuffer;
+    int nBits; //!< bits in nBuffer, less than 8
+
+public:
+    explicit CBitWriter(std::vector<unsigned char>& vDataIn) : vData(vDataIn), nBuffer(0), nBits(0) {}
+
+    /** Write the nCount low bits of nValue, nCount at most 64 */
+    void Write(uint64_t nValue, int nCount)
+    {
+        while (nCount > 0) {
+            int nTake = std::min(8 - nBits, nCount);
+            uint8_t nChunk = (nValue >> (nCount - nTake)) & ((1 << nTake) - 1);
+            nBuffer |= nChunk << (8 - nBits - nTake);
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8) {
+                vData.push_back(nBuffer);
+                nBuffer = 0;
+                nBits = 0;
+            }
+        }
+    }
+
+    /** Write the last partial byte, padded with zeros */
+    void Flush()
+    {
+        if (nBits > 0)
+            vData.push_back(nBuffer);
+        nBuffer = 0;
+        nBits = 0;
+    }
+};
+
+/** Reads bits from a byte range, most significant bit first */
+class CBitReader
+{
+private:
+    const unsigned char* pcur;
+    const unsigned char* pend;
+    uint8_t nBuffer;
+    int nBits; //!< bits left in nBuffer
+
+    void Fill()
+    {
+        if (pcur == pend)
+            throw std::ios_base::failure("CBitReader: end of data");
+        nBuffer = *pcur++;
+        nBits = 8;
+    }
+
+public:
+    CBitReader(const unsigned char* pbegin, const unsigned char* pendIn) : pcur(pbegin), pend(pendIn), nBuffer(0), nBits(0) {}
+
+    /** Read nCount bits, at most 64 */
+    uint64_t Read(int nCount)
+    {
+        uint64_t nValue = 0;
+        while (nCount > 0) {
+            if (nBits == 0)
+                Fill();
+            int nTake = std::min(nBits, nCount);
+            nValue = (nValue << nTake) | ((nBuffer >> (nBits - nTake)) & ((1 << nTake) - 1));
+            nBits -= nTake;
+            nCount -= nTake;
+        }
+        return nValue;
+    }
+
+    /** Count the 1 bits up to the next 0 bit, and skip past it */
+    uint64_t ReadUnary()
+    {
+        uint64_t nCount = 0;
+        while (true) {
+            if (nBits == 0)
+                Fill();
+            // The bits left in the buffer, shifted to the top of a byte
+            uint8_t nTop = nBuffer << (8 - nBits);
+            int nOnes = 0;
+            while (nOnes < nBits && (nTop & 0x80)) {
+                nTop <<= 1;
+                nOnes++;
+            }
+            nCount += nOnes;
+            nBits -= nOnes;
+            if (nBits > 0) {
+                nBits--;
+                return nCount;
+            }
+        }
+    }
+
+    /** Whether all bytes were read; the padding of the last one is not checked */
+    bool AtEnd() const { return pcur == pend; }
+};
+
+void GolombRiceEncode(CBitWriter& writer, uint8_t nP, uint64_t nValue)
+{
+    // The quotient in unary, as that many 1 bits and a 0
+    uint64_t nQuotient = nValue >> nP;
+    while (nQuotient > 0) {
+        int nCount = std::min<uint64_t>(nQuotient, 64);
+        writer.Write(~(uint64_t)0, nCount);
+        nQuotient -= nCount;
+    }
+    writer.Write(0, 1);
+    writer.Write(nValue, nP);
+}
+
+uint64_t GolombRiceDecode(CBitReader& reader, uint8_t nP)
+{
+    uint64_t nQuotient = reader.ReadUnary();
+    return (nQuotient << nP) | reader.Read(nP);
+}
+
+/** The high 64 bits of x * n, which maps x uniformly into [0, n) */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)x * n) >> 64);
+#else
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+
+} // anon namespace
+
+GCSFilter::GCSFilter(const Params& paramsIn) : params(paramsIn), nN(0), nF(0)
+{
+    CVectorAppender appender(vEncoded);
+    WriteCompactSize(appender, 0);
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, const std::vector<unsigned char>& vEncodedIn) : params(paramsIn), vEncoded(vEncodedIn)
+{
+    CSpanReader reader((const char*)vEncoded.data(), (const char*)vEncoded.data() + vEncoded.size(), SER_NETWORK, 0);
+    uint64_t nCount = ReadCompactSize(reader);
+    if (nCount > std::numeric_limits<uint32_t>::max())
+        throw std::ios_base::failure("N must be below 2^32");
+    nN = nCount;
+    nF = (uint64_t)nN * params.nM;
+
+    // Decode all the values, so that a filter with too much or too little data is rejected here
+    CBitReader bits(vEncoded.data() + vEncoded.size() - reader.size(), vEncoded.data() + vEncoded.size());
+    for (uint32_t i = 0; i < nN; i++)
+        GolombRiceDecode(bits, params.nP);
+    if (!bits.AtEnd())
+        throw std::ios_base::failure("encoded filter has more data than its elements");
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, const ElementSet& elements) : params(paramsIn)
+{
+    if (elements.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("N must be below 2^32");
+    nN = elements.size();
+    nF = (uint64_t)nN * params.nM;
+
+    CVectorAppender appender(vEncoded);
+    WriteCompactSize(appender, nN);
+    if (elements.empty())
+        return;
+
+    std::vector<uint64_t> vHashes;
+    vHashes.reserve(elements.size());
+    for (const Element& element : elements)
+        vHashes.push_back(HashToRange(element));
+    std::sort(vHashes.begin(), vHashes.end());
+
+    CBitWriter writer(vEncoded);
+    uint64_t nLast = 0;
+    for (uint64_t nHash : vHashes) {
+        GolombRiceEncode(writer, params.nP, nHash - nLast);
+        nLast = nHash;
+    }
+    writer.Flush();
+}
+
+uint64_t GCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t nHash = CSipHasher(params.nSipHashK0, params.nSipHashK1).Write(element.data(), element.size()).Finalize();
+    return MapIntoRange(nHash, nF);
+}
+
+bool GCSFilter::MatchInternal(const std::vector<uint64_t>& vQuery) const
+{
+    CSpanReader reader((const char*)vEncoded.data(), (const char*)vEncoded.data() + vEncoded.size(), SER_NETWORK, 0);
+    ReadCompactSize(reader);
+    CBitReader bits(vEncoded.data() + vEncoded.size() - reader.size(), vEncoded.data() + vEncoded.size());
+
+    // Both are sorted, so a merge finds any value they have in common
+    uint64_t nValue = 0;
+    size_t nQuery = 0;
+    for (uint32_t i = 0; i < nN; i++) {
+        nValue += GolombRiceDecode(bits, params.nP);
+        while (true) {
+            if (nQuery == vQuery.size())
+                return false;
+            if (vQuery[nQuery] == nValue)
+                return true;
+            if (vQuery[nQuery] > nValue)
+                break;
+            nQuery++;
+        }
+    }
+    return false;
+}
+
+bool GCSFilter::Match(const Element& element) const
+{
+    return MatchInternal(std::vector<uint64_t>(1, HashToRange(element)));
+}
+
+bool GCSFilter::MatchAny(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vQuery;
+    vQuery.reserve(elements.size());
+    for (const Element& element : elements)
+        vQuery.push_back(HashToRange(element));
+    std::sort(vQuery.begin(), vQuery.end());
+    return MatchInternal(vQuery);
+}
+
+std::string BlockFilterTypeName(BlockFilterType filterType)
+{
+    switch (filterType) {
+    case BLOCK_FILTER_BASIC:
+        return "basic";
+    default:
+        return "";
+    }
+}
+
+bool BlockFilterTypeByName(const std::string& strName, BlockFilterType& filterType)
+{
+    if (strName == "basic") {
+        filterType = BLOCK_FILTER_BASIC;
+        return true;
+    }
+    return false;
+}
+
+GCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockUndo)
+{
+    GCSFilter::ElementSet elements;
+    for (const CTransactionRef& tx : block.vtx) {
+        for (const CTxOut& txout : tx->vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(GCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    for (const CTxUndo& txundo : blockUndo.vtxundo) {
+        for (const CTxInUndo& prevout : txundo.vprevout) {
+            const CScript& script = prevout.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(GCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    return elements;
+}
+
+bool BlockFilter::BuildParams(GCSFilter::Params& params) const
+{
+    switch (filterType) {
+    case BLOCK_FILTER_BASIC:
+        params.nSipHashK0 = ReadLE64(blockHash.begin());
+        params.nSipHashK1 = ReadLE64(blockHash.begin() + 8);
+        params.nP = BASIC_FILTER_P;
+        params.nM = BASIC_FILTER_M;
+        return true;
+    default:
+        return false;
+    }
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const uint256& blockHashIn, const std::vector<unsigned char>& vEncoded)
+    : filterType(filterTypeIn), blockHash(blockHashIn)
+{
+    GCSFilter::Params params;
+    if (!BuildParams(params))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(params, vEncoded);
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const uint256& blockHashIn, const GCSFilter::ElementSet& elements)
+    : filterType(filterTypeIn), blockHash(blockHashIn)
+{
+    GCSFilter::Params params;
+    if (!BuildParams(params))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(params, elements);
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockUndo)
+    : filterType(filterTypeIn), blockHash(block.GetHash())
+{
+    GCSFilter::Params params;
+    if (!BuildParams(params))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(params, BasicFilterElements(block, blockUndo));
+}
+
+uint256 BlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vEncoded = GetEncodedFilter();
+    return Hash(vEncoded.begin(), vEncoded.end());
+}
+
+uint256 BlockFilter::ComputeHeader(const uint256& prevHeader) const
+{
+    const uint256 filterHash = GetHash();
+    return Hash(filterHash.begin(), filterHash.end(), prevHeader.begin(), prevHeader.end());
+}
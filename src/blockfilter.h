@@ -0,0 +1,149 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * A Golomb-coded set as BIP 158 specifies it: the N elements are hashed with SipHash
+ * into [0, N * M), sorted, and the differences between successive values are Golomb-Rice
+ * coded with parameter P. A query matches with a false positive rate of about 1 / M.
+ * The encoding is the CompactSize N followed by the coded values.
+ */
+class GCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    struct Params
+    {
+        uint64_t nSipHashK0;
+        uint64_t nSipHashK1;
+        uint8_t nP; //!< Golomb-Rice coding parameter
+        uint32_t nM; //!< Inverse false positive rate
+
+        Params(uint64_t nSipHashK0In = 0, uint64_t nSipHashK1In = 0, uint8_t nPIn = 0, uint32_t nMIn = 1)
+            : nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn) {}
+    };
+
+private:
+    Params params;
+    uint32_t nN; //!< Number of elements
+    uint64_t nF; //!< Range of the element hashes, N * M
+    std::vector<unsigned char> vEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    /** Whether any of the sorted hashes is in the set */
+    bool MatchInternal(const std::vector<uint64_t>& vQuery) const;
+
+public:
+    explicit GCSFilter(const Params& paramsIn = Params());
+    /** Decode a filter, throws std::ios_base::failure if it does not hold exactly the elements it claims */
+    GCSFilter(const Params& paramsIn, const std::vector<unsigned char>& vEncodedIn);
+    GCSFilter(const Params& paramsIn, const ElementSet& elements);
+
+    uint32_t GetN() const { return nN; }
+    const Params& GetParams() const { return params; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    /** Whether the element may be in the set */
+    bool Match(const Element& element) const;
+    /** Whether any of the elements may be in the set, in a single pass over it */
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+//! Parameters of the basic filter, BIP 158
+static const uint8_t BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+enum BlockFilterType : uint8_t
+{
+    BLOCK_FILTER_BASIC = 0,
+    BLOCK_FILTER_INVALID = 255,
+};
+
+/** Name of a filter type, as REST queries take it ("basic") */
+std::string BlockFilterTypeName(BlockFilterType filterType);
+/** The filter type with the name, false if there is none */
+bool BlockFilterTypeByName(const std::string& strName, BlockFilterType& filterType);
+
+/** What the basic filter of a block holds: every output script and every script the block
+ * spends from blockUndo, except the empty ones and outputs that start with OP_RETURN */
+GCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockUndo);
+
+/**
+ * The compact filter of one block, as BIP 157 peers are served it. Filters are chained
+ * by their headers, each the hash of the filter hash and the header of the block before.
+ */
+class BlockFilter
+{
+private:
+    BlockFilterType filterType;
+    uint256 blockHash;
+    GCSFilter filter;
+
+    /** The filter parameters of the type, keyed by the block hash */
+    bool BuildParams(GCSFilter::Params& params) const;
+
+public:
+    BlockFilter() : filterType(BLOCK_FILTER_INVALID) {}
+    /** Decode a filter, throws std::ios_base::failure if it is malformed */
+    BlockFilter(BlockFilterType filterTypeIn, const uint256& blockHashIn, const std::vector<unsigned char>& vEncoded);
+    BlockFilter(BlockFilterType filterTypeIn, const uint256& blockHashIn, const GCSFilter::ElementSet& elements);
+    BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockUndo);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return blockHash; }
+    const GCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    /** The hash of the encoded filter */
+    uint256 GetHash() const;
+    /** The header of the filter, chained to the header of the filter of the block before */
+    uint256 ComputeHeader(const uint256& prevHeader) const;
+
+    // Serialized as the cfilter message carries it
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 32 + GetSizeOfCompactSize(GetEncodedFilter().size()) + GetEncodedFilter().size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, (uint8_t)filterType, nType, nVersion);
+        ::Serialize(s, blockHash, nType, nVersion);
+        ::Serialize(s, GetEncodedFilter(), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        uint8_t nFilterType;
+        std::vector<unsigned char> vEncoded;
+        ::Unserialize(s, nFilterType, nType, nVersion);
+        ::Unserialize(s, blockHash, nType, nVersion);
+        ::Unserialize(s, vEncoded, nType, nVersion);
+        filterType = (BlockFilterType)nFilterType;
+        GCSFilter::Params params;
+        if (!BuildParams(params))
+            throw std::ios_base::failure("unknown filter type");
+        filter = GCSFilter(params, vEncoded);
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -0,0 +1,623 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockpipeline.h"
+
+#include "clientversion.h"
+#include "consensus/validation.h"
+#include "hash.h"
+#include "init.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "ui_interface.h"
+#include "undo.h"
+#include "util.h"
+
+#include <set>
+#include <stdio.h>
+#include <string.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+CBlockReadAhead blockReadAhead;
+CRecentBlockUndo recentBlockUndo;
+CBlockStoreWriter blockStoreWriter;
+
+void CBlockReadAhead::SetMaxBlocks(int nMaxBlocksIn)
+{
+    boost::lock_guard<boost::mutex> lock(cs);
+    nMaxBlocks = nMaxBlocksIn;
+    while ((int)queue.size() > nMaxBlocks)
+        queue.pop_back();
+}
+
+int CBlockReadAhead::GetMaxBlocks()
+{
+    boost::lock_guard<boost::mutex> lock(cs);
+    return nMaxBlocks;
+}
+
+std::deque<CBlockReadAhead::Entry>::iterator CBlockReadAhead::Find(const uint256& hash)
+{
+    for (std::deque<Entry>::iterator it = queue.begin(); it != queue.end(); it++) {
+        if (it->hash == hash)
+            return it;
+    }
+    return queue.end();
+}
+
+void CBlockReadAhead::Request(const std::vector<const CBlockIndex*>& vpindex)
+{
+    AssertLockHeld(cs_main);
+    boost::lock_guard<boost::mutex> lock(cs);
+    if (!fRunning)
+        return;
+
+    // Blocks already read or being read are kept, a block being read that is dropped is
+    // thrown away when it is done
+    std::deque<Entry> queueNew;
+    for (size_t i = 0; i < vpindex.size() && (int)queueNew.size() < nMaxBlocks; i++) {
+        const CBlockIndex* pindex = vpindex[i];
+        std::deque<Entry>::iterator it = Find(pindex->GetBlockHash());
+        if (it != queue.end()) {
+            queueNew.push_back(*it);
+            continue;
+        }
+        Entry entry;
+        entry.hash = pindex->GetBlockHash();
+        entry.pos = pindex->GetBlockPos();
+        entry.fCheckPoW = !(pindex->nStatus & BLOCK_POW_VERIFIED);
+        entry.state = QUEUED;
+        queueNew.push_back(entry);
+    }
+    queue.swap(queueNew);
+    cond.notify_all();
+}
+
+boost::shared_ptr<const CBlock> CBlockReadAhead::Take(const CBlockIndex* pindex)
+{
+    boost::shared_ptr<const CBlock> pblock;
+    const uint256& hash = pindex->GetBlockHash();
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(cs);
+    std::deque<Entry>::iterator it = Find(hash);
+    // The blocks before it were taken already, so the thread is on it or gets to it next
+    while (it != queue.end() && it->state != READY && fRunning) {
+        cond.wait(lock);
+        it = Find(hash);
+    }
+    if (it == queue.end())
+        return pblock;
+    if (it->state == READY)
+        pblock = it->pblock;
+    // The blocks before it will not be connected next any more
+    queue.erase(queue.begin(), it + 1);
+    return pblock;
+}
+
+void CRecentBlockUndo::SetMaxBlocks(int nMaxBlocksIn)
+{
+    boost::lock_guard<boost::mutex> lock(cs);
+    nMaxBlocks = nMaxBlocksIn;
+    while ((int)entries.size() > nMaxBlocks)
+        entries.pop_front();
+}
+
+int CRecentBlockUndo::GetMaxBlocks()
+{
+    boost::lock_guard<boost::mutex> lock(cs);
+    return nMaxBlocks;
+}
+
+void CRecentBlockUndo::Add(const CBlockIndex* pindex, const boost::shared_ptr<const CBlock>& pblock, const boost::shared_ptr<const CBlockUndo>& pundo)
+{
+    boost::lock_guard<boost::mutex> lock(cs);
+    if (nMaxBlocks == 0)
+        return;
+    if (!entries.empty() && (!pindex->pprev || entries.back().hash != pindex->pprev->GetBlockHash()))
+        entries.clear();
+    Entry entry;
+    entry.hash = pindex->GetBlockHash();
+    entry.pblock = pblock;
+    entry.pundo = pundo;
+    entries.push_back(entry);
+    if ((int)entries.size() > nMaxBlocks)
+        entries.pop_front();
+}
+
+bool CRecentBlockUndo::Take(const uint256& hash, boost::shared_ptr<const CBlock>& pblock, boost::shared_ptr<const CBlockUndo>& pundo)
+{
+    boost::lock_guard<boost::mutex> lock(cs);
+    if (entries.empty() || entries.back().hash != hash) {
+        // The chain went some other way, none of them will be disconnected next
+        entries.clear();
+        return false;
+    }
+    pblock = entries.back().pblock;
+    pundo = entries.back().pundo;
+    entries.pop_back();
+    return true;
+}
+
+void CBlockReadAhead::ThreadReadAhead(const Consensus::Params* pconsensusParams)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        fRunning = true;
+    }
+    try {
+        while (true) {
+            Entry entry;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                std::deque<Entry>::iterator it;
+                while (true) {
+                    for (it = queue.begin(); it != queue.end() && it->state != QUEUED; it++) {}
+                    if (it != queue.end())
+                        break;
+                    cond.wait(lock);
+                }
+                it->state = READING;
+                entry = *it;
+            }
+
+            boost::shared_ptr<CBlock> pblock(new CBlock());
+            if (ReadBlockFromDisk(*pblock, entry.pos, *pconsensusParams, entry.fCheckPoW) && pblock->GetHash() == entry.hash) {
+                // The result is left to ConnectBlock, which checks the block again unless it passed.
+                // A header that matches an index entry with verified PoW needs no second look at it.
+                CValidationState state;
+                if (CheckBlock(*pblock, state, *pconsensusParams, entry.fCheckPoW, true) && !entry.fCheckPoW)
+                    pblock->fChecked = true;
+            } else {
+                LogPrint("bench", "%s: could not read block %s at %s\n", __func__, entry.hash.ToString(), entry.pos.ToString());
+                pblock.reset();
+            }
+
+            boost::lock_guard<boost::mutex> lock(cs);
+            std::deque<Entry>::iterator it = Find(entry.hash);
+            if (it != queue.end() && it->state == READING) {
+                it->state = READY;
+                it->pblock = pblock;
+            }
+            cond.notify_all();
+        }
+    } catch (...) {
+        boost::lock_guard<boost::mutex> lock(cs);
+        fRunning = false;
+        queue.clear();
+        cond.notify_all();
+        throw;
+    }
+}
+
+CVerifyDBReader::CVerifyDBReader(const std::vector<Job>& vJobs, int nCheckLevelIn, const Consensus::Params& consensusParamsIn, int nThreads)
+    : consensusParams(consensusParamsIn), nCheckLevel(nCheckLevelIn), nNext(0), nTaken(0), fStop(false)
+{
+    vEntries.resize(vJobs.size());
+    for (size_t i = 0; i < vJobs.size(); i++) {
+        vEntries[i].job = vJobs[i];
+        vEntries[i].fDone = false;
+        vEntries[i].fValid = false;
+    }
+    // Enough to keep every thread busy while VerifyDB catches up, few enough blocks to hold
+    nWindow = 4 * std::max(nThreads, 1);
+    for (int i = 0; i < nThreads && i < (int)vJobs.size(); i++)
+        threads.create_thread(boost::bind(&CVerifyDBReader::ThreadCheck, this));
+}
+
+CVerifyDBReader::~CVerifyDBReader()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    threads.join_all();
+}
+
+bool CVerifyDBReader::Check(const Job& job, boost::shared_ptr<CBlock>& pblock, std::string& strError) const
+{
+    // check level 0: read from disk, always recomputing the PoW
+    pblock.reset(new CBlock());
+    if (!ReadBlockFromDisk(*pblock, job.pos, consensusParams, true) || pblock->GetHash() != job.hash) {
+        strError = strprintf("ReadBlockFromDisk failed at %d, hash=%s", job.nHeight, job.hash.ToString());
+        return false;
+    }
+    // check level 1: verify block validity
+    CValidationState state;
+    if (nCheckLevel >= 1 && !CheckBlock(*pblock, state, consensusParams)) {
+        strError = strprintf("found bad block at %d, hash=%s (%s)", job.nHeight, job.hash.ToString(), FormatStateMessage(state));
+        return false;
+    }
+    // check level 2: verify undo validity
+    if (nCheckLevel >= 2 && !job.undoPos.IsNull()) {
+        CBlockUndo undo;
+        if (!UndoReadFromDisk(undo, job.undoPos, job.hashPrev)) {
+            strError = strprintf("found bad undo data at %d, hash=%s", job.nHeight, job.hash.ToString());
+            return false;
+        }
+    }
+    return true;
+}
+
+void CVerifyDBReader::Run(size_t n)
+{
+    boost::shared_ptr<CBlock> pblock;
+    std::string strError;
+    bool fValid;
+    try {
+        fValid = Check(vEntries[n].job, pblock, strError);
+    } catch (const std::exception& e) {
+        fValid = false;
+        strError = strprintf("%s at %d, hash=%s", e.what(), vEntries[n].job.nHeight, vEntries[n].job.hash.ToString());
+    }
+
+    boost::lock_guard<boost::mutex> lock(cs);
+    Entry& entry = vEntries[n];
+    entry.fDone = true;
+    entry.fValid = fValid;
+    entry.pblock = pblock;
+    entry.strError = strError;
+    cond.notify_all();
+}
+
+void CVerifyDBReader::ThreadCheck()
+{
+    RenameThread("mil-verifydb");
+    while (true) {
+        size_t n;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && nNext < vEntries.size() && nNext >= nTaken + nWindow)
+                cond.wait(lock);
+            if (fStop || nNext >= vEntries.size())
+                return;
+            n = nNext++;
+        }
+        Run(n);
+    }
+}
+
+bool CVerifyDBReader::Take(boost::shared_ptr<CBlock>& pblock, std::string& strError)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    assert(nTaken < vEntries.size());
+    size_t n = nTaken;
+    if (nNext == n) {
+        // No thread got to it, waiting would only leave this one idle
+        nNext++;
+        lock.unlock();
+        Run(n);
+        lock.lock();
+    }
+    while (!vEntries[n].fDone)
+        cond.wait(lock);
+    Entry& entry = vEntries[n];
+    pblock.swap(entry.pblock);
+    strError = entry.strError;
+    nTaken++;
+    cond.notify_all();
+    return entry.fValid;
+}
+
+namespace {
+
+/** The block or undo file a batch is writing, kept open across records that follow each other */
+class CStoreFile
+{
+private:
+    FILE* file;
+    int nFile;
+    bool fUndo;
+    unsigned int nPos;
+
+public:
+    CStoreFile() : file(NULL), nFile(-1), fUndo(false), nPos(0) {}
+    ~CStoreFile() { Close(); }
+
+    /** Be at pos of the block or undo file, only opening it when it is not there already */
+    bool Seek(const CDiskBlockPos& pos, bool fUndoIn)
+    {
+        if (file && nFile == pos.nFile && fUndo == fUndoIn && nPos == pos.nPos)
+            return true;
+        if (!Close())
+            return false;
+        file = fUndoIn ? OpenUndoFile(pos) : OpenBlockFile(pos);
+        if (!file)
+            return error("%s: could not open %s file at %s", __func__, fUndoIn ? "undo" : "block", pos.ToString());
+        nFile = pos.nFile;
+        fUndo = fUndoIn;
+        nPos = pos.nPos;
+        return true;
+    }
+
+    bool Write(const char* pch, size_t nSize)
+    {
+        if (fwrite(pch, 1, nSize, file) != nSize)
+            return error("%s: could not write %u bytes to %s file %d at %u", __func__, nSize, fUndo ? "undo" : "block", nFile, nPos);
+        nPos += nSize;
+        return true;
+    }
+
+    /** Hand what was written to the OS, so that readers of the file see it */
+    bool Close()
+    {
+        if (!file)
+            return true;
+        bool fOk = fflush(file) == 0;
+        fclose(file);
+        file = NULL;
+        if (!fOk)
+            return error("%s: could not flush %s file %d", __func__, fUndo ? "undo" : "block", nFile);
+        return true;
+    }
+};
+
+} // namespace
+
+bool CBlockStoreWriter::Add(Entry& entry)
+{
+    {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (fRunning && !fFailed && !queue.empty() && nPendingSize + entry.nSize > MAX_PENDING_WRITE_SIZE)
+            cond.wait(lock);
+        if (fFailed)
+            return false;
+        nPendingSize += entry.nSize;
+        queue.push_back(std::move(entry));
+        if (fRunning) {
+            cond.notify_all();
+            return true;
+        }
+    }
+    // Done here, after anything the thread left behind
+    return Sync();
+}
+
+bool CBlockStoreWriter::WriteBlock(CDiskBlockPos& pos, const CBlock& block, const CMessageHeader::MessageStartChars& messageStartIn)
+{
+    Entry entry;
+    entry.type = BLOCK;
+    entry.pos = pos;
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    SerializeBlockRecord(ssRecord, block, messageStartIn);
+    entry.vchRecord.assign(ssRecord.begin(), ssRecord.end());
+    entry.nSize = entry.vchRecord.size();
+    if (!Add(entry))
+        return false;
+    // The record starts with the message start and the size of the block
+    pos.nPos += MESSAGE_START_SIZE + sizeof(unsigned int);
+    return true;
+}
+
+bool CBlockStoreWriter::WriteUndo(CDiskBlockPos& pos, CBlockUndo& blockundo, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStartIn)
+{
+    Entry entry;
+    entry.type = UNDO;
+    entry.fUndo = true;
+    entry.pos = pos;
+    entry.hashBlock = hashBlock;
+    memcpy(entry.messageStart, messageStartIn, sizeof(entry.messageStart));
+    entry.nSize = ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION);
+    entry.blockundo.vtxundo.swap(blockundo.vtxundo);
+    if (!Add(entry))
+        return false;
+    // The record starts with the message start and the size of the undo data
+    pos.nPos += MESSAGE_START_SIZE + sizeof(unsigned int);
+    return true;
+}
+
+void CBlockStoreWriter::Allocate(const CDiskBlockPos& pos, unsigned int nLength, bool fUndo)
+{
+    Entry entry;
+    entry.type = ALLOCATE;
+    entry.fUndo = fUndo;
+    entry.pos = pos;
+    entry.nLength = nLength;
+    Add(entry);
+}
+
+void CBlockStoreWriter::Commit(int nFile, bool fFinalize, unsigned int nBlockSize, unsigned int nUndoSize)
+{
+    Entry entry;
+    entry.type = COMMIT;
+    entry.pos = CDiskBlockPos(nFile, 0);
+    entry.fFinalize = fFinalize;
+    entry.nBlockSize = nBlockSize;
+    entry.nUndoSize = nUndoSize;
+    Add(entry);
+}
+
+void CBlockStoreWriter::Remove(int nFile)
+{
+    Entry entry;
+    entry.type = REMOVE;
+    entry.pos = CDiskBlockPos(nFile, 0);
+    Add(entry);
+}
+
+bool CBlockStoreWriter::WriteBatch()
+{
+    std::vector<Entry*> vpentry;
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        // Only this thread removes entries, the others only append, which leaves these in place
+        for (std::deque<Entry>::iterator it = queue.begin(); it != queue.end(); it++)
+            vpentry.push_back(&*it);
+    }
+
+    CStoreFile file;
+    std::set<int> setCommit;
+    bool fOk = true;
+    for (size_t i = 0; i < vpentry.size() && fOk; i++) {
+        Entry& entry = *vpentry[i];
+        switch (entry.type) {
+        case BLOCK:
+            fOk = file.Seek(entry.pos, false) && file.Write(&entry.vchRecord[0], entry.vchRecord.size());
+            break;
+        case UNDO: {
+            // Serialized here rather than by ConnectBlock, as UndoWriteToDisk does
+            CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+            ssRecord << FLATDATA(entry.messageStart) << (unsigned int)entry.nSize << entry.blockundo;
+            CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+            hasher << entry.hashBlock;
+            hasher << entry.blockundo;
+            ssRecord << hasher.GetHash();
+            fOk = file.Seek(entry.pos, true) && file.Write(&ssRecord[0], ssRecord.size());
+            break;
+        }
+        case ALLOCATE: {
+            FILE* fileAllocate = entry.fUndo ? OpenUndoFile(entry.pos) : OpenBlockFile(entry.pos);
+            if (fileAllocate) {
+                AllocateFileRange(fileAllocate, entry.pos.nPos, entry.nLength);
+                fclose(fileAllocate);
+            }
+            break;
+        }
+        case COMMIT:
+            // Truncated after the data before it is written and before what follows
+            fOk = file.Close();
+            if (fOk && entry.fFinalize) {
+                FILE* fileBlock = OpenBlockFile(entry.pos);
+                if (fileBlock) {
+                    TruncateFile(fileBlock, entry.nBlockSize);
+                    fclose(fileBlock);
+                }
+                FILE* fileUndo = OpenUndoFile(entry.pos);
+                if (fileUndo) {
+                    TruncateFile(fileUndo, entry.nUndoSize);
+                    fclose(fileUndo);
+                }
+            }
+            setCommit.insert(entry.pos.nFile);
+            break;
+        case REMOVE: {
+            // A file left behind only takes space, it is no reason to stop writing
+            fOk = file.Close();
+            boost::system::error_code ec;
+            boost::filesystem::remove(GetBlockPosFilename(entry.pos, "blk"), ec);
+            if (!ec)
+                boost::filesystem::remove(GetBlockPosFilename(entry.pos, "rev"), ec);
+            if (ec)
+                LogPrintf("Prune: could not delete blk/rev (%05u): %s\n", entry.pos.nFile, ec.message());
+            else
+                LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, entry.pos.nFile);
+            setCommit.erase(entry.pos.nFile);
+            break;
+        }
+        }
+    }
+    if (!file.Close())
+        fOk = false;
+
+    // Each file is committed once for the whole batch
+    if (fOk) {
+        for (std::set<int>::const_iterator it = setCommit.begin(); it != setCommit.end(); it++) {
+            CDiskBlockPos pos(*it, 0);
+            FILE* fileBlock = OpenBlockFile(pos);
+            if (fileBlock) {
+                FileCommit(fileBlock);
+                fclose(fileBlock);
+            }
+            FILE* fileUndo = OpenUndoFile(pos);
+            if (fileUndo) {
+                FileCommit(fileUndo);
+                fclose(fileUndo);
+            }
+        }
+    }
+
+    boost::lock_guard<boost::mutex> lock(cs);
+    // A failed batch stays queued and fails every Sync until the node is shut down
+    if (fOk) {
+        for (size_t i = 0; i < vpentry.size(); i++) {
+            nPendingSize -= queue.front().nSize;
+            queue.pop_front();
+        }
+    } else {
+        fFailed = true;
+    }
+    cond.notify_all();
+    return fOk;
+}
+
+bool CBlockStoreWriter::Sync()
+{
+    {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (fRunning && !queue.empty() && !fFailed)
+            cond.wait(lock);
+        if (queue.empty() || fFailed)
+            return !fFailed;
+    }
+    // The thread stopped before it got to everything
+    boost::lock_guard<boost::mutex> lockWrite(csWrite);
+    while (true) {
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            if (queue.empty() || fFailed)
+                return !fFailed;
+        }
+        if (!WriteBatch())
+            return false;
+    }
+}
+
+void CBlockStoreWriter::WaitFor(const CDiskBlockPos& pos, bool fUndo)
+{
+    const Type type = fUndo ? UNDO : BLOCK;
+    {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fFailed) {
+            bool fPending = false;
+            for (std::deque<Entry>::const_iterator it = queue.begin(); it != queue.end() && !fPending; it++)
+                fPending = it->type == type && it->pos.nFile == pos.nFile && it->pos.nPos + MESSAGE_START_SIZE + sizeof(unsigned int) == pos.nPos;
+            if (!fPending)
+                return;
+            if (!fRunning)
+                break;
+            cond.wait(lock);
+        }
+        if (fFailed)
+            return;
+    }
+    // The thread is gone before it got to it
+    Sync();
+}
+
+void CBlockStoreWriter::ThreadWrite()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        fRunning = true;
+    }
+    try {
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (queue.empty() || fFailed)
+                    cond.wait(lock);
+            }
+            boost::lock_guard<boost::mutex> lockWrite(csWrite);
+            if (!WriteBatch()) {
+                strMiscWarning = "Failed to write block or undo data";
+                LogPrintf("*** %s\n", strMiscWarning);
+                uiInterface.ThreadSafeMessageBox(_("Error: A fatal internal error occurred, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+                StartShutdown();
+            }
+        }
+    } catch (...) {
+        // Whatever is still queued is done by the next Sync call
+        boost::lock_guard<boost::mutex> lock(cs);
+        fRunning = false;
+        cond.notify_all();
+        throw;
+    }
+}
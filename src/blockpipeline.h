@@ -0,0 +1,299 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKPIPELINE_H
+#define BITCOIN_BLOCKPIPELINE_H
+
+#include "chain.h"
+#include "protocol.h"
+#include "uint256.h"
+#include "undo.h"
+
+#include <deque>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CBlock;
+
+namespace Consensus {
+struct Params;
+} // namespace Consensus
+
+/** -blockreadahead default: blocks read and checked ahead of the one being connected */
+static const int DEFAULT_BLOCK_READAHEAD = 4;
+/** Maximum of -blockreadahead */
+static const int MAX_BLOCK_READAHEAD = 64;
+/** Default for -asyncblockstore, writing block and undo files on a thread of their own */
+static const bool DEFAULT_ASYNC_BLOCK_STORE = true;
+/** Serialized size of the blocks and undo data handed to the writer thread before their writers wait for it */
+static const size_t MAX_PENDING_WRITE_SIZE = 64 << 20;
+/** -undocache default: blocks last connected kept in memory with their undo data */
+static const int DEFAULT_UNDO_CACHE = 6;
+/** Maximum of -undocache */
+static const int MAX_UNDO_CACHE = 100;
+
+/**
+ * The stage before ConnectBlock. While one block is connected under cs_main, the next blocks
+ * of the chain being activated are read from disk and checked with CheckBlock (merkle root,
+ * transactions and, unless it was verified before, the Ethash PoW) on a thread of their own.
+ * ConnectTip takes a block from here instead of reading it, and ConnectBlock finds it checked.
+ *
+ * Without the thread nothing is read ahead and ConnectTip reads every block itself.
+ */
+class CBlockReadAhead
+{
+private:
+    enum State {
+        QUEUED,
+        READING,
+        READY,
+    };
+
+    struct Entry {
+        uint256 hash;
+        CDiskBlockPos pos;
+        bool fCheckPoW;
+        State state;
+        //! NULL once READY if the block could not be read
+        boost::shared_ptr<CBlock> pblock;
+    };
+
+    boost::mutex cs;
+    //! signalled when blocks are requested, when one is read and when the thread stops
+    boost::condition_variable cond;
+    //! in the order they will be connected
+    std::deque<Entry> queue;
+    int nMaxBlocks;
+    bool fRunning;
+
+    std::deque<Entry>::iterator Find(const uint256& hash);
+
+public:
+    CBlockReadAhead() : nMaxBlocks(DEFAULT_BLOCK_READAHEAD), fRunning(false) {}
+
+    /** Read at most nMaxBlocksIn blocks ahead, 0 turns reading ahead off */
+    void SetMaxBlocks(int nMaxBlocksIn);
+    int GetMaxBlocks();
+
+    /** Read the first blocks of vpindex ahead, in order, and forget any other. They must have
+     * their data. Requires cs_main, as the index entries are read here. */
+    void Request(const std::vector<const CBlockIndex*>& vpindex);
+    /** The block of pindex, waiting for it until it is read. NULL if it was not requested or
+     * could not be read; the caller reads it itself then. The returned block has fChecked set
+     * if it passed CheckBlock. */
+    boost::shared_ptr<const CBlock> Take(const CBlockIndex* pindex);
+
+    /** The reading thread, until interrupted */
+    void ThreadReadAhead(const Consensus::Params* pconsensusParams);
+};
+
+/**
+ * The blocks last connected to the best chain and their undo data, so that DisconnectTip undoes
+ * a shallow reorg without reading either back from disk (or checking the block's Ethash PoW
+ * again). The blocks are kept in chain order; a block connected on top of another than the
+ * last one kept starts over, and one taken for disconnecting is dropped.
+ */
+class CRecentBlockUndo
+{
+private:
+    struct Entry {
+        uint256 hash;
+        boost::shared_ptr<const CBlock> pblock;
+        boost::shared_ptr<const CBlockUndo> pundo;
+    };
+
+    boost::mutex cs;
+    //! the last one is the block connected last
+    std::deque<Entry> entries;
+    int nMaxBlocks;
+
+public:
+    CRecentBlockUndo() : nMaxBlocks(DEFAULT_UNDO_CACHE) {}
+
+    /** Keep at most nMaxBlocksIn blocks, 0 turns the cache off */
+    void SetMaxBlocks(int nMaxBlocksIn);
+    int GetMaxBlocks();
+
+    /** Keep pblock, the block of pindex just connected, and its undo data */
+    void Add(const CBlockIndex* pindex, const boost::shared_ptr<const CBlock>& pblock, const boost::shared_ptr<const CBlockUndo>& pundo);
+    /** Take out the block of hash and its undo data if it is the last one kept; false otherwise,
+     * the caller reads them from disk then */
+    bool Take(const uint256& hash, boost::shared_ptr<const CBlock>& pblock, boost::shared_ptr<const CBlockUndo>& pundo);
+};
+
+/**
+ * Levels 0 to 2 of VerifyDB: reading the blocks of the best chain back from disk with their
+ * Ethash PoW, CheckBlock and reading their undo data. Threads of its own do them from the tip
+ * down, at most a window of blocks ahead of the one VerifyDB disconnects under cs_main. A block
+ * no thread started on yet when VerifyDB takes it is checked by VerifyDB itself, so without
+ * threads everything is done in order as before.
+ */
+class CVerifyDBReader
+{
+public:
+    /** What the threads need of a block index entry, copied under cs_main */
+    struct Job {
+        uint256 hash;
+        //! the hash of the parent, the undo data is tied to it
+        uint256 hashPrev;
+        int nHeight;
+        CDiskBlockPos pos;
+        //! null if there is no undo data to check
+        CDiskBlockPos undoPos;
+    };
+
+private:
+    struct Entry {
+        Job job;
+        bool fDone;
+        bool fValid;
+        boost::shared_ptr<CBlock> pblock;
+        std::string strError;
+    };
+
+    const Consensus::Params& consensusParams;
+    int nCheckLevel;
+
+    boost::mutex cs;
+    //! signalled when a block is checked, when one is taken and when stopping
+    boost::condition_variable cond;
+    //! in the order they are taken; only the results change once the threads run
+    std::vector<Entry> vEntries;
+    //! the entry a thread or Take starts on next
+    size_t nNext;
+    //! the entry Take returns next
+    size_t nTaken;
+    size_t nWindow;
+    bool fStop;
+    boost::thread_group threads;
+
+    /** Levels 0 to 2 of one block; false with strError set if they fail */
+    bool Check(const Job& job, boost::shared_ptr<CBlock>& pblock, std::string& strError) const;
+    /** Check entry n and record the result. Not holding cs. */
+    void Run(size_t n);
+    void ThreadCheck();
+
+public:
+    /** Check the blocks of vJobs on nThreads threads, 0 to check each in Take */
+    CVerifyDBReader(const std::vector<Job>& vJobs, int nCheckLevelIn, const Consensus::Params& consensusParamsIn, int nThreads);
+    /** Stops the threads, after the blocks they are on */
+    ~CVerifyDBReader();
+
+    /** The next block, waiting until it is checked. False with strError set if it failed. */
+    bool Take(boost::shared_ptr<CBlock>& pblock, std::string& strError);
+};
+
+/**
+ * Writes the blk?????.dat and rev?????.dat files on a thread of its own: the blocks AcceptBlock
+ * stores, the undo data of connected blocks, the preallocation of their space and the commits
+ * of the files to disk, and deletes the files pruning gave up. FindBlockPos and FindUndoPos reserve the space and the position is
+ * recorded in the block index right away; the block index is only written to disk after Sync,
+ * when all data it refers to is written and committed, and readers of a block or of undo data
+ * wait for the record they read.
+ *
+ * Everything handed over is done in order. The thread takes whatever has queued up as one
+ * batch, keeps a file open across records that follow each other in it and commits each file
+ * once per batch, however many commits of it were asked for. Validation only waits for the
+ * thread in Sync, before the block index refers to the data, and when it is too far behind.
+ *
+ * Without the writer thread (before it is started, once it stopped or with -asyncblockstore=0)
+ * everything is done right away by the caller.
+ */
+class CBlockStoreWriter
+{
+private:
+    enum Type {
+        BLOCK,
+        UNDO,
+        ALLOCATE,
+        COMMIT,
+        REMOVE,
+    };
+
+    struct Entry {
+        Type type;
+        //! the undo file rather than the block file, for BLOCK, UNDO and ALLOCATE
+        bool fUndo;
+        //! the start of the record FindBlockPos or FindUndoPos reserved, or of the range to
+        //! allocate; only nFile for a commit or a removal
+        CDiskBlockPos pos;
+        //! BLOCK: the whole record as WriteBlockToDisk writes it
+        std::vector<char> vchRecord;
+        //! UNDO: what UndoWriteToDisk writes
+        uint256 hashBlock;
+        CMessageHeader::MessageStartChars messageStart;
+        CBlockUndo blockundo;
+        //! ALLOCATE: the length of the range
+        unsigned int nLength;
+        //! COMMIT: truncate the files to nBlockSize and nUndoSize first
+        bool fFinalize;
+        unsigned int nBlockSize;
+        unsigned int nUndoSize;
+        //! the serialized size of the data, against MAX_PENDING_WRITE_SIZE
+        size_t nSize;
+
+        Entry() : type(BLOCK), fUndo(false), nLength(0), fFinalize(false), nBlockSize(0), nUndoSize(0), nSize(0) {}
+    };
+
+    mutable boost::mutex cs;
+    //! signalled when something is handed over, when a batch is done and when the thread stops
+    mutable boost::condition_variable cond;
+    //! the entries of the batch being written stay at the front until they are done
+    std::deque<Entry> queue;
+    size_t nPendingSize;
+    //! held while a batch is written, so none is written twice
+    boost::mutex csWrite;
+    bool fRunning;
+    bool fFailed;
+
+    /** Queue entry, taking its contents, and do it right away if there is no thread */
+    bool Add(Entry& entry);
+    /** Do the entries at the front of the queue that were there when it was called and drop
+     * them. Requires csWrite. */
+    bool WriteBatch();
+
+public:
+    CBlockStoreWriter() : nPendingSize(0), fRunning(false), fFailed(false) {}
+
+    /** Write block into the record FindBlockPos reserved at pos. pos is changed to where the
+     * block is, past the record header, as WriteBlockToDisk does. False if it could not be
+     * written. */
+    bool WriteBlock(CDiskBlockPos& pos, const CBlock& block, const CMessageHeader::MessageStartChars& messageStartIn);
+    /** Write blockundo, taking its contents, into the record FindUndoPos reserved at pos, with
+     * hashBlock the hash of the parent of its block. pos is changed to where the undo data is,
+     * past the record header, as UndoWriteToDisk does. False if it could not be written. */
+    bool WriteUndo(CDiskBlockPos& pos, CBlockUndo& blockundo, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStartIn);
+    /** Preallocate nLength bytes of the block or undo file from pos on, see AllocateFileRange */
+    void Allocate(const CDiskBlockPos& pos, unsigned int nLength, bool fUndo);
+    /** Commit the block and undo files nFile to disk once everything before is written. With
+     * fFinalize they are truncated to nBlockSize and nUndoSize first, dropping the unused
+     * preallocated space. */
+    void Commit(int nFile, bool fFinalize, unsigned int nBlockSize, unsigned int nUndoSize);
+    /** Delete the block and undo files nFile, once the block index no longer refers to them */
+    void Remove(int nFile);
+    /** Wait until everything handed over is done, or do it here if the thread is gone; false if
+     * writing failed. */
+    bool Sync();
+    /** Wait until the block or undo data at pos (as WriteBlock or WriteUndo returned it) is
+     * written */
+    void WaitFor(const CDiskBlockPos& pos, bool fUndo);
+
+    /** The writer thread, until interrupted */
+    void ThreadWrite();
+};
+
+/** Blocks read ahead of ConnectTip */
+extern CBlockReadAhead blockReadAhead;
+/** Blocks and undo data kept for DisconnectTip */
+extern CRecentBlockUndo recentBlockUndo;
+/** The writer of the blk?????.dat and rev?????.dat files */
+extern CBlockStoreWriter blockStoreWriter;
+
+#endif // BITCOIN_BLOCKPIPELINE_H
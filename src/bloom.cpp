@@ -133,7 +133,37 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
+CTxDataElements::CTxDataElements(const CTransaction& tx)
+{
+    vStart.reserve(tx.vout.size() + tx.vin.size() + 1);
+    std::vector<unsigned char> data;
+    for (unsigned int i = 0; i < tx.vout.size() + tx.vin.size(); i++)
+    {
+        const CScript& script = i < tx.vout.size() ? tx.vout[i].scriptPubKey : tx.vin[i - tx.vout.size()].scriptSig;
+        vStart.push_back(vElements.size());
+        CScript::const_iterator pc = script.begin();
+        while (pc < script.end())
+        {
+            opcodetype opcode;
+            if (!script.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                vElements.push_back(data);
+        }
+    }
+    vStart.push_back(vElements.size());
+}
+
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(tx, CTxDataElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const CTxDataElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -153,14 +183,9 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (uint32_t e = elements.vStart[i]; e < elements.vStart[i + 1]; e++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(elements.vElements[e]))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
@@ -181,21 +206,16 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        if (contains(tx.vin[i].prevout))
             return true;
 
         // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
+        for (uint32_t e = elements.vStart[tx.vout.size() + i]; e < elements.vStart[tx.vout.size() + i + 1]; e++)
         {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(elements.vElements[e]))
                 return true;
         }
     }
@@ -313,3 +333,192 @@ void CRollingBloomFilter::reset()
         *it = 0;
     }
 }
+
+/** The false positive rate of a blocked bloom filter with 256 positions per block,
+ *  nHashFuncs bits per element and lambda elements per block on average: the
+ *  load of a block follows a Poisson distribution. */
+static double BlockedBloomFPRate(int nHashFuncs, double lambda)
+{
+    double fpRate = 0;
+    double p = exp(-lambda);
+    for (int nLoad = 0; nLoad < lambda * 6 + 60; nLoad++) {
+        if (nLoad > 0)
+            p *= lambda / nLoad;
+        fpRate += p * pow(1.0 - pow(1.0 - 1.0 / 256, nHashFuncs * nLoad), nHashFuncs);
+    }
+    return fpRate;
+}
+
+CRollingBlockedBloomFilter::CRollingBlockedBloomFilter(unsigned int nElements, double fpRate)
+{
+    /* Blocks fill unevenly, so fewer hash functions than for CRollingBloomFilter do
+     * as well: 3/4 of log(fpRate) / log(0.5), restricted to the range 1-50. */
+    nHashFuncs = std::max(1, std::min((int)round(0.75 * log(fpRate) / log(0.5)), 50));
+    /* Between 2 and 3 generations of nElements / 2 entries, as in CRollingBloomFilter. */
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    /* The largest load per block that keeps the false positive rate */
+    double lo = 0, hi = 256;
+    for (int i = 0; i < 40; i++) {
+        double mid = (lo + hi) / 2;
+        if (BlockedBloomFPRate(nHashFuncs, mid) > fpRate)
+            hi = mid;
+        else
+            lo = mid;
+    }
+    nBlocks = std::max((uint32_t)ceil(nMaxElements / std::max(lo, 1.0 / 256)), (uint32_t)1);
+    data.clear();
+    data.resize((size_t)nBlocks * WORDS_PER_BLOCK + WORDS_PER_BLOCK - 1);
+    reset();
+}
+
+uint64_t* CRollingBlockedBloomFilter::Block(uint64_t nHash)
+{
+    uint64_t* pBlocks = (uint64_t*)(((uintptr_t)&data[0] + 63) & ~(uintptr_t)63);
+    /* The high half picks the block, without the bias of a modulo */
+    return pBlocks + (((nHash >> 32) * nBlocks) >> 32) * WORDS_PER_BLOCK;
+}
+
+const uint64_t* CRollingBlockedBloomFilter::Block(uint64_t nHash) const
+{
+    const uint64_t* pBlocks = (const uint64_t*)(((uintptr_t)&data[0] + 63) & ~(uintptr_t)63);
+    return pBlocks + (((nHash >> 32) * nBlocks) >> 32) * WORDS_PER_BLOCK;
+}
+
+void CRollingBlockedBloomFilter::Mask(uint64_t nHash, uint64_t mask[4]) const
+{
+    /* Positions from the top byte of a linear congruential sequence seeded with the
+     * hash; double hashing repeats positions too often in a block of 256. */
+    uint64_t x = nHash;
+    mask[0] = mask[1] = mask[2] = mask[3] = 0;
+    for (int n = 0; n < nHashFuncs; n++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t pos = x >> 56;
+        mask[pos >> 6] |= ((uint64_t)1) << (pos & 63);
+    }
+}
+
+void CRollingBlockedBloomFilter::insert(uint64_t nHash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4) {
+            nGeneration = 1;
+        }
+        uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+        /* Wipe old entries that used this generation number. */
+        uint64_t* pBlocks = Block(0);
+        for (size_t b = 0; b < (size_t)nBlocks * WORDS_PER_BLOCK; b += WORDS_PER_BLOCK) {
+            for (int i = 0; i < 4; i++) {
+                uint64_t p1 = pBlocks[b + i], p2 = pBlocks[b + 4 + i];
+                uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+                pBlocks[b + i] = p1 & mask;
+                pBlocks[b + 4 + i] = p2 & mask;
+            }
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint64_t mask[4];
+    Mask(nHash, mask);
+    uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+    uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+    uint64_t* block = Block(nHash);
+    for (int i = 0; i < 4; i++) {
+        block[i] = (block[i] & ~mask[i]) | (mask[i] & nGenerationMask1);
+        block[4 + i] = (block[4 + i] & ~mask[i]) | (mask[i] & nGenerationMask2);
+    }
+}
+
+bool CRollingBlockedBloomFilter::contains(uint64_t nHash) const
+{
+    uint64_t mask[4];
+    Mask(nHash, mask);
+    const uint64_t* block = Block(nHash);
+    /* A position is set if it is set in either plane; no early exit, so the four words are probed at once */
+    uint64_t missing = 0;
+    for (int i = 0; i < 4; i++)
+        missing |= mask[i] & ~(block[i] | block[4 + i]);
+    return missing == 0;
+}
+
+void CRollingBlockedBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(CSipHasher(k0, k1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+void CRollingBlockedBloomFilter::insert(const uint256& hash)
+{
+    insert(SipHashUint256(k0, k1, hash));
+}
+
+bool CRollingBlockedBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(CSipHasher(k0, k1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
+bool CRollingBlockedBloomFilter::contains(const uint256& hash) const
+{
+    return contains(SipHashUint256(k0, k1, hash));
+}
+
+void CRollingBlockedBloomFilter::reset()
+{
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    for (std::vector<uint64_t>::iterator it = data.begin(); it != data.end(); it++) {
+        *it = 0;
+    }
+}
+
+CBlockedBloomFilter::CBlockedBloomFilter(unsigned int nElementsIn, unsigned int nBitsPerElement) :
+    nElements(nElementsIn),
+    k0(GetRand(std::numeric_limits<uint64_t>::max())),
+    k1(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    uint64_t nBits = std::max((uint64_t)nElements * nBitsPerElement, (uint64_t)1);
+    nBlocks = (nBits + WORDS_PER_BLOCK * 32 - 1) / (WORDS_PER_BLOCK * 32);
+    data.reset(new std::atomic<uint32_t>[(size_t)nBlocks * WORDS_PER_BLOCK]);
+    for (size_t i = 0; i < (size_t)nBlocks * WORDS_PER_BLOCK; i++)
+        data[i].store(0, std::memory_order_relaxed);
+}
+
+uint64_t CBlockedBloomFilter::Hash(const unsigned char* pch, size_t nSize) const
+{
+    return CSipHasher(k0, k1).Write(pch, nSize).Finalize();
+}
+
+/* Odd multipliers that spread the low half of the hash over the 8 words of a block,
+ * as in the split block bloom filters of Putze, Sanders and Singler */
+static const uint32_t BLOCKED_BLOOM_SALT[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+void CBlockedBloomFilter::insert(const unsigned char* pch, size_t nSize)
+{
+    uint64_t nHash = Hash(pch, nSize);
+    /* The high half picks the block, without the bias of a modulo */
+    std::atomic<uint32_t>* block = &data[(((nHash >> 32) * nBlocks) >> 32) * WORDS_PER_BLOCK];
+    for (unsigned int i = 0; i < WORDS_PER_BLOCK; i++) {
+        uint32_t nBit = (uint32_t)1 << (((uint32_t)nHash * BLOCKED_BLOOM_SALT[i]) >> 27);
+        if (!(block[i].load(std::memory_order_relaxed) & nBit))
+            block[i].fetch_or(nBit, std::memory_order_relaxed);
+    }
+}
+
+bool CBlockedBloomFilter::contains(const unsigned char* pch, size_t nSize) const
+{
+    uint64_t nHash = Hash(pch, nSize);
+    const std::atomic<uint32_t>* block = &data[(((nHash >> 32) * nBlocks) >> 32) * WORDS_PER_BLOCK];
+    for (unsigned int i = 0; i < WORDS_PER_BLOCK; i++) {
+        uint32_t nBit = (uint32_t)1 << (((uint32_t)nHash * BLOCKED_BLOOM_SALT[i]) >> 27);
+        if (!(block[i].load(std::memory_order_relaxed) & nBit))
+            return false;
+    }
+    return true;
+}
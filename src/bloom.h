@@ -7,8 +7,11 @@
 
 #include "serialize.h"
 
+#include <atomic>
 #include <vector>
 
+#include <boost/scoped_array.hpp>
+
 class COutPoint;
 class CTransaction;
 class uint256;
@@ -30,6 +33,23 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements the scripts of a transaction push, as IsRelevantAndUpdate
+ * matches them: the non-empty pushes of every output script, then of every input
+ * script, each up to the first op that fails to parse. Extracting them once lets a
+ * transaction be matched against many filters without parsing its scripts again.
+ */
+class CTxDataElements
+{
+public:
+    //! All the elements, output scripts first
+    std::vector<std::vector<unsigned char> > vElements;
+    //! Output i pushes vElements[vStart[i]] up to vStart[i + 1], input i follows at vStart[vout.size() + i]
+    std::vector<uint32_t> vStart;
+
+    explicit CTxDataElements(const CTransaction& tx);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -97,6 +117,8 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    //! The same, with the data elements of tx extracted already
+    bool IsRelevantAndUpdate(const CTransaction& tx, const CTxDataElements& elements);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
@@ -140,4 +162,117 @@ private:
     int nHashFuncs;
 };
 
+/**
+ * CRollingBlockedBloomFilter keeps the same generations as CRollingBloomFilter, and
+ * takes the same parameters, but keeps all the bits of an element in one 64-byte
+ * block: the two bit planes of 256 positions, next to each other. An insert or
+ * contains hashes the element once, with SipHash, and touches a single cache line,
+ * where CRollingBloomFilter computes a MurmurHash3 and touches a cache line per
+ * hash function. The bits of an element are gathered into a mask of four words
+ * first, so the block is probed or updated with a few wide operations.
+ *
+ * Packing the bits of an element together costs memory for the same false
+ * positive rate: about 15% more at 0.001, 70% more at 0.000001.
+ */
+class CRollingBlockedBloomFilter
+{
+public:
+    // Calls GetRand() at creation time, like CRollingBloomFilter.
+    CRollingBlockedBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+private:
+    //! Per block, 4 words of the low bit plane and 4 of the high one
+    static const unsigned int WORDS_PER_BLOCK = 8;
+
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    uint32_t nBlocks;
+    //! Blocks, from the first 64-byte boundary in it
+    std::vector<uint64_t> data;
+    uint64_t k0, k1;
+    int nHashFuncs;
+
+    uint64_t* Block(uint64_t nHash);
+    const uint64_t* Block(uint64_t nHash) const;
+    void Mask(uint64_t nHash, uint64_t mask[4]) const;
+    void insert(uint64_t nHash);
+    bool contains(uint64_t nHash) const;
+};
+
+/**
+ * BlockedBloomFilter is a bloom filter for large sets that are only ever added to.
+ *
+ * Every item sets 8 bits in one 256-bit block of the filter, one bit in each of
+ * its 32-bit words, so a lookup touches a single cache line instead of one per
+ * hash function. Items are hashed with SipHash under a random salt, which is kept
+ * when the filter is serialized. Items can be inserted while other threads look
+ * others up; a thread finds an item once it synchronized with the inserting one
+ * afterwards, e.g. through a lock both take.
+ *
+ * With the default 16 bits per element the false positive rate stays below 0.1%
+ * up to nElements items, and goes up with every item beyond that.
+ */
+class CBlockedBloomFilter
+{
+public:
+    CBlockedBloomFilter(unsigned int nElements, unsigned int nBitsPerElement = 16);
+
+    void insert(const unsigned char* pch, size_t nSize);
+    bool contains(const unsigned char* pch, size_t nSize) const;
+
+    /** The number of items the filter was sized for */
+    unsigned int GetCapacity() const { return nElements; }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 4 + 8 + 8 + ::GetSerializeSize(VARINT(nBlocks), nType, nVersion) + nBlocks * WORDS_PER_BLOCK * 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ::Serialize(s, nElements, nType, nVersion);
+        ::Serialize(s, k0, nType, nVersion);
+        ::Serialize(s, k1, nType, nVersion);
+        ::Serialize(s, VARINT(nBlocks), nType, nVersion);
+        for (size_t i = 0; i < (size_t)nBlocks * WORDS_PER_BLOCK; i++)
+            ::Serialize(s, data[i].load(std::memory_order_relaxed), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        ::Unserialize(s, nElements, nType, nVersion);
+        ::Unserialize(s, k0, nType, nVersion);
+        ::Unserialize(s, k1, nType, nVersion);
+        ::Unserialize(s, VARINT(nBlocks), nType, nVersion);
+        if (nBlocks == 0)
+            throw std::ios_base::failure("CBlockedBloomFilter::Unserialize: empty filter");
+        data.reset(new std::atomic<uint32_t>[(size_t)nBlocks * WORDS_PER_BLOCK]);
+        for (size_t i = 0; i < (size_t)nBlocks * WORDS_PER_BLOCK; i++) {
+            uint32_t nWord;
+            ::Unserialize(s, nWord, nType, nVersion);
+            data[i].store(nWord, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    CBlockedBloomFilter(const CBlockedBloomFilter&);
+    void operator=(const CBlockedBloomFilter&);
+
+    static const unsigned int WORDS_PER_BLOCK = 8;
+
+    unsigned int nElements;
+    uint64_t k0, k1;
+    uint32_t nBlocks;
+    boost::scoped_array<std::atomic<uint32_t> > data;
+
+    uint64_t Hash(const unsigned char* pch, size_t nSize) const;
+};
+
 #endif // BITCOIN_BLOOM_H
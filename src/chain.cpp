@@ -5,6 +5,8 @@
 
 #include "chain.h"
 
+#include <new>
+
 using namespace std;
 
 /**
@@ -112,6 +114,29 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+CBlockIndex* CBlockIndexArena::Allocate(const CBlockIndex& index)
+{
+    if (nLastUsed == CHUNK_ENTRIES) {
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * CHUNK_ENTRIES)));
+        nLastUsed = 0;
+    }
+    CBlockIndex* pindex = new (vChunks.back() + nLastUsed) CBlockIndex(index);
+    nLastUsed++;
+    return pindex;
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t nChunk = 0; nChunk < vChunks.size(); nChunk++) {
+        size_t nUsed = nChunk + 1 == vChunks.size() ? nLastUsed : CHUNK_ENTRIES;
+        for (size_t i = 0; i < nUsed; i++)
+            vChunks[nChunk][i].~CBlockIndex();
+        ::operator delete(vChunks[nChunk]);
+    }
+    vChunks.clear();
+    nLastUsed = CHUNK_ENTRIES;
+}
+
 arith_uint256 GetBlockProof(const CBlockIndex& block)
 {
     arith_uint256 bnTarget;
@@ -146,6 +146,11 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+
+    BLOCK_POW_VERIFIED      =   256, //!< Ethash PoW of the header was verified, no need to recompute it on disk reads
+    BLOCK_HAVE_POWHASH      =   512, //!< Ethash result of the header is stored in hashPoW
+
+    BLOCK_UNCHECKED_CONTEXT =  1024, //!< indexed by a parallel reindex; ContextualCheckBlock runs when the block is connected
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -201,6 +206,9 @@ public:
     //! ethash expand
     uint256 mixhash;
 
+    //! Ethash result of the header, only valid if BLOCK_HAVE_POWHASH is set
+    uint256 hashPoW;
+
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
@@ -226,6 +234,7 @@ public:
         nNonce         = 0;
         
         mixhash = uint256();
+        hashPoW = uint256();
     }
 
     CBlockIndex()
@@ -358,6 +367,43 @@ arith_uint256 GetBlockProof(const CBlockIndex& block);
 /** Return the time it would take to redo the work difference between from and to, assuming the current hashrate corresponds to the difficulty at tip, in seconds. */
 int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip, const Consensus::Params&);
 
+/**
+ * Storage for the block index entries, allocated in chunks instead of one by one. Entries
+ * allocated one after the other, as the headers of a chain are, lie next to each other in
+ * memory, so walking a chain through pprev and pskip touches few cache lines. Entries are
+ * only freed all together.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vChunks;
+    //! Entries used in the last chunk
+    size_t nLastUsed;
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+public:
+    //! Entries in one chunk
+    static const size_t CHUNK_ENTRIES = 4096;
+
+    CBlockIndexArena() : nLastUsed(CHUNK_ENTRIES) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    /** A new entry, a copy of index; it lives until Clear() or the arena is destroyed */
+    CBlockIndex* Allocate(const CBlockIndex& index);
+
+    /** Destroy all entries */
+    void Clear();
+
+    size_t size() const { return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_ENTRIES + nLastUsed; }
+
+    void swap(CBlockIndexArena& other) {
+        vChunks.swap(other.vChunks);
+        std::swap(nLastUsed, other.nLastUsed);
+    }
+};
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -398,6 +444,9 @@ public:
         READWRITE(nNonce);
         READWRITE(mixhash);
         READWRITE(nHeight);
+
+        if (nStatus & BLOCK_HAVE_POWHASH)
+            READWRITE(hashPoW);
     }
 
     uint256 GetBlockHash() const
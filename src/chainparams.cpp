@@ -6,6 +6,7 @@
 
 #include "chainparams.h"
 #include "consensus/merkle.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
 
 #include "tinyformat.h"
 #include "util.h"
@@ -32,7 +33,7 @@ static CBlock CreateGenesisBlock(const char* pszTimestamp, const CScript& genesi
     genesis.nBits    = nBits;
     genesis.nNonce   = nNonce;
     genesis.nVersion = nVersion;
-    genesis.vtx.push_back(txNew);
+    genesis.vtx.push_back(MakeTransactionRef(std::move(txNew)));
     genesis.hashPrevBlock.SetNull();
     genesis.hashMerkleRoot = BlockMerkleRoot(genesis);
     genesis.mixhash = uint256S(mixhash);
@@ -79,6 +80,9 @@ public:
         consensus.nPowTargetSpacing = 60;   // <-- MIL: OK
         consensus.fPowAllowMinDifficultyBlocks = false;
         consensus.fPowNoRetargeting = false;
+        consensus.nEthashEpochLength = ETHASH_EPOCH_LENGTH;
+        consensus.nEthashCacheSize = 0;
+        consensus.nEthashDatasetSize = 0;
         consensus.nRuleChangeActivationThreshold = 15120; // 75% of 20160
         consensus.nMinerConfirmationWindow = 20160; // <-- MIL: approx. 2 weeks
         consensus.vDeployments[Consensus::DEPLOYMENT_TESTDUMMY].bit = 28;
@@ -98,6 +102,10 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0000000000000000000000000000000000000000000000000000000000100010"); // <-- MIL: OK
 
+        // By default assume that the scripts in ancestors of this block are valid.
+        // Set by each release to a block buried deep enough at the time; none yet.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         /**
          * The message start string is designed to be unlikely to occur in normal data.
          * The characters are rarely used upper ASCII, not valid as UTF-8, and produce
@@ -160,6 +168,9 @@ public:
         consensus.nPowTargetSpacing = 60;
         consensus.fPowAllowMinDifficultyBlocks = true;
         consensus.fPowNoRetargeting = false;
+        consensus.nEthashEpochLength = ETHASH_EPOCH_LENGTH;
+        consensus.nEthashCacheSize = 0;
+        consensus.nEthashDatasetSize = 0;
         consensus.nRuleChangeActivationThreshold = 1512; // 75% for testchains
         consensus.nMinerConfirmationWindow = 2016; // nPowTargetTimespan / nPowTargetSpacing
         consensus.vDeployments[Consensus::DEPLOYMENT_TESTDUMMY].bit = 28;
@@ -179,6 +190,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x00");
 
+        // By default assume that the scripts in ancestors of this block are valid.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         pchMessageStart[0] = 0xfa;
         pchMessageStart[1] = 0xa2;
         pchMessageStart[2] = 0xf0;
@@ -241,6 +255,10 @@ public:
         consensus.nPowTargetSpacing = 2.5 * 60;
         consensus.fPowAllowMinDifficultyBlocks = true;
         consensus.fPowNoRetargeting = true;
+        // Tiny Ethash epochs, caches and DAGs, so that tests need neither time nor memory to mine
+        consensus.nEthashEpochLength = 100;
+        consensus.nEthashCacheSize = 1024 * 64;
+        consensus.nEthashDatasetSize = 16384 * 64;
         consensus.nRuleChangeActivationThreshold = 108; // 75% for testchains
         consensus.nMinerConfirmationWindow = 144; // Faster than normal for regtest (144 instead of 2016)
         consensus.vDeployments[Consensus::DEPLOYMENT_TESTDUMMY].bit = 28;
@@ -256,6 +274,9 @@ public:
         // The best chain should have at least this much work.
         consensus.nMinimumChainWork = uint256S("0x00");
 
+        // By default assume that the scripts in ancestors of this block are valid.
+        consensus.defaultAssumeValid = uint256S("0x00");
+
         pchMessageStart[0] = 0xfa;
         pchMessageStart[1] = 0xbf;
         pchMessageStart[2] = 0xb5;
@@ -268,9 +289,9 @@ public:
         * For RegTest we simulate the Litecoin Genesis so we can re-use all validation data
         */
 
-        genesis = CreateGenesisBlock("NY Times 05/Oct/2011 Steve Jobs, Apple’s Visionary, Dies at 56", CScript() << ParseHex("040184710fa689ad5023690c80f3a49c8f13f8d45b8c857fbcbc8bc4a8e4d3eb4b10f4d4604fa08dce601aaf0f470216fe1b51850b4acf21b179c45070ac7b03a9") << OP_CHECKSIG, 1296688602, 0, 0x207fffff, 1, 50 * COIN, "c763d8572dec8e75534d2007e265fa95f21be2912fa0625842683ef4329f9021");
+        genesis = CreateGenesisBlock("NY Times 05/Oct/2011 Steve Jobs, Apple’s Visionary, Dies at 56", CScript() << ParseHex("040184710fa689ad5023690c80f3a49c8f13f8d45b8c857fbcbc8bc4a8e4d3eb4b10f4d4604fa08dce601aaf0f470216fe1b51850b4acf21b179c45070ac7b03a9") << OP_CHECKSIG, 1296688602, 3, 0x207fffff, 1, 50 * COIN, "2e1d1ed7b295fc4957eebd86b893ec24ff670f9cf64658479392fcb04a6b88b5");
         consensus.hashGenesisBlock = genesis.GetHash();
-        assert(consensus.hashGenesisBlock == uint256S("0xe4e8daefa8511ee5aa0b7d2129050147d532ecfc31136b0283cf3b3cf89284fb"));
+        assert(consensus.hashGenesisBlock == uint256S("0x08806001907c85c11ccd8617537b9182e6f6d7781d90ddcb357ab7861d5055b3"));
         assert(genesis.hashMerkleRoot == uint256S("0x97ddfbbae6be97fd6cdf3e7ca13232a3afff2353e29badfab7f73011edd4ced9"));
 
         vFixedSeeds.clear(); //!< Regtest mode doesn't have any fixed seeds.
@@ -329,6 +350,8 @@ void SelectParams(const std::string& network)
 {
     SelectBaseParams(network);
     pCurrentParams = &Params(network);
+    const Consensus::Params& consensus = pCurrentParams->GetConsensus();
+    EthashAux::setParams(consensus.nEthashEpochLength, consensus.nEthashCacheSize, consensus.nEthashDatasetSize);
 }
 
 void UpdateRegtestBIP9Parameters(Consensus::DeploymentPos d, int64_t nStartTime, int64_t nTimeout)
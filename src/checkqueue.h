@@ -5,7 +5,13 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stdint.h>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -16,6 +22,23 @@
 template <typename T>
 class CCheckQueueControl;
 
+/** What a CCheckQueue did since it was created */
+struct CCheckQueueStats
+{
+    //! The checks of one queue, that is of the master (queue 0) or of one worker
+    struct Thread {
+        uint64_t nChecks;
+        //! Checks taken from other queues
+        uint64_t nStolen;
+        int64_t nBusyMicros;
+    };
+
+    uint64_t nAdded;
+    unsigned int nQueued;
+    unsigned int nMaxQueued;
+    std::vector<Thread> vThreads;
+};
+
 /** 
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
@@ -25,12 +48,39 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread has a queue of its own, with its own lock: Add deals the
+  * checks out over them, a thread takes its batches from the back of its
+  * own queue and, once that is empty, steals from the front of the others.
+  * The shared mutex is only taken to go to sleep and to wake threads up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! The checks of one thread
+    struct WorkerQueue {
+        boost::mutex mutex;
+        //! As the order of booleans doesn't matter, the owner uses it as a LIFO (stack)
+        std::deque<T> checks;
+        //! checks.size(), to look for work to steal without taking the lock
+        std::atomic<size_t> nSize;
+
+        //! Counters of the thread owning the queue, see CCheckQueueStats
+        std::atomic<uint64_t> nChecksRun;
+        std::atomic<uint64_t> nStolen;
+        std::atomic<int64_t> nBusyMicros;
+
+        WorkerQueue() : nSize(0), nChecksRun(0), nStolen(0), nBusyMicros(0) {}
+    };
+
+    //! Maximum number of queues; further workers share them
+    static const unsigned int MAX_QUEUES = 65;
+
+    //! Queue 0 is the master's, queue n the n'th worker's
+    std::vector<std::unique_ptr<WorkerQueue> > vQueues;
+
+    //! Mutex that idle threads sleep on
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,121 +89,168 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of worker threads started (excluding the master).
+    std::atomic<unsigned int> nWorkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
-
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! The number of elements in the queues, not yet taken by any thread.
+    std::atomic<unsigned int> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
+
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! The queue the next Add starts dealing at (only used by the master).
+    unsigned int nNextQueue;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Checks added since creation, and the most ever queued at once
+    std::atomic<uint64_t> nAdded;
+    std::atomic<unsigned int> nMaxQueued;
+
+    unsigned int ActiveQueues() const
+    {
+        return std::min<unsigned int>(nWorkers + 1, vQueues.size());
+    }
+
+    /**
+     * Move a batch of checks into vChecks: from the back of queue nQueue,
+     * or from the front of the first other queue that has any.
+     */
+    bool Take(unsigned int nQueue, std::vector<T>& vChecks)
+    {
+        unsigned int nQueues = ActiveQueues();
+        for (unsigned int i = 0; i < nQueues; i++) {
+            WorkerQueue& q = *vQueues[(nQueue + i) % nQueues];
+            if (q.nSize.load(std::memory_order_relaxed) == 0)
+                continue;
+            boost::unique_lock<boost::mutex> lock(q.mutex);
+            if (q.checks.empty())
+                continue;
+            // Take half of what is left, so that the last checks are spread
+            // over all threads and they finish approximately simultaneously.
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)q.checks.size() / 2));
+            vChecks.resize(nNow);
+            for (unsigned int n = 0; n < nNow; n++) {
+                // We want the lock on the mutex to be as short as possible, so swap jobs from the
+                // queue to the local batch vector instead of copying.
+                if (i == 0) {
+                    vChecks[n].swap(q.checks.back());
+                    q.checks.pop_back();
+                } else {
+                    vChecks[n].swap(q.checks.front());
+                    q.checks.pop_front();
+                }
+            }
+            q.nSize = q.checks.size();
+            nQueued -= nNow;
+            if (i != 0)
+                vQueues[nQueue]->nStolen.fetch_add(nNow, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nQueue, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
+            if (Take(nQueue, vChecks)) {
+                int64_t nTimeStart = GetTimeMicros();
                 // Check whether we need to do work at all
-                fOk = fAllOk;
+                bool fOk = fAllOk;
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                if (!fOk)
+                    fAllOk = false;
+                unsigned int nNow = vChecks.size();
+                vChecks.clear();
+                WorkerQueue& own = *vQueues[nQueue];
+                own.nChecksRun.fetch_add(nNow, std::memory_order_relaxed);
+                own.nBusyMicros.fetch_add(GetTimeMicros() - nTimeStart, std::memory_order_relaxed);
+                if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+                    // We processed the last element; inform the master it can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    condMaster.notify_one();
+                }
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster && nTodo == 0) {
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                fAllOk = true;
+                // return the current status
+                return fRet;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            // Add and the last worker to finish notify while holding the
+            // mutex, so nothing is missed between this check and the wait.
+            if (nQueued == 0)
+                (fMaster ? condMaster : condWorker).wait(lock);
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn) : nWorkers(0), nQueued(0), nTodo(0), fAllOk(true), nNextQueue(0), nBatchSize(nBatchSizeIn), nAdded(0), nMaxQueued(0)
+    {
+        for (unsigned int i = 0; i < MAX_QUEUES; i++)
+            vQueues.emplace_back(new WorkerQueue());
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        Loop(1 + nWorkers++ % (MAX_QUEUES - 1));
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
+        // Deal the checks out in equal shares, starting one queue further
+        // every time, so that one check per Add spreads as well.
+        unsigned int nQueues = ActiveQueues();
+        unsigned int nShare = (vChecks.size() + nQueues - 1) / nQueues;
+        for (unsigned int nPos = 0; nPos < vChecks.size(); nPos += nShare) {
+            WorkerQueue& q = *vQueues[nNextQueue++ % nQueues];
+            unsigned int nEnd = std::min<unsigned int>(vChecks.size(), nPos + nShare);
+            boost::unique_lock<boost::mutex> lock(q.mutex);
+            for (unsigned int n = nPos; n < nEnd; n++) {
+                q.checks.push_back(T());
+                vChecks[n].swap(q.checks.back());
+            }
+            q.nSize = q.checks.size();
+            nQueued += nEnd - nPos;
+        }
+        nAdded += vChecks.size();
+        // Only the master adds, so nothing else raises the maximum in between
+        unsigned int nNowQueued = nQueued;
+        if (nNowQueued > nMaxQueued)
+            nMaxQueued = nNowQueued;
+        boost::unique_lock<boost::mutex> lock(mutex);
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -163,8 +260,22 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && nQueued == 0 && fAllOk == true);
+    }
+
+    //! The counters, for the master and every queue a worker was started on
+    void GetStats(CCheckQueueStats& stats) const
+    {
+        stats.nAdded = nAdded;
+        stats.nQueued = nQueued;
+        stats.nMaxQueued = nMaxQueued;
+        stats.vThreads.resize(ActiveQueues());
+        for (unsigned int i = 0; i < stats.vThreads.size(); i++) {
+            const WorkerQueue& q = *vQueues[i];
+            stats.vThreads[i].nChecks = q.nChecksRun;
+            stats.vThreads[i].nStolen = q.nStolen;
+            stats.vThreads[i].nBusyMicros = q.nBusyMicros;
+        }
     }
 
 };
@@ -5,10 +5,12 @@
 #include "coins.h"
 
 #include "memusage.h"
-#include "random.h"
+#include "trace.h"
 
 #include <assert.h>
 
+#include <algorithm>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -43,6 +45,12 @@ bool CCoins::Spend(uint32_t nPos)
 
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
+void CCoinsView::GetCoinsMany(const std::vector<uint256> &txids, std::vector<CCoins> &coins, std::vector<bool> &found, int nThreads) const {
+    coins.resize(txids.size());
+    found.resize(txids.size());
+    for (size_t i = 0; i < txids.size(); i++)
+        found[i] = GetCoins(txids[i], coins[i]);
+}
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
 CCoinsViewCursor *CCoinsView::Cursor() const { return 0; }
@@ -56,9 +64,8 @@ void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
 CCoinsViewCursor *CCoinsViewBacked::Cursor() const { return base->Cursor(); }
 
-SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
-
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false),
+    cacheCoins(0, SaltedTxidHasher(), std::equal_to<uint256>(), CCoinsMap::allocator_type(&cacheCoinsResource)), cachedCoinsUsage(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -73,6 +80,7 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
     CCoinsMap::iterator it = cacheCoins.find(txid);
     if (it != cacheCoins.end())
         return it;
+    TRACE1(utxocache, miss, txid.begin());
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
@@ -155,6 +163,34 @@ bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) const {
     return it != cacheCoins.end();
 }
 
+void CCoinsViewCache::Prefetch(const std::vector<uint256> &txids, int nThreads) const {
+    // Inserting may rehash the map under an outstanding modifier
+    assert(!hasModifier);
+    std::vector<uint256> vMissing;
+    for (size_t i = 0; i < txids.size(); i++) {
+        if (!cacheCoins.count(txids[i]))
+            vMissing.push_back(txids[i]);
+    }
+    std::sort(vMissing.begin(), vMissing.end());
+    vMissing.erase(std::unique(vMissing.begin(), vMissing.end()), vMissing.end());
+    if (vMissing.empty())
+        return;
+
+    std::vector<CCoins> vCoins;
+    std::vector<bool> vFound;
+    base->GetCoinsMany(vMissing, vCoins, vFound, nThreads);
+    for (size_t i = 0; i < vMissing.size(); i++) {
+        if (!vFound[i])
+            continue;
+        // Entered as FetchCoins would
+        CCoinsMap::iterator it = cacheCoins.insert(std::make_pair(vMissing[i], CCoinsCacheEntry())).first;
+        it->second.coins.swap(vCoins[i]);
+        if (it->second.coins.IsPruned())
+            it->second.flags = CCoinsCacheEntry::FRESH;
+        cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
+    }
+}
+
 uint256 CCoinsViewCache::GetBestBlock() const {
     if (hashBlock.IsNull())
         hashBlock = base->GetBestBlock();
@@ -211,9 +247,14 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
 }
 
 bool CCoinsViewCache::Flush() {
+    TRACE2(utxocache, flush_start, cacheCoins.size(), DynamicMemoryUsage());
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    TRACE1(utxocache, flush_end, fOk);
     cacheCoins.clear();
     cachedCoinsUsage = 0;
+    // All nodes are gone, hand their memory back at once
+    if (cacheCoinsResource.GetLiveBlocks() == 0)
+        cacheCoinsResource.Release();
     return fOk;
 }
 
@@ -9,13 +9,17 @@
 #include "compressor.h"
 #include "core_memusage.h"
 #include "hash.h"
+#include "hasher.h"
 #include "memusage.h"
 #include "serialize.h"
+#include "support/allocators/pool.h"
 #include "uint256.h"
 
 #include <assert.h>
 #include <stdint.h>
 
+#include <functional>
+
 #include <boost/foreach.hpp>
 #include <boost/unordered_map.hpp>
 
@@ -265,22 +269,43 @@ public:
     }
 };
 
-class SaltedTxidHasher
-{
-private:
-    /** Salt */
-    const uint64_t k0, k1;
+/** An unspent output with what it shares with the other outputs of its transaction, as stored
+ * in the coin database */
+struct CCoinValue {
+    CTxOut out;
+    unsigned int nHeight;
+    bool fCoinBase;
+    int nTxVersion;
 
-public:
-    SaltedTxidHasher();
+    CCoinValue() : nHeight(0), fCoinBase(false), nTxVersion(0) {}
+    CCoinValue(const CCoins &coins, uint32_t n) : out(coins.vout[n]), nHeight(coins.nHeight), fCoinBase(coins.fCoinBase), nTxVersion(coins.nVersion) {}
 
-    /**
-     * This *must* return size_t. With Boost 1.46 on 32-bit systems the
-     * unordered_map will behave unpredictably if the custom hasher returns a
-     * uint64_t, resulting in failures when syncing the chain (#4634).
-     */
-    size_t operator()(const uint256& txid) const {
-        return SipHashUint256(k0, k1, txid);
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        return ::GetSerializeSize(VARINT(nCode), nType, nVersion) + ::GetSerializeSize(VARINT(nTxVersion), nType, nVersion) +
+            ::GetSerializeSize(CTxOutCompressor(REF(out)), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        ::Serialize(s, VARINT(nCode), nType, nVersion);
+        ::Serialize(s, VARINT(nTxVersion), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(out)), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        nHeight = nCode / 2;
+        fCoinBase = nCode & 1;
+        ::Unserialize(s, VARINT(nTxVersion), nType, nVersion);
+        ::Unserialize(s, REF(CTxOutCompressor(out)), nType, nVersion);
+    }
+
+    bool operator==(const CCoinValue &other) const {
+        return out == other.out && nHeight == other.nHeight && fCoinBase == other.fCoinBase && nTxVersion == other.nTxVersion;
     }
 };
 
@@ -297,7 +322,10 @@ struct CCoinsCacheEntry
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
+/** Nodes are taken from the pool of the cache the map belongs to, if it has one. The map stays
+ * node-based: AccessCoins hands out pointers into it that must outlive the next lookup. */
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher, std::equal_to<uint256>,
+                             pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -331,6 +359,10 @@ public:
     //! This may (but cannot always) return true for fully spent transactions
     virtual bool HaveCoins(const uint256 &txid) const;
 
+    //! Retrieve the CCoins of several txids at once, found[i] tells whether coins[i] was.
+    //! Views that can read concurrently may use up to nThreads threads for it
+    virtual void GetCoinsMany(const std::vector<uint256> &txids, std::vector<CCoins> &coins, std::vector<bool> &found, int nThreads) const;
+
     //! Retrieve the block hash whose state this CCoinsView currently represents
     virtual uint256 GetBestBlock() const;
 
@@ -398,6 +430,8 @@ protected:
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    /* Memory of the cacheCoins nodes, so that it goes back in one piece when the cache is flushed. */
+    PoolResource cacheCoinsResource;
     mutable CCoinsMap cacheCoins;
 
     /* Cached dynamic memory usage for the inner CCoins objects. */
@@ -421,6 +455,13 @@ public:
      */
     bool HaveCoinsInCache(const uint256 &txid) const;
 
+    /**
+     * Load the coins of txids that are not cached yet from the backing view in one go,
+     * so that the accesses that follow hit the cache. Reads on up to nThreads threads
+     * if the backing view allows it.
+     */
+    void Prefetch(const std::vector<uint256> &txids, int nThreads) const;
+
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
      * more efficient than GetCoins. Modifications to other cache entries are
@@ -0,0 +1,217 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinswriter.h"
+
+#include "init.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <stdexcept>
+
+#include <boost/thread.hpp>
+
+CCoinsViewWriter::CCoinsViewWriter(CCoinsViewDB* dbIn) : db(dbIn), fRunning(false), fFailed(false) {}
+
+CCoinsViewWriter::pending_type CCoinsViewWriter::GetPending() const
+{
+    boost::lock_guard<boost::mutex> lock(cs);
+    return pending;
+}
+
+bool CCoinsViewWriter::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    pending_type flush = GetPending();
+    if (flush) {
+        CCoinsMap::const_iterator it = flush->find(txid);
+        if (it != flush->end()) {
+            // Spent by the flush, whatever the database still has
+            if (it->second.coins.IsPruned())
+                return false;
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return db->GetCoins(txid, coins);
+}
+
+bool CCoinsViewWriter::HaveCoins(const uint256 &txid) const
+{
+    pending_type flush = GetPending();
+    if (flush) {
+        CCoinsMap::const_iterator it = flush->find(txid);
+        if (it != flush->end())
+            return !it->second.coins.IsPruned();
+    }
+    return db->HaveCoins(txid);
+}
+
+void CCoinsViewWriter::GetCoinsMany(const std::vector<uint256> &txids, std::vector<CCoins> &coins, std::vector<bool> &found, int nThreads) const
+{
+    pending_type flush = GetPending();
+    if (!flush) {
+        db->GetCoinsMany(txids, coins, found, nThreads);
+        return;
+    }
+
+    coins.resize(txids.size());
+    found.resize(txids.size());
+    std::vector<uint256> vRead;
+    std::vector<size_t> vReadPos;
+    for (size_t i = 0; i < txids.size(); i++) {
+        CCoinsMap::const_iterator it = flush->find(txids[i]);
+        if (it == flush->end()) {
+            vRead.push_back(txids[i]);
+            vReadPos.push_back(i);
+        } else if ((found[i] = !it->second.coins.IsPruned())) {
+            coins[i] = it->second.coins;
+        }
+    }
+
+    std::vector<CCoins> vReadCoins;
+    std::vector<bool> vReadFound;
+    db->GetCoinsMany(vRead, vReadCoins, vReadFound, nThreads);
+    for (size_t i = 0; i < vRead.size(); i++) {
+        found[vReadPos[i]] = vReadFound[i];
+        coins[vReadPos[i]].swap(vReadCoins[i]);
+    }
+}
+
+uint256 CCoinsViewWriter::GetBestBlock() const
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        if (pending && !hashPending.IsNull())
+            return hashPending;
+    }
+    return db->GetBestBlock();
+}
+
+bool CCoinsViewWriter::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    // The entries of a flush are read while it is written, so the next one waits for it
+    if (!Sync())
+        return false;
+
+    // Only the dirty entries, on the heap rather than in the pool of the flushed cache
+    boost::shared_ptr<CCoinsMap> flush(new CCoinsMap());
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            CCoinsCacheEntry& entry = (*flush)[it->first];
+            entry.coins.swap(it->second.coins);
+            entry.flags = it->second.flags;
+        }
+        CCoinsMap::iterator itOld = it++;
+        mapCoins.erase(itOld);
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        if (fRunning) {
+            pending = flush;
+            hashPending = hashBlock;
+            cond.notify_all();
+            return true;
+        }
+    }
+    return db->WriteCoins(*flush, hashBlock);
+}
+
+CCoinsViewCursor *CCoinsViewWriter::Cursor() const
+{
+    Sync();
+    return db->Cursor();
+}
+
+bool CCoinsViewWriter::ReadUTXOStats(CUTXOStats& stats) const
+{
+    return db->ReadUTXOStats(stats);
+}
+
+bool CCoinsViewWriter::WriteUTXOStats(const CUTXOStats& stats)
+{
+    return db->WriteUTXOStats(stats);
+}
+
+bool CCoinsViewWriter::WritePending(const pending_type& flush, const uint256& hashBlock) const
+{
+    int64_t nStart = GetTimeMicros();
+    bool fOk;
+    try {
+        fOk = db->WriteCoins(*flush, hashBlock);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        fOk = false;
+    }
+    LogPrint("coindb", "Wrote %u transactions to the coin database in the background: %.2fms\n", (unsigned int)flush->size(), 0.001 * (GetTimeMicros() - nStart));
+
+    boost::lock_guard<boost::mutex> lock(cs);
+    // A failed flush stays pending, so reads remain consistent until the node is shut down
+    if (fOk)
+        pending.reset();
+    else
+        fFailed = true;
+    cond.notify_all();
+    return fOk;
+}
+
+bool CCoinsViewWriter::Sync() const
+{
+    {
+        // Never interrupted half way through a flush, the wait ends when the writer stops
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (fRunning && pending && !fFailed)
+            cond.wait(lock);
+        if (!pending || fFailed)
+            return !fFailed;
+    }
+    // The thread stopped before it got to the flush
+    boost::lock_guard<boost::mutex> lockWrite(csWrite);
+    pending_type flush;
+    uint256 hashBlock;
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        if (!pending || fFailed)
+            return !fFailed;
+        flush = pending;
+        hashBlock = hashPending;
+    }
+    return WritePending(flush, hashBlock);
+}
+
+void CCoinsViewWriter::ThreadWrite()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        fRunning = true;
+    }
+    try {
+        while (true) {
+            pending_type flush;
+            uint256 hashBlock;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!pending || fFailed)
+                    cond.wait(lock);
+                flush = pending;
+                hashBlock = hashPending;
+            }
+            boost::lock_guard<boost::mutex> lockWrite(csWrite);
+            if (!WritePending(flush, hashBlock)) {
+                strMiscWarning = "Failed to write to coin database";
+                LogPrintf("*** %s\n", strMiscWarning);
+                uiInterface.ThreadSafeMessageBox(_("Error: A fatal internal error occurred, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+                StartShutdown();
+            }
+        }
+    } catch (...) {
+        // Whatever is still pending is written by the next Sync call
+        boost::lock_guard<boost::mutex> lock(cs);
+        fRunning = false;
+        cond.notify_all();
+        throw;
+    }
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSWRITER_H
+#define BITCOIN_COINSWRITER_H
+
+#include "coins.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CCoinsViewDB;
+class CUTXOStats;
+
+/** Default for -asyncflush, writing the chainstate on a thread of its own */
+static const bool DEFAULT_ASYNC_FLUSH = true;
+
+/**
+ * The view between the coin database and the coins cache that writes flushes in the background.
+ *
+ * BatchWrite takes the dirty entries out of the flushed cache and returns; the writer thread
+ * then writes them to the database in one batch. Until that batch is committed, reads of those
+ * txids are answered from the entries handed over, and everything else from the database, so
+ * validation carries on against the state of the flush. The entries are never changed once
+ * handed over, readers only take the lock to copy the pointer to them.
+ *
+ * One flush is written at a time: a BatchWrite waits for the one before it. Without the writer
+ * thread (before it is started, once it stopped or with -asyncflush=0) BatchWrite writes itself.
+ */
+class CCoinsViewWriter : public CCoinsView
+{
+public:
+    CCoinsViewWriter(CCoinsViewDB* dbIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    void GetCoinsMany(const std::vector<uint256> &txids, std::vector<CCoins> &coins, std::vector<bool> &found, int nThreads) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    /** Waits for the flush being written, a cursor only sees the database */
+    CCoinsViewCursor *Cursor() const;
+
+    /** The UTXO set statistics, written straight away: they only count for the best block they are of */
+    bool ReadUTXOStats(CUTXOStats& stats) const;
+    bool WriteUTXOStats(const CUTXOStats& stats);
+
+    /** Wait until the flush handed over is on disk, or write it here if the thread is gone; false if writing failed */
+    bool Sync() const;
+
+    /** The writer thread, until interrupted */
+    void ThreadWrite();
+
+private:
+    typedef boost::shared_ptr<const CCoinsMap> pending_type;
+
+    CCoinsViewDB* db;
+
+    mutable boost::mutex cs;
+    //! signalled when a flush is handed over, when it is written and when the thread stops
+    mutable boost::condition_variable cond;
+    //! the entries of the flush not committed yet, NULL if there is none
+    mutable pending_type pending;
+    mutable uint256 hashPending;
+    //! held while a flush is written, so none is written twice
+    mutable boost::mutex csWrite;
+    bool fRunning;
+    mutable bool fFailed;
+
+    pending_type GetPending() const;
+    /** Write the pending flush and drop it once it is committed. Requires csWrite. */
+    bool WritePending(const pending_type& flush, const uint256& hashBlock) const;
+};
+
+#endif // BITCOIN_COINSWRITER_H
@@ -5,6 +5,7 @@
 
 #include "compressor.h"
 
+#include "amount.h"
 #include "hash.h"
 #include "pubkey.h"
 #include "script/standard.h"
@@ -183,3 +184,15 @@ uint64_t CTxOutCompressor::DecompressAmount(uint64_t x)
     }
     return n;
 }
+
+bool CBlockCompressor::CanCompress(const CBlock &block)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = *block.vtx[i];
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            if (!MoneyRange(tx.vout[j].nValue) || tx.vout[j].scriptPubKey.size() > MAX_SCRIPT_SIZE)
+                return false;
+        }
+    }
+    return true;
+}
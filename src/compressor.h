@@ -6,6 +6,7 @@
 #ifndef BITCOIN_COMPRESSOR_H
 #define BITCOIN_COMPRESSOR_H
 
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "script/script.h"
 #include "serialize.h"
@@ -126,4 +127,112 @@ public:
     }
 };
 
+/** Set in the size of a block file record whose block is stored with CBlockCompressor */
+static const unsigned int BLOCK_RECORD_COMPRESSED = 0x80000000;
+
+/** Compact serializer for blocks in the block files (-compressblocks).
+ *
+ *  The header is stored as it is, and each transaction with:
+ *  * its outputs through CTxOutCompressor
+ *  * VARINTs for the version, the lock time, the outpoint index plus one and the
+ *    inverted sequence number, so that the common values take one byte each
+ *  * a flags byte in front, telling whether the witness follows the outputs
+ *
+ *  Only blocks CanCompress accepts read back exactly as they were.
+ */
+class CBlockCompressor
+{
+private:
+    CBlock &block;
+
+    template<typename Stream>
+    static void SerializeTx(Stream &s, const CTransaction &tx, int nType, int nVersion) {
+        uint32_t nTxVersion = tx.nVersion;
+        unsigned char flags = tx.wit.IsNull() ? 0 : 1;
+        s << VARINT(nTxVersion) << flags;
+        WriteCompactSize(s, tx.vin.size());
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            const CTxIn &txin = tx.vin[i];
+            uint32_t nIndex = txin.prevout.n + 1, nSequence = ~txin.nSequence;
+            s << txin.prevout.hash << VARINT(nIndex) << *(const CScriptBase*)(&txin.scriptSig) << VARINT(nSequence);
+        }
+        WriteCompactSize(s, tx.vout.size());
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            s << CTxOutCompressor(REF(tx.vout[i]));
+        if (flags & 1) {
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                s << (i < tx.wit.vtxinwit.size() ? tx.wit.vtxinwit[i] : CTxInWitness());
+        }
+        uint32_t nLockTime = tx.nLockTime;
+        s << VARINT(nLockTime);
+    }
+
+    template<typename Stream>
+    static void UnserializeTx(Stream &s, CMutableTransaction &tx, int nType, int nVersion) {
+        uint32_t nTxVersion = 0;
+        unsigned char flags = 0;
+        s >> VARINT(nTxVersion) >> flags;
+        if (flags & ~1)
+            throw std::ios_base::failure("Unknown transaction optional data");
+        tx.nVersion = nTxVersion;
+        // Grown one at a time, so that a corrupt count fails on the data rather than allocating it
+        uint64_t nInputs = ReadCompactSize(s);
+        tx.vin.clear();
+        for (uint64_t i = 0; i < nInputs; i++) {
+            tx.vin.push_back(CTxIn());
+            CTxIn &txin = tx.vin.back();
+            uint32_t nIndex = 0, nSequence = 0;
+            s >> txin.prevout.hash >> VARINT(nIndex) >> *(CScriptBase*)(&txin.scriptSig) >> VARINT(nSequence);
+            txin.prevout.n = nIndex - 1;
+            txin.nSequence = ~nSequence;
+        }
+        uint64_t nOutputs = ReadCompactSize(s);
+        tx.vout.clear();
+        for (uint64_t i = 0; i < nOutputs; i++) {
+            tx.vout.push_back(CTxOut());
+            s >> REF(CTxOutCompressor(tx.vout.back()));
+        }
+        tx.wit.SetNull();
+        if (flags & 1) {
+            tx.wit.vtxinwit.resize(tx.vin.size());
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                s >> tx.wit.vtxinwit[i];
+        }
+        s >> VARINT(tx.nLockTime);
+    }
+
+public:
+    CBlockCompressor(CBlock &blockIn) : block(blockIn) { }
+
+    /** Whether the outputs of block all fit CTxOutCompressor, which cuts longer scripts and assumes money ranges */
+    static bool CanCompress(const CBlock &block);
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        s << block.GetBlockHeader();
+        WriteCompactSize(s, block.vtx.size());
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            SerializeTx(s, *block.vtx[i], nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        block.SetNull();
+        s >> *(CBlockHeader*)&block;
+        uint64_t nTx = ReadCompactSize(s);
+        PrevectorArenaScope arena;
+        for (uint64_t i = 0; i < nTx; i++) {
+            CMutableTransaction tx;
+            UnserializeTx(s, tx, nType, nVersion);
+            block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+        }
+    }
+};
+
 #endif // BITCOIN_COMPRESSOR_H
@@ -68,7 +68,13 @@ struct Params {
     int64_t nPowTargetSpacing;
     int64_t nPowTargetTimespan;
     int64_t DifficultyAdjustmentInterval() const { return nPowTargetTimespan / nPowTargetSpacing; }
+    /** Ethash blocks per epoch, and light cache and DAG sizes in bytes; 0 sizes grow with the epoch as on mainnet */
+    uint64_t nEthashEpochLength;
+    uint64_t nEthashCacheSize;
+    uint64_t nEthashDatasetSize;
     uint256 nMinimumChainWork;
+    /** By default assume that the scripts in ancestors of this block are valid */
+    uint256 defaultAssumeValid;
 };
 } // namespace Consensus
 
@@ -8,68 +8,276 @@
 #include <assert.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_X86_DISPATCH 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define AES_ARM_DISPATCH 1
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
 extern "C" {
 #include "crypto/ctaes/ctaes.c"
 }
 
+namespace
+{
+#if AES_X86_DISPATCH
+/** AES with the AES-NI instructions, one block at a time. */
+namespace aes_ni
+{
+#define AES_NI __attribute__((target("sse2,aes")))
+
+/** SubBytes of each byte of a key schedule word. With the word in all four columns ShiftRows changes nothing. */
+AES_NI uint32_t SubWord(uint32_t w)
+{
+    return _mm_cvtsi128_si32(_mm_aesenclast_si128(_mm_set1_epi32(w), _mm_setzero_si128()));
+}
+
+/** The round keys of the equivalent inverse cipher, which aesdec expects. */
+AES_NI void InvertKeys(unsigned char* dk, const unsigned char* rk, int rounds)
+{
+    _mm_storeu_si128((__m128i*)dk, _mm_loadu_si128((const __m128i*)(rk + 16 * rounds)));
+    for (int i = 1; i < rounds; i++)
+        _mm_storeu_si128((__m128i*)(dk + 16 * i), _mm_aesimc_si128(_mm_loadu_si128((const __m128i*)(rk + 16 * (rounds - i)))));
+    _mm_storeu_si128((__m128i*)(dk + 16 * rounds), _mm_loadu_si128((const __m128i*)rk));
+}
+
+AES_NI void Encrypt(const unsigned char* rk, int rounds, unsigned char* out, const unsigned char* in)
+{
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)rk));
+    for (int i = 1; i < rounds; i++)
+        x = _mm_aesenc_si128(x, _mm_loadu_si128((const __m128i*)(rk + 16 * i)));
+    _mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(x, _mm_loadu_si128((const __m128i*)(rk + 16 * rounds))));
+}
+
+AES_NI void Decrypt(const unsigned char* dk, int rounds, unsigned char* out, const unsigned char* in)
+{
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)dk));
+    for (int i = 1; i < rounds; i++)
+        x = _mm_aesdec_si128(x, _mm_loadu_si128((const __m128i*)(dk + 16 * i)));
+    _mm_storeu_si128((__m128i*)out, _mm_aesdeclast_si128(x, _mm_loadu_si128((const __m128i*)(dk + 16 * rounds))));
+}
+
+#undef AES_NI
+} // namespace aes_ni
+
+bool HaveAESNI()
+{
+    uint32_t eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES);
+}
+#endif
+
+#if AES_ARM_DISPATCH
+/** AES with the ARMv8 cryptography extensions, one block at a time. */
+namespace aes_armv8
+{
+#define AES_ARMV8 __attribute__((target("arch=armv8-a+crypto")))
+
+/** SubBytes of each byte of a key schedule word. With the word in all four columns ShiftRows changes nothing. */
+AES_ARMV8 uint32_t SubWord(uint32_t w)
+{
+    return vgetq_lane_u32(vreinterpretq_u32_u8(vaeseq_u8(vreinterpretq_u8_u32(vdupq_n_u32(w)), vdupq_n_u8(0))), 0);
+}
+
+/** The round keys of the equivalent inverse cipher, which aesd expects. */
+AES_ARMV8 void InvertKeys(unsigned char* dk, const unsigned char* rk, int rounds)
+{
+    vst1q_u8(dk, vld1q_u8(rk + 16 * rounds));
+    for (int i = 1; i < rounds; i++)
+        vst1q_u8(dk + 16 * i, vaesimcq_u8(vld1q_u8(rk + 16 * (rounds - i))));
+    vst1q_u8(dk + 16 * rounds, vld1q_u8(rk));
+}
+
+/** aese adds the round key before SubBytes, the last one is added on its own. */
+AES_ARMV8 void Encrypt(const unsigned char* rk, int rounds, unsigned char* out, const unsigned char* in)
+{
+    uint8x16_t x = vld1q_u8(in);
+    for (int i = 0; i < rounds - 1; i++)
+        x = vaesmcq_u8(vaeseq_u8(x, vld1q_u8(rk + 16 * i)));
+    x = vaeseq_u8(x, vld1q_u8(rk + 16 * (rounds - 1)));
+    vst1q_u8(out, veorq_u8(x, vld1q_u8(rk + 16 * rounds)));
+}
+
+AES_ARMV8 void Decrypt(const unsigned char* dk, int rounds, unsigned char* out, const unsigned char* in)
+{
+    uint8x16_t x = vld1q_u8(in);
+    for (int i = 0; i < rounds - 1; i++)
+        x = vaesimcq_u8(vaesdq_u8(x, vld1q_u8(dk + 16 * i)));
+    x = vaesdq_u8(x, vld1q_u8(dk + 16 * (rounds - 1)));
+    vst1q_u8(out, veorq_u8(x, vld1q_u8(dk + 16 * rounds)));
+}
+
+#undef AES_ARMV8
+} // namespace aes_armv8
+
+bool HaveARMv8AES()
+{
+#if defined(__APPLE__)
+    return true;
+#elif defined(__linux__) && defined(HWCAP_AES)
+    return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+    return false;
+#endif
+}
+#endif
+
+/** The AES instructions this CPU has, all NULL when ctaes is used. */
+struct AESKernels
+{
+    const char* name;
+    uint32_t (*subword)(uint32_t w);
+    void (*invert)(unsigned char* dk, const unsigned char* rk, int rounds);
+    void (*encrypt)(const unsigned char* rk, int rounds, unsigned char* out, const unsigned char* in);
+    void (*decrypt)(const unsigned char* dk, int rounds, unsigned char* out, const unsigned char* in);
+};
+
+AESKernels SelectAESKernels()
+{
+    AESKernels kernels = { "ctaes", NULL, NULL, NULL, NULL };
+#if AES_X86_DISPATCH
+    if (HaveAESNI()) {
+        AESKernels ni = { "aes-ni", aes_ni::SubWord, aes_ni::InvertKeys, aes_ni::Encrypt, aes_ni::Decrypt };
+        kernels = ni;
+    }
+#elif AES_ARM_DISPATCH
+    if (HaveARMv8AES()) {
+        AESKernels armv8 = { "armv8", aes_armv8::SubWord, aes_armv8::InvertKeys, aes_armv8::Encrypt, aes_armv8::Decrypt };
+        kernels = armv8;
+    }
+#endif
+    return kernels;
+}
+
+const AESKernels& ActiveAESKernels()
+{
+    static const AESKernels kernels = SelectAESKernels();
+    return kernels;
+}
+
+/** Expand a key of nk words into the rounds + 1 round keys of the hardware kernels, inverted for decryption
+ *  if fDecrypt. The words are little endian, as on every CPU with a kernel. Returns false if there is none. */
+bool ExpandHardwareKey(unsigned char* rk, const unsigned char* key, int nk, int rounds, bool fDecrypt)
+{
+    static const uint8_t rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+    const AESKernels& kernels = ActiveAESKernels();
+    if (!kernels.encrypt)
+        return false;
+
+    uint32_t w[4 * 15];
+    memcpy(w, key, 4 * nk);
+    for (int i = nk; i < 4 * (rounds + 1); i++) {
+        uint32_t t = w[i - 1];
+        if (i % nk == 0)
+            t = kernels.subword((t >> 8) | (t << 24)) ^ rcon[i / nk - 1];
+        else if (nk > 6 && i % nk == 4)
+            t = kernels.subword(t);
+        w[i] = w[i - nk] ^ t;
+    }
+    if (fDecrypt)
+        kernels.invert(rk, (const unsigned char*)w, rounds);
+    else
+        memcpy(rk, w, 16 * (rounds + 1));
+    memset(w, 0, sizeof(w));
+    return true;
+}
+
+} // namespace
+
+const char* AESImplementation()
+{
+    return ActiveAESKernels().name;
+}
+
 AES128Encrypt::AES128Encrypt(const unsigned char key[16])
 {
-    AES128_init(&ctx, key);
+    if (!ExpandHardwareKey(rk, key, 4, 10, false))
+        AES128_init(&ctx, key);
 }
 
 AES128Encrypt::~AES128Encrypt()
 {
     memset(&ctx, 0, sizeof(ctx));
+    memset(rk, 0, sizeof(rk));
 }
 
 void AES128Encrypt::Encrypt(unsigned char ciphertext[16], const unsigned char plaintext[16]) const
 {
-    AES128_encrypt(&ctx, 1, ciphertext, plaintext);
+    const AESKernels& kernels = ActiveAESKernels();
+    if (kernels.encrypt)
+        kernels.encrypt(rk, 10, ciphertext, plaintext);
+    else
+        AES128_encrypt(&ctx, 1, ciphertext, plaintext);
 }
 
 AES128Decrypt::AES128Decrypt(const unsigned char key[16])
 {
-    AES128_init(&ctx, key);
+    if (!ExpandHardwareKey(rk, key, 4, 10, true))
+        AES128_init(&ctx, key);
 }
 
 AES128Decrypt::~AES128Decrypt()
 {
     memset(&ctx, 0, sizeof(ctx));
+    memset(rk, 0, sizeof(rk));
 }
 
 void AES128Decrypt::Decrypt(unsigned char plaintext[16], const unsigned char ciphertext[16]) const
 {
-    AES128_decrypt(&ctx, 1, plaintext, ciphertext);
+    const AESKernels& kernels = ActiveAESKernels();
+    if (kernels.decrypt)
+        kernels.decrypt(rk, 10, plaintext, ciphertext);
+    else
+        AES128_decrypt(&ctx, 1, plaintext, ciphertext);
 }
 
 AES256Encrypt::AES256Encrypt(const unsigned char key[32])
 {
-    AES256_init(&ctx, key);
+    if (!ExpandHardwareKey(rk, key, 8, 14, false))
+        AES256_init(&ctx, key);
 }
 
 AES256Encrypt::~AES256Encrypt()
 {
     memset(&ctx, 0, sizeof(ctx));
+    memset(rk, 0, sizeof(rk));
 }
 
 void AES256Encrypt::Encrypt(unsigned char ciphertext[16], const unsigned char plaintext[16]) const
 {
-    AES256_encrypt(&ctx, 1, ciphertext, plaintext);
+    const AESKernels& kernels = ActiveAESKernels();
+    if (kernels.encrypt)
+        kernels.encrypt(rk, 14, ciphertext, plaintext);
+    else
+        AES256_encrypt(&ctx, 1, ciphertext, plaintext);
 }
 
 AES256Decrypt::AES256Decrypt(const unsigned char key[32])
 {
-    AES256_init(&ctx, key);
+    if (!ExpandHardwareKey(rk, key, 8, 14, true))
+        AES256_init(&ctx, key);
 }
 
 AES256Decrypt::~AES256Decrypt()
 {
     memset(&ctx, 0, sizeof(ctx));
+    memset(rk, 0, sizeof(rk));
 }
 
 void AES256Decrypt::Decrypt(unsigned char plaintext[16], const unsigned char ciphertext[16]) const
 {
-    AES256_decrypt(&ctx, 1, plaintext, ciphertext);
+    const AESKernels& kernels = ActiveAESKernels();
+    if (kernels.decrypt)
+        kernels.decrypt(rk, 14, plaintext, ciphertext);
+    else
+        AES256_decrypt(&ctx, 1, plaintext, ciphertext);
 }
 
 
@@ -2,7 +2,8 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 //
-// C++ wrapper around ctaes, a constant-time AES implementation
+// C++ wrapper around ctaes, a constant-time AES implementation, and the
+// AES instructions of the CPU where it has them
 
 #ifndef BITCOIN_CRYPTO_AES_H
 #define BITCOIN_CRYPTO_AES_H
@@ -20,6 +21,8 @@ class AES128Encrypt
 {
 private:
     AES128_ctx ctx;
+    //! Round keys of the hardware kernels, ctx is unused with them
+    unsigned char rk[11 * 16];
 
 public:
     AES128Encrypt(const unsigned char key[16]);
@@ -32,6 +35,8 @@ class AES128Decrypt
 {
 private:
     AES128_ctx ctx;
+    //! Round keys of the hardware kernels, ctx is unused with them
+    unsigned char rk[11 * 16];
 
 public:
     AES128Decrypt(const unsigned char key[16]);
@@ -44,6 +49,8 @@ class AES256Encrypt
 {
 private:
     AES256_ctx ctx;
+    //! Round keys of the hardware kernels, ctx is unused with them
+    unsigned char rk[15 * 16];
 
 public:
     AES256Encrypt(const unsigned char key[32]);
@@ -56,6 +63,8 @@ class AES256Decrypt
 {
 private:
     AES256_ctx ctx;
+    //! Round keys of the hardware kernels, ctx is unused with them
+    unsigned char rk[15 * 16];
 
 public:
     AES256Decrypt(const unsigned char key[32]);
@@ -115,4 +124,7 @@ private:
     unsigned char iv[AES_BLOCKSIZE];
 };
 
+/** The AES implementation selected for this CPU */
+const char* AESImplementation();
+
 #endif // BITCOIN_CRYPTO_AES_H
@@ -1,6 +1,9 @@
 #include "crypto/ethash/ethashWraper/EthashAux.h"
 #include "crypto/ethash/ethashlib/internal.h"
 #include "crypto/ethash/ethashExtension/SHA3.h"
+#include "flathashmap.h"
+#include "hasher.h"
+#include "trace.h"
 //#include "crypto/ethash/ethashExtension/Common.h"
 
 #define DEV_IF_THROWS(X) try{X;}catch(...)
@@ -18,73 +21,181 @@ EthashAux* EthashAux::get()
 	return s_this;
 }
 
-uint256 EthashAux::seedHash(unsigned _number)
+namespace
+{
+/// The seed hash of every epoch up to ETHASH_MAX_EPOCHS and the reverse mapping, never modified once built.
+struct SeedHashes
 {
-	unsigned epoch = _number / ETHASH_EPOCH_LENGTH;
-	Guard l(get()->x_epochs);
-	if (epoch >= get()->m_seedHashes.size())
+	SeedHashes()
 	{
-		uint256 ret;
-		unsigned n = 0;
-		if (!get()->m_seedHashes.empty())
-		{
-			ret = get()->m_seedHashes.back();
-			n = get()->m_seedHashes.size() - 1;
-		}
-		get()->m_seedHashes.resize(epoch + 1);
-		//printf("Searching for seedHash of epoch %u\n", epoch);
-		for (; n <= epoch; ++n, ret = sha3(ret))
+		uint256 h;
+		for (unsigned n = 0; n < ETHASH_MAX_EPOCHS; ++n, h = sha3(h))
 		{
-			get()->m_seedHashes[n] = ret;
-			//printf("Epoch: %u is %s\n", n, ret.GetHex().c_str());
+			seeds[n] = h;
+			epochs[h] = n;
 		}
-		//printf("Testcase sha3 is %s\n", ret.GetHex().c_str());
 	}
-	return get()->m_seedHashes[epoch];
+	uint256 seeds[ETHASH_MAX_EPOCHS];
+	FlatHashMap<uint256, unsigned, CheapUint256Hasher> epochs;
+};
+
+SeedHashes const& seedHashes()
+{
+	// Built on first use, later lookups need no lock
+	static SeedHashes const s_seedHashes;
+	return s_seedHashes;
+}
 }
 
-uint64_t EthashAux::number(uint256 const& _seedHash)
+void EthashAux::setParams(uint64_t _epochLength, uint64_t _cacheSize, uint64_t _fullSize)
+{
+	WriteGuard l(get()->x_lights);
+	if (_epochLength == ethash_get_epoch_length() && _cacheSize == get()->m_cacheSize && _fullSize == get()->m_fullSize)
+		return;
+	ethash_set_params(_epochLength, _cacheSize, _fullSize);
+	get()->m_cacheSize = _cacheSize;
+	get()->m_fullSize = _fullSize;
+
+	// Seed hashes stay valid, everything computed from the old sizes does not
+	get()->m_lights.clear();
+	get()->m_lightsLru.clear();
+	get()->m_lightsSize = 0;
+	DEV_GUARDED(get()->x_fulls)
+	{
+		get()->m_fulls.clear();
+		get()->m_retainedFulls.clear();
+	}
+	DEV_GUARDED(get()->x_evals)
+		for (EvalEntry& entry: get()->m_evals)
+			entry.set = false;
+}
+
+uint64_t EthashAux::epochLength()
+{
+	return ethash_get_epoch_length();
+}
+
+uint256 EthashAux::seedHash(unsigned _number)
 {
-	Guard l(get()->x_epochs);
+	unsigned epoch = _number / epochLength();
+	SeedHashes const& table = seedHashes();
+	if (epoch < ETHASH_MAX_EPOCHS)
+		return table.seeds[epoch];
+	// Past the tabulated sizes, not reachable by this chain in practice
+	uint256 ret = table.seeds[ETHASH_MAX_EPOCHS - 1];
+	for (unsigned n = ETHASH_MAX_EPOCHS - 1; n < epoch; ++n)
+		ret = sha3(ret);
+	return ret;
+}
 
-	unsigned epoch = 0;
-	auto epochIter = get()->m_epochs.find(_seedHash);
-	if (epochIter == get()->m_epochs.end())
+uint64_t EthashAux::number(uint256 const& _seedHash)
+{
+	SeedHashes const& table = seedHashes();
+	auto epochIter = table.epochs.find(_seedHash);
+	if (epochIter == table.epochs.end())
 	{
-		//		cdebug << "Searching for seedHash " << _seedHash;
-		// different sha3 algo, need to add SHA3, RPL... vectorref.h
-		for (uint256 h; h != _seedHash && epoch < 2048; ++epoch, h = sha3(h), get()->m_epochs[h] = epoch) {
-		}
-		if (epoch == 2048)
-		{
-			std::ostringstream error;
-			//error << "apparent block number for " << _seedHash.GetHex() << " is too high; max is " << (ETHASH_EPOCH_LENGTH * 2048);
-			throw std::invalid_argument(error.str());
-		}
+		std::ostringstream error;
+		//error << "apparent block number for " << _seedHash.GetHex() << " is too high; max is " << (ETHASH_EPOCH_LENGTH * 2048);
+		throw std::invalid_argument(error.str());
 	}
-	else
-		epoch = epochIter->second;
-	return epoch * ETHASH_EPOCH_LENGTH;
+	return (uint64_t)epochIter->second * epochLength();
 }
 
 EthashAux::LightType EthashAux::light(uint256 const& _seedHash)
 {
-	UpgradableGuard l(get()->x_lights);
+	// Lookups reorder the LRU, so even hits need exclusive access.
+	WriteGuard l(get()->x_lights);
 
-	if (get()->m_lights.count(_seedHash))
-		return get()->m_lights.at(_seedHash);
-	UpgradeGuard l2(l);
+	Lights::iterator it = get()->m_lights.find(_seedHash);
+	if (it != get()->m_lights.end())
+	{
+		get()->m_lightsLru.splice(get()->m_lightsLru.begin(), get()->m_lightsLru, it->second.second);
+		return it->second.first;
+	}
 
-	return (get()->m_lights[_seedHash] = std::make_shared<LightAllocation>(_seedHash));
+	// x_fulls is only ever taken inside x_lights, never around it
+	std::string dagDir;
+	DEV_GUARDED(get()->x_fulls)
+		dagDir = get()->m_dagDir;
+	LightType ret = std::make_shared<LightAllocation>(_seedHash, dagDir);
+	get()->m_lightsLru.push_front(_seedHash);
+	get()->m_lights[_seedHash] = std::make_pair(ret, get()->m_lightsLru.begin());
+	get()->m_lightsSize += ret->size;
+	get()->evictLights(_seedHash);
+	return ret;
 }
 
-EthashAux::LightAllocation::LightAllocation(uint256 const& _seedHash)
+void EthashAux::evictLights(uint256 const& _keep)
+{
+	if (m_lightsSize <= m_lightBudget)
+		return;
+
+	uint64_t height = m_chainHeight;
+	uint256 current = seedHash(height);
+	uint256 next = seedHash(height + epochLength());
+	LightsLru::iterator it = m_lightsLru.end();
+	while (m_lightsSize > m_lightBudget && it != m_lightsLru.begin())
+	{
+		--it;
+		if (*it == _keep || *it == current || *it == next)
+			continue;
+		// Holders of the shared pointer keep the cache alive until they are done.
+		Lights::iterator entry = m_lights.find(*it);
+		m_lightsSize -= entry->second.first->size;
+		m_lights.erase(entry);
+		it = m_lightsLru.erase(it);
+		++m_lightEvictions;
+	}
+}
+
+void EthashAux::setLightCacheBudget(uint64_t _bytes)
+{
+	WriteGuard l(get()->x_lights);
+	get()->m_lightBudget = _bytes;
+	get()->evictLights(uint256());
+}
+
+void EthashAux::setChainHeight(uint64_t _blockNumber)
+{
+	get()->m_chainHeight = _blockNumber;
+}
+
+uint64_t EthashAux::lightEvictions()
+{
+	return get()->m_lightEvictions;
+}
+
+uint64_t EthashAux::lightCacheUsage()
+{
+	ReadGuard l(get()->x_lights);
+	return get()->m_lightsSize;
+}
+
+void EthashAux::trimLightCache()
+{
+	WriteGuard l(get()->x_lights);
+	uint64_t budget = get()->m_lightBudget;
+	get()->m_lightBudget = 0;
+	get()->evictLights(uint256());
+	get()->m_lightBudget = budget;
+}
+
+uint64_t EthashAux::dagMemoryUsage()
+{
+	uint64_t ret = 0;
+	Guard l(get()->x_fulls);
+	for (Fulls::const_iterator it = get()->m_fulls.begin(); it != get()->m_fulls.end(); ++it)
+		if (!it->second.expired())
+			ret += ethash_get_datasize(number(it->first));
+	return ret;
+}
+
+EthashAux::LightAllocation::LightAllocation(uint256 const& _seedHash, std::string const& _dagDir)
 {
-	
 	uint64_t blockNumber = EthashAux::number(_seedHash);
-	light = ethash_light_new(blockNumber);
+	light = ethash_light_new_in(_dagDir.empty() ? NULL : _dagDir.c_str(), blockNumber);
 	if (!light)
-		BOOST_THROW_EXCEPTION(std::runtime_error("ethash_light_new()"));
+		BOOST_THROW_EXCEPTION(std::runtime_error("ethash_light_new_in()"));
 	size = ethash_get_cachesize(blockNumber);
 }
 
@@ -93,29 +204,78 @@ EthashAux::LightAllocation::~LightAllocation()
 	ethash_light_delete(light);
 }
 
-EthashAux::FullAllocation::FullAllocation(ethash_light_t _light, ethash_callback_t _cb)
+EthashAux::FullAllocation::FullAllocation(uint256 const& _seedHash, ethash_light_t _light, ethash_callback_t _cb, std::string const& _dagDir):
+	seedHash(_seedHash)
 {
 //	cdebug << "About to call ethash_full_new...";
-	full = ethash_full_new(_light, _cb);
+	full = ethash_full_new_in(_dagDir.empty() ? NULL : _dagDir.c_str(), _light, _cb);
 //	cdebug << "Called OK.";
 	if (!full)
 	{
 		throw std::runtime_error("ethash_full_new");
 	}
+	// Once per epoch: the device keeps its copy for as long as the node keeps this one
+	if (std::shared_ptr<EthashBackend> backend = EthashAux::backend())
+	{
+		try
+		{
+			if (backend->upload(seedHash, ethash_full_dag(full), ethash_full_dag_size(full)))
+				device = backend;
+		}
+		catch (std::exception const&)
+		{
+		}
+	}
 }
 
 EthashAux::FullAllocation::~FullAllocation()
 {
+	if (device)
+	{
+		try
+		{
+			device->release(seedHash);
+		}
+		catch (std::exception const&)
+		{
+		}
+	}
+	for (auto const& replica: replicas)
+		if (replica.second)
+			ethash_full_delete(replica.second);
 	ethash_full_delete(full);
-} 
+}
+
+ethash_full_t EthashAux::FullAllocation::replica(unsigned _node) const
+{
+	Guard l(x_replicas);
+	auto it = replicas.find(_node);
+	if (it != replicas.end())
+		return it->second;
+	// A failed copy is not retried, its threads scan the DAG itself
+	ethash_full_t ret = ethash_full_replicate(full);
+	replicas[_node] = ret;
+	return ret;
+}
 
-static std::function<int(unsigned)> s_dagCallback;
+// Progress callback of the DAG built on the current thread; each generator
+// runs on its own thread, so concurrent builds do not share a callback.
+static boost::thread_specific_ptr<std::function<int(unsigned)>> s_dagCallback;
 
 static int dagCallbackShim(unsigned _p)
 {
 	//clog(DAGChannel) << "Generating DAG file. Progress: " << toString(_p) << "%";
 	//LogPrintf("Generating DAG file. Progress: %u\n", _p);
-	return s_dagCallback ? s_dagCallback(_p) : 0;
+	std::function<int(unsigned)>* f = s_dagCallback.get();
+	return (f && *f) ? (*f)(_p) : 0;
+}
+
+void EthashAux::retainFull(FullType const& _full)
+{
+	m_retainedFulls.remove(_full);
+	m_retainedFulls.push_front(_full);
+	while (m_retainedFulls.size() > MAX_RETAINED_DAGS)
+		m_retainedFulls.pop_back();
 }
 
 EthashAux::FullType EthashAux::full(uint256 const& _seedHash, bool _createIfMissing, std::function<int(unsigned)> const& _f)
@@ -126,19 +286,26 @@ EthashAux::FullType EthashAux::full(uint256 const& _seedHash, bool _createIfMiss
 	DEV_GUARDED(get()->x_fulls)
 		if ((ret = get()->m_fulls[_seedHash].lock()))
 		{
-			get()->m_lastUsedFull = ret;
+			get()->retainFull(ret);
 			return ret;
 		}
 	
 	if (_createIfMissing || computeFull(_seedHash, false) == 100)
 	{
-		s_dagCallback = _f;
+		std::string dagDir;
+		DEV_GUARDED(get()->x_fulls)
+			dagDir = get()->m_dagDir;
+		s_dagCallback.reset(new std::function<int(unsigned)>(_f));
 //		cnote << "Loading from libethash...";
-		ret = std::make_shared<FullAllocation>(l->light, dagCallbackShim);
+		ret = std::make_shared<FullAllocation>(_seedHash, l->light, dagCallbackShim, dagDir);
 //		cnote << "Done loading.";
+		s_dagCallback.reset();
 
 		DEV_GUARDED(get()->x_fulls)
-			get()->m_fulls[_seedHash] = get()->m_lastUsedFull = ret;
+		{
+			get()->m_fulls[_seedHash] = ret;
+			get()->retainFull(ret);
+		}
 	}
 
 	return ret;
@@ -147,12 +314,9 @@ EthashAux::FullType EthashAux::full(uint256 const& _seedHash, bool _createIfMiss
 unsigned EthashAux::computeFull(uint256 const& _seedHash, bool _createIfMissing)
 {
 	Guard l(get()->x_fulls);
-	//boost::lock_guard<boost::mutex> lock(get()->x_fulls);
 	
-	uint64_t blockNumber;
-
 	try {
-		blockNumber = EthashAux::number(_seedHash);
+		EthashAux::number(_seedHash);
 	}
 	catch(const std::exception& e) {
 		return 0;
@@ -160,30 +324,77 @@ unsigned EthashAux::computeFull(uint256 const& _seedHash, bool _createIfMissing)
     
 	if (FullType ret = get()->m_fulls[_seedHash].lock())
 	{
-		get()->m_lastUsedFull = ret;
+		get()->retainFull(ret);
 		return 100;
 	}
 
-	if(!get()->m_fullGenerator){
-		//LogPrintf("Thread is null\n");
-	}
-	else if(get()->m_generatingFullNumber == NotGenerating && get()->m_fullGenerator->joinable()) {
-		get()->m_fullGenerator->detach();
-	}
+	Generators::const_iterator it = get()->m_generators.find(_seedHash);
+	if (it != get()->m_generators.end())
+		return *it->second;
 
-	if (_createIfMissing && (!get()->m_fullGenerator || !get()->m_fullGenerator->joinable()))
+	if (_createIfMissing && get()->m_generators.size() < MAX_DAG_GENERATORS)
 	{
-		get()->m_fullProgress = 0;
-		get()->m_generatingFullNumber = blockNumber / ETHASH_EPOCH_LENGTH * ETHASH_EPOCH_LENGTH;
-		get()->m_fullGenerator = std::unique_ptr<boost::thread>(new boost::thread([=](){
-			get()->full(_seedHash, true, [](unsigned p){ get()->m_fullProgress = p; return 0; });
+		std::shared_ptr<std::atomic<unsigned>> progress = std::make_shared<std::atomic<unsigned>>(0);
+		get()->m_generators[_seedHash] = progress;
+		uint64_t epoch = number(_seedHash) / epochLength();
+		boost::thread([=](){
+			try {
+				get()->full(_seedHash, true, [progress, epoch](unsigned p){
+					*progress = p;
+					TRACE2(ethash, dag_progress, epoch, p);
+					return 0;
+				});
+			}
+			catch (const std::exception& e) {
+				// Leave it to the next request to try again
+			}
 			//LogPrintf("Full DAG loaded");
-			get()->m_fullProgress = 0;
-			get()->m_generatingFullNumber = NotGenerating;
-		}));
+			Guard l(get()->x_fulls);
+			get()->m_generators.erase(_seedHash);
+		}).detach();
 	}
 
-	return (get()->m_generatingFullNumber == blockNumber) ? get()->m_fullProgress : 0;
+	return 0;
+}
+
+std::map<uint64_t, unsigned> EthashAux::dagProgress()
+{
+	std::map<uint64_t, unsigned> ret;
+	Guard l(get()->x_fulls);
+	for (Generators::const_iterator it = get()->m_generators.begin(); it != get()->m_generators.end(); ++it)
+		ret[number(it->first) / epochLength()] = *it->second;
+	return ret;
+}
+
+std::map<uint64_t, unsigned> EthashAux::dagStatus()
+{
+	std::map<uint64_t, unsigned> ret = dagProgress();
+	Guard l(get()->x_fulls);
+	for (Fulls::const_iterator it = get()->m_fulls.begin(); it != get()->m_fulls.end(); ++it)
+		if (!it->second.expired())
+			ret[number(it->first) / epochLength()] = 100;
+	return ret;
+}
+
+void EthashAux::setDagPrefetch(unsigned _percent)
+{
+	get()->m_dagPrefetch = std::min(_percent, 100u);
+}
+
+void EthashAux::setDagNuma(bool _numa)
+{
+	get()->m_dagNuma = _numa;
+}
+
+bool EthashAux::dagNuma()
+{
+	return get()->m_dagNuma;
+}
+
+bool EthashAux::shouldPrefetch(uint64_t _blockNumber)
+{
+	uint64_t length = epochLength();
+	return _blockNumber % length >= length * get()->m_dagPrefetch / 100;
 }
 
 void EthashAux::reverseUint256(uint256 const& hash, uint8_t* _array)
@@ -217,27 +428,127 @@ EthashProofOfWork::Result EthashAux::LightAllocation::compute(uint256 const& _he
 
 EthashProofOfWork::Result EthashAux::eval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t const& _nonce)
 {
-	DEV_GUARDED(get()->x_fulls)
-		if (FullType dag = get()->m_fulls[_seedHash].lock())
-			return dag->compute(_headerHash, _nonce);
-	try
+	TRACE2(ethash, eval, _headerHash.begin(), _nonce);
+	EthashAux* self = get();
+	EthashProofOfWork::Result result;
+	if (self->findEval(_seedHash, _headerHash, _nonce, result))
+		return result;
+	result = self->computeEval(_seedHash, _headerHash, _nonce);
+	// Failures are not cached, the next attempt may have the memory it lacked
+	if (result.msg.empty())
+		self->storeEval(_seedHash, _headerHash, _nonce, result);
+	return result;
+}
+
+std::vector<EthashProofOfWork::Result> EthashAux::evalBatch(uint256 const& _seedHash, std::vector<EthashInput> const& _inputs)
+{
+	EthashAux* self = get();
+	std::vector<EthashProofOfWork::Result> results(_inputs.size());
+	std::vector<EthashInput> misses;
+	std::vector<size_t> missIndex;
+	for (size_t i = 0; i < _inputs.size(); ++i)
+		if (!self->findEval(_seedHash, _inputs[i].headerHash, _inputs[i].nonce, results[i]))
+		{
+			misses.push_back(_inputs[i]);
+			missIndex.push_back(i);
+		}
+	if (misses.empty())
+		return results;
+
+	// A device launch only pays for itself over many inputs, which is why single evaluations stay on the CPU
+	std::vector<EthashProofOfWork::Result> computed;
+	bool offloaded = false;
+	if (std::shared_ptr<EthashBackend> backend = EthashAux::backend())
+	{
+		try
 		{
-			return EthashAux::get()->light(_seedHash)->compute(_headerHash, _nonce);
+			offloaded = backend->evalBatch(_seedHash, misses, computed) && computed.size() == misses.size();
 		}
-		catch(std::exception e)
+		catch (std::exception const&)
 		{
-			return EthashProofOfWork::Result{ uint256(), uint256(), e.what() };
+			offloaded = false;
 		}
+	}
+	for (size_t i = 0; i < misses.size(); ++i)
+	{
+		EthashProofOfWork::Result& result = results[missIndex[i]];
+		result = offloaded ? computed[i] : self->computeEval(_seedHash, misses[i].headerHash, misses[i].nonce);
+		if (result.msg.empty())
+			self->storeEval(_seedHash, misses[i].headerHash, misses[i].nonce, result);
+	}
+	return results;
 }
 
-ethash_return_value EthashAux::performEthash(int blockNumber, uint256 prevhash, uint64_t nonce)
+// The same header is checked as a header, as part of its block, when read back from disk and when
+// mined or submitted, each time at the cost of a light evaluation. Direct mapping needs no bookkeeping,
+// inputs that evict each other only cost what the cache saves.
+static size_t evalSlot(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _nonce)
 {
-	EthashAux::FullType dag;
-    uint256 seed = seedHash(blockNumber); //block number  - replace
+	return (_seedHash.GetCheapHash() ^ _headerHash.GetCheapHash() ^ _nonce) % ETHASH_EVAL_CACHE_SIZE;
+}
+
+bool EthashAux::findEval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _nonce, EthashProofOfWork::Result& o_result)
+{
+	DEV_GUARDED(x_evals)
+	{
+		if (m_evals.empty())
+			m_evals.resize(ETHASH_EVAL_CACHE_SIZE);
+		EvalEntry const& entry = m_evals[evalSlot(_seedHash, _headerHash, _nonce)];
+		if (entry.set && entry.nonce == _nonce && entry.headerHash == _headerHash && entry.seedHash == _seedHash)
+		{
+			++m_evalHits;
+			o_result = entry.result;
+			return true;
+		}
+	}
+	++m_evalMisses;
+	return false;
+}
+
+void EthashAux::storeEval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _nonce, EthashProofOfWork::Result const& _result)
+{
+	DEV_GUARDED(x_evals)
+	{
+		EvalEntry& entry = m_evals[evalSlot(_seedHash, _headerHash, _nonce)];
+		entry.seedHash = _seedHash;
+		entry.headerHash = _headerHash;
+		entry.nonce = _nonce;
+		entry.result = _result;
+		entry.set = true;
+	}
+}
+
+EthashProofOfWork::Result EthashAux::computeEval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _nonce)
+{
+	DEV_GUARDED(x_fulls)
+		if (FullType dag = m_fulls[_seedHash].lock())
+			return dag->compute(_headerHash, _nonce);
+	try
+	{
+		return light(_seedHash)->compute(_headerHash, _nonce);
+	}
+	catch(std::exception e)
+	{
+		return EthashProofOfWork::Result{ uint256(), uint256(), e.what() };
+	}
+}
 
+uint64_t EthashAux::evalCacheHits()
+{
+	return get()->m_evalHits;
+}
+
+uint64_t EthashAux::evalCacheMisses()
+{
+	return get()->m_evalMisses;
+}
+
+EthashAux::FullType EthashAux::readyFull(uint256 const& _seedHash)
+{
+	EthashAux::FullType dag;
 	while (/*!shouldStop() && */!dag)
         {
-            while (/*!shouldStop() &&*/ computeFull(seed, true) != 100) {
+            while (/*!shouldStop() &&*/ computeFull(_seedHash, true) != 100) {
                 #if defined(HAVE_WORKING_BOOST_SLEEP_FOR)
                     boost::this_thread::sleep_for(boost::chrono::milliseconds(500));
                 #elif defined(HAVE_WORKING_BOOST_SLEEP)
@@ -247,12 +558,86 @@ ethash_return_value EthashAux::performEthash(int blockNumber, uint256 prevhash,
                     #error missing boost sleep implementation
                 #endif
             }
-            dag = full(seed, false);
+            dag = full(_seedHash, false);
         }
-	
+	return dag;
+}
+
+ethash_return_value EthashAux::performEthash(int blockNumber, uint256 prevhash, uint64_t nonce)
+{
+	EthashAux::FullType dag = readyFull(seedHash(blockNumber));
+
 	ethash_h256_t reverse_hash;
 	reverseUint256(prevhash, reverse_hash.b);
-	return ethash_full_compute(dag->full, reverse_hash, nonce);
+	TRACE2(ethash, perform_start, blockNumber, nonce);
+	ethash_return_value ret = ethash_full_compute(dag->full, reverse_hash, nonce);
+	TRACE2(ethash, perform_end, blockNumber, nonce);
+	return ret;
+}
+
+bool EthashAux::FullAllocation::search(uint256 const& _headerHash, uint64_t _startNonce, uint64_t _count, uint256 const& _target, uint64_t& o_nonce, uint256& o_mixHash, ethash_full_t _copy) const
+{
+	// Both in ethash byte order, the result is compared most significant byte first
+	ethash_h256_t header;
+	ethash_h256_t boundary;
+	reverseUint256(_headerHash, header.b);
+	reverseUint256(_target, boundary.b);
+	if (device)
+	{
+		try
+		{
+			return device->search(seedHash, _headerHash, _startNonce, _count, _target, o_nonce, o_mixHash);
+		}
+		catch (std::exception const&)
+		{
+			// The device is lost or out of memory, the CPU scans the same nonces instead
+		}
+	}
+	ethash_return_value_t r;
+	if (!ethash_full_search(_copy ? _copy : full, header, _startNonce, _count, &boundary, &o_nonce, &r))
+		return false;
+	o_mixHash = uint256(r.mix_hash.getChars(true));
+	return true;
+}
+
+bool EthashAux::search(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _startNonce, uint64_t _count, uint256 const& _target, uint64_t& o_nonce, uint256& o_mixHash)
+{
+	// Keeps the DAG alive for the whole scan
+	FullType dag = readyFull(_seedHash);
+	return dag->search(_headerHash, _startNonce, _count, _target, o_nonce, o_mixHash);
+}
+
+void EthashAux::setDagThreads(unsigned _threads)
+{
+	ethash_set_dag_threads(_threads);
+}
+
+void EthashAux::setDagDir(std::string const& _dir)
+{
+	Guard l(get()->x_fulls);
+	get()->m_dagDir = _dir;
+}
+
+void EthashAux::setDagMemory(bool _file, bool _hugePages)
+{
+	ethash_set_dag_memory(_file, _hugePages);
+}
+
+const char* EthashAux::kernelName()
+{
+	return ethash_get_kernel_name();
+}
+
+void EthashAux::setBackend(std::shared_ptr<EthashBackend> const& _backend)
+{
+	Guard l(get()->x_backend);
+	get()->m_backend = _backend;
+}
+
+std::shared_ptr<EthashBackend> EthashAux::backend()
+{
+	Guard l(get()->x_backend);
+	return get()->m_backend;
 }
 
 uint256 EthashAux::getSeedHash(uint64_t block_number)
@@ -3,11 +3,15 @@
 #include "uint256.h"
 #include <stdbool.h>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
+#include <string>
 #include "crypto/ethash/ethashlib/ethash.h"
 #include "crypto/ethash/ethashExtension/Guards.h"
 #include "crypto/ethash/ethashExtension/Exceptions.h"
 #include "crypto/ethash/ethashWraper/EthashProofOfWork.h"
+#include "crypto/ethash/ethashWraper/EthashBackend.h"
 #include <boost/unordered_map.hpp>
 #include <boost/thread.hpp>
 
@@ -15,6 +19,29 @@
 
 using uint256s = std::vector<uint256>;
 
+/** Maximum number of DAG generation threads */
+static const int MAX_DAG_THREADS = 64;
+/** -dagthreads default (0 = number of cores) */
+static const int DEFAULT_DAG_THREADS = 0;
+/** -dagfile default: keep the DAG in a memory mapped file */
+static const bool DEFAULT_DAG_FILE = true;
+/** -daghugepages default */
+static const bool DEFAULT_DAG_HUGEPAGES = false;
+/** Maximum number of DAGs generated at the same time (current and next epoch) */
+static const unsigned MAX_DAG_GENERATORS = 2;
+/** Number of most recently used DAGs kept in memory */
+static const unsigned MAX_RETAINED_DAGS = 2;
+/** -dagnuma default: give the miner threads of every NUMA node their own copy of the DAG */
+static const bool DEFAULT_DAG_NUMA = false;
+/** -dagprefetch default: percentage of an epoch after which the next DAG is built */
+static const unsigned DEFAULT_DAG_PREFETCH = 90;
+/** -ethashlightcache default, in MiB */
+static const unsigned DEFAULT_ETHASH_LIGHT_CACHE = 128;
+/** Number of epochs with tabulated cache and DAG sizes, their seed hashes are precomputed */
+static const unsigned ETHASH_MAX_EPOCHS = 2048;
+/** Number of evaluations eval remembers, a header is checked several times on its way in */
+static const unsigned ETHASH_EVAL_CACHE_SIZE = 4096;
+
 class EthashAux
 {
 public:
@@ -23,7 +50,8 @@ public:
     static EthashAux* get();
 
     struct LightAllocation{
-        LightAllocation(uint256 const& _seedHash);
+        /// Maps the cache of @a _seedHash saved in @a _dagDir, or computes and saves it there.
+        LightAllocation(uint256 const& _seedHash, std::string const& _dagDir);
 		~LightAllocation();
         EthashProofOfWork::Result compute(uint256 const& _headerHash, uint64_t const& _nonce) const;
         ethash_light_t light;
@@ -31,26 +59,54 @@ public:
     };
 
     struct FullAllocation{
-        FullAllocation(ethash_light_t light, ethash_callback_t _cb);
+        /// Builds or loads the DAG of @a _seedHash and hands it to the offload backend, if one is set.
+        FullAllocation(uint256 const& _seedHash, ethash_light_t light, ethash_callback_t _cb, std::string const& _dagDir);
         ~FullAllocation();
         EthashProofOfWork::Result compute(uint256 const& _headerHash, uint64_t const& _nonce) const;
+        /// Scans @a _count nonces from @a _startNonce for a hash of at most @a _target.
+        /// @returns whether one was found, its nonce and mix hash go to @a o_nonce and @a o_mixHash.
+        /// Scans @a _copy instead of the DAG itself if given, see replica().
+        bool search(uint256 const& _headerHash, uint64_t _startNonce, uint64_t _count, uint256 const& _target, uint64_t& o_nonce, uint256& o_mixHash, ethash_full_t _copy = nullptr) const;
+        /// @returns the copy of the DAG on NUMA node @a _node, made by the first thread asking, which
+        /// should run on that node. Null if the copy could not be made.
+        ethash_full_t replica(unsigned _node) const;
+        uint256 seedHash;
         ethash_full_t full;
+        std::shared_ptr<EthashBackend> device; ///< the backend holding a copy of the DAG, if any
+        mutable Mutex x_replicas;
+        mutable std::map<unsigned, ethash_full_t> replicas; ///< guarded by x_replicas
     };
 
     using LightType = std::shared_ptr<LightAllocation>;
     using FullType = std::shared_ptr<FullAllocation>;
 
+    /// Sets the epoch length and fixed cache and DAG sizes of the chain, see ethash_set_params.
+    /// Caches, DAGs and evaluations of other parameters are dropped.
+    static void setParams(uint64_t _epochLength, uint64_t _cacheSize, uint64_t _fullSize);
+    /// @returns the number of blocks per epoch.
+    static uint64_t epochLength();
+
     static uint256 seedHash(unsigned _number);
     static uint64_t number(uint256 const& _seedHash);
     static LightType light(uint256 const& _seedHash);
 
-    static const uint64_t NotGenerating = (uint64_t)-1;
-    /// Kicks off generation of DAG for @a _seedHash and @returns false or @returns true if ready.
+    /// Kicks off generation of DAG for @a _seedHash unless it is already being built, and @returns its progress (100 if ready).
 	static unsigned computeFull(uint256 const& _seedHash, bool _createIfMissing = true);
+    /// @returns the progress of every DAG currently being generated, by epoch.
+    static std::map<uint64_t, unsigned> dagProgress();
+    /// @returns the progress of every DAG in memory or being generated, by epoch (100 when ready).
+    static std::map<uint64_t, unsigned> dagStatus();
     /// Kicks off generation of DAG for @a _blocknumber and blocks until ready; @returns result or empty pointer if not existing and _createIfMissing is false.
 	static FullType full(uint256 const& _seedHash, bool _createIfMissing = false, std::function<int(unsigned)> const& _f = std::function<int(unsigned)>());
 
+    /// Evaluates Ethash, or @returns the result of an earlier evaluation of the same inputs.
     static EthashProofOfWork::Result eval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t const& _nonce);
+    /// @returns the number of eval calls answered from the cache, and of those that were not.
+    static uint64_t evalCacheHits();
+    static uint64_t evalCacheMisses();
+    /// Evaluates all of @a _inputs in the epoch of @a _seedHash, on the offload backend if one is set.
+    /// Results come in the order of the inputs and are cached like those of eval().
+    static std::vector<EthashProofOfWork::Result> evalBatch(uint256 const& _seedHash, std::vector<EthashInput> const& _inputs);
 
     static uint256 getSeedHash(uint64_t block_number);
 
@@ -58,30 +114,112 @@ public:
 
     static ethash_return_value performEthash(int blockNumber, uint256 prevhash, uint64_t nonce);
 
+    /// Waits for the DAG of @a _seedHash and scans @a _count nonces from @a _startNonce with it, see FullAllocation::search.
+    static bool search(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _startNonce, uint64_t _count, uint256 const& _target, uint64_t& o_nonce, uint256& o_mixHash);
+
+    /// Sets the number of threads used to generate a full DAG.
+    static void setDagThreads(unsigned _threads);
+
+    /// Sets the directory of DAG files; empty for the default (~/.ethash).
+    static void setDagDir(std::string const& _dir);
+
+    /// Keeps new DAGs in a file or in anonymous memory, optionally on huge pages.
+    static void setDagMemory(bool _file, bool _hugePages);
+
+    /// @returns the name of the FNV mixing kernel selected for this CPU.
+    static const char* kernelName();
+
+    /// Offloads searches and batched evaluations to @a _backend from now on; null to use the CPU only.
+    /// DAGs built before keep being searched where they were.
+    static void setBackend(std::shared_ptr<EthashBackend> const& _backend);
+    /// @returns the backend set, null if none.
+    static std::shared_ptr<EthashBackend> backend();
+
+    /// Has the miner threads of every NUMA node scan their own copy of the DAG.
+    static void setDagNuma(bool _numa);
+    static bool dagNuma();
+
+    /// Sets the percentage of an epoch after which miners build the next DAG.
+    static void setDagPrefetch(unsigned _percent);
+    /// @returns whether the DAG of the epoch after @a _blockNumber should be built now.
+    static bool shouldPrefetch(uint64_t _blockNumber);
+
+    /// Sets the memory budget of the light cache LRU, in bytes.
+    static void setLightCacheBudget(uint64_t _bytes);
+    /// Records the chain height; its epoch and the next one are never evicted.
+    static void setChainHeight(uint64_t _blockNumber);
+    /// @returns the number of light caches evicted so far.
+    static uint64_t lightEvictions();
+    /// @returns the total size of the light caches currently held.
+    static uint64_t lightCacheUsage();
+    /// Evicts every light cache the budget allows to evict, leaving the budget as it is.
+    static void trimLightCache();
+    /// @returns the total size of the DAGs currently held, in memory or mapped from their files.
+    static uint64_t dagMemoryUsage();
+
 private:
     EthashAux() {};
 
     static EthashAux* s_this;
 
+    /// Kicks off generation of the DAG of @a _seedHash and blocks until it is ready.
+    static FullType readyFull(uint256 const& _seedHash);
+
+    /// Looks @a _headerHash and @a _nonce up in the evaluation cache, counting the hit or miss.
+    bool findEval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _nonce, EthashProofOfWork::Result& o_result);
+    /// Keeps a successful evaluation in the cache.
+    void storeEval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _nonce, EthashProofOfWork::Result const& _result);
+    /// Evaluates on the CPU, with the DAG if it is held and the light cache otherwise. Not cached.
+    EthashProofOfWork::Result computeEval(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _nonce);
+
+    /// Evicts least recently used light caches until the budget is met. Requires x_lights.
+    void evictLights(uint256 const& _keep);
+
     SharedMutex x_lights;
-    typedef boost::unordered_map<uint256, std::shared_ptr<LightAllocation>> Lights; 
+    typedef std::list<uint256> LightsLru;
+    typedef boost::unordered_map<uint256, std::pair<LightType, LightsLru::iterator>> Lights;
     Lights m_lights;
+    LightsLru m_lightsLru; ///< most recently used first
+    uint64_t m_lightsSize = 0;
+    uint64_t m_lightBudget = DEFAULT_ETHASH_LIGHT_CACHE << 20;
+    std::atomic<uint64_t> m_lightEvictions{0};
+    std::atomic<uint64_t> m_chainHeight{0};
+    uint64_t m_cacheSize = 0; ///< fixed sizes set by setParams, guarded by x_lights
+    uint64_t m_fullSize = 0;
+
+    /// Keeps @a _full among the most recently used DAGs. Requires x_fulls.
+    void retainFull(FullType const& _full);
 
     Mutex x_fulls;
     typedef boost::unordered_map<uint256, std::weak_ptr<FullAllocation>> Fulls; 
     Fulls m_fulls;
-    FullType m_lastUsedFull;
-    std::unique_ptr<boost::thread> m_fullGenerator;
-    uint64_t m_generatingFullNumber = NotGenerating;
-    unsigned m_fullProgress;
-
-    Mutex x_epochs;
-    typedef boost::unordered_map<uint256, unsigned> Epochs; 
-    Epochs m_epochs;
-    uint256s m_seedHashes;
+    std::list<FullType> m_retainedFulls; ///< most recently used first
+    typedef boost::unordered_map<uint256, std::shared_ptr<std::atomic<unsigned>>> Generators;
+    Generators m_generators; ///< progress of the DAGs being generated
+    std::atomic<unsigned> m_dagPrefetch{DEFAULT_DAG_PREFETCH};
+    std::atomic<bool> m_dagNuma{DEFAULT_DAG_NUMA};
+    std::string m_dagDir; ///< guarded by x_fulls
+
+    /// A successful evaluation; the seed hash stands for the epoch
+    struct EvalEntry
+    {
+        uint256 seedHash;
+        uint256 headerHash;
+        uint64_t nonce = 0;
+        EthashProofOfWork::Result result;
+        bool set = false;
+    };
+    Mutex x_evals;
+    std::vector<EvalEntry> m_evals; ///< indexed by a hash of the inputs, allocated on first use
+    std::atomic<uint64_t> m_evalHits{0};
+    std::atomic<uint64_t> m_evalMisses{0};
+
+    Mutex x_backend;
+    std::shared_ptr<EthashBackend> m_backend;
 };
 
+/// Seed and header hashes are Keccak outputs, their first 64 bits hash them as well as all 32 bytes would
 inline std::size_t hash_value(const uint256 &F)
 {
-	return boost::hash_range(F.begin(),F.end());
+	return F.GetCheapHash();
 }
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "uint256.h"
+#include "crypto/ethash/ethashWraper/EthashProofOfWork.h"
+
+/// The header hash and nonce of one Ethash evaluation, the epoch is given with the batch.
+struct EthashInput
+{
+	uint256 headerHash;
+	uint64_t nonce;
+};
+
+/**
+ * A device Ethash work is offloaded to, such as a GPU driven through OpenCL or CUDA.
+ * EthashAux hands it the DAG of every epoch it builds, once, then offers it the nonce
+ * searches of the miner and the batches of headers to verify. Whatever the device
+ * declines, or fails at by throwing, is done on the CPU as before.
+ */
+class EthashBackend
+{
+public:
+	virtual ~EthashBackend() {}
+
+	/// @returns the name of the device, for the log.
+	virtual std::string name() const = 0;
+
+	/// Copies the DAG of @a _seedHash to the device. @returns whether the device holds it,
+	/// searches with that DAG go to the device only if it does.
+	virtual bool upload(uint256 const& _seedHash, void const* _dag, uint64_t _size) = 0;
+	/// Frees the DAG of @a _seedHash, the node no longer keeps it either.
+	virtual void release(uint256 const& _seedHash) = 0;
+
+	/// Scans like EthashAux::FullAllocation::search, with a DAG uploaded before.
+	virtual bool search(uint256 const& _seedHash, uint256 const& _headerHash, uint64_t _startNonce, uint64_t _count, uint256 const& _target, uint64_t& o_nonce, uint256& o_mixHash) = 0;
+
+	/// Evaluates all of @a _inputs in the epoch of @a _seedHash, filling @a o_results in their order.
+	/// @returns false to leave the whole batch to the CPU.
+	virtual bool evalBatch(uint256 const& _seedHash, std::vector<EthashInput> const& _inputs, std::vector<EthashProofOfWork::Result>& o_results) = 0;
+};
@@ -13,6 +13,7 @@
 #define ETHASH_ACCESSES 64         //Hashimoto
 #define ETHASH_DAG_MAGIC_NUM_SIZE 8//Dag
 #define ETHASH_DAG_MAGIC_NUM 0xFEE1DEADBADDCAFE //Dag
+#define ETHASH_LIGHT_MAGIC_NUM 0xCAC4EDBADDCAFE11 //Light cache file
 
 #ifdef __cplusplus
 extern "C" {
@@ -61,6 +62,19 @@ ethash_light_t ethash_light_new(uint64_t block_number);
  */
 void ethash_light_delete(ethash_light_t light);
 
+/**
+ * Like @ref ethash_light_new() but keeps the cache in a file of @a dirname next
+ * to the DAG files. A cache written there before is mapped read only once its
+ * checksum matches, otherwise the cache is computed and saved for the next start,
+ * and the files of epochs older than the previous one are removed.
+ * Without DAG files, see @ref ethash_set_dag_memory(), this is ethash_light_new().
+ *
+ * @param dirname        The DAG directory, or NULL for the default one
+ * @param block_number   The block number for which to create the handler
+ * @return               Newly allocated ethash_light handler or NULL on failure
+ */
+ethash_light_t ethash_light_new_in(char const* dirname, uint64_t block_number);
+
 /**
  * Calculate the light client data
  *
@@ -91,12 +105,33 @@ ethash_return_value_t ethash_light_compute(
  */
 ethash_full_t ethash_full_new(ethash_light_t light, ethash_callback_t callback);
 
+/**
+ * Allocate and initialize a new ethash_full handler, keeping the DAG file in
+ * @a dirname. Once the DAG is ready, DAG files of epochs older than the
+ * previous one are removed from that directory.
+ *
+ * @param dirname       The DAG directory, or NULL for the default one
+ * @param light         The light handler containing the cache.
+ * @param callback      Check @ref ethash_full_new() for details.
+ * @return              Newly allocated ethash_full handler or NULL on failure
+ */
+ethash_full_t ethash_full_new_in(char const* dirname, ethash_light_t light, ethash_callback_t callback);
+
 /**
  * Frees a previously allocated ethash_full handler
  * @param full    The light handler to free
  */
 void ethash_full_delete(ethash_full_t full);
 
+/**
+ * The DAG of a full client handler, to copy it to another device
+ *
+ * @param full    The full client handler
+ * @return        The first byte of the DAG, ethash_full_dag_size() bytes long
+ */
+void const* ethash_full_dag(ethash_full_t full);
+uint64_t ethash_full_dag_size(ethash_full_t full);
+
 /**
  * Calculate the full client data
  *
@@ -111,6 +146,28 @@ ethash_return_value_t ethash_full_compute(
 	uint64_t nonce
 );
 
+/**
+ * Search a range of nonces for a result below a boundary
+ *
+ * @param full           The full client handler
+ * @param header_hash    The header hash to pack into the mix
+ * @param start_nonce    The first nonce to try
+ * @param count          The number of nonces to try
+ * @param boundary       The largest acceptable result, compared as a big endian number
+ * @param nonce          Set to the winning nonce
+ * @param ret            Set to the result of the winning nonce
+ * @return               true if a nonce was found
+ */
+bool ethash_full_search(
+	ethash_full_t full,
+	ethash_h256_t const header_hash,
+	uint64_t start_nonce,
+	uint64_t count,
+	ethash_h256_t const* boundary,
+	uint64_t* nonce,
+	ethash_return_value_t* ret
+);
+
 /**
  * Calculate the seedhash for a given block number
  */
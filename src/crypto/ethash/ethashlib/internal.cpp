@@ -10,16 +10,54 @@
 #include <math.h>
 #include "util.h"
 
+#include <algorithm>
+#include <atomic>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ETHASH_X86_DISPATCH 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ETHASH_NEON 1
+#include <arm_neon.h>
+#endif
+
+static std::atomic<uint64_t> epoch_length(ETHASH_EPOCH_LENGTH);
+static std::atomic<uint64_t> fixed_cache_size(0);
+static std::atomic<uint64_t> fixed_full_size(0);
+
+void ethash_set_params(uint64_t length, uint64_t cache_size, uint64_t full_size)
+{
+	assert(length > 0);
+	assert(cache_size % sizeof(node) == 0 && full_size % ETHASH_MIX_BYTES == 0);
+	epoch_length = length;
+	fixed_cache_size = cache_size;
+	fixed_full_size = full_size;
+}
+
+uint64_t ethash_get_epoch_length(void)
+{
+	return epoch_length;
+}
+
 uint64_t ethash_get_datasize(uint64_t const block_number)
 {
-	assert(block_number / ETHASH_EPOCH_LENGTH < 2048);
-	return dag_sizes[block_number / ETHASH_EPOCH_LENGTH];
+	if (uint64_t const size = fixed_full_size) {
+		return size;
+	}
+	assert(block_number / epoch_length < 2048);
+	return dag_sizes[block_number / epoch_length];
 }
 
 uint64_t ethash_get_cachesize(uint64_t const block_number)
 {
-	assert(block_number / ETHASH_EPOCH_LENGTH < 2048);
-	return cache_sizes[block_number / ETHASH_EPOCH_LENGTH];
+	if (uint64_t const size = fixed_cache_size) {
+		return size;
+	}
+	assert(block_number / epoch_length < 2048);
+	return cache_sizes[block_number / epoch_length];
 }
 
 // Follows Sergio's "STRICT MEMORY HARD HASHING FUNCTIONS" (2014)
@@ -60,6 +98,132 @@ static bool ethash_compute_cache_nodes(
 	return true;
 }
 
+// The FNV folding of 64-byte nodes into each other dominates both DAG item
+// calculation and the hashimoto loop, so it comes in scalar, AVX2 and NEON
+// flavours. The fastest one supported by the CPU is picked once at startup.
+
+typedef void (*ethash_dag_parents_fn)(node* ret, uint32_t node_index, node const* cache_nodes, uint32_t num_parent_nodes);
+typedef void (*ethash_mix_fn)(node* mix, node const* dag_nodes);
+
+struct ethash_kernel {
+	char const* name;
+	ethash_dag_parents_fn dag_parents; ///< fold ETHASH_DATASET_PARENTS cache nodes into ret
+	ethash_mix_fn mix;                 ///< fold MIX_NODES dag nodes into the mix
+};
+
+static void ethash_dag_parents_scalar(node* ret, uint32_t node_index, node const* cache_nodes, uint32_t num_parent_nodes)
+{
+	for (uint32_t i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
+		uint32_t parent_index = fnv_hash(node_index ^ i, ret->words[i % NODE_WORDS]) % num_parent_nodes;
+		node const *parent = &cache_nodes[parent_index];
+		for (unsigned w = 0; w != NODE_WORDS; ++w) {
+			ret->words[w] = fnv_hash(ret->words[w], parent->words[w]);
+		}
+	}
+}
+
+static void ethash_mix_scalar(node* mix, node const* dag_nodes)
+{
+	for (unsigned n = 0; n != MIX_NODES; ++n) {
+		for (unsigned w = 0; w != NODE_WORDS; ++w) {
+			mix[n].words[w] = fnv_hash(mix[n].words[w], dag_nodes[n].words[w]);
+		}
+	}
+}
+
+#if ETHASH_X86_DISPATCH
+__attribute__((target("avx2")))
+static void ethash_dag_parents_avx2(node* ret, uint32_t node_index, node const* cache_nodes, uint32_t num_parent_nodes)
+{
+	__m256i const fnv_prime = _mm256_set1_epi32(FNV_PRIME);
+	__m256i lo = _mm256_loadu_si256((__m256i const*)&ret->words[0]);
+	__m256i hi = _mm256_loadu_si256((__m256i const*)&ret->words[8]);
+	for (uint32_t i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
+		uint32_t parent_index = fnv_hash(node_index ^ i, ret->words[i % NODE_WORDS]) % num_parent_nodes;
+		node const *parent = &cache_nodes[parent_index];
+		lo = _mm256_xor_si256(_mm256_mullo_epi32(lo, fnv_prime), _mm256_loadu_si256((__m256i const*)&parent->words[0]));
+		hi = _mm256_xor_si256(_mm256_mullo_epi32(hi, fnv_prime), _mm256_loadu_si256((__m256i const*)&parent->words[8]));
+		// have to write to ret as values are used to compute index
+		_mm256_storeu_si256((__m256i*)&ret->words[0], lo);
+		_mm256_storeu_si256((__m256i*)&ret->words[8], hi);
+	}
+}
+
+__attribute__((target("avx2")))
+static void ethash_mix_avx2(node* mix, node const* dag_nodes)
+{
+	__m256i const fnv_prime = _mm256_set1_epi32(FNV_PRIME);
+	for (unsigned w = 0; w != MIX_WORDS; w += 8) {
+		__m256i m = _mm256_loadu_si256((__m256i const*)&mix->words[0] + w / 8);
+		__m256i d = _mm256_loadu_si256((__m256i const*)&dag_nodes->words[0] + w / 8);
+		_mm256_storeu_si256((__m256i*)&mix->words[0] + w / 8, _mm256_xor_si256(_mm256_mullo_epi32(m, fnv_prime), d));
+	}
+}
+#endif
+
+#if ETHASH_NEON
+static void ethash_dag_parents_neon(node* ret, uint32_t node_index, node const* cache_nodes, uint32_t num_parent_nodes)
+{
+	uint32x4_t const fnv_prime = vdupq_n_u32(FNV_PRIME);
+	uint32x4_t v0 = vld1q_u32(&ret->words[0]);
+	uint32x4_t v1 = vld1q_u32(&ret->words[4]);
+	uint32x4_t v2 = vld1q_u32(&ret->words[8]);
+	uint32x4_t v3 = vld1q_u32(&ret->words[12]);
+	for (uint32_t i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
+		uint32_t parent_index = fnv_hash(node_index ^ i, ret->words[i % NODE_WORDS]) % num_parent_nodes;
+		node const *parent = &cache_nodes[parent_index];
+		v0 = veorq_u32(vmulq_u32(v0, fnv_prime), vld1q_u32(&parent->words[0]));
+		v1 = veorq_u32(vmulq_u32(v1, fnv_prime), vld1q_u32(&parent->words[4]));
+		v2 = veorq_u32(vmulq_u32(v2, fnv_prime), vld1q_u32(&parent->words[8]));
+		v3 = veorq_u32(vmulq_u32(v3, fnv_prime), vld1q_u32(&parent->words[12]));
+		// have to write to ret as values are used to compute index
+		vst1q_u32(&ret->words[0], v0);
+		vst1q_u32(&ret->words[4], v1);
+		vst1q_u32(&ret->words[8], v2);
+		vst1q_u32(&ret->words[12], v3);
+	}
+}
+
+static void ethash_mix_neon(node* mix, node const* dag_nodes)
+{
+	uint32x4_t const fnv_prime = vdupq_n_u32(FNV_PRIME);
+	for (unsigned w = 0; w != MIX_WORDS; w += 4) {
+		uint32x4_t m = vld1q_u32(&mix->words[0] + w);
+		uint32x4_t d = vld1q_u32(&dag_nodes->words[0] + w);
+		vst1q_u32(&mix->words[0] + w, veorq_u32(vmulq_u32(m, fnv_prime), d));
+	}
+}
+#endif
+
+static struct ethash_kernel ethash_select_kernel(void)
+{
+	struct ethash_kernel kernel = { "scalar", ethash_dag_parents_scalar, ethash_mix_scalar };
+#if ETHASH_X86_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernel.name = "avx2";
+		kernel.dag_parents = ethash_dag_parents_avx2;
+		kernel.mix = ethash_mix_avx2;
+	}
+#elif ETHASH_NEON
+	kernel.name = "neon";
+	kernel.dag_parents = ethash_dag_parents_neon;
+	kernel.mix = ethash_mix_neon;
+#endif
+	return kernel;
+}
+
+static struct ethash_kernel const& ethash_active_kernel(void)
+{
+	static struct ethash_kernel const kernel = ethash_select_kernel();
+	return kernel;
+}
+
+char const* ethash_get_kernel_name(void)
+{
+	return ethash_active_kernel().name;
+}
+
 void ethash_calculate_dag_item(
 	node* const ret,
 	uint32_t node_index,
@@ -72,55 +236,132 @@ void ethash_calculate_dag_item(
 	memcpy(ret, init, sizeof(node));
 	ret->words[0] ^= node_index;
 	SHA3_512(ret->bytes, ret->bytes, sizeof(node));
-#if defined(_M_X64) && ENABLE_SSE
-	__m128i const fnv_prime = _mm_set1_epi32(FNV_PRIME);
-	__m128i xmm0 = ret->xmm[0];
-	__m128i xmm1 = ret->xmm[1];
-	__m128i xmm2 = ret->xmm[2];
-	__m128i xmm3 = ret->xmm[3];
-#elif defined(__MIC__)
-	__m512i const fnv_prime = _mm512_set1_epi32(FNV_PRIME);
-	__m512i zmm0 = ret->zmm[0];
-#endif
+	ethash_active_kernel().dag_parents(ret, node_index, cache_nodes, num_parent_nodes);
+	SHA3_512(ret->bytes, ret->bytes, sizeof(node));
+}
 
-	for (uint32_t i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
-		uint32_t parent_index = fnv_hash(node_index ^ i, ret->words[i % NODE_WORDS]) % num_parent_nodes;
-		node const *parent = &cache_nodes[parent_index];
+// Computes full_nodes[begin, end). Items are seeded and finalised four at a
+// time so that the Keccak permutations of neighbouring items run interleaved.
+static void ethash_calculate_dag_range(
+	node* const full_nodes,
+	uint32_t begin,
+	uint32_t end,
+	ethash_light_t const light
+)
+{
+	uint32_t num_parent_nodes = (uint32_t) (light->cache_size / sizeof(node));
+	node const* cache_nodes = (node const *) light->cache;
+	ethash_dag_parents_fn const dag_parents = ethash_active_kernel().dag_parents;
+	uint32_t n = begin;
+	for (; end - n >= 4; n += 4) {
+		uint8_t* items[4];
+		for (uint32_t i = 0; i < 4; ++i) {
+			node* const ret = &full_nodes[n + i];
+			memcpy(ret, &cache_nodes[(n + i) % num_parent_nodes], sizeof(node));
+			ret->words[0] ^= n + i;
+			items[i] = ret->bytes;
+		}
+		SHA3_512_x4(items, items, sizeof(node));
+		for (uint32_t i = 0; i < 4; ++i) {
+			dag_parents(&full_nodes[n + i], n + i, cache_nodes, num_parent_nodes);
+		}
+		SHA3_512_x4(items, items, sizeof(node));
+	}
+	for (; n != end; ++n) {
+		ethash_calculate_dag_item(&full_nodes[n], n, light);
+	}
+}
+
+static std::atomic<unsigned> dag_threads(1);
 
-#if defined(_M_X64) && ENABLE_SSE
-		{
-			xmm0 = _mm_mullo_epi32(xmm0, fnv_prime);
-			xmm1 = _mm_mullo_epi32(xmm1, fnv_prime);
-			xmm2 = _mm_mullo_epi32(xmm2, fnv_prime);
-			xmm3 = _mm_mullo_epi32(xmm3, fnv_prime);
-			xmm0 = _mm_xor_si128(xmm0, parent->xmm[0]);
-			xmm1 = _mm_xor_si128(xmm1, parent->xmm[1]);
-			xmm2 = _mm_xor_si128(xmm2, parent->xmm[2]);
-			xmm3 = _mm_xor_si128(xmm3, parent->xmm[3]);
-
-			// have to write to ret as values are used to compute index
-			ret->xmm[0] = xmm0;
-			ret->xmm[1] = xmm1;
-			ret->xmm[2] = xmm2;
-			ret->xmm[3] = xmm3;
+void ethash_set_dag_threads(unsigned threads)
+{
+	dag_threads = threads ? threads : 1;
+}
+
+unsigned ethash_get_dag_threads(void)
+{
+	return dag_threads;
+}
+
+// Shared state of one parallel DAG build. Workers claim DAG_CHUNK_NODES sized
+// ranges from next_node and account finished nodes in done_nodes.
+struct dag_build_state {
+	node* full_nodes;
+	uint32_t max_n;
+	ethash_light_t light;
+	std::atomic<uint32_t> next_node;
+	std::atomic<uint32_t> done_nodes;
+	std::atomic<bool> abort;
+};
+
+static const uint32_t DAG_CHUNK_NODES = 4096;
+
+// Computes chunks until the range is exhausted or the build is aborted.
+// Returns after at most one chunk when single_chunk is set, so that the
+// calling thread can interleave progress reporting with its own work.
+static bool ethash_dag_worker(struct dag_build_state* state, bool single_chunk)
+{
+	while (!state->abort) {
+		uint32_t const begin = state->next_node.fetch_add(DAG_CHUNK_NODES);
+		if (begin >= state->max_n) {
+			return false;
+		}
+		uint32_t const end = std::min(begin + DAG_CHUNK_NODES, state->max_n);
+		ethash_calculate_dag_range(state->full_nodes, begin, end, state->light);
+		state->done_nodes += end - begin;
+		if (single_chunk) {
+			return true;
 		}
-		#elif defined(__MIC__)
-		{
-			zmm0 = _mm512_mullo_epi32(zmm0, fnv_prime);
+	}
+	return false;
+}
+
+static bool ethash_compute_full_data_parallel(
+	node* full_nodes,
+	uint32_t max_n,
+	ethash_light_t const light,
+	ethash_callback_t callback,
+	unsigned threads
+)
+{
+	struct dag_build_state state;
+	state.full_nodes = full_nodes;
+	state.max_n = max_n;
+	state.light = light;
+	state.next_node = 0;
+	state.done_nodes = 0;
+	state.abort = false;
+
+	if (callback && callback(0) != 0) {
+		return false;
+	}
+
+	// The calling thread is one of the workers; it is also the only one
+	// invoking the callback, which is not required to be thread safe.
+	boost::thread_group workers;
+	for (unsigned i = 1; i < threads; ++i) {
+		workers.create_thread(boost::bind(&ethash_dag_worker, &state, false));
+	}
 
-			// have to write to ret as values are used to compute index
-			zmm0 = _mm512_xor_si512(zmm0, parent->zmm[0]);
-			ret->zmm[0] = zmm0;
+	unsigned reported = 0;
+	while (ethash_dag_worker(&state, true)) {
+		if (!callback) {
+			continue;
 		}
-		#else
-		{
-			for (unsigned w = 0; w != NODE_WORDS; ++w) {
-				ret->words[w] = fnv_hash(ret->words[w], parent->words[w]);
+		unsigned const progress = (unsigned)((uint64_t)state.done_nodes * 100 / max_n);
+		if (progress != reported) {
+			reported = progress;
+			if (callback(progress) != 0) {
+				state.abort = true;
 			}
 		}
-#endif
 	}
-	SHA3_512(ret->bytes, ret->bytes, sizeof(node));
+	workers.join_all();
+	if (state.abort) {
+		return false;
+	}
+	return !callback || reported == 100 || callback(100) == 0;
 }
 
 bool ethash_compute_full_data(
@@ -136,18 +377,19 @@ bool ethash_compute_full_data(
 	}
 	uint32_t const max_n = (uint32_t)(full_size / sizeof(node));
 	node* full_nodes = (node*)mem; //C++
-	double const progress_change = 1.0f / max_n;
-	double progress = 0.0f;
-	// now compute full nodes
-	for (uint32_t n = 0; n != max_n; ++n) {
+	unsigned const threads = ethash_get_dag_threads();
+	if (threads > 1) {
+		return ethash_compute_full_data_parallel(full_nodes, max_n, light, callback, threads);
+	}
+	// now compute full nodes, one percent of the dataset at a time
+	uint32_t const step = std::max<uint32_t>(max_n / 100, 1);
+	for (uint32_t n = 0; n < max_n; n += step) {
 		if (callback &&
-			n % (max_n / 100) == 0 &&
-			callback((unsigned int)(ceil(progress * 100.0f))) != 0) {
+			callback((unsigned int)(ceil(n * 100.0 / max_n))) != 0) {
 
 			return false;
 		}
-		progress += progress_change;
-		ethash_calculate_dag_item(&(full_nodes[n]), n, light);
+		ethash_calculate_dag_range(full_nodes, n, std::min(n + step, max_n), light);
 	}
 	return true;
 }
@@ -186,45 +428,17 @@ static bool ethash_hash(
 	for (unsigned i = 0; i != ETHASH_ACCESSES; ++i) {
 		uint32_t const index = fnv_hash(s_mix->words[0] ^ i, mix->words[i % MIX_WORDS]) % num_full_pages;
 
-		for (unsigned n = 0; n != MIX_NODES; ++n) {
-			node const* dag_node;
-			node tmp_node;
-			if (full_nodes) {
-				dag_node = &full_nodes[MIX_NODES * index + n];
-			} else {
-				ethash_calculate_dag_item(&tmp_node, index * MIX_NODES + n, light);
-				dag_node = &tmp_node;
-			}
-
-#if defined(_M_X64) && ENABLE_SSE
-			{
-				__m128i fnv_prime = _mm_set1_epi32(FNV_PRIME);
-				__m128i xmm0 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[0]);
-				__m128i xmm1 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[1]);
-				__m128i xmm2 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[2]);
-				__m128i xmm3 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[3]);
-				mix[n].xmm[0] = _mm_xor_si128(xmm0, dag_node->xmm[0]);
-				mix[n].xmm[1] = _mm_xor_si128(xmm1, dag_node->xmm[1]);
-				mix[n].xmm[2] = _mm_xor_si128(xmm2, dag_node->xmm[2]);
-				mix[n].xmm[3] = _mm_xor_si128(xmm3, dag_node->xmm[3]);
+		node const* dag_nodes;
+		node tmp_nodes[MIX_NODES];
+		if (full_nodes) {
+			dag_nodes = &full_nodes[MIX_NODES * index];
+		} else {
+			for (unsigned n = 0; n != MIX_NODES; ++n) {
+				ethash_calculate_dag_item(&tmp_nodes[n], index * MIX_NODES + n, light);
 			}
-			#elif defined(__MIC__)
-			{
-				// __m512i implementation via union
-				//	Each vector register (zmm) can store sixteen 32-bit integer numbers
-				__m512i fnv_prime = _mm512_set1_epi32(FNV_PRIME);
-				__m512i zmm0 = _mm512_mullo_epi32(fnv_prime, mix[n].zmm[0]);
-				mix[n].zmm[0] = _mm512_xor_si512(zmm0, dag_node->zmm[0]);
-			}
-			#else
-			{
-				for (unsigned w = 0; w != NODE_WORDS; ++w) {
-					mix[n].words[w] = fnv_hash(mix[n].words[w], dag_node->words[w]);
-				}
-			}
-#endif
+			dag_nodes = tmp_nodes;
 		}
-
+		ethash_active_kernel().mix(mix, dag_nodes);
 	}
 
 // Workaround for a GCC regression which causes a bogus -Warray-bounds warning.
@@ -267,7 +481,7 @@ ethash_h256_t ethash_get_seedhash(uint64_t block_number)
 {
 	ethash_h256_t ret;
 	ethash_h256_reset(&ret);
-	uint64_t const epochs = block_number / ETHASH_EPOCH_LENGTH;
+	uint64_t const epochs = block_number / epoch_length;
 	for (uint32_t i = 0; i < epochs; ++i)
 		SHA3_256(&ret, (uint8_t*)&ret, 32);
 	return ret;
@@ -319,12 +533,54 @@ ethash_light_t ethash_light_new(uint64_t block_number)
 
 void ethash_light_delete(ethash_light_t light)
 {
-	if (light->cache) {
+	if (light->map) {
+		munmap(light->map, light->map_size);
+	} else if (light->cache) {
 		free(light->cache);
 	}
 	free(light);
 }
 
+// Maps a light cache saved before, if its header and checksum match. Hashing the
+// cache once is several times cheaper than the rounds that compute it.
+static bool ethash_light_load(struct ethash_light* ret, FILE* f, uint64_t cache_size)
+{
+	ethash_light_header_t header;
+	size_t found_size;
+	int fd;
+	if (!ethash_file_size(f, &found_size) || found_size != sizeof(header) + cache_size ||
+		fread(&header, sizeof(header), 1, f) != 1 ||
+		header.magic != ETHASH_LIGHT_MAGIC_NUM || header.cache_size != cache_size ||
+		(fd = ethash_fileno(f)) == -1) {
+		return false;
+	}
+	char* mmapped_data = (char*)mmap(NULL, found_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mmapped_data == MAP_FAILED) {
+		return false;
+	}
+	ethash_h256_t checksum;
+	SHA3_256(&checksum, (uint8_t*)mmapped_data + sizeof(header), cache_size);
+	if (memcmp(&checksum, &header.checksum, sizeof(checksum)) != 0) {
+		munmap(mmapped_data, found_size);
+		return false;
+	}
+	ret->map = mmapped_data;
+	ret->map_size = found_size;
+	ret->cache = mmapped_data + sizeof(header);
+	ret->cache_size = cache_size;
+	return true;
+}
+
+static bool ethash_light_save(char const* dirname, ethash_h256_t const seedhash, ethash_light_t light)
+{
+	ethash_light_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = ETHASH_LIGHT_MAGIC_NUM;
+	header.cache_size = light->cache_size;
+	SHA3_256(&header.checksum, (uint8_t const*)light->cache, light->cache_size);
+	return ethash_io_write_light(dirname, seedhash, &header, sizeof(header), light->cache, light->cache_size);
+}
+
 ethash_return_value_t ethash_light_compute_internal(
 	ethash_light_t light,
 	uint64_t full_size,
@@ -350,7 +606,82 @@ ethash_return_value_t ethash_light_compute(
 	return ethash_light_compute_internal(light, full_size, header_hash, nonce);
 }
 
-static bool ethash_mmap(struct ethash_full* ret, FILE* f)
+static std::atomic<bool> dag_file(true);
+static std::atomic<bool> dag_hugepages(false);
+
+void ethash_set_dag_memory(bool file, bool hugepages)
+{
+	dag_file = file;
+	dag_hugepages = hugepages;
+}
+
+bool ethash_get_dag_file(void)
+{
+	return dag_file;
+}
+
+// Files are named by revision and seed alone, so fixed test sizes stay in memory.
+static bool ethash_use_files(void)
+{
+	return dag_file && !fixed_cache_size && !fixed_full_size;
+}
+
+ethash_light_t ethash_light_new_in(char const* dirname, uint64_t block_number)
+{
+	char strbuf[256];
+	if (!ethash_use_files()) {
+		return ethash_light_new(block_number);
+	}
+	if (!dirname) {
+		if (!ethash_get_default_dirname(strbuf, 256)) {
+			return ethash_light_new(block_number);
+		}
+		dirname = strbuf;
+	}
+	ethash_h256_t seedhash = ethash_get_seedhash(block_number);
+	uint64_t cache_size = ethash_get_cachesize(block_number);
+	FILE* f = ethash_io_open_light(dirname, seedhash);
+	if (f) {
+		struct ethash_light* ret = static_cast<ethash_light*>(calloc(sizeof(*ret), 1));
+		// the mapping outlives the file stream
+		bool loaded = ret && ethash_light_load(ret, f, cache_size);
+		fclose(f);
+		if (loaded) {
+			ret->block_number = block_number;
+			return ret;
+		}
+		free(ret);
+	}
+	ethash_light_t ret = ethash_light_new_internal(cache_size, &seedhash);
+	if (!ret) {
+		return NULL;
+	}
+	ret->block_number = block_number;
+	if (ethash_light_save(dirname, seedhash, ret)) {
+		ethash_io_remove_stale_lights(dirname, block_number / epoch_length);
+	}
+	return ret;
+}
+
+#define ETHASH_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Random 128 byte reads all over the DAG miss the TLB on almost every access
+// with 4 KiB pages; ask for transparent huge pages where the kernel has them.
+static void ethash_advise_hugepages(void* addr, size_t size)
+{
+#if defined(MADV_HUGEPAGE)
+	if (dag_hugepages) {
+		madvise(addr, size, MADV_HUGEPAGE);
+	}
+#else
+	(void)addr;
+	(void)size;
+#endif
+}
+
+// Complete DAGs are mapped read only, so that several processes can share
+// one copy in the page cache.
+static bool ethash_mmap(struct ethash_full* ret, FILE* f, bool writable)
 {
 	int fd;
 	char* mmapped_data;
@@ -359,10 +690,11 @@ static bool ethash_mmap(struct ethash_full* ret, FILE* f)
 	if ((fd = ethash_fileno(ret->file)) == -1) {
 		return false;
 	}
+	ret->map_size = (size_t)ret->file_size + ETHASH_DAG_MAGIC_NUM_SIZE;
 	mmapped_data = (char*)mmap(
 		NULL,
-		(size_t)ret->file_size + ETHASH_DAG_MAGIC_NUM_SIZE,
-		PROT_READ | PROT_WRITE,
+		ret->map_size,
+		writable ? PROT_READ | PROT_WRITE : PROT_READ,
 		MAP_SHARED,
 		fd,
 		0
@@ -370,10 +702,79 @@ static bool ethash_mmap(struct ethash_full* ret, FILE* f)
 	if (mmapped_data == MAP_FAILED) {
 		return false;
 	}
+	ethash_advise_hugepages(mmapped_data, ret->map_size);
+	ret->map = mmapped_data;
 	ret->data = (node*)(mmapped_data + ETHASH_DAG_MAGIC_NUM_SIZE);
 	return true;
 }
 
+// Backs the DAG with anonymous memory, preferring explicit huge pages.
+static bool ethash_map_memory(struct ethash_full* ret)
+{
+	void* data = MAP_FAILED;
+	ret->file = NULL;
+	ret->map_size = (size_t)ret->file_size;
+#if defined(MAP_HUGETLB)
+	if (dag_hugepages) {
+		size_t const huge_size = (ret->map_size + ETHASH_HUGE_PAGE_SIZE - 1) / ETHASH_HUGE_PAGE_SIZE * ETHASH_HUGE_PAGE_SIZE;
+		data = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED) {
+			ret->map_size = huge_size;
+		}
+	}
+#endif
+	if (data == MAP_FAILED) {
+		data = mmap(NULL, ret->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED) {
+			return false;
+		}
+		ethash_advise_hugepages(data, ret->map_size);
+	}
+	ret->map = data;
+	ret->data = (node*)data;
+	return true;
+}
+
+static ethash_full_t ethash_full_new_memory(
+	uint64_t full_size,
+	ethash_light_t const light,
+	ethash_callback_t callback
+)
+{
+	struct ethash_full* ret = static_cast<ethash_full*>(calloc(sizeof(*ret), 1));
+	if (!ret) {
+		return NULL;
+	}
+	ret->file_size = (size_t)full_size;
+	if (!ethash_map_memory(ret)) {
+		ETHASH_CRITICAL("mmap failure()");
+		free(ret);
+		return NULL;
+	}
+	if (!ethash_compute_full_data(ret->data, full_size, light, callback)) {
+		ETHASH_CRITICAL("Failure at computing DAG data.");
+		munmap(ret->map, ret->map_size);
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+ethash_full_t ethash_full_replicate(ethash_full_t full)
+{
+	struct ethash_full* ret = static_cast<ethash_full*>(calloc(sizeof(*ret), 1));
+	if (!ret) {
+		return NULL;
+	}
+	ret->file_size = full->file_size;
+	if (!ethash_map_memory(ret)) {
+		free(ret);
+		return NULL;
+	}
+	memcpy(ret->data, full->data, (size_t)full->file_size);
+	return ret;
+}
+
 ethash_full_t ethash_full_new_internal(
 	char const* dirname,
 	ethash_h256_t const seed_hash,
@@ -384,6 +785,10 @@ ethash_full_t ethash_full_new_internal(
 {
 	struct ethash_full* ret;
 	FILE *f = NULL;
+	char* pending_name = NULL;
+	if (!dirname) {
+		return ethash_full_new_memory(full_size, light, callback);
+	}
 	node* tmp_nodes; //C
 	uint64_t const magic_num =ETHASH_DAG_MAGIC_NUM; //C++ compiler
 	//ret = calloc(sizeof(*ret), 1);
@@ -393,13 +798,13 @@ ethash_full_t ethash_full_new_internal(
 	}
 	ret->file_size = (size_t)full_size;
 
-	enum ethash_io_rc err = ethash_io_prepare(dirname, seed_hash, &f, (size_t)full_size, false);
+	enum ethash_io_rc err = ethash_io_prepare(dirname, seed_hash, &f, (size_t)full_size, false, &pending_name);
 	if (err == ETHASH_IO_FAIL)
 		goto fail_free_full;
 
 	if (err == ETHASH_IO_MEMO_SIZE_MISMATCH) {
 		// if a DAG of same filename but unexpected size is found, silently force new file creation
-		if (ethash_io_prepare(dirname, seed_hash, &f, (size_t)full_size, true) != ETHASH_IO_MEMO_MISMATCH) {
+		if (ethash_io_prepare(dirname, seed_hash, &f, (size_t)full_size, true, &pending_name) != ETHASH_IO_MEMO_MISMATCH) {
 			ETHASH_CRITICAL("Could not recreate DAG file after finding existing DAG with unexpected size.");
 			goto fail_free_full;
 		}
@@ -408,7 +813,7 @@ ethash_full_t ethash_full_new_internal(
 	}
 
 	if (err == ETHASH_IO_MEMO_MISMATCH || err == ETHASH_IO_MEMO_MATCH) {
-		if (!ethash_mmap(ret, f)) {
+		if (!ethash_mmap(ret, f, err == ETHASH_IO_MEMO_MISMATCH)) {
 			ETHASH_CRITICAL("mmap failure()");
 			goto fail_close_file;
 		}
@@ -452,42 +857,72 @@ ethash_full_t ethash_full_new_internal(
 		ETHASH_CRITICAL("Could not flush memory mapped data to DAG file. Insufficient space?");
 		goto fail_free_full_data;
 	}
+	// our mapping stays valid even if another process published the DAG first
+	if (!ethash_io_publish(dirname, seed_hash, pending_name)) {
+		ETHASH_CRITICAL("Could not move the new DAG file into place.");
+	}
 	return ret;
 
 fail_free_full_data:
 	// could check that munmap(..) == 0 but even if it did not can't really do anything here
-	munmap(ret->data, (size_t)full_size);
+	munmap(ret->map, ret->map_size);
 #if defined(__MIC__)
 	_mm_free(ret->data);
 #endif
 fail_close_file:
 	fclose(ret->file);
+	if (pending_name) {
+		ethash_io_discard(pending_name);
+	}
 fail_free_full:
 	free(ret);
 	return NULL;
 }
 
 ethash_full_t ethash_full_new(ethash_light_t light, ethash_callback_t callback)
+{
+	return ethash_full_new_in(NULL, light, callback);
+}
+
+ethash_full_t ethash_full_new_in(char const* dirname, ethash_light_t light, ethash_callback_t callback)
 {
 	char strbuf[256];
-	if (!ethash_get_default_dirname(strbuf, 256)) {
-		return NULL;
+	bool const file = ethash_use_files();
+	if (file && !dirname) {
+		if (!ethash_get_default_dirname(strbuf, 256)) {
+			return NULL;
+		}
+		dirname = strbuf;
 	}
 	uint64_t full_size = ethash_get_datasize(light->block_number);
 	ethash_h256_t seedhash = ethash_get_seedhash(light->block_number);
-	return ethash_full_new_internal(strbuf, seedhash, full_size, light, callback);
+	ethash_full_t ret = ethash_full_new_internal(file ? dirname : NULL, seedhash, full_size, light, callback);
+	if (ret && file) {
+		ethash_io_remove_stale(dirname, light->block_number / epoch_length);
+	}
+	return ret;
 }
 
 void ethash_full_delete(ethash_full_t full)
 {
 	// could check that munmap(..) == 0 but even if it did not can't really do anything here
-	munmap(full->data, (size_t)full->file_size);
+	munmap(full->map, full->map_size);
 	if (full->file) {
 		fclose(full->file);
 	}
 	free(full);
 }
 
+void const* ethash_full_dag(ethash_full_t full)
+{
+	return full->data;
+}
+
+uint64_t ethash_full_dag_size(ethash_full_t full)
+{
+	return full->file_size;
+}
+
 ethash_return_value_t ethash_full_compute(
 	ethash_full_t full,
 	ethash_h256_t const header_hash,
@@ -506,4 +941,28 @@ ethash_return_value_t ethash_full_compute(
 		ret.success = false;
 	}
 	return ret;
+}
+
+bool ethash_full_search(
+	ethash_full_t full,
+	ethash_h256_t const header_hash,
+	uint64_t start_nonce,
+	uint64_t count,
+	ethash_h256_t const* boundary,
+	uint64_t* nonce,
+	ethash_return_value_t* ret
+)
+{
+	for (uint64_t i = 0; i < count; ++i) {
+		if (!ethash_hash(ret, (node const*)full->data, NULL, full->file_size, header_hash, start_nonce + i)) {
+			ret->success = false;
+			return false;
+		}
+		if (memcmp(ret->result.b, boundary->b, 32) <= 0) {
+			ret->success = true;
+			*nonce = start_nonce + i;
+			return true;
+		}
+	}
+	return false;
 }
\ No newline at end of file
@@ -33,8 +33,18 @@ struct ethash_light {
 	void* cache;
 	uint64_t cache_size;
 	uint64_t block_number;
+	void* map;       ///< The mapped light cache file the cache points into, if any
+	size_t map_size;
 };
 
+/// Leads a light cache file. 64 bytes, so that the nodes after it stay aligned.
+typedef struct ethash_light_header {
+	uint64_t magic;
+	uint64_t cache_size;
+	ethash_h256_t checksum;   ///< SHA3-256 of the cache
+	uint8_t reserved[16];
+} ethash_light_header_t;
+
 /**
  * Allocate and initialize a new ethash_light handler. Internal version
  *
@@ -46,15 +56,36 @@ struct ethash_light {
  */
 ethash_light_t ethash_light_new_internal(uint64_t cache_size, ethash_h256_t const* seed);
 
+/**
+ * Calculate the light client data. Internal version.
+ *
+ * @param light          The light client handler
+ * @param full_size      The size of the full data in bytes.
+ * @param header_hash    The header hash to pack into the mix
+ * @param nonce          The nonce to pack into the mix
+ * @return               The resulting hash.
+ */
+ethash_return_value_t ethash_light_compute_internal(
+	ethash_light_t light,
+	uint64_t full_size,
+	ethash_h256_t const header_hash,
+	uint64_t nonce
+);
+
 struct ethash_full {
 	FILE* file;
 	uint64_t file_size;
 	node* data;
+	void* map;       ///< start of the mapping holding data
+	size_t map_size; ///< length of that mapping
 };
 
 /**
  * Allocate and initialize a new ethash_full handler. Internal version.
  *
+ * If @a dirname is NULL the DAG lives in anonymous memory only and is
+ * recomputed on every call.
+ *
  * @param dirname        The directory in which to put the DAG file.
  * @param seedhash       The seed hash of the block. Used in the DAG file naming.
  * @param full_size      The size of the full data in bytes.
@@ -77,6 +108,16 @@ ethash_full_t ethash_full_new_internal(
 	ethash_callback_t callback
 );
 
+/**
+ * Copy the DAG of @a full into anonymous memory touched first by the calling
+ * thread, which Linux places on the NUMA node that thread runs on.
+ *
+ * @param full          The DAG to copy
+ * @return              A handler computing and searching like @a full, to be
+ *                      freed with @ref ethash_full_delete(), or NULL on failure
+ */
+ethash_full_t ethash_full_replicate(ethash_full_t full);
+
 void ethash_calculate_dag_item(
 	node* const ret,
 	uint32_t node_index,
@@ -93,6 +134,8 @@ uint64_t ethash_get_cachesize(uint64_t const block_number);
  * @param full_size   The size of the full data in bytes
  * @param cache       A cache object to use in the calculation
  * @param callback    The callback function. Check @ref ethash_full_new() for details.
+ *                    It is only ever invoked from the calling thread, also when
+ *                    the DAG is computed by several threads.
  * @return            true if all went fine and false for invalid parameters
  */
 bool ethash_compute_full_data(
@@ -102,6 +145,60 @@ bool ethash_compute_full_data(
 	ethash_callback_t callback
 );
 
+/**
+ * @return            Name of the FNV mixing kernel selected for this CPU
+ *                    ("scalar", "avx2" or "neon")
+ */
+char const* ethash_get_kernel_name(void);
+
+/**
+ * Set the number of threads used by @ref ethash_compute_full_data()
+ *
+ * @param threads     Number of DAG worker threads, including the calling thread.
+ *                    0 and 1 both compute the DAG on the calling thread only.
+ */
+void ethash_set_dag_threads(unsigned threads);
+
+/**
+ * @return            The number of threads used by @ref ethash_compute_full_data()
+ */
+unsigned ethash_get_dag_threads(void);
+
+/**
+ * Choose how the memory of a full DAG is backed.
+ *
+ * @param file        If false @ref ethash_full_new() keeps the DAG in anonymous
+ *                    memory instead of mapping a DAG file.
+ * @param hugepages   Back the DAG with huge pages: explicit ones (MAP_HUGETLB)
+ *                    for in-memory DAGs when available, transparent ones
+ *                    (MADV_HUGEPAGE) otherwise. Best effort; falls back to
+ *                    normal pages silently.
+ */
+void ethash_set_dag_memory(bool file, bool hugepages);
+
+/**
+ * @return            Whether @ref ethash_full_new() maps a DAG file
+ */
+bool ethash_get_dag_file(void);
+
+/**
+ * Replace the mainnet epoch length and size tables, for test chains.
+ *
+ * @param epoch_length  Blocks per epoch.
+ * @param cache_size    Light cache size of every epoch in bytes, a multiple of
+ *                      the node size; 0 for the mainnet table.
+ * @param full_size     DAG size of every epoch in bytes, a multiple of
+ *                      ETHASH_MIX_BYTES; 0 for the mainnet table.
+ *                      With fixed sizes caches and DAGs are never kept in
+ *                      files, whose names would not tell them from mainnet ones.
+ */
+void ethash_set_params(uint64_t epoch_length, uint64_t cache_size, uint64_t full_size);
+
+/**
+ * @return            The number of blocks per epoch
+ */
+uint64_t ethash_get_epoch_length(void);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -19,23 +19,52 @@
  * @date 2015
  */
 #include "crypto/ethash/ethashlib/io.h"
+#include "crypto/ethash/ethashlib/sha3.h"
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#if defined(_WIN32)
+#include <process.h>
+#define ethash_getpid _getpid
+#else
+#include <unistd.h>
+#define ethash_getpid getpid
+#endif
+
+static char* ethash_io_dag_filename(char const* dirname, ethash_h256_t const* seedhash)
+{
+	char mutable_name[DAG_MUTABLE_NAME_MAX_SIZE];
+	if (!ethash_io_mutable_name(ETHASH_REVISION, seedhash, mutable_name)) {
+		return NULL;
+	}
+	return ethash_io_create_filename(dirname, mutable_name, strlen(mutable_name));
+}
+
+static char* ethash_io_light_filename(char const* dirname, ethash_h256_t const* seedhash)
+{
+	char light_name[DAG_MUTABLE_NAME_MAX_SIZE + 1];
+	if (!ethash_io_light_name(ETHASH_REVISION, seedhash, light_name)) {
+		return NULL;
+	}
+	return ethash_io_create_filename(dirname, light_name, strlen(light_name));
+}
 
 enum ethash_io_rc ethash_io_prepare(
 	char const* dirname,
 	ethash_h256_t const seedhash,
 	FILE** output_file,
 	uint64_t file_size,
-	bool force_create
+	bool force_create,
+	char** pending_name
 )
 {
-	char mutable_name[DAG_MUTABLE_NAME_MAX_SIZE];
 	enum ethash_io_rc ret = ETHASH_IO_FAIL;
     char* tmpfile; //C++
+    char* newfile; //C++
+    size_t newfile_size;
 	// reset errno before io calls
 	errno = 0;
+	*pending_name = NULL;
 
 	// assert directory exists
 	if (!ethash_mkdir(dirname)) {
@@ -43,8 +72,7 @@ enum ethash_io_rc ethash_io_prepare(
 		goto end;
 	}
 
-	ethash_io_mutable_name(ETHASH_REVISION, &seedhash, mutable_name);
-	tmpfile = ethash_io_create_filename(dirname, mutable_name, strlen(mutable_name)); //C++
+	tmpfile = ethash_io_dag_filename(dirname, &seedhash); //C++
 	if (!tmpfile) {
 		ETHASH_CRITICAL("Could not create the full DAG pathname");
 		goto end;
@@ -52,8 +80,9 @@ enum ethash_io_rc ethash_io_prepare(
 
 	FILE *f;
 	if (!force_create) {
-		// try to open the file
-		f = ethash_fopen(tmpfile, "rb+");
+		// try to open the file; a complete DAG is only ever read, so that
+		// several processes can map the same file
+		f = ethash_fopen(tmpfile, "rb");
 		if (f) {
 			size_t found_size;
 			if (!ethash_file_size(f, &found_size)) {
@@ -85,28 +114,31 @@ enum ethash_io_rc ethash_io_prepare(
 		}
 	}
 	
-	// file does not exist, will need to be created
-	f = ethash_fopen(tmpfile, "wb+");
-	if (!f) {
-		ETHASH_CRITICAL("Could not create DAG file: \"%s\"", tmpfile);
-		goto free_memo;
-	}
-	// make sure it's of the proper size
-	if (ethash_fseek(f, file_size + ETHASH_DAG_MAGIC_NUM_SIZE - 1, SEEK_SET) != 0) {
-		fclose(f);
-		ETHASH_CRITICAL("Could not seek to the end of DAG file: \"%s\". Insufficient space?", tmpfile);
+	// file does not exist, will need to be created. It is built under a
+	// process specific name and renamed once complete, so that no other
+	// process ever maps a half written DAG.
+	newfile_size = strlen(tmpfile) + 1 + 10 + 1;
+	newfile = (char*)malloc(newfile_size);
+	if (!newfile) {
 		goto free_memo;
 	}
-	if (fputc('\n', f) == EOF) {
-		fclose(f);
-		ETHASH_CRITICAL("Could not write in the end of DAG file: \"%s\". Insufficient space?", tmpfile);
+	snprintf(newfile, newfile_size, "%s.%u", tmpfile, (unsigned)ethash_getpid());
+	f = ethash_fopen(newfile, "wb+");
+	if (!f) {
+		ETHASH_CRITICAL("Could not create DAG file: \"%s\"", newfile);
+		free(newfile);
 		goto free_memo;
 	}
-	if (fflush(f) != 0) {
+	// make sure it's of the proper size
+	if (ethash_fseek(f, file_size + ETHASH_DAG_MAGIC_NUM_SIZE - 1, SEEK_SET) != 0 ||
+		fputc('\n', f) == EOF ||
+		fflush(f) != 0) {
 		fclose(f);
-		ETHASH_CRITICAL("Could not flush at end of DAG file: \"%s\". Insufficient space?", tmpfile);
+		ETHASH_CRITICAL("Could not extend DAG file: \"%s\". Insufficient space?", newfile);
+		ethash_io_discard(newfile);
 		goto free_memo;
 	}
+	*pending_name = newfile;
 	ret = ETHASH_IO_MEMO_MISMATCH;
 	goto set_file;
 
@@ -118,3 +150,110 @@ free_memo:
 end:
 	return ret;
 }
+
+bool ethash_io_publish(char const* dirname, ethash_h256_t const seedhash, char* pending_name)
+{
+	bool ret = false;
+	char* name = ethash_io_dag_filename(dirname, &seedhash);
+	if (name) {
+#if defined(_WIN32)
+		// rename() does not replace existing files on Windows
+		remove(name);
+#endif
+		ret = rename(pending_name, name) == 0;
+		free(name);
+	}
+	if (!ret) {
+		remove(pending_name);
+	}
+	free(pending_name);
+	return ret;
+}
+
+void ethash_io_discard(char* pending_name)
+{
+	remove(pending_name);
+	free(pending_name);
+}
+
+FILE* ethash_io_open_light(char const* dirname, ethash_h256_t const seedhash)
+{
+	char* name = ethash_io_light_filename(dirname, &seedhash);
+	if (!name) {
+		return NULL;
+	}
+	FILE* f = ethash_fopen(name, "rb");
+	free(name);
+	return f;
+}
+
+bool ethash_io_write_light(
+	char const* dirname,
+	ethash_h256_t const seedhash,
+	void const* header,
+	size_t header_size,
+	void const* cache,
+	uint64_t cache_size
+)
+{
+	if (!ethash_mkdir(dirname)) {
+		return false;
+	}
+	char* name = ethash_io_light_filename(dirname, &seedhash);
+	if (!name) {
+		return false;
+	}
+	bool ret = false;
+	size_t pending_size = strlen(name) + 1 + 10 + 1;
+	char* pending_name = (char*)malloc(pending_size);
+	if (pending_name) {
+		snprintf(pending_name, pending_size, "%s.%u", name, (unsigned)ethash_getpid());
+		FILE* f = ethash_fopen(pending_name, "wb");
+		if (f) {
+			bool written = fwrite(header, header_size, 1, f) == 1 &&
+				fwrite(cache, (size_t)cache_size, 1, f) == 1;
+			written = fclose(f) == 0 && written;
+			if (written) {
+#if defined(_WIN32)
+				// rename() does not replace existing files on Windows
+				remove(name);
+#endif
+				ret = rename(pending_name, name) == 0;
+			}
+			if (!ret) {
+				remove(pending_name);
+			}
+		}
+		free(pending_name);
+	}
+	free(name);
+	return ret;
+}
+
+static void ethash_io_remove_before(
+	char const* dirname,
+	uint64_t epoch,
+	char* (*filename)(char const*, ethash_h256_t const*)
+)
+{
+	ethash_h256_t seedhash;
+	memset(&seedhash, 0, sizeof(seedhash));
+	for (uint64_t e = 0; e + 1 < epoch; ++e) {
+		char* name = filename(dirname, &seedhash);
+		if (name) {
+			remove(name);
+			free(name);
+		}
+		SHA3_256(&seedhash, (uint8_t*)&seedhash, 32);
+	}
+}
+
+void ethash_io_remove_stale(char const* dirname, uint64_t epoch)
+{
+	ethash_io_remove_before(dirname, epoch, ethash_io_dag_filename);
+}
+
+void ethash_io_remove_stale_lights(char const* dirname, uint64_t epoch)
+{
+	ethash_io_remove_before(dirname, epoch, ethash_io_light_filename);
+}
@@ -18,6 +18,7 @@ extern "C" {
 // the seedhash and last 1 is for the null terminating character
 // Reference: https://github.com/ethereum/wiki/wiki/Ethash-DAG
 #define DAG_MUTABLE_NAME_MAX_SIZE (6 + 10 + 1 + 16 + 1)
+// Light cache files are named alike with the 6 characters of "light-R" less one
 /// Possible return values of @see ethash_io_prepare
 enum ethash_io_rc {
 	ETHASH_IO_FAIL = 0,           ///< There has been an IO failure
@@ -61,6 +62,10 @@ enum ethash_io_rc {
  * @param[in] file_size      The size that the DAG file should have on disk
  * @param[out] force_create  If true then there is no check to see if the file
  *                           already exists
+ * @param[out] pending_name  Set if a new file was created. New DAGs are written
+ *                           under a temporary name, which has to be passed to
+ *                           @ref ethash_io_publish() once complete or to
+ *                           @ref ethash_io_discard() on failure.
  * @return                   For possible return values @see enum ethash_io_rc
  */
 enum ethash_io_rc ethash_io_prepare(
@@ -68,7 +73,58 @@ enum ethash_io_rc ethash_io_prepare(
 	ethash_h256_t const seedhash,
 	FILE** output_file,
 	uint64_t file_size,
-	bool force_create
+	bool force_create,
+	char** pending_name
+);
+
+/**
+ * Moves a completed DAG created by @ref ethash_io_prepare() to its final name
+ * @param dirname        The directory name of the DAG
+ * @param seedhash       The seedhash of the DAG
+ * @param pending_name   The temporary name. It is freed by this function.
+ * @return               true if the DAG is now available to other processes
+ */
+bool ethash_io_publish(char const* dirname, ethash_h256_t const seedhash, char* pending_name);
+
+/**
+ * Removes an incomplete DAG created by @ref ethash_io_prepare()
+ * @param pending_name   The temporary name. It is freed by this function.
+ */
+void ethash_io_discard(char* pending_name);
+
+/**
+ * Deletes the DAG files of all epochs before @a epoch - 1 from @a dirname
+ * @param dirname        The directory holding the DAG files
+ * @param epoch          The epoch of the newest DAG in use
+ */
+void ethash_io_remove_stale(char const* dirname, uint64_t epoch);
+
+/**
+ * Deletes the light cache files of all epochs before @a epoch - 1 from @a dirname
+ * @param dirname        The directory holding the light cache files
+ * @param epoch          The epoch of the newest light cache saved
+ */
+void ethash_io_remove_stale_lights(char const* dirname, uint64_t epoch);
+
+/**
+ * Opens the light cache file of @a seedhash in @a dirname for reading
+ * @return               The open file or NULL if there is none
+ */
+FILE* ethash_io_open_light(char const* dirname, ethash_h256_t const seedhash);
+
+/**
+ * Writes a light cache file of @a seedhash to @a dirname: @a header followed by
+ * @a cache. The file is written under a temporary name first, so that other
+ * processes only ever open complete caches.
+ * @return               true if the file is now available
+ */
+bool ethash_io_write_light(
+	char const* dirname,
+	ethash_h256_t const seedhash,
+	void const* header,
+	size_t header_size,
+	void const* cache,
+	uint64_t cache_size
 );
 
 /**
@@ -161,6 +217,19 @@ static inline bool ethash_io_mutable_name(
     return snprintf(output, DAG_MUTABLE_NAME_MAX_SIZE, "full-R%u-%016" PRIx64, revision, hash) >= 0;
 }
 
+static inline bool ethash_io_light_name(
+	uint32_t revision,
+	ethash_h256_t const* seed_hash,
+	char* output
+)
+{
+    uint64_t hash = *((uint64_t*)seed_hash);
+#if LITTLE_ENDIAN == BYTE_ORDER
+    hash = ethash_swap_u64(hash);
+#endif
+    return snprintf(output, DAG_MUTABLE_NAME_MAX_SIZE + 1, "light-R%u-%016" PRIx64, revision, hash) >= 0;
+}
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -12,8 +12,13 @@ struct ethash_h256;
 #define decsha3(bits) \
 	int sha3_##bits(uint8_t*, size_t, uint8_t const*, size_t);
 
+#define decsha3_x4(bits) \
+	int sha3_##bits##_x4(uint8_t* const*, size_t, uint8_t const* const*, size_t);
+
 decsha3(256)
 decsha3(512)
+decsha3_x4(256)
+decsha3_x4(512)
 
 static inline void SHA3_256(struct ethash_h256 const* ret, uint8_t const* data, size_t const size)
 {
@@ -25,6 +30,15 @@ static inline void SHA3_512(uint8_t* ret, uint8_t const* data, size_t const size
 	sha3_512(ret, 64, data, size);
 }
 
+/**
+ * Hash four equally sized inputs at once. Uses four interleaved Keccak
+ * states when the CPU supports AVX2. Outputs may alias their inputs.
+ */
+static inline void SHA3_512_x4(uint8_t* const ret[4], uint8_t const* const data[4], size_t const size)
+{
+	sha3_512_x4(ret, 64, data, size);
+}
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,181 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+
+#include <string.h>
+
+Num3072::Num3072(const unsigned char data[BYTE_SIZE])
+{
+    FromBytes(data);
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    memset(limbs + 1, 0, (LIMBS - 1) * sizeof(limb_t));
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] < (limb_t)(0 - MAX_PRIME_DIFF))
+        return false;
+    for (int i = 1; i < LIMBS; i++)
+        if (limbs[i] != (limb_t)-1)
+            return false;
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtract the modulus by adding MAX_PRIME_DIFF and dropping 2^3072
+    if (!IsOverflow())
+        return;
+    double_limb_t t = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; i++) {
+        t += limbs[i];
+        limbs[i] = (limb_t)t;
+        t >>= LIMB_BITS;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t tmp[2 * LIMBS];
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            double_limb_t t = (double_limb_t)limbs[i] * a.limbs[j] + (i ? tmp[i + j] : 0) + carry;
+            tmp[i + j] = (limb_t)t;
+            carry = t >> LIMB_BITS;
+        }
+        tmp[i + LIMBS] = (limb_t)carry;
+    }
+
+    // 2^3072 is MAX_PRIME_DIFF modulo the prime, so the upper half folds onto the lower one
+    double_limb_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t t = (double_limb_t)tmp[i + LIMBS] * MAX_PRIME_DIFF + tmp[i] + carry;
+        limbs[i] = (limb_t)t;
+        carry = t >> LIMB_BITS;
+    }
+    // And so does what carries past the top limb, until nothing does
+    while (carry) {
+        double_limb_t t = carry * MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && t; i++) {
+            t += limbs[i];
+            limbs[i] = (limb_t)t;
+            t >>= LIMB_BITS;
+        }
+        carry = t;
+    }
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // this^(p - 2), four bits of the exponent at a time
+    Num3072 table[16];
+    table[1] = *this;
+    for (int k = 2; k < 16; k++) {
+        table[k] = table[k - 1];
+        table[k].Multiply(*this);
+    }
+
+    Num3072 r;
+    for (int i = LIMBS - 1; i >= 0; i--) {
+        // The limbs of p - 2
+        limb_t e = i == 0 ? (limb_t)(0 - MAX_PRIME_DIFF - 2) : (limb_t)-1;
+        for (int nShift = LIMB_BITS - 4; nShift >= 0; nShift -= 4) {
+            if (i != LIMBS - 1 || nShift != LIMB_BITS - 4)
+                for (int k = 0; k < 4; k++)
+                    r.Multiply(r);
+            unsigned int nBits = (e >> nShift) & 15;
+            if (nBits)
+                r.Multiply(table[nBits]);
+        }
+    }
+    return r;
+}
+
+void Num3072::ToBytes(unsigned char out[BYTE_SIZE]) const
+{
+    Num3072 reduced(*this);
+    reduced.FullReduce();
+    for (int i = 0; i < LIMBS; i++)
+        for (size_t n = 0; n < sizeof(limb_t); n += 4)
+            WriteLE32(out + sizeof(limb_t) * i + n, (uint32_t)(reduced.limbs[i] >> (8 * n)));
+}
+
+void Num3072::FromBytes(const unsigned char data[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++) {
+        limbs[i] = 0;
+        for (size_t n = 0; n < sizeof(limb_t); n += 4)
+            limbs[i] |= (limb_t)ReadLE32(data + sizeof(limb_t) * i + n) << (8 * n);
+    }
+}
+
+Num3072 CMuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char seed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(seed);
+    unsigned char expanded[Num3072::BYTE_SIZE];
+    for (uint32_t n = 0; n < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; n++) {
+        unsigned char counter[4];
+        WriteLE32(counter, n);
+        CSHA512().Write(seed, sizeof(seed)).Write(counter, sizeof(counter)).Finalize(expanded + n * CSHA512::OUTPUT_SIZE);
+    }
+    return Num3072(expanded);
+}
+
+CMuHash3072& CMuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::operator*=(const CMuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+CMuHash3072& CMuHash3072::operator/=(const CMuHash3072& other)
+{
+    numerator.Multiply(other.denominator);
+    denominator.Multiply(other.numerator);
+    return *this;
+}
+
+void CMuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE]) const
+{
+    Num3072 result = denominator.GetInverse();
+    result.Multiply(numerator);
+    unsigned char data[Num3072::BYTE_SIZE];
+    result.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(hash);
+}
+
+void CMuHash3072::GetState(unsigned char out[STATE_SIZE]) const
+{
+    numerator.ToBytes(out);
+    denominator.ToBytes(out + Num3072::BYTE_SIZE);
+}
+
+void CMuHash3072::SetState(const unsigned char data[STATE_SIZE])
+{
+    numerator.FromBytes(data);
+    denominator.FromBytes(data + Num3072::BYTE_SIZE);
+}
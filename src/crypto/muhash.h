@@ -0,0 +1,86 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An integer modulo the prime 2^3072 - 1103717, in limbs of 64 bits where the compiler
+ * has a 128-bit type to multiply them into, else of 32 bits; least significant first */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+#endif
+    static const int LIMB_BITS = sizeof(limb_t) * 8;
+    static const size_t BYTE_SIZE = 384;
+    static const int LIMBS = BYTE_SIZE / sizeof(limb_t);
+    //! 2^3072 minus the modulus
+    static const limb_t MAX_PRIME_DIFF = 1103717;
+
+    //! Below 2^3072, but not always below the modulus
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    /** The little-endian number in data */
+    explicit Num3072(const unsigned char data[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    /** The inverse, by Fermat's little theorem; takes a few milliseconds */
+    Num3072 GetInverse() const;
+    /** The value reduced below the modulus, little-endian */
+    void ToBytes(unsigned char out[BYTE_SIZE]) const;
+    void FromBytes(const unsigned char data[BYTE_SIZE]);
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+};
+
+/**
+ * A hash of a set, MuHash3072: the product modulo a prime of the hashes of its
+ * elements. Adding and removing elements takes one multiplication each, in any
+ * order, so the hash of a large set can be kept up to date as it changes.
+ *
+ * Elements are mapped to a number by expanding their SHA256 hash with SHA512 in
+ * counter mode. Removals are multiplied into a denominator, which is only
+ * inverted by Finalize.
+ */
+class CMuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+    static const size_t STATE_SIZE = 2 * Num3072::BYTE_SIZE;
+
+    /** The hash of the empty set */
+    CMuHash3072() {}
+
+    CMuHash3072& Insert(const unsigned char* data, size_t len);
+    CMuHash3072& Remove(const unsigned char* data, size_t len);
+    /** The union of two disjoint sets */
+    CMuHash3072& operator*=(const CMuHash3072& other);
+    /** The difference with a subset */
+    CMuHash3072& operator/=(const CMuHash3072& other);
+
+    void Finalize(unsigned char hash[OUTPUT_SIZE]) const;
+
+    void GetState(unsigned char out[STATE_SIZE]) const;
+    void SetState(const unsigned char data[STATE_SIZE]);
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -7,6 +7,20 @@
 #include "crypto/common.h"
 
 #include <string.h>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_X86_DISPATCH 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define SHA256_ARM_DISPATCH 1
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
 
 // Internal implementation code.
 namespace
@@ -127,7 +141,395 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** The round constants, for the transforms that loop over the rounds. */
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** A transform of consecutive 64-byte chunks, the hardware ones keep the state in registers between them. */
+typedef void (*TransformType)(uint32_t* s, const unsigned char* chunk, size_t blocks);
+
+void TransformBlocks(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        Transform(s, chunk);
+        chunk += 64;
+    }
+}
+
+/** Load word j of the 64-byte blocks of every lane, lane i is the block at in + 64 * i. */
+void inline LoadLanes(uint32_t* words, const unsigned char* in, int nLanes, int j)
+{
+    for (int i = 0; i < nLanes; i++)
+        words[i] = ReadBE32(in + 64 * i + 4 * j);
+}
+
+/** Double-SHA256 of one 64-byte message. */
+void TransformD64(unsigned char* out, const unsigned char* in, TransformType transform)
+{
+    uint32_t s[8];
+    unsigned char buf[64] = {0};
+    Initialize(s);
+    transform(s, in, 1);
+    // The padding of a 64-byte message fills a block of its own
+    buf[0] = 0x80;
+    buf[62] = 0x02;
+    transform(s, buf, 1);
+    // The 32-byte hash and its padding fit in one block
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buf + 4 * i, s[i]);
+    memset(buf + 32, 0, 32);
+    buf[32] = 0x80;
+    buf[62] = 0x01;
+    Initialize(s);
+    transform(s, buf, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
 } // namespace sha256
+
+#if SHA256_X86_DISPATCH
+/** Four double-SHA256s at once, one in each 32-bit lane of an SSE2 register. */
+namespace sha256d64_sse2
+{
+#define SHA256_SSE2 __attribute__((target("sse2")))
+
+SHA256_SSE2 inline __m128i K(uint32_t x) { return _mm_set1_epi32(x); }
+SHA256_SSE2 inline __m128i Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+SHA256_SSE2 inline __m128i Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+SHA256_SSE2 inline __m128i Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+SHA256_SSE2 inline __m128i And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+SHA256_SSE2 inline __m128i ShR(__m128i x, int n) { return _mm_srli_epi32(x, n); }
+SHA256_SSE2 inline __m128i Rot(__m128i x, int n) { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+
+SHA256_SSE2 inline __m128i Ch(__m128i x, __m128i y, __m128i z) { return Xor(z, And(x, Xor(y, z))); }
+SHA256_SSE2 inline __m128i Maj(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), And(z, Or(x, y))); }
+SHA256_SSE2 inline __m128i Sigma0(__m128i x) { return Xor(Xor(Rot(x, 2), Rot(x, 13)), Rot(x, 22)); }
+SHA256_SSE2 inline __m128i Sigma1(__m128i x) { return Xor(Xor(Rot(x, 6), Rot(x, 11)), Rot(x, 25)); }
+SHA256_SSE2 inline __m128i sigma0(__m128i x) { return Xor(Xor(Rot(x, 7), Rot(x, 18)), ShR(x, 3)); }
+SHA256_SSE2 inline __m128i sigma1(__m128i x) { return Xor(Xor(Rot(x, 17), Rot(x, 19)), ShR(x, 10)); }
+
+/** One SHA-256 transformation of every lane. w holds the message words and is overwritten by the schedule. */
+SHA256_SSE2 void Transform(__m128i* s, __m128i* w)
+{
+    __m128i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] = Add(Add(w[i & 15], sigma1(w[(i + 14) & 15])), Add(w[(i + 9) & 15], sigma0(w[(i + 1) & 15])));
+        __m128i t1 = Add(Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), K(sha256::K[i]))), w[i & 15]);
+        __m128i t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g; g = f; f = e; e = Add(d, t1); d = c; c = b; b = a; a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+}
+
+SHA256_SSE2 void TransformD64_4way(unsigned char* out, const unsigned char* in)
+{
+    uint32_t init[8], words[4];
+    sha256::Initialize(init);
+    __m128i s[8], t[8], w[16];
+    for (int i = 0; i < 8; i++)
+        s[i] = t[i] = K(init[i]);
+    // Every input block is read before any output is written, so they may overlap
+    for (int j = 0; j < 16; j++) {
+        sha256::LoadLanes(words, in, 4, j);
+        w[j] = _mm_set_epi32(words[3], words[2], words[1], words[0]);
+    }
+    Transform(s, w);
+    w[0] = K(0x80000000);
+    for (int j = 1; j < 15; j++)
+        w[j] = K(0);
+    w[15] = K(512);
+    Transform(s, w);
+    for (int j = 0; j < 8; j++)
+        w[j] = s[j];
+    w[8] = K(0x80000000);
+    for (int j = 9; j < 15; j++)
+        w[j] = K(0);
+    w[15] = K(256);
+    Transform(t, w);
+    for (int j = 0; j < 8; j++) {
+        _mm_storeu_si128((__m128i*)words, t[j]);
+        for (int i = 0; i < 4; i++)
+            WriteBE32(out + 32 * i + 4 * j, words[i]);
+    }
+}
+
+#undef SHA256_SSE2
+} // namespace sha256d64_sse2
+
+/** Eight double-SHA256s at once, one in each 32-bit lane of an AVX2 register. */
+namespace sha256d64_avx2
+{
+#define SHA256_AVX2 __attribute__((target("avx2")))
+
+SHA256_AVX2 inline __m256i K(uint32_t x) { return _mm256_set1_epi32(x); }
+SHA256_AVX2 inline __m256i Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+SHA256_AVX2 inline __m256i Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+SHA256_AVX2 inline __m256i Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+SHA256_AVX2 inline __m256i And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+SHA256_AVX2 inline __m256i ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
+SHA256_AVX2 inline __m256i Rot(__m256i x, int n) { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+
+SHA256_AVX2 inline __m256i Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+SHA256_AVX2 inline __m256i Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+SHA256_AVX2 inline __m256i Sigma0(__m256i x) { return Xor(Xor(Rot(x, 2), Rot(x, 13)), Rot(x, 22)); }
+SHA256_AVX2 inline __m256i Sigma1(__m256i x) { return Xor(Xor(Rot(x, 6), Rot(x, 11)), Rot(x, 25)); }
+SHA256_AVX2 inline __m256i sigma0(__m256i x) { return Xor(Xor(Rot(x, 7), Rot(x, 18)), ShR(x, 3)); }
+SHA256_AVX2 inline __m256i sigma1(__m256i x) { return Xor(Xor(Rot(x, 17), Rot(x, 19)), ShR(x, 10)); }
+
+/** One SHA-256 transformation of every lane. w holds the message words and is overwritten by the schedule. */
+SHA256_AVX2 void Transform(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] = Add(Add(w[i & 15], sigma1(w[(i + 14) & 15])), Add(w[(i + 9) & 15], sigma0(w[(i + 1) & 15])));
+        __m256i t1 = Add(Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), K(sha256::K[i]))), w[i & 15]);
+        __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g; g = f; f = e; e = Add(d, t1); d = c; c = b; b = a; a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+}
+
+SHA256_AVX2 void TransformD64_8way(unsigned char* out, const unsigned char* in)
+{
+    uint32_t init[8], words[8];
+    sha256::Initialize(init);
+    __m256i s[8], t[8], w[16];
+    for (int i = 0; i < 8; i++)
+        s[i] = t[i] = K(init[i]);
+    // Every input block is read before any output is written, so they may overlap
+    for (int j = 0; j < 16; j++) {
+        sha256::LoadLanes(words, in, 8, j);
+        w[j] = _mm256_set_epi32(words[7], words[6], words[5], words[4], words[3], words[2], words[1], words[0]);
+    }
+    Transform(s, w);
+    w[0] = K(0x80000000);
+    for (int j = 1; j < 15; j++)
+        w[j] = K(0);
+    w[15] = K(512);
+    Transform(s, w);
+    for (int j = 0; j < 8; j++)
+        w[j] = s[j];
+    w[8] = K(0x80000000);
+    for (int j = 9; j < 15; j++)
+        w[j] = K(0);
+    w[15] = K(256);
+    Transform(t, w);
+    for (int j = 0; j < 8; j++) {
+        _mm256_storeu_si256((__m256i*)words, t[j]);
+        for (int i = 0; i < 8; i++)
+            WriteBE32(out + 32 * i + 4 * j, words[i]);
+    }
+}
+
+#undef SHA256_AVX2
+} // namespace sha256d64_avx2
+
+/** The SHA-256 transform with the x86 SHA extensions, the state is held as ABEF and CDGH in two registers. */
+namespace sha256_shani
+{
+#define SHA256_SHANI __attribute__((target("sse4.1,sha")))
+
+/** Four rounds, with m the four message words of them. */
+SHA256_SHANI inline void QuadRound(__m128i& s0, __m128i& s1, __m128i m, int i)
+{
+    const __m128i msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&sha256::K[4 * i]));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+/** The two halves of computing the next four message words m2 from the previous twelve. */
+SHA256_SHANI inline void ShiftMessageA(__m128i& m0, __m128i m1) { m0 = _mm_sha256msg1_epu32(m0, m1); }
+SHA256_SHANI inline void ShiftMessageC(__m128i m0, __m128i m1, __m128i& m2) { m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1); }
+SHA256_SHANI inline void ShiftMessageB(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    ShiftMessageC(m0, m1, m2);
+    ShiftMessageA(m0, m1);
+}
+
+SHA256_SHANI inline __m128i Load(const unsigned char* in)
+{
+    const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), mask);
+}
+
+SHA256_SHANI void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    // ABCD EFGH to ABEF CDGH
+    __m128i t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xB1);
+    __m128i t2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(s + 4)), 0x1B);
+    __m128i s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    __m128i s1 = _mm_blend_epi16(t2, t1, 0xF0);
+
+    while (blocks--) {
+        const __m128i so0 = s0, so1 = s1;
+        __m128i m0, m1, m2, m3;
+        m0 = Load(chunk);
+        QuadRound(s0, s1, m0, 0);
+        m1 = Load(chunk + 16);
+        QuadRound(s0, s1, m1, 1);
+        ShiftMessageA(m0, m1);
+        m2 = Load(chunk + 32);
+        QuadRound(s0, s1, m2, 2);
+        ShiftMessageA(m1, m2);
+        m3 = Load(chunk + 48);
+        QuadRound(s0, s1, m3, 3);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(s0, s1, m0, 4);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(s0, s1, m1, 5);
+        ShiftMessageB(m0, m1, m2);
+        QuadRound(s0, s1, m2, 6);
+        ShiftMessageB(m1, m2, m3);
+        QuadRound(s0, s1, m3, 7);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(s0, s1, m0, 8);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(s0, s1, m1, 9);
+        ShiftMessageB(m0, m1, m2);
+        QuadRound(s0, s1, m2, 10);
+        ShiftMessageB(m1, m2, m3);
+        QuadRound(s0, s1, m3, 11);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(s0, s1, m0, 12);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(s0, s1, m1, 13);
+        ShiftMessageC(m0, m1, m2);
+        QuadRound(s0, s1, m2, 14);
+        ShiftMessageC(m1, m2, m3);
+        QuadRound(s0, s1, m3, 15);
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+        chunk += 64;
+    }
+
+    // ABEF CDGH back to ABCD EFGH
+    t1 = _mm_shuffle_epi32(s0, 0x1B);
+    t2 = _mm_shuffle_epi32(s1, 0xB1);
+    _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(t1, t2, 0xF0));
+    _mm_storeu_si128((__m128i*)(s + 4), _mm_alignr_epi8(t2, t1, 0x08));
+}
+
+#undef SHA256_SHANI
+} // namespace sha256_shani
+
+/** Whether the CPU has the SHA extensions, which older compilers' __builtin_cpu_supports does not know. */
+bool HaveSHANI()
+{
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return false;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx >> 29) & 1;
+}
+#endif
+
+#if SHA256_ARM_DISPATCH
+/** The SHA-256 transform with the ARMv8 cryptography extensions. */
+namespace sha256_armv8
+{
+#define SHA256_ARMV8 __attribute__((target("arch=armv8-a+crypto")))
+
+SHA256_ARMV8 void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    uint32x4_t abcd = vld1q_u32(s), efgh = vld1q_u32(s + 4);
+    while (blocks--) {
+        const uint32x4_t abcd_save = abcd, efgh_save = efgh;
+        uint32x4_t m[4];
+        for (int j = 0; j < 4; j++)
+            m[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(chunk + 16 * j)));
+        // Four rounds at a time, with the message words of the fourth round after them computed alongside
+        for (int i = 0; i < 16; i++) {
+            const uint32x4_t msg = vaddq_u32(m[i & 3], vld1q_u32(&sha256::K[4 * i]));
+            if (i < 12)
+                m[i & 3] = vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]);
+            const uint32x4_t abcd_prev = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, msg);
+            efgh = vsha256h2q_u32(efgh, abcd_prev, msg);
+            if (i < 12)
+                m[i & 3] = vsha256su1q_u32(m[i & 3], m[(i + 2) & 3], m[(i + 3) & 3]);
+        }
+        abcd = vaddq_u32(abcd, abcd_save);
+        efgh = vaddq_u32(efgh, efgh_save);
+        chunk += 64;
+    }
+    vst1q_u32(s, abcd);
+    vst1q_u32(s + 4, efgh);
+}
+
+#undef SHA256_ARMV8
+} // namespace sha256_armv8
+
+bool HaveARMv8SHA2()
+{
+#if defined(__APPLE__)
+    return true;
+#elif defined(__linux__) && defined(HWCAP_SHA2)
+    return getauxval(AT_HWCAP) & HWCAP_SHA2;
+#else
+    return false;
+#endif
+}
+#endif
+
+/** The transforms this CPU has. The double-SHA256 transforms of several 64-byte messages at once are NULL when it
+ *  has none, and the messages left over are hashed one at a time with transform. */
+struct SHA256Kernels
+{
+    std::string name;
+    sha256::TransformType transform;
+    void (*transform_4way)(unsigned char* out, const unsigned char* in);
+    void (*transform_8way)(unsigned char* out, const unsigned char* in);
+};
+
+SHA256Kernels SelectSHA256Kernels()
+{
+    SHA256Kernels kernels = { "generic", sha256::TransformBlocks, NULL, NULL };
+#if SHA256_X86_DISPATCH
+    __builtin_cpu_init();
+    if (HaveSHANI()) {
+        // One message at a time with the SHA extensions beats even eight of them in AVX2 registers
+        kernels.name = "shani";
+        kernels.transform = sha256_shani::Transform;
+        return kernels;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.name += ", 4-way sse2";
+        kernels.transform_4way = sha256d64_sse2::TransformD64_4way;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.name += ", 8-way avx2";
+        kernels.transform_8way = sha256d64_avx2::TransformD64_8way;
+    }
+#elif SHA256_ARM_DISPATCH
+    if (HaveARMv8SHA2()) {
+        kernels.name = "armv8";
+        kernels.transform = sha256_armv8::Transform;
+    }
+#endif
+    return kernels;
+}
+
+const SHA256Kernels& ActiveSHA256Kernels()
+{
+    static const SHA256Kernels kernels = SelectSHA256Kernels();
+    return kernels;
+}
+
 } // namespace
 
 
@@ -147,14 +549,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        ActiveSHA256Kernels().transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        ActiveSHA256Kernels().transform(s, data, blocks);
+        bytes += 64 * blocks;
+        data += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +590,69 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    const SHA256Kernels& kernels = ActiveSHA256Kernels();
+    if (kernels.transform_8way) {
+        while (blocks >= 8) {
+            kernels.transform_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (kernels.transform_4way) {
+        while (blocks >= 4) {
+            kernels.transform_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        sha256::TransformD64(out, in, kernels.transform);
+        out += 32;
+        in += 64;
+        blocks--;
+    }
+}
+
+const char* SHA256Implementation()
+{
+    return ActiveSHA256Kernels().name.c_str();
+}
+
+bool SHA256SelfTest()
+{
+    static const unsigned char abc[3] = {'a', 'b', 'c'};
+    static const unsigned char abcHash[CSHA256::OUTPUT_SIZE] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+    // Of the first 1000 bytes of data, which takes several chunks at once
+    static const unsigned char dataHash[CSHA256::OUTPUT_SIZE] = {
+        0x1e, 0x9b, 0xc3, 0x8c, 0xbf, 0x86, 0x0b, 0x9e, 0xc3, 0x19, 0x18, 0xb0, 0x65, 0xf9, 0xb5, 0x24,
+        0x76, 0xc5, 0x49, 0xa7, 0x82, 0xe0, 0xe7, 0x99, 0x0b, 0xed, 0x8c, 0xe3, 0x86, 0x8d, 0x23, 0x71};
+    unsigned char data[64 * 17], hash[CSHA256::OUTPUT_SIZE], out[32 * 17];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = i * 7 + 3;
+
+    CSHA256().Write(abc, sizeof(abc)).Finalize(hash);
+    if (memcmp(hash, abcHash, sizeof(hash)) != 0)
+        return false;
+    CSHA256().Write(data, 1).Write(data + 1, 999).Finalize(hash);
+    if (memcmp(hash, dataHash, sizeof(hash)) != 0)
+        return false;
+
+    // Every multi-way transform and the messages left over from them
+    for (size_t blocks = 1; blocks <= 17; blocks++) {
+        SHA256D64(out, data, blocks);
+        for (size_t i = 0; i < blocks; i++) {
+            CSHA256().Write(data + 64 * i, 64).Finalize(hash);
+            CSHA256().Write(hash, sizeof(hash)).Finalize(hash);
+            if (memcmp(hash, out + 32 * i, sizeof(hash)) != 0)
+                return false;
+        }
+    }
+    return true;
+}
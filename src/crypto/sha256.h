@@ -25,4 +25,15 @@ public:
     CSHA256& Reset();
 };
 
+/** Compute the double-SHA256 of each of the blocks 64-byte messages at in into the 32 bytes at
+ *  out + 32 * i. The messages are hashed several at a time where the CPU has vector instructions
+ *  for it; out may be in, as a merkle tree level is hashed in place. */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
+/** The SHA-256 transforms selected for this CPU */
+const char* SHA256Implementation();
+
+/** Check the selected transforms against known hashes and against each other */
+bool SHA256SelfTest();
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -2,12 +2,22 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
 #include "dbwrapper.h"
 
 #include "util.h"
 #include "random.h"
 
+#include <algorithm>
+#include <set>
+
 #include <boost/filesystem.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -15,14 +25,75 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CDBLatencyHistogram::CDBLatencyHistogram() : nCount(0), nTotalMicros(0)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vBuckets[i] = 0;
+}
+
+void CDBLatencyHistogram::Add(int64_t nMicros)
+{
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && nMicros >= (int64_t(1) << nBucket))
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotalMicros += std::max(nMicros, (int64_t)0);
+}
+
+void CDBStats::AddBatch(size_t nBytes, int64_t nMicros)
+{
+    writeLatency.Add(nMicros);
+    nBatchBytes += nBytes;
+    uint64_t nMax = nBatchBytesMax;
+    while (nBytes > nMax && !nBatchBytesMax.compare_exchange_weak(nMax, nBytes)) {}
+}
+
+/** The block cache of a database, counting the lookups it answers and misses */
+class CCountingCache : public leveldb::Cache
+{
+private:
+    leveldb::Cache* cache;
+    CDBStats& stats;
+
+public:
+    CCountingCache(leveldb::Cache* cacheIn, CDBStats& statsIn) : cache(cacheIn), stats(statsIn) {}
+    ~CCountingCache() { delete cache; }
+
+    Handle* Insert(const leveldb::Slice& key, void* value, size_t charge, void (*deleter)(const leveldb::Slice& key, void* value))
+    {
+        return cache->Insert(key, value, charge, deleter);
+    }
+
+    Handle* Lookup(const leveldb::Slice& key)
+    {
+        Handle* handle = cache->Lookup(key);
+        if (handle)
+            stats.nCacheHits++;
+        else
+            stats.nCacheMisses++;
+        return handle;
+    }
+
+    void Release(Handle* handle) { cache->Release(handle); }
+    void* Value(Handle* handle) { return cache->Value(handle); }
+    void Erase(const leveldb::Slice& key) { cache->Erase(key); }
+    uint64_t NewId() { return cache->NewId(); }
+};
+
+//! the databases open, for getdbstats
+static boost::mutex csOpenDBs;
+static std::set<const CDBWrapper*> setOpenDBs;
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBOptions& dbOptions, CDBStats& stats)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
+    options.block_cache = new CCountingCache(leveldb::NewLRUCache(nCacheSize / 2), stats);
     options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.filter_policy = dbOptions.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dbOptions.nBloomBits) : NULL;
+    options.compression = dbOptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.block_size = dbOptions.nBlockSize;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +102,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& pathIn, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CDBOptions& dbOptions) : path(pathIn), fObfuscated(false)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, dbOptions, stats);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -52,6 +123,13 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
         TryCreateDirectory(path);
         LogPrintf("Opening LevelDB in %s\n", path.string());
     }
+#ifdef HAVE_SNAPPY
+    const char* strCompression = dbOptions.fCompression ? "snappy" : "none";
+#else
+    const char* strCompression = dbOptions.fCompression ? "none (built without snappy)" : "none";
+#endif
+    LogPrint("leveldb", "LevelDB options: compression %s, block size %u, max open files %d, bloom filter bits %d\n",
+        strCompression, (unsigned int)dbOptions.nBlockSize, dbOptions.nMaxOpenFiles, dbOptions.nBloomBits);
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
@@ -74,10 +152,18 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     }
 
     LogPrintf("Using obfuscation key for %s: %s\n", path.string(), HexStr(obfuscate_key));
+    fObfuscated = std::count(obfuscate_key.begin(), obfuscate_key.end(), 0) != (ptrdiff_t)obfuscate_key.size();
+
+    boost::lock_guard<boost::mutex> lock(csOpenDBs);
+    setOpenDBs.insert(this);
 }
 
 CDBWrapper::~CDBWrapper()
 {
+    {
+        boost::lock_guard<boost::mutex> lock(csOpenDBs);
+        setOpenDBs.erase(this);
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -88,13 +174,60 @@ CDBWrapper::~CDBWrapper()
     options.env = NULL;
 }
 
+CDBSnapshot::CDBSnapshot(const CDBWrapper &parent) : parent(parent), psnapshot(parent.pdb->GetSnapshot())
+{
+}
+
+CDBSnapshot::~CDBSnapshot()
+{
+    parent.pdb->ReleaseSnapshot(psnapshot);
+}
+
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
+    int64_t nStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+    stats.AddBatch(batch.SizeEstimate(), GetTimeMicros() - nStart);
     dbwrapper_private::HandleError(status);
     return true;
 }
 
+std::string CDBWrapper::GetProperty(const std::string& strProperty) const
+{
+    std::string strValue;
+    if (!pdb->GetProperty(strProperty, &strValue))
+        return std::string();
+    return strValue;
+}
+
+void CDBWrapper::ForEachOpen(boost::function<void(const CDBWrapper&)> fn)
+{
+    boost::lock_guard<boost::mutex> lock(csOpenDBs);
+    for (std::set<const CDBWrapper*>::const_iterator it = setOpenDBs.begin(); it != setOpenDBs.end(); ++it)
+        fn(**it);
+}
+
+static void LogOneDBStats(const CDBWrapper& db)
+{
+    const CDBStats& stats = db.GetStats();
+    uint64_t nReads = stats.readLatency.GetCount();
+    uint64_t nBatches = stats.writeLatency.GetCount();
+    uint64_t nSeeks = stats.seekLatency.GetCount();
+    uint64_t nHits = stats.nCacheHits;
+    uint64_t nLookups = nHits + stats.nCacheMisses;
+    LogPrintf("LevelDB stats of %s: %u reads (%u found, %.1fus avg), %u batches (%u bytes, %.1fus avg), %u seeks (%.1fus avg), %u nexts, block cache hit rate %.1f%%\n",
+        db.GetPath().string(),
+        nReads, (uint64_t)stats.nReadsFound, stats.readLatency.GetTotalMicros() / std::max(1.0, (double)nReads),
+        nBatches, (uint64_t)stats.nBatchBytes, stats.writeLatency.GetTotalMicros() / std::max(1.0, (double)nBatches),
+        nSeeks, stats.seekLatency.GetTotalMicros() / std::max(1.0, (double)nSeeks),
+        (uint64_t)stats.nNexts, nLookups ? 100.0 * nHits / nLookups : 0.0);
+}
+
+void LogDBStats()
+{
+    CDBWrapper::ForEachOpen(LogOneDBStats);
+}
+
 // Prefixed with null character to avoid collisions with other keys
 //
 // We must use a string constructor which specifies length so that we copy
@@ -125,7 +258,8 @@ bool CDBWrapper::IsEmpty()
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
-void CDBIterator::Next() { piter->Next(); }
+void CDBIterator::Next() { dbwrapper_private::GetStats(parent).nNexts++; piter->Next(); }
+void CDBIterator::Prev() { piter->Prev(); }
 
 namespace dbwrapper_private {
 
@@ -148,4 +282,31 @@ const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w)
     return w.obfuscate_key;
 }
 
+const std::vector<unsigned char>* GetXorKey(const CDBWrapper &w)
+{
+    return w.fObfuscated ? &w.obfuscate_key : NULL;
+}
+
+CDBStats& GetStats(const CDBWrapper &w)
+{
+    return w.stats;
+}
+
+static boost::thread_specific_ptr<CDataStream> ptrKeyScratch;
+static boost::thread_specific_ptr<std::string> ptrValueScratch;
+
+CDataStream& GetKeyScratch()
+{
+    if (!ptrKeyScratch.get())
+        ptrKeyScratch.reset(new CDataStream(SER_DISK, CLIENT_VERSION));
+    return *ptrKeyScratch;
+}
+
+std::string& GetValueScratch()
+{
+    if (!ptrValueScratch.get())
+        ptrValueScratch.reset(new std::string());
+    return *ptrValueScratch;
+}
+
 };
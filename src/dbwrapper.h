@@ -12,11 +12,28 @@
 #include "utilstrencodings.h"
 #include "version.h"
 
+#include <atomic>
+
 #include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+//! Table block size of a database unless configured otherwise (bytes)
+static const size_t DEFAULT_DB_BLOCK_SIZE = 4096;
+//! -dbblocksize bounds (KiB)
+static const int64_t MIN_DB_BLOCK_SIZE_KB = 1;
+static const int64_t MAX_DB_BLOCK_SIZE_KB = 1024;
+//! Table files a database keeps open unless configured otherwise; LevelDB raises this to at least 74
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+//! max. -dbmaxopenfiles
+static const int MAX_DB_MAX_OPEN_FILES = 50000;
+//! Bloom filter bits per key of a database unless configured otherwise
+static const int DEFAULT_DB_BLOOM_BITS = 10;
+//! max. -dbbloombits
+static const int MAX_DB_BLOOM_BITS = 32;
+
 class dbwrapper_error : public std::runtime_error
 {
 public:
@@ -24,6 +41,7 @@ public:
 };
 
 class CDBWrapper;
+struct CDBStats;
 
 /** These should be considered an implementation detail of the specific database.
  */
@@ -39,6 +57,81 @@ void HandleError(const leveldb::Status& status);
  */
 const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w);
 
+/** The obfuscation key of a database for reading its values, NULL if XOR with it is a noop */
+const std::vector<unsigned char>* GetXorKey(const CDBWrapper &w);
+
+/** The counters of a database, for the batches and iterators working on it */
+CDBStats& GetStats(const CDBWrapper &w);
+
+/** Buffers of the calling thread for the keys and values of lookups, so a lookup allocates nothing */
+CDataStream& GetKeyScratch();
+std::string& GetValueScratch();
+
+/** Serialize a key for a lookup into the key buffer of the calling thread; the slice is valid
+ * until the thread serializes the next one.
+ */
+template <typename K>
+leveldb::Slice SerializeKey(const K& key)
+{
+    CDataStream& ssKey = GetKeyScratch();
+    ssKey.clear();
+    ssKey << key;
+    return leveldb::Slice(&ssKey[0], ssKey.size());
+}
+
+};
+
+/** The LevelDB settings that can differ between databases */
+struct CDBOptions
+{
+    //! compress table blocks with Snappy; without Snappy built in they are stored as they are
+    bool fCompression;
+    //! uncompressed size of the table blocks, the unit LevelDB reads and caches (bytes)
+    size_t nBlockSize;
+    int nMaxOpenFiles;
+    //! bloom filter bits per key, 0 for no filter
+    int nBloomBits;
+
+    CDBOptions() : fCompression(false), nBlockSize(DEFAULT_DB_BLOCK_SIZE), nMaxOpenFiles(DEFAULT_DB_MAX_OPEN_FILES), nBloomBits(DEFAULT_DB_BLOOM_BITS) {}
+};
+
+/** Latencies of a database operation, counted in power of two buckets of microseconds */
+class CDBLatencyHistogram
+{
+public:
+    //! bucket i counts latencies below 2^i us, the last one everything longer
+    static const int BUCKETS = 24;
+
+    CDBLatencyHistogram();
+    void Add(int64_t nMicros);
+
+    uint64_t GetCount() const { return nCount; }
+    uint64_t GetTotalMicros() const { return nTotalMicros; }
+    uint64_t GetBucket(int i) const { return vBuckets[i]; }
+
+private:
+    std::atomic<uint64_t> vBuckets[BUCKETS];
+    std::atomic<uint64_t> nCount;
+    std::atomic<uint64_t> nTotalMicros;
+};
+
+/** What a CDBWrapper did since it was opened, updated by every thread using it */
+struct CDBStats
+{
+    std::atomic<uint64_t> nReadsFound;
+    CDBLatencyHistogram readLatency;
+    std::atomic<uint64_t> nBatchBytes;
+    std::atomic<uint64_t> nBatchBytesMax;
+    CDBLatencyHistogram writeLatency;
+    std::atomic<uint64_t> nNexts;
+    CDBLatencyHistogram seekLatency;
+    //! lookups of table blocks in the block cache
+    std::atomic<uint64_t> nCacheHits;
+    std::atomic<uint64_t> nCacheMisses;
+
+    CDBStats() : nReadsFound(0), nBatchBytes(0), nBatchBytesMax(0), nNexts(0), nCacheHits(0), nCacheMisses(0) {}
+
+    void AddBatch(size_t nBytes, int64_t nMicros);
 };
 
 /** Batch of changes queued to be written to a CDBWrapper */
@@ -49,12 +142,27 @@ class CDBBatch
 private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
+    //! bytes the batch takes in the log, as far as it is known from the keys and values
+    size_t size_estimate;
+
+    void PutSized(const leveldb::Slice& slKey, const leveldb::Slice& slValue)
+    {
+        batch.Put(slKey, slValue);
+        // One tag byte and the varint lengths around key and value
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
+    }
+
+    void DeleteSized(const leveldb::Slice& slKey)
+    {
+        batch.Delete(slKey);
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
+    }
 
 public:
     /**
      * @param[in] parent    CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &parent) : parent(parent) { };
+    CDBBatch(const CDBWrapper &parent) : parent(parent), size_estimate(0) { };
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -70,7 +178,7 @@ public:
         ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
-        batch.Put(slKey, slValue);
+        PutSized(slKey, slValue);
     }
 
     template <typename K>
@@ -81,8 +189,28 @@ public:
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
-        batch.Delete(slKey);
+        DeleteSized(slKey);
     }
+
+    /** Write a serialized key and an unobfuscated serialized value, as returned by CDBIterator::GetKeyRaw and GetValueRaw */
+    void WriteRaw(const std::string& strKey, CDataStream ssValue)
+    {
+        ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
+        PutSized(strKey, leveldb::Slice(&ssValue[0], ssValue.size()));
+    }
+
+    void EraseRaw(const std::string& strKey)
+    {
+        DeleteSized(strKey);
+    }
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -106,19 +234,19 @@ public:
     void SeekToFirst();
 
     template<typename K> void Seek(const K& key) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
-        ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        leveldb::Slice slKey = dbwrapper_private::SerializeKey(key);
+        int64_t nStart = GetTimeMicros();
         piter->Seek(slKey);
+        dbwrapper_private::GetStats(parent).seekLatency.Add(GetTimeMicros() - nStart);
     }
 
     void Next();
+    void Prev();
 
     template<typename K> bool GetKey(K& key) {
         leveldb::Slice slKey = piter->key();
         try {
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            CSpanReader ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             ssKey >> key;
         } catch (const std::exception&) {
             return false;
@@ -130,11 +258,15 @@ public:
         return piter->key().size();
     }
 
+    /** The serialized key, for moving entries between databases */
+    std::string GetKeyRaw() {
+        return piter->key().ToString();
+    }
+
     template<typename V> bool GetValue(V& value) {
         leveldb::Slice slValue = piter->value();
         try {
-            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
+            CSpanReader ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION, dbwrapper_private::GetXorKey(parent));
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
@@ -146,12 +278,55 @@ public:
         return piter->value().size();
     }
 
+    /** The value as stored, obfuscated; valid until the iterator moves. Read it with a
+     * CSpanReader given dbwrapper_private::GetXorKey. */
+    leveldb::Slice GetValueSlice() {
+        return piter->value();
+    }
+
+    /** The serialized value with the obfuscation removed, for moving entries between databases */
+    CDataStream GetValueRaw() {
+        leveldb::Slice slValue = piter->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
+        return ssValue;
+    }
+
+};
+
+/** A consistent read-only view of a CDBWrapper, iterators opened on it do not see later writes */
+class CDBSnapshot
+{
+    friend class CDBWrapper;
+
+private:
+    const CDBWrapper &parent;
+    const leveldb::Snapshot *psnapshot;
+
+    CDBSnapshot(const CDBSnapshot&);
+    void operator=(const CDBSnapshot&);
+
+public:
+    /**
+     * @param[in] parent    CDBWrapper to take the snapshot of, must outlive it
+     */
+    CDBSnapshot(const CDBWrapper &parent);
+    ~CDBSnapshot();
 };
 
 class CDBWrapper
 {
+    friend class CDBSnapshot;
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
+    friend CDBStats& dbwrapper_private::GetStats(const CDBWrapper &w);
+    friend const std::vector<unsigned char>* dbwrapper_private::GetXorKey(const CDBWrapper &w);
 private:
+    //! where the database is kept
+    boost::filesystem::path path;
+
+    //! updated by const readers too
+    mutable CDBStats stats;
+
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
 
@@ -176,6 +351,9 @@ private:
     //! a key used for optional XOR-obfuscation of the database
     std::vector<unsigned char> obfuscate_key;
 
+    //! whether obfuscate_key is not all zeros, and changes what it is XORed with
+    bool fObfuscated;
+
     //! the key under which the obfuscation key is stored
     static const std::string OBFUSCATE_KEY_KEY;
 
@@ -192,29 +370,33 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] dbOptions   Compression, block size, open files and bloom filter of the tables.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CDBOptions& dbOptions = CDBOptions());
     ~CDBWrapper();
 
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const
+    bool Read(const K& key, V& value, const CDBSnapshot *pSnapshot = NULL) const
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
-        ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
-
-        std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Slice slKey = dbwrapper_private::SerializeKey(key);
+
+        leveldb::ReadOptions options = readoptions;
+        if (pSnapshot)
+            options.snapshot = pSnapshot->psnapshot;
+        // LevelDB copies the value out, into a buffer that keeps its capacity between reads
+        std::string& strValue = dbwrapper_private::GetValueScratch();
+        int64_t nStart = GetTimeMicros();
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
+        stats.readLatency.Add(GetTimeMicros() - nStart);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
             LogPrintf("LevelDB read failure: %s\n", status.ToString());
             dbwrapper_private::HandleError(status);
         }
+        stats.nReadsFound++;
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(obfuscate_key);
+            CSpanReader ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION, fObfuscated ? &obfuscate_key : NULL);
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
@@ -233,19 +415,19 @@ public:
     template <typename K>
     bool Exists(const K& key) const
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(ssKey.GetSerializeSize(key));
-        ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+        leveldb::Slice slKey = dbwrapper_private::SerializeKey(key);
 
-        std::string strValue;
+        std::string& strValue = dbwrapper_private::GetValueScratch();
+        int64_t nStart = GetTimeMicros();
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        stats.readLatency.Add(GetTimeMicros() - nStart);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
             LogPrintf("LevelDB read failure: %s\n", status.ToString());
             dbwrapper_private::HandleError(status);
         }
+        stats.nReadsFound++;
         return true;
     }
 
@@ -276,11 +458,29 @@ public:
         return new CDBIterator(*this, pdb->NewIterator(iteroptions));
     }
 
+    CDBIterator *NewIterator(const CDBSnapshot &snapshot)
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot.psnapshot;
+        return new CDBIterator(*this, pdb->NewIterator(options));
+    }
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    const boost::filesystem::path& GetPath() const { return path; }
+    const CDBStats& GetStats() const { return stats; }
+    /** A LevelDB property such as leveldb.stats, empty if LevelDB does not know it */
+    std::string GetProperty(const std::string& strProperty) const;
+
+    /** Call fn for every database open, while none can be closed */
+    static void ForEachOpen(boost::function<void(const CDBWrapper&)> fn);
 };
 
+/** Log a line with the counters of every database open */
+void LogDBStats();
+
 #endif // BITCOIN_DBWRAPPER_H
 
@@ -0,0 +1,243 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATHASHMAP_H
+#define BITCOIN_FLATHASHMAP_H
+
+#include "memusage.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+/**
+ * A hash map with open addressing and linear probing: the entries lie in one array, so a
+ * lookup touches a cache line or two rather than following a bucket to a node of its own.
+ * Next to every slot is 32 bits of the hash of its key, zero when the slot is empty, which
+ * lets probing skip most keys without comparing them and erasing shift the later entries
+ * back rather than leave tombstones.
+ *
+ * Unlike the node-based maps, inserting may move every entry: references, pointers and
+ * iterators to them are only good until the next insertion or erasure. Keys and values
+ * must be default constructible, and keys must not be changed through an iterator.
+ */
+template <typename K, typename V, typename Hasher, typename KeyEqual = std::equal_to<K> >
+class FlatHashMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<K, V> value_type;
+    typedef size_t size_type;
+
+private:
+    //! Slots of a map that holds anything; the number of slots is a power of two, at most
+    //! 3/4 of them are used as beyond that the probes grow long
+    static const size_t MIN_CAPACITY = 16;
+
+    std::vector<uint32_t> vTags; //!< hash bits of the key in the slot, with the top bit set; 0 if empty
+    std::vector<value_type> vSlots;
+    size_t nSize;
+    size_t nMask;
+    Hasher hasher;
+    KeyEqual keyEqual;
+
+    static uint32_t Tag(size_t nHash) { return (uint32_t)nHash | 0x80000000; }
+
+    /** The slot holding key, or the empty slot it would go in */
+    size_t Probe(const K& key, uint32_t nTag) const
+    {
+        size_t i = nTag & nMask;
+        while (vTags[i] != 0) {
+            if (vTags[i] == nTag && keyEqual(vSlots[i].first, key))
+                return i;
+            i = (i + 1) & nMask;
+        }
+        return i;
+    }
+
+    void Rehash(size_t nCapacity)
+    {
+        std::vector<uint32_t> vOldTags;
+        std::vector<value_type> vOldSlots;
+        vOldTags.swap(vTags);
+        vOldSlots.swap(vSlots);
+        vTags.assign(nCapacity, 0);
+        vSlots.resize(nCapacity);
+        nMask = nCapacity - 1;
+        for (size_t i = 0; i < vOldTags.size(); i++) {
+            if (vOldTags[i] == 0)
+                continue;
+            size_t j = vOldTags[i] & nMask;
+            while (vTags[j] != 0)
+                j = (j + 1) & nMask;
+            vTags[j] = vOldTags[i];
+            vSlots[j] = std::move(vOldSlots[i]);
+        }
+    }
+
+    /** The slot of key, inserting it with a default value if it is not there */
+    std::pair<size_t, bool> FindOrInsert(const K& key)
+    {
+        if (vTags.empty() || (nSize + 1) * 4 > vTags.size() * 3)
+            Rehash(vTags.empty() ? MIN_CAPACITY : vTags.size() * 2);
+        uint32_t nTag = Tag(hasher(key));
+        size_t i = Probe(key, nTag);
+        if (vTags[i] != 0)
+            return std::make_pair(i, false);
+        vTags[i] = nTag;
+        vSlots[i].first = key;
+        nSize++;
+        return std::make_pair(i, true);
+    }
+
+    /** Empty slot i, moving the entries after it back so that no probe stops short */
+    void EraseSlot(size_t i)
+    {
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & nMask;
+            if (vTags[j] == 0)
+                break;
+            // The entry at j may fill the hole if its probe starts at or before it
+            size_t nHome = vTags[j] & nMask;
+            if (((j - nHome) & nMask) < ((j - i) & nMask))
+                continue;
+            vTags[i] = vTags[j];
+            vSlots[i] = std::move(vSlots[j]);
+            i = j;
+        }
+        vTags[i] = 0;
+        vSlots[i] = value_type();
+        nSize--;
+    }
+
+    template <typename Map, typename Value>
+    class iterator_base : public std::iterator<std::forward_iterator_tag, Value>
+    {
+    private:
+        friend class FlatHashMap;
+        Map* pMap;
+        size_t nPos;
+
+        void SkipEmpty()
+        {
+            while (nPos < pMap->vTags.size() && pMap->vTags[nPos] == 0)
+                nPos++;
+        }
+
+    public:
+        iterator_base() : pMap(NULL), nPos(0) {}
+        iterator_base(Map* pMapIn, size_t nPosIn) : pMap(pMapIn), nPos(nPosIn) { SkipEmpty(); }
+        template <typename OtherMap, typename OtherValue>
+        iterator_base(const iterator_base<OtherMap, OtherValue>& other) : pMap(other.pMap), nPos(other.nPos) {}
+
+        Value& operator*() const { return pMap->vSlots[nPos]; }
+        Value* operator->() const { return &pMap->vSlots[nPos]; }
+        iterator_base& operator++() { nPos++; SkipEmpty(); return *this; }
+        iterator_base operator++(int) { iterator_base copy(*this); ++(*this); return copy; }
+        bool operator==(const iterator_base& other) const { return nPos == other.nPos; }
+        bool operator!=(const iterator_base& other) const { return nPos != other.nPos; }
+
+        template <typename OtherMap, typename OtherValue> friend class iterator_base;
+    };
+
+public:
+    typedef iterator_base<FlatHashMap, value_type> iterator;
+    typedef iterator_base<const FlatHashMap, const value_type> const_iterator;
+
+    explicit FlatHashMap(const Hasher& hasherIn = Hasher(), const KeyEqual& keyEqualIn = KeyEqual())
+        : nSize(0), nMask(0), hasher(hasherIn), keyEqual(keyEqualIn) {}
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    /** Number of slots, entries and empty ones */
+    size_t capacity() const { return vTags.size(); }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, vTags.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, vTags.size()); }
+
+    iterator find(const K& key)
+    {
+        if (nSize == 0)
+            return end();
+        size_t i = Probe(key, Tag(hasher(key)));
+        return vTags[i] != 0 ? iterator(this, i) : end();
+    }
+
+    const_iterator find(const K& key) const
+    {
+        if (nSize == 0)
+            return end();
+        size_t i = Probe(key, Tag(hasher(key)));
+        return vTags[i] != 0 ? const_iterator(this, i) : end();
+    }
+
+    size_t count(const K& key) const { return find(key) != end() ? 1 : 0; }
+
+    V& operator[](const K& key) { return vSlots[FindOrInsert(key).first].second; }
+
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        std::pair<size_t, bool> result = FindOrInsert(value.first);
+        if (result.second)
+            vSlots[result.first].second = value.second;
+        return std::make_pair(iterator(this, result.first), result.second);
+    }
+
+    std::pair<iterator, bool> emplace(const K& key, const V& value) { return insert(value_type(key, value)); }
+
+    /** Unlike the standard maps this returns nothing: the entry after it may have moved into its slot, or one before it */
+    void erase(iterator it) { EraseSlot(it.nPos); }
+
+    size_t erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            return 0;
+        EraseSlot(it.nPos);
+        return 1;
+    }
+
+    void clear()
+    {
+        std::vector<uint32_t>().swap(vTags);
+        std::vector<value_type>().swap(vSlots);
+        nSize = 0;
+        nMask = 0;
+    }
+
+    /** Make room for nCount entries without growing again */
+    void reserve(size_t nCount)
+    {
+        size_t nCapacity = vTags.empty() ? MIN_CAPACITY : vTags.size();
+        while (nCount * 4 > nCapacity * 3)
+            nCapacity *= 2;
+        if (nCapacity != vTags.size())
+            Rehash(nCapacity);
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(vTags) + memusage::DynamicUsage(vSlots);
+    }
+};
+
+namespace memusage {
+
+template <typename K, typename V, typename H, typename E>
+static inline size_t DynamicUsage(const FlatHashMap<K, V, H, E>& m)
+{
+    return m.DynamicMemoryUsage();
+}
+
+}
+
+#endif // BITCOIN_FLATHASHMAP_H
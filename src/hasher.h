@@ -0,0 +1,46 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HASHER_H
+#define BITCOIN_HASHER_H
+
+#include "hash.h"
+#include "uint256.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Hashes a uint256 with SipHash under a random salt, for the maps whose keys peers choose
+ * (txids, the hashes of outpoints): without the salt they could make the keys collide.
+ * Hashes that carry proof of work, or that nobody picks, can use CheapUint256Hasher.
+ */
+class SaltedUint256Hasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedUint256Hasher();
+
+    /**
+     * This *must* return size_t. With Boost 1.46 on 32-bit systems the
+     * unordered_map will behave unpredictably if the custom hasher returns a
+     * uint64_t, resulting in failures when syncing the chain (#4634).
+     */
+    size_t operator()(const uint256& hash) const {
+        return SipHashUint256(k0, k1, hash);
+    }
+};
+
+typedef SaltedUint256Hasher SaltedTxidHasher;
+
+/** The first 64 bits of a uint256, which are uniform for block hashes and other hash outputs nobody can grind */
+struct CheapUint256Hasher
+{
+    size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+};
+
+#endif // BITCOIN_HASHER_H
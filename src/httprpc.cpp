@@ -7,6 +7,7 @@
 #include "base58.h"
 #include "chainparams.h"
 #include "httpserver.h"
+#include "init.h"
 #include "rpc/protocol.h"
 #include "rpc/server.h"
 #include "random.h"
@@ -144,6 +145,52 @@ static bool RPCAuthorized(const std::string& strAuth)
     return multiUserAuthorized(strUserPass);
 }
 
+/**
+ * Reply to a single request for a streamable method with a chunked reply,
+ * started once the result outgrows RPC_STREAM_FLUSH_SIZE. Errors raised
+ * before that are thrown as usual; after it, all that can be done is to cut
+ * the reply short.
+ */
+static void JSONRPCStreamReply(HTTPRequest* req, const JSONRequest& jreq)
+{
+    bool fStarted = false;
+    JSONStreamWriter writer([req, &fStarted](const std::string& strChunk) {
+        if (!fStarted) {
+            req->WriteHeader("Content-Type", "application/json");
+            req->StartChunkedReply(HTTP_OK);
+            fStarted = true;
+        }
+        req->WriteReplyChunk(strChunk);
+    });
+
+    // Same members as JSONRPCReplyObj, the result being written in place
+    writer.BeginObject();
+    writer.Key("result");
+    try {
+        tableRPC.executeStream(jreq.strMethod, jreq.params, writer);
+    } catch (...) {
+        if (!fStarted)
+            throw;
+        LogPrintf("%s: %s failed while streaming its result, reply cut short\n", __func__, jreq.strMethod);
+        req->EndChunkedReply();
+        return;
+    }
+    writer.Key("error");
+    writer.Value(NullUniValue);
+    writer.Key("id");
+    writer.Value(jreq.id);
+    writer.EndObject();
+
+    if (fStarted) {
+        writer.Flush();
+        req->WriteReplyChunk("\n");
+        req->EndChunkedReply();
+    } else {
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, writer.Release() + "\n");
+    }
+}
+
 static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
 {
     // JSONRPC handles only POST
@@ -185,6 +232,11 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
+            if (tableRPC.isStreamable(jreq.strMethod)) {
+                JSONRPCStreamReply(req, jreq);
+                return true;
+            }
+
             UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
             // Check for solo mining with ethminer
             // TODO better conditions, maybe cointains eth_
@@ -230,6 +282,26 @@ static bool InitRPCAuthentication()
     return true;
 }
 
+/** Readiness for load balancers and orchestrators, without authentication: 200 once the node is ready, 503 before */
+static bool HTTPReq_Health(HTTPRequest* req, const std::string &)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BAD_METHOD, "Only GET requests are supported");
+        return false;
+    }
+    std::string strReason;
+    bool fReady = IsNodeReady(strReason);
+    std::vector<CStartupPhase> vPhases = GetStartupPhases();
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("ready", fReady));
+    result.push_back(Pair("phase", vPhases.empty() ? "starting" : vPhases.back().strName));
+    if (!fReady)
+        result.push_back(Pair("waitingfor", strReason));
+    req->WriteHeader("Content-Type", "application/json");
+    req->WriteReply(fReady ? HTTP_OK : HTTP_SERVICE_UNAVAILABLE, result.write() + "\n");
+    return true;
+}
+
 bool StartHTTPRPC()
 {
     LogPrint("rpc", "Starting HTTP RPC server\n");
@@ -237,6 +309,7 @@ bool StartHTTPRPC()
         return false;
 
     RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    RegisterHTTPHandler("/health", true, HTTPReq_Health);
 
     assert(EventBase());
     httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
@@ -253,6 +326,7 @@ void StopHTTPRPC()
 {
     LogPrint("rpc", "Stopping HTTP RPC server\n");
     UnregisterHTTPHandler("/", true);
+    UnregisterHTTPHandler("/health", true);
     if (httpRPCTimerInterface) {
         RPCUnsetTimerInterface(httpRPCTimerInterface);
         delete httpRPCTimerInterface;
@@ -22,6 +22,7 @@
 
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/listener.h>
 #include <event2/thread.h>
 #include <event2/buffer.h>
 #include <event2/util.h>
@@ -61,7 +62,8 @@ private:
 };
 
 /** Simple work queue for distributing work over multiple threads.
- * Work items are simply callable objects.
+ * Work items are simply callable objects. Items are turned away when the
+ * queue is full, or when the oldest item has waited longer than maxLatency.
  */
 template <typename WorkItem>
 class WorkQueue
@@ -70,10 +72,21 @@ private:
     /** Mutex protects entire object */
     CWaitableCriticalSection cs;
     CConditionVariable cond;
-    std::deque<std::unique_ptr<WorkItem>> queue;
+    //! Items with the time they were queued, in microseconds
+    std::deque<std::pair<int64_t, std::unique_ptr<WorkItem>>> queue;
     bool running;
     size_t maxDepth;
+    //! In microseconds, 0 for no limit
+    int64_t maxLatency;
     int numThreads;
+    size_t peakDepth;
+    uint64_t nRejected;
+    uint64_t nRejectedLatency;
+
+    int64_t Latency(int64_t nNow) const
+    {
+        return queue.empty() ? 0 : nNow - queue.front().first;
+    }
 
     /** RAII object to keep track of number of running worker threads */
     class ThreadCounter
@@ -94,9 +107,13 @@ private:
     };
 
 public:
-    WorkQueue(size_t maxDepth) : running(true),
-                                 maxDepth(maxDepth),
-                                 numThreads(0)
+    WorkQueue(size_t maxDepth, int64_t maxLatency) : running(true),
+                                                     maxDepth(maxDepth),
+                                                     maxLatency(maxLatency),
+                                                     numThreads(0),
+                                                     peakDepth(0),
+                                                     nRejected(0),
+                                                     nRejectedLatency(0)
     {
     }
     /** Precondition: worker threads have all stopped
@@ -105,17 +122,40 @@ public:
     ~WorkQueue()
     {
     }
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
+    /** Enqueue a work item. On failure, nLatencyRet is how long the oldest
+     * queued item has waited, in microseconds.
+     */
+    bool Enqueue(WorkItem* item, int64_t& nLatencyRet)
     {
+        int64_t nNow = GetTimeMicros();
         boost::unique_lock<boost::mutex> lock(cs);
+        nLatencyRet = Latency(nNow);
         if (queue.size() >= maxDepth) {
+            nRejected++;
             return false;
         }
-        queue.emplace_back(std::unique_ptr<WorkItem>(item));
+        if (maxLatency > 0 && nLatencyRet > maxLatency) {
+            nRejectedLatency++;
+            return false;
+        }
+        queue.emplace_back(nNow, std::unique_ptr<WorkItem>(item));
+        peakDepth = std::max(peakDepth, queue.size());
         cond.notify_one();
         return true;
     }
+    /** Current, maximum and peak depth, latency, and the number of items rejected */
+    void GetStats(HTTPWorkQueueStats& stats)
+    {
+        int64_t nNow = GetTimeMicros();
+        boost::unique_lock<boost::mutex> lock(cs);
+        stats.nDepth = queue.size();
+        stats.nMaxDepth = maxDepth;
+        stats.nPeakDepth = peakDepth;
+        stats.nRejected = nRejected;
+        stats.nLatencyMicros = Latency(nNow);
+        stats.nRejectedLatency = nRejectedLatency;
+        stats.nThreads = numThreads;
+    }
     /** Thread function */
     void Run()
     {
@@ -128,7 +168,7 @@ public:
                     cond.wait(lock);
                 if (!running)
                     break;
-                i = std::move(queue.front());
+                i = std::move(queue.front().second);
                 queue.pop_front();
             }
             (*i)();
@@ -169,20 +209,30 @@ struct HTTPPathHandler
     HTTPRequestHandler handler;
 };
 
+/** An event loop thread with its own HTTP server and listening sockets */
+struct HTTPEventThread
+{
+    HTTPEventThread() : base(0), http(0) {}
+    struct event_base* base;
+    struct evhttp* http;
+    //! Bound listening sockets
+    std::vector<evhttp_bound_socket *> boundSockets;
+    boost::thread thread;
+};
+
 /** HTTP module state */
 
-//! libevent event loop
+//! libevent event loops; with more than one, each listens on every endpoint
+//! through SO_REUSEPORT and the kernel spreads the connections over them
+static std::vector<std::unique_ptr<HTTPEventThread>> eventThreads;
+//! Event loop of the first thread, for timers and custom events
 static struct event_base* eventBase = 0;
-//! HTTP server
-struct evhttp* eventHTTP = 0;
 //! List of subnets to allow RPC connections from
 static std::vector<CSubNet> rpc_allow_subnets;
-//! Work queue for handling longer requests off the event loop thread
+//! Work queue for handling longer requests off the event loop threads
 static WorkQueue<HTTPClosure>* workQueue = 0;
 //! Handlers for (sub)paths
 std::vector<HTTPPathHandler> pathHandlers;
-//! Bound listening sockets
-std::vector<evhttp_bound_socket *> boundSockets;
 
 /** Check if a network address is allowed to access the HTTP server */
 static bool ClientAllowed(const CNetAddr& netaddr)
@@ -283,11 +333,15 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
     if (i != iend) {
         std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(std::move(hreq), path, i->handler));
         assert(workQueue);
-        if (workQueue->Enqueue(item.get()))
+        int64_t nLatency;
+        if (workQueue->Enqueue(item.get(), nLatency))
             item.release(); /* if true, queue took ownership */
         else {
-            LogPrintf("WARNING: request rejected because http work queue depth exceeded, it can be increased with the -rpcworkqueue= setting\n");
-            item->req->WriteReply(HTTP_INTERNAL, "Work queue depth exceeded");
+            LogPrintf("WARNING: request rejected because the http work queue is full or its oldest request waited %dms, see the -rpcworkqueue= and -rpcmaxqueuelatency= settings\n", nLatency / 1000);
+            // Suggest coming back once the queue had as long to drain as its
+            // oldest request has been waiting
+            item->req->WriteHeader("Retry-After", strprintf("%d", std::max<int64_t>(1, (nLatency + 999999) / 1000000)));
+            item->req->WriteReply(HTTP_SERVUNAVAIL, "Work queue depth exceeded");
         }
     } else {
         hreq->WriteReply(HTTP_NOTFOUND);
@@ -311,8 +365,38 @@ static void ThreadHTTP(struct event_base* base, struct evhttp* http)
     LogPrint("http", "Exited http event loop\n");
 }
 
-/** Bind HTTP server to specified addresses */
-static bool HTTPBindAddresses(struct evhttp* http)
+/**
+ * Listen on address:port for the HTTP server of thread. Replies go out with
+ * TCP_NODELAY, which the accepted sockets inherit from the listener, so short
+ * replies on kept-alive connections are not held back by Nagle's algorithm.
+ */
+static evhttp_bound_socket* HTTPBindAddress(HTTPEventThread& thread, const std::string& address, uint16_t port, bool fReusePort)
+{
+    CService addrBind;
+    if (!Lookup(address.empty() ? "::" : address.c_str(), addrBind, port, false))
+        return NULL;
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len))
+        return NULL;
+    unsigned int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE;
+#ifdef LEV_OPT_REUSEABLE_PORT
+    if (fReusePort)
+        flags |= LEV_OPT_REUSEABLE_PORT;
+#endif
+    struct evconnlistener* listener = evconnlistener_new_bind(thread.base, NULL, NULL, flags, SOMAXCONN, (struct sockaddr*)&sockaddr, len);
+    if (!listener)
+        return NULL;
+    int nOne = 1;
+    setsockopt(evconnlistener_get_fd(listener), IPPROTO_TCP, TCP_NODELAY, (const char*)&nOne, sizeof(int));
+    evhttp_bound_socket* bind_handle = evhttp_bind_listener(thread.http, listener);
+    if (!bind_handle)
+        evconnlistener_free(listener);
+    return bind_handle;
+}
+
+/** Bind the HTTP server of thread to the configured addresses */
+static bool HTTPBindAddresses(HTTPEventThread& thread, bool fReusePort)
 {
     int defaultPort = GetArg("-rpcport", BaseParams().RPCPort());
     std::vector<std::pair<std::string, uint16_t> > endpoints;
@@ -340,14 +424,27 @@ static bool HTTPBindAddresses(struct evhttp* http)
     // Bind addresses
     for (std::vector<std::pair<std::string, uint16_t> >::iterator i = endpoints.begin(); i != endpoints.end(); ++i) {
         LogPrint("http", "Binding RPC on address %s port %i\n", i->first, i->second);
-        evhttp_bound_socket *bind_handle = evhttp_bind_socket_with_handle(http, i->first.empty() ? NULL : i->first.c_str(), i->second);
+        evhttp_bound_socket *bind_handle = HTTPBindAddress(thread, i->first, i->second, fReusePort);
         if (bind_handle) {
-            boundSockets.push_back(bind_handle);
+            thread.boundSockets.push_back(bind_handle);
         } else {
             LogPrintf("Binding RPC on address %s port %i failed.\n", i->first, i->second);
         }
     }
-    return !boundSockets.empty();
+    return !thread.boundSockets.empty();
+}
+
+/** Free the HTTP server and event loop of thread */
+static void HTTPFreeEventThread(HTTPEventThread& thread)
+{
+    if (thread.http) {
+        evhttp_free(thread.http);
+        thread.http = 0;
+    }
+    if (thread.base) {
+        event_base_free(thread.base);
+        thread.base = 0;
+    }
 }
 
 /** Simple wrapper to set thread name and run work queue */
@@ -372,9 +469,6 @@ static void libevent_log_cb(int severity, const char *msg)
 
 bool InitHTTPServer()
 {
-    struct evhttp* http = 0;
-    struct event_base* base = 0;
-
     if (!InitHTTPAllowList())
         return false;
 
@@ -401,67 +495,88 @@ bool InitHTTPServer()
     evthread_use_pthreads();
 #endif
 
-    base = event_base_new(); // XXX RAII
-    if (!base) {
-        LogPrintf("Couldn't create an event_base: exiting\n");
-        return false;
+    int nEventThreads = std::max((long)GetArg("-rpceventthreads", DEFAULT_HTTP_EVENT_THREADS), 1L);
+#ifndef LEV_OPT_REUSEABLE_PORT
+    if (nEventThreads > 1) {
+        LogPrintf("HTTP: -rpceventthreads needs SO_REUSEPORT support in libevent, using one event thread\n");
+        nEventThreads = 1;
     }
+#endif
 
-    /* Create a new evhttp object to handle requests. */
-    http = evhttp_new(base); // XXX RAII
-    if (!http) {
-        LogPrintf("couldn't create evhttp. Exiting.\n");
-        event_base_free(base);
-        return false;
-    }
+    for (int n = 0; n < nEventThreads; n++) {
+        std::unique_ptr<HTTPEventThread> thread(new HTTPEventThread());
+        thread->base = event_base_new();
+        if (!thread->base) {
+            LogPrintf("Couldn't create an event_base: exiting\n");
+            break;
+        }
+
+        /* Create a new evhttp object to handle requests. */
+        thread->http = evhttp_new(thread->base);
+        if (!thread->http) {
+            LogPrintf("couldn't create evhttp. Exiting.\n");
+            HTTPFreeEventThread(*thread);
+            break;
+        }
 
-    evhttp_set_timeout(http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
-    evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
-    evhttp_set_max_body_size(http, MAX_SIZE);
-    evhttp_set_gencb(http, http_request_cb, NULL);
+        evhttp_set_timeout(thread->http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
+        evhttp_set_max_headers_size(thread->http, MAX_HEADERS_SIZE);
+        evhttp_set_max_body_size(thread->http, MAX_SIZE);
+        evhttp_set_gencb(thread->http, http_request_cb, NULL);
 
-    if (!HTTPBindAddresses(http)) {
-        LogPrintf("Unable to bind any endpoint for RPC server\n");
-        evhttp_free(http);
-        event_base_free(base);
+        if (!HTTPBindAddresses(*thread, nEventThreads > 1)) {
+            LogPrintf("Unable to bind any endpoint for RPC server\n");
+            HTTPFreeEventThread(*thread);
+            break;
+        }
+        eventThreads.push_back(std::move(thread));
+    }
+    if ((int)eventThreads.size() < nEventThreads) {
+        BOOST_FOREACH (std::unique_ptr<HTTPEventThread>& thread, eventThreads)
+            HTTPFreeEventThread(*thread);
+        eventThreads.clear();
         return false;
     }
 
     LogPrint("http", "Initialized HTTP server\n");
     int workQueueDepth = std::max((long)GetArg("-rpcworkqueue", DEFAULT_HTTP_WORKQUEUE), 1L);
-    LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
+    int64_t maxQueueLatency = std::max((int64_t)GetArg("-rpcmaxqueuelatency", DEFAULT_HTTP_MAX_QUEUE_LATENCY), (int64_t)0);
+    LogPrintf("HTTP: creating work queue of depth %d, turning requests away after %dms in it\n", workQueueDepth, maxQueueLatency);
 
-    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
-    eventBase = base;
-    eventHTTP = http;
+    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth, maxQueueLatency * 1000);
+    eventBase = eventThreads.front()->base;
     return true;
 }
 
-boost::thread threadHTTP;
-
 bool StartHTTPServer()
 {
     LogPrint("http", "Starting HTTP server\n");
     int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
-    LogPrintf("HTTP: starting %d worker threads\n", rpcThreads);
-    threadHTTP = boost::thread(boost::bind(&ThreadHTTP, eventBase, eventHTTP));
+    LogPrintf("HTTP: starting %d event threads and %d worker threads\n", eventThreads.size(), rpcThreads);
+    BOOST_FOREACH (std::unique_ptr<HTTPEventThread>& thread, eventThreads)
+        thread->thread = boost::thread(boost::bind(&ThreadHTTP, thread->base, thread->http));
 
     for (int i = 0; i < rpcThreads; i++)
         boost::thread(boost::bind(&HTTPWorkQueueRun, workQueue));
     return true;
 }
 
+/** Stop accepting connections on thread and reject requests on its current ones */
+static void HTTPInterruptEventThread(HTTPEventThread& thread)
+{
+    // Unlisten sockets
+    BOOST_FOREACH (evhttp_bound_socket *socket, thread.boundSockets) {
+        evhttp_del_accept_socket(thread.http, socket);
+    }
+    // Reject requests on current connections
+    evhttp_set_gencb(thread.http, http_reject_request_cb, NULL);
+}
+
 void InterruptHTTPServer()
 {
     LogPrint("http", "Interrupting HTTP server\n");
-    if (eventHTTP) {
-        // Unlisten sockets
-        BOOST_FOREACH (evhttp_bound_socket *socket, boundSockets) {
-            evhttp_del_accept_socket(eventHTTP, socket);
-        }
-        // Reject requests on current connections
-        evhttp_set_gencb(eventHTTP, http_reject_request_cb, NULL);
-    }
+    BOOST_FOREACH (std::unique_ptr<HTTPEventThread>& thread, eventThreads)
+        HTTPInterruptEventThread(*thread);
     if (workQueue)
         workQueue->Interrupt();
 }
@@ -474,35 +589,41 @@ void StopHTTPServer()
         workQueue->WaitExit();
         delete workQueue;
     }
-    if (eventBase) {
-        LogPrint("http", "Waiting for HTTP event thread to exit\n");
-        // Give event loop a few seconds to exit (to send back last RPC responses), then break it
+    if (!eventThreads.empty()) {
+        LogPrint("http", "Waiting for HTTP event threads to exit\n");
+        // Give event loops a few seconds to exit (to send back last RPC responses), then break them
         // Before this was solved with event_base_loopexit, but that didn't work as expected in
         // at least libevent 2.0.21 and always introduced a delay. In libevent
         // master that appears to be solved, so in the future that solution
         // could be used again (if desirable).
         // (see discussion in https://github.com/bitcoin/bitcoin/pull/6990)
+        BOOST_FOREACH (std::unique_ptr<HTTPEventThread>& thread, eventThreads) {
 #if BOOST_VERSION >= 105000
-        if (!threadHTTP.try_join_for(boost::chrono::milliseconds(2000))) {
+            if (!thread->thread.try_join_for(boost::chrono::milliseconds(2000))) {
 #else
-        if (!threadHTTP.timed_join(boost::posix_time::milliseconds(2000))) {
+            if (!thread->thread.timed_join(boost::posix_time::milliseconds(2000))) {
 #endif
-            LogPrintf("HTTP event loop did not exit within allotted time, sending loopbreak\n");
-            event_base_loopbreak(eventBase);
-            threadHTTP.join();
+                LogPrintf("HTTP event loop did not exit within allotted time, sending loopbreak\n");
+                event_base_loopbreak(thread->base);
+                thread->thread.join();
+            }
         }
     }
-    if (eventHTTP) {
-        evhttp_free(eventHTTP);
-        eventHTTP = 0;
-    }
-    if (eventBase) {
-        event_base_free(eventBase);
-        eventBase = 0;
-    }
+    BOOST_FOREACH (std::unique_ptr<HTTPEventThread>& thread, eventThreads)
+        HTTPFreeEventThread(*thread);
+    eventThreads.clear();
+    eventBase = 0;
     LogPrint("http", "Stopped HTTP server\n");
 }
 
+bool GetHTTPWorkQueueStats(HTTPWorkQueueStats& stats)
+{
+    if (!workQueue)
+        return false;
+    workQueue->GetStats(stats);
+    return true;
+}
+
 struct event_base* EventBase()
 {
     return eventBase;
@@ -535,12 +656,21 @@ void HTTPEvent::trigger(struct timeval* tv)
         evtimer_add(ev, tv); // trigger after timeval passed
 }
 HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
-                                                       replySent(false)
+                                                       base(eventBase),
+                                                       replySent(false),
+                                                       chunkedReply(false)
 {
+    evhttp_connection* con = evhttp_request_get_connection(req);
+    if (con)
+        base = evhttp_connection_get_base(con);
 }
 HTTPRequest::~HTTPRequest()
 {
-    if (!replySent) {
+    if (chunkedReply && !replySent) {
+        // The body is incomplete, but the status line is already out
+        LogPrintf("%s: Unfinished chunked reply\n", __func__);
+        EndChunkedReply();
+    } else if (!replySent) {
         // Keep track of whether reply was sent to avoid request leaks
         LogPrintf("%s: Unhandled request\n", __func__);
         WriteReply(HTTP_INTERNAL, "Unhandled request");
@@ -593,18 +723,62 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
 {
-    assert(!replySent && req);
+    assert(!replySent && !chunkedReply && req);
     // Send event to main http thread to send reply message
     struct evbuffer* evb = evhttp_request_get_output_buffer(req);
     assert(evb);
     evbuffer_add(evb, strReply.data(), strReply.size());
-    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+    HTTPEvent* ev = new HTTPEvent(base, true,
         boost::bind(evhttp_send_reply, req, nStatus, (const char*)NULL, (struct evbuffer *)NULL));
     ev->trigger(0);
     replySent = true;
     req = 0; // transferred back to main thread
 }
 
+void HTTPRequest::StartChunkedReply(int nStatus)
+{
+    assert(!replySent && !chunkedReply && req);
+    HTTPEvent* ev = new HTTPEvent(base, true,
+        boost::bind(evhttp_send_reply_start, req, nStatus, (const char*)NULL));
+    ev->trigger(0);
+    chunkedReply = true;
+}
+
+static void http_send_chunk(struct evhttp_request* req, const std::string& strChunk, std::shared_ptr<std::promise<void> > sent)
+{
+    struct evbuffer* evb = evbuffer_new();
+    evbuffer_add(evb, strChunk.data(), strChunk.size());
+    evhttp_send_reply_chunk(req, evb);
+    evbuffer_free(evb);
+    sent->set_value();
+}
+
+void HTTPRequest::WriteReplyChunk(const std::string& strChunk)
+{
+    assert(chunkedReply && !replySent && req);
+    if (strChunk.empty())
+        return;
+    // Do not run ahead of the event loop, which would only queue the whole
+    // body in memory again
+    if (chunkSent.valid())
+        chunkSent.wait();
+    std::shared_ptr<std::promise<void> > sent = std::make_shared<std::promise<void> >();
+    chunkSent = sent->get_future();
+    HTTPEvent* ev = new HTTPEvent(base, true,
+        boost::bind(http_send_chunk, req, strChunk, sent));
+    ev->trigger(0);
+}
+
+void HTTPRequest::EndChunkedReply()
+{
+    assert(chunkedReply && !replySent && req);
+    HTTPEvent* ev = new HTTPEvent(base, true,
+        boost::bind(evhttp_send_reply_end, req));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // transferred back to main thread
+}
+
 CService HTTPRequest::GetPeer()
 {
     evhttp_connection* con = evhttp_request_get_connection(req);
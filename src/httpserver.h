@@ -7,13 +7,18 @@
 
 #include <string>
 #include <stdint.h>
+#include <future>
 #include <boost/thread.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/function.hpp>
 
 static const int DEFAULT_HTTP_THREADS=4;
-static const int DEFAULT_HTTP_WORKQUEUE=16;
+static const int DEFAULT_HTTP_WORKQUEUE=256;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+//! Event loop threads accepting and serving HTTP connections
+static const int DEFAULT_HTTP_EVENT_THREADS=1;
+//! Milliseconds the oldest queued request may have waited before new ones are turned away
+static const int DEFAULT_HTTP_MAX_QUEUE_LATENCY=1000;
 
 struct evhttp_request;
 struct event_base;
@@ -44,8 +49,26 @@ void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPR
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
 
-/** Return evhttp event base. This can be used by submodules to
- * queue timers or custom events.
+/** State of the queue of HTTP requests waiting for a worker thread */
+struct HTTPWorkQueueStats
+{
+    size_t nDepth;
+    size_t nMaxDepth;
+    //! Highest depth reached since startup
+    size_t nPeakDepth;
+    //! Requests turned away because the queue was full
+    uint64_t nRejected;
+    //! How long the oldest queued request has waited, in microseconds
+    int64_t nLatencyMicros;
+    //! Requests turned away because the queue latency exceeded -rpcmaxqueuelatency
+    uint64_t nRejectedLatency;
+    int nThreads;
+};
+/** Get the state of the work queue, false if there is none */
+bool GetHTTPWorkQueueStats(HTTPWorkQueueStats& stats);
+
+/** Return the event base of the first HTTP event loop thread. This can be
+ * used by submodules to queue timers or custom events.
  */
 struct event_base* EventBase();
 
@@ -56,7 +79,12 @@ class HTTPRequest
 {
 private:
     struct evhttp_request* req;
+    //! Event loop that owns the connection, where replies must be sent from
+    struct event_base* base;
     bool replySent;
+    bool chunkedReply;
+    //! Set once the event loop has handed the last chunk of a chunked reply to libevent
+    std::future<void> chunkSent;
 
 public:
     HTTPRequest(struct evhttp_request* req);
@@ -112,6 +140,27 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Start a chunked reply, for bodies that are produced piecewise.
+     * nStatus is the HTTP status code to send. Write the body with
+     * WriteReplyChunk and complete the reply with EndChunkedReply.
+     *
+     * @note Call this instead of WriteReply, after writing the headers.
+     */
+    void StartChunkedReply(int nStatus);
+
+    /**
+     * Send the next piece of a chunked reply. Waits until the event loop took
+     * the previous piece, so at most one piece is queued per request.
+     */
+    void WriteReplyChunk(const std::string& strChunk);
+
+    /**
+     * Complete a chunked reply. As with WriteReply, do not call any other
+     * HTTPRequest methods after calling this.
+     */
+    void EndChunkedReply();
 };
 
 /** Event handler closure.
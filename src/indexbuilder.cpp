@@ -0,0 +1,363 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "indexbuilder.h"
+
+#include "chainparams.h"
+#include "indexwriter.h"
+#include "main.h"
+#include "sync.h"
+#include "txdb.h"
+#include "undo.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+/** The index entries of one block, read from disk without holding cs_main */
+struct CIndexBuildBlock
+{
+    const CBlockIndex* pindex;
+    CDiskBlockPos blockPos;
+    CDiskBlockPos undoPos;
+    bool fAddress;
+    bool fSpent;
+    bool fTimestamp;
+    bool fBlockFilter;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    //! outputs of the block, only the ones still unspent at the tip are indexed
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    GCSFilter::ElementSet blockFilterElements;
+
+    CIndexBuildBlock() : pindex(NULL), fAddress(false), fSpent(false), fTimestamp(false), fBlockFilter(false) {}
+};
+
+} // anon namespace
+
+static CCriticalSection cs_indexbuild;
+static std::map<std::string, CIndexBuildState> mapIndexBuilds;
+
+static const char* const INDEX_BUILD_NAMES[] = {"addressindex", "spentindex", "timestampindex", "blockfilterindex"};
+
+static bool* GetIndexFlag(const std::string& strName)
+{
+    if (strName == "addressindex")
+        return &fAddressIndex;
+    if (strName == "spentindex")
+        return &fSpentIndex;
+    if (strName == "timestampindex")
+        return &fTimestampIndex;
+    if (strName == "blockfilterindex")
+        return &fBlockFilterIndex;
+    return NULL;
+}
+
+bool ScheduleIndexBuild(const std::string& strName)
+{
+    bool* pfEnabled = GetIndexFlag(strName);
+    if (!pfEnabled)
+        return false;
+
+    LOCK2(cs_main, cs_indexbuild);
+    // Genesis outputs are not spendable, and ConnectBlock never indexes it either
+    CIndexBuildState state(chainActive.Height(), 1);
+    if (!pblocktree->WriteIndexBuildState(strName, state))
+        return error("%s: writing the %s build state failed", __func__, strName);
+    if (strName == "addressindex") {
+        // The builder writes compact keys, and the balances are computed once it is done
+        if (!pblocktree->WriteFlag("addressindexcompact", true) || !pblocktree->WriteFlag("addressbalanceindex", true))
+            return error("%s: writing the address index flags failed", __func__);
+    }
+    if (!pblocktree->WriteFlag(strName, true))
+        return error("%s: writing the %s flag failed", __func__, strName);
+
+    *pfEnabled = true;
+    mapIndexBuilds[strName] = state;
+    LogPrintf("%s: building %s up to height %d in the background\n", __func__, strName, state.nTargetHeight);
+    return true;
+}
+
+bool LoadIndexBuilds(bool fReindexing)
+{
+    LOCK(cs_indexbuild);
+    mapIndexBuilds.clear();
+    for (const char* pszName : INDEX_BUILD_NAMES) {
+        CIndexBuildState state;
+        if (!pblocktree->ReadIndexBuildState(pszName, state))
+            continue;
+        if (fReindexing || !*GetIndexFlag(pszName)) {
+            if (!pblocktree->EraseIndexBuildState(pszName))
+                return error("%s: erasing the %s build state failed", __func__, pszName);
+            continue;
+        }
+        LogPrintf("%s: resuming the %s build at height %d of %d\n", __func__, pszName, state.nNextHeight, state.nTargetHeight);
+        mapIndexBuilds[pszName] = state;
+    }
+    return true;
+}
+
+bool IsIndexBuilding(const std::string& strName)
+{
+    LOCK(cs_indexbuild);
+    return mapIndexBuilds.count(strName) > 0;
+}
+
+std::map<std::string, CIndexBuildState> GetIndexBuilds()
+{
+    LOCK(cs_indexbuild);
+    return mapIndexBuilds;
+}
+
+/** Whether the named build still has to index the block at nHeight */
+static bool IndexBuildCovers(const std::string& strName, int nHeight)
+{
+    AssertLockHeld(cs_indexbuild);
+    std::map<std::string, CIndexBuildState>::const_iterator it = mapIndexBuilds.find(strName);
+    return it != mapIndexBuilds.end() && it->second.nNextHeight <= nHeight && nHeight <= it->second.nTargetHeight;
+}
+
+/** Retire the builds that reached their target or the tip, whichever is lower */
+static bool FinishIndexBuilds()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_indexbuild);
+    std::map<std::string, CIndexBuildState>::iterator it = mapIndexBuilds.begin();
+    while (it != mapIndexBuilds.end()) {
+        if (it->second.nNextHeight <= std::min(it->second.nTargetHeight, chainActive.Height())) {
+            ++it;
+            continue;
+        }
+        // ConnectBlock kept updating the balances of the addresses it saw meanwhile, start over from the deltas
+        if (it->first == "addressindex" && (!SyncIndexWriter() || !paddressindexdb->RebuildAddressBalanceIndex()))
+            return error("%s: rebuilding the address balances failed", __func__);
+        if (!pblocktree->EraseIndexBuildState(it->first))
+            return error("%s: erasing the %s build state failed", __func__, it->first);
+        LogPrintf("%s: %s built\n", __func__, it->first);
+        mapIndexBuilds.erase(it++);
+    }
+    return true;
+}
+
+static int GetAddressType(const CScript& script, uint160& hashBytes)
+{
+    if (script.IsPayToScriptHash()) {
+        hashBytes = uint160(std::vector<unsigned char>(script.begin()+2, script.begin()+22));
+        return 2;
+    }
+    if (script.IsPayToPublicKeyHash()) {
+        hashBytes = uint160(std::vector<unsigned char>(script.begin()+3, script.begin()+23));
+        return 1;
+    }
+    hashBytes.SetNull();
+    return 0;
+}
+
+/** Read a block and its undo data and compute the entries ConnectBlock would have written */
+static bool ReadIndexBuildBlock(CIndexBuildBlock& b, const Consensus::Params& consensusParams)
+{
+    if (!b.fAddress && !b.fSpent && !b.fBlockFilter)
+        return true;
+
+    const int nHeight = b.pindex->nHeight;
+    CBlock block;
+    if (!ReadBlockFromDisk(block, b.blockPos, consensusParams, false) || block.GetHash() != b.pindex->GetBlockHash())
+        return error("%s: reading block %s failed", __func__, b.pindex->GetBlockHash().ToString());
+    CBlockUndo blockundo;
+    if (!UndoReadFromDisk(blockundo, b.undoPos, b.pindex->pprev->GetBlockHash()))
+        return error("%s: reading the undo data of block %s failed", __func__, b.pindex->GetBlockHash().ToString());
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s: undo data of block %s does not match", __func__, b.pindex->GetBlockHash().ToString());
+    if (b.fBlockFilter)
+        b.blockFilterElements = BasicFilterElements(block, blockundo);
+
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256& txhash = tx.GetHash();
+
+        if (!tx.IsCoinBase()) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                return error("%s: undo data of transaction %s does not match", __func__, txhash.ToString());
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxIn& input = tx.vin[j];
+                const CTxOut& prevout = txundo.vprevout[j].txout;
+                uint160 hashBytes;
+                int addressType = GetAddressType(prevout.scriptPubKey, hashBytes);
+
+                if (b.fAddress && addressType > 0)
+                    b.addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, j, true), prevout.nValue * -1));
+                if (b.fSpent)
+                    b.spentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, nHeight, prevout.nValue, addressType, hashBytes)));
+            }
+        }
+
+        if (b.fAddress) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut& out = tx.vout[k];
+                uint160 hashBytes;
+                int addressType = GetAddressType(out.scriptPubKey, hashBytes);
+                if (addressType == 0)
+                    continue;
+
+                b.addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, k, false), out.nValue));
+                b.addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight)));
+            }
+        }
+    }
+    return true;
+}
+
+/** Write the entries of the blocks that are still on the active chain, return the last height written */
+static bool WriteIndexBuildBlocks(const std::vector<CIndexBuildBlock>& vBlocks, int& nApplied)
+{
+    AssertLockHeld(cs_main);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    bool fHavePrevLogicalTS = false;
+    unsigned int prevLogicalTS = 0;
+    bool fHavePrevFilterHeader = false;
+    uint256 prevFilterHeader;
+
+    // The blocks connected so far must be written before the coins view is compared with their entries
+    if (!SyncIndexWriter())
+        return error("%s: writing the queued index updates failed", __func__);
+
+    nApplied = vBlocks.front().pindex->nHeight - 1;
+    for (const CIndexBuildBlock& b : vBlocks) {
+        // A reorg replaced the rest, the next round reads the new blocks
+        if (chainActive[b.pindex->nHeight] != b.pindex)
+            break;
+
+        addressIndex.insert(addressIndex.end(), b.addressIndex.begin(), b.addressIndex.end());
+        for (const std::pair<CAddressUnspentKey, CAddressUnspentValue>& entry : b.addressUnspentIndex) {
+            const CCoins* coins = pcoinsTip->AccessCoins(entry.first.txhash);
+            if (coins && coins->IsAvailable(entry.first.index))
+                addressUnspentIndex.push_back(entry);
+        }
+        spentIndex.insert(spentIndex.end(), b.spentIndex.begin(), b.spentIndex.end());
+
+        if (b.fTimestamp) {
+            unsigned int logicalTS = b.pindex->nTime;
+            if (!fHavePrevLogicalTS && !ptimestampindexdb->ReadTimestampBlockIndex(b.pindex->pprev->GetBlockHash(), prevLogicalTS))
+                prevLogicalTS = 0;
+            if (logicalTS <= prevLogicalTS)
+                logicalTS = prevLogicalTS + 1;
+
+            if (!ptimestampindexdb->WriteTimestampIndex(CTimestampIndexKey(logicalTS, b.pindex->GetBlockHash())) ||
+                !ptimestampindexdb->WriteTimestampBlockIndex(CTimestampBlockIndexKey(b.pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
+                return error("%s: writing the timestamp index failed", __func__);
+            prevLogicalTS = logicalTS;
+            fHavePrevLogicalTS = true;
+        }
+
+        if (b.fBlockFilter) {
+            // Each header commits to the one before, so the filters are written in chain order
+            if (!fHavePrevFilterHeader && !pblockfilterdb->ReadPrevBlockFilterHeader(b.pindex->pprev->GetBlockHash(), prevFilterHeader))
+                return error("%s: reading the filter header of block %s failed", __func__, b.pindex->pprev->GetBlockHash().ToString());
+            if (!pblockfilterdb->WriteBlockFilter(BlockFilter(BLOCK_FILTER_BASIC, b.pindex->GetBlockHash(), b.blockFilterElements), prevFilterHeader, prevFilterHeader))
+                return error("%s: writing the block filter index failed", __func__);
+            fHavePrevFilterHeader = true;
+        }
+        nApplied = b.pindex->nHeight;
+    }
+
+    if (!addressIndex.empty() && !paddressindexdb->WriteAddressIndex(addressIndex))
+        return error("%s: writing the address index failed", __func__);
+    if (!addressUnspentIndex.empty() && !paddressindexdb->UpdateAddressUnspentIndex(addressUnspentIndex))
+        return error("%s: writing the address unspent index failed", __func__);
+    if (!spentIndex.empty() && !pspentindexdb->UpdateSpentIndex(spentIndex))
+        return error("%s: writing the spent index failed", __func__);
+    return true;
+}
+
+static void ThreadIndexBuilder(int nThreads)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    int64_t nStart = GetTimeMillis();
+
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        std::vector<CIndexBuildBlock> vBlocks;
+        {
+            LOCK2(cs_main, cs_indexbuild);
+            // The index writer skips the filters of blocks whose predecessor has none yet, so the
+            // filter build follows the tip until it catches up rather than stopping at its target
+            std::map<std::string, CIndexBuildState>::iterator itFilter = mapIndexBuilds.find("blockfilterindex");
+            if (itFilter != mapIndexBuilds.end())
+                itFilter->second.nTargetHeight = std::max(itFilter->second.nTargetHeight, chainActive.Height());
+            if (!FinishIndexBuilds())
+                return;
+            if (mapIndexBuilds.empty())
+                break;
+
+            int nFrom = std::numeric_limits<int>::max();
+            int nTo = 0;
+            for (const std::pair<std::string, CIndexBuildState>& entry : mapIndexBuilds) {
+                nFrom = std::min(nFrom, entry.second.nNextHeight);
+                nTo = std::max(nTo, std::min(entry.second.nTargetHeight, chainActive.Height()));
+            }
+            nTo = std::min(nTo, nFrom + INDEX_BUILD_BATCH_SIZE - 1);
+
+            for (int nHeight = nFrom; nHeight <= nTo; nHeight++) {
+                CIndexBuildBlock b;
+                b.pindex = chainActive[nHeight];
+                if (!(b.pindex->nStatus & BLOCK_HAVE_DATA) || !(b.pindex->nStatus & BLOCK_HAVE_UNDO)) {
+                    LogPrintf("%s: block data at height %d is missing, the index builds need -reindex\n", __func__, nHeight);
+                    return;
+                }
+                b.blockPos = b.pindex->GetBlockPos();
+                b.undoPos = b.pindex->GetUndoPos();
+                b.fAddress = IndexBuildCovers("addressindex", nHeight);
+                b.fSpent = IndexBuildCovers("spentindex", nHeight);
+                b.fTimestamp = IndexBuildCovers("timestampindex", nHeight);
+                b.fBlockFilter = IndexBuildCovers("blockfilterindex", nHeight);
+                vBlocks.push_back(b);
+            }
+        }
+
+        if (!ParallelForEach(vBlocks.size(), nThreads, [&](size_t i) { return ReadIndexBuildBlock(vBlocks[i], consensusParams); })) {
+            LogPrintf("%s: reading blocks failed, stopping the index builds\n", __func__);
+            return;
+        }
+
+        LOCK2(cs_main, cs_indexbuild);
+        int nApplied;
+        if (!WriteIndexBuildBlocks(vBlocks, nApplied))
+            return;
+        // Checkpoint after the entries, a restart redoes at most one batch
+        for (std::pair<const std::string, CIndexBuildState>& entry : mapIndexBuilds) {
+            CIndexBuildState& state = entry.second;
+            if (state.nNextHeight > nApplied)
+                continue;
+            state.nNextHeight = std::min(nApplied, state.nTargetHeight) + 1;
+            if (!pblocktree->WriteIndexBuildState(entry.first, state)) {
+                LogPrintf("%s: writing the %s build state failed\n", __func__, entry.first);
+                return;
+            }
+        }
+        LogPrintf("Index build: height %d of %d\n", nApplied, chainActive.Height());
+    }
+    LogPrintf("%s: index builds done in %.3fs\n", __func__, (GetTimeMillis() - nStart) * 0.001);
+}
+
+void StartIndexBuilder(boost::thread_group& threadGroup)
+{
+    {
+        LOCK(cs_indexbuild);
+        if (mapIndexBuilds.empty())
+            return;
+    }
+    int nThreads = std::max(1, std::min((int)GetArg("-indexbuildthreads", DEFAULT_INDEX_BUILD_THREADS), MAX_INDEX_BUILD_THREADS));
+    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "indexbuild",
+                                          boost::function<void()>(boost::bind(&ThreadIndexBuilder, nThreads))));
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEXBUILDER_H
+#define BITCOIN_INDEXBUILDER_H
+
+#include <map>
+#include <string>
+
+struct CIndexBuildState;
+
+namespace boost {
+class thread_group;
+} // namespace boost
+
+/** Number of blocks indexed between two checkpoints */
+static const int INDEX_BUILD_BATCH_SIZE = 500;
+/** -indexbuildthreads default, threads reading blocks for a background index build */
+static const int DEFAULT_INDEX_BUILD_THREADS = 4;
+/** Maximum number of threads reading blocks for a background index build */
+static const int MAX_INDEX_BUILD_THREADS = 16;
+
+/** Build an optional index ("addressindex", "spentindex", "timestampindex", "blockfilterindex") that was
+ * switched on for an existing chain. The index is enabled right away so ConnectBlock
+ * writes it for new blocks, the blocks up to the current tip are indexed in the background.
+ */
+bool ScheduleIndexBuild(const std::string& strName);
+/** Pick up the builds interrupted by a shutdown, or drop them all when reindexing. */
+bool LoadIndexBuilds(bool fReindexing);
+/** Whether the named index is still being built, its queries would be incomplete. */
+bool IsIndexBuilding(const std::string& strName);
+/** The builds in progress by index name. */
+std::map<std::string, CIndexBuildState> GetIndexBuilds();
+/** Start the thread working through the scheduled builds, if there are any. */
+void StartIndexBuilder(boost::thread_group& threadGroup);
+
+#endif // BITCOIN_INDEXBUILDER_H
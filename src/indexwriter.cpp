@@ -0,0 +1,250 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "indexwriter.h"
+
+#include "init.h"
+#include "main.h"
+#include "timestampindex.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <deque>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+static boost::mutex csIndexQueue;
+//! signalled when an update is queued, when one is written and when the writer thread stops
+static boost::condition_variable condIndexQueue;
+static std::deque<boost::shared_ptr<const CIndexUpdate> > queueIndexUpdates;
+static uint64_t nIndexUpdatesQueued = 0;
+static uint64_t nIndexUpdatesWritten = 0;
+static bool fIndexWriterRunning = false;
+static bool fIndexWriterFailed = false;
+
+//! held while an update is written, so they are written one at a time and in order
+static boost::mutex csIndexWrite;
+//! the tip the index databases are at after the last update written, NULL before the first
+static const CBlockIndex* pindexIndexTip = NULL; // guarded by csIndexWrite
+
+static boost::mutex csIndexSnapshots;
+//! the snapshots handed out lately, newest last
+static std::deque<std::shared_ptr<const CIndexSnapshot> > dequeIndexSnapshots; // guarded by csIndexSnapshots
+
+CIndexSnapshot::CIndexSnapshot() : pindex(NULL) {}
+CIndexSnapshot::~CIndexSnapshot() {}
+
+static bool WriteIndexUpdate(const CIndexUpdate& update)
+{
+    if (!update.txIndex.empty() && !ptxindexdb->WriteTxIndex(update.txIndex))
+        return error("%s: failed to write transaction index", __func__);
+
+    if (!update.addressIndex.empty()) {
+        if (update.fConnect ? !paddressindexdb->WriteAddressIndex(update.addressIndex) : !paddressindexdb->EraseAddressIndex(update.addressIndex))
+            return error("%s: failed to write address index", __func__);
+    }
+    if (!update.addressUnspentIndex.empty() && !paddressindexdb->UpdateAddressUnspentIndex(update.addressUnspentIndex))
+        return error("%s: failed to write address unspent index", __func__);
+
+    if (!update.spentIndex.empty() && !pspentindexdb->UpdateSpentIndex(update.spentIndex))
+        return error("%s: failed to write spent index", __func__);
+
+    if (update.fConnect && update.fTimestamp) {
+        unsigned int logicalTS = update.nTime;
+        unsigned int prevLogicalTS = 0;
+
+        // The previous block's logical timestamp was written by the update before this one
+        if (!update.hashPrevBlock.IsNull())
+            if (!ptimestampindexdb->ReadTimestampBlockIndex(update.hashPrevBlock, prevLogicalTS))
+                LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
+
+        if (logicalTS <= prevLogicalTS) {
+            logicalTS = prevLogicalTS + 1;
+            LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, update.nTime, prevLogicalTS, logicalTS);
+        }
+
+        if (!ptimestampindexdb->WriteTimestampIndex(CTimestampIndexKey(logicalTS, update.hashBlock)))
+            return error("%s: failed to write timestamp index", __func__);
+        if (!ptimestampindexdb->WriteTimestampBlockIndex(CTimestampBlockIndexKey(update.hashBlock), CTimestampBlockIndexValue(logicalTS)))
+            return error("%s: failed to write blockhash index", __func__);
+    }
+
+    if (update.fConnect && update.fBlockFilter) {
+        uint256 prevHeader, header;
+        // While the index is built in the background the blocks before may have no filter yet,
+        // the build writes this one once it gets there
+        if (!pblockfilterdb->ReadPrevBlockFilterHeader(update.hashPrevBlock, prevHeader))
+            LogPrint("index", "%s: no filter header for the block before %s yet\n", __func__, update.hashBlock.ToString());
+        else if (!pblockfilterdb->WriteBlockFilter(BlockFilter(BLOCK_FILTER_BASIC, update.hashBlock, update.blockFilterElements), prevHeader, header))
+            return error("%s: failed to write block filter index", __func__);
+    }
+    return true;
+}
+
+/** Write the update at the front of the queue, false if there is none. Requires csIndexWrite. */
+static bool WriteNextIndexUpdate()
+{
+    boost::shared_ptr<const CIndexUpdate> update;
+    {
+        boost::lock_guard<boost::mutex> lock(csIndexQueue);
+        if (queueIndexUpdates.empty())
+            return false;
+        update = queueIndexUpdates.front();
+    }
+
+    bool fFailed;
+    {
+        boost::lock_guard<boost::mutex> lock(csIndexQueue);
+        fFailed = fIndexWriterFailed;
+    }
+    if (!fFailed && !WriteIndexUpdate(*update)) {
+        strMiscWarning = "Failed to write to index database";
+        LogPrintf("*** %s\n", strMiscWarning);
+        uiInterface.ThreadSafeMessageBox(_("Error: A fatal internal error occurred, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        fFailed = true;
+    }
+
+    // A disconnected block leaves the indexes at its parent
+    pindexIndexTip = update->fConnect ? update->pindex : update->pindex->pprev;
+
+    boost::lock_guard<boost::mutex> lock(csIndexQueue);
+    fIndexWriterFailed = fFailed;
+    queueIndexUpdates.pop_front();
+    nIndexUpdatesWritten++;
+    condIndexQueue.notify_all();
+    return true;
+}
+
+static void ThreadIndexWriter()
+{
+    try {
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(csIndexQueue);
+                while (queueIndexUpdates.empty())
+                    condIndexQueue.wait(lock);
+            }
+            boost::lock_guard<boost::mutex> lockWrite(csIndexWrite);
+            WriteNextIndexUpdate();
+        }
+    } catch (...) {
+        // Whatever is still queued is written by the next SyncIndexWriter call
+        boost::lock_guard<boost::mutex> lock(csIndexQueue);
+        fIndexWriterRunning = false;
+        condIndexQueue.notify_all();
+        throw;
+    }
+}
+
+void CIndexWriter::UpdatedIndexes(const boost::shared_ptr<const CIndexUpdate>& update)
+{
+    {
+        // Never interrupted half way through connecting a block, the wait ends when the writer stops
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(csIndexQueue);
+        while (fIndexWriterRunning && queueIndexUpdates.size() >= MAX_INDEX_WRITER_QUEUE)
+            condIndexQueue.wait(lock);
+        queueIndexUpdates.push_back(update);
+        nIndexUpdatesQueued++;
+        if (fIndexWriterRunning) {
+            condIndexQueue.notify_all();
+            return;
+        }
+    }
+    SyncIndexWriter();
+}
+
+void StartIndexWriter(boost::thread_group& threadGroup)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(csIndexQueue);
+        fIndexWriterRunning = true;
+    }
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "indexwriter", &ThreadIndexWriter));
+}
+
+bool SyncIndexWriter()
+{
+    uint64_t nTarget;
+    {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(csIndexQueue);
+        nTarget = nIndexUpdatesQueued;
+        while (fIndexWriterRunning && nIndexUpdatesWritten < nTarget)
+            condIndexQueue.wait(lock);
+        if (nIndexUpdatesWritten >= nTarget)
+            return !fIndexWriterFailed;
+    }
+
+    boost::lock_guard<boost::mutex> lockWrite(csIndexWrite);
+    while (true) {
+        {
+            boost::lock_guard<boost::mutex> lock(csIndexQueue);
+            if (nIndexUpdatesWritten >= nTarget)
+                return !fIndexWriterFailed;
+        }
+        WriteNextIndexUpdate();
+    }
+}
+
+bool FlushIndexWriter()
+{
+    if (!SyncIndexWriter())
+        return false;
+    CIndexDB* indexes[] = {ptxindexdb, paddressindexdb, pspentindexdb, ptimestampindexdb, pblockfilterdb};
+    for (CIndexDB* pindexdb : indexes) {
+        if (pindexdb && !pindexdb->Sync())
+            return false;
+    }
+    return true;
+}
+
+std::shared_ptr<const CIndexSnapshot> GetIndexSnapshot()
+{
+    if (!SyncIndexWriter())
+        return std::shared_ptr<const CIndexSnapshot>();
+
+    // No update is half written while the snapshots are taken
+    boost::lock_guard<boost::mutex> lockWrite(csIndexWrite);
+    // Before the first update the indexes are at the tip they were loaded with
+    const CBlockIndex* pindex = pindexIndexTip ? pindexIndexTip : GetChainTipSnapshot()->pindex;
+    boost::lock_guard<boost::mutex> lock(csIndexSnapshots);
+    if (!dequeIndexSnapshots.empty() && dequeIndexSnapshots.back()->pindex == pindex)
+        return dequeIndexSnapshots.back();
+
+    std::shared_ptr<CIndexSnapshot> snapshot = std::make_shared<CIndexSnapshot>();
+    snapshot->pindex = pindex;
+    if (paddressindexdb)
+        snapshot->address.reset(new CDBSnapshot(*paddressindexdb));
+    if (pspentindexdb)
+        snapshot->spent.reset(new CDBSnapshot(*pspentindexdb));
+    if (ptimestampindexdb)
+        snapshot->timestamp.reset(new CDBSnapshot(*ptimestampindexdb));
+    dequeIndexSnapshots.push_back(snapshot);
+    if (dequeIndexSnapshots.size() > MAX_INDEX_SNAPSHOTS)
+        dequeIndexSnapshots.pop_front();
+    return snapshot;
+}
+
+std::shared_ptr<const CIndexSnapshot> GetIndexSnapshot(const uint256& hashBlock)
+{
+    boost::lock_guard<boost::mutex> lock(csIndexSnapshots);
+    for (const std::shared_ptr<const CIndexSnapshot>& snapshot : dequeIndexSnapshots) {
+        if (snapshot->pindex && snapshot->pindex->GetBlockHash() == hashBlock)
+            return snapshot;
+    }
+    return std::shared_ptr<const CIndexSnapshot>();
+}
+
+void ResetIndexSnapshots()
+{
+    {
+        boost::lock_guard<boost::mutex> lockWrite(csIndexWrite);
+        pindexIndexTip = NULL;
+    }
+    boost::lock_guard<boost::mutex> lock(csIndexSnapshots);
+    dequeIndexSnapshots.clear();
+}
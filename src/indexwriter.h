@@ -0,0 +1,95 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEXWRITER_H
+#define BITCOIN_INDEXWRITER_H
+
+#include "addressindex.h"
+#include "amount.h"
+#include "blockfilter.h"
+#include "spentindex.h"
+#include "txdb.h"
+#include "uint256.h"
+#include "validationinterface.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+class CBlockIndex;
+class CDBSnapshot;
+
+namespace boost {
+class thread_group;
+} // namespace boost
+
+/** Number of block updates the index writer may fall behind before block connection waits for it */
+static const unsigned int MAX_INDEX_WRITER_QUEUE = 100;
+/** Number of index snapshots of recent tips kept for paged reads to continue on */
+static const unsigned int MAX_INDEX_SNAPSHOTS = 4;
+
+/** The optional index entries of one connected or disconnected block */
+struct CIndexUpdate
+{
+    bool fConnect;
+    //! the block, its entry in mapBlockIndex is never freed while the indexes are open
+    const CBlockIndex* pindex;
+    uint256 hashBlock;
+    uint256 hashPrevBlock;
+    unsigned int nTime;
+    std::vector<std::pair<uint256, CDiskTxPos> > txIndex;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    //! whether to write the timestamp index entries of a connected block
+    bool fTimestamp;
+    //! whether to write the basic filter of a connected block, built from blockFilterElements
+    bool fBlockFilter;
+    GCSFilter::ElementSet blockFilterElements;
+
+    CIndexUpdate() : fConnect(true), pindex(NULL), nTime(0), fTimestamp(false), fBlockFilter(false) {}
+};
+
+/** Read-only views of the address, spent and timestamp index databases, all as of the same tip.
+ * Readers use them without cs_main; the views are NULL for the indexes that are off. */
+struct CIndexSnapshot
+{
+    //! the last block whose index updates the views contain
+    const CBlockIndex* pindex;
+    std::unique_ptr<CDBSnapshot> address;
+    std::unique_ptr<CDBSnapshot> spent;
+    std::unique_ptr<CDBSnapshot> timestamp;
+
+    CIndexSnapshot();
+    ~CIndexSnapshot();
+};
+
+/** Writes the index updates of the validation interface to the index databases.
+ * Updates are queued and written in order on a thread of their own, once it was started;
+ * before that they are written right away.
+ */
+class CIndexWriter : public CValidationInterface
+{
+protected:
+    void UpdatedIndexes(const boost::shared_ptr<const CIndexUpdate>& update);
+};
+
+/** Start the thread writing the queued index updates */
+void StartIndexWriter(boost::thread_group& threadGroup);
+/** Wait until the index updates queued so far are written, or write them here if the thread is gone.
+ * Readers use this to see the entries of the blocks already connected.
+ */
+bool SyncIndexWriter();
+/** Write the queued index updates and sync the index databases, before the chainstate is flushed */
+bool FlushIndexWriter();
+/** Snapshots of the indexes with the updates queued so far written, shared by the readers of the same
+ * tip. NULL if the index writer failed. */
+std::shared_ptr<const CIndexSnapshot> GetIndexSnapshot();
+/** The snapshots handed out for an earlier tip, while they are among the last MAX_INDEX_SNAPSHOTS;
+ * later pages of a paged read use them to see the same state as the first. NULL once dropped. */
+std::shared_ptr<const CIndexSnapshot> GetIndexSnapshot(const uint256& hashBlock);
+/** Drop the kept snapshots and the tip of the index writer, before the index databases or the block index are unloaded */
+void ResetIndexSnapshots();
+
+#endif // BITCOIN_INDEXWRITER_H
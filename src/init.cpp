@@ -11,23 +11,35 @@
 
 #include "addrman.h"
 #include "amount.h"
+#include "blockfilemap.h"
+#include "blockpipeline.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "coinswriter.h"
 #include "consensus/validation.h"
+#include "crypto/aes.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
+#include "crypto/sha256.h"
 #include "httpserver.h"
 #include "httprpc.h"
+#include "indexbuilder.h"
+#include "indexwriter.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
 #include "policy/policy.h"
+#include "profiler.h"
+#include "rpc/blockchain.h"
+#include "rpc/jobs.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
 #include "script/standard.h"
 #include "script/sigcache.h"
 #include "scheduler.h"
+#include "stratum.h"
 #include "timedata.h"
 #include "txdb.h"
 #include "txmempool.h"
@@ -35,6 +47,7 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utxostats.h"
 #include "validationinterface.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
@@ -59,6 +72,7 @@
 
 #if ENABLE_ZMQ
 #include "zmq/zmqnotificationinterface.h"
+#include "zmq/zmqrpc.h"
 #endif
 
 using namespace std;
@@ -68,11 +82,10 @@ static const bool DEFAULT_PROXYRANDOMIZE = true;
 static const bool DEFAULT_REST_ENABLE = false;
 static const bool DEFAULT_DISABLE_SAFEMODE = false;
 static const bool DEFAULT_STOPAFTERBLOCKIMPORT = false;
+static const int DEFAULT_SCHEDULER_THREADS = 2;
 
 
-#if ENABLE_ZMQ
-static CZMQNotificationInterface* pzmqNotificationInterface = NULL;
-#endif
+static CIndexWriter* pindexwriter = NULL;
 
 #ifdef WIN32
 // Win32 LevelDB doesn't use filedescriptors, and the ones used for
@@ -156,6 +169,15 @@ public:
             abort();
         }
     }
+    void GetCoinsMany(const std::vector<uint256> &txids, std::vector<CCoins> &coins, std::vector<bool> &found, int nThreads) const {
+        try {
+            base->GetCoinsMany(txids, coins, found, nThreads);
+        } catch(const std::runtime_error& e) {
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            abort();
+        }
+    }
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
@@ -166,6 +188,7 @@ static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 void Interrupt(boost::thread_group& threadGroup)
 {
     InterruptHTTPServer();
+    InterruptStratumServer();
     InterruptHTTPRPC();
     InterruptRPC();
     InterruptREST();
@@ -187,9 +210,11 @@ void Shutdown()
     /// module was initialized.
     RenameThread("mil-shutoff");
     mempool.AddTransactionsUpdated(1);
+    GenerateBitcoins(false, 0, Params());
 
     StopHTTPRPC();
     StopREST();
+    StopStratumServer();
     StopRPC();
     StopHTTPServer();
 #ifdef ENABLE_WALLET
@@ -199,6 +224,12 @@ void Shutdown()
     StopNode();
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
+    StopProfiler();
+
+    // Not before the mempool was loaded, which would replace the file with
+    // the part of it loaded so far
+    if (mempool.IsLoaded() && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
 
     if (fFeeEstimatesInitialized)
     {
@@ -216,14 +247,34 @@ void Shutdown()
         if (pcoinsTip != NULL) {
             FlushStateToDisk();
         }
+        if (paddressindexdb != NULL && !paddressindexdb->WriteAddressFilter())
+            LogPrintf("%s: failed to write the address filter\n", __func__);
         delete pcoinsTip;
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinswriter;
+        pcoinswriter = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
+        if (pindexwriter) {
+            UnregisterValidationInterface(pindexwriter);
+            delete pindexwriter;
+            pindexwriter = NULL;
+        }
+        ResetIndexSnapshots();
+        delete ptxindexdb;
+        ptxindexdb = NULL;
+        delete paddressindexdb;
+        paddressindexdb = NULL;
+        delete pspentindexdb;
+        pspentindexdb = NULL;
+        delete ptimestampindexdb;
+        ptimestampindexdb = NULL;
+        delete pblockfilterdb;
+        pblockfilterdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -286,8 +337,21 @@ void OnRPCStopped()
     LogPrint("rpc", "RPC stopped.\n");
 }
 
+/** Whether a command changes the node's state, which a follower leaves to its leader */
+static bool IsFollowerRefusedCommand(const CRPCCommand& cmd)
+{
+    static const std::set<std::string> setRefused = {
+        "sendrawtransaction", "loadtxoutset", "pruneblockchain", "addnode", "disconnectnode", "setban", "clearbanned",
+    };
+    return cmd.category == "mining" || cmd.category == "generating" || cmd.category == "wallet" ||
+           cmd.category == "hidden" || setRefused.count(cmd.name);
+}
+
 void OnRPCPreCommand(const CRPCCommand& cmd)
 {
+    if (fFollowLeader && IsFollowerRefusedCommand(cmd))
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, strprintf("%s is not available on a follower, send it to the leader", cmd.name));
+
     // Observe safe mode
     string strWarning = GetWarnings("rpc");
     if (strWarning != "" && !GetBoolArg("-disablesafemode", DEFAULT_DISABLE_SAFEMODE) &&
@@ -305,12 +369,21 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-assumevalid=<hex>", strprintf(_("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s, testnet: %s)"), Params(CBaseChainParams::MAIN).GetConsensus().defaultAssumeValid.GetHex(), Params(CBaseChainParams::TESTNET).GetConsensus().defaultAssumeValid.GetHex()));
+    strUsage += HelpMessageOpt("-asyncblockstore", strprintf(_("Write blocks and the undo data of connected blocks to disk, and commit them, on a thread of its own (default: %u)"), DEFAULT_ASYNC_BLOCK_STORE));
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the chainstate to disk on a thread of its own while blocks are connected; the write may take up to -dbcache more memory (default: %u)"), DEFAULT_ASYNC_FLUSH));
+    strUsage += HelpMessageOpt("-blockmapfiles=<n>", strprintf(_("Keep the <n> most recently read block files mapped into memory to read blocks from (0 to %d, 0 = off, default: %d)"), MAX_BLOCK_MAP_FILES, DEFAULT_BLOCK_MAP_FILES));
+    strUsage += HelpMessageOpt("-blockreadahead=<n>", strprintf(_("Read and check up to <n> blocks from disk ahead of the one being connected (0 to %d, 0 = off, default: %d)"), MAX_BLOCK_READAHEAD, DEFAULT_BLOCK_READAHEAD));
+    strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Keep at most <n> orphan, replaced and rejected transactions in memory to reconstruct compact blocks from (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
+    strUsage += HelpMessageOpt("-compressblocks", strprintf(_("Write new blocks to the block files in a compact encoding of their transactions; the files then cannot be read by older versions (default: %u)"), DEFAULT_COMPRESS_BLOCKS));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), BITCOIN_CONF_FILENAME));
+    strUsage += HelpMessageOpt("-headersonly", strprintf(_("Sync, verify and serve block headers only; blocks and transactions are never downloaded. "
+            "Implies -blocksonly and the smallest -dbcache, and is incompatible with the wallet and the indexes (default: %u)"), DEFAULT_HEADERSONLY));
     if (mode == HMM_BITCOIND)
     {
 #ifndef WIN32
@@ -318,31 +391,50 @@ std::string HelpMessage(HelpMessageMode mode)
 #endif
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
+    strUsage += HelpMessageOpt("-dbblocksize=[<db>:]<n>", strprintf(_("Set the LevelDB table block size of the databases, or of database <db>, in kilobytes; <db> is chainstate, blockindex, txindex, addressindex, spentindex, timestampindex or blockfilterindex (%d to %d, default: %u)"), MIN_DB_BLOCK_SIZE_KB, MAX_DB_BLOCK_SIZE_KB, DEFAULT_DB_BLOCK_SIZE / 1024));
+    strUsage += HelpMessageOpt("-dbbloombits=[<db>:]<n>", strprintf(_("Set the LevelDB bloom filter bits per key of the databases, or of database <db>, 0 for none (0 to %d, default: %d)"), MAX_DB_BLOOM_BITS, DEFAULT_DB_BLOOM_BITS));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbcompression=[<db>:]<n>", _("Compress the LevelDB tables of the databases, or of database <db>, with Snappy if built with it (default: 1 for the optional indexes, 0 otherwise)"));
+    strUsage += HelpMessageOpt("-dbmaxopenfiles=[<db>:]<n>", strprintf(_("Set the number of LevelDB table files the databases, or database <db>, keep open (%d to %d, default: %d)"), DEFAULT_DB_MAX_OPEN_FILES, MAX_DB_MAX_OPEN_FILES, DEFAULT_DB_MAX_OPEN_FILES));
+    strUsage += HelpMessageOpt("-ethashlightcache=<n>", strprintf(_("Set the memory budget for Ethash light caches of past epochs in megabytes (default: %u)"), DEFAULT_ETHASH_LIGHT_CACHE));
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-maxmemory=<n>", strprintf(_("Soft limit on the memory of the node in megabytes, as getmemoryinfo reports it: over it, the coins cache is flushed early and Ethash light caches are evicted (0 = no limit, default: %u)"), DEFAULT_MAX_MEMORY));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-prefetchthreads=<n>", strprintf(_("Set the number of threads that read the inputs of a block from the coin database before it is connected (0 to %d, 0 = off, default: %d)"),
+        MAX_PREFETCH_THREADS, DEFAULT_PREFETCH_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
-    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode is incompatible with -txindex and -rescan. "
+    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, "
+            "and enables automatic pruning of old blocks if a target size in MiB is provided. The address, spent, timestamp and block filter indexes are kept. "
+            "This mode is incompatible with -txindex and -rescan. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
-            "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+            "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >%u = automatically prune block files to stay under the specified target size in MiB)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
+    strUsage += HelpMessageOpt("-reindexthreads=<n>", strprintf(_("Set the number of threads that scan the blk*.dat files during -reindex (0 to %d, 0 = one block at a time, default: %d)"),
+        MAX_REINDEX_THREADS, DEFAULT_REINDEX_THREADS));
+    strUsage += HelpMessageOpt("-scriptcheckcpus=<list>", _("Pin the script verification threads to these CPUs in turn, e.g. the cores of one NUMA node: a comma separated list of CPU numbers and ranges such as 0-15,32-47 (default: not pinned)"));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-undocache=<n>", strprintf(_("Keep the last <n> connected blocks and their undo data in memory, so a reorg of up to <n> blocks reads neither from disk (0 to %d, 0 = off, default: %d)"), MAX_UNDO_CACHE, DEFAULT_UNDO_CACHE));
+    strUsage += HelpMessageOpt("-utxostats", strprintf(_("Keep the UTXO set statistics up to date block by block, so gettxoutsetinfo need not scan the set (default: %u)"), DEFAULT_UTXO_STATS));
 
     strUsage += HelpMessageOpt("-addressindex", strprintf(_("Maintain a full address index, used to query for the balance, txids and unspent outputs for addresses (default: %u)"), DEFAULT_ADDRESSINDEX));
+    strUsage += HelpMessageOpt("-addressindexthreads=<n>", strprintf(_("Set the number of threads a query for several addresses is spread over (1 to %d, default: %d)"), MAX_ADDRESSINDEX_THREADS, DEFAULT_ADDRESSINDEX_THREADS));
     strUsage += HelpMessageOpt("-timestampindex", strprintf(_("Maintain a timestamp index for block hashes, used to query block hashes by range of timestamps (default: %u)"), DEFAULT_TIMESTAMPINDEX));
     strUsage += HelpMessageOpt("-spentindex", strprintf(_("Maintain a full spent index, used to query the spending txid and input index for an outpoint (default: %u)"), DEFAULT_SPENTINDEX));
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Maintain the basic compact filters of blocks (BIP 158), served over REST and with -peerblockfilters to peers (default: %u)"), DEFAULT_BLOCKFILTERINDEX));
+    strUsage += HelpMessageOpt("-indexbuildthreads=<n>", strprintf(_("Set the number of threads reading blocks when an index switched on for an existing chain is built (1 to %d, default: %d)"), MAX_INDEX_BUILD_THREADS, DEFAULT_INDEX_BUILD_THREADS));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -350,9 +442,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-bantime=<n>", strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), DEFAULT_MISBEHAVING_BANTIME));
     strUsage += HelpMessageOpt("-bind=<addr>", _("Bind to given address and always listen on it. Use [host]:port notation for IPv6"));
     strUsage += HelpMessageOpt("-connect=<ip>", _("Connect only to the specified node(s)"));
+    strUsage += HelpMessageOpt("-follow=<ip>", _("Follow a trusted leader node: connect only to it, apply its blocks without checking their proof of work or scripts, and answer only RPC calls that read"));
     strUsage += HelpMessageOpt("-discover", _("Discover own IP addresses (default: 1 when listening and no -externalip or -proxy)"));
     strUsage += HelpMessageOpt("-dns", _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + strprintf(_("(default: %u)"), DEFAULT_NAME_LOOKUP));
     strUsage += HelpMessageOpt("-dnsseed", _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)"));
+    strUsage += HelpMessageOpt("-earlyblockrelay", strprintf(_("Send new blocks to the peers that asked for high-bandwidth compact blocks as soon as their proof of work and transactions are checked, before they are connected (default: %u)"), DEFAULT_EARLY_BLOCK_RELAY));
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), DEFAULT_FORCEDNSSEED));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
@@ -360,16 +454,21 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), DEFAULT_MAX_PEER_CONNECTIONS));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXRECEIVEBUFFER));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXSENDBUFFER));
+    strUsage += HelpMessageOpt("-maxtotalreceivebuffer=<n>", strprintf(_("Maximum receive buffer of all connections together, <n>*1000 bytes; peers with a message waiting to be processed pause beyond it (default: %u)"), DEFAULT_MAXTOTALRECEIVEBUFFER));
     strUsage += HelpMessageOpt("-maxtimeadjustment", strprintf(_("Maximum allowed median peer time offset adjustment. Local perspective of time may be influenced by peers forward or backward by this amount. (default: %u seconds)"), DEFAULT_MAX_TIME_ADJUSTMENT));
+    strUsage += HelpMessageOpt("-msghandthreads=<n>", strprintf(_("Set the number of threads processing peer messages (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), DEFAULT_PERMIT_BAREMULTISIG));
+    strUsage += HelpMessageOpt("-peerblockfilters", strprintf(_("Serve compact block filters to peers (BIP 157), needs -blockfilterindex (default: %u)"), DEFAULT_PEERBLOCKFILTERS));
     strUsage += HelpMessageOpt("-peerbloomfilters", strprintf(_("Support filtering of blocks and transaction with bloom filters (default: %u)"), DEFAULT_PEERBLOOMFILTERS));
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), Params(CBaseChainParams::MAIN).GetDefaultPort(), Params(CBaseChainParams::TESTNET).GetDefaultPort()));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), DEFAULT_PROXYRANDOMIZE));
     strUsage += HelpMessageOpt("-rpcserialversion", strprintf(_("Sets the serialization of raw transaction or block hex returned in non-verbose mode, non-segwit(0) or segwit(1) (default: %d)"), DEFAULT_RPC_SERIALIZE_VERSION));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+    strUsage += HelpMessageOpt("-socketevents=<method>", _("Wait for peer sockets with <method> (epoll, kqueue or select, default: epoll on Linux, kqueue on BSD and OS X, select elsewhere)"));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
     strUsage += HelpMessageOpt("-torcontrol=<ip>:<port>", strprintf(_("Tor control port to use if onion listening enabled (default: %s)"), DEFAULT_TOR_CONTROL));
     strUsage += HelpMessageOpt("-torpassword=<pass>", _("Tor control port password (default: empty)"));
@@ -397,6 +496,12 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubhashtx=<address>", _("Enable publish hash transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubmininginfo=<address>", _("Enable publish mining telemetry in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubrpcjob=<address>", _("Enable publish RPC jobs as they finish in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubsequence=<address>", _("Enable publish mempool additions and removals with their mempool sequence number in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubaddressdelta=<address>", _("Enable publish the address index deltas of mempool transactions and connected or disconnected blocks in <address> (requires -addressindex)"));
+    strUsage += HelpMessageOpt("-zmqpub<type>hwm=<n>", strprintf(_("Drop <type> notifications for a subscriber that is <n> messages behind, for instance -zmqpubhashtxhwm (default: %d)"), DEFAULT_ZMQ_SNDHWM));
+    strUsage += HelpMessageOpt("-zmqtxbatchms=<n>", strprintf(_("Publish the hashtx and rawtx notifications of up to <n> milliseconds as one message, 0 to publish each right away (default: %d)"), DEFAULT_ZMQ_TX_BATCH_MS));
 #endif
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
@@ -411,13 +516,17 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", "Randomly drop 1 of every <n> network messages");
         strUsage += HelpMessageOpt("-fuzzmessagestest=<n>", "Randomly fuzz 1 of every <n> network messages");
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf("Stop running after importing blocks from disk (default: %u)", DEFAULT_STOPAFTERBLOCKIMPORT));
+        strUsage += HelpMessageOpt("-lockprofiling", strprintf("Record how long locks wait and are held per acquisition site, see getlockcontention (default: %u)", DEFAULT_LOCKPROFILING));
+        strUsage += HelpMessageOpt("-profile=<file>", "Sample the CPU usage of all threads and write it as a pprof CPU profile to <file>, relative to the data directory, and per thread name to <file>.<thread>; see setprofiling");
+        strUsage += HelpMessageOpt("-profilehz=<n>", strprintf("Samples per CPU second of the profiler (default: %u)", DEFAULT_PROFILE_HZ));
+        strUsage += HelpMessageOpt("-schedulerthreads=<n>", strprintf("Number of threads running background tasks, low priority ones never take all of them (default: %d)", DEFAULT_SCHEDULER_THREADS));
         strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
         strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
         strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-bip9params=deployment:start:end", "Use given start/end times for specified bip9 deployment (regtest-only)");
     }
-    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, http, libevent, lock, mempool, mempoolrej, net, proxy, prune, rand, reindex, rpc, selectcoins, tor, zmq"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, http, leveldb, libevent, lock, mempool, mempoolrej, net, proxy, prune, rand, reindex, rpc, selectcoins, stratum, tor, zmq"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -433,7 +542,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", DEFAULT_LIMITFREERELAY));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", DEFAULT_RELAYPRIORITY));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit sum of signature cache and script execution cache sizes to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for relaying, mining and transaction creation (default: %s)"),
@@ -458,9 +567,20 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-mempoolreplacement", strprintf(_("Enable transaction replacement in the memory pool (default: %u)"), DEFAULT_ENABLE_REPLACEMENT));
 
     strUsage += HelpMessageGroup(_("Block creation options:"));
+    strUsage += HelpMessageOpt("-gen", strprintf(_("Generate coins (default: %u)"), DEFAULT_GENERATE));
+    strUsage += HelpMessageOpt("-genproclimit=<n>", strprintf(_("Set the number of threads for coin generation and the generate call, -1 = all cores (default: %d)"), DEFAULT_GENERATE_THREADS));
     strUsage += HelpMessageOpt("-blockmaxweight=<n>", strprintf(_("Set maximum BIP141 block weight (default: %d)"), DEFAULT_BLOCK_MAX_WEIGHT));
     strUsage += HelpMessageOpt("-blockmaxsize=<n>", strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE));
     strUsage += HelpMessageOpt("-blockprioritysize=<n>", strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE));
+    strUsage += HelpMessageOpt("-workemptyfirst", strprintf(_("Hand out an empty block as eth_getWork on a new tip until the full template is assembled (default: %u)"), DEFAULT_WORK_EMPTY_FIRST));
+    strUsage += HelpMessageOpt("-asynctemplatecheck", strprintf(_("Hand out eth_getWork and getblocktemplate templates before checking them with TestBlockValidity, withdrawing any that fail; submitted blocks are still fully validated (default: %u)"), DEFAULT_ASYNC_TEMPLATE_CHECK));
+    strUsage += HelpMessageOpt("-dagthreads=<n>", strprintf(_("Set the number of threads used to generate the Ethash DAG (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_DAG_THREADS, DEFAULT_DAG_THREADS));
+    strUsage += HelpMessageOpt("-dagdir=<dir>", _("Specify the directory holding Ethash DAG files (default: ~/.ethash)"));
+    strUsage += HelpMessageOpt("-dagfile", strprintf(_("Keep the Ethash DAG in a file so it survives restarts; 0 keeps it in memory only (default: %u)"), DEFAULT_DAG_FILE));
+    strUsage += HelpMessageOpt("-daghugepages", strprintf(_("Back the Ethash DAG with huge pages where the system supports them (default: %u)"), DEFAULT_DAG_HUGEPAGES));
+    strUsage += HelpMessageOpt("-dagnuma", strprintf(_("Copy the Ethash DAG to every NUMA node and pin each mining thread to a node, which then reads its own copy (default: %u)"), DEFAULT_DAG_NUMA));
+    strUsage += HelpMessageOpt("-dagprefetch=<n>", strprintf(_("Start building the next epoch's DAG when mining this far into an epoch, in percent (0 to 100, 100 = never, default: %u)"), DEFAULT_DAG_PREFETCH));
     if (showDebug)
         strUsage += HelpMessageOpt("-blockversion=<n>", "Override block version to test forking scenarios");
 
@@ -474,9 +594,18 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-rpcauth=<userpw>", _("Username and hashed password for JSON-RPC connections. The field <userpw> comes in the format: <USERNAME>:<SALT>$<HASH>. A canonical python script is included in share/rpcuser. This option can be specified multiple times"));
     strUsage += HelpMessageOpt("-rpcport=<port>", strprintf(_("Listen for JSON-RPC connections on <port> (default: %u or testnet: %u)"), BaseParams(CBaseChainParams::MAIN).RPCPort(), BaseParams(CBaseChainParams::TESTNET).RPCPort()));
     strUsage += HelpMessageOpt("-rpcallowip=<ip>", _("Allow JSON-RPC connections from specified source. Valid for <ip> are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24). This option can be specified multiple times"));
+    strUsage += HelpMessageOpt("-rpcblockcache=<n>", strprintf(_("Keep up to <n> megabytes of blocks rendered by getblock and /rest/block, 0 to keep none (default: %u)"), DEFAULT_RPC_BLOCK_CACHE));
+    strUsage += HelpMessageOpt("-rpcslowlog=<ms>", strprintf(_("Log RPC calls taking at least <ms> milliseconds, 0 to log none (default: %u)"), DEFAULT_RPC_SLOWLOG));
     strUsage += HelpMessageOpt("-rpcthreads=<n>", strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_HTTP_THREADS));
+    strUsage += HelpMessageOpt("-rpcjobthreads=<n>", strprintf(_("Set the number of threads running RPC calls submitted with submitjob, 0 to run none (default: %d)"), DEFAULT_RPC_JOB_THREADS));
+    strUsage += HelpMessageOpt("-rpcbatchthreads=<n>", strprintf(_("Set the number of threads executing the calls of one JSON-RPC batch (default: %d)"), DEFAULT_RPC_BATCH_THREADS));
+    strUsage += HelpMessageOpt("-stratum", strprintf(_("Accept EthereumStratum/1.0 mining connections, requires -server (default: %u)"), DEFAULT_STRATUM_ENABLE));
+    strUsage += HelpMessageOpt("-stratumbind=<addr>", _("Bind to given address to listen for Stratum connections. Use [host]:port notation for IPv6 (default: 127.0.0.1)"));
+    strUsage += HelpMessageOpt("-stratumport=<port>", strprintf(_("Listen for Stratum connections on <port> (default: %u)"), DEFAULT_STRATUM_PORT));
     if (showDebug) {
         strUsage += HelpMessageOpt("-rpcworkqueue=<n>", strprintf("Set the depth of the work queue to service RPC calls (default: %d)", DEFAULT_HTTP_WORKQUEUE));
+        strUsage += HelpMessageOpt("-rpcmaxqueuelatency=<n>", strprintf("Answer RPC calls with 503 and Retry-After while the oldest call in the work queue has waited more than <n> milliseconds, 0 to only limit the depth (default: %d)", DEFAULT_HTTP_MAX_QUEUE_LATENCY));
+        strUsage += HelpMessageOpt("-rpceventthreads=<n>", strprintf("Set the number of threads accepting and serving RPC connections; more than one listens with SO_REUSEPORT, which lets other processes of the same user bind the RPC port too (default: %d)", DEFAULT_HTTP_EVENT_THREADS));
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
     }
 
@@ -587,6 +716,35 @@ void CleanupBlockRevFiles()
     }
 }
 
+/** Log how fast the -loadblock files were validated, for replaying a recorded range of blocks as a benchmark */
+static void LogImportSummary(int64_t nStart, int nHeightStart, unsigned int nTxStart, const CBlockConnectStats& statsStart)
+{
+    int nBlocks;
+    unsigned int nTx;
+    {
+        LOCK(cs_main);
+        nBlocks = chainActive.Height() - nHeightStart;
+        nTx = chainActive.Tip() ? chainActive.Tip()->nChainTx - nTxStart : 0;
+    }
+    if (nBlocks <= 0)
+        return;
+    double nSeconds = std::max<int64_t>(1, GetTimeMicros() - nStart) * 0.000001;
+    CBlockConnectStats stats = GetBlockConnectStats();
+    const CBlockConnectTimes& total = stats.total;
+    const CBlockConnectTimes& start = statsStart.total;
+    int64_t nConnect = (total.nCheck - start.nCheck) + (total.nForks - start.nForks) + (total.nInputs - start.nInputs) +
+                       (total.nScripts - start.nScripts) + (total.nUndo - start.nUndo) + (total.nIndex - start.nIndex) +
+                       (total.nCallbacks - start.nCallbacks);
+    LogPrintf("Imported %d blocks, %u transactions, %u inputs in %.2fs (-par=%d, -dbcache=%d): %.2f blocks/s, %.1f tx/s\n",
+        nBlocks, nTx, stats.nInputs - statsStart.nInputs, nSeconds, GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS),
+        GetArg("-dbcache", nDefaultDbCache), nBlocks / nSeconds, nTx / nSeconds);
+    LogPrintf("  ms per block: check %.2f, forks %.2f, inputs %.2f, scripts %.2f, undo %.2f, index %.2f, callbacks %.2f, outside ConnectBlock %.2f\n",
+        0.001 * (total.nCheck - start.nCheck) / nBlocks, 0.001 * (total.nForks - start.nForks) / nBlocks,
+        0.001 * (total.nInputs - start.nInputs) / nBlocks, 0.001 * (total.nScripts - start.nScripts) / nBlocks,
+        0.001 * (total.nUndo - start.nUndo) / nBlocks, 0.001 * (total.nIndex - start.nIndex) / nBlocks,
+        0.001 * (total.nCallbacks - start.nCallbacks) / nBlocks, (1000.0 * nSeconds - 0.001 * nConnect) / nBlocks);
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     const CChainParams& chainparams = Params();
@@ -595,17 +753,21 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
     // -reindex
     if (fReindex) {
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
+        if (nReindexThreads > 0) {
+            ReindexBlockFiles(chainparams);
+        } else {
+            int nFile = 0;
+            while (true) {
+                CDiskBlockPos pos(nFile, 0);
+                if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                    break; // No block files left to reindex
+                FILE *file = OpenBlockFile(pos, true);
+                if (!file)
+                    break; // This error is logged in OpenBlockFile
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+                LoadExternalBlockFile(chainparams, file, &pos);
+                nFile++;
+            }
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
@@ -629,6 +791,15 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     }
 
     // -loadblock=
+    int64_t nImportStart = GetTimeMicros();
+    int nImportHeight;
+    unsigned int nImportTx;
+    {
+        LOCK(cs_main);
+        nImportHeight = chainActive.Height();
+        nImportTx = chainActive.Tip() ? chainActive.Tip()->nChainTx : 0;
+    }
+    CBlockConnectStats importStats = GetBlockConnectStats();
     BOOST_FOREACH(const boost::filesystem::path& path, vImportFiles) {
         FILE *file = fopen(path.string().c_str(), "rb");
         if (file) {
@@ -645,13 +816,33 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Failed to connect best block\n");
         StartShutdown();
     }
+    if (!vImportFiles.empty())
+        LogImportSummary(nImportStart, nImportHeight, nImportTx, importStats);
 
     if (GetBoolArg("-stopafterblockimport", DEFAULT_STOPAFTERBLOCKIMPORT)) {
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    // Loaded here rather than during init, so that the node is serving RPC
+    // and peers while the transactions are checked again
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
+    mempool.SetIsLoaded(!ShutdownRequested());
 }
 
+#ifdef ENABLE_WALLET
+/** The wallet startup work that can be done once RPC is up */
+static void ThreadWalletStartup()
+{
+    if (!pwalletMain->CheckLoadedKeys()) {
+        strMiscWarning = _("Warning: some keys in the wallet do not match their public key; see debug.log");
+        uiInterface.ThreadSafeMessageBox(strMiscWarning, "", CClientUIInterface::MSG_ERROR);
+    }
+    pwalletMain->ReacceptWalletTransactions();
+}
+#endif
+
 /** Sanity checks
  *  Ensure that Bitcoin is running in a usable environment with all
  *  necessary library support.
@@ -662,6 +853,10 @@ bool InitSanityCheck(void)
         InitError("Elliptic curve cryptography sanity check failure. Aborting.");
         return false;
     }
+    if (!SHA256SelfTest()) {
+        InitError("SHA256 self-test failure. Aborting.");
+        return false;
+    }
     if (!glibc_sanity_test() || !glibcxx_sanity_test())
         return false;
 
@@ -680,6 +875,8 @@ bool AppInitServers(boost::thread_group& threadGroup)
         return false;
     if (GetBoolArg("-rest", DEFAULT_REST_ENABLE) && !StartREST())
         return false;
+    if (GetBoolArg("-stratum", DEFAULT_STRATUM_ENABLE) && !StartStratumServer())
+        return false;
     if (!StartHTTPServer())
         return false;
     return true;
@@ -699,6 +896,20 @@ void InitParameterInteraction()
             LogPrintf("%s: parameter interaction: -whitebind set -> setting -listen=1\n", __func__);
     }
 
+    if (mapArgs.count("-follow")) {
+        // a follower takes blocks on trust, from its leader only
+        mapArgs["-connect"] = mapArgs["-follow"];
+        mapMultiArgs["-connect"] = std::vector<std::string>(1, mapArgs["-follow"]);
+        mapArgs["-listen"] = "0";
+        LogPrintf("%s: parameter interaction: -follow set -> setting -connect=%s -listen=0\n", __func__, mapArgs["-follow"]);
+        if (SoftSetBoolArg("-blocksonly", true))
+            LogPrintf("%s: parameter interaction: -follow set -> setting -blocksonly=1\n", __func__);
+#ifdef ENABLE_WALLET
+        if (SoftSetBoolArg("-disablewallet", true))
+            LogPrintf("%s: parameter interaction: -follow set -> setting -disablewallet=1\n", __func__);
+#endif
+    }
+
     if (mapArgs.count("-connect") && mapMultiArgs["-connect"].size() > 0) {
         // when only connecting to trusted nodes, do not seed via DNS, or listen by default
         if (SoftSetBoolArg("-dnsseed", false))
@@ -748,6 +959,18 @@ void InitParameterInteraction()
             LogPrintf("%s: parameter interaction: -zapwallettxes=<mode> -> setting -rescan=1\n", __func__);
     }
 
+    // a headers-only node relays no transactions and needs next to no cache
+    if (GetBoolArg("-headersonly", DEFAULT_HEADERSONLY)) {
+        if (SoftSetBoolArg("-blocksonly", true))
+            LogPrintf("%s: parameter interaction: -headersonly=1 -> setting -blocksonly=1\n", __func__);
+        if (SoftSetArg("-dbcache", strprintf("%d", nMinDbCache)))
+            LogPrintf("%s: parameter interaction: -headersonly=1 -> setting -dbcache=%d\n", __func__, nMinDbCache);
+#ifdef ENABLE_WALLET
+        if (SoftSetBoolArg("-disablewallet", true))
+            LogPrintf("%s: parameter interaction: -headersonly=1 -> setting -disablewallet=1\n", __func__);
+#endif
+    }
+
     // disable walletbroadcast and whitelistrelay in blocksonly mode
     if (GetBoolArg("-blocksonly", DEFAULT_BLOCKSONLY)) {
         if (SoftSetBoolArg("-whitelistrelay", false))
@@ -770,6 +993,24 @@ static std::string ResolveErrMsg(const char * const optname, const std::string&
     return strprintf(_("Cannot resolve -%s address: '%s'"), optname, strBind);
 }
 
+/** Parse a list of CPU numbers and ranges such as "0-15,32-47" */
+static bool ParseCpuList(const std::string& strList, std::vector<int>& vCpus)
+{
+    std::vector<std::string> vItems;
+    boost::split(vItems, strList, boost::is_any_of(","));
+    BOOST_FOREACH(const std::string& strItem, vItems) {
+        std::vector<std::string> vBounds;
+        boost::split(vBounds, strItem, boost::is_any_of("-"));
+        int nFirst, nLast;
+        if (vBounds.size() > 2 || !ParseInt32(vBounds.front(), &nFirst) || !ParseInt32(vBounds.back(), &nLast) ||
+            nFirst < 0 || nLast < nFirst)
+            return false;
+        for (int nCpu = nFirst; nCpu <= nLast; nCpu++)
+            vCpus.push_back(nCpu);
+    }
+    return true;
+}
+
 void InitLogging()
 {
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
@@ -781,12 +1022,60 @@ void InitLogging()
     LogPrintf("MIL version %s\n", FormatFullVersion());
 }
 
+static CCriticalSection cs_startupPhases;
+static std::vector<CStartupPhase> vStartupPhases;
+
+/** End the current phase of AppInit2 and start the next */
+static void BeginStartupPhase(const std::string& strName)
+{
+    LOCK(cs_startupPhases);
+    int64_t nNow = GetTimeMillis();
+    if (!vStartupPhases.empty()) {
+        CStartupPhase& current = vStartupPhases.back();
+        current.nDurationMillis = nNow - current.nStartMillis;
+        LogPrint("bench", "Startup phase %s: %dms\n", current.strName, current.nDurationMillis);
+    }
+    CStartupPhase phase;
+    phase.strName = strName;
+    phase.nStartMillis = nNow;
+    phase.nDurationMillis = -1;
+    vStartupPhases.push_back(phase);
+}
+
+std::vector<CStartupPhase> GetStartupPhases()
+{
+    LOCK(cs_startupPhases);
+    return vStartupPhases;
+}
+
+bool IsNodeReady(std::string& strReason)
+{
+    {
+        LOCK(cs_startupPhases);
+        if (vStartupPhases.empty() || vStartupPhases.back().strName != "done") {
+            strReason = vStartupPhases.empty() ? "starting" : vStartupPhases.back().strName;
+            return false;
+        }
+    }
+    if (IsInitialBlockDownload()) {
+        strReason = "initialblockdownload";
+        return false;
+    }
+    if (!AddressesLoaded()) {
+        strReason = "loadaddresses";
+        return false;
+    }
+    strReason = "";
+    return true;
+}
+
 /** Initialize milcoin.
  *  @pre Parameters should be parsed and config file should be read.
  */
 bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 {
     // ********************************************************* Step 1: setup
+    BeginStartupPhase("setup");
 #ifdef _MSC_VER
     // Turn off Microsoft heap dump noise
     _CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_FILE);
@@ -843,6 +1132,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 #endif
 
     // ********************************************************* Step 2: parameter interactions
+    BeginStartupPhase("parameters");
     const CChainParams& chainparams = Params();
 
     // also see: InitParameterInteraction()
@@ -858,6 +1148,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 #endif
     }
 
+    // the indexes are built from blocks a headers-only node never has
+    if (GetBoolArg("-headersonly", DEFAULT_HEADERSONLY)) {
+        if (GetBoolArg("-txindex", DEFAULT_TXINDEX) || GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) ||
+            GetBoolArg("-spentindex", DEFAULT_SPENTINDEX) || GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX) ||
+            GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+            return InitError(_("Headers-only mode is incompatible with -txindex, -addressindex, -spentindex, -timestampindex and -blockfilterindex."));
+    }
+
     // Make sure enough file descriptors are available
     int nBind = std::max(
                 (mapMultiArgs.count("-bind") ? mapMultiArgs.at("-bind").size() : 0) +
@@ -908,8 +1206,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         mempool.setSanityCheck(1.0 / ratio);
     }
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
+    fLockProfiling = GetBoolArg("-lockprofiling", DEFAULT_LOCKPROFILING);
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
 
+    fFollowLeader = mapArgs.count("-follow") > 0;
+    if (fFollowLeader) {
+        if (mapArgs.count("-addnode") || mapArgs.count("-seednode"))
+            return InitError(_("-follow can not be combined with -addnode or -seednode, the leader must be the only peer"));
+        LogPrintf("Following %s: its blocks are applied without checking their proof of work or scripts.\n", mapArgs["-follow"]);
+    }
+
+    hashAssumeValid = uint256S(GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
+    if (!hashAssumeValid.IsNull())
+        LogPrintf("Assuming ancestors of block %s have valid scripts.\n", hashAssumeValid.GetHex());
+    else
+        LogPrintf("Validating scripts for all blocks.\n");
+
     // mempool limits
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     int64_t nMempoolSizeMin = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000 * 40;
@@ -925,6 +1237,41 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    std::vector<int> vScriptCheckCpus;
+    if (mapArgs.count("-scriptcheckcpus") && !ParseCpuList(mapArgs["-scriptcheckcpus"], vScriptCheckCpus))
+        return InitError(strprintf(_("Invalid -scriptcheckcpus list: '%s'"), mapArgs["-scriptcheckcpus"]));
+
+    nPrefetchThreads = std::max(0, std::min((int)GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS), MAX_PREFETCH_THREADS));
+    nReindexThreads = std::max(0, std::min((int)GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS), MAX_REINDEX_THREADS));
+
+    fCompressBlocks = GetBoolArg("-compressblocks", DEFAULT_COMPRESS_BLOCKS);
+
+    blockFileMaps.SetMaxFiles(std::max(0, std::min((int)GetArg("-blockmapfiles", DEFAULT_BLOCK_MAP_FILES), MAX_BLOCK_MAP_FILES)));
+
+    blockReadAhead.SetMaxBlocks(std::max(0, std::min((int)GetArg("-blockreadahead", DEFAULT_BLOCK_READAHEAD), MAX_BLOCK_READAHEAD)));
+    recentBlockUndo.SetMaxBlocks(std::max(0, std::min((int)GetArg("-undocache", DEFAULT_UNDO_CACHE), MAX_UNDO_CACHE)));
+
+    nAddressIndexThreads = std::max(1, std::min((int)GetArg("-addressindexthreads", DEFAULT_ADDRESSINDEX_THREADS), MAX_ADDRESSINDEX_THREADS));
+
+    // -dagthreads=0 means autodetect, like -par
+    int nDagThreads = GetArg("-dagthreads", DEFAULT_DAG_THREADS);
+    if (nDagThreads <= 0)
+        nDagThreads += GetNumCores();
+    EthashAux::setDagThreads(std::max(1, std::min(nDagThreads, MAX_DAG_THREADS)));
+    if (mapArgs.count("-dagdir")) {
+        boost::filesystem::path dagDir = boost::filesystem::system_complete(GetArg("-dagdir", ""));
+        try {
+            boost::filesystem::create_directories(dagDir);
+        } catch (const boost::filesystem::filesystem_error&) {
+            return InitError(strprintf(_("Cannot create -dagdir directory %s"), dagDir.string()));
+        }
+        EthashAux::setDagDir(dagDir.string());
+    }
+    EthashAux::setDagMemory(GetBoolArg("-dagfile", DEFAULT_DAG_FILE), GetBoolArg("-daghugepages", DEFAULT_DAG_HUGEPAGES));
+    EthashAux::setDagPrefetch((unsigned)std::max<int64_t>(0, GetArg("-dagprefetch", DEFAULT_DAG_PREFETCH)));
+    EthashAux::setDagNuma(GetBoolArg("-dagnuma", DEFAULT_DAG_NUMA));
+    EthashAux::setLightCacheBudget((uint64_t)std::max<int64_t>(0, GetArg("-ethashlightcache", DEFAULT_ETHASH_LIGHT_CACHE)) << 20);
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
@@ -933,7 +1280,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         return InitError(_("Prune cannot be configured with a negative value."));
     }
     nPruneTarget = (uint64_t) nSignedPruneTarget;
-    if (nPruneTarget) {
+    if (GetArg("-prune", 0) == 1) {
+        // Only pruneblockchain deletes blocks, the target is never reached
+        LogPrintf("Block pruning enabled.  Use RPC call pruneblockchain(height) to manually prune block and undo files.\n");
+        nPruneTarget = std::numeric_limits<uint64_t>::max();
+        fPruneMode = true;
+    } else if (nPruneTarget) {
         if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES) {
             return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
         }
@@ -941,12 +1293,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         fPruneMode = true;
     }
 
+    fHeadersOnly = GetBoolArg("-headersonly", DEFAULT_HEADERSONLY);
+    if (fHeadersOnly)
+        LogPrintf("Headers-only mode enabled: blocks will not be downloaded.\n");
+    fEarlyBlockRelay = GetBoolArg("-earlyblockrelay", DEFAULT_EARLY_BLOCK_RELAY);
+
     RegisterAllCoreRPCCommands(tableRPC);
 #ifdef ENABLE_WALLET
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
     if (!fDisableWallet)
         RegisterWalletRPCCommands(tableRPC);
 #endif
+#if ENABLE_ZMQ
+    RegisterZMQRPCCommands(tableRPC);
+#endif
 
     nConnectTimeout = GetArg("-timeout", DEFAULT_CONNECT_TIMEOUT);
     if (nConnectTimeout <= 0)
@@ -987,6 +1347,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices = ServiceFlags(nLocalServices | NODE_BLOOM);
 
+    if (GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS)) {
+        if (!GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+            return InitError(_("Cannot set -peerblockfilters without -blockfilterindex."));
+        nLocalServices = ServiceFlags(nLocalServices | NODE_COMPACT_FILTERS);
+    }
+
     if (GetArg("-rpcserialversion", DEFAULT_RPC_SERIALIZE_VERSION) < 0)
         return InitError("rpcserialversion must be non-negative.");
 
@@ -1040,6 +1406,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
+    BeginStartupPhase("datadir");
 
     // Initialize elliptic curve code
     ECC_Start();
@@ -1082,14 +1449,37 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     std::ostringstream strErrors;
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    LogPrintf("Using %s Ethash kernel\n", EthashAux::kernelName());
+    LogPrintf("Using %s SHA256 transforms\n", SHA256Implementation());
+    LogPrintf("Using %s AES\n", AESImplementation());
+    InitSignatureCache();
+    InitScriptExecutionCache();
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
-            threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
+            int nCpu = vScriptCheckCpus.empty() ? -1 : vScriptCheckCpus[i % vScriptCheckCpus.size()];
+            threadGroup.create_thread(boost::bind(&ThreadScriptCheck, nCpu));
+            threadGroup.create_thread(boost::bind(&ThreadMempoolScriptCheck, nCpu));
+            threadGroup.create_thread(&ThreadHeaderCheck);
+        }
     }
 
-    // Start the lightweight task scheduler thread
+    // Start the lightweight task scheduler threads
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
-    threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
+    int nSchedulerThreads = std::max(1, (int)GetArg("-schedulerthreads", DEFAULT_SCHEDULER_THREADS));
+    for (int i = 0; i < nSchedulerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
+    scheduler.scheduleEvery(&TrimMempool, MEMPOOL_TRIM_INTERVAL, CScheduler::PRIORITY_LOW, "trimmempool");
+    if (GetArg("-maxmemory", DEFAULT_MAX_MEMORY) > 0)
+        scheduler.scheduleEvery(&CheckMemoryLimit, MEMORY_CHECK_INTERVAL, CScheduler::PRIORITY_LOW, "checkmemorylimit");
+    // Also when -profile is not given, as setprofiling can start the profiler
+    scheduler.scheduleEvery(&FlushProfiler, 1, CScheduler::PRIORITY_LOW, "flushprofiler");
+    if (mapArgs.count("-profile")) {
+        std::string strError;
+        if (!StartProfiler(GetArg("-profile", ""), GetArg("-profilehz", DEFAULT_PROFILE_HZ), strError))
+            return InitError(strprintf("-profile: %s", strError));
+    }
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "valqueue", &ThreadValidationInterfaceQueue));
+    StartWorkTemplateBuilder(threadGroup);
 
     /* Start the RPC server already.  It will be started in "warmup" mode
      * and not really process calls already (but it will signify connections
@@ -1106,6 +1496,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int64_t nStart;
 
     // ********************************************************* Step 5: verify wallet database integrity
+    BeginStartupPhase("verifywallet");
 #ifdef ENABLE_WALLET
     if (!fDisableWallet) {
         if (!CWallet::Verify())
@@ -1113,6 +1504,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     } // (!fDisableWallet)
 #endif // ENABLE_WALLET
     // ********************************************************* Step 6: network initialization
+    BeginStartupPhase("network");
 
     RegisterNodeSignals(GetNodeSignals());
 
@@ -1193,6 +1585,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     fNameLookup = GetBoolArg("-dns", DEFAULT_NAME_LOOKUP);
     fRelayTxes = !GetBoolArg("-blocksonly", DEFAULT_BLOCKSONLY);
 
+    if (mapArgs.count("-socketevents")) {
+        std::string strSocketEvents = GetArg("-socketevents", "");
+        if (strSocketEvents != "epoll" && strSocketEvents != "kqueue" && strSocketEvents != "select")
+            return InitError(strprintf(_("Unknown -socketevents method: '%s'"), strSocketEvents));
+    }
+
     bool fBound = false;
     if (fListen) {
         if (mapArgs.count("-bind") || mapArgs.count("-whitebind")) {
@@ -1238,7 +1636,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     pzmqNotificationInterface = CZMQNotificationInterface::CreateWithArguments(mapArgs);
 
     if (pzmqNotificationInterface) {
-        RegisterValidationInterface(pzmqNotificationInterface);
+        RegisterValidationInterface(pzmqNotificationInterface, true);
+        RPCServer::OnJobFinished(boost::bind(&CZMQNotificationInterface::RPCJobFinished, pzmqNotificationInterface, _1));
+        if (pzmqNotificationInterface->GetBatchMillis() > 0) {
+            boost::function<void()> flushLoop = boost::bind(&CZMQNotificationInterface::ThreadFlushBatches, pzmqNotificationInterface);
+            threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "zmqbatch", flushLoop));
+        }
     }
 #endif
     if (mapArgs.count("-maxuploadtarget")) {
@@ -1246,6 +1649,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // ********************************************************* Step 7: load block chain
+    BeginStartupPhase("loadblockindex");
 
     fReindex = GetBoolArg("-reindex", false);
     bool fReindexChainState = GetBoolArg("-reindex-chainstate", false);
@@ -1276,29 +1680,39 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             fReindex = true;
         }
     }
+    // The optional indexes each have a database in here
+    boost::filesystem::create_directories(GetDataDir() / "indexes");
 
     // cache size calculations
     int64_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greater than nMaxDbcache
-    int64_t nBlockTreeDBCache = nTotalCache / 8;
-
-    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) || GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
-        nBlockTreeDBCache = nTotalCache * 3 / 4;
-    } else {
-        nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
-    }
-
+    int64_t nBlockTreeDBCache = std::min(nTotalCache / 8, nMaxBlockDBCache << 20);
     nTotalCache -= nBlockTreeDBCache;
+    // Each optional index has a database of its own, sized for how it is read
+    int64_t nAddressIndexDBCache = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) ? nTotalCache / 2 : nMinIndexDBCache << 20;
+    int64_t nSpentIndexDBCache = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX) ? nTotalCache / 8 : nMinIndexDBCache << 20;
+    int64_t nTxIndexDBCache = GetBoolArg("-txindex", DEFAULT_TXINDEX) ? std::min(nTotalCache / 8, nMaxTxIndexDBCache << 20) : nMinIndexDBCache << 20;
+    int64_t nTimestampIndexDBCache = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX) ? std::min(nTotalCache / 32, nMaxTimestampIndexDBCache << 20) : nMinIndexDBCache << 20;
+    int64_t nBlockFilterIndexDBCache = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX) ? std::min(nTotalCache / 16, nMaxBlockFilterIndexDBCache << 20) : nMinIndexDBCache << 20;
+    nTotalCache -= nAddressIndexDBCache + nSpentIndexDBCache + nTxIndexDBCache + nTimestampIndexDBCache + nBlockFilterIndexDBCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for transaction index database\n", nTxIndexDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for address index database\n", nAddressIndexDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for spent index database\n", nSpentIndexDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for timestamp index database\n", nTimestampIndexDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for block filter index database\n", nBlockFilterIndexDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
+    pindexwriter = new CIndexWriter();
+    RegisterValidationInterface(pindexwriter);
+
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
@@ -1309,17 +1723,35 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nStart = GetTimeMillis();
         do {
             try {
+                ResetIndexSnapshots();
                 UnloadBlockIndex();
                 delete pcoinsTip;
                 delete pcoinsdbview;
+                delete pcoinswriter;
                 delete pcoinscatcher;
                 delete pblocktree;
+                delete ptxindexdb;
+                delete paddressindexdb;
+                delete pspentindexdb;
+                delete ptimestampindexdb;
+                delete pblockfilterdb;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                ptxindexdb = new CIndexDB("txindex", nTxIndexDBCache, false, fReindex);
+                paddressindexdb = new CIndexDB("addressindex", nAddressIndexDBCache, false, fReindex);
+                pspentindexdb = new CIndexDB("spentindex", nSpentIndexDBCache, false, fReindex);
+                ptimestampindexdb = new CIndexDB("timestampindex", nTimestampIndexDBCache, false, fReindex);
+                pblockfilterdb = new CIndexDB("blockfilterindex", nBlockFilterIndexDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pcoinswriter = new CCoinsViewWriter(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinswriter);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1349,27 +1781,43 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                // Check for changed -addressindex state
-                if (fAddressIndex != GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
+                if (!LoadIndexBuilds(fReindex || fReindexChainState)) {
+                    strLoadError = _("Error loading block database");
+                    break;
+                }
+
+                // Check for changed -addressindex state, an index switched on is built in the background unless blocks
+                // were pruned already; pruning keeps the blocks a build has yet to read
+                if (fAddressIndex != GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) &&
+                    (fAddressIndex || fHavePruned || !ScheduleIndexBuild("addressindex"))) {
                     strLoadError = _("You need to rebuild the database using -reindex-chainstate to change addressindex");
                     break;
                 }
 
                 // Check for changed --spentindex state
-                if (fSpentIndex != GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
+                if (fSpentIndex != GetBoolArg("-spentindex", DEFAULT_SPENTINDEX) &&
+                    (fSpentIndex || fHavePruned || !ScheduleIndexBuild("spentindex"))) {
                     strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -spentindex");
                     break;
                 }
 
                 // Check for changed -timestampindex state
-                if(fTimestampIndex != GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX)) {
+                if (fTimestampIndex != GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX) &&
+                    (fTimestampIndex || fHavePruned || !ScheduleIndexBuild("timestampindex"))) {
                     strLoadError = _("You need to rebuild the database using -reindex-chainstate to change timestampindex");
                     break;
                 }
 
+                // Check for changed -blockfilterindex state
+                if (fBlockFilterIndex != GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX) &&
+                    (fBlockFilterIndex || fHavePruned || !ScheduleIndexBuild("blockfilterindex"))) {
+                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -blockfilterindex");
+                    break;
+                }
+
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
-                if (fHavePruned && !fPruneMode) {
+                if (fHavePruned && !fPruneMode && !fSnapshotChain) {
                     strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
                     break;
                 }
@@ -1382,6 +1830,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     }
                 }
 
+                BeginStartupPhase("verifyblocks");
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (fHavePruned && GetArg("-checkblocks", DEFAULT_CHECKBLOCKS) > MIN_BLOCKS_TO_KEEP) {
                     LogPrintf("Prune: pruned datadir may not have more than %d blocks; only checking available blocks",
@@ -1451,6 +1900,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     fFeeEstimatesInitialized = true;
 
     // ********************************************************* Step 8: load wallet
+    BeginStartupPhase("loadwallet");
 #ifdef ENABLE_WALLET
     if (fDisableWallet) {
         pwalletMain = NULL;
@@ -1459,12 +1909,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         CWallet::InitLoadWallet();
         if (!pwalletMain)
             return false;
+        // Rescans run by importprivkey and the like as RPC jobs report how far they are
+        pwalletMain->ShowProgress.connect(&RPCJobProgress);
     }
 #else // ENABLE_WALLET
     LogPrintf("No wallet support compiled in!\n");
 #endif // !ENABLE_WALLET
 
     // ********************************************************* Step 9: data directory maintenance
+    BeginStartupPhase("maintenance");
 
     // if pruning, unset the service bit and perform the initial blockstore prune
     // after any wallet rescanning has taken place.
@@ -1476,6 +1929,15 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             PruneAndFlush();
         }
     }
+    // A chain loaded from a UTXO snapshot cannot serve the blocks below it either
+    if (fSnapshotChain) {
+        LogPrintf("Unsetting NODE_NETWORK on a chain loaded from a UTXO snapshot\n");
+        nLocalServices = ServiceFlags(nLocalServices & ~NODE_NETWORK);
+    }
+    if (fHeadersOnly) {
+        LogPrintf("Unsetting NODE_NETWORK in headers-only mode\n");
+        nLocalServices = ServiceFlags(nLocalServices & ~NODE_NETWORK);
+    }
 
     if (Params().GetConsensus().vDeployments[Consensus::DEPLOYMENT_SEGWIT].nTimeout != 0) {
         // Only advertize witness capabilities if they have a reasonable start time.
@@ -1490,6 +1952,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // ********************************************************* Step 10: import blocks
+    BeginStartupPhase("importblocks");
 
     if (!CheckDiskSpace())
         return false;
@@ -1512,7 +1975,21 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             vImportFiles.push_back(strFile);
     }
 
+    StartIndexWriter(threadGroup);
+    if (GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH)) {
+        boost::function<void()> writeLoop = boost::bind(&CCoinsViewWriter::ThreadWrite, pcoinswriter);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "coinswriter", writeLoop));
+    }
+    if (GetBoolArg("-asyncblockstore", DEFAULT_ASYNC_BLOCK_STORE)) {
+        boost::function<void()> storeLoop = boost::bind(&CBlockStoreWriter::ThreadWrite, &blockStoreWriter);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "blockstore", storeLoop));
+    }
+    if (blockReadAhead.GetMaxBlocks() > 0) {
+        boost::function<void()> readAheadLoop = boost::bind(&CBlockReadAhead::ThreadReadAhead, &blockReadAhead, &chainparams.GetConsensus());
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "readahead", readAheadLoop));
+    }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    StartIndexBuilder(threadGroup);
 
     // Wait for genesis block to be processed
     {
@@ -1524,6 +2001,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // ********************************************************* Step 11: start node
+    BeginStartupPhase("ethash");
+    {
+        // Build the light cache of the tip's epoch now, rather than while checking the first block from a peer
+        int nHeight;
+        {
+            LOCK(cs_main);
+            nHeight = chainActive.Height() + 1;
+        }
+        EthashAux::light(EthashAux::seedHash(nHeight));
+    }
+
+    BeginStartupPhase("startnode");
 
     if (!strErrors.str().empty())
         return InitError(strErrors.str());
@@ -1542,15 +2031,27 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     StartNode(threadGroup, scheduler);
 
+    // Generate coins in the background
+    GenerateBitcoins(GetBoolArg("-gen", DEFAULT_GENERATE), GetArg("-genproclimit", DEFAULT_GENERATE_THREADS), chainparams);
+
     // ********************************************************* Step 12: finished
+    BeginStartupPhase("done");
+    {
+        std::vector<CStartupPhase> vPhases = GetStartupPhases();
+        std::string strPhases;
+        for (size_t i = 0; i + 1 < vPhases.size(); i++)
+            strPhases += strprintf("%s%s %dms", i ? ", " : "", vPhases[i].strName, vPhases[i].nDurationMillis);
+        LogPrintf("Startup took %dms: %s\n", vPhases.back().nStartMillis - vPhases[0].nStartMillis, strPhases);
+    }
 
     SetRPCWarmupFinished();
     uiInterface.InitMessage(_("Done loading"));
 
 #ifdef ENABLE_WALLET
     if (pwalletMain) {
-        // Add wallet transactions that aren't already in a block to mapTransactions
-        pwalletMain->ReacceptWalletTransactions();
+        // Check the keys of old wallet records, and add wallet transactions that aren't
+        // already in a block to mapTransactions, without keeping RPC waiting
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "walletstart", &ThreadWalletStartup));
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
@@ -6,7 +6,9 @@
 #ifndef BITCOIN_INIT_H
 #define BITCOIN_INIT_H
 
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 class CScheduler;
 class CWallet;
@@ -27,6 +29,20 @@ void InitLogging();
 void InitParameterInteraction();
 bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler);
 
+/** A phase of AppInit2, see getstartupinfo */
+struct CStartupPhase
+{
+    std::string strName;
+    int64_t nStartMillis;
+    //! -1 while it is the current phase
+    int64_t nDurationMillis;
+};
+
+/** The phases of startup so far; the last one is the current phase, "done" once AppInit2 finished */
+std::vector<CStartupPhase> GetStartupPhases();
+/** Whether startup finished, the node left initial block download and its addresses are loaded; strReason tells what it waits for */
+bool IsNodeReady(std::string& strReason);
+
 /** The help message mode determines what help message to show */
 enum HelpMessageMode {
     HMM_BITCOIND,
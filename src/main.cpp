@@ -8,14 +8,24 @@
 #include "addrman.h"
 #include "arith_uint256.h"
 #include "blockencodings.h"
+#include "blockfilemap.h"
+#include "blockfilter.h"
+#include "blockpipeline.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinswriter.h"
+#include "compressor.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "cuckoocache.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
 #include "hash.h"
+#include "indexbuilder.h"
+#include "indexwriter.h"
 #include "init.h"
+#include "memusage.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "policy/fees.h"
@@ -28,6 +38,7 @@
 #include "script/sigcache.h"
 #include "script/standard.h"
 #include "tinyformat.h"
+#include "trace.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -35,14 +46,18 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #include "utilstrencodings.h"
+#include "utxosnapshot.h"
+#include "utxostats.h"
 #include "validationinterface.h"
 #include "versionbits.h"
 
+#include <algorithm>
 #include <atomic>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
@@ -62,26 +77,73 @@ using namespace std;
  */
 
 CCriticalSection cs_main;
+CCriticalSection cs_orphans;
+/** Guards the structure of mapBlockIndex, see LookupBlockIndex. Taken after cs_main, and no other lock is taken under it. */
+static CCriticalSection cs_blockindex;
 
 BlockMap mapBlockIndex;
+//! Holds every entry of mapBlockIndex
+CBlockIndexArena blockIndexArena;
 CChain chainActive;
+CChain chainHeaders;
 CBlockIndex *pindexBestHeader = NULL;
+bool fHeadersOnly = DEFAULT_HEADERSONLY;
+bool fEarlyBlockRelay = DEFAULT_EARLY_BLOCK_RELAY;
+
+CChain& HeadersChain()
+{
+    return fHeadersOnly ? chainHeaders : chainActive;
+}
+
+/** Read with std::atomic_load; replaced by PublishChainTip whenever HeadersChain() moves */
+static std::shared_ptr<const CChainTipSnapshot> pChainTipSnapshot;
+
+/** Snapshot the tip of HeadersChain() for GetChainTipSnapshot readers */
+static void PublishChainTip()
+{
+    AssertLockHeld(cs_main);
+    std::shared_ptr<CChainTipSnapshot> snapshot = std::make_shared<CChainTipSnapshot>();
+    CBlockIndex* pindex = HeadersChain().Tip();
+    if (pindex) {
+        snapshot->pindex = pindex;
+        snapshot->nHeight = pindex->nHeight;
+        snapshot->hashBlock = pindex->GetBlockHash();
+        snapshot->nChainWork = pindex->nChainWork;
+        snapshot->nMedianTimePast = pindex->GetMedianTimePast();
+    }
+    std::atomic_store(&pChainTipSnapshot, std::shared_ptr<const CChainTipSnapshot>(snapshot));
+}
+
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot()
+{
+    static const std::shared_ptr<const CChainTipSnapshot> empty = std::make_shared<CChainTipSnapshot>();
+    std::shared_ptr<const CChainTipSnapshot> snapshot = std::atomic_load(&pChainTipSnapshot);
+    return snapshot ? snapshot : empty;
+}
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = DEFAULT_PREFETCH_THREADS;
+int nReindexThreads = DEFAULT_REINDEX_THREADS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
 bool fAddressIndex = false;
+int nAddressIndexThreads = DEFAULT_ADDRESSINDEX_THREADS;
 bool fTimestampIndex = false;
 bool fSpentIndex = false;
+bool fBlockFilterIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
+bool fCompressBlocks = DEFAULT_COMPRESS_BLOCKS;
+bool fSnapshotChain = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
+uint256 hashAssumeValid;
+bool fFollowLeader = false;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
@@ -97,20 +159,76 @@ FeeFilterRounder filterRounder(::minRelayTxFee);
 struct IteratorComparator
 {
     template<typename I>
-    bool operator()(const I& a, const I& b)
+    bool operator()(const I& a, const I& b) const
     {
         return &(*a) < &(*b);
     }
 };
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
     int64_t nTimeExpire;
+    size_t nListPos; //!< Position in vOrphanList
+};
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_orphans);
+map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_orphans);
+/** The orphans of each peer, erased along with it */
+map<NodeId, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPeer GUARDED_BY(cs_orphans);
+/** The orphans by expiry time, so that the expired ones are found first */
+set<pair<int64_t, uint256>> setOrphanTransactionsByExpiry GUARDED_BY(cs_orphans);
+/** All orphans in no order, so that a random one is picked in constant time */
+vector<map<uint256, COrphanTx>::iterator> vOrphanList GUARDED_BY(cs_orphans);
+void EraseOrphansFor(NodeId peer);
+/** Transactions rejected for their fee alone, kept until a child pays for them in a package */
+map<uint256, COrphanTx> mapLowFeeTransactions GUARDED_BY(cs_main);
+
+/**
+ * Transactions seen lately that are not in the mempool: orphans, transactions
+ * replaced in the mempool and ones rejected by policy, each with its witness
+ * hash. Compact blocks are reconstructed from them as well, as a miner may
+ * have had them. Once -blockreconstructionextratxn are kept, the oldest are
+ * overwritten.
+ */
+class CExtraTxnForCompact
+{
+private:
+    CCriticalSection cs;
+    std::vector<std::pair<uint256, CTransactionRef> > vTxn;
+    //! The next one overwritten once vTxn is full
+    size_t nNext;
+
+public:
+    CExtraTxnForCompact() : nNext(0) {}
+
+    void Add(const CTransactionRef& tx, size_t nMax)
+    {
+        LOCK(cs);
+        std::pair<uint256, CTransactionRef> entry(tx->GetWitnessHash(), tx);
+        if (vTxn.size() < nMax) {
+            vTxn.push_back(entry);
+        } else {
+            vTxn[nNext % vTxn.size()] = entry;
+            nNext = (nNext + 1) % vTxn.size();
+        }
+    }
+
+    void Get(std::vector<std::pair<uint256, CTransactionRef> >& vTxnOut)
+    {
+        LOCK(cs);
+        vTxnOut = vTxn;
+    }
 };
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+static CExtraTxnForCompact extraTxnForCompact;
+
+static void AddToCompactExtraTransactions(const CTransactionRef& tx)
+{
+    size_t nMax = (size_t)std::max((int64_t)0, GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
+    // Big transactions are not kept, as for orphans
+    if (nMax == 0 || GetTransactionWeight(*tx) >= MAX_STANDARD_TX_WEIGHT)
+        return;
+    extraTxnForCompact.Add(tx, nMax);
+}
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -118,6 +236,8 @@ void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
  */
 static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams);
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
+/** The script verification flags that pindex's block is connected with */
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -159,6 +279,38 @@ namespace {
     set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexCandidates;
     /** Number of nodes with fSyncStarted. */
     int nSyncStarted = 0;
+    /** Sum of the download rates of the peers that have one, and their number. */
+    int64_t nDownloadRateSum = 0;
+    int nPeersWithDownloadRate = 0;
+
+    /**
+     * The headers between two checkpoints above our best header, fetched from
+     * peers other than the sync peers while these work through the headers
+     * below, and connected once the headers before them are in.
+     */
+    struct CHeadersSegment {
+        //! The checkpoint the segment follows, and its height
+        uint256 hashAnchor;
+        int nHeightAnchor;
+        //! The checkpoint the segment ends at
+        uint256 hashStop;
+        //! Headers received so far, their proofs of work checked, with the Ethash hashes of these
+        std::vector<CBlockHeader> vHeaders;
+        std::vector<uint256> vHashPoW;
+        //! The peer fetching the rest of the segment, or -1
+        NodeId nodeid;
+        int64_t nRequestTime;
+
+        CHeadersSegment() : nHeightAnchor(0), nodeid(-1), nRequestTime(0) {}
+
+        uint256 GetLastHash() const { return vHeaders.empty() ? hashAnchor : vHeaders.back().GetHash(); }
+        int GetLastHeight() const { return nHeightAnchor + (int)vHeaders.size(); }
+        bool IsComplete() const { return !vHeaders.empty() && vHeaders.back().GetHash() == hashStop; }
+    };
+    /** Headers segments by the height of the checkpoint they follow. Requires cs_main. */
+    std::map<int, CHeadersSegment> mapHeadersSegments;
+    /** Whether mapHeadersSegments was set up from the checkpoints. Requires cs_main. */
+    bool fHeadersSegmentsInit = false;
     /** All pairs A->B, where A (or one of its ancestors) misses transactions, but B has transactions.
      * Pruned nodes may have entries where B is missing data.
      */
@@ -218,6 +370,7 @@ namespace {
         uint256 hash;
         CBlockIndex* pindex;                                     //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
+        int64_t nTime;                                           //!< When the block was requested, in microseconds.
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
@@ -225,7 +378,7 @@ namespace {
     /** Stack of nodes which we have set to announce using compact blocks */
     list<NodeId> lNodesAnnouncingHeaderAndIDs;
 
-    /** Number of preferable block download peers. */
+    /** Number of preferable block download peers. Protected by cs_nodestate. */
     int nPreferredDownload = 0;
 
     /** Dirty block index entries. */
@@ -237,8 +390,9 @@ namespace {
     /** Number of peers from which we're downloading blocks. */
     int nPeersWithValidatedDownloads = 0;
 
-    /** Relay map, protected by cs_main. */
-    typedef std::map<uint256, std::shared_ptr<const CTransaction>> MapRelay;
+    /** Transactions mined or evicted from the mempool lately, which peers they were announced to may
+     * still ask for. Announced transactions still in the mempool are served from there. Protected by cs_main. */
+    typedef std::map<uint256, CTransactionRef> MapRelay;
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
@@ -258,19 +412,25 @@ struct CBlockReject {
 };
 
 /**
- * Maintain validation-specific state about nodes, protected by cs_main, instead
- * by CNode's own locks. This simplifies asynchronous operation, where
- * processing of incoming data is done after the ProcessMessage call returns,
- * and we're no longer holding the node's locks.
+ * Maintain validation-specific state about nodes, instead by CNode's own locks.
+ * This simplifies asynchronous operation, where processing of incoming data is
+ * done after the ProcessMessage call returns, and we're no longer holding the
+ * node's locks.
+ *
+ * Entries are added and erased holding both cs_main and cs_nodestate, so either
+ * one keeps them in place. The block download state is protected by cs_main.
+ * Misbehavior and the preferred download flag are protected by cs_nodestate, and
+ * the announcement preferences are atomics set by the peer's own messages, so
+ * that messages which only change these do not wait for validation.
  */
 struct CNodeState {
     //! The peer's address
     CService address;
-    //! Whether we have a fully established connection.
+    //! Whether we have a fully established connection. Protected by cs_nodestate.
     bool fCurrentlyConnected;
-    //! Accumulated misbehaviour score for this peer.
+    //! Accumulated misbehaviour score for this peer. Protected by cs_nodestate.
     int nMisbehavior;
-    //! Whether this peer should be disconnected and banned (unless whitelisted).
+    //! Whether this peer should be disconnected and banned (unless whitelisted). Protected by cs_nodestate.
     bool fShouldBan;
     //! String name of this peer (debugging/logging purposes).
     std::string name;
@@ -288,6 +448,10 @@ struct CNodeState {
     int nUnconnectingHeaders;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
+    //! The key in mapHeadersSegments of the segment this peer fetches, or -1.
+    int nHeadersSegment;
+    //! Whether this peer failed to serve a headers segment, and gets no other.
+    bool fHeadersSegmentFailed;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
@@ -295,27 +459,31 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
-    //! Whether we consider this a preferred download peer.
+    //! Bytes per second of the blocks we requested from this peer, averaged, or 0 before the first one.
+    int64_t nDownloadRate;
+    //! When a block we requested from this peer last arrived, in microseconds.
+    int64_t nLastBlockReceived;
+    //! Whether we consider this a preferred download peer. Protected by cs_nodestate.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
-    bool fPreferHeaders;
+    std::atomic<bool> fPreferHeaders;
     //! Whether this peer wants invs or cmpctblocks (when possible) for block announcements.
-    bool fPreferHeaderAndIDs;
+    std::atomic<bool> fPreferHeaderAndIDs;
     /**
       * Whether this peer will send us cmpctblocks if we request them.
       * This is not used to gate request logic, as we really only care about fSupportsDesiredCmpctVersion,
       * but is used as a flag to "lock in" the version of compact blocks (fWantsCmpctWitness) we send.
       */
-    bool fProvidesHeaderAndIDs;
+    std::atomic<bool> fProvidesHeaderAndIDs;
     //! Whether this peer can give us witnesses
-    bool fHaveWitness;
+    std::atomic<bool> fHaveWitness;
     //! Whether this peer wants witnesses in cmpctblocks/blocktxns
-    bool fWantsCmpctWitness;
+    std::atomic<bool> fWantsCmpctWitness;
     /**
      * If we've announced NODE_WITNESS to this peer: whether the peer sends witnesses in cmpctblocks/blocktxns,
      * otherwise: whether this peer sends non-witnesses in cmpctblocks/blocktxns.
      */
-    bool fSupportsDesiredCmpctVersion;
+    std::atomic<bool> fSupportsDesiredCmpctVersion;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -327,10 +495,14 @@ struct CNodeState {
         pindexBestHeaderSent = NULL;
         nUnconnectingHeaders = 0;
         fSyncStarted = false;
+        nHeadersSegment = -1;
+        fHeadersSegmentFailed = false;
         nStallingSince = 0;
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nDownloadRate = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -341,10 +513,13 @@ struct CNodeState {
     }
 };
 
-/** Map maintaining per-node state. Requires cs_main. */
+/** Guards mapNodeState with cs_main, and the parts of CNodeState named there. No other lock is taken under it. */
+CCriticalSection cs_nodestate;
+
+/** Map maintaining per-node state. Changed holding cs_main and cs_nodestate. */
 map<NodeId, CNodeState> mapNodeState;
 
-// Requires cs_main.
+// Requires cs_main or cs_nodestate.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
     if (it == mapNodeState.end())
@@ -358,6 +533,7 @@ int GetHeight()
     return chainActive.Height();
 }
 
+// Requires cs_nodestate.
 void UpdatePreferredDownload(CNode* node, CNodeState* state)
 {
     nPreferredDownload -= state->fPreferredDownload;
@@ -369,39 +545,101 @@ void UpdatePreferredDownload(CNode* node, CNodeState* state)
 }
 
 void InitializeNode(NodeId nodeid, const CNode *pnode) {
-    LOCK(cs_main);
-    CNodeState &state = mapNodeState.insert(std::make_pair(nodeid, CNodeState())).first->second;
+    LOCK2(cs_main, cs_nodestate);
+    CNodeState &state = mapNodeState.emplace(std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple()).first->second;
     state.name = pnode->addrName;
     state.address = pnode->addr;
 }
 
+// Requires cs_main.
+// Leaves the headers segment the peer fetches, if any, to another peer.
+static void ReleaseHeadersSegment(CNodeState* state)
+{
+    if (state->nHeadersSegment < 0)
+        return;
+    std::map<int, CHeadersSegment>::iterator it = mapHeadersSegments.find(state->nHeadersSegment);
+    if (it != mapHeadersSegments.end())
+        it->second.nodeid = -1;
+    state->nHeadersSegment = -1;
+}
+
 void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
 
     if (state->fSyncStarted)
         nSyncStarted--;
-
-    if (state->nMisbehavior == 0 && state->fCurrentlyConnected) {
-        AddressCurrentlyConnected(state->address);
-    }
+    ReleaseHeadersSegment(state);
 
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
     EraseOrphansFor(nodeid);
-    nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
+    if (state->nDownloadRate > 0) {
+        nDownloadRateSum -= state->nDownloadRate;
+        nPeersWithDownloadRate--;
+    }
+
+    CService address = state->address;
+    bool fAddressConnected;
+    {
+        LOCK(cs_nodestate);
+        fAddressConnected = state->nMisbehavior == 0 && state->fCurrentlyConnected;
+        nPreferredDownload -= state->fPreferredDownload;
+
+        mapNodeState.erase(nodeid);
+
+        if (mapNodeState.empty()) {
+            // Do a consistency check after the last peer is removed.
+            assert(mapBlocksInFlight.empty());
+            assert(nPreferredDownload == 0);
+            assert(nPeersWithValidatedDownloads == 0);
+            assert(nPeersWithDownloadRate == 0);
+        }
+    }
+
+    if (fAddressConnected) {
+        AddressCurrentlyConnected(address);
+    }
+}
 
-    mapNodeState.erase(nodeid);
+// Requires cs_main.
+// Updates the download rate of the peer from a block of nSize bytes it sent,
+// if we requested it from that peer. The block took from its request, or from
+// the arrival of the previous one if later, as the peer sends them in turn.
+void RecordBlockDownload(NodeId nodeid, const uint256& hash, unsigned int nSize)
+{
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    CNodeState *state = State(nodeid);
+    int64_t nNow = GetTimeMicros();
+    int64_t nElapsed = std::max<int64_t>(nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived), 1000);
+    int64_t nRate = (int64_t)nSize * 1000000 / nElapsed;
+    state->nLastBlockReceived = nNow;
 
-    if (mapNodeState.empty()) {
-        // Do a consistency check after the last peer is removed.
-        assert(mapBlocksInFlight.empty());
-        assert(nPreferredDownload == 0);
-        assert(nPeersWithValidatedDownloads == 0);
+    if (state->nDownloadRate > 0) {
+        nDownloadRateSum -= state->nDownloadRate;
+        nRate = state->nDownloadRate + (nRate - state->nDownloadRate) / BLOCK_DOWNLOAD_RATE_SMOOTHING;
+    } else {
+        nPeersWithDownloadRate++;
     }
+    state->nDownloadRate = std::max<int64_t>(nRate, 1);
+    nDownloadRateSum += state->nDownloadRate;
+}
+
+// Requires cs_main.
+// How many blocks may be in flight from the peer: MAX_BLOCKS_IN_TRANSIT_PER_PEER
+// for one downloading at the average rate of our peers, and more or fewer in
+// proportion for faster or slower ones.
+int GetBlocksInTransitQuota(const CNodeState* state)
+{
+    if (state->nDownloadRate == 0 || nPeersWithDownloadRate < 2)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nQuota = MAX_BLOCKS_IN_TRANSIT_PER_PEER * state->nDownloadRate * nPeersWithDownloadRate / nDownloadRateSum;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER, nQuota));
 }
 
 // Requires cs_main.
@@ -447,7 +685,7 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     MarkBlockAsReceived(hash);
 
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != NULL, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)});
+            {hash, pindex, pindex != NULL, GetTimeMicros(), std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -529,6 +767,8 @@ void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pf
 // Requires cs_main
 bool CanDirectFetch(const Consensus::Params &consensusParams)
 {
+    if (fHeadersOnly)
+        return false;
     return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
 }
 
@@ -656,16 +896,42 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     CNodeState *state = State(nodeid);
     if (state == NULL)
         return false;
-    stats.nMisbehavior = state->nMisbehavior;
+    {
+        LOCK(cs_nodestate);
+        stats.nMisbehavior = state->nMisbehavior;
+    }
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
     BOOST_FOREACH(const QueuedBlock& queue, state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nDownloadRate = state->nDownloadRate;
+    stats.nBlocksInTransitQuota = GetBlocksInTransitQuota(state);
     return true;
 }
 
+/** Read with std::atomic_load; replaced by PublishNodeStateStats about once a second */
+static std::shared_ptr<const NodeStateStatsMap> pNodeStateStatsSnapshot;
+/** When SendMessages next publishes the stats (protected by cs_main) */
+static int64_t nNextNodeStateStatsPublish = 0;
+
+// Requires cs_main.
+static void PublishNodeStateStats()
+{
+    std::shared_ptr<NodeStateStatsMap> snapshot = std::make_shared<NodeStateStatsMap>();
+    for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+        GetNodeStateStats(it->first, (*snapshot)[it->first]);
+    std::atomic_store(&pNodeStateStatsSnapshot, std::shared_ptr<const NodeStateStatsMap>(snapshot));
+}
+
+std::shared_ptr<const NodeStateStatsMap> GetNodeStateStatsSnapshot()
+{
+    static const std::shared_ptr<const NodeStateStatsMap> empty = std::make_shared<NodeStateStatsMap>();
+    std::shared_ptr<const NodeStateStatsMap> snapshot = std::atomic_load(&pNodeStateStatsSnapshot);
+    return snapshot ? snapshot : empty;
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
@@ -703,14 +969,25 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+/** The UTXO set statistics, current while they are for the best block of pcoinsTip (protected by cs_main) */
+static CUTXOStats utxoStats;
+CCoinsViewWriter *pcoinswriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CIndexDB *ptxindexdb = NULL;
+CIndexDB *paddressindexdb = NULL;
+CIndexDB *pspentindexdb = NULL;
+CIndexDB *ptimestampindexdb = NULL;
+CIndexDB *pblockfilterdb = NULL;
+
+/** Answers the -timestampindex range queries over the active chain */
+static CTimestampRangeIndex timestampRangeIndex;
 
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_orphans)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -730,23 +1007,31 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
+    // One copy, shared with the transactions kept for compact blocks
+    CTransactionRef ptx = MakeTransactionRef(tx);
+    int64_t nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{ptx, peer, nTimeExpire, vOrphanList.size()});
     assert(ret.second);
     BOOST_FOREACH(const CTxIn& txin, tx.vin) {
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
+    mapOrphanTransactionsByPeer[peer].insert(ret.first);
+    setOrphanTransactionsByExpiry.insert(make_pair(nTimeExpire, hash));
+    vOrphanList.push_back(ret.first);
+
+    AddToCompactExtraTransactions(ptx);
 
     LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
              mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
     return true;
 }
 
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_orphans)
 {
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return 0;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin)
     {
         auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
@@ -755,62 +1040,112 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    auto itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    itPeer->second.erase(it);
+    if (itPeer->second.empty())
+        mapOrphanTransactionsByPeer.erase(itPeer);
+    setOrphanTransactionsByExpiry.erase(make_pair(it->second.nTimeExpire, hash));
+
+    // Move the last orphan into the place of this one
+    size_t nListPos = it->second.nListPos;
+    assert(vOrphanList[nListPos] == it);
+    if (nListPos + 1 != vOrphanList.size()) {
+        vOrphanList[nListPos] = vOrphanList.back();
+        vOrphanList[nListPos]->second.nListPos = nListPos;
+    }
+    vOrphanList.pop_back();
+
     mapOrphanTransactions.erase(it);
     return 1;
 }
 
 void EraseOrphansFor(NodeId peer)
 {
+    LOCK(cs_orphans);
+    auto itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+    vector<uint256> vErase;
+    for (const auto& it : itPeer->second)
+        vErase.push_back(it->first);
     int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
-        }
-    }
+    BOOST_FOREACH(const uint256& hash, vErase)
+        nErased += EraseOrphanTx(hash);
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
+    LOCK(cs_orphans);
     unsigned int nEvicted = 0;
-    static int64_t nNextSweep;
     int64_t nNow = GetTime();
-    if (nNextSweep <= nNow) {
-        // Sweep out expired orphan pool entries:
-        int nErased = 0;
-        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
-        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-        while (iter != mapOrphanTransactions.end())
-        {
-            map<uint256, COrphanTx>::iterator maybeErase = iter++;
-            if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
-            } else {
-                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
-            }
-        }
-        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
-        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
-        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
-    }
+    // Sweep out expired orphan pool entries:
+    int nErased = 0;
+    while (!setOrphanTransactionsByExpiry.empty() && setOrphanTransactionsByExpiry.begin()->first <= nNow)
+        nErased += EraseOrphanTx(setOrphanTransactionsByExpiry.begin()->second);
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
         // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        EraseOrphanTx(vOrphanList[GetRand(vOrphanList.size())]->first);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// mapLowFeeTransactions
+//
+
+void static AddLowFeeTx(const CTransactionRef& ptx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    uint256 hash = ptx->GetHash();
+    if (mapLowFeeTransactions.count(hash) || GetTransactionWeight(*ptx) >= MAX_STANDARD_TX_WEIGHT)
+        return;
+
+    int64_t nNow = GetTime();
+    map<uint256, COrphanTx>::iterator iter = mapLowFeeTransactions.begin();
+    while (iter != mapLowFeeTransactions.end()) {
+        if (iter->second.nTimeExpire <= nNow)
+            mapLowFeeTransactions.erase(iter++);
+        else
+            ++iter;
+    }
+    while (mapLowFeeTransactions.size() >= MAX_LOW_FEE_TRANSACTIONS) {
+        // Evict a random one
+        map<uint256, COrphanTx>::iterator it = mapLowFeeTransactions.lower_bound(GetRandHash());
+        if (it == mapLowFeeTransactions.end())
+            it = mapLowFeeTransactions.begin();
+        mapLowFeeTransactions.erase(it);
+    }
+    mapLowFeeTransactions.emplace(hash, COrphanTx{ptx, peer, nNow + ORPHAN_TX_EXPIRE_TIME});
+    LogPrint("mempool", "stored low fee tx %s (mapsz %u)\n", hash.ToString(), mapLowFeeTransactions.size());
+}
+
+/**
+ * The distinct transactions tx spends from that were rejected for their fee,
+ * in the order of its inputs. Returns false if there are none or more than
+ * MAX_PACKAGE_PARENTS of them.
+ */
+bool static GetLowFeeParents(const CTransaction& tx, std::vector<CTransactionRef>& vParents) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    vParents.clear();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        map<uint256, COrphanTx>::iterator it = mapLowFeeTransactions.find(txin.prevout.hash);
+        if (it == mapLowFeeTransactions.end())
+            continue;
+        if (std::find(vParents.begin(), vParents.end(), it->second.tx) != vParents.end())
+            continue;
+        if (vParents.size() == MAX_PACKAGE_PARENTS)
+            return false;
+        vParents.push_back(it->second.tx);
+    }
+    return !vParents.empty();
+}
+
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
     if (tx.nLockTime == 0)
@@ -1104,13 +1439,15 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state)
             return state.DoS(100, false, REJECT_INVALID, "bad-txns-txouttotal-toolarge");
     }
 
-    // Check for duplicate inputs
-    set<COutPoint> vInOutPoints;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        if (vInOutPoints.count(txin.prevout))
+    // Check for duplicate inputs, with one sorted copy of the outpoints rather than a set node per input
+    if (tx.vin.size() > 1) {
+        std::vector<COutPoint> vInOutPoints;
+        vInOutPoints.reserve(tx.vin.size());
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vInOutPoints.push_back(txin.prevout);
+        std::sort(vInOutPoints.begin(), vInOutPoints.end());
+        if (std::adjacent_find(vInOutPoints.begin(), vInOutPoints.end()) != vInOutPoints.end())
             return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputs-duplicate");
-        vInOutPoints.insert(txin.prevout);
     }
 
     if (tx.IsCoinBase())
@@ -1128,15 +1465,90 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state)
     return true;
 }
 
+/** Keep serving transactions that leave the mempool for a while. Requires cs_main. */
+static void AddRelayRemoved(const std::vector<CTransactionRef>& vtx)
+{
+    int64_t nNow = GetTimeMicros();
+    for (const CTransactionRef& tx : vtx) {
+        auto ret = mapRelay.insert(std::make_pair(tx->GetHash(), tx));
+        if (ret.second)
+            vRelayExpiration.push_back(std::make_pair(nNow + RELAY_REMOVED_TX_EXPIRY * 1000000, ret.first));
+    }
+    while (!vRelayExpiration.empty() && (vRelayExpiration.front().first < nNow || mapRelay.size() > MAX_RELAY_REMOVED_TX)) {
+        mapRelay.erase(vRelayExpiration.front().second);
+        vRelayExpiration.pop_front();
+    }
+}
+
 void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     int expired = pool.Expire(GetTime() - age);
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
+    // Once over the limit, trim some way below it
+    if (pool.DynamicMemoryUsage() <= limit)
+        return;
     std::vector<uint256> vNoSpendsRemaining;
-    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    std::vector<CTransactionRef> vtxEvicted;
+    pool.TrimToSize(limit - limit / 100 * MEMPOOL_TRIM_HEADROOM_PERCENT, &vNoSpendsRemaining, &pool == &mempool ? &vtxEvicted : NULL);
     BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
+    AddRelayRemoved(vtxEvicted);
+}
+
+void TrimMempool()
+{
+    LOCK(cs_main);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+}
+
+/** Set by CheckMemoryLimit while the node is over -maxmemory, cleared by the coins cache flush it asks for */
+static std::atomic<bool> fMemoryPressure(false);
+
+static void AddDBMemoryUsage(const CDBWrapper& db, size_t& nUsage)
+{
+    std::string strUsage = db.GetProperty("leveldb.approximate-memory-usage");
+    if (!strUsage.empty())
+        nUsage += atoi64(strUsage);
+}
+
+CNodeMemoryUsage GetNodeMemoryUsage()
+{
+    CNodeMemoryUsage usage;
+    {
+        LOCK(cs_main);
+        usage.nCoinsCache = pcoinsTip ? pcoinsTip->DynamicMemoryUsage() : 0;
+        usage.nBlockIndex = memusage::DynamicUsage(mapBlockIndex) + mapBlockIndex.size() * memusage::MallocUsage(sizeof(CBlockIndex));
+    }
+    usage.nScriptCache = GetScriptExecutionCacheStats().nMemoryUsage;
+    usage.nMempool = mempool.DynamicMemoryUsage();
+    CDBWrapper::ForEachOpen(boost::bind(&AddDBMemoryUsage, _1, boost::ref(usage.nLevelDB)));
+    usage.nSigCache = GetSignatureCacheStats().nMemoryUsage;
+    usage.nEthashLight = EthashAux::lightCacheUsage();
+    usage.nEthashDAG = EthashAux::dagMemoryUsage();
+    usage.nPeerSend = TotalSendQueueSize();
+    usage.nPeerRecv = TotalRecvBufferSize() + IdleRecvBufferSize();
+    return usage;
+}
+
+void CheckMemoryLimit()
+{
+    static bool fOverLimit = false;
+    size_t nMaxMemory = std::max<int64_t>(0, GetArg("-maxmemory", DEFAULT_MAX_MEMORY)) << 20;
+    if (nMaxMemory == 0)
+        return;
+    size_t nUsage = GetNodeMemoryUsage().Total();
+    if (nUsage <= nMaxMemory) {
+        if (fOverLimit)
+            LogPrintf("%s: memory use of %u MiB back under -maxmemory\n", __func__, nUsage >> 20);
+        fOverLimit = false;
+        return;
+    }
+    if (!fOverLimit)
+        LogPrintf("%s: memory use of %u MiB over -maxmemory=%u, flushing the coins cache and evicting Ethash light caches\n", __func__, nUsage >> 20, nMaxMemory >> 20);
+    fOverLimit = true;
+    EthashAux::trimLightCache();
+    fMemoryPressure = true;
 }
 
 /** Convert CValidationState to a human-readable message for logging */
@@ -1148,9 +1560,25 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
+/** Transactions with fewer inputs than this have their scripts checked serially by AcceptToMemoryPool */
+static const unsigned int MIN_PARALLEL_MEMPOOL_INPUTS = 4;
+
+static CCheckQueue<CScriptCheck> mempoolcheckqueue(128);
+
+void ThreadMempoolScriptCheck(int nCpu) {
+    RenameThread("mil-mempoolch");
+    if (nCpu >= 0 && !SetThreadAffinity(nCpu))
+        LogPrintf("%s: could not pin mempool script check thread to CPU %d\n", __func__, nCpu);
+    mempoolcheckqueue.Thread();
+}
+
+/**
+ * The work of AcceptToMemoryPool. A package member skips the fee checks and the
+ * wallet notification, which AcceptPackageToMemoryPool does for the package.
+ */
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                              bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+                              bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
+                              std::vector<uint256>& vHashTxnToUncache, bool fPackageMember)
 {
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
@@ -1322,7 +1750,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -1335,7 +1763,9 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                 strprintf("%d", nSigOpsCost));
 
         CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
-        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+        if (fPackageMember) {
+            // Checked on the whole package
+        } else if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nFees, mempoolRejectFee));
         } else if (GetBoolArg("-relaypriority", DEFAULT_RELAYPRIORITY) && nModifiedFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(entry.GetPriority(chainActive.Height() + 1))) {
             // Require that free transactions have sufficient priority to be mined in the next block.
@@ -1345,7 +1775,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Continuously rate-limit free (really, very-low-fee) transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
-        if (fLimitFree && nModifiedFees < ::minRelayTxFee.GetFee(nSize))
+        if (fLimitFree && !fPackageMember && nModifiedFees < ::minRelayTxFee.GetFee(nSize))
         {
             static CCriticalSection csFreeLimiter;
             static double dFreeCount;
@@ -1371,21 +1801,21 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                 strprintf("%d > %d", nFees, nAbsurdFee));
 
         // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
+        CTxMemPool::vecEntries vAncestors;
         size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
         size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
         size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
         size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
         std::string errString;
-        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+        if (!pool.CalculateMemPoolAncestors(entry, vAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
         }
 
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
-        // pathological case by making sure setConflicts and setAncestors don't
+        // pathological case by making sure setConflicts and vAncestors don't
         // intersect.
-        BOOST_FOREACH(CTxMemPool::txiter ancestorIt, setAncestors)
+        BOOST_FOREACH(CTxMemPool::txiter ancestorIt, vAncestors)
         {
             const uint256 &hashAncestor = ancestorIt->GetTx().GetHash();
             if (setConflicts.count(hashAncestor))
@@ -1532,30 +1962,49 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        // Verify the scripts of transactions with many inputs on the mempool
+        // check threads. If that fails, the serial CheckInputs below runs
+        // anyway to tell why, mostly finding the valid signatures cached.
+        bool fScriptsOk = false;
+        if (nScriptCheckThreads && tx.vin.size() >= MIN_PARALLEL_MEMPOOL_INPUTS) {
+            std::vector<CScriptCheck> vChecks;
+            CCheckQueueControl<CScriptCheck> control(&mempoolcheckqueue);
+            if (CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata, &vChecks)) {
+                control.Add(vChecks);
+                fScriptsOk = control.Wait();
+            }
+        }
+        if (!fScriptsOk && !CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
+            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
                 // Only the witness is missing, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
             return false;
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
+        // Check again against the consensus-critical script verification
+        // flags of the current tip, in case of bugs in the standard flags that
+        // cause transactions to pass as valid when they're actually invalid.
+        // For instance the STRICTENC flag was incorrectly allowing certain
         // CHECKSIG NOT scripts to pass, even though they were invalid.
         //
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+        //
+        // Using the tip's flags rather than MANDATORY_SCRIPT_VERIFY_FLAGS
+        // also caches the result for ConnectBlock, which almost always
+        // connects the transaction with the same flags. When the flags of
+        // the next block differ (a soft fork activating), the cache entries
+        // simply miss.
+        unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
+        if (!CheckInputs(tx, state, view, true, currentBlockScriptVerifyFlags, true, true, txdata))
         {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against block but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
         }
 
@@ -1567,53 +2016,133 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                     hash.ToString(),
                     FormatMoney(nModifiedFees - nConflictingFees),
                     (int)nSize - (int)nConflictingSize);
+            AddToCompactExtraTransactions(it->GetSharedTx());
         }
         pool.RemoveStaged(allConflicting, false);
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, vAncestors, !IsInitialBlockDownload());
+        TRACE4(mempool, added, hash.begin(), nSize, nFees, fPackageMember);
 
-        //Add memory address index
-        if(fAddressIndex){
-            pool.addAddressIndex(entry, view);
-        }
+        if (fAddressIndex || fSpentIndex) {
+            // Classify the spent outputs once for both memory indexes
+            std::vector<CIndexAddress> vPrevAddresses;
+            vPrevAddresses.reserve(tx.vin.size());
+            BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                vPrevAddresses.push_back(GetIndexAddress(view.GetOutputFor(txin).scriptPubKey));
+
+            //Add memory address index
+            if(fAddressIndex){
+                pool.addAddressIndex(entry, view, vPrevAddresses);
+            }
 
-        // Add memory spent index
-        if (fSpentIndex) {
-            pool.addSpentIndex(entry, view);
+            // Add memory spent index
+            if (fSpentIndex) {
+                pool.addSpentIndex(entry, view, vPrevAddresses);
+            }
         }
 
-        // trim mempool and check if tx was trimmed
-        if (!fOverrideMempoolLimit) {
-            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        // Trimming is left to TrimMempool, and the rolling minimum fee checked
+        // above keeps out what it would trim, unless the mempool grows
+        // too far past its limit before it runs: then trim mempool and
+        // check if tx was trimmed
+        size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+        if (!fOverrideMempoolLimit && pool.DynamicMemoryUsage() > nMaxMempool + nMaxMempool / 100 * MEMPOOL_TRIM_OVERSHOOT_PERCENT) {
+            LimitMempoolSize(pool, nMaxMempool, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
             if (!pool.exists(hash))
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
         }
     }
 
-    SyncWithWallets(tx, NULL, NULL);
+    if (!fPackageMember)
+        SyncWithWallets(tx, NULL, NULL);
 
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
     std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache, false);
     if (!res) {
+        TRACE4(mempool, rejected, tx.GetHash().begin(), state.GetRejectReason().c_str(), state.GetRejectCode(), pfMissingInputs && *pfMissingInputs);
         BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
     }
     return res;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, nAbsurdFee);
+}
+
+/**
+ * Accept the parents, then their child tx, as a package that pays the mempool
+ * minimum fee and the relay fee with its combined fee rate, though the parents
+ * alone do not. Each transaction passes all the other checks of
+ * AcceptToMemoryPool; if any fails, or the package fee does, none stays.
+ */
+bool static AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& vParents, const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    std::vector<uint256> vHashTxToUncache;
+    std::vector<CTransactionRef> vAccepted;
+    int64_t nNow = GetTime();
+    bool fAccepted = true;
+    for (size_t i = 0; i <= vParents.size() && fAccepted; i++) {
+        CTransactionRef ptx = i < vParents.size() ? vParents[i] : MakeTransactionRef(tx);
+        fAccepted = AcceptToMemoryPoolWorker(pool, state, *ptx, false, NULL, nNow, true, 0, vHashTxToUncache, true);
+        if (fAccepted)
+            vAccepted.push_back(ptx);
+    }
+
+    if (fAccepted) {
+        CAmount nPackageFees = 0;
+        size_t nPackageSize = 0;
+        {
+            LOCK(pool.cs);
+            BOOST_FOREACH(const CTransactionRef& ptx, vAccepted) {
+                CTxMemPool::txiter it = pool.mapTx.find(ptx->GetHash());
+                nPackageFees += it->GetModifiedFee();
+                nPackageSize += it->GetTxSize();
+            }
+        }
+        CAmount nRequiredFee = std::max(pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nPackageSize),
+                                        ::minRelayTxFee.GetFee(nPackageSize));
+        if (nPackageFees < nRequiredFee)
+            fAccepted = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "package fee not met", false, strprintf("%d < %d", nPackageFees, nRequiredFee));
+    }
+
+    if (!fAccepted) {
+        // Removing the first parent takes its descendants along
+        std::list<CTransaction> removed;
+        BOOST_FOREACH(const CTransactionRef& ptx, vAccepted)
+            pool.removeRecursive(*ptx, removed);
+        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+            pcoinsTip->Uncache(hashTx);
+        return false;
+    }
+
+    BOOST_FOREACH(const CTransactionRef& ptx, vAccepted)
+        SyncWithWallets(*ptx, NULL, NULL);
+    LogPrint("mempool", "accepted package of %u parents and tx %s\n", vParents.size(), tx.GetHash().ToString());
+    return true;
+}
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes)
 {
     if(!fTimestampIndex)
         return error("Timestamp index not enabled");
 
-    if(!pblocktree->ReadTimestampIndex(high, low, fActiveOnly, hashes))
+    if (fActiveOnly) {
+        timestampRangeIndex.GetRange(high, low, hashes);
+        return true;
+    }
+
+    SyncIndexWriter();
+    if(!ptimestampindexdb->ReadTimestampIndex(high, low, fActiveOnly, hashes))
         return error("Unable to get hashes for timestamps");
     
     return true;
@@ -1627,12 +2156,24 @@ bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     if (mempool.getSpentIndex(key, value))
         return true;
     
-    if (!pblocktree->ReadSpentIndex(key, value))
+    SyncIndexWriter();
+    if (!pspentindexdb->ReadSpentIndex(key, value))
         return false;
     
     return true;
 }
 
+bool GetSpentIndex(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values)
+{
+    if (!fSpentIndex)
+        return false;
+
+    mempool.getSpentIndex(keys, values);
+
+    SyncIndexWriter();
+    return pspentindexdb->ReadSpentIndex(keys, values);
+}
+
 bool HashOnChainActive(const uint256 &hash)
 {
     CBlockIndex* pblockindex = mapBlockIndex[hash];
@@ -1650,56 +2191,198 @@ bool GetAddressIndex(uint160 addressHash, int type,
     if(!fAddressIndex)
         return error("address index not enabled");
     
-    if(!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+    SyncIndexWriter();
+    if(!paddressindexdb->ReadAddressIndex(addressHash, type, addressIndex, start, end))
         return error("unable to get txids for address");
     
     return true;
 }
 
+bool GetAddressIndex(const std::vector<std::pair<uint160, int> > &addresses,
+                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int start, int end,
+                     const CDBSnapshot *pSnapshot)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pSnapshot)
+        SyncIndexWriter();
+    if (!paddressindexdb->ReadAddressIndex(addresses, start, end, nAddressIndexThreads, addressIndex, pSnapshot))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool ScanAddressIndex(uint160 addressHash, int type, const boost::function<bool(const CAddressIndexKey&, CAmount)> &fn,
+                      int start, int end, const CAddressIndexKey *pFrom, const CDBSnapshot *pSnapshot)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pSnapshot)
+        SyncIndexWriter();
+    if (!paddressindexdb->ScanAddressIndex(addressHash, type, start, end, pFrom, fn, pSnapshot))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool GetAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &balance)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    SyncIndexWriter();
+    if (!paddressindexdb->ReadAddressBalance(addressHash, type, balance))
+        return error("unable to get balance for address");
+
+    return true;
+}
+
 bool GetAddressUnspent(uint160 addressHash, int type,
                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs)
 {
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+    SyncIndexWriter();
+    if (!paddressindexdb->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
         return error("unable to get txids for address");
     
     return true;
 }
 
-/** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
-bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
+bool GetAddressUnspent(const std::vector<std::pair<uint160, int> > &addresses,
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                       const CDBSnapshot *pSnapshot)
 {
-    CBlockIndex *pindexSlow = NULL;
+    if (!fAddressIndex)
+        return error("address index not enabled");
 
-    LOCK(cs_main);
+    if (!pSnapshot)
+        SyncIndexWriter();
+    if (!paddressindexdb->ReadAddressUnspentIndex(addresses, nAddressIndexThreads, unspentOutputs, pSnapshot))
+        return error("unable to get txids for address");
 
-    std::shared_ptr<const CTransaction> ptx = mempool.get(hash);
-    if (ptx)
-    {
-        txOut = *ptx;
-        return true;
-    }
+    return true;
+}
 
-    if (fTxIndex) {
-        CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (const std::exception& e) {
-                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-            }
-            hashBlock = header.GetHash();
-            if (txOut.GetHash() != hash)
-                return error("%s: txid mismatch", __func__);
-            return true;
+bool ScanAddressUnspent(uint160 addressHash, int type, const boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> &fn,
+                        const CAddressUnspentKey *pFrom, const CDBSnapshot *pSnapshot)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pSnapshot)
+        SyncIndexWriter();
+    if (!paddressindexdb->ScanAddressUnspentIndex(addressHash, type, pFrom, fn, pSnapshot))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+static bool IsBlockStoredCompressed(const CBlock& block)
+{
+    return fCompressBlocks && CBlockCompressor::CanCompress(block);
+}
+
+unsigned int GetStoredBlockSize(const CBlock& block)
+{
+    if (IsBlockStoredCompressed(block))
+        return ::GetSerializeSize(CBlockCompressor(const_cast<CBlock&>(block)), SER_DISK, CLIENT_VERSION);
+    return ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+}
+
+void SerializeBlockRecord(CDataStream& s, const CBlock& block, const CMessageHeader::MessageStartChars& messageStart)
+{
+    if (IsBlockStoredCompressed(block)) {
+        CBlockCompressor compressor(const_cast<CBlock&>(block));
+        s << FLATDATA(messageStart) << (compressor.GetSerializeSize(s.GetType(), s.GetVersion()) | BLOCK_RECORD_COMPRESSED) << compressor;
+    } else {
+        s << FLATDATA(messageStart) << (unsigned int)::GetSerializeSize(block, s.GetType(), s.GetVersion()) << block;
+    }
+}
+
+/** Deserialize the block of a block file record, fCompressed if BLOCK_RECORD_COMPRESSED was set in its size */
+template<typename Stream>
+static void UnserializeBlockRecord(Stream& s, CBlock& block, bool fCompressed)
+{
+    if (fCompressed) {
+        CBlockCompressor compressor(block);
+        s >> compressor;
+    } else {
+        s >> block;
+    }
+}
+
+/** Read the size field in front of the block at pos, BLOCK_RECORD_COMPRESSED included */
+static bool ReadBlockRecordSize(const CDiskBlockPos& pos, unsigned int& nSize)
+{
+    if (pos.IsNull() || pos.nPos < 4)
+        return error("%s: no block at %s", __func__, pos.ToString());
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+    try {
+        filein >> nSize;
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+}
+
+/** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
+bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
+{
+    CBlockIndex *pindexSlow = NULL;
+
+    LOCK(cs_main);
+
+    CTransactionRef ptx = mempool.get(hash);
+    if (ptx)
+    {
+        txOut = *ptx;
+        return true;
+    }
+
+    if (fTxIndex) {
+        CDiskTxPos postx;
+        SyncIndexWriter();
+        if (ptxindexdb->ReadTxIndex(hash, postx)) {
+            // Opened at the size of the block, which tells whether the transaction can be read in place
+            if (postx.nPos < 4)
+                return error("%s: no block at %s", __func__, postx.ToString());
+            CAutoFile file(OpenBlockFile(CDiskBlockPos(postx.nFile, postx.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+            if (file.IsNull())
+                return error("%s: OpenBlockFile failed", __func__);
+            CBlockHeader header;
+            try {
+                unsigned int nSize;
+                file >> nSize;
+                if (nSize & BLOCK_RECORD_COMPRESSED) {
+                    // nTxOffset counts in the uncompressed block
+                    CBlock block;
+                    UnserializeBlockRecord(file, block, true);
+                    header = block.GetBlockHeader();
+                    unsigned int nTxOffset = GetSizeOfCompactSize(block.vtx.size());
+                    for (unsigned int i = 0; i < block.vtx.size() && nTxOffset <= postx.nTxOffset; i++) {
+                        if (nTxOffset == postx.nTxOffset)
+                            txOut = *block.vtx[i];
+                        nTxOffset += ::GetSerializeSize(*block.vtx[i], SER_DISK, CLIENT_VERSION);
+                    }
+                } else {
+                    file >> header;
+                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    file >> txOut;
+                }
+            } catch (const std::exception& e) {
+                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            }
+            hashBlock = header.GetHash();
+            if (txOut.GetHash() != hash)
+                return error("%s: txid mismatch", __func__);
+            return true;
         }
     }
 
@@ -1718,9 +2401,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-                if (tx.GetHash() == hash) {
-                    txOut = tx;
+            BOOST_FOREACH(const CTransactionRef &tx, block.vtx) {
+                if (tx->GetHash() == hash) {
+                    txOut = *tx;
                     hashBlock = pindexSlow->GetBlockHash();
                     return true;
                 }
@@ -1748,50 +2431,73 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     if (fileout.IsNull())
         return error("WriteBlockToDisk: OpenBlockFile failed");
 
-    // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
-    fileout << FLATDATA(messageStart) << nSize;
-
-    // Write block
     long fileOutPos = ftell(fileout.Get());
     if (fileOutPos < 0)
         return error("WriteBlockToDisk: ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+
+    // Write index header and block
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    SerializeBlockRecord(ssRecord, block, messageStart);
+    fileout.write(&ssRecord[0], ssRecord.size());
+    pos.nPos = (unsigned int)fileOutPos + MESSAGE_START_SIZE + sizeof(unsigned int);
 
     LogPrintf("end WriteBlockToDisk:\n");
 
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    // The block may still be on its way to the file
+    blockStoreWriter.WaitFor(pos, false);
 
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    // Deserialize straight from the mapped file when it can be mapped
+    boost::shared_ptr<const CMappedBlockFile> pmap;
+    const char* pbegin;
+    unsigned int nSize;
+    bool fCompressed;
+    if (blockFileMaps.GetBlock(pos, pmap, pbegin, nSize, fCompressed)) {
+        try {
+            CSpanReader ssBlock(pbegin, pbegin + nSize, SER_DISK, CLIENT_VERSION);
+            UnserializeBlockRecord(ssBlock, block, fCompressed);
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        // Open history file to read, at the size that tells how the block is stored
+        if (pos.IsNull() || pos.nPos < 4)
+            return error("ReadBlockFromDisk: no block at %s", pos.ToString());
+        CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+
+        // Read block
+        try {
+            filein >> nSize;
+            UnserializeBlockRecord(filein, block, nSize & BLOCK_RECORD_COMPRESSED);
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     // Check the header
     /* Check blocks proof of work. */
-    if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
+    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
 
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams, bool fForceCheckPOW)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+    // The header hash comparison below is enough to tie the block to an
+    // index entry whose Ethash PoW was already verified.
+    bool fCheckPOW = fForceCheckPOW || !(pindex->nStatus & BLOCK_POW_VERIFIED);
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams, fCheckPOW))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
@@ -1799,6 +2505,81 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(CRawBlock& block, const CDiskBlockPos& pos)
+{
+    block.pmap.reset();
+    block.vchData.clear();
+    blockStoreWriter.WaitFor(pos, false);
+    bool fCompressed;
+    if (!blockFileMaps.GetBlock(pos, block.pmap, block.pbegin, block.nSize, fCompressed)) {
+        // The size is stored right before the block
+        if (pos.IsNull() || pos.nPos < 4)
+            return error("%s: no block at %s", __func__, pos.ToString());
+        CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+        try {
+            unsigned int nSize;
+            filein >> nSize;
+            fCompressed = nSize & BLOCK_RECORD_COMPRESSED;
+            nSize &= ~BLOCK_RECORD_COMPRESSED;
+            if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                return error("%s: bad block size %u at %s", __func__, nSize, pos.ToString());
+            block.vchData.resize(nSize);
+            filein.read(&block.vchData[0], nSize);
+            block.pbegin = &block.vchData[0];
+            block.nSize = nSize;
+        }
+        catch (const std::exception& e) {
+            return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    }
+    if (!fCompressed)
+        return true;
+
+    // A compressed block has to be serialized again for the network
+    CBlock blockStored;
+    try {
+        CSpanReader ssStored(block.pbegin, block.pbegin + block.nSize, SER_DISK, CLIENT_VERSION);
+        UnserializeBlockRecord(ssStored, blockStored, true);
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    ssBlock << blockStored;
+    block.pmap.reset();
+    block.vchData.assign(ssBlock.begin(), ssBlock.end());
+    block.pbegin = &block.vchData[0];
+    block.nSize = block.vchData.size();
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CRawBlock& block, const CDiskBlockPos& pos, const uint256& hash, bool fCheckPOW, const Consensus::Params& consensusParams)
+{
+    if (!ReadRawBlockFromDisk(block, pos))
+        return false;
+    CBlockHeader header;
+    try {
+        CSpanReader ssHeader(block.pbegin, block.pbegin + block.nSize, SER_DISK, CLIENT_VERSION);
+        ssHeader >> header;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    if (fCheckPOW && !CheckProofOfWork(header.GetPoWHash(), header.nBits, consensusParams))
+        return error("%s: Errors in block header at %s", __func__, pos.ToString());
+    if (header.GetHash() != hash)
+        return error("%s: GetHash() doesn't match index for %s at %s", __func__,
+                hash.ToString(), pos.ToString());
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CRawBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    return ReadRawBlockFromDisk(block, pindex->GetBlockPos(), pindex->GetBlockHash(), !(pindex->nStatus & BLOCK_POW_VERIFIED), consensusParams);
+}
+
 int static generateMTRandom(unsigned int s, int range)
 {
     boost::mt19937 gen(s);
@@ -1868,13 +2649,15 @@ bool IsInitialBlockDownload()
     if (fImporting || fReindex) {
         return true;
     }
-    if (chainActive.Tip() == NULL){
+    // In headers-only mode the download is over once the headers are
+    const CChain& chain = HeadersChain();
+    if (chain.Tip() == NULL){
         return true;
     }
-    if (chainActive.Tip()->nChainWork < UintToArith256(chainParams.GetConsensus().nMinimumChainWork)){
+    if (chain.Tip()->nChainWork < UintToArith256(chainParams.GetConsensus().nMinimumChainWork)){
         return true;
     }
-    if (chainActive.Tip()->GetBlockTime() < (GetTime() - nMaxTipAge)) {
+    if (chain.Tip()->GetBlockTime() < (GetTime() - nMaxTipAge)) {
         return true;
     }
     latchToFalse.store(true, std::memory_order_relaxed);
@@ -1976,12 +2759,12 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    LOCK(cs_nodestate);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -2127,7 +2910,27 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
+/**
+ * Transactions whose scripts all passed with a given set of flags, so that
+ * ConnectBlock does not run them again after AcceptToMemoryPool. Entries are
+ * SHA256(nonce || wtxid || flags), and like the signature cache the table
+ * shares -maxsigcachesize. Guarded by cs_main.
+ */
+static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+static uint256 scriptExecutionCacheNonce(GetRandHash());
+static CScriptExecutionCacheStats scriptExecutionCacheStats;
+
+void InitScriptExecutionCache()
+{
+    // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
+    // setup_bytes creates the minimum possible cache (2 elements).
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %zu elements\n",
+            (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -2148,13 +2951,25 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // the checkpoint is for a chain that's invalid due to false scriptSigs
         // this optimization would allow an invalid chain to be accepted.
         if (fScriptChecks) {
+            // First check if script executions have been cached with the same
+            // flags. The nonce is cut so that the entry hashes in one block.
+            uint256 hashCacheEntry;
+            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            AssertLockHeld(cs_main);
+            scriptExecutionCacheStats.nLookups++;
+            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
+                scriptExecutionCacheStats.nHits++;
+                return true;
+            }
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(*coins, tx, i, flags, cacheSigStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2167,7 +2982,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2181,14 +2996,19 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            if (cacheFullScriptStore && !pvChecks) {
+                // We executed all of the provided scripts, and were told to
+                // cache the result. Do so now.
+                scriptExecutionCache.insert(hashCacheEntry);
+                scriptExecutionCacheStats.nInserts++;
+            }
         }
     }
 
     return true;
 }
 
-namespace {
-
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
@@ -2218,6 +3038,9 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
+    // The record may still be on its way to the file
+    blockStoreWriter.WaitFor(pos, true);
+
     // Open history file to read
     CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -2243,6 +3066,8 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -2296,7 +3121,8 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
     return fClean;
 }
 
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean,
+                     const CBlockUndo* pblockundo)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -2305,12 +3131,16 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock(): no undo data available");
-    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock(): failure reading undo data");
+    CBlockUndo blockUndoRead;
+    if (!pblockundo) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock(): no undo data available");
+        if (!UndoReadFromDisk(blockUndoRead, pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock(): failure reading undo data");
+        pblockundo = &blockUndoRead;
+    }
+    const CBlockUndo& blockUndo = *pblockundo;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
@@ -2318,36 +3148,27 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    boost::scoped_ptr<CBlockIndexAddresses> outputAddresses;
+    if (fAddressIndex)
+        outputAddresses.reset(new CBlockIndexAddresses(block.vtx));
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         uint256 hash = tx.GetHash();
 
         if(fAddressIndex) {
             for (unsigned int k = tx.vout.size(); k-- > 0;) {
                 const CTxOut &out = tx.vout[k];
+                const CIndexAddress& address = outputAddresses->Output(i, k);
+                if (address.type == 0)
+                    continue;
 
-                if(out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, k , false), out.nValue));
-                
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), hash, k), CAddressUnspentValue()));
-
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
+                // undo receiving activity
+                addressIndex.push_back(make_pair(CAddressIndexKey(address.type, address.hashBytes, pindex->nHeight, i, hash, k, false), out.nValue));
 
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, k, false), out.nValue));
-                
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), hash, k), CAddressUnspentValue()));
-                } else {
-                    continue;
-                }
+                // undo unspent index
+                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(address.type, address.hashBytes, hash, k), CAddressUnspentValue()));
             }
         }
 
@@ -2390,28 +3211,15 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
                 if(fAddressIndex) {
                     const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
-
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
-                    
-                        // restore unspent index
-
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
-                    
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
+                    const CIndexAddress address = GetIndexAddress(prevout.scriptPubKey);
+                    if (address.type == 0)
+                        continue;
 
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
-                    
-                        // restore unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                    // undo spending activity
+                    addressIndex.push_back(make_pair(CAddressIndexKey(address.type, address.hashBytes, pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
 
-                    } else {
-                        continue;
-                    }
+                    // restore unspent index
+                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(address.type, address.hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
                 }
             }
         }
@@ -2425,13 +3233,17 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
         return true;
     }
 
-    if(fAddressIndex) {
-        if (!pblocktree->EraseAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to delete address index");
-        }
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
+    if (fAddressIndex || fSpentIndex) {
+        boost::shared_ptr<CIndexUpdate> update(new CIndexUpdate());
+        update->fConnect = false;
+        update->pindex = pindex;
+        update->hashBlock = pindex->GetBlockHash();
+        update->hashPrevBlock = pindex->pprev->GetBlockHash();
+        update->nTime = pindex->nTime;
+        update->addressIndex.swap(addressIndex);
+        update->addressUnspentIndex.swap(addressUnspentIndex);
+        update->spentIndex.swap(spentIndex);
+        GetMainSignals().UpdatedIndexes(update);
     }
 
     return fClean;
@@ -2441,37 +3253,130 @@ void static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
 
-    CDiskBlockPos posOld(nLastBlockFile, 0);
-
-    FILE *fileOld = OpenBlockFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
-    }
-
-    fileOld = OpenUndoFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
-    }
+    // Done once the data handed to the writer before is written; only FlushStateToDisk waits for it
+    blockStoreWriter.Commit(nLastBlockFile, fFinalize, vinfoBlockFile[nLastBlockFile].nSize, vinfoBlockFile[nLastBlockFile].nUndoSize);
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
-void ThreadScriptCheck() {
+void ThreadScriptCheck(int nCpu) {
     RenameThread("mil-scriptch");
+    if (nCpu >= 0 && !SetThreadAffinity(nCpu))
+        LogPrintf("%s: could not pin script check thread to CPU %d\n", __func__, nCpu);
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CHeaderPoWCheck> headercheckqueue(8);
+/** Held by the message handler thread that is the master of headercheckqueue */
+static CCriticalSection cs_headercheckqueue;
+
+void ThreadHeaderCheck() {
+    RenameThread("mil-headerch");
+    headercheckqueue.Thread();
+}
+
+bool CHeaderPoWCheck::operator()() {
+    *phashPoW = pheader->GetPoWHash();
+    return true;
+}
+
+/**
+ * Hand the Ethash proofs of the headers we don't know yet to the offload
+ * backend, one batch per epoch. The results land in the evaluation cache,
+ * where GetPoWHash finds them whichever thread checks the header.
+ */
+static void OffloadHeadersPoW(const std::vector<CBlockHeader>& headers)
+{
+    std::map<uint256, std::vector<EthashInput> > mapBatches;
+    {
+        LOCK(cs_main);
+        for (unsigned int n = 0; n < headers.size(); n++) {
+            if (mapBlockIndex.count(headers[n].GetHash()))
+                continue;
+            EthashInput input;
+            input.headerHash = headers[n].hashPrevBlock;
+            input.nonce = headers[n].nNonce;
+            mapBatches[EthashAux::seedHash(headers[n].nHeight)].push_back(input);
+        }
+    }
+    for (std::map<uint256, std::vector<EthashInput> >::const_iterator it = mapBatches.begin(); it != mapBatches.end(); ++it)
+        EthashAux::evalBatch(it->first, it->second);
+}
+
+/**
+ * Evaluate the Ethash proofs of a headers message on the header check threads.
+ * vHashPoW receives one entry per header; entries of headers we already know
+ * are left null so AcceptBlockHeader doesn't need them. Leaves vHashPoW empty
+ * when there are no worker threads, or while another message handler thread
+ * uses them, in which case headers are checked serially.
+ */
+static void ComputeHeadersPoW(const std::vector<CBlockHeader>& headers, std::vector<uint256>& vHashPoW)
+{
+    if (headers.size() < 2)
+        return;
+    if (EthashAux::backend())
+        OffloadHeadersPoW(headers);
+    if (nScriptCheckThreads == 0)
+        return;
+    TRY_LOCK(cs_headercheckqueue, lockQueue);
+    if (!lockQueue)
+        return;
+    vHashPoW.assign(headers.size(), uint256());
+
+    std::vector<CHeaderPoWCheck> vChecks;
+    vChecks.reserve(headers.size());
+    {
+        LOCK(cs_main);
+        for (unsigned int n = 0; n < headers.size(); n++) {
+            if (!mapBlockIndex.count(headers[n].GetHash()))
+                vChecks.push_back(CHeaderPoWCheck(headers[n], vHashPoW[n]));
+        }
+    }
+
+    CCheckQueueControl<CHeaderPoWCheck> control(&headercheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams)
+{
+    // BIP16 didn't become active until Oct 1 2012
+    int64_t nBIP16SwitchTime = 1349049600;
+    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rules, for version 3 blocks,
+    // when 75% of the network has upgraded:
+    if (pindex->nVersion >= 3 && IsSuperMajority(3, pindex->pprev, consensusparams.nMajorityEnforceBlockUpgrade, consensusparams)) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for version 4
+    // blocks, when 75% of the network has upgraded:
+    if (pindex->nVersion >= 4 && IsSuperMajority(4, pindex->pprev, consensusparams.nMajorityEnforceBlockUpgrade, consensusparams)) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindex->pprev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    // Start enforcing WITNESS rules using versionbits logic.
+    if (IsWitnessEnabled(pindex->pprev, consensusparams)) {
+        flags |= SCRIPT_VERIFY_WITNESS;
+        flags |= SCRIPT_VERIFY_NULLDUMMY;
+    }
+
+    return flags;
+}
+
 int32_t ComputeBlockVersion(const CBlockIndex* pindexPrev, const Consensus::Params& params)
 {
     LOCK(cs_main);
@@ -2514,20 +3419,84 @@ public:
 // Protected by cs_main
 static ThresholdConditionCache warningcache[VERSIONBITS_NUM_BITS];
 
-static int64_t nTimeCheck = 0;
-static int64_t nTimeForks = 0;
 static int64_t nTimeVerify = 0;
-static int64_t nTimeConnect = 0;
-static int64_t nTimeIndex = 0;
-static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
+// Guarded by cs_main
+static CBlockConnectStats connectStats;
+// The last BLOCK_LATENCY_HISTORY blocks connected by ConnectTip, guarded by cs_main
+static std::deque<CBlockLatency> vBlockLatency;
+static int64_t nLastBenchSummary = 0;
+
+/** Seconds between the summaries of the validation counters logged with -debug=bench */
+static const int64_t BENCH_SUMMARY_INTERVAL = 60;
+
+static void ThreadStatsToLog(const char* pszName, const CCheckQueueStats& stats)
+{
+    int64_t nBusyTotal = 0;
+    for (unsigned int i = 0; i < stats.vThreads.size(); i++)
+        nBusyTotal += stats.vThreads[i].nBusyMicros;
+    std::string strThreads;
+    for (unsigned int i = 0; i < stats.vThreads.size(); i++)
+        strThreads += strprintf(" %.0f%%", nBusyTotal ? 100.0 * stats.vThreads[i].nBusyMicros / nBusyTotal : 0.0);
+    LogPrint("bench", "  %s: %u checks, at most %u queued, busy share of master and workers:%s\n",
+        pszName, stats.nAdded, stats.nMaxQueued, strThreads);
+}
+
+/** Log the validation counters since startup, see getvalidationstats */
+static void LogValidationSummary()
+{
+    AssertLockHeld(cs_main);
+    const CBlockConnectTimes& total = connectStats.total;
+    double nBlocks = std::max<uint64_t>(1, connectStats.nBlocks + connectStats.nBlocksChecked);
+    LogPrint("bench", "Validation summary: %u blocks, %u inputs, average ms per block: check %.2f, forks %.2f, inputs %.2f, scripts %.2f, undo %.2f, index %.2f, callbacks %.2f\n",
+        connectStats.nBlocks, connectStats.nInputs, 0.001 * total.nCheck / nBlocks, 0.001 * total.nForks / nBlocks,
+        0.001 * total.nInputs / nBlocks, 0.001 * total.nScripts / nBlocks, 0.001 * total.nUndo / nBlocks,
+        0.001 * total.nIndex / nBlocks, 0.001 * total.nCallbacks / nBlocks);
+    CSignatureCacheStats sigcache = GetSignatureCacheStats();
+    LogPrint("bench", "  signature cache: %u lookups, %.1f%% hits; script execution cache: %u lookups, %.1f%% hits\n",
+        sigcache.nLookups, sigcache.nLookups ? 100.0 * sigcache.nHits / sigcache.nLookups : 0.0,
+        scriptExecutionCacheStats.nLookups, scriptExecutionCacheStats.nLookups ? 100.0 * scriptExecutionCacheStats.nHits / scriptExecutionCacheStats.nLookups : 0.0);
+    CCheckQueueStats queueStats;
+    GetScriptCheckQueueStats(queueStats, false);
+    ThreadStatsToLog("script checks", queueStats);
+    GetScriptCheckQueueStats(queueStats, true);
+    ThreadStatsToLog("mempool script checks", queueStats);
+}
+
+CScriptExecutionCacheStats GetScriptExecutionCacheStats()
+{
+    LOCK(cs_main);
+    CScriptExecutionCacheStats stats = scriptExecutionCacheStats;
+    stats.nMemoryUsage = scriptExecutionCache.memory_usage();
+    return stats;
+}
+
+CBlockConnectStats GetBlockConnectStats()
+{
+    LOCK(cs_main);
+    return connectStats;
+}
+
+std::vector<CBlockLatency> GetBlockLatencyHistory()
+{
+    LOCK(cs_main);
+    return std::vector<CBlockLatency>(vBlockLatency.begin(), vBlockLatency.end());
+}
+
+void GetScriptCheckQueueStats(CCheckQueueStats& stats, bool fMempool)
+{
+    (fMempool ? mempoolcheckqueue : scriptcheckqueue).GetStats(stats);
+}
 
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck, CBlockUndo* pblockundo)
 {
     AssertLockHeld(cs_main);
 
     int64_t nTimeStart = GetTimeMicros();
+    CBlockConnectTimes& total = connectStats.total;
+    CBlockConnectTimes times;
+    TRACE4(validation, block_connect_start, block.GetHash().begin(), pindex->nHeight, block.vtx.size(), fJustCheck);
 
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck))
@@ -2545,7 +3514,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return true;
     }
 
-    bool fScriptChecks = true;
+    // A follower applies what its leader has validated
+    bool fScriptChecks = !fFollowLeader;
     if (fCheckpointsEnabled) {
         CBlockIndex *pindexLastCheckpoint = Checkpoints::GetLastCheckpoint(chainparams.Checkpoints());
         if (pindexLastCheckpoint && pindexLastCheckpoint->GetAncestor(pindex->nHeight) == pindex) {
@@ -2553,9 +3523,27 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             fScriptChecks = false;
         }
     }
+    if (fScriptChecks && !hashAssumeValid.IsNull() && pindexBestHeader) {
+        // We were given the hash of a block whose history was verified elsewhere. Its ancestors
+        // still get every check but the scripts: the Ethash PoW of their headers, amounts and
+        // the coins they spend.
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it != mapBlockIndex.end()) {
+            const Consensus::Params& consensusParams = chainparams.GetConsensus();
+            if (it->second->GetAncestor(pindex->nHeight) == pindex &&
+                pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
+                pindexBestHeader->nChainWork >= UintToArith256(consensusParams.nMinimumChainWork)) {
+                // Only blocks buried under two weeks' worth of work on top of them: hash power can
+                // not get an invalid block accepted by telling users to set -assumevalid to it, it
+                // has to bury it first. The minimum chain work keeps the scripts checked while we
+                // only see chains worse than the one expected.
+                fScriptChecks = (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) <= 60 * 60 * 24 * 7 * 2);
+            }
+        }
+    }
 
-    int64_t nTime1 = GetTimeMicros(); nTimeCheck += nTime1 - nTimeStart;
-    LogPrint("bench", "    - Sanity checks: %.2fms [%.2fs]\n", 0.001 * (nTime1 - nTimeStart), nTimeCheck * 0.000001);
+    int64_t nTime1 = GetTimeMicros(); times.nCheck = nTime1 - nTimeStart; total.nCheck += times.nCheck;
+    LogPrint("bench", "    - Sanity checks: %.2fms [%.2fs]\n", 0.001 * (nTime1 - nTimeStart), total.nCheck * 0.000001);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2585,47 +3573,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     fEnforceBIP30 = fEnforceBIP30 && (!pindexBIP34height || !(pindexBIP34height->GetBlockHash() == chainparams.GetConsensus().BIP34Hash));
 
     if (fEnforceBIP30) {
-        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+            const CCoins* coins = view.AccessCoins(tx->GetHash());
             if (coins && !coins->IsPruned())
                 return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
                                  REJECT_INVALID, "bad-txns-BIP30");
         }
     }
 
-    // BIP16 didn't become active until Oct 1 2012
-    int64_t nBIP16SwitchTime = 1349049600;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
-    // when 75% of the network has upgraded:
-    if (block.nVersion >= 3 && IsSuperMajority(3, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
-    // blocks, when 75% of the network has upgraded:
-    if (block.nVersion >= 4 && IsSuperMajority(4, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
+    unsigned int flags = GetBlockScriptFlags(pindex, chainparams.GetConsensus());
 
-    // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    // Start enforcing BIP68 (sequence locks) using versionbits logic.
     int nLockTimeFlags = 0;
     if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
-    // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_WITNESS;
-        flags |= SCRIPT_VERIFY_NULLDUMMY;
-    }
-
-    int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
-    LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
+    int64_t nTime2 = GetTimeMicros(); times.nForks = nTime2 - nTime1; total.nForks += times.nForks;
+    LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), total.nForks * 0.000001);
 
     CBlockUndo blockundo;
 
@@ -2643,12 +3608,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    boost::scoped_ptr<CBlockIndexAddresses> outputAddresses;
+    if (fAddressIndex)
+        outputAddresses.reset(new CBlockIndexAddresses(block.vtx));
 
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         const uint256 txhash = tx.GetHash();
 
         nInputs += tx.vin.size();
@@ -2668,13 +3636,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             }
 
             // Which orphan pool entries must we evict?
-            for (size_t j = 0; j < tx.vin.size(); j++) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
-                if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-                for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    vOrphanErase.push_back(orphanHash);
+            {
+                LOCK(cs_orphans);
+                for (size_t j = 0; j < tx.vin.size(); j++) {
+                    auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
+                    if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
+                    for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+                        const CTransaction& orphanTx = *(*mi)->second.tx;
+                        const uint256& orphanHash = orphanTx.GetHash();
+                        vOrphanErase.push_back(orphanHash);
+                    }
                 }
             }
 
@@ -2689,32 +3660,20 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
                     const CTxIn input = tx.vin[j];
                     const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    uint160 hashBytes;
-                    int addressType;
-
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-                        addressType = 2;
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-                        addressType = 1;
-                    } else {
-                        hashBytes.SetNull();
-                        addressType = 0;
-                    }
+                    const CIndexAddress address = GetIndexAddress(prevout.scriptPubKey);
 
-                    if (fAddressIndex && addressType > 0) {
+                    if (fAddressIndex && address.type > 0) {
                         // record spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
-                    
+                        addressIndex.push_back(make_pair(CAddressIndexKey(address.type, address.hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
+
                         // remove address from unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
+                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(address.type, address.hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
                     }
 
                     if (fSpentIndex) {
                         // add the spent index to determine the txid and input that spent an output
                         // and to find the amount and address from an input
-                        spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
+                        spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, address.type, address.hashBytes)));
                     }
 
                 }
@@ -2737,7 +3696,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2746,31 +3705,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (fAddressIndex) {
             for (unsigned int k = 0; k < tx.vout.size(); k++) {
                 const CTxOut &out = tx.vout[k];
+                const CIndexAddress& address = outputAddresses->Output(i, k);
+                if (address.type == 0)
+                    continue;
 
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+                // record receiving activity
+                addressIndex.push_back(make_pair(CAddressIndexKey(address.type, address.hashBytes, pindex->nHeight, i, txhash, k, false), out.nValue));
 
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else {
-                    continue;
-                }
-
-            }
-        }
+                // record unspent output
+                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(address.type, address.hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
 
         CTxUndo undoDummy;
         if (i > 0) {
@@ -2781,33 +3726,40 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
-    int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
-    LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
+    int64_t nTime3 = GetTimeMicros(); times.nInputs = nTime3 - nTime2; total.nInputs += times.nInputs;
+    LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), total.nInputs * 0.000001);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, pindex->pprev->nNonce, chainparams.GetConsensus());
-    if (block.vtx[0].GetValueOut() > blockReward)
+    if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
-                               block.vtx[0].GetValueOut(), blockReward),
+                               block.vtx[0]->GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
     // For MIL also add the protocol rule that the first output in the coinbase must go to the charity address and have at least 20% of the subsidy (as per integer arithmetic)
 
-    if (block.vtx[0].vout[0].scriptPubKey != CHARITY_SCRIPT) {
+    if (block.vtx[0]->vout[0].scriptPubKey != CHARITY_SCRIPT) {
         return state.DoS(100, error("ConnectBlock() : coinbase does not pay to the charity in the first output)"));
     }
     int64_t charityAmount = GetBlockSubsidy(pindex->nHeight, pindex->pprev->nNonce, chainparams.GetConsensus()) * 20 / 100;
-    if (block.vtx[0].vout[0].nValue < charityAmount)
+    if (block.vtx[0]->vout[0].nValue < charityAmount)
        return state.DoS(100, error("ConnectBlock() : coinbase does not pay enough to the charity"));
 
 
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
+    times.nScripts = nTime4 - nTime3; total.nScripts += times.nScripts;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
 
-    if (fJustCheck)
+    if (fJustCheck) {
+        connectStats.nBlocksChecked++;
         return true;
+    }
+
+    // Before the writer takes its contents
+    if (pblockundo)
+        *pblockundo = blockundo;
 
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS))
@@ -2816,7 +3768,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             CDiskBlockPos pos;
             if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
                 return error("ConnectBlock(): FindUndoPos failed");
-            if (!UndoWriteToDisk(blockundo, pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
+            if (!blockStoreWriter.WriteUndo(pos, blockundo, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
                 return AbortNode(state, "Failed to write undo data");
 
             // update nUndoPos in block index
@@ -2828,59 +3780,54 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return AbortNode(state, "Failed to write transaction index");
-
-    if(fAddressIndex){
-        if (!pblocktree->WriteAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to write address index");
-        }
+    int64_t nTimeUndo = GetTimeMicros(); times.nUndo = nTimeUndo - nTime4; total.nUndo += times.nUndo;
+    LogPrint("bench", "    - Undo writing: %.2fms [%.2fs]\n", 0.001 * times.nUndo, total.nUndo * 0.000001);
 
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
+    // CheckBlock above verified the PoW, later disk reads can skip it
+    if (!(pindex->nStatus & BLOCK_POW_VERIFIED)) {
+        pindex->nStatus |= BLOCK_POW_VERIFIED;
+        setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fSpentIndex)
-        if (!pblocktree->UpdateSpentIndex(spentIndex))
-            return AbortNode(state, "Failed to write transaction index");
-
-
-    if(fTimestampIndex) {
-        unsigned int logicalTS = pindex->nTime;
-        unsigned int prevLogicalTS = 0;
-
-        //retrieve logical timestamp of previous block
+    if (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex || fBlockFilterIndex) {
+        // Written to the index databases by the index writer, in the order blocks are connected
+        boost::shared_ptr<CIndexUpdate> update(new CIndexUpdate());
+        update->pindex = pindex;
+        update->hashBlock = pindex->GetBlockHash();
         if (pindex->pprev)
-            if(!pblocktree->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
-                LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
-        
-        if (logicalTS <= prevLogicalTS) {
-            logicalTS = prevLogicalTS + 1;
-            LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
+            update->hashPrevBlock = pindex->pprev->GetBlockHash();
+        update->nTime = pindex->nTime;
+        if (fTxIndex)
+            update->txIndex.swap(vPos);
+        if (fAddressIndex) {
+            update->addressIndex.swap(addressIndex);
+            update->addressUnspentIndex.swap(addressUnspentIndex);
         }
-
-        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
-            return AbortNode(state, "Failed to write timestamp index");
-        
-        if (!pblocktree->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
-            return AbortNode(state, "Failed to write blockhash index");
+        if (fSpentIndex)
+            update->spentIndex.swap(spentIndex);
+        update->fTimestamp = fTimestampIndex;
+        // The filter is hashed and encoded by the index writer, once per block however many peers fetch it
+        if (fBlockFilterIndex) {
+            update->fBlockFilter = true;
+            update->blockFilterElements = BasicFilterElements(block, blockundo);
+        }
+        GetMainSignals().UpdatedIndexes(update);
     }
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
-    int64_t nTime5 = GetTimeMicros(); nTimeIndex += nTime5 - nTime4;
-    LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime5 - nTime4), nTimeIndex * 0.000001);
+    int64_t nTime5 = GetTimeMicros(); times.nIndex = nTime5 - nTimeUndo; total.nIndex += times.nIndex;
+    LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime5 - nTimeUndo), total.nIndex * 0.000001);
 
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     // Erase orphan transactions include or precluded by this block
     if (vOrphanErase.size()) {
+        LOCK(cs_orphans);
         int nErased = 0;
         BOOST_FOREACH(uint256 &orphanHash, vOrphanErase) {
             nErased += EraseOrphanTx(orphanHash);
@@ -2888,8 +3835,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         LogPrint("mempool", "Erased %d orphan tx included or conflicted by block\n", nErased);
     }
 
-    int64_t nTime6 = GetTimeMicros(); nTimeCallbacks += nTime6 - nTime5;
-    LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime6 - nTime5), nTimeCallbacks * 0.000001);
+    int64_t nTime6 = GetTimeMicros(); times.nCallbacks = nTime6 - nTime5; total.nCallbacks += times.nCallbacks;
+    LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime6 - nTime5), total.nCallbacks * 0.000001);
+
+    connectStats.nBlocks++;
+    connectStats.nInputs += nInputs - 1;
+    connectStats.last = times;
+    connectStats.nLastHeight = pindex->nHeight;
+    if (LogAcceptCategory("bench") && nTime6 - nLastBenchSummary >= BENCH_SUMMARY_INTERVAL * 1000000) {
+        nLastBenchSummary = nTime6;
+        LogValidationSummary();
+    }
+    TRACE5(validation, block_connected, block.GetHash().begin(), pindex->nHeight, block.vtx.size(), nInputs - 1, nTime6 - nTimeStart);
 
     return true;
 }
@@ -2901,13 +3858,15 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+static void FindFilesToPruneManual(std::set<int>& setFilesToPrune, int nManualPruneHeight);
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
  * if they're too large, if it's been a while since the last write,
  * or always and in all cases if we're in prune mode and are deleting files.
  */
-bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
+bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode, int nManualPruneHeight = 0) {
     const CChainParams& chainparams = Params();
     LOCK2(cs_main, cs_LastBlockFile);
     static int64_t nLastWrite = 0;
@@ -2916,9 +3875,13 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     std::set<int> setFilesToPrune;
     bool fFlushForPrune = false;
     try {
-    if (fPruneMode && fCheckForPruning && !fReindex) {
-        FindFilesToPrune(setFilesToPrune, chainparams.PruneAfterHeight());
-        fCheckForPruning = false;
+    if (fPruneMode && (fCheckForPruning || nManualPruneHeight > 0) && !fReindex) {
+        if (nManualPruneHeight > 0) {
+            FindFilesToPruneManual(setFilesToPrune, nManualPruneHeight);
+        } else {
+            FindFilesToPrune(setFilesToPrune, chainparams.PruneAfterHeight());
+            fCheckForPruning = false;
+        }
         if (!setFilesToPrune.empty()) {
             fFlushForPrune = true;
             if (!fHavePruned) {
@@ -2947,8 +3910,10 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
     bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
+    // The node is over -maxmemory, and the coins cache is what can give memory back the soonest.
+    bool fMemoryCritical = (mode == FLUSH_STATE_IF_NEEDED || mode == FLUSH_STATE_PERIODIC) && fMemoryPressure;
     // Combine all conditions that result in a full cache flush.
-    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
+    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune || fMemoryCritical;
     // Write blocks and block index to disk.
     if (fDoFullFlush || fPeriodicWrite) {
         // Depend on nMinDiskSpace to ensure we can write block index
@@ -2956,6 +3921,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
             return state.Error("out of disk space");
         // First make sure all block and undo data is flushed to disk.
         FlushBlockFile();
+        if (!blockStoreWriter.Sync())
+            return AbortNode(state, "Failed to write block or undo data");
         // Then update all block file information (which may refer to block and undo files).
         {
             std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
@@ -2988,16 +3955,30 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
+        // The indexes are written first, so they are never behind the chainstate on disk.
+        if (!FlushIndexWriter())
+            return AbortNode(state, "Failed to write to index database");
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // Written apart from the coins, the statistics are checked against the best block on load
+        if (utxoStats.hashBlock == pcoinsTip->GetBestBlock() && !pcoinswriter->WriteUTXOStats(utxoStats))
+            return AbortNode(state, "Failed to write to coin database");
+        // The coins are written in the background, unless the caller needs them on disk or
+        // the block files they may refer to are about to be pruned
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinswriter && !pcoinswriter->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
+        fMemoryPressure = false;
+        if (LogAcceptCategory("leveldb"))
+            LogDBStats();
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
         // Update best block in wallet (so we can detect restored wallets).
         GetMainSignals().SetBestChain(chainActive.GetLocator());
         nLastSetChain = nNow;
     }
+    TRACE5(validation, flush_state, mode, fDoFullFlush, fPeriodicWrite, cacheSize, GetTimeMicros() - nNow);
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error while flushing: ") + e.what());
     }
@@ -3018,6 +3999,10 @@ void PruneAndFlush() {
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     chainActive.SetTip(pindexNew);
+    PublishChainTip();
+    if (fTimestampIndex)
+        timestampRangeIndex.SetTip(pindexNew);
+    EthashAux::setChainHeight(pindexNew->nHeight);
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -3077,21 +4062,134 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
 
 }
 
-/** Disconnect chainActive's tip. You probably want to call mempool.removeForReorg and manually re-limit mempool size after this, with cs_main held. */
-bool static DisconnectTip(CValidationState& state, const CChainParams& chainparams, bool fBare = false)
+/**
+ * Put the transactions of the blocks disconnected in a reorg back into the
+ * mempool, or only drop their descendants from it if fAddToMempool is false,
+ * then bring the mempool in line with the new tip. The descendant state of
+ * the transactions that went back is fixed in one pass at the end.
+ */
+static void UpdateMempoolForReorg(DisconnectedBlockTransactions& disconnectpool, bool fAddToMempool)
+{
+    AssertLockHeld(cs_main);
+    std::vector<uint256> vHashUpdate;
+    BOOST_FOREACH(const CTransactionRef& ptx, disconnectpool.GetQueuedTx()) {
+        // ignore validation errors in resurrected transactions
+        list<CTransaction> removed;
+        CValidationState stateDummy;
+        if (!fAddToMempool || ptx->IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, *ptx, false, NULL, true)) {
+            mempool.removeRecursive(*ptx, removed);
+        } else if (mempool.exists(ptx->GetHash())) {
+            vHashUpdate.push_back(ptx->GetHash());
+        }
+    }
+    disconnectpool.clear();
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in the
+    // disconnected blocks that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+
+    mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+}
+
+/** Whether utxoStats are current for view, which is about to change, and should follow it */
+static bool FollowUTXOStats(const CCoinsViewCache& view)
+{
+    return utxoStats.hashBlock == view.GetBestBlock() && GetBoolArg("-utxostats", DEFAULT_UTXO_STATS);
+}
+
+/**
+ * The entries of the txids that connecting (fConnect) or disconnecting block changes in
+ * view, as they are before: those of its transactions and of the outputs they spend. The
+ * transactions of a block being connected have no entries yet, so they are not read.
+ */
+static void GetUTXOStatsCoins(const CBlock& block, const CCoinsViewCache& view, bool fConnect, std::vector<std::pair<uint256, CCoins> >& vCoins)
+{
+    std::set<uint256> setSeen;
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+        if (setSeen.insert(tx->GetHash()).second)
+            vCoins.push_back(std::make_pair(tx->GetHash(), CCoins()));
+    if (!fConnect) {
+        for (size_t i = 0; i < vCoins.size(); i++) {
+            const CCoins* coins = view.AccessCoins(vCoins[i].first);
+            if (coins)
+                vCoins[i].second = *coins;
+        }
+    }
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+        if (tx->IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx->vin) {
+            if (!setSeen.insert(txin.prevout.hash).second)
+                continue;
+            vCoins.push_back(std::make_pair(txin.prevout.hash, CCoins()));
+            const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+            if (coins)
+                vCoins.back().second = *coins;
+        }
+    }
+}
+
+/** Follow the entries of vCoins to what they are in view, now at hashBlock */
+static void UpdateUTXOStats(const CCoinsViewCache& view, const std::vector<std::pair<uint256, CCoins> >& vCoins, const uint256& hashBlock)
+{
+    int64_t nStart = GetTimeMicros();
+    const CCoins coinsPruned;
+    for (size_t i = 0; i < vCoins.size(); i++) {
+        const CCoins* coins = view.AccessCoins(vCoins[i].first);
+        utxoStats.Update(vCoins[i].first, vCoins[i].second, coins ? *coins : coinsPruned);
+    }
+    utxoStats.hashBlock = hashBlock;
+    LogPrint("bench", "    - UTXO set statistics: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+}
+
+bool GetTipUTXOStats(CUTXOStats& stats)
+{
+    AssertLockHeld(cs_main);
+    if (utxoStats.hashBlock != pcoinsTip->GetBestBlock())
+        return false;
+    stats = utxoStats;
+    return true;
+}
+
+void SetTipUTXOStats(const CUTXOStats& stats)
+{
+    AssertLockHeld(cs_main);
+    assert(stats.hashBlock == pcoinsTip->GetBestBlock());
+    utxoStats = stats;
+}
+
+/**
+ * Disconnect chainActive's tip. Its transactions are added to disconnectpool,
+ * if not NULL, for UpdateMempoolForReorg to put back into the mempool once
+ * the reorg is done, with cs_main still held.
+ */
+bool static DisconnectTip(CValidationState& state, const CChainParams& chainparams, DisconnectedBlockTransactions* disconnectpool)
 {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete, chainparams.GetConsensus()))
+    // Take the block and its undo data from memory if it was connected lately, or read it from disk.
+    CBlock blockRead;
+    boost::shared_ptr<const CBlock> pblockRecent;
+    boost::shared_ptr<const CBlockUndo> pblockundoRecent;
+    if (!recentBlockUndo.Take(pindexDelete->GetBlockHash(), pblockRecent, pblockundoRecent) &&
+        !ReadBlockFromDisk(blockRead, pindexDelete, chainparams.GetConsensus()))
         return AbortNode(state, "Failed to read block");
+    const CBlock& block = pblockRecent ? *pblockRecent : blockRead;
     // Apply the block atomically to the chain state.
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        bool fStats = FollowUTXOStats(view);
+        std::vector<std::pair<uint256, CCoins> > vStatsCoins;
+        if (fStats)
+            GetUTXOStatsCoins(block, view, false, vStatsCoins);
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, pblockundoRecent.get()))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+        if (fStats)
+            UpdateUTXOStats(view, vStatsCoins, pindexDelete->pprev->GetBlockHash());
         assert(view.Flush());
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -3099,75 +4197,199 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
 
-    if (!fBare) {
-        // Resurrect mempool transactions from the disconnected block.
-        std::vector<uint256> vHashUpdate;
-        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-            // ignore validation errors in resurrected transactions
+    if (disconnectpool) {
+        disconnectpool->addForBlock(block.vtx);
+        // Past the size limit, the transactions of the first blocks
+        // disconnected are dropped, along with their mempool descendants
+        while (disconnectpool->DynamicMemoryUsage() > MAX_DISCONNECTED_TX_POOL_SIZE) {
             list<CTransaction> removed;
-            CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
-                mempool.removeRecursive(tx, removed);
-            } else if (mempool.exists(tx.GetHash())) {
-                vHashUpdate.push_back(tx.GetHash());
-            }
+            mempool.removeRecursive(*disconnectpool->popLast(), removed);
         }
-        // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
-        // no in-mempool children, which is generally not true when adding
-        // previously-confirmed transactions back to the mempool.
-        // UpdateTransactionsFromBlock finds descendants of any transactions in this
-        // block that were added back and cleans up the mempool state.
-        mempool.UpdateTransactionsFromBlock(vHashUpdate);
     }
 
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev, chainparams);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx, pindexDelete->pprev, NULL);
-    }
+    SyncBlockWithWallets(block.vtx, pindexDelete->pprev, NULL);
     return true;
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
+/** Load the outputs a block spends into pcoinsTip, reading the ones not cached on nPrefetchThreads threads at once */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    std::set<uint256> setCreated;
+    for (const CTransactionRef& tx : block.vtx)
+        setCreated.insert(tx->GetHash());
+    std::vector<uint256> vSpent;
+    for (const CTransactionRef& tx : block.vtx) {
+        if (tx->IsCoinBase())
+            continue;
+        for (const CTxIn& txin : tx->vin) {
+            if (!setCreated.count(txin.prevout.hash))
+                vSpent.push_back(txin.prevout.hash);
+        }
+    }
+    pcoinsTip->Prefetch(vSpent, nPrefetchThreads);
+}
+
+/** Transactions that entered our mempool less than this many seconds before their block may not have reached peers yet */
+static const int64_t CMPCTBLOCK_PREFILL_RECENT_SECONDS = 5;
+/** Most bytes of transactions prefilled in a compact block on a prediction, besides the coinbase */
+static const unsigned int MAX_CMPCTBLOCK_PREFILL_SIZE = 10000;
+/** Most blocks whose hints are kept in recentCompactBlockHints */
+static const unsigned int MAX_CMPCTBLOCK_HINT_BLOCKS = 4;
+
+/** What our mempool knew about the transactions of a block just before the block was connected */
+struct CCompactBlockHints
+{
+    struct TxHint {
+        uint256 hash;
+        unsigned int nSize;
+        //! Fee rate in satoshis per 1000 bytes, or -1 when the transaction was not in our mempool
+        CAmount nFeeRate;
+        //! Entered our mempool less than CMPCTBLOCK_PREFILL_RECENT_SECONDS before the block
+        bool fRecent;
+
+        TxHint() : nSize(0), nFeeRate(-1), fRecent(false) {}
+    };
+
+    //! Indexed like the transactions of the block; the coinbase is always prefilled
+    std::vector<TxHint> vTx;
+};
+
+/** The hints of the last blocks connected, the most recent first */
+class CRecentCompactBlockHints
+{
+private:
+    CCriticalSection cs;
+    std::list<std::pair<uint256, std::shared_ptr<const CCompactBlockHints> > > listHints;
+
+public:
+    std::shared_ptr<const CCompactBlockHints> Get(const uint256& hash)
+    {
+        LOCK(cs);
+        for (std::list<std::pair<uint256, std::shared_ptr<const CCompactBlockHints> > >::iterator it = listHints.begin(); it != listHints.end(); ++it)
+            if (it->first == hash)
+                return it->second;
+        return std::shared_ptr<const CCompactBlockHints>();
+    }
+
+    void Add(const uint256& hash, const std::shared_ptr<const CCompactBlockHints>& hints)
+    {
+        LOCK(cs);
+        listHints.push_front(std::make_pair(hash, hints));
+        if (listHints.size() > MAX_CMPCTBLOCK_HINT_BLOCKS)
+            listHints.pop_back();
+    }
+};
+static CRecentCompactBlockHints recentCompactBlockHints;
+
+/** Remember what the mempool knows about the transactions of block, before they leave it */
+static void RecordCompactBlockHints(const CBlock& block, const uint256& hash)
+{
+    std::shared_ptr<CCompactBlockHints> hints = std::make_shared<CCompactBlockHints>();
+    hints->vTx.resize(block.vtx.size());
+    int64_t nNow = GetTime();
+    {
+        LOCK(mempool.cs);
+        for (size_t i = 1; i < block.vtx.size(); i++) {
+            const CTransaction& tx = *block.vtx[i];
+            CCompactBlockHints::TxHint& hint = hints->vTx[i];
+            hint.hash = tx.GetHash();
+            hint.nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            TxMempoolInfo info = mempool.info(hint.hash);
+            if (info.tx) {
+                hint.nFeeRate = info.feeRate.GetFeePerK();
+                hint.fRecent = nNow - info.nTime < CMPCTBLOCK_PREFILL_RECENT_SECONDS;
+            }
+        }
+    }
+    recentCompactBlockHints.Add(hash, hints);
+}
+
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
  */
-bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const CBlock* pblock)
+bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const CBlock* pblock, DisconnectedBlockTransactions& disconnectpool)
 {
     assert(pindexNew->pprev == chainActive.Tip());
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    boost::shared_ptr<const CBlock> pblockAhead;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
-            return AbortNode(state, "Failed to read block");
-        pblock = &block;
+        pblockAhead = blockReadAhead.Take(pindexNew);
+        if (pblockAhead) {
+            pblock = pblockAhead.get();
+        } else {
+            if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
+                return AbortNode(state, "Failed to read block");
+            pblock = &block;
+        }
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    CBlockLatency latency;
+    latency.nRead = nTime2 - nTime1;
+    latency.nPoW = pblock->nPoWCheckMicros;
+    // Misses of ConnectBlock would each wait for a read of their own
+    if (nPrefetchThreads > 0) {
+        PrefetchBlockInputs(*pblock);
+        int64_t nTimePrefetched = GetTimeMicros(); nTimePrefetch += nTimePrefetched - nTime2;
+        LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTimePrefetched - nTime2) * 0.001, nTimePrefetch * 0.000001);
+        latency.nPrefetch = nTimePrefetched - nTime2;
+        nTime2 = nTimePrefetched;
+    }
+    // A parallel reindex indexed this block without its chain context
+    if (pindexNew->nStatus & BLOCK_UNCHECKED_CONTEXT) {
+        if (!ContextualCheckBlock(*pblock, state, pindexNew->pprev)) {
+            if (state.IsInvalid())
+                InvalidBlockFound(pindexNew, state);
+            return error("ConnectTip(): ContextualCheckBlock %s failed: %s", pindexNew->GetBlockHash().ToString(), FormatStateMessage(state));
+        }
+        pindexNew->nStatus &= ~BLOCK_UNCHECKED_CONTEXT;
+        setDirtyBlockIndex.insert(pindexNew);
+    }
     {
         CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
+        bool fStats = FollowUTXOStats(view);
+        std::vector<std::pair<uint256, CCoins> > vStatsCoins;
+        if (fStats)
+            GetUTXOStatsCoins(*pblock, view, true, vStatsCoins);
+        int64_t nTimeConnect = GetTimeMicros();
+        // Kept for a reorg that disconnects the block again soon, not while catching up
+        boost::shared_ptr<CBlockUndo> pblockundo;
+        if (recentBlockUndo.GetMaxBlocks() > 0 && !IsInitialBlockDownload())
+            pblockundo.reset(new CBlockUndo());
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams, false, pblockundo.get());
+        int64_t nTimeConnected = GetTimeMicros();
         GetMainSignals().BlockChecked(*pblock, state);
+        latency.nConnect = nTimeConnected - nTimeConnect;
+        latency.nCallbacks = GetTimeMicros() - nTimeConnected;
         if (!rv) {
             if (state.IsInvalid())
                 InvalidBlockFound(pindexNew, state);
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(pindexNew->GetBlockHash());
+        if (fStats)
+            UpdateUTXOStats(view, vStatsCoins, pindexNew->GetBlockHash());
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
+        if (pblockundo)
+            recentBlockUndo.Add(pindexNew, pblockAhead ? pblockAhead : boost::shared_ptr<const CBlock>(new CBlock(*pblock)), pblockundo);
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
@@ -3176,24 +4398,53 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         return false;
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
+    latency.nFlush = nTime4 - nTime3;
+    latency.nChainState = nTime5 - nTime4;
+    // Remember which transactions peers may lack, before the mempool forgets them
+    if (!IsInitialBlockDownload())
+        RecordCompactBlockHints(*pblock, pindexNew->GetBlockHash());
+    // Mined transactions announced lately may still be asked for
+    if (!IsInitialBlockDownload()) {
+        std::vector<CTransactionRef> vtxMined;
+        for (const CTransactionRef& tx : pblock->vtx) {
+            if (mempool.exists(tx->GetHash()))
+                vtxMined.push_back(tx);
+        }
+        AddRelayRemoved(vtxMined);
+    }
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
+    disconnectpool.removeForBlock(pblock->vtx);
     // Update chainActive & related variables.
     UpdateTip(pindexNew, chainparams);
+    int64_t nTimeTip = GetTimeMicros();
+    latency.nTip = nTimeTip - nTime5;
     // Tell wallet about transactions that went from mempool
     // to conflicted:
-    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
-        SyncWithWallets(tx, pindexNew, NULL);
+    if (!txConflicted.empty()) {
+        std::vector<CTransactionRef> vtxConflicted;
+        BOOST_FOREACH(CTransaction& tx, txConflicted)
+            vtxConflicted.push_back(MakeTransactionRef(std::move(tx)));
+        SyncBlockWithWallets(vtxConflicted, pindexNew, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
-        SyncWithWallets(tx, pindexNew, pblock);
-    }
+    SyncBlockWithWallets(pblock->vtx, pindexNew, pblock);
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
     LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, nTimeTotal * 0.000001);
+
+    latency.nHeight = pindexNew->nHeight;
+    latency.hash = pindexNew->GetBlockHash();
+    latency.nTime = GetTime();
+    latency.nTx = pblock->vtx.size();
+    latency.connect = connectStats.last;
+    latency.nCallbacks += nTime6 - nTimeTip;
+    latency.nTotal = nTime6 - nTime1;
+    vBlockLatency.push_back(latency);
+    if (vBlockLatency.size() > BLOCK_LATENCY_HISTORY)
+        vBlockLatency.pop_front();
     return true;
 }
 
@@ -3280,8 +4531,12 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
 
     // Disconnect active blocks which are no longer in the best chain.
     bool fBlocksDisconnected = false;
+    DisconnectedBlockTransactions disconnectpool;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state, chainparams)) {
+        if (!DisconnectTip(state, chainparams, &disconnectpool)) {
+            // The mempool is left consistent with the tip, short of the
+            // transactions of the blocks disconnected
+            UpdateMempoolForReorg(disconnectpool, false);
             return false;
         }
         fBlocksDisconnected = true;
@@ -3304,9 +4559,15 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         }
         nHeight = nTargetHeight;
 
+        // The blocks after the first are read and checked while it is connected
+        std::vector<const CBlockIndex*> vpindexAhead(vpindexToConnect.rbegin(), vpindexToConnect.rend());
+        if (pblock && !vpindexAhead.empty() && vpindexAhead.back() == pindexMostWork)
+            vpindexAhead.pop_back();
+        blockReadAhead.Request(vpindexAhead);
+
         // Connect new blocks.
         BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
-            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
+            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, disconnectpool)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -3317,6 +4578,7 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
                     break;
                 } else {
                     // A system error occurred (disk space, database error, ...).
+                    UpdateMempoolForReorg(disconnectpool, false);
                     return false;
                 }
             } else {
@@ -3330,10 +4592,8 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         }
     }
 
-    if (fBlocksDisconnected) {
-        mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
-        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
-    }
+    if (fBlocksDisconnected)
+        UpdateMempoolForReorg(disconnectpool, true);
     mempool.check(pcoinsTip);
 
     // Callbacks/notifications for a new best chain.
@@ -3380,6 +4640,8 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
         if (ShutdownRequested()) {
             break;
         }
+        // Don't let queued subscribers fall ever further behind
+        LimitValidationInterfaceQueue();
 
         const CBlockIndex *pindexFork;
         bool fInitialDownload;
@@ -3441,7 +4703,7 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
                 }
                 // Notify external listeners about the new tip.
                 if (!vHashes.empty()) {
-                    GetMainSignals().UpdatedBlockTip(pindexNewTip);
+                    GetMainSignals().UpdatedBlockTip(pindexNewTip, pblock && pblock->GetHash() == pindexNewTip->GetBlockHash() ? pblock : NULL);
                 }
             }
         }
@@ -3465,6 +4727,7 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
+    DisconnectedBlockTransactions disconnectpool;
     while (chainActive.Contains(pindex)) {
         CBlockIndex *pindexWalk = chainActive.Tip();
         pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
@@ -3472,13 +4735,13 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
         setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state, chainparams)) {
-            mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+        if (!DisconnectTip(state, chainparams, &disconnectpool)) {
+            UpdateMempoolForReorg(disconnectpool, false);
             return false;
         }
     }
 
-    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    UpdateMempoolForReorg(disconnectpool, true);
 
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
     // add it again.
@@ -3491,7 +4754,6 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
     }
 
     InvalidChainFound(pindex);
-    mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
     uiInterface.NotifyBlockTip(IsInitialBlockDownload(), pindex->pprev);
     return true;
 }
@@ -3538,12 +4800,13 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
     }
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(CBlockIndex(block));
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
     pindexNew->nSequenceId = 0;
+    // LookupBlockIndex finds the entry with its header fields set
+    LOCK(cs_blockindex);
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
@@ -3564,9 +4827,9 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 }
 
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
-bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
+bool ReceivedBlockTransactions(unsigned int nTx, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
-    pindexNew->nTx = block.vtx.size();
+    pindexNew->nTx = nTx;
     pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
@@ -3612,6 +4875,140 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
     return true;
 }
 
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CUTXOSnapshotHeader& header, std::string& strError)
+{
+    // The whole file is checked before anything is written, without holding cs_main
+    if (!VerifyUTXOSnapshot(path, header, strError))
+        return false;
+    if (!hashExpected.IsNull() && header.hashSerialized != hashExpected) {
+        strError = strprintf("the snapshot hash %s is not the expected %s", header.hashSerialized.ToString(), hashExpected.ToString());
+        return false;
+    }
+
+    LOCK(cs_main);
+    CValidationState state;
+    if (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex) {
+        strError = "the optional indexes need the blocks below the snapshot, disable them to load one";
+        return false;
+    }
+    if (fPruneMode || fHavePruned) {
+        strError = "cannot load a snapshot into a pruned node";
+        return false;
+    }
+    if (chainActive.Height() != 0 || pcoinsTip->GetBestBlock() != chainActive.Genesis()->GetBlockHash()) {
+        strError = "only a node that has not connected any block past genesis can load a snapshot";
+        return false;
+    }
+    BlockMap::iterator mi = mapBlockIndex.find(header.hashBlock);
+    if (mi == mapBlockIndex.end()) {
+        strError = strprintf("the header of the snapshot block %s is not known yet, wait for the headers to be synced", header.hashBlock.ToString());
+        return false;
+    }
+    CBlockIndex* pindexBase = mi->second;
+    if (pindexBase->nHeight != header.nHeight || pindexBase->nHeight < 1 || (pindexBase->nStatus & BLOCK_FAILED_MASK) || !pindexBase->IsValid(BLOCK_VALID_TREE)) {
+        strError = strprintf("the snapshot block %s is not a valid block at height %d", header.hashBlock.ToString(), header.nHeight);
+        return false;
+    }
+    // Every block has its coinbase at least
+    if (header.nChainTx < chainActive.Genesis()->nChainTx + header.nHeight) {
+        strError = "the snapshot claims fewer transactions than blocks";
+        return false;
+    }
+
+    LogPrintf("%s: loading %u transactions at height %d from %s\n", __func__, header.nTransactions, header.nHeight, path.string());
+    // Until the coins are all written the chainstate on disk is neither the old nor the new one
+    if (!pblocktree->WriteFlag("utxosnapshotloading", true) || !pblocktree->Sync()) {
+        strError = "cannot write to the block index database";
+        return false;
+    }
+    CUTXOSnapshotReader reader(path);
+    if (!reader.Open(strError))
+        return false;
+    // The statistics of genesis must not be written along with the coins being loaded
+    bool fStats = GetBoolArg("-utxostats", DEFAULT_UTXO_STATS);
+    utxoStats.SetNull();
+    CUTXOStats statsLoaded;
+    try {
+        uint256 txid;
+        CCoins coins;
+        uint64_t nLoaded = 0;
+        while (reader.Next(txid, coins)) {
+            if (fStats)
+                statsLoaded.Add(txid, coins);
+            // Snapshot txids are unique and the chainstate of genesis is empty
+            pcoinsTip->ModifyNewCoins(txid, false)->swap(coins);
+            if (++nLoaded % 10000 == 0 && !FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED)) {
+                strError = "cannot write the coins: " + FormatStateMessage(state);
+                return false;
+            }
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("error reading %s: %s", path.string(), e.what());
+        return false;
+    }
+
+    // The blocks below the snapshot get the state of pruned ones: valid, processed once and
+    // gone. Their transaction counts are unknown, one each is a lower bound, and the snapshot
+    // block takes the rest so that its nChainTx is exact.
+    std::vector<CBlockIndex*> vPath;
+    for (CBlockIndex* pindex = pindexBase; pindex->pprev; pindex = pindex->pprev)
+        vPath.push_back(pindex);
+    std::reverse(vPath.begin(), vPath.end());
+    BOOST_FOREACH(CBlockIndex* pindex, vPath) {
+        if (pindex == pindexBase)
+            pindex->nTx = std::max<uint64_t>(1, header.nChainTx - pindex->pprev->nChainTx);
+        else if (pindex->nTx == 0)
+            pindex->nTx = 1;
+        pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+    }
+    chainActive.SetTip(pindexBase);
+    PublishChainTip();
+    pcoinsTip->SetBestBlock(pindexBase->GetBlockHash());
+    if (fStats) {
+        statsLoaded.hashBlock = pindexBase->GetBlockHash();
+        utxoStats = statsLoaded;
+    }
+    setBlockIndexCandidates.insert(pindexBase);
+
+    // Blocks already received above the path can now be linked, as in ReceivedBlockTransactions
+    deque<CBlockIndex*> queue(vPath.begin(), vPath.end());
+    while (!queue.empty()) {
+        CBlockIndex *pindex = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            CBlockIndex *pindexChild = it->second;
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+            if (chainActive.Contains(pindexChild))
+                continue;
+            pindexChild->nChainTx = pindex->nChainTx + pindexChild->nTx;
+            {
+                LOCK(cs_nBlockSequenceId);
+                pindexChild->nSequenceId = nBlockSequenceId++;
+            }
+            if (!setBlockIndexCandidates.value_comp()(pindexChild, chainActive.Tip()))
+                setBlockIndexCandidates.insert(pindexChild);
+            queue.push_back(pindexChild);
+        }
+    }
+    PruneBlockIndexCandidates();
+
+    fSnapshotChain = true;
+    fHavePruned = true;
+    nLocalServices = ServiceFlags(nLocalServices & ~NODE_NETWORK);
+    if (!pblocktree->WriteFlag("utxosnapshot", true) || !FlushStateToDisk(state, FLUSH_STATE_ALWAYS) ||
+        !pblocktree->WriteFlag("utxosnapshotloading", false) || !pblocktree->Sync()) {
+        strError = "cannot write the loaded chainstate: " + FormatStateMessage(state);
+        return false;
+    }
+    LogPrintf("%s: new tip %s height=%d, %u transactions\n", __func__, pindexBase->GetBlockHash().ToString(), pindexBase->nHeight, header.nTransactions);
+    return true;
+}
+
 bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
 {
     LOCK(cs_LastBlockFile);
@@ -3653,12 +5050,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
             if (fPruneMode)
                 fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
-                FILE *file = OpenBlockFile(pos);
-                if (file) {
-                    LogPrintf("Pre-allocating up to position 0x%x in blk%05u.dat\n", nNewChunks * BLOCKFILE_CHUNK_SIZE, pos.nFile);
-                    AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
-                    fclose(file);
-                }
+                LogPrintf("Pre-allocating up to position 0x%x in blk%05u.dat\n", nNewChunks * BLOCKFILE_CHUNK_SIZE, pos.nFile);
+                blockStoreWriter.Allocate(pos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos, false);
             }
             else
                 return state.Error("out of disk space");
@@ -3686,12 +5079,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
         if (fPruneMode)
             fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
-            FILE *file = OpenUndoFile(pos);
-            if (file) {
-                LogPrintf("Pre-allocating up to position 0x%x in rev%05u.dat\n", nNewChunks * UNDOFILE_CHUNK_SIZE, pos.nFile);
-                AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
-                fclose(file);
-            }
+            LogPrintf("Pre-allocating up to position 0x%x in rev%05u.dat\n", nNewChunks * UNDOFILE_CHUNK_SIZE, pos.nFile);
+            blockStoreWriter.Allocate(pos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos, true);
         }
         else
             return state.Error("out of disk space");
@@ -3700,11 +5089,17 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     return true;
 }
 
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, uint256* phashPoW)
 {
-    // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
-        return state.DoS(50, false, REJECT_INVALID, "high-hash", false, "proof of work failed");
+    // Check proof of work matches claimed amount. A follower does not compute
+    // the Ethash of its leader's headers, but still checks a hash sent along.
+    if (fCheckPOW && !(fFollowLeader && (!phashPoW || phashPoW->IsNull()))) {
+        uint256 hashPoW = (phashPoW && !phashPoW->IsNull()) ? *phashPoW : block.GetPoWHash();
+        if (phashPoW)
+            *phashPoW = hashPoW;
+        if (!CheckProofOfWork(hashPoW, block.nBits, consensusParams))
+            return state.DoS(50, false, REJECT_INVALID, "high-hash", false, "proof of work failed");
+    }
 
     return true;
 }
@@ -3719,8 +5114,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
 
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
+    int64_t nTimePoW = GetTimeMicros();
     if (!CheckBlockHeader(block, state, consensusParams, fCheckPOW))
         return false;
+    if (fCheckPOW)
+        block.nPoWCheckMicros = GetTimeMicros() - nTimePoW;
 
     // Check the merkle root.
     if (fCheckMerkleRoot) {
@@ -3747,22 +5145,22 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
         return state.DoS(100, false, REJECT_INVALID, "bad-blk-length", false, "size limits failed");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, false, REJECT_INVALID, "bad-cb-missing", false, "first tx is not coinbase");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, false, REJECT_INVALID, "bad-cb-multiple", false, "more than one coinbase");
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+        if (!CheckTransaction(*tx, state))
             return state.Invalid(false, state.GetRejectCode(), state.GetRejectReason(),
-                                 strprintf("Transaction check failed (tx hash %s) %s", tx.GetHash().ToString(), state.GetDebugMessage()));
+                                 strprintf("Transaction check failed (tx hash %s) %s", tx->GetHash().ToString(), state.GetDebugMessage()));
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
     {
-        nSigOps += GetLegacySigOpCount(tx);
+        nSigOps += GetLegacySigOpCount(*tx);
     }
     if (nSigOps * WITNESS_SCALE_FACTOR > MAX_BLOCK_SIGOPS_COST)
         return state.DoS(100, false, REJECT_INVALID, "bad-blk-sigops", false, "out-of-bounds SigOpCount");
@@ -3798,8 +5196,8 @@ bool IsWitnessEnabled(const CBlockIndex* pindexPrev, const Consensus::Params& pa
 static int GetWitnessCommitmentIndex(const CBlock& block)
 {
     int commitpos = -1;
-    for (size_t o = 0; o < block.vtx[0].vout.size(); o++) {
-        if (block.vtx[0].vout[o].scriptPubKey.size() >= 38 && block.vtx[0].vout[o].scriptPubKey[0] == OP_RETURN && block.vtx[0].vout[o].scriptPubKey[1] == 0x24 && block.vtx[0].vout[o].scriptPubKey[2] == 0xaa && block.vtx[0].vout[o].scriptPubKey[3] == 0x21 && block.vtx[0].vout[o].scriptPubKey[4] == 0xa9 && block.vtx[0].vout[o].scriptPubKey[5] == 0xed) {
+    for (size_t o = 0; o < block.vtx[0]->vout.size(); o++) {
+        if (block.vtx[0]->vout[o].scriptPubKey.size() >= 38 && block.vtx[0]->vout[o].scriptPubKey[0] == OP_RETURN && block.vtx[0]->vout[o].scriptPubKey[1] == 0x24 && block.vtx[0]->vout[o].scriptPubKey[2] == 0xaa && block.vtx[0]->vout[o].scriptPubKey[3] == 0x21 && block.vtx[0]->vout[o].scriptPubKey[4] == 0xa9 && block.vtx[0]->vout[o].scriptPubKey[5] == 0xed) {
             commitpos = o;
         }
     }
@@ -3810,10 +5208,14 @@ void UpdateUncommittedBlockStructures(CBlock& block, const CBlockIndex* pindexPr
 {
     int commitpos = GetWitnessCommitmentIndex(block);
     static const std::vector<unsigned char> nonce(32, 0x00);
-    if (commitpos != -1 && IsWitnessEnabled(pindexPrev, consensusParams) && block.vtx[0].wit.IsEmpty()) {
-        block.vtx[0].wit.vtxinwit.resize(1);
-        block.vtx[0].wit.vtxinwit[0].scriptWitness.stack.resize(1);
-        block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0] = nonce;
+    if (commitpos != -1 && IsWitnessEnabled(pindexPrev, consensusParams) && block.vtx[0]->wit.IsEmpty()) {
+        CTxWitness wit;
+        wit.vtxinwit.resize(1);
+        wit.vtxinwit[0].scriptWitness.stack.resize(1);
+        wit.vtxinwit[0].scriptWitness.stack[0] = nonce;
+        CMutableTransaction tx(*block.vtx[0]);
+        tx.wit = wit;
+        block.vtx[0] = MakeTransactionRef(std::move(tx));
     }
 }
 
@@ -3837,8 +5239,9 @@ std::vector<unsigned char> GenerateCoinbaseCommitment(CBlock& block, const CBloc
             out.scriptPubKey[5] = 0xed;
             memcpy(&out.scriptPubKey[6], witnessroot.begin(), 32);
             commitment = std::vector<unsigned char>(out.scriptPubKey.begin(), out.scriptPubKey.end());
-            const_cast<std::vector<CTxOut>*>(&block.vtx[0].vout)->push_back(out);
-            block.vtx[0].UpdateHash();
+            CMutableTransaction tx(*block.vtx[0]);
+            tx.vout.push_back(out);
+            block.vtx[0] = MakeTransactionRef(std::move(tx));
         }
     }
     UpdateUncommittedBlockStructures(block, pindexPrev, consensusParams);
@@ -3915,8 +5318,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
                               : block.GetBlockTime();
 
     // Check that all transactions are finalized
-    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-        if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+        if (!IsFinalTx(*tx, nHeight, nLockTimeCutoff)) {
             return state.DoS(10, false, REJECT_INVALID, "bad-txns-nonfinal", false, "non-final transaction");
         }
     }
@@ -3946,8 +5349,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     if (checkHeightMismatch)
     {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, false, REJECT_INVALID, "bad-cb-height", false, "block height mismatch in coinbase");
         }
     }
@@ -3969,11 +5372,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
             // The malleation check is ignored; as the transaction tree itself
             // already does not permit it, it is impossible to trigger in the
             // witness tree.
-            if (block.vtx[0].wit.vtxinwit.size() != 1 || block.vtx[0].wit.vtxinwit[0].scriptWitness.stack.size() != 1 || block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0].size() != 32) {
+            if (block.vtx[0]->wit.vtxinwit.size() != 1 || block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack.size() != 1 || block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack[0].size() != 32) {
                 return state.DoS(100, error("%s : invalid witness nonce size", __func__), REJECT_INVALID, "bad-witness-nonce-size", true);
             }
-            CHash256().Write(hashWitness.begin(), 32).Write(&block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0][0], 32).Finalize(hashWitness.begin());
-            if (memcmp(hashWitness.begin(), &block.vtx[0].vout[commitpos].scriptPubKey[6], 32)) {
+            CHash256().Write(hashWitness.begin(), 32).Write(&block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack[0][0], 32).Finalize(hashWitness.begin());
+            if (memcmp(hashWitness.begin(), &block.vtx[0]->vout[commitpos].scriptPubKey[6], 32)) {
                 return state.DoS(100, error("%s : witness merkle commitment mismatch", __func__), REJECT_INVALID, "bad-witness-merkle-match", true);
             }
             fHaveWitness = true;
@@ -3983,7 +5386,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     // No witness data is allowed in blocks that don't commit to witness data, as this would otherwise leave room for spam
     if (!fHaveWitness) {
         for (size_t i = 0; i < block.vtx.size(); i++) {
-            if (!block.vtx[i].wit.IsNull()) {
+            if (!block.vtx[i]->wit.IsNull()) {
                 return state.DoS(100, error("%s : unexpected witness data found", __func__), REJECT_INVALID, "unexpected-witness", true);
             }
         }
@@ -4002,11 +5405,12 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, const uint256* phashPoWIn=NULL)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
     uint256 hash = block.GetHash();
+    uint256 hashPoW = phashPoWIn ? *phashPoWIn : uint256();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -4021,7 +5425,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), true, &hashPoW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -4040,8 +5444,18 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         if (!ContextualCheckBlockHeader(block, state, chainparams.GetConsensus(), pindexPrev, GetAdjustedTime()))
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
-    if (pindex == NULL)
+    if (pindex == NULL) {
         pindex = AddToBlockIndex(block);
+        // CheckBlockHeader verified the PoW of every header but the genesis block,
+        // or the leader did, without the hash, for a follower
+        if (hash != chainparams.GetConsensus().hashGenesisBlock) {
+            pindex->nStatus |= BLOCK_POW_VERIFIED;
+            if (!hashPoW.IsNull()) {
+                pindex->hashPoW = hashPoW;
+                pindex->nStatus |= BLOCK_HAVE_POWHASH;
+            }
+        }
+    }
 
     if (ppindex)
         *ppindex = pindex;
@@ -4095,17 +5509,24 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        // A block already on disk may be stored differently than -compressblocks would store it now
+        unsigned int nBlockSize = 0;
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
+        if (dbp != NULL) {
             blockPos = *dbp;
+            if (!ReadBlockRecordSize(blockPos, nBlockSize))
+                return error("AcceptBlock(): ReadBlockRecordSize failed");
+            nBlockSize &= ~BLOCK_RECORD_COMPRESSED;
+        } else {
+            nBlockSize = GetStoredBlockSize(block);
+        }
         if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != NULL))
             return error("AcceptBlock(): FindBlockPos failed");
         if (dbp == NULL) {
-            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
+            if (!blockStoreWriter.WriteBlock(blockPos, block, chainparams.MessageStart()))
                 AbortNode(state, "Failed to write block");
         }
-        if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
+        if (!ReceivedBlockTransactions(block.vtx.size(), state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error: ") + e.what());
@@ -4130,6 +5551,8 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 }
 
 
+static void RelayBlockEarly(CBlockIndex* pindex, const CBlock& block, const CNode* pfrom);
+
 bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, CNode* pfrom, const CBlock* pblock, bool fForceProcessing, const CDiskBlockPos* dbp, bool fMayBanPeerIfInvalid)
 {
     {
@@ -4148,6 +5571,9 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, C
         CheckBlockIndex(chainparams.GetConsensus());
         if (!ret)
             return error("%s: AcceptBlock FAILED", __func__);
+        // Its PoW, CheckBlock and ContextualCheckBlock passed; connecting it may take a while yet
+        if (fEarlyBlockRelay && fNewBlock && !fHeadersOnly && pindex->pprev == chainActive.Tip() && !IsInitialBlockDownload())
+            RelayBlockEarly(pindex, *pblock, pfrom);
     }
 
     NotifyHeaderTip();
@@ -4234,11 +5660,50 @@ void PruneOneBlockFile(const int fileNumber)
 void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
-        CDiskBlockPos pos(*it, 0);
-        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
-        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
-        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+        blockFileMaps.Remove(*it);
+        blockStoreWriter.Remove(*it);
+    }
+}
+
+/* The lowest height an index build in progress has yet to read, files with blocks from there on are kept */
+static int GetIndexBuildPruneHeight()
+{
+    int nHeight = std::numeric_limits<int>::max();
+    std::map<std::string, CIndexBuildState> mapBuilds = GetIndexBuilds();
+    for (std::map<std::string, CIndexBuildState>::const_iterator it = mapBuilds.begin(); it != mapBuilds.end(); ++it)
+        nHeight = std::min(nHeight, it->second.nNextHeight);
+    return nHeight;
+}
+
+/* Calculate the block/rev files to delete, up to nManualPruneHeight */
+static void FindFilesToPruneManual(std::set<int>& setFilesToPrune, int nManualPruneHeight)
+{
+    assert(fPruneMode && nManualPruneHeight > 0);
+
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || chainActive.Tip()->nHeight <= (int)MIN_BLOCKS_TO_KEEP)
+        return;
+
+    // last block to prune is the lesser of (user-specified height, MIN_BLOCKS_TO_KEEP from the tip)
+    unsigned int nLastBlockWeCanPrune = std::min((unsigned)nManualPruneHeight, chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP);
+    int nIndexBuildHeight = GetIndexBuildPruneHeight();
+    int count = 0;
+    for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+        if (vinfoBlockFile[fileNumber].nSize == 0 || vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+            continue;
+        if ((int)vinfoBlockFile[fileNumber].nHeightLast >= nIndexBuildHeight)
+            continue;
+        PruneOneBlockFile(fileNumber);
+        setFilesToPrune.insert(fileNumber);
+        count++;
     }
+    LogPrintf("Prune (Manual): prune_height=%d removed %d blk/rev pairs\n", nLastBlockWeCanPrune, count);
+}
+
+void PruneBlockFilesManual(int nManualPruneHeight)
+{
+    CValidationState state;
+    FlushStateToDisk(state, FLUSH_STATE_NONE, nManualPruneHeight);
 }
 
 /* Calculate the block/rev files that should be deleted to remain under target*/
@@ -4253,6 +5718,7 @@ void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfterHeight
     }
 
     unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP;
+    int nIndexBuildHeight = GetIndexBuildPruneHeight();
     uint64_t nCurrentUsage = CalculateCurrentUsage();
     // We don't check to prune until after we've allocated new space for files
     // So we should leave a buffer under our target to account for another allocation
@@ -4275,6 +5741,10 @@ void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfterHeight
             if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
                 continue;
 
+            // nor files an index build still has to read
+            if ((int)vinfoBlockFile[fileNumber].nHeightLast >= nIndexBuildHeight)
+                continue;
+
             PruneOneBlockFile(fileNumber);
             // Queue up the files for removal
             setFilesToPrune.insert(fileNumber);
@@ -4347,35 +5817,91 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error(std::string(__func__) + ": new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(CBlockIndex());
+    LOCK(cs_blockindex);
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    LOCK(cs_blockindex);
+    BlockMap::const_iterator mi = mapBlockIndex.find(hash);
+    return mi == mapBlockIndex.end() ? NULL : mi->second;
+}
+
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
+    int64_t nStart = GetTimeMicros();
+
+    // Load block file info
+    pblocktree->ReadLastBlockFile(nLastBlockFile);
+    vinfoBlockFile.resize(nLastBlockFile + 1);
+    LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
+    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+        pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
+    }
+    LogPrintf("%s: last block file info: %s\n", __func__, vinfoBlockFile[nLastBlockFile].ToString());
+    for (int nFile = nLastBlockFile + 1; true; nFile++) {
+        CBlockFileInfo info;
+        if (pblocktree->ReadBlockFileInfo(nFile, info)) {
+            vinfoBlockFile.push_back(info);
+        } else {
+            break;
+        }
+    }
+
+    // The blocks stored are nearly all of the index, the headers without data are few, so the
+    // map is given its buckets once instead of growing through every size on the way
+    size_t nBlocksStored = 0;
+    BOOST_FOREACH(const CBlockFileInfo& info, vinfoBlockFile)
+        nBlocksStored += info.nBlocks;
+    mapBlockIndex.reserve(nBlocksStored + nBlocksStored / 16);
+
     if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
         return false;
+    int64_t nLoaded = GetTimeMicros();
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainWork, parents first: a counting sort by height puts every entry after
+    // its parent without comparing any
+    int nMaxHeight = -1;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<size_t> vHeightStart(nMaxHeight + 2, 0);
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 0; nHeight <= nMaxHeight; nHeight++)
+        vHeightStart[nHeight + 1] += vHeightStart[nHeight];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+
+    // The entries were allocated in the order of their hashes, as the database holds them; copy
+    // them in height order so that the ancestors of a block lie close together. Each old entry
+    // points to its copy through pskip until the map is updated, BuildSkip sets it below.
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        CBlockIndexArena arenaByHeight;
+        BOOST_FOREACH(CBlockIndex*& pindex, vSortedByHeight) {
+            CBlockIndex* pindexCopy = arenaByHeight.Allocate(*pindex);
+            if (pindex->pprev)
+                pindexCopy->pprev = pindex->pprev->pskip;
+            pindex->pskip = pindexCopy;
+            pindex = pindexCopy;
+        }
+        BOOST_FOREACH(BlockMap::value_type& item, mapBlockIndex)
+            item.second = item.second->pskip;
+        BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
+            pindex->pskip = NULL;
+        blockIndexArena.swap(arenaByHeight);
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
@@ -4399,24 +5925,15 @@ bool static LoadBlockIndexDB()
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
-    }
-
-    // Load block file info
-    pblocktree->ReadLastBlockFile(nLastBlockFile);
-    vinfoBlockFile.resize(nLastBlockFile + 1);
-    LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
-    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
-        pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
-    }
-    LogPrintf("%s: last block file info: %s\n", __func__, vinfoBlockFile[nLastBlockFile].ToString());
-    for (int nFile = nLastBlockFile + 1; true; nFile++) {
-        CBlockFileInfo info;
-        if (pblocktree->ReadBlockFileInfo(nFile, info)) {
-            vinfoBlockFile.push_back(info);
-        } else {
-            break;
+        // Connected blocks from before BLOCK_POW_VERIFIED existed passed the same PoW check
+        if (pindex->IsValid(BLOCK_VALID_SCRIPTS) && !(pindex->nStatus & BLOCK_POW_VERIFIED)) {
+            pindex->nStatus |= BLOCK_POW_VERIFIED;
+            setDirtyBlockIndex.insert(pindex);
         }
     }
+    int64_t nLinked = GetTimeMicros();
+    LogPrintf("%s: loaded %u block index entries in %.2fms (reading %.2fms, chain work %.2fms)\n", __func__,
+        (unsigned int)mapBlockIndex.size(), 0.001 * (nLinked - nStart), 0.001 * (nLoaded - nStart), 0.001 * (nLinked - nLoaded));
 
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
@@ -4441,6 +5958,17 @@ bool static LoadBlockIndexDB()
     if (fHavePruned)
         LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
 
+    // A chainstate loaded from a snapshot lacks the blocks below it as a pruned one does
+    bool fSnapshotLoading = false;
+    pblocktree->ReadFlag("utxosnapshotloading", fSnapshotLoading);
+    if (fSnapshotLoading)
+        return error("%s: loading a UTXO snapshot was interrupted, the chainstate is incomplete", __func__);
+    pblocktree->ReadFlag("utxosnapshot", fSnapshotChain);
+    if (fSnapshotChain) {
+        LogPrintf("%s: the chainstate was loaded from a UTXO snapshot\n", __func__);
+        fHavePruned = true;
+    }
+
     // Check whether we need to continue reindexing
     bool fReindexing = false;
     pblocktree->ReadReindexing(fReindexing);
@@ -4454,6 +5982,41 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("addressindex", fAddressIndex);
     LogPrintf("%s: spent index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
+    // The optional indexes used to be kept in the block tree database, move them out once
+    bool fSeparateIndexes = false;
+    pblocktree->ReadFlag("separateindexes", fSeparateIndexes);
+    if (!fSeparateIndexes) {
+        if (!ptxindexdb->MoveFromBlockTree(*pblocktree) || !paddressindexdb->MoveFromBlockTree(*pblocktree) ||
+            !pspentindexdb->MoveFromBlockTree(*pblocktree) || !ptimestampindexdb->MoveFromBlockTree(*pblocktree))
+            return error("%s: failed to move the indexes out of the block tree database", __func__);
+        pblocktree->WriteFlag("separateindexes", true);
+    }
+
+    // Address indexes from before the compact key format are converted once
+    bool fAddressIndexCompact = false;
+    pblocktree->ReadFlag("addressindexcompact", fAddressIndexCompact);
+    if (fAddressIndex && !fAddressIndexCompact) {
+        LogPrintf("%s: converting the address index to the compact format\n", __func__);
+        if (!paddressindexdb->CompactAddressIndex())
+            return error("%s: failed to convert the address index", __func__);
+        pblocktree->WriteFlag("addressindexcompact", true);
+    }
+
+    // Address indexes from before the balance records were kept need them computed once
+    bool fAddressBalances = false;
+    pblocktree->ReadFlag("addressbalanceindex", fAddressBalances);
+    if (fAddressIndex && !fAddressBalances) {
+        LogPrintf("%s: building the address balance index\n", __func__);
+        if (!paddressindexdb->RebuildAddressBalanceIndex())
+            return error("%s: failed to build the address balance index", __func__);
+        pblocktree->WriteFlag("addressbalanceindex", true);
+        pblocktree->WriteFlag("addressindexcompact", true);
+    }
+
+    // Lookups of addresses the index has never seen are answered from memory, also while it is being built
+    if ((fAddressIndex || GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) && !paddressindexdb->LoadAddressFilter())
+        return error("%s: failed to load the address filter", __func__);
+
     // Check whether we have a timestamp index
     pblocktree->ReadFlag("timestampindex", fTimestampIndex);
     LogPrintf("%s: timestamp index %s\n", __func__, fTimestampIndex ? "enabled" : "disabled");
@@ -4462,12 +6025,29 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("spentindex", fSpentIndex);
     LogPrintf("%s: spent index %s\n", __func__, fSpentIndex ? "enabled" : "disabled");
 
+    // Check whether we have a block filter index
+    pblocktree->ReadFlag("blockfilterindex", fBlockFilterIndex);
+    LogPrintf("%s: block filter index %s\n", __func__, fBlockFilterIndex ? "enabled" : "disabled");
+
+    // The UTXO set statistics, used only if they are for the best block of the chainstate
+    if (!pcoinswriter->ReadUTXOStats(utxoStats))
+        utxoStats.SetNull();
+
+    if (fHeadersOnly && pindexBestHeader) {
+        chainHeaders.SetTip(pindexBestHeader);
+        PublishChainTip();
+    }
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end()) {
         return true;
     }
     chainActive.SetTip(it->second);
+    PublishChainTip();
+    if (fTimestampIndex)
+        timestampRangeIndex.SetTip(it->second);
+    EthashAux::setChainHeight(it->second->nHeight);
 
     PruneBlockIndexCandidates();
 
@@ -4509,41 +6089,47 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
     int nGoodTransactions = 0;
     CValidationState state;
     int reportDone = 0;
-    LogPrintf("[0%]...");
+
+    // Levels 0 to 2 run on as many threads as script checks do, from the tip down, while this
+    // loop disconnects the blocks they are done with
+    std::vector<CVerifyDBReader::Job> vJobs;
     for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        boost::this_thread::interruption_point();
-        int percentageDone = std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100))));
-        if (reportDone < percentageDone/10) {
-            // report every 10% step
-            LogPrintf("[%d%%]...", percentageDone);
-            reportDone = percentageDone/10;
-        }
-        uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone);
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
-        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+        if ((fPruneMode || fSnapshotChain) && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
             // If pruning, only go back as far as we have data.
             LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
             break;
         }
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
-            return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus()))
-            return error("%s: *** found bad block at %d, hash=%s (%s)\n", __func__, 
-                         pindex->nHeight, pindex->GetBlockHash().ToString(), FormatStateMessage(state));
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!UndoReadFromDisk(undo, pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB(): *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            }
+        CVerifyDBReader::Job job;
+        job.hash = pindex->GetBlockHash();
+        job.hashPrev = pindex->pprev->GetBlockHash();
+        job.nHeight = pindex->nHeight;
+        job.pos = pindex->GetBlockPos();
+        job.undoPos = pindex->GetUndoPos();
+        vJobs.push_back(job);
+    }
+    CVerifyDBReader reader(vJobs, nCheckLevel, chainparams.GetConsensus(), nScriptCheckThreads);
+
+    LogPrintf("[0%]...");
+    CBlockIndex* pindex = chainActive.Tip();
+    for (size_t nJob = 0; nJob < vJobs.size(); nJob++, pindex = pindex->pprev)
+    {
+        boost::this_thread::interruption_point();
+        int percentageDone = std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100))));
+        if (reportDone < percentageDone/10) {
+            // report every 10% step
+            LogPrintf("[%d%%]...", percentageDone);
+            reportDone = percentageDone/10;
         }
+        uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone);
+        // check levels 0 to 2: read from disk recomputing the PoW, verify block and undo validity
+        boost::shared_ptr<CBlock> pblock;
+        std::string strError;
+        if (!reader.Take(pblock, strError))
+            return error("VerifyDB(): *** %s", strError);
+        CBlock& block = *pblock;
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
         if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
@@ -4570,7 +6156,7 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
             uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
             pindex = chainActive.Next(pindex);
             CBlock block;
-            if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+            if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus(), true))
                 return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             if (!ConnectBlock(block, state, pindex, coins, chainparams))
                 return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4607,7 +6193,7 @@ bool RewindBlockIndex(const CChainParams& params)
             // of the blockchain).
             break;
         }
-        if (!DisconnectTip(state, params, true)) {
+        if (!DisconnectTip(state, params, NULL)) {
             return error("RewindBlockIndex: unable to disconnect block at height %i", pindex->nHeight);
         }
         // Occasionally flush state to disk.
@@ -4672,33 +6258,51 @@ void UnloadBlockIndex()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    chainHeaders.SetTip(NULL);
+    PublishChainTip();
+    utxoStats.SetNull();
+    timestampRangeIndex.Clear();
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    {
+        LOCK(cs_orphans);
+        mapOrphanTransactions.clear();
+        mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
+        setOrphanTransactionsByExpiry.clear();
+        vOrphanList.clear();
+    }
+    mapLowFeeTransactions.clear();
     nSyncStarted = 0;
+    mapHeadersSegments.clear();
+    fHeadersSegmentsInit = false;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
     nBlockSequenceId = 1;
     mapBlockSource.clear();
     mapBlocksInFlight.clear();
-    nPreferredDownload = 0;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
-    mapNodeState.clear();
+    {
+        LOCK(cs_nodestate);
+        nPreferredDownload = 0;
+        mapNodeState.clear();
+    }
     recentRejects.reset(NULL);
     versionbitscache.Clear();
     for (int b = 0; b < VERSIONBITS_NUM_BITS; b++) {
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
+    {
+        LOCK(cs_blockindex);
+        mapBlockIndex.clear();
     }
-    mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
+    fSnapshotChain = false;
 }
 
 bool LoadBlockIndex()
@@ -4716,9 +6320,10 @@ bool InitBlockIndex(const CChainParams& chainparams)
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
 
-    // Initialise the charity script here, as this takes place in the the test code also
+    // Initialise the charity script here, as this takes place in the the test code also.
+    // Reindexing calls this a second time, so assign rather than append.
 
-    CHARITY_SCRIPT << OP_DUP << OP_HASH160 << ParseHex(chainparams.GetConsensus().CharityPubKey) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CHARITY_SCRIPT = CScript() << OP_DUP << OP_HASH160 << ParseHex(chainparams.GetConsensus().CharityPubKey) << OP_EQUALVERIFY << OP_CHECKSIG;
 
     // Check whether we're already initialized
     if (chainActive.Genesis() != NULL)
@@ -4727,11 +6332,14 @@ bool InitBlockIndex(const CChainParams& chainparams)
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    pblocktree->WriteFlag("separateindexes", true);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
     // Use the provided setting for -addressindex in the new database
     fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
     pblocktree->WriteFlag("addressindex", fAddressIndex);
+    pblocktree->WriteFlag("addressbalanceindex", true);
+    pblocktree->WriteFlag("addressindexcompact", true);
     LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
     //Use the provided setting for -timestampindex in the new database
@@ -4742,6 +6350,10 @@ bool InitBlockIndex(const CChainParams& chainparams)
     fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
     pblocktree->WriteFlag("spentindex", fSpentIndex);
     LogPrintf("%s: spent index %s\n", __func__, fSpentIndex ? "enabled" : "disabled");
+
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX);
+    pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
+    LogPrintf("%s: block filter index %s\n", __func__, fBlockFilterIndex ? "enabled" : "disabled");
     
     LogPrintf("Initializing databases...\n");
 
@@ -4750,15 +6362,15 @@ bool InitBlockIndex(const CChainParams& chainparams)
         try {
             CBlock &block = const_cast<CBlock&>(chainparams.GenesisBlock());
             // Start new block file
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            unsigned int nBlockSize = GetStoredBlockSize(block);
             CDiskBlockPos blockPos;
             CValidationState state;
             if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.GetBlockTime()))
                 return error("LoadBlockIndex(): FindBlockPos failed");
-            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
+            if (!blockStoreWriter.WriteBlock(blockPos, block, chainparams.MessageStart()))
                 return error("LoadBlockIndex(): writing genesis block to disk failed");
             CBlockIndex *pindex = AddToBlockIndex(block);
-            if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
+            if (!ReceivedBlockTransactions(block.vtx.size(), state, pindex, blockPos))
                 return error("LoadBlockIndex(): genesis block not accepted");
             // Force a chainstate write so that when we VerifyDB in a moment, it doesn't check stale data
             return FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
@@ -4788,6 +6400,7 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            bool fCompressed = false;
             try {
                 // locate a header
                 unsigned char buf[MESSAGE_START_SIZE];
@@ -4798,6 +6411,8 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     continue;
                 // read size
                 blkdat >> nSize;
+                fCompressed = nSize & BLOCK_RECORD_COMPRESSED;
+                nSize &= ~BLOCK_RECORD_COMPRESSED;
                 if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
                     continue;
             } catch (const std::exception&) {
@@ -4812,7 +6427,7 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
                 CBlock block;
-                blkdat >> block;
+                UnserializeBlockRecord(blkdat, block, fCompressed);
                 nRewind = blkdat.GetPos();
 
                 // detect out of order blocks, and store them for later
@@ -4885,6 +6500,189 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+/** A block found by ReindexBlockFiles, with what indexing it needs from the block data */
+struct CReindexEntry
+{
+    CBlockHeader header;
+    uint256 hash;
+    uint256 hashPoW;
+    CDiskBlockPos pos;
+    unsigned int nSize;
+    unsigned int nTx;
+};
+
+/** Collect the blocks of one blk*.dat file that pass the context-free checks, in file order */
+static void ScanBlockFile(const CChainParams& chainparams, int nFile, std::vector<CReindexEntry>& vEntries)
+{
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    FILE* fileIn = OpenBlockFile(CDiskBlockPos(nFile, 0), true);
+    if (!fileIn)
+        return; // This error is logged in OpenBlockFile
+    LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+    try {
+        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
+        uint64_t nRewind = blkdat.GetPos();
+        while (!blkdat.eof()) {
+            boost::this_thread::interruption_point();
+
+            blkdat.SetPos(nRewind);
+            nRewind++; // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            bool fCompressed = false;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat.FindByte(chainparams.MessageStart()[0]);
+                nRewind = blkdat.GetPos()+1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                fCompressed = nSize & BLOCK_RECORD_COMPRESSED;
+                nSize &= ~BLOCK_RECORD_COMPRESSED;
+                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read block
+                uint64_t nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                blkdat.SetPos(nBlockPos);
+                CBlock block;
+                UnserializeBlockRecord(blkdat, block, fCompressed);
+                nRewind = blkdat.GetPos();
+
+                CReindexEntry entry;
+                entry.header = block.GetBlockHeader();
+                entry.hash = block.GetHash();
+                entry.pos = CDiskBlockPos(nFile, nBlockPos);
+                entry.nSize = nSize;
+                entry.nTx = block.vtx.size();
+
+                // As AcceptBlockHeader and AcceptBlock would, bar the checks that need the parent
+                CValidationState state;
+                bool fGenesis = entry.hash == consensusParams.hashGenesisBlock;
+                if ((!fGenesis && !CheckBlockHeader(block, state, consensusParams, true, &entry.hashPoW)) ||
+                    !CheckBlock(block, state, consensusParams, fGenesis)) {
+                    LogPrint("reindex", "%s: Skipping block %s in blk%05u.dat: %s\n", __func__, entry.hash.ToString(),
+                            (unsigned int)nFile, FormatStateMessage(state));
+                    continue;
+                }
+                vEntries.push_back(entry);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+}
+
+static void ThreadScanBlockFiles(const CChainParams& chainparams, std::atomic<int>* pnNextFile, std::vector<std::vector<CReindexEntry> >* pvFileEntries)
+{
+    RenameThread("mil-reindex");
+    int nFile;
+    while ((nFile = (*pnNextFile)++) < (int)pvFileEntries->size())
+        ScanBlockFile(chainparams, nFile, (*pvFileEntries)[nFile]);
+}
+
+bool ReindexBlockFiles(const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nFiles = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFiles, 0), "blk")))
+        nFiles++;
+
+    // Scan the files in parallel; each thread takes the next file not yet claimed
+    std::vector<std::vector<CReindexEntry> > vFileEntries(nFiles);
+    std::atomic<int> nNextFile(0);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < std::min(std::max(nReindexThreads, 1), std::max(nFiles, 1)); i++)
+        threadGroup.create_thread(boost::bind(&ThreadScanBlockFiles, boost::cref(chainparams), &nNextFile, &vFileEntries));
+    try {
+        threadGroup.join_all();
+    } catch (const boost::thread_interrupted&) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+    if (ShutdownRequested())
+        return false;
+
+    std::vector<CReindexEntry> vEntries;
+    for (int nFile = 0; nFile < nFiles; nFile++) {
+        vEntries.insert(vEntries.end(), vFileEntries[nFile].begin(), vFileEntries[nFile].end());
+        std::vector<CReindexEntry>().swap(vFileEntries[nFile]);
+    }
+    LogPrintf("Scanned %d block files for %u blocks in %dms\n", nFiles, vEntries.size(), GetTimeMillis() - nStart);
+
+    // Index the headers so that every parent comes before its children, starting at the
+    // genesis block and at whatever is already indexed
+    std::multimap<uint256, size_t> mapChildren;
+    std::vector<bool> vQueued(vEntries.size(), false);
+    std::deque<size_t> queue;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < vEntries.size(); i++) {
+            if (vEntries[i].hash == chainparams.GetConsensus().hashGenesisBlock || mapBlockIndex.count(vEntries[i].header.hashPrevBlock)) {
+                vQueued[i] = true;
+                queue.push_back(i);
+            } else {
+                mapChildren.insert(std::make_pair(vEntries[i].header.hashPrevBlock, i));
+            }
+        }
+    }
+
+    int nLoaded = 0;
+    while (!queue.empty()) {
+        boost::this_thread::interruption_point();
+        const CReindexEntry& entry = vEntries[queue.front()];
+        queue.pop_front();
+
+        {
+            LOCK(cs_main);
+            CValidationState state;
+            CBlockIndex* pindex = NULL;
+            if (!AcceptBlockHeader(entry.header, state, chainparams, &pindex, &entry.hashPoW)) {
+                LogPrint("reindex", "%s: Skipping block %s: %s\n", __func__, entry.hash.ToString(), FormatStateMessage(state));
+                continue;
+            }
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+                CDiskBlockPos blockPos = entry.pos;
+                if (!FindBlockPos(state, blockPos, entry.nSize+8, pindex->nHeight, entry.header.GetBlockTime(), true))
+                    return error("%s: FindBlockPos failed", __func__);
+                pindex->nStatus |= BLOCK_UNCHECKED_CONTEXT;
+                ReceivedBlockTransactions(entry.nTx, state, pindex, blockPos);
+                nLoaded++;
+            }
+        }
+
+        std::pair<std::multimap<uint256, size_t>::iterator, std::multimap<uint256, size_t>::iterator> range = mapChildren.equal_range(entry.hash);
+        for (; range.first != range.second; range.first++) {
+            if (!vQueued[range.first->second]) {
+                vQueued[range.first->second] = true;
+                queue.push_back(range.first->second);
+            }
+        }
+    }
+    NotifyHeaderTip();
+
+    // Write the index now, so a restart doesn't repeat the scan once reindexing is marked done
+    CValidationState state;
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+        return false;
+
+    LogPrintf("Indexed %i blocks from block files in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -5142,11 +6940,17 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
+            {
+                LOCK(cs_orphans);
+                if (mapOrphanTransactions.count(inv.hash))
+                    return true;
+            }
+
             // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
             // requesting or processing some txs which have already been included in a block
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
+                   mapLowFeeTransactions.count(inv.hash) ||
                    pcoinsTip->HaveCoinsInCache(inv.hash);
         }
     case MSG_BLOCK:
@@ -5157,14 +6961,296 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/** Most block and compact block payloads kept in recentBlockPayloads */
+static const unsigned int MAX_RECENT_BLOCK_PAYLOADS = 8;
+
+/**
+ * The blocks and compact blocks serialized for peers last, so that a new
+ * block that many peers ask for, or that is announced to them as a compact
+ * block, is read and serialized once and the same payload is queued for all
+ * of them. Keyed by block hash and inventory type, the most recent first.
+ */
+class CRecentBlockPayloads
+{
+private:
+    CCriticalSection cs;
+    std::list<std::pair<std::pair<uint256, int>, CSharedPayloadRef> > listPayloads;
+
+public:
+    CSharedPayloadRef Get(const uint256& hash, int nType)
+    {
+        LOCK(cs);
+        for (std::list<std::pair<std::pair<uint256, int>, CSharedPayloadRef> >::iterator it = listPayloads.begin(); it != listPayloads.end(); ++it) {
+            if (it->first.first == hash && it->first.second == nType) {
+                listPayloads.splice(listPayloads.begin(), listPayloads, it);
+                return listPayloads.front().second;
+            }
+        }
+        return CSharedPayloadRef();
+    }
+
+    void Add(const uint256& hash, int nType, const CSharedPayloadRef& payload)
+    {
+        LOCK(cs);
+        listPayloads.push_front(std::make_pair(std::make_pair(hash, nType), payload));
+        if (listPayloads.size() > MAX_RECENT_BLOCK_PAYLOADS)
+            listPayloads.pop_back();
+    }
+};
+static CRecentBlockPayloads recentBlockPayloads;
+
+/**
+ * The payload of a block message, for nType MSG_BLOCK or MSG_WITNESS_BLOCK, or
+ * of a compact block message, for MSG_CMPCT_BLOCK with MSG_WITNESS_FLAG if the
+ * peer wants witnesses. pos, fCheckPOW and fStoredWithWitness come from the
+ * block's index entry. Returns a null reference if the block can't be read.
+ */
+static CSharedPayloadRef GetBlockPayload(const uint256& hash, int nType, const CDiskBlockPos& pos, bool fCheckPOW, bool fStoredWithWitness, const Consensus::Params& consensusParams)
+{
+    CSharedPayloadRef payload = recentBlockPayloads.Get(hash, nType);
+    if (payload)
+        return payload;
+
+    // A full block is sent from its stored bytes, without deserializing it, when the
+    // peer wants it as it is stored: always with witness data, and without it for a
+    // block stored before witness enforcement, which cannot have any. The bytes are
+    // queued in place when the block file is mapped.
+    if (nType == MSG_WITNESS_BLOCK || (nType == MSG_BLOCK && !fStoredWithWitness)) {
+        boost::shared_ptr<CRawBlock> pRawBlock(new CRawBlock());
+        if (ReadRawBlockFromDisk(*pRawBlock, pos, hash, fCheckPOW, consensusParams))
+            payload.reset(new CSharedPayload(pRawBlock->pbegin, pRawBlock->nSize, pRawBlock));
+    }
+    if (!payload) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pos, consensusParams, fCheckPOW) || block.GetHash() != hash)
+            return payload;
+        bool fWitness = nType & MSG_WITNESS_FLAG;
+        CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION | (fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS));
+        if ((nType & ~MSG_WITNESS_FLAG) == MSG_CMPCT_BLOCK)
+            ssPayload << CBlockHeaderAndShortTxIDs(block, fWitness);
+        else
+            ssPayload << block;
+        CSerializeData data;
+        ssPayload.GetAndClear(data);
+        payload.reset(new CSharedPayload(data));
+    }
+    recentBlockPayloads.Add(hash, nType, payload);
+    return payload;
+}
+
+CSharedPayloadRef GetBlockPayload(const CBlock& block, int nType)
+{
+    const uint256 hash = block.GetHash();
+    CSharedPayloadRef payload = recentBlockPayloads.Get(hash, nType);
+    if (payload)
+        return payload;
+
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION | ((nType & MSG_WITNESS_FLAG) ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS));
+    ssPayload << block;
+    CSerializeData data;
+    ssPayload.GetAndClear(data);
+    payload.reset(new CSharedPayload(data));
+    recentBlockPayloads.Add(hash, nType, payload);
+    return payload;
+}
+
+CSharedPayloadRef GetRecentBlockPayload(const uint256& hash, int nType)
+{
+    return recentBlockPayloads.Get(hash, nType);
+}
+
+/** Most blocks whose CMerkleBlockData is kept in recentMerkleBlockData */
+static const unsigned int MAX_RECENT_MERKLE_BLOCK_DATA = 8;
+
+/**
+ * The blocks filtered for BIP37 peers last, as CMerkleBlockData, so that a new
+ * block is read, its scripts parsed and its merkle tree hashed once, however
+ * many peers with a filter ask for it. Keyed by block hash, the most recent first.
+ */
+class CRecentMerkleBlockData
+{
+private:
+    CCriticalSection cs;
+    std::list<std::pair<uint256, std::shared_ptr<const CMerkleBlockData> > > listData;
+
+public:
+    std::shared_ptr<const CMerkleBlockData> Get(const uint256& hash)
+    {
+        LOCK(cs);
+        for (std::list<std::pair<uint256, std::shared_ptr<const CMerkleBlockData> > >::iterator it = listData.begin(); it != listData.end(); ++it) {
+            if (it->first == hash) {
+                listData.splice(listData.begin(), listData, it);
+                return listData.front().second;
+            }
+        }
+        return std::shared_ptr<const CMerkleBlockData>();
+    }
+
+    void Add(const uint256& hash, const std::shared_ptr<const CMerkleBlockData>& data)
+    {
+        LOCK(cs);
+        listData.push_front(std::make_pair(hash, data));
+        if (listData.size() > MAX_RECENT_MERKLE_BLOCK_DATA)
+            listData.pop_back();
+    }
+};
+static CRecentMerkleBlockData recentMerkleBlockData;
+
+/**
+ * What the block is filtered for BIP37 peers from, from recentMerkleBlockData or read
+ * from disk. Returns a null pointer if the block can't be read.
+ */
+static std::shared_ptr<const CMerkleBlockData> GetMerkleBlockData(const uint256& hash, const CDiskBlockPos& pos, bool fCheckPOW, const Consensus::Params& consensusParams)
+{
+    std::shared_ptr<const CMerkleBlockData> data = recentMerkleBlockData.Get(hash);
+    if (data)
+        return data;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pos, consensusParams, fCheckPOW) || block.GetHash() != hash)
+        return data;
+    data = std::make_shared<const CMerkleBlockData>(block);
+    recentMerkleBlockData.Add(hash, data);
+    return data;
+}
+
+static CCriticalSection cs_cmpctBlockStats;
+static CCompactBlockStats cmpctBlockStats;
+
+CCompactBlockStats GetCompactBlockStats()
+{
+    LOCK(cs_cmpctBlockStats);
+    return cmpctBlockStats;
+}
+
+/**
+ * Pick the transactions of a block that pto probably lacks, to prefill them in
+ * the compact block it gets: first those that were not in our mempool either,
+ * then those that arrived shortly before the block, then those below pto's fee
+ * filter, and last those that neither of us announced to the other. Picks up
+ * to MAX_CMPCTBLOCK_PREFILL_SIZE bytes of them and returns how many.
+ */
+static size_t PredictMissingTxs(CNode* pto, const CCompactBlockHints& hints, std::vector<bool>& vPrefill)
+{
+    CAmount nFeeFilter = 0;
+    {
+        LOCK(pto->cs_feeFilter);
+        nFeeFilter = pto->minFeeFilter;
+    }
+
+    // Why each transaction may be missing, from 0 for the likeliest, or -1
+    static const int MAX_REASON = 3;
+    std::vector<int> vReason(hints.vTx.size(), -1);
+    {
+        LOCK(pto->cs_inventory);
+        for (size_t i = 1; i < hints.vTx.size(); i++) {
+            const CCompactBlockHints::TxHint& hint = hints.vTx[i];
+            if (hint.nFeeRate < 0)
+                vReason[i] = 0;
+            else if (hint.fRecent)
+                vReason[i] = 1;
+            else if (nFeeFilter && hint.nFeeRate < nFeeFilter)
+                vReason[i] = 2;
+            else if (!pto->filterInventoryKnown.contains(hint.hash))
+                vReason[i] = MAX_REASON;
+        }
+    }
+
+    vPrefill.assign(hints.vTx.size(), false);
+    size_t nPrefill = 0;
+    unsigned int nSize = 0;
+    for (int nReason = 0; nReason <= MAX_REASON; nReason++) {
+        for (size_t i = 1; i < hints.vTx.size(); i++) {
+            if (vReason[i] == nReason && nSize + hints.vTx[i].nSize <= MAX_CMPCTBLOCK_PREFILL_SIZE) {
+                vPrefill[i] = true;
+                nSize += hints.vTx[i].nSize;
+                nPrefill++;
+            }
+        }
+    }
+    return nPrefill;
+}
+
+/**
+ * The payload of a compact block message for pto: the one shared by all peers,
+ * unless PredictMissingTxs expects pto to lack some of the transactions, which
+ * are then prefilled in a compact block serialized for pto alone. The other
+ * arguments are as for GetBlockPayload.
+ */
+static CSharedPayloadRef GetCompactBlockPayload(CNode* pto, const uint256& hash, bool fWitness, const CDiskBlockPos& pos, bool fCheckPOW, bool fStoredWithWitness, const Consensus::Params& consensusParams)
+{
+    CSharedPayloadRef payload;
+    std::vector<bool> vPrefill;
+    std::shared_ptr<const CCompactBlockHints> hints = recentCompactBlockHints.Get(hash);
+    size_t nPrefill = hints ? PredictMissingTxs(pto, *hints, vPrefill) : 0;
+    if (nPrefill > 0) {
+        CBlock block;
+        if (ReadBlockFromDisk(block, pos, consensusParams, fCheckPOW) && block.GetHash() == hash && block.vtx.size() == vPrefill.size()) {
+            CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION | (fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS));
+            ssPayload << CBlockHeaderAndShortTxIDs(block, fWitness, vPrefill);
+            CSerializeData data;
+            ssPayload.GetAndClear(data);
+            payload.reset(new CSharedPayload(data));
+            LogPrint("cmpctblock", "Prefilled %u predicted txn in compact block %s for peer=%d\n", nPrefill, hash.ToString(), pto->id);
+        }
+    }
+    if (!payload) {
+        nPrefill = 0;
+        payload = GetBlockPayload(hash, MSG_CMPCT_BLOCK | (fWitness ? MSG_WITNESS_FLAG : 0), pos, fCheckPOW, fStoredWithWitness, consensusParams);
+    }
+    if (payload) {
+        LOCK(cs_cmpctBlockStats);
+        cmpctBlockStats.nSent++;
+        if (nPrefill > 0) {
+            cmpctBlockStats.nSentPredicted++;
+            cmpctBlockStats.nPrefilledTxSent += nPrefill;
+        }
+    }
+    return payload;
+}
+
+/**
+ * Send the block of pindex, just accepted on top of the tip, as a compact block to the peers that
+ * asked for high-bandwidth announcements, before it is connected, as BIP 152 permits. They do not
+ * hold it against us if it fails to connect. Once connected it is not announced to them again.
+ * Requires cs_main.
+ */
+static void RelayBlockEarly(CBlockIndex* pindex, const CBlock& block, const CNode* pfrom)
+{
+    AssertLockHeld(cs_main);
+    // Serialized once for each compact block version
+    CSharedPayloadRef payloads[2];
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        if (pnode == pfrom || pnode->fDisconnect || !pnode->fSuccessfullyConnected)
+            continue;
+        CNodeState* state = State(pnode->GetId());
+        if (!state || !state->fPreferHeaderAndIDs)
+            continue;
+        ProcessBlockAvailability(pnode->GetId());
+        if (PeerHasHeader(state, pindex) || !PeerHasHeader(state, pindex->pprev))
+            continue;
+        bool fWitness = state->fWantsCmpctWitness;
+        CSharedPayloadRef& payload = payloads[fWitness];
+        if (!payload)
+            payload = GetBlockPayload(block, MSG_CMPCT_BLOCK | (fWitness ? MSG_WITNESS_FLAG : 0));
+        LogPrint("net", "%s sending header-and-ids %s to peer %d before connecting it\n", __func__,
+                 pindex->GetBlockHash().ToString(), pnode->id);
+        pnode->PushMessageShared(NetMsgType::CMPCTBLOCK, payload);
+        state->pindexBestHeaderSent = pindex;
+        {
+            LOCK(cs_cmpctBlockStats);
+            cmpctBlockStats.nSent++;
+        }
+    }
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -5177,49 +7263,95 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
             {
+                // Decide what to send under cs_main, from a copy of the index entry's
+                // position and status; reading and serializing the block don't need it.
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CDiskBlockPos pos;
+                bool fCheckPOW = false;
+                bool fStoredWithWitness = false;
+                bool fCompact = false;
+                bool fPeerWantsWitness = false;
+                uint256 hashTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
-                }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
-                {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
 
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    send = send && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                    if (send)
+                    {
+                        pos = mi->second->GetBlockPos();
+                        fCheckPOW = !(mi->second->nStatus & BLOCK_POW_VERIFIED);
+                        fStoredWithWitness = mi->second->nStatus & BLOCK_OPT_WITNESS;
+                        if (inv.type == MSG_CMPCT_BLOCK) {
+                            fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+                            fCompact = CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                        }
+                        if (inv.hash == pfrom->hashContinue)
+                            hashTip = chainActive.Tip()->GetBlockHash();
+                    }
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_FILTERED_BLOCK)
+                    CSharedPayloadRef payload;
+                    std::shared_ptr<const CMerkleBlockData> merkleBlockData;
+                    if (inv.type == MSG_FILTERED_BLOCK) {
+                        merkleBlockData = GetMerkleBlockData(inv.hash, pos, fCheckPOW, consensusParams);
+                        send = merkleBlockData.get() != NULL;
+                    } else {
+                        // If a peer is asking for old blocks, we're almost guaranteed
+                        // they wont have a useful mempool to match against a compact block,
+                        // and we don't feel like constructing the object for them, so
+                        // instead we respond with the full, non-compact block.
+                        if (inv.type == MSG_CMPCT_BLOCK && fCompact) {
+                            payload = GetCompactBlockPayload(pfrom, inv.hash, fPeerWantsWitness, pos, fCheckPOW, fStoredWithWitness, consensusParams);
+                        } else {
+                            int nPayloadType = inv.type;
+                            if (inv.type == MSG_CMPCT_BLOCK)
+                                nPayloadType = MSG_BLOCK | (fPeerWantsWitness ? MSG_WITNESS_FLAG : 0);
+                            payload = GetBlockPayload(inv.hash, nPayloadType, pos, fCheckPOW, fStoredWithWitness, consensusParams);
+                        }
+                        send = payload.get() != NULL;
+                    }
+
+                    if (!send)
+                    {
+                        // The block was pruned since cs_main was released
+                        LogPrintf("%s: cannot load block %s from disk for peer=%d\n", __func__, inv.hash.ToString(), pfrom->GetId());
+                    }
+                    else if (payload)
+                    {
+                        pfrom->PushMessageShared(inv.type == MSG_CMPCT_BLOCK && fCompact ? NetMsgType::CMPCTBLOCK : NetMsgType::BLOCK, payload);
+                    }
+                    else
                     {
                         bool send = false;
                         CMerkleBlock merkleBlock;
@@ -5227,7 +7359,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             LOCK(pfrom->cs_filter);
                             if (pfrom->pfilter) {
                                 send = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
+                                merkleBlock = CMerkleBlock(*merkleBlockData, *pfrom->pfilter);
                             }
                         }
                         if (send) {
@@ -5240,33 +7372,20 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *merkleBlockData->vtx[pair.first]);
                         }
                         // else
                             // no response
                     }
-                    else if (inv.type == MSG_CMPCT_BLOCK)
-                    {
-                        // If a peer is asking for old blocks, we're almost guaranteed
-                        // they wont have a useful mempool to match against a compact block,
-                        // and we don't feel like constructing the object for them, so
-                        // instead we respond with the full, non-compact block.
-                        bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-                        if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
-                            pfrom->PushMessageWithFlag(fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
-                        } else
-                            pfrom->PushMessageWithFlag(fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    if (send && !hashTip.IsNull())
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage(NetMsgType::INV, vInv);
                         pfrom->hashContinue.SetNull();
                     }
@@ -5274,54 +7393,316 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             }
             else if (inv.type == MSG_TX || inv.type == MSG_WITNESS_TX)
             {
-                // Send stream from relay memory
-                bool push = false;
-                auto mi = mapRelay.find(inv.hash);
-                if (mi != mapRelay.end()) {
-                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *mi->second);
-                    push = true;
-                } else if (pfrom->timeLastMempoolReq) {
-                    auto txinfo = mempool.info(inv.hash);
-                    // To protect privacy, do not answer getdata using the mempool when
-                    // that TX couldn't have been INVed in reply to a MEMPOOL request.
-                    if (txinfo.tx && txinfo.nTime <= pfrom->timeLastMempoolReq) {
-                        pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *txinfo.tx);
-                        push = true;
-                    }
+                // To protect privacy, only send transactions announced to the peer, or that
+                // it could have been INVed in reply to a MEMPOOL request
+                bool fAnnounced;
+                {
+                    LOCK(pfrom->cs_inventory);
+                    fAnnounced = pfrom->filterInventoryAnnounced.contains(inv.hash);
                 }
-                if (!push) {
+                CTransactionRef ptx;
+                auto txinfo = mempool.info(inv.hash);
+                if (txinfo.tx && (fAnnounced || (pfrom->timeLastMempoolReq && txinfo.nTime <= pfrom->timeLastMempoolReq)))
+                    ptx = txinfo.tx;
+                if (!ptx && fAnnounced) {
+                    // Mined or evicted since it was announced
+                    LOCK(cs_main);
+                    auto mi = mapRelay.find(inv.hash);
+                    if (mi != mapRelay.end())
+                        ptx = mi->second;
+                }
+                if (ptx) {
+                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *ptx);
+                } else {
                     vNotFound.push_back(inv);
                 }
             }
 
-            // Track requests for our stuff.
-            GetMainSignals().Inventory(inv.hash);
+            // Track requests for our stuff.
+            GetMainSignals().Inventory(inv.hash);
+
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+                break;
+        }
+    }
+
+    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+
+    if (!vNotFound.empty()) {
+        // Let the peer know that we didn't find what it asked for, so it doesn't
+        // have to wait around forever. Currently only SPV clients actually care
+        // about this message: it's needed when they are recursively walking the
+        // dependencies of relevant unconfirmed transactions. SPV clients want to
+        // do that because they want to know about (and store and rebroadcast and
+        // risk analyze) the dependencies of transactions relevant to them, without
+        // having to download the entire memory pool.
+        pfrom->PushMessage(NetMsgType::NOTFOUND, vNotFound);
+    }
+}
+
+uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params& chainparams) {
+    uint32_t nFetchFlags = 0;
+    if ((nLocalServices & NODE_WITNESS) && State(pfrom->GetId())->fHaveWitness) {
+        nFetchFlags |= MSG_WITNESS_FLAG;
+    }
+    return nFetchFlags;
+}
+
+// Requires cs_main.
+// Gives pto the lowest headers segment nobody fetches, within
+// MAX_HEADERS_SEGMENT_AHEAD of our best header, and takes it away again if pto
+// does not answer in time.
+static void RequestHeadersSegment(CNode* pto, CNodeState* state, const CChainParams& chainparams)
+{
+    if (!fHeadersSegmentsInit) {
+        fHeadersSegmentsInit = true;
+        const MapCheckpoints& checkpoints = chainparams.Checkpoints().mapCheckpoints;
+        for (MapCheckpoints::const_iterator it = checkpoints.begin(); fCheckpointsEnabled && it != checkpoints.end(); ++it) {
+            MapCheckpoints::const_iterator itNext = std::next(it);
+            if (itNext == checkpoints.end())
+                break;
+            // The sync peer is about to get there itself
+            if (it->first < pindexBestHeader->nHeight + (int)MAX_HEADERS_RESULTS || mapBlockIndex.count(itNext->second))
+                continue;
+            CHeadersSegment& segment = mapHeadersSegments[it->first];
+            segment.hashAnchor = it->second;
+            segment.nHeightAnchor = it->first;
+            segment.hashStop = itNext->second;
+        }
+    }
+
+    if (state->nHeadersSegment >= 0) {
+        std::map<int, CHeadersSegment>::iterator it = mapHeadersSegments.find(state->nHeadersSegment);
+        if (it != mapHeadersSegments.end() && it->second.nRequestTime < GetTime() - HEADERS_SEGMENT_TIMEOUT) {
+            LogPrint("net", "headers segment %d timed out with peer=%d\n", it->first, pto->id);
+            ReleaseHeadersSegment(state);
+            state->fHeadersSegmentFailed = true;
+        }
+        return;
+    }
+    if (state->fHeadersSegmentFailed)
+        return;
+
+    for (std::map<int, CHeadersSegment>::iterator it = mapHeadersSegments.begin(); it != mapHeadersSegments.end(); ++it) {
+        CHeadersSegment& segment = it->second;
+        if (segment.nHeightAnchor >= pindexBestHeader->nHeight + MAX_HEADERS_SEGMENT_AHEAD)
+            break;
+        if (segment.nodeid != -1 || segment.IsComplete() || pto->nStartingHeight < segment.GetLastHeight() + 1)
+            continue;
+        segment.nodeid = pto->GetId();
+        segment.nRequestTime = GetTime();
+        state->nHeadersSegment = it->first;
+        LogPrint("net", "getheaders (%d) of headers segment %d to peer=%d\n", segment.GetLastHeight(), it->first, pto->id);
+        pto->PushMessage(NetMsgType::GETHEADERS, CBlockLocator(std::vector<uint256>(1, segment.GetLastHash())), segment.hashStop);
+        return;
+    }
+}
+
+// Requires cs_main.
+// Whether headers following hashPrevBlock from the peer continue the headers
+// segment it fetches.
+static bool IsHeadersSegmentContinuation(NodeId nodeid, const uint256& hashPrevBlock)
+{
+    CNodeState* state = State(nodeid);
+    std::map<int, CHeadersSegment>::iterator it = mapHeadersSegments.find(state->nHeadersSegment);
+    return it != mapHeadersSegments.end() && it->second.nodeid == nodeid && it->second.GetLastHash() == hashPrevBlock;
+}
+
+// Requires cs_main.
+// Adds headers from pfrom to the segment it fetches. Their proofs of work are
+// checked now, as these need no previous header; the checks that do wait for
+// ConnectHeadersSegments.
+static bool ProcessHeadersSegment(CNode* pfrom, const std::vector<CBlockHeader>& headers, const std::vector<uint256>& vHashPoW, const CChainParams& chainparams)
+{
+    CNodeState* state = State(pfrom->GetId());
+    if (!IsHeadersSegmentContinuation(pfrom->GetId(), headers[0].hashPrevBlock))
+        return true;
+    CHeadersSegment& segment = mapHeadersSegments[state->nHeadersSegment];
+
+    for (unsigned int n = 0; n < headers.size(); n++) {
+        const CBlockHeader& header = headers[n];
+        CValidationState stateHeader;
+        uint256 hashPoW = vHashPoW.empty() ? uint256() : vHashPoW[n];
+        if (header.hashPrevBlock != segment.GetLastHash() || (int)header.nHeight != segment.GetLastHeight() + 1 ||
+                !CheckBlockHeader(header, stateHeader, chainparams.GetConsensus(), true, &hashPoW)) {
+            ReleaseHeadersSegment(state);
+            state->fHeadersSegmentFailed = true;
+            Misbehaving(pfrom->GetId(), 20);
+            return error("invalid header in headers segment from peer=%d", pfrom->id);
+        }
+        segment.vHeaders.push_back(header);
+        segment.vHashPoW.push_back(hashPoW);
+        if (segment.IsComplete()) {
+            LogPrint("net", "headers segment %d complete at %d from peer=%d\n", segment.nHeightAnchor, segment.GetLastHeight(), pfrom->id);
+            ReleaseHeadersSegment(state);
+            return true;
+        }
+    }
+
+    // A short answer before the end of the segment: the peer does not have the rest
+    if (headers.size() < MAX_HEADERS_RESULTS) {
+        ReleaseHeadersSegment(state);
+        state->fHeadersSegmentFailed = true;
+    } else {
+        segment.nRequestTime = GetTime();
+    }
+    return true;
+}
+
+// Requires cs_main.
+// Connects the complete headers segments that follow our headers, and drops
+// those the sync peers got past already.
+static void ConnectHeadersSegments(const CChainParams& chainparams)
+{
+    while (!mapHeadersSegments.empty()) {
+        std::map<int, CHeadersSegment>::iterator it = mapHeadersSegments.begin();
+        CHeadersSegment& segment = it->second;
+        if (!mapBlockIndex.count(segment.hashStop)) {
+            if (!segment.IsComplete() || !mapBlockIndex.count(segment.hashAnchor))
+                break;
+            CBlockIndex* pindexLast = NULL;
+            for (unsigned int n = 0; n < segment.vHeaders.size(); n++) {
+                CValidationState state;
+                if (!AcceptBlockHeader(segment.vHeaders[n], state, chainparams, &pindexLast, &segment.vHashPoW[n])) {
+                    // Left to the sync peers
+                    LogPrintf("%s: dropping headers segment %d: %s\n", __func__, it->first, FormatStateMessage(state));
+                    break;
+                }
+            }
+            if (pindexLast && pindexLast->GetBlockHash() == segment.hashStop)
+                LogPrint("net", "connected headers segment %d up to %d\n", it->first, pindexLast->nHeight);
+        }
+        if (segment.nodeid != -1)
+            ReleaseHeadersSegment(State(segment.nodeid));
+        mapHeadersSegments.erase(it);
+    }
+}
+
+// Requires cs_main.
+// In headers-only mode, moves chainHeaders to the best header and announces
+// the headers that joined it, as ActivateBestChain does with blocks.
+static void UpdateHeadersChain()
+{
+    if (!fHeadersOnly || !pindexBestHeader || pindexBestHeader == chainHeaders.Tip())
+        return;
+    const CBlockIndex* pindexFork = chainHeaders.FindFork(pindexBestHeader);
+    chainHeaders.SetTip(pindexBestHeader);
+    PublishChainTip();
+    if (IsInitialBlockDownload())
+        return;
+
+    std::vector<uint256> vHashes;
+    for (CBlockIndex* pindex = pindexBestHeader; pindex != pindexFork; pindex = pindex->pprev) {
+        vHashes.push_back(pindex->GetBlockHash());
+        if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE)
+            break;
+    }
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        BOOST_REVERSE_FOREACH(const uint256& hash, vHashes) {
+            pnode->PushBlockHash(hash);
+        }
+    }
+}
+
+/**
+ * The part of AcceptToMemoryPool that does not need cs_main, run by the
+ * message handler threads before they take it, so that they verify the
+ * scripts of different transactions in parallel: the context-free checks,
+ * then the signatures against a copy of the inputs taken under a short lock.
+ * It only leaves the valid signatures in the signature cache; the serialized
+ * AcceptToMemoryPool that follows checks everything again under cs_main and
+ * finds them there, or tells why the transaction is invalid.
+ */
+void static PreCheckTransaction(const CTransaction& tx)
+{
+    CValidationState state;
+    if (!CheckTransaction(tx, state) || tx.IsCoinBase())
+        return;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (AlreadyHave(CInv(MSG_TX, tx.GetHash())))
+            return;
+
+        string reason;
+        if (fRequireStandard && !IsStandardTx(tx, reason, IsWitnessEnabled(chainActive.Tip(), Params().GetConsensus())))
+            return;
+        if (!Params().RequireStandard())
+            scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+
+        // Copy the inputs without leaving them in the coins cache, which
+        // AcceptToMemoryPool keeps to the inputs of the transactions it accepts
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        view.SetBackend(viewMemPool);
+        vector<uint256> vHashTxToUncache;
+        bool fHaveInputs = true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                vHashTxToUncache.push_back(txin.prevout.hash);
+            if (!view.HaveCoins(txin.prevout.hash)) {
+                fHaveInputs = false;
                 break;
+            }
         }
+        fHaveInputs = fHaveInputs && view.HaveInputs(tx);
+        view.SetBackend(dummy);
+        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
+            pcoinsTip->Uncache(hashTx);
+        if (!fHaveInputs)
+            return;
     }
 
-    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+    PrecomputedTransactionData txdata(tx);
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        CScriptCheck check(*view.AccessCoins(tx.vin[i].prevout.hash), tx, i, scriptVerifyFlags, true, &txdata);
+        if (!check())
+            return;
+    }
+}
 
-    if (!vNotFound.empty()) {
-        // Let the peer know that we didn't find what it asked for, so it doesn't
-        // have to wait around forever. Currently only SPV clients actually care
-        // about this message: it's needed when they are recursively walking the
-        // dependencies of relevant unconfirmed transactions. SPV clients want to
-        // do that because they want to know about (and store and rebroadcast and
-        // risk analyze) the dependencies of transactions relevant to them, without
-        // having to download the entire memory pool.
-        pfrom->PushMessage(NetMsgType::NOTFOUND, vNotFound);
+/**
+ * The stop block of a BIP 157 request, if the node serves filters of the type and the
+ * block is on the active chain. Otherwise the peer is disconnected and NULL returned.
+ */
+static const CBlockIndex* LookupBlockFilterStop(CNode* pfrom, uint8_t nFilterType, const uint256& hashStop)
+{
+    AssertLockHeld(cs_main);
+    if (!(nLocalServices & NODE_COMPACT_FILTERS) || nFilterType != BLOCK_FILTER_BASIC) {
+        LogPrint("net", "peer %d requested unsupported block filter type %d, disconnecting\n", pfrom->id, nFilterType);
+        pfrom->fDisconnect = true;
+        return NULL;
+    }
+    BlockMap::iterator it = mapBlockIndex.find(hashStop);
+    if (it == mapBlockIndex.end() || !chainActive.Contains(it->second)) {
+        LogPrint("net", "peer %d requested block filters up to %s, not on the active chain, disconnecting\n", pfrom->id, hashStop.ToString());
+        pfrom->fDisconnect = true;
+        return NULL;
     }
+    return it->second;
 }
 
-uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params& chainparams) {
-    uint32_t nFetchFlags = 0;
-    if ((nLocalServices & NODE_WITNESS) && State(pfrom->GetId())->fHaveWitness) {
-        nFetchFlags |= MSG_WITNESS_FLAG;
+/**
+ * The active blocks from nStartHeight up to the stop block of a getcfilters or getcfheaders
+ * request, at most nMaxCount of them. A peer asking for more, or for none, is disconnected.
+ */
+static bool GetBlockFilterRange(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop, uint32_t nMaxCount, std::vector<uint256>& vHashes)
+{
+    LOCK(cs_main);
+    const CBlockIndex* pindexStop = LookupBlockFilterStop(pfrom, nFilterType, hashStop);
+    if (!pindexStop)
+        return false;
+    if (nStartHeight > (uint32_t)pindexStop->nHeight || (uint32_t)pindexStop->nHeight - nStartHeight >= nMaxCount) {
+        LogPrint("net", "peer %d requested block filters from height %u up to %d, disconnecting\n", pfrom->id, nStartHeight, pindexStop->nHeight);
+        pfrom->fDisconnect = true;
+        return false;
     }
-    return nFetchFlags;
+    for (int nHeight = nStartHeight; nHeight <= pindexStop->nHeight; nHeight++)
+        vHashes.push_back(chainActive[nHeight]->GetBlockHash());
+    return true;
 }
 
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams)
@@ -5334,13 +7715,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    if (fHeadersOnly &&
+              (strCommand == NetMsgType::BLOCK ||
+               strCommand == NetMsgType::CMPCTBLOCK ||
+               strCommand == NetMsgType::BLOCKTXN))
+    {
+        // Never asked for, and there is no chainstate to connect them to
+        LogPrint("net", "ignoring %s in headers-only mode peer=%d\n", SanitizeString(strCommand), pfrom->id);
+        return true;
+    }
+
+
     if (!(nLocalServices & NODE_BLOOM) &&
               (strCommand == NetMsgType::FILTERLOAD ||
                strCommand == NetMsgType::FILTERADD ||
                strCommand == NetMsgType::FILTERCLEAR))
     {
         if (pfrom->nVersion >= NO_BLOOM_VERSION) {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
             return false;
         } else {
@@ -5362,7 +7753,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pfrom->nVersion != 0)
         {
             pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 1);
             return false;
         }
@@ -5436,16 +7826,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
-        if((pfrom->nServices & NODE_WITNESS))
         {
-            LOCK(cs_main);
-            State(pfrom->GetId())->fHaveWitness = true;
-        }
+            LOCK(cs_nodestate);
+            if (pfrom->nServices & NODE_WITNESS)
+                State(pfrom->GetId())->fHaveWitness = true;
 
-        // Potentially mark this peer as a preferred download peer.
-        {
-        LOCK(cs_main);
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+            // Potentially mark this peer as a preferred download peer.
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
         }
 
         // Change version
@@ -5498,7 +7885,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (pfrom->nVersion == 0)
     {
         // Must have a version message before anything else
-        LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 1);
         return false;
     }
@@ -5510,7 +7896,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // Mark this node as currently connected, so we update its timestamp later.
         if (pfrom->fNetworkNode) {
-            LOCK(cs_main);
+            LOCK(cs_nodestate);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
 
@@ -5547,7 +7933,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         if (vAddr.size() > 1000)
         {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message addr size() = %u", vAddr.size());
         }
@@ -5604,7 +7989,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == NetMsgType::SENDHEADERS)
     {
-        LOCK(cs_main);
+        LOCK(cs_nodestate);
         State(pfrom->GetId())->fPreferHeaders = true;
     }
 
@@ -5614,7 +7999,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint64_t nCMPCTBLOCKVersion = 0;
         vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
         if (nCMPCTBLOCKVersion == 1 || ((nLocalServices & NODE_WITNESS) && nCMPCTBLOCKVersion == 2)) {
-            LOCK(cs_main);
+            LOCK(cs_nodestate);
             // fProvidesHeaderAndIDs is used to "lock in" version of compact blocks we send (fWantsCmpctWitness)
             if (!State(pfrom->GetId())->fProvidesHeaderAndIDs) {
                 State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
@@ -5638,7 +8023,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message inv size() = %u", vInv.size());
         }
@@ -5725,7 +8109,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message getdata size() = %u", vInv.size());
         }
@@ -5827,6 +8210,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
             resp.txn[i] = block.vtx[req.indexes[i]];
         }
+        {
+            LOCK(cs_cmpctBlockStats);
+            cmpctBlockStats.nBlockTxnRequestsReceived++;
+            cmpctBlockStats.nBlockTxnTxSent += resp.txn.size();
+        }
         pfrom->PushMessageWithFlag(State(pfrom->GetId())->fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCKTXN, resp);
     }
 
@@ -5844,6 +8232,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CNodeState *nodestate = State(pfrom->GetId());
+        CChain& chain = HeadersChain();
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
         {
@@ -5856,26 +8245,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         else
         {
             // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
+            pindex = FindForkInGlobalIndex(chain, locator);
             if (pindex)
-                pindex = chainActive.Next(pindex);
+                pindex = chain.Next(pindex);
         }
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
         int nLimit = MAX_HEADERS_RESULTS;
         //LogPrintf("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
+        for (; pindex; pindex = chain.Next(pindex))
         {
             vHeaders.push_back(pindex->GetBlockHeader());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
-        // pindex can be NULL either if we sent chainActive.Tip() OR
-        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // pindex can be NULL either if we sent chain.Tip() OR
+        // if our peer has chain.Tip() (and thus we are sending an empty
         // headers message). In both cases it's safe to update
         // pindexBestHeaderSent to be our tip.
-        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+        nodestate->pindexBestHeaderSent = pindex ? pindex : chain.Tip();
         pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
     }
 
@@ -5898,6 +8287,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        PreCheckTransaction(tx);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
@@ -5906,8 +8297,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv.hash);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
+        bool fAccepted = !AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs);
+
+        // The inputs tx misses may be of parents rejected for their fee, which
+        // it can pay for. If the package fails, tx is handled as an orphan.
+        std::vector<CTransactionRef> vPackageParents;
+        if (!fAccepted && fMissingInputs && GetLowFeeParents(tx, vPackageParents)) {
+            CValidationState statePackage;
+            fAccepted = AcceptPackageToMemoryPool(mempool, statePackage, vPackageParents, tx);
+            if (!fAccepted) {
+                LogPrint("mempool", "package of tx %s not accepted: %s\n", tx.GetHash().ToString(), FormatStateMessage(statePackage));
+                vPackageParents.clear();
+            }
+        }
+
+        if (fAccepted) {
             mempool.check(pcoinsTip);
+            BOOST_FOREACH(const CTransactionRef& parent, vPackageParents) {
+                RelayTransaction(*parent);
+                for (unsigned int i = 0; i < parent->vout.size(); i++) {
+                    vWorkQueue.emplace_back(parent->GetHash(), i);
+                }
+                mapLowFeeTransactions.erase(parent->GetHash());
+            }
             RelayTransaction(tx);
             for (unsigned int i = 0; i < tx.vout.size(); i++) {
                 vWorkQueue.emplace_back(inv.hash, i);
@@ -5923,17 +8335,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // Recursively process any orphan transactions that depended on this one
             set<NodeId> setMisbehaving;
             while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+                // Copied out, as accepting them must not happen under cs_orphans;
+                // the pool only changes under cs_main, which is held throughout
+                std::vector<std::pair<CTransactionRef, NodeId> > vOrphans;
+                {
+                    LOCK(cs_orphans);
+                    auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+                    if (itByPrev != mapOrphanTransactionsByPrev.end()) {
+                        for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi)
+                            vOrphans.push_back(std::make_pair((*mi)->second.tx, (*mi)->second.fromPeer));
+                    }
+                }
                 vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
+                BOOST_FOREACH(const PAIRTYPE(CTransactionRef, NodeId)& orphan, vOrphans)
                 {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
+                    const CTransaction& orphanTx = *orphan.first;
                     const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
+                    NodeId fromPeer = orphan.second;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
@@ -5977,6 +8395,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 }
             }
 
+            LOCK(cs_orphans);
             BOOST_FOREACH(uint256 hash, vEraseQueue)
                 EraseOrphanTx(hash);
         }
@@ -5996,7 +8415,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->AddInventoryKnown(_inv);
                     if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
                 }
-                AddOrphanTx(tx, pfrom->GetId());
+                {
+                    LOCK(cs_orphans);
+                    AddOrphanTx(tx, pfrom->GetId());
+                }
 
                 // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
                 unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
@@ -6014,6 +8436,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 assert(recentRejects);
                 recentRejects->insert(tx.GetHash());
             }
+            // A miner with another policy may still include it, and a child
+            // may yet pay for one rejected for its fee alone
+            if (state.IsInvalid()) {
+                CTransactionRef ptx = MakeTransactionRef(tx);
+                AddToCompactExtraTransactions(ptx);
+                if (state.GetRejectCode() == REJECT_INSUFFICIENTFEE)
+                    AddLowFeeTx(ptx, pfrom->GetId());
+            }
 
             if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
                 // Always relay transactions received from whitelisted peers, even
@@ -6060,6 +8490,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CBlock block;
         bool fBlockReconstructed = false;
 
+        std::vector<std::pair<uint256, CTransactionRef> > vExtraTxn;
+        extraTxnForCompact.Get(vExtraTxn);
+
+        // Match the short ids against the mempool before taking cs_main, when
+        // the block looks like one we'd reconstruct. The checks are repeated
+        // under cs_main below, which uses the prepared block if they pass.
+        std::unique_ptr<PartiallyDownloadedBlock> preparedBlock;
+        ReadStatus preparedStatus = READ_STATUS_OK;
+        {
+            bool fPrepare = false;
+            {
+                LOCK(cs_main);
+                BlockMap::iterator miPrev = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.GetHash());
+                fPrepare = miPrev != mapBlockIndex.end() && miPrev->second->nHeight < chainActive.Height() + 2 &&
+                           (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA));
+            }
+            if (fPrepare) {
+                preparedBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                preparedStatus = preparedBlock->InitData(cmpctblock, vExtraTxn);
+            }
+        }
+
         LOCK(cs_main);
 
         if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
@@ -6132,14 +8585,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     }
                 }
 
+                if (!preparedBlock) {
+                    preparedBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                    preparedStatus = preparedBlock->InitData(cmpctblock, vExtraTxn);
+                }
+                (*queuedBlockIt)->partialBlock = std::move(preparedBlock);
                 PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
-                ReadStatus status = partialBlock.InitData(cmpctblock);
+                ReadStatus status = preparedStatus;
                 if (status == READ_STATUS_INVALID) {
                     MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
                     Misbehaving(pfrom->GetId(), 100);
                     LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
                     return true;
                 } else if (status == READ_STATUS_FAILED) {
+                    {
+                        LOCK(cs_cmpctBlockStats);
+                        cmpctBlockStats.nReceived++;
+                        cmpctBlockStats.nFailed++;
+                    }
                     // Duplicate txindexes, the block is now in-flight, so just request it
                     std::vector<CInv> vInv(1);
                     vInv[0] = CInv(MSG_BLOCK | GetFetchFlags(pfrom, pindex->pprev, chainparams.GetConsensus()), cmpctblock.header.GetHash());
@@ -6158,6 +8621,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     if (!partialBlock.IsTxAvailable(i))
                         req.indexes.push_back(i);
                 }
+                {
+                    // BLOCKTXN counts the reconstruction
+                    LOCK(cs_cmpctBlockStats);
+                    cmpctBlockStats.nReceived++;
+                    cmpctBlockStats.nPrefilledTxReceived += cmpctblock.PrefilledTxCount();
+                    cmpctBlockStats.nBlockTxnTxRequested += req.indexes.size();
+                }
                 if (req.indexes.empty()) {
                     // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
                     BlockTransactions txn;
@@ -6175,14 +8645,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 // download from.
                 // Optimistically try to reconstruct anyway since we might be
                 // able to without any round trips.
-                PartiallyDownloadedBlock tempBlock(&mempool);
-                ReadStatus status = tempBlock.InitData(cmpctblock);
+                if (!preparedBlock) {
+                    preparedBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                    preparedStatus = preparedBlock->InitData(cmpctblock, vExtraTxn);
+                }
+                ReadStatus status = preparedStatus;
                 if (status != READ_STATUS_OK) {
                     // TODO: don't ignore failures
                     return true;
                 }
-                std::vector<CTransaction> dummy;
-                status = tempBlock.FillBlock(block, dummy);
+                std::vector<CTransactionRef> dummy;
+                status = preparedBlock->FillBlock(block, dummy);
                 if (status == READ_STATUS_OK) {
                     fBlockReconstructed = true;
                 }
@@ -6259,6 +8732,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
             return true;
         } else if (status == READ_STATUS_FAILED) {
+            {
+                LOCK(cs_cmpctBlockStats);
+                cmpctBlockStats.nFailed++;
+            }
             // Might have collided, fall back to getdata now :(
             std::vector<CInv> invs;
             invs.push_back(CInv(MSG_BLOCK | GetFetchFlags(pfrom, chainActive.Tip(), chainparams.GetConsensus()), resp.blockhash));
@@ -6281,6 +8758,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // though the block was successfully read, and rely on the
             // handling in ProcessNewBlock to ensure the block index is
             // updated, reject messages go out, etc.
+            {
+                // Without transactions, this comes straight from the cmpctblock
+                LOCK(cs_cmpctBlockStats);
+                if (resp.txn.empty())
+                    cmpctBlockStats.nReconstructed++;
+                else
+                    cmpctBlockStats.nReconstructedAfterRequest++;
+            }
             CValidationState state;
             // BIP 152 permits peers to relay compact blocks after validating
             // the header only; we should not punish peers if the block turns
@@ -6303,7 +8788,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
         unsigned int nCount = ReadCompactSize(vRecv);
         if (nCount > MAX_HEADERS_RESULTS) {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("headers message size = %u", nCount);
         }
@@ -6313,6 +8797,31 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        bool fSegment = false;
+        if (nCount > 0) {
+            LOCK(cs_main);
+            fSegment = IsHeadersSegmentContinuation(pfrom->GetId(), headers[0].hashPrevBlock);
+            // Ask for the next headers before checking these, so that the peer sends them meanwhile
+            if (nCount == MAX_HEADERS_RESULTS && fSegment) {
+                const uint256& hashStop = mapHeadersSegments[State(pfrom->GetId())->nHeadersSegment].hashStop;
+                if (headers.back().GetHash() != hashStop)
+                    pfrom->PushMessage(NetMsgType::GETHEADERS, CBlockLocator(std::vector<uint256>(1, headers.back().GetHash())), hashStop);
+            } else if (nCount == MAX_HEADERS_RESULTS && mapBlockIndex.count(headers[0].hashPrevBlock)) {
+                // Headers message had its maximum size; the peer may have more headers.
+                // Skip what headers segments connected beyond these already.
+                CBlockLocator locator = chainActive.GetLocator(pindexBestHeader);
+                BlockMap::iterator mi = mapBlockIndex.find(headers.back().GetHash());
+                if (mi == mapBlockIndex.end() || pindexBestHeader->GetAncestor(mi->second->nHeight) != mi->second)
+                    locator.vHave.insert(locator.vHave.begin(), headers.back().GetHash());
+                LogPrintf("more getheaders (%d) mixhash: %s to end to peer=%d (startheight:%d)\n", headers.back().nHeight, headers.back().mixhash.GetHex(), pfrom->id, pfrom->nStartingHeight);
+                pfrom->PushMessage(NetMsgType::GETHEADERS, locator, uint256());
+            }
+        }
+
+        // Evaluate the proofs of work of the whole batch in parallel, before taking cs_main
+        std::vector<uint256> vHashPoW;
+        ComputeHeadersPoW(headers, vHashPoW);
+
         {
         LOCK(cs_main);
 
@@ -6321,6 +8830,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        if (fSegment) {
+            bool fOk = ProcessHeadersSegment(pfrom, headers, vHashPoW, chainparams);
+            ConnectHeadersSegments(chainparams);
+            UpdateHeadersChain();
+            return fOk;
+        }
+
         CNodeState *nodestate = State(pfrom->GetId());
 
         // If this looks like it could be a block announcement (nCount <
@@ -6352,14 +8868,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < headers.size(); n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
 
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, vHashPoW.empty() ? NULL : &vHashPoW[n])) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -6377,13 +8894,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         assert(pindexLast);
         UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrintf("more getheaders (%d) mixhash: %s to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pindexLast->mixhash.GetHex(), pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexLast), uint256());
-        }
+        ConnectHeadersSegments(chainparams);
+        UpdateHeadersChain();
 
         bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
         // If this set of headers is valid and ends in a block with at least as
@@ -6449,9 +8961,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
+        unsigned int nSize = vRecv.size();
         vRecv >> block;
 
         LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
+        {
+            LOCK(cs_main);
+            RecordBlockDownload(pfrom->GetId(), block.GetHash(), nSize);
+        }
 
 
         CValidationState state;
@@ -6466,10 +8983,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
             pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
                                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
-            if (nDoS > 0) {
-                LOCK(cs_main);
+            if (nDoS > 0)
                 Misbehaving(pfrom->GetId(), nDoS);
-            }
         }
 
     }
@@ -6495,7 +9010,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addr);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -6610,7 +9128,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (!filter.IsWithinSizeConstraints())
         {
             // There is no excuse for sending a too-large filter
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
         }
         else
@@ -6642,10 +9159,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 bad = true;
             }
         }
-        if (bad) {
-            LOCK(cs_main);
+        if (bad)
             Misbehaving(pfrom->GetId(), 100);
-        }
     }
 
 
@@ -6658,6 +9173,87 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    // The compact filters of BIP 157 are built once per block by the block filter index, serving
+    // them only reads the index. A filter the index has not reached yet ends the response there.
+    else if (strCommand == NetMsgType::GETCFILTERS)
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        std::vector<uint256> vHashes;
+        if (!GetBlockFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, vHashes))
+            return true;
+        for (const uint256& hash : vHashes) {
+            BlockFilter filter;
+            if (!pblockfilterdb->ReadBlockFilter(hash, filter)) {
+                LogPrint("net", "no filter of block %s for peer %d\n", hash.ToString(), pfrom->id);
+                break;
+            }
+            pfrom->PushMessage(NetMsgType::CFILTER, filter);
+        }
+    }
+
+
+    else if (strCommand == NetMsgType::GETCFHEADERS)
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        std::vector<uint256> vHashes;
+        if (!GetBlockFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, vHashes))
+            return true;
+        uint256 hashPrevBlock;
+        if (nStartHeight > 0) {
+            LOCK(cs_main);
+            hashPrevBlock = chainActive[nStartHeight - 1]->GetBlockHash();
+        }
+        uint256 prevHeader;
+        if (!hashPrevBlock.IsNull() && !pblockfilterdb->ReadBlockFilterHeader(hashPrevBlock, prevHeader)) {
+            LogPrint("net", "no filter header of block %s for peer %d\n", hashPrevBlock.ToString(), pfrom->id);
+            return true;
+        }
+        std::vector<uint256> vFilterHashes(vHashes.size());
+        for (size_t i = 0; i < vHashes.size(); i++) {
+            uint256 header;
+            if (!pblockfilterdb->ReadBlockFilterHeader(vHashes[i], header, &vFilterHashes[i])) {
+                LogPrint("net", "no filter header of block %s for peer %d\n", vHashes[i].ToString(), pfrom->id);
+                return true;
+            }
+        }
+        pfrom->PushMessage(NetMsgType::CFHEADERS, nFilterType, hashStop, prevHeader, vFilterHashes);
+    }
+
+
+    else if (strCommand == NetMsgType::GETCFCHECKPT)
+    {
+        uint8_t nFilterType;
+        uint256 hashStop;
+        vRecv >> nFilterType >> hashStop;
+
+        std::vector<uint256> vHashes;
+        {
+            LOCK(cs_main);
+            const CBlockIndex* pindexStop = LookupBlockFilterStop(pfrom, nFilterType, hashStop);
+            if (!pindexStop)
+                return true;
+            for (int nHeight = CFCHECKPT_INTERVAL; nHeight <= pindexStop->nHeight; nHeight += CFCHECKPT_INTERVAL)
+                vHashes.push_back(chainActive[nHeight]->GetBlockHash());
+        }
+        std::vector<uint256> vHeaders(vHashes.size());
+        for (size_t i = 0; i < vHashes.size(); i++) {
+            if (!pblockfilterdb->ReadBlockFilterHeader(vHashes[i], vHeaders[i])) {
+                LogPrint("net", "no filter header of block %s for peer %d\n", vHashes[i].ToString(), pfrom->id);
+                return true;
+            }
+        }
+        pfrom->PushMessage(NetMsgType::CFCHECKPT, nFilterType, hashStop, vHeaders);
+    }
+
+
     else if (strCommand == NetMsgType::REJECT)
     {
         if (fDebug) {
@@ -6783,6 +9379,8 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        TRACE4(net, inbound_message, pfrom->id, pfrom->addrName.c_str(), strCommand.c_str(), nMessageSize);
+
         // Process message
         bool fRet = false;
         try
@@ -6835,22 +9433,58 @@ bool ProcessMessages(CNode* pfrom)
     return fOk;
 }
 
-class CompareInvMempoolOrder
+/** Least time in microseconds between two computations of the shared announcement order */
+static const int64_t INVENTORY_ORDER_INTERVAL = 1000000;
+
+/**
+ * The mempool sorted by depth and score once for all peers, so that each peer
+ * ranks the transactions it is about to announce by a lookup in it instead of
+ * sorting them itself under the mempool lock. Recomputed when the mempool has
+ * changed, at most every INVENTORY_ORDER_INTERVAL.
+ */
+class CInvAnnounceOrder
 {
-    CTxMemPool *mp;
 public:
-    CompareInvMempoolOrder(CTxMemPool *mempool)
-    {
-        mp = mempool;
-    }
+    struct Entry {
+        //! Position in the order, the lowest announced first
+        size_t nRank;
+        CTransactionRef tx;
+        //! Fee rate in satoshis per 1000 bytes
+        CAmount nFeeRate;
+    };
+    typedef std::map<uint256, Entry> OrderMap;
+
+private:
+    CCriticalSection cs;
+    std::shared_ptr<const OrderMap> order;
+    int64_t nTimeComputed;
+    unsigned int nTransactionsUpdated;
+
+public:
+    CInvAnnounceOrder() : nTimeComputed(0), nTransactionsUpdated(0) {}
 
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
+    std::shared_ptr<const OrderMap> Get(int64_t nNow)
     {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
+        LOCK(cs);
+        if (order && (nNow - nTimeComputed < INVENTORY_ORDER_INTERVAL || mempool.GetTransactionsUpdated() == nTransactionsUpdated))
+            return order;
+
+        // Read first, so that changes during infoAll are picked up by the next computation
+        nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        std::vector<TxMempoolInfo> vInfo = mempool.infoAll();
+        std::shared_ptr<OrderMap> orderNew = std::make_shared<OrderMap>();
+        for (size_t i = 0; i < vInfo.size(); i++) {
+            Entry& entry = (*orderNew)[vInfo[i].tx->GetHash()];
+            entry.nRank = i;
+            entry.tx = vInfo[i].tx;
+            entry.nFeeRate = vInfo[i].feeRate.GetFeePerK();
+        }
+        order = orderNew;
+        nTimeComputed = nNow;
+        return order;
     }
 };
+static CInvAnnounceOrder invAnnounceOrder;
 
 bool SendMessages(CNode* pto)
 {
@@ -6889,48 +9523,57 @@ bool SendMessages(CNode* pto)
             }
         }
 
-        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
-        if (!lockMain)
-            return true;
-
-        // Address refresh broadcast
-        int64_t nNow = GetTimeMicros();
-        if (!IsInitialBlockDownload() && pto->nNextLocalAddrSend < nNow) {
-            AdvertiseLocal(pto);
-            pto->nNextLocalAddrSend = PoissonNextSend(nNow, AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL);
-        }
-
         //
         // Message: addr
         //
-        if (pto->nNextAddrSend < nNow) {
-            pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+        int64_t nNowAddr = GetTimeMicros();
+        if (pto->nNextAddrSend < nNowAddr) {
+            pto->nNextAddrSend = PoissonNextSend(nNowAddr, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_addr);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage(NetMsgType::ADDR, vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+                // we only send the big addr message once
+                if (pto->vAddrToSend.capacity() > 40)
+                    pto->vAddrToSend.shrink_to_fit();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage(NetMsgType::ADDR, vAddr);
-            // we only send the big addr message once
-            if (pto->vAddrToSend.capacity() > 40)
-                pto->vAddrToSend.shrink_to_fit();
+            // receiver rejects addr messages larger than 1000
+            for (size_t nStart = 0; nStart < vAddr.size(); nStart += 1000)
+                pto->PushMessage(NetMsgType::ADDR, vector<CAddress>(vAddr.begin() + nStart, vAddr.begin() + std::min(vAddr.size(), nStart + 1000)));
+        }
+
+        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
+        if (!lockMain)
+            return true;
+
+        // Address refresh broadcast
+        int64_t nNow = GetTimeMicros();
+        if (nNow > nNextNodeStateStatsPublish) {
+            PublishNodeStateStats();
+            nNextNodeStateStatsPublish = nNow + 1000000;
+        }
+        if (!IsInitialBlockDownload() && pto->nNextLocalAddrSend < nNow) {
+            AdvertiseLocal(pto);
+            pto->nNextLocalAddrSend = PoissonNextSend(nNow, AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL);
         }
 
         CNodeState &state = *State(pto->GetId());
-        if (state.fShouldBan) {
+        bool fShouldBan;
+        {
+            LOCK(cs_nodestate);
+            fShouldBan = state.fShouldBan;
+            state.fShouldBan = false;
+        }
+        if (fShouldBan) {
             if (pto->fWhitelisted)
                 LogPrintf("Warning: not punishing whitelisted peer %s!\n", pto->addr.ToString());
             else {
@@ -6942,7 +9585,6 @@ bool SendMessages(CNode* pto)
                     CNode::Ban(pto->addr, BanReasonNodeMisbehaving);
                 }
             }
-            state.fShouldBan = false;
         }
 
         BOOST_FOREACH(const CBlockReject& reject, state.rejects)
@@ -6952,7 +9594,11 @@ bool SendMessages(CNode* pto)
         // Start block sync
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
-        bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
+        bool fFetch;
+        {
+            LOCK(cs_nodestate);
+            fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
+        }
         if (!state.fSyncStarted && !pto->fClient && !pto->fDisconnect && !fImporting && !fReindex) {
             // Only actively request headers from a single peer, unless we're close to today.
             if ((nSyncStarted == 0 && fFetch) || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60) {
@@ -6972,6 +9618,10 @@ bool SendMessages(CNode* pto)
                 pto->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexStart), uint256());
             }
         }
+        // Meanwhile fetch the headers between later checkpoints from the other peers
+        if (!state.fSyncStarted && nSyncStarted > 0 && !pto->fClient && !pto->fDisconnect && !fImporting && !fReindex &&
+                pindexBestHeader->GetBlockTime() <= GetAdjustedTime() - 24 * 60 * 60)
+            RequestHeadersSegment(pto, &state, Params());
 
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
@@ -7009,7 +9659,7 @@ bool SendMessages(CNode* pto)
                     BlockMap::iterator mi = mapBlockIndex.find(hash);
                     assert(mi != mapBlockIndex.end());
                     CBlockIndex *pindex = mi->second;
-                    if (chainActive[pindex->nHeight] != pindex) {
+                    if (HeadersChain()[pindex->nHeight] != pindex) {
                         // Bail out if we reorged away from this block
                         fRevertToInv = true;
                         break;
@@ -7049,16 +9699,18 @@ bool SendMessages(CNode* pto)
                 }
             }
             if (!fRevertToInv && !vHeaders.empty()) {
-                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs && !fHeadersOnly) {
                     // We only send up to 1 block as header-and-ids, as otherwise
                     // probably means we're doing an initial-ish-sync or they're slow
                     LogPrint("net", "%s sending header-and-ids %s to peer %d\n", __func__,
                             vHeaders.front().GetHash().ToString(), pto->id);
-                    //TODO: Shouldn't need to reload block from disk, but requires refactor
-                    CBlock block;
-                    assert(ReadBlockFromDisk(block, pBestIndex, consensusParams));
-                    CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
-                    pto->PushMessageWithFlag(state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, cmpctblock);
+                    // Read and serialized once for all the peers it is announced to,
+                    // unless pto is predicted to lack some of its transactions
+                    CSharedPayloadRef payload = GetCompactBlockPayload(pto, pBestIndex->GetBlockHash(), state.fWantsCmpctWitness,
+                                                                       pBestIndex->GetBlockPos(), !(pBestIndex->nStatus & BLOCK_POW_VERIFIED),
+                                                                       pBestIndex->nStatus & BLOCK_OPT_WITNESS, consensusParams);
+                    assert(payload);
+                    pto->PushMessageShared(NetMsgType::CMPCTBLOCK, payload);
                     state.pindexBestHeaderSent = pBestIndex;
                 } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
@@ -7075,7 +9727,8 @@ bool SendMessages(CNode* pto)
                 } else
                     fRevertToInv = true;
             }
-            if (fRevertToInv) {
+            // In headers-only mode there is no block to serve to a peer that asks for the one announced
+            if (fRevertToInv && !fHeadersOnly) {
                 // If falling back to using an inv, just try to inv the tip.
                 // The last entry in vBlockHashesToAnnounce was our tip at some point
                 // in the past.
@@ -7171,62 +9824,59 @@ bool SendMessages(CNode* pto)
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
+                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons,
+                // by the order shared by all peers. Candidates newer than it wait for the next trickle,
+                // unless they left the mempool already.
+                std::shared_ptr<const CInvAnnounceOrder::OrderMap> order = invAnnounceOrder.Get(nNow);
+                vector<std::pair<size_t, const CInvAnnounceOrder::OrderMap::value_type*> > vInvTx;
+                vInvTx.reserve(pto->setInventoryTxToSend.size());
+                {
+                    LOCK(mempool.cs);
+                    for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); ) {
+                        CInvAnnounceOrder::OrderMap::const_iterator mi = order->find(*it);
+                        if (mi != order->end()) {
+                            vInvTx.push_back(std::make_pair(mi->second.nRank, &*mi));
+                            it++;
+                        } else if (!mempool.exists(*it)) {
+                            it = pto->setInventoryTxToSend.erase(it);
+                        } else {
+                            it++;
+                        }
+                    }
+                }
                 // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                // As std::make_heap produces a max-heap, the lowest ranks must compare greatest.
+                std::greater<std::pair<size_t, const CInvAnnounceOrder::OrderMap::value_type*> > compareRank;
+                std::make_heap(vInvTx.begin(), vInvTx.end(), compareRank);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
                 while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
                     // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
+                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareRank);
+                    const CInvAnnounceOrder::OrderMap::value_type* pentry = vInvTx.back().second;
                     vInvTx.pop_back();
-                    uint256 hash = *it;
+                    const uint256& hash = pentry->first;
                     // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
+                    pto->setInventoryTxToSend.erase(hash);
                     // Check if not in the filter already
                     if (pto->filterInventoryKnown.contains(hash)) {
                         continue;
                     }
-                    // Not in the mempool anymore? don't bother sending it.
-                    auto txinfo = mempool.info(hash);
-                    if (!txinfo.tx) {
-                        continue;
-                    }
-                    if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
+                    if (filterrate && pentry->second.nFeeRate < filterrate) {
                         continue;
                     }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*pentry->second.tx)) continue;
                     // Send
                     vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
-                    {
-                        // Expire old relay messages
-                        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
-                        {
-                            mapRelay.erase(vRelayExpiration.front().second);
-                            vRelayExpiration.pop_front();
-                        }
-
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
-                        if (ret.second) {
-                            vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
-                        }
-                    }
+                    pto->filterInventoryAnnounced.insert(hash);
                     if (vInv.size() == MAX_INV_SZ) {
                         pto->PushMessage(NetMsgType::INV, vInv);
                         vInv.clear();
@@ -7265,10 +9915,11 @@ bool SendMessages(CNode* pto)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nBlocksInTransitQuota = GetBlocksInTransitQuota(&state);
+        if (!fHeadersOnly && !pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlocksInTransitQuota) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInTransitQuota - state.nBlocksInFlight, vToDownload, staller, consensusParams);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -7277,8 +9928,14 @@ bool SendMessages(CNode* pto)
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState *stateStaller = State(staller);
+                if (stateStaller->nStallingSince == 0) {
+                    stateStaller->nStallingSince = nNow;
+                    // Should it catch up, it gets fewer of the blocks the window waits for
+                    if (stateStaller->nDownloadRate > 1) {
+                        nDownloadRateSum -= stateStaller->nDownloadRate - stateStaller->nDownloadRate / 2;
+                        stateStaller->nDownloadRate /= 2;
+                    }
                     LogPrint("net", "Stall started peer=%d\n", staller);
                 }
             }
@@ -7346,19 +10003,142 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
     return VersionBitsState(chainActive.Tip(), params, pos, versionbitscache);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nCount = 0;
+    int64_t nFailed = 0;
+    int64_t nExpired = 0;
+    int64_t nNow = GetTime();
+
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unknown mempool file version %u. Continuing anyway.\n", nVersion);
+            return false;
+        }
+        uint64_t nNum;
+        file >> nNum;
+        while (nNum--) {
+            CTransaction tx;
+            int64_t nTime;
+            double dPriorityDelta;
+            CAmount nFeeDelta;
+            file >> tx;
+            file >> nTime;
+            file >> dPriorityDelta;
+            file >> nFeeDelta;
+
+            // Applied before the transaction is accepted, so that it is
+            // judged with the fee it had in the mempool it was dumped from
+            if (dPriorityDelta != 0 || nFeeDelta != 0)
+                mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), dPriorityDelta, nFeeDelta);
+            if (nTime + nExpiryTimeout > nNow) {
+                // Takes cs_main per transaction, so that blocks and messages
+                // are processed in between while the file is loaded
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime))
+                    nCount++;
+                else
+                    nFailed++;
+            } else {
+                nExpired++;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+
+        // Prioritisations of transactions that were not in the mempool
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", nCount, nFailed, nExpired);
+    return true;
+}
+
+void DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<TxMempoolInfo> vInfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vInfo = mempool.infoAll();
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "wb");
+        if (!filestr) {
+            LogPrintf("Failed to open mempool.dat.new for writing\n");
+            return;
+        }
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t nVersion = MEMPOOL_DUMP_VERSION;
+        file << nVersion;
+        file << (uint64_t)vInfo.size();
+        // infoAll() lists parents before their children, the order they are
+        // accepted in again
+        BOOST_FOREACH(const TxMempoolInfo& info, vInfo) {
+            file << *(info.tx);
+            file << info.nTime;
+            std::map<uint256, std::pair<double, CAmount> >::iterator it = mapDeltas.find(info.tx->GetHash());
+            if (it != mapDeltas.end()) {
+                file << it->second.first;
+                file << it->second.second;
+                mapDeltas.erase(it);
+            } else {
+                file << 0.0;
+                file << CAmount(0);
+            }
+        }
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+    }
+}
+
 class CMainCleanup
 {
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
+        setOrphanTransactionsByExpiry.clear();
+        vOrphanList.clear();
+        mapLowFeeTransactions.clear();
     }
 } instance_of_cmaincleanup;
@@ -25,26 +25,35 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBloomFilter;
+class CCoinsViewWriter;
 class CChainParams;
+class CDBSnapshot;
+class CIndexDB;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
+class CUTXOSnapshotHeader;
+class CUTXOStats;
 class CValidationInterface;
 class CValidationState;
 
 struct PrecomputedTransactionData;
 struct CNodeStateStats;
+struct CRawBlock;
 struct LockPoints;
 
 /** Default for DEFAULT_WHITELISTRELAY. */
@@ -61,10 +70,14 @@ static const CAmount HIGH_TX_FEE_PER_KB = 0.01 * COIN;
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -blockreconstructionextratxn, transactions outside the mempool kept for compact block reconstruction */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** Expiration time for orphan transactions in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
-/** Minimum time between orphan transactions expire time checks in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Maximum number of transactions rejected for their fee kept for a child to pay for them */
+static const unsigned int MAX_LOW_FEE_TRANSACTIONS = 100;
+/** Maximum number of such parents a child may pay for in one package */
+static const unsigned int MAX_PACKAGE_PARENTS = 4;
 /** Default for -limitancestorcount, max number of in-mempool ancestors */
 static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
 /** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
@@ -75,6 +88,18 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between the runs of TrimMempool */
+static const int64_t MEMPOOL_TRIM_INTERVAL = 2;
+/** Percentage of -maxmempool a trim leaves free, so that the transactions after it do not each trigger another */
+static const unsigned int MEMPOOL_TRIM_HEADROOM_PERCENT = 5;
+/** Percentage over -maxmempool the mempool may grow between runs of TrimMempool before AcceptToMemoryPool trims it itself */
+static const unsigned int MEMPOOL_TRIM_OVERSHOOT_PERCENT = 10;
+/** Default for -maxmemory, in megabytes; 0 for no soft limit */
+static const unsigned int DEFAULT_MAX_MEMORY = 0;
+/** Seconds between the runs of CheckMemoryLimit */
+static const int64_t MEMORY_CHECK_INTERVAL = 10;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -83,16 +108,36 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 
 /** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+static const int MAX_SCRIPTCHECK_THREADS = 64;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads reading the inputs of a block being connected */
+static const int MAX_PREFETCH_THREADS = 16;
+/** -prefetchthreads default (threads reading the inputs of a block before it is connected, 0 = off) */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+/** -compressblocks default */
+static const bool DEFAULT_COMPRESS_BLOCKS = false;
+/** Maximum number of threads scanning block files during a reindex */
+static const int MAX_REINDEX_THREADS = 16;
+/** -reindexthreads default (threads scanning blk*.dat files at once during -reindex, 0 = sequential reindex) */
+static const int DEFAULT_REINDEX_THREADS = 4;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Fewest blocks in transit from a peer that downloads slower than our other peers */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+/** Most blocks in transit from a peer that downloads faster than our other peers */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER = 64;
+/** The download rate of a peer moves by 1/this of the difference to each new block's */
+static const int BLOCK_DOWNLOAD_RATE_SMOOTHING = 8;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Seconds a peer gets to answer for a headers segment before another peer is asked */
+static const int64_t HEADERS_SEGMENT_TIMEOUT = 60;
+/** Headers segments are only fetched up to this many blocks above our best header */
+static const int MAX_HEADERS_SEGMENT_AHEAD = 200000;
 /** Maximum depth of blocks we're willing to serve as compact blocks to peers
  *  when requested. For older blocks, a regular BLOCK response will be sent. */
 static const int MAX_CMPCTBLOCK_DEPTH = 5;
@@ -119,6 +164,10 @@ static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
 /** Maximum number of inventory items to send per transmission.
  *  Limits the impact of low-fee transaction floods. */
 static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Maximum number of transactions that left the mempool still served to the peers they were announced to */
+static const unsigned int MAX_RELAY_REMOVED_TX = 5000;
+/** How long such a transaction is served after it left the mempool, in seconds */
+static const int64_t RELAY_REMOVED_TX_EXPIRY = 15 * 60;
 /** Average delay between feefilter broadcasts in seconds. */
 static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
 /** Maximum feefilter broadcast delay after significant change. */
@@ -137,8 +186,13 @@ static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
 static const bool DEFAULT_ADDRESSINDEX = false;
+/** Default for -addressindexthreads, the threads a multi-address index query is spread over */
+static const int DEFAULT_ADDRESSINDEX_THREADS = 4;
+/** Maximum number of -addressindexthreads */
+static const int MAX_ADDRESSINDEX_THREADS = 64;
 static const bool DEFAULT_TIMESTAMPINDEX = false;
 static const bool DEFAULT_SPENTINDEX = false;
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
@@ -154,16 +208,26 @@ static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
 static const int MAX_UNCONNECTING_HEADERS = 10;
 
 static const bool DEFAULT_PEERBLOOMFILTERS = true;
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
 
-struct BlockHasher
-{
-    size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
-};
+/** Maximum number of filters a getcfilters message may ask for, BIP 157 */
+static const uint32_t MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of filter hashes a getcfheaders message may ask for, BIP 157 */
+static const uint32_t MAX_GETCFHEADERS_SIZE = 2000;
+/** Heights between the filter headers of a cfcheckpt message, BIP 157 */
+static const int CFCHECKPT_INTERVAL = 1000;
+
+/** Block hashes carry proof of work, nobody can grind them to collide. The block index stays
+ * node-based, as every CBlockIndex points at its key in phashBlock. */
+typedef CheapUint256Hasher BlockHasher;
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
+/** Guards the orphan transaction pool. Taken after cs_main, and held only around the pool's own bookkeeping. */
+extern CCriticalSection cs_orphans;
 extern CTxMemPool mempool;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+/** Changed holding cs_main and cs_blockindex (in main.cpp), so read it holding cs_main or through LookupBlockIndex */
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -174,14 +238,22 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
+extern int nReindexThreads;
 extern bool fTxIndex;
 extern bool fAddressIndex;
+extern int nAddressIndexThreads;
 extern bool fSpentIndex;
 extern bool fTimestampIndex;
+extern bool fBlockFilterIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
+/** Block whose ancestors, if it is in the best header chain and buried deep enough, need no script checks */
+extern uint256 hashAssumeValid;
+/** Whether blocks come from a trusted leader (-follow), whose proof of work and scripts are not checked again */
+extern bool fFollowLeader;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
@@ -194,6 +266,14 @@ extern bool fEnableReplacement;
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
 
+static const bool DEFAULT_HEADERSONLY = false;
+/** True if we're running in -headersonly mode: headers are synced, validated and served, blocks are never downloaded. */
+extern bool fHeadersOnly;
+
+static const bool DEFAULT_EARLY_BLOCK_RELAY = false;
+/** Announce new blocks to high-bandwidth compact block peers once their PoW and CheckBlock pass, before they are connected (BIP 152) */
+extern bool fEarlyBlockRelay;
+
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
 
@@ -202,6 +282,11 @@ static const uint64_t nMinDiskSpace = 52428800;
 extern bool fHavePruned;
 /** True if we're running in -prune mode. */
 extern bool fPruneMode;
+/** True if new blocks are written to the block files with CBlockCompressor where it is lossless (-compressblocks). */
+extern bool fCompressBlocks;
+/** True if the chainstate was loaded from a UTXO snapshot; the blocks below it were never
+ * downloaded and are treated as pruned. */
+extern bool fSnapshotChain;
 /** Number of MiB of block files that we're trying to stay below. */
 extern uint64_t nPruneTarget;
 /** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned. */
@@ -250,6 +335,12 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/**
+ * Rebuild the block index from all blk*.dat files. The files are scanned on nReindexThreads
+ * threads, which run the context-free checks; the headers are then indexed in parent order and
+ * the blocks are left to ActivateBestChain, which finishes their contextual checks as it connects them.
+ */
+bool ReindexBlockFiles(const CChainParams& chainparams);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -264,8 +355,12 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   pto             The node which we are sending messages to.
  */
 bool SendMessages(CNode* pto);
-/** Run an instance of the script checking thread */
-void ThreadScriptCheck();
+/** Run a script check worker, pinned to CPU nCpu unless it is negative */
+void ThreadScriptCheck(int nCpu);
+/** Run a script check worker for transactions entering the mempool, pinned like ThreadScriptCheck */
+void ThreadMempoolScriptCheck(int nCpu);
+/** Run an instance of the header PoW checking thread */
+void ThreadHeaderCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -291,7 +386,8 @@ CAmount GetBlockSubsidy(int nHeight, uint64_t nNonce, const Consensus::Params& c
  * Pruning functions are called from FlushStateToDisk when the global fCheckForPruning flag has been set.
  * Block and undo files are deleted in lock-step (when blk00003.dat is deleted, so is rev00003.dat.)
  * Pruning cannot take place until the longest chain is at least a certain length (100000 on mainnet, 1000 on testnet, 1000 on regtest).
- * Pruning will never delete a block within a defined distance (currently 288) from the active chain's tip.
+ * Pruning will never delete a block within a defined distance (currently 288) from the active chain's tip,
+ * nor one a background index build has yet to read. The indexes themselves are kept.
  * The block index is updated by unsetting HAVE_DATA and HAVE_UNDO for any blocks that were stored in the deleted files.
  * A db flag records the fact that at least some block files have been pruned.
  *
@@ -300,25 +396,94 @@ CAmount GetBlockSubsidy(int nHeight, uint64_t nNonce, const Consensus::Params& c
 void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfterHeight);
 
 /**
- *  Actually unlink the specified files
+ *  Actually unlink the specified files, on the block store writer thread
  */
 void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 
+/** Prune block files up to nManualPruneHeight, keeping the last MIN_BLOCKS_TO_KEEP blocks */
+void PruneBlockFilesManual(int nManualPruneHeight);
+
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
+/**
+ * The block index entry of hash, or NULL, without waiting for cs_main. The
+ * header fields of an entry never change once it is added; its status and
+ * chain fields still require cs_main.
+ */
+CBlockIndex* LookupBlockIndex(const uint256& hash);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+typedef std::map<NodeId, CNodeStateStats> NodeStateStatsMap;
+/**
+ * The statistics of every peer as of about a second ago, for readers that should
+ * not wait for cs_main, like the GUI; never NULL. Peers connected since are missing.
+ */
+std::shared_ptr<const NodeStateStatsMap> GetNodeStateStatsSnapshot();
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
+/**
+ * Make the UTXO snapshot at path the chainstate of a node that has the headers up to its
+ * block but no blocks past genesis. The blocks below the snapshot become like pruned ones,
+ * valid with their data gone. If hashExpected is not null the snapshot hash must match it.
+ */
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CUTXOSnapshotHeader& header, std::string& strError);
+/** The statistics of the UTXO set at the best block of pcoinsTip, false while they are not known (requires cs_main) */
+bool GetTipUTXOStats(CUTXOStats& stats);
+/** Follow the UTXO set from stats on, which must be for the best block of pcoinsTip (requires cs_main) */
+void SetTipUTXOStats(const CUTXOStats& stats);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
 
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
+
+/** Expire old transactions and trim the mempool to -maxmempool; run by the scheduler every MEMPOOL_TRIM_INTERVAL */
+void TrimMempool();
+
+/** The memory the main structures of the node take, in bytes, as memusage.h and their own accounting estimate it */
+struct CNodeMemoryUsage
+{
+    size_t nCoinsCache;
+    size_t nMempool;
+    size_t nBlockIndex;     //!< mapBlockIndex and its entries
+    size_t nLevelDB;        //!< The write buffers and block caches of the open databases
+    size_t nSigCache;
+    size_t nScriptCache;
+    size_t nEthashLight;
+    size_t nEthashDAG;      //!< Including DAGs mapped from their files
+    size_t nPeerSend;       //!< Messages queued to send to peers
+    size_t nPeerRecv;       //!< Messages received from peers, with the idle buffers kept for reuse
+
+    CNodeMemoryUsage() : nCoinsCache(0), nMempool(0), nBlockIndex(0), nLevelDB(0), nSigCache(0), nScriptCache(0),
+                         nEthashLight(0), nEthashDAG(0), nPeerSend(0), nPeerRecv(0) {}
+
+    size_t Total() const
+    {
+        return nCoinsCache + nMempool + nBlockIndex + nLevelDB + nSigCache + nScriptCache + nEthashLight + nEthashDAG + nPeerSend + nPeerRecv;
+    }
+};
+
+CNodeMemoryUsage GetNodeMemoryUsage();
+/**
+ * Compare GetNodeMemoryUsage to -maxmemory and, over it, evict the Ethash light
+ * caches the budget allows to and have the next FlushStateToDisk flush the coins
+ * cache; run by the scheduler every MEMORY_CHECK_INTERVAL when -maxmemory is set
+ */
+void CheckMemoryLimit();
+
+/** Dump the mempool, with its entry times and prioritisations, to mempool.dat */
+void DumpMempool();
+
+/** Add the transactions of mempool.dat to the mempool; false if the file was missing, unreadable or cut short by shutdown */
+bool LoadMempool();
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -330,6 +495,8 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int64_t nDownloadRate;
+    int nBlocksInTransitQuota;
 };
 
 
@@ -362,10 +529,129 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. cacheSigStore stores valid signatures in the signature cache;
+ * cacheFullScriptStore records that all scripts passed with these flags, so that they are skipped
+ * the next time (only when they ran inline). Script checks require cs_main to be held.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata,
+                 std::vector<CScriptCheck> *pvChecks = NULL);
+
+/** Initializes the script execution cache from -maxsigcachesize */
+void InitScriptExecutionCache();
+
+/** Lookups of the script execution cache since startup, guarded by cs_main */
+struct CScriptExecutionCacheStats
+{
+    uint64_t nLookups;
+    uint64_t nHits;
+    uint64_t nInserts;
+    //! Bytes the cache table takes
+    size_t nMemoryUsage;
+
+    CScriptExecutionCacheStats() : nLookups(0), nHits(0), nInserts(0), nMemoryUsage(0) {}
+};
+
+/** Time ConnectBlock spent in each of its phases, in microseconds */
+struct CBlockConnectTimes
+{
+    int64_t nCheck;     //!< CheckBlock and the checkpoint lookup
+    int64_t nForks;     //!< BIP30 and the script flags
+    int64_t nInputs;    //!< Checking and spending the inputs, handing their scripts to the check queue
+    int64_t nScripts;   //!< Waiting for the script checks left after the last input
+    int64_t nUndo;      //!< Writing the undo data
+    int64_t nIndex;     //!< Handing the index updates to the index writer
+    int64_t nCallbacks; //!< Notifications and orphan cleanup
+
+    CBlockConnectTimes() : nCheck(0), nForks(0), nInputs(0), nScripts(0), nUndo(0), nIndex(0), nCallbacks(0) {}
+};
+
+/** What ConnectBlock did since startup; the totals include blocks that were only checked */
+struct CBlockConnectStats
+{
+    uint64_t nBlocks;
+    uint64_t nBlocksChecked;
+    uint64_t nInputs;
+    CBlockConnectTimes total;
+    //! The phases of the last block connected, at nLastHeight
+    CBlockConnectTimes last;
+    int nLastHeight;
+
+    CBlockConnectStats() : nBlocks(0), nBlocksChecked(0), nInputs(0), nLastHeight(-1) {}
+};
+
+/** How many of the last blocks connected to the tip GetBlockLatencyHistory remembers */
+static const unsigned int BLOCK_LATENCY_HISTORY = 1000;
+
+/** Where the time went when one block was connected to the tip, in microseconds */
+struct CBlockLatency
+{
+    int nHeight;
+    uint256 hash;
+    int64_t nTime;          //!< When it was connected, in seconds since the epoch
+    unsigned int nTx;
+    int64_t nPoW;           //!< Checking the Ethash proof of work, when the block arrived; not part of nTotal
+    int64_t nRead;          //!< Loading the block from disk or taking it from the read-ahead
+    int64_t nPrefetch;      //!< Loading its inputs into the coins cache
+    int64_t nConnect;       //!< ConnectBlock, split into its phases in connect
+    CBlockConnectTimes connect;
+    int64_t nFlush;         //!< Flushing its coins into pcoinsTip
+    int64_t nChainState;    //!< FlushStateToDisk, with the index and coins database writes
+    int64_t nTip;           //!< Updating the mempool and the tip
+    int64_t nCallbacks;     //!< The validation interface: BlockChecked and the wallet notifications
+    int64_t nTotal;         //!< All of ConnectTip
+
+    CBlockLatency() : nHeight(-1), nTime(0), nTx(0), nPoW(0), nRead(0), nPrefetch(0), nConnect(0), nFlush(0),
+                      nChainState(0), nTip(0), nCallbacks(0), nTotal(0) {}
+};
+
+/** How compact blocks fared since startup, as sender and as receiver */
+struct CCompactBlockStats
+{
+    //! Compact blocks sent
+    uint64_t nSent;
+    //! ... of which with transactions prefilled because the peer was predicted to lack them
+    uint64_t nSentPredicted;
+    //! Transactions prefilled besides the coinbase
+    uint64_t nPrefilledTxSent;
+    //! getblocktxn requests answered, each for transactions we did not predict
+    uint64_t nBlockTxnRequestsReceived;
+    uint64_t nBlockTxnTxSent;
+    //! Compact blocks received for blocks we were fetching from the peer
+    uint64_t nReceived;
+    uint64_t nPrefilledTxReceived;
+    //! ... rebuilt from the prefilled transactions and our mempool alone
+    uint64_t nReconstructed;
+    //! ... rebuilt after asking for the missing transactions with getblocktxn
+    uint64_t nReconstructedAfterRequest;
+    uint64_t nBlockTxnTxRequested;
+    //! ... fetched as full blocks after all, after short ID collisions
+    uint64_t nFailed;
+
+    CCompactBlockStats() : nSent(0), nSentPredicted(0), nPrefilledTxSent(0), nBlockTxnRequestsReceived(0), nBlockTxnTxSent(0),
+                           nReceived(0), nPrefilledTxReceived(0), nReconstructed(0), nReconstructedAfterRequest(0),
+                           nBlockTxnTxRequested(0), nFailed(0) {}
+};
+
+CCompactBlockStats GetCompactBlockStats();
+
+/**
+ * The payload of a block message for block, for nType MSG_BLOCK or
+ * MSG_WITNESS_BLOCK, shared with peers that are sent the block: the one
+ * serialized for them already, else serialized now and kept for them.
+ */
+CSharedPayloadRef GetBlockPayload(const CBlock& block, int nType);
+/** The payload of the block with this hash if one was serialized recently, else a null reference */
+CSharedPayloadRef GetRecentBlockPayload(const uint256& hash, int nType);
+
+struct CCheckQueueStats;
+
+CScriptExecutionCacheStats GetScriptExecutionCacheStats();
+CBlockConnectStats GetBlockConnectStats();
+/** The phases of the last BLOCK_LATENCY_HISTORY blocks connected to the tip, oldest first */
+std::vector<CBlockLatency> GetBlockLatencyHistory();
+/** The counters of the script check queue of ConnectBlock, or of the mempool one */
+void GetScriptCheckQueueStats(CCheckQueueStats& stats, bool fMempool);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -449,24 +735,90 @@ public:
 
     ScriptError GetScriptError() const { return error; }
 };
+/**
+ * Closure representing the Ethash evaluation of one block header, so that the
+ * proofs of work of a whole headers message can be computed in parallel.
+ */
+class CHeaderPoWCheck
+{
+private:
+    const CBlockHeader *pheader;
+    uint256 *phashPoW;
+
+public:
+    CHeaderPoWCheck(): pheader(NULL), phashPoW(NULL) {}
+    CHeaderPoWCheck(const CBlockHeader& headerIn, uint256& hashPoWOut) :
+        pheader(&headerIn), phashPoW(&hashPoWOut) { }
+
+    bool operator()();
+
+    void swap(CHeaderPoWCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(phashPoW, check.phashPoW);
+    }
+};
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes);
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
+/** Where each of keys is spent, in the mempool or the chain; values[i] is null for an unspent output */
+bool GetSpentIndex(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values);
 bool HashOnChainActive(const uint256 &hash);
 bool GetAddressIndex(uint160 addressHash, int type,
                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                     int start = 0, int end = 0);
+/** Read the address index entries of several addresses in parallel, merged in height order */
+bool GetAddressIndex(const std::vector<std::pair<uint160, int> > &addresses,
+                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                     int start = 0, int end = 0, const CDBSnapshot *pSnapshot = NULL);
+bool GetAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &balance);
+/** Pass the address index entries of an address to fn in key order, starting at pFrom if given, until fn returns false.
+ * Reads pSnapshot if given, the index as of now otherwise; the same goes for the calls below. */
+bool ScanAddressIndex(uint160 addressHash, int type, const boost::function<bool(const CAddressIndexKey&, CAmount)> &fn,
+                      int start = 0, int end = 0, const CAddressIndexKey *pFrom = NULL, const CDBSnapshot *pSnapshot = NULL);
+/** Pass the unspent outputs of an address to fn in key order, starting at pFrom if given, until fn returns false */
+bool ScanAddressUnspent(uint160 addressHash, int type, const boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> &fn,
+                        const CAddressUnspentKey *pFrom = NULL, const CDBSnapshot *pSnapshot = NULL);
 bool GetAddressUnspent(uint160 addressHash, int type,
                      std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
+/** Read the unspent outputs of several addresses in parallel, merged in height order */
+bool GetAddressUnspent(const std::vector<std::pair<uint160, int> > &addresses,
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                       const CDBSnapshot *pSnapshot = NULL);
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** The size a block written now takes in its block file record, after the message start and the size field */
+unsigned int GetStoredBlockSize(const CBlock& block);
+/** Append the block file record of block to s: the message start, the size, with BLOCK_RECORD_COMPRESSED set when the block is
+ * compressed, and the block */
+void SerializeBlockRecord(CDataStream& s, const CBlock& block, const CMessageHeader::MessageStartChars& messageStart);
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPOW = true);
+/** Read the block of pindex. The Ethash PoW is only recomputed if it was not verified before, or if fForceCheckPOW is set. */
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams, bool fForceCheckPOW = false);
+/** Read the serialized block at pos, without deserializing it when it is stored uncompressed. Its bytes are
+ * referenced in place when its file is mapped and copied into block.vchData otherwise. */
+bool ReadRawBlockFromDisk(CRawBlock& block, const CDiskBlockPos& pos);
+/** Read the serialized block of pindex. Only its header is deserialized, to check it
+ * against pindex and to recompute the Ethash PoW if it was not verified before. */
+bool ReadRawBlockFromDisk(CRawBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** As above, for the position and status of an index entry copied under cs_main, so that
+ * the read itself doesn't need cs_main. Fails if the block was pruned since. */
+bool ReadRawBlockFromDisk(CRawBlock& block, const CDiskBlockPos& pos, const uint256& hash, bool fCheckPOW, const Consensus::Params& consensusParams);
+/** Write the undo data of a block into the record FindUndoPos reserved at pos, which is changed to
+ * where the undo data is. hashBlock is the hash of the parent of the block it belongs to. */
+bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart);
+/** Read the undo data at pos, hashBlock is the hash of the parent of the block it belongs to */
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 /** Functions for validating blocks and updating the block tree */
 
 /** Context-independent validity checks */
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true);
+/**
+ * If phashPoW is not NULL and already holds an Ethash result (e.g. computed by
+ * CHeaderPoWCheck), that result is checked instead of evaluating the header.
+ * Otherwise it receives the result computed for the PoW check.
+ */
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, uint256* phashPoW = NULL);
 bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
 /** Context-dependent validity checks.
@@ -477,15 +829,18 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
- *  can fail if those validity checks fail (among other reasons). */
+ *  can fail if those validity checks fail (among other reasons). If pblockundo is
+ *  given it receives a copy of the undo data of the block. */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins,
-                  const CChainParams& chainparams, bool fJustCheck = false);
+                  const CChainParams& chainparams, bool fJustCheck = false, CBlockUndo* pblockundo = NULL);
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. The undo data is read
+ *  from disk unless pblockundo is given. */
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL,
+                     const CBlockUndo* pblockundo = NULL);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
@@ -522,12 +877,65 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex);
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
+/** The chain of headers up to pindexBestHeader, only kept in -headersonly mode (protected by cs_main). */
+extern CChain chainHeaders;
+
+/** The chain headers are served and announced from: chainHeaders in -headersonly mode, chainActive otherwise. Requires cs_main. */
+CChain& HeadersChain();
+
+/**
+ * The tip of chainActive as of its last change, for readers that should not
+ * wait for cs_main. Block index entries are kept until shutdown and their
+ * ancestry never changes, so the chain the tip ends can be walked without
+ * locks.
+ */
+struct CChainTipSnapshot
+{
+    //! NULL before the block index is loaded
+    const CBlockIndex* pindex;
+    int nHeight;
+    uint256 hashBlock;
+    arith_uint256 nChainWork;
+    int64_t nMedianTimePast;
+
+    CChainTipSnapshot() : pindex(NULL), nHeight(-1), nMedianTimePast(0) {}
+
+    /** The block at height nHeightIn of this chain, or NULL */
+    const CBlockIndex* operator[](int nHeightIn) const {
+        if (pindex == NULL || nHeightIn < 0 || nHeightIn > nHeight)
+            return NULL;
+        return pindex->GetAncestor(nHeightIn);
+    }
+
+    bool Contains(const CBlockIndex* pindexIn) const {
+        return (*this)[pindexIn->nHeight] == pindexIn;
+    }
+
+    /** The successor of pindexIn on this chain, or NULL */
+    const CBlockIndex* Next(const CBlockIndex* pindexIn) const {
+        return Contains(pindexIn) ? (*this)[pindexIn->nHeight + 1] : NULL;
+    }
+};
+
+/** The latest tip snapshot; never NULL */
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot();
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the view writing the flushes of pcoinsTip to the coin database */
+extern CCoinsViewWriter *pcoinswriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variables that point to the optional index databases, written by the index writer */
+extern CIndexDB *ptxindexdb;
+extern CIndexDB *paddressindexdb;
+extern CIndexDB *pspentindexdb;
+extern CIndexDB *ptimestampindexdb;
+extern CIndexDB *pblockfilterdb;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -0,0 +1,206 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mempoolindex.h"
+
+#include "hash.h"
+#include "random.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+CMempoolIndexHasher::CMempoolIndexHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t CMempoolIndexHasher::operator()(const std::pair<int, uint160>& address) const
+{
+    unsigned char type = address.first;
+    return CSipHasher(k0, k1).Write(address.second.begin(), address.second.size()).Write(&type, 1).Finalize();
+}
+
+size_t CMempoolIndexHasher::operator()(const CSpentIndexKey& key) const
+{
+    return SipHashUint256(k0, k1 ^ key.outputIndex, key.txid);
+}
+
+static bool DeltaKeyEqual(const CMempoolAddressDeltaKey& a, const CMempoolAddressDeltaKey& b)
+{
+    return a.txhash == b.txhash && a.index == b.index && a.spending == b.spending;
+}
+
+static bool DeltaKeyLess(const CMempoolAddressDeltaKey& a, const CMempoolAddressDeltaKey& b)
+{
+    return CMempoolAddressDeltaKeyCompare()(a, b);
+}
+
+static bool DeltaLess(const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& a, const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& b)
+{
+    return DeltaKeyLess(a.first, b.first);
+}
+
+static bool DeltaEqual(const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& a, const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& b)
+{
+    return DeltaKeyEqual(a.first, b.first);
+}
+
+static bool SameAddress(const CMempoolAddressDeltaKey& a, const CMempoolAddressDeltaKey& b)
+{
+    return a.type == b.type && a.addressBytes == b.addressBytes;
+}
+
+void CMempoolAddressIndex::Add(const deltas_type& deltas)
+{
+    deltas_type sorted(deltas);
+    std::sort(sorted.begin(), sorted.end(), DeltaLess);
+
+    // One new list per address, however many deltas of the transaction it has
+    deltas_type::const_iterator it = sorted.begin();
+    while (it != sorted.end()) {
+        deltas_type::const_iterator itEnd = it;
+        while (itEnd != sorted.end() && SameAddress(itEnd->first, it->first))
+            ++itEnd;
+
+        address_type address(it->first.type, it->first.addressBytes);
+        Shard& shard = GetShard(address);
+        LOCK(shard.cs);
+        snapshot_type& list = shard.map[address];
+        boost::shared_ptr<deltas_type> updated(new deltas_type());
+        if (list) {
+            updated->reserve(list->size() + (itEnd - it));
+            std::merge(list->begin(), list->end(), it, itEnd, std::back_inserter(*updated), DeltaLess);
+            updated->erase(std::unique(updated->begin(), updated->end(), DeltaEqual), updated->end());
+        } else {
+            updated->assign(it, itEnd);
+        }
+        list = updated;
+        it = itEnd;
+    }
+}
+
+void CMempoolAddressIndex::Remove(const std::vector<CMempoolAddressDeltaKey>& keys, deltas_type* pRemoved)
+{
+    std::vector<CMempoolAddressDeltaKey> sorted(keys);
+    std::sort(sorted.begin(), sorted.end(), DeltaKeyLess);
+
+    std::vector<CMempoolAddressDeltaKey>::const_iterator it = sorted.begin();
+    while (it != sorted.end()) {
+        std::vector<CMempoolAddressDeltaKey>::const_iterator itEnd = it;
+        while (itEnd != sorted.end() && SameAddress(*itEnd, *it))
+            ++itEnd;
+
+        address_type address(it->type, it->addressBytes);
+        Shard& shard = GetShard(address);
+        LOCK(shard.cs);
+        map_type::iterator mi = shard.map.find(address);
+        if (mi != shard.map.end()) {
+            boost::shared_ptr<deltas_type> updated(new deltas_type());
+            updated->reserve(mi->second->size());
+            // Both are sorted, drop the entries of the removed keys in one pass
+            std::vector<CMempoolAddressDeltaKey>::const_iterator ki = it;
+            for (deltas_type::const_iterator di = mi->second->begin(); di != mi->second->end(); ++di) {
+                while (ki != itEnd && DeltaKeyLess(*ki, di->first))
+                    ++ki;
+                if (ki == itEnd || !DeltaKeyEqual(*ki, di->first))
+                    updated->push_back(*di);
+                else if (pRemoved)
+                    pRemoved->push_back(*di);
+            }
+            if (updated->empty())
+                shard.map.erase(mi);
+            else
+                mi->second = updated;
+        }
+        it = itEnd;
+    }
+}
+
+CMempoolAddressIndex::snapshot_type CMempoolAddressIndex::Get(const uint160& addressHash, int type) const
+{
+    static const snapshot_type empty(new deltas_type());
+    address_type address(type, addressHash);
+    const Shard& shard = GetShard(address);
+    LOCK(shard.cs);
+    map_type::const_iterator mi = shard.map.find(address);
+    if (mi == shard.map.end())
+        return empty;
+    return mi->second;
+}
+
+void CMempoolAddressIndex::Clear()
+{
+    for (unsigned int i = 0; i < MEMPOOL_INDEX_SHARDS; i++) {
+        LOCK(shards[i].cs);
+        shards[i].map.clear();
+    }
+}
+
+size_t CMempoolAddressIndex::GetAddressCount() const
+{
+    size_t nCount = 0;
+    for (unsigned int i = 0; i < MEMPOOL_INDEX_SHARDS; i++) {
+        LOCK(shards[i].cs);
+        nCount += shards[i].map.size();
+    }
+    return nCount;
+}
+
+void CMempoolSpentIndex::Add(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& spent)
+{
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = spent.begin(); it != spent.end(); ++it) {
+        Shard& shard = GetShard(it->first);
+        LOCK(shard.cs);
+        shard.map[it->first] = it->second;
+    }
+}
+
+void CMempoolSpentIndex::Remove(const uint256& txid, const std::vector<CSpentIndexKey>& keys)
+{
+    for (std::vector<CSpentIndexKey>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+        Shard& shard = GetShard(*it);
+        LOCK(shard.cs);
+        // Leave the entry alone if another transaction spends the output by now
+        map_type::iterator mi = shard.map.find(*it);
+        if (mi != shard.map.end() && mi->second.txid == txid)
+            shard.map.erase(mi);
+    }
+}
+
+bool CMempoolSpentIndex::Get(const CSpentIndexKey& key, CSpentIndexValue& value) const
+{
+    const Shard& shard = GetShard(key);
+    LOCK(shard.cs);
+    map_type::const_iterator mi = shard.map.find(key);
+    if (mi == shard.map.end())
+        return false;
+    value = mi->second;
+    return true;
+}
+
+void CMempoolSpentIndex::Get(const std::vector<CSpentIndexKey>& vKeys, std::vector<CSpentIndexValue>& vValues) const
+{
+    vValues.resize(vKeys.size());
+    std::vector<std::vector<size_t> > vByShard(MEMPOOL_INDEX_SHARDS);
+    for (size_t i = 0; i < vKeys.size(); i++)
+        vByShard[hasher.Shard(hasher(vKeys[i]))].push_back(i);
+
+    for (unsigned int nShard = 0; nShard < MEMPOOL_INDEX_SHARDS; nShard++) {
+        if (vByShard[nShard].empty())
+            continue;
+        const Shard& shard = shards[nShard];
+        LOCK(shard.cs);
+        for (size_t i : vByShard[nShard]) {
+            map_type::const_iterator mi = shard.map.find(vKeys[i]);
+            if (mi != shard.map.end())
+                vValues[i] = mi->second;
+        }
+    }
+}
+
+void CMempoolSpentIndex::Clear()
+{
+    for (unsigned int i = 0; i < MEMPOOL_INDEX_SHARDS; i++) {
+        LOCK(shards[i].cs);
+        shards[i].map.clear();
+    }
+}
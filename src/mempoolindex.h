@@ -0,0 +1,121 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMPOOLINDEX_H
+#define BITCOIN_MEMPOOLINDEX_H
+
+#include "addressindex.h"
+#include "spentindex.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+/** Number of independently locked shards of the mempool address and spent indexes */
+static const unsigned int MEMPOOL_INDEX_SHARDS = 16;
+
+/** Salted hash of an address or an outpoint, the top bits pick the shard */
+class CMempoolIndexHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    CMempoolIndexHasher();
+
+    size_t operator()(const std::pair<int, uint160>& address) const;
+    size_t operator()(const CSpentIndexKey& key) const;
+    unsigned int Shard(size_t nHash) const { return (nHash >> (sizeof(size_t) * 8 - 4)) % MEMPOOL_INDEX_SHARDS; }
+};
+
+struct CSpentIndexKeyEqual
+{
+    bool operator()(const CSpentIndexKey& a, const CSpentIndexKey& b) const {
+        return a.txid == b.txid && a.outputIndex == b.outputIndex;
+    }
+};
+
+/**
+ * The address deltas of the mempool transactions, hashed by address.
+ *
+ * Every address maps to an immutable, sorted list of its deltas. Writers replace
+ * the list of an address under the lock of its shard, readers only take that lock
+ * to copy the pointer. A list handed out stays valid and unchanged however the
+ * mempool changes afterwards, so queries never hold mempool.cs or a shard lock
+ * while they work through the result.
+ */
+class CMempoolAddressIndex
+{
+public:
+    typedef std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > deltas_type;
+    typedef boost::shared_ptr<const deltas_type> snapshot_type;
+
+    /** Add the deltas of a transaction */
+    void Add(const deltas_type& deltas);
+    /** Remove the deltas of a transaction, by the keys Add was given, appending them to pRemoved if not NULL */
+    void Remove(const std::vector<CMempoolAddressDeltaKey>& keys, deltas_type* pRemoved = NULL);
+    /** The deltas of an address, ordered by CMempoolAddressDeltaKeyCompare; never NULL */
+    snapshot_type Get(const uint160& addressHash, int type) const;
+    void Clear();
+    size_t GetAddressCount() const;
+
+private:
+    typedef std::pair<int, uint160> address_type;
+    typedef boost::unordered_map<address_type, snapshot_type, CMempoolIndexHasher> map_type;
+
+    struct Shard {
+        mutable CCriticalSection cs;
+        map_type map;
+    };
+
+    CMempoolIndexHasher hasher;
+    Shard shards[MEMPOOL_INDEX_SHARDS];
+
+    Shard& GetShard(const address_type& address) { return shards[hasher.Shard(hasher(address))]; }
+    const Shard& GetShard(const address_type& address) const { return shards[hasher.Shard(hasher(address))]; }
+};
+
+/** The address deltas of a transaction added to or removed from the mempool, see CMainSignals::UpdatedMempoolAddresses */
+struct CMempoolAddressUpdate
+{
+    bool fAdded;
+    uint256 txhash;
+    CMempoolAddressIndex::deltas_type deltas;
+
+    CMempoolAddressUpdate(bool fAddedIn, const uint256& txhashIn) : fAdded(fAddedIn), txhash(txhashIn) {}
+};
+
+/** The outputs spent by mempool transactions, hashed by outpoint and sharded like CMempoolAddressIndex */
+class CMempoolSpentIndex
+{
+public:
+    void Add(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& spent);
+    /** Remove the outputs spent by a transaction */
+    void Remove(const uint256& txid, const std::vector<CSpentIndexKey>& keys);
+    bool Get(const CSpentIndexKey& key, CSpentIndexValue& value) const;
+    /** Look up many outputs taking every shard lock at most once, vValues[i] stays null for a miss */
+    void Get(const std::vector<CSpentIndexKey>& vKeys, std::vector<CSpentIndexValue>& vValues) const;
+    void Clear();
+
+private:
+    typedef boost::unordered_map<CSpentIndexKey, CSpentIndexValue, CMempoolIndexHasher, CSpentIndexKeyEqual> map_type;
+
+    struct Shard {
+        mutable CCriticalSection cs;
+        map_type map;
+    };
+
+    CMempoolIndexHasher hasher;
+    Shard shards[MEMPOOL_INDEX_SHARDS];
+
+    Shard& GetShard(const CSpentIndexKey& key) { return shards[hasher.Shard(hasher(key))]; }
+    const Shard& GetShard(const CSpentIndexKey& key) const { return shards[hasher.Shard(hasher(key))]; }
+};
+
+#endif // BITCOIN_MEMPOOLINDEX_H
@@ -6,11 +6,14 @@
 #define BITCOIN_MEMUSAGE_H
 
 #include "indirectmap.h"
+#include "prevector.h"
+#include "support/allocators/pool.h"
 
 #include <stdlib.h>
 
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -117,6 +120,12 @@ static inline size_t IncrementalDynamicUsage(const std::map<X, Y, Z>& m)
     return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >));
 }
 
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::multimap<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
 // indirectmap has underlying map with pointer as key
 
 template<typename X, typename Y>
@@ -167,6 +176,24 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+// The standard hashed containers have nodes and buckets laid out as the boost ones
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::unordered_map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+/** The nodes of a map with a pool take the chunks of the pool, whether in use or given back */
+template<typename X, typename Y, typename Z, typename E>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, E, pool_allocator<std::pair<const X, Y> > >& m)
+{
+    const PoolResource* resource = m.get_allocator().resource;
+    if (resource == NULL)
+        return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+    return resource->DynamicMemoryUsage() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
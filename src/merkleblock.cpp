@@ -23,8 +23,8 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const uint256& hash = block.vtx[i].GetHash();
-        if (filter.IsRelevantAndUpdate(block.vtx[i]))
+        const uint256& hash = block.vtx[i]->GetHash();
+        if (filter.IsRelevantAndUpdate(*block.vtx[i]))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(make_pair(i, hash));
@@ -37,6 +37,49 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlockData::CMerkleBlockData(const CBlock& block) : header(block.GetBlockHeader()), vtx(block.vtx)
+{
+    vElements.reserve(vtx.size());
+    vTree.resize(1);
+    vTree[0].reserve(vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        vElements.push_back(CTxDataElements(*vtx[i]));
+        vTree[0].push_back(vtx[i]->GetHash());
+    }
+    // Every level up to the root, the last node of an odd level paired with itself
+    while (vTree.back().size() > 1) {
+        const std::vector<uint256>& vLevel = vTree.back();
+        std::vector<uint256> vNext((vLevel.size() + 1) / 2);
+        for (unsigned int pos = 0; pos < vNext.size(); pos++) {
+            const uint256& left = vLevel[pos * 2];
+            const uint256& right = pos * 2 + 1 < vLevel.size() ? vLevel[pos * 2 + 1] : left;
+            vNext[pos] = Hash(BEGIN(left), END(left), BEGIN(right), END(right));
+        }
+        vTree.push_back(vNext);
+    }
+}
+
+CMerkleBlock::CMerkleBlock(const CMerkleBlockData& data, CBloomFilter& filter)
+{
+    header = data.header;
+
+    vector<bool> vMatch;
+    vMatch.reserve(data.vtx.size());
+
+    for (unsigned int i = 0; i < data.vtx.size(); i++)
+    {
+        if (filter.IsRelevantAndUpdate(*data.vtx[i], data.vElements[i]))
+        {
+            vMatch.push_back(true);
+            vMatchedTxn.push_back(make_pair(i, data.vTree[0][i]));
+        }
+        else
+            vMatch.push_back(false);
+    }
+
+    txn = CPartialMerkleTree(data.vTree, vMatch);
+}
+
 CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
 {
     header = block.GetBlockHeader();
@@ -49,7 +92,7 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const uint256& hash = block.vtx[i].GetHash();
+        const uint256& hash = block.vtx[i]->GetHash();
         if (txids.count(hash))
             vMatch.push_back(true);
         else
@@ -77,7 +120,7 @@ uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::ve
     }
 }
 
-void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) {
+void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch, const std::vector<std::vector<uint256> > *pTree) {
     // determine whether this node is the parent of at least one matched txid
     bool fParentOfMatch = false;
     for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
@@ -86,12 +129,12 @@ void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const st
     vBits.push_back(fParentOfMatch);
     if (height==0 || !fParentOfMatch) {
         // if at height 0, or nothing interesting below, store hash and stop
-        vHash.push_back(CalcHash(height, pos, vTxid));
+        vHash.push_back(pTree ? (*pTree)[height][pos] : CalcHash(height, pos, vTxid));
     } else {
         // otherwise, don't store any hash, but descend into the subtrees
-        TraverseAndBuild(height-1, pos*2, vTxid, vMatch);
+        TraverseAndBuild(height-1, pos*2, vTxid, vMatch, pTree);
         if (pos*2+1 < CalcTreeWidth(height-1))
-            TraverseAndBuild(height-1, pos*2+1, vTxid, vMatch);
+            TraverseAndBuild(height-1, pos*2+1, vTxid, vMatch, pTree);
     }
 }
 
@@ -147,6 +190,12 @@ CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const
     TraverseAndBuild(nHeight, 0, vTxid, vMatch);
 }
 
+CPartialMerkleTree::CPartialMerkleTree(const std::vector<std::vector<uint256> > &vTree, const std::vector<bool> &vMatch) : nTransactions(vTree[0].size()), fBad(false) {
+    // the tree holds the nodes at every height, so none has to be hashed here
+    int nHeight = vTree.size() - 1;
+    TraverseAndBuild(nHeight, 0, vTree[0], vMatch, &vTree);
+}
+
 CPartialMerkleTree::CPartialMerkleTree() : nTransactions(0), fBad(true) {}
 
 uint256 CPartialMerkleTree::ExtractMatches(std::vector<uint256> &vMatch, std::vector<unsigned int> &vnIndex) {
@@ -70,8 +70,8 @@ protected:
     /** calculate the hash of a node in the merkle tree (at leaf level: the txid's themselves) */
     uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid);
 
-    /** recursive function that traverses tree nodes, storing the data as bits and hashes */
-    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    /** recursive function that traverses tree nodes, storing the data as bits and hashes; the hashes come from pTree, if given, instead of CalcHash */
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch, const std::vector<std::vector<uint256> > *pTree = NULL);
 
     /**
      * recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
@@ -107,6 +107,9 @@ public:
     /** Construct a partial merkle tree from a list of transaction ids, and a mask that selects a subset of them */
     CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
 
+    /** The same, from the nodes of the whole tree by height, as CMerkleBlockData keeps them: vTree[0] holds the txids */
+    CPartialMerkleTree(const std::vector<std::vector<uint256> > &vTree, const std::vector<bool> &vMatch);
+
     CPartialMerkleTree();
 
     /**
@@ -118,6 +121,24 @@ public:
 };
 
 
+/**
+ * What a block is filtered for BIP37 peers from, extracted once so that a block
+ * served to many of them has its scripts parsed and its merkle tree hashed once:
+ * the transactions, the data elements their scripts push and the nodes of the
+ * merkle tree at every height.
+ */
+class CMerkleBlockData
+{
+public:
+    CBlockHeader header;
+    std::vector<CTransactionRef> vtx;
+    std::vector<CTxDataElements> vElements;
+    //! vTree[0] holds the txids, vTree[h] the nodes at height h, up to the root
+    std::vector<std::vector<uint256> > vTree;
+
+    explicit CMerkleBlockData(const CBlock& block);
+};
+
 /**
  * Used to relay blocks as header + vector<merkle branch>
  * to filtered nodes.
@@ -140,6 +161,9 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    // The same, from the data extracted from the block once
+    CMerkleBlock(const CMerkleBlockData& data, CBloomFilter& filter);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids);
 
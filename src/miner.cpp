@@ -13,24 +13,32 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
 #include "hash.h"
 #include "main.h"
 #include "net.h"
 #include "policy/policy.h"
 #include "pow.h"
 #include "primitives/transaction.h"
+#include "random.h"
 #include "script/standard.h"
 #include "timedata.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utilstrencodings.h"
 #include "validationinterface.h"
 
 #include <algorithm>
+#include <atomic>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <limits>
+#include <list>
 #include <queue>
 
+#include <univalue.h>
+
 using namespace std;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -48,12 +56,31 @@ uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 uint64_t nLastBlockWeight = 0;
 
+/** Upper bounds in milliseconds of the template latency histogram, the last bucket takes the rest */
+static const int64_t TEMPLATE_LATENCY_BOUNDS[] = {10, 50, 100, 250, 500, 1000, 2500};
+static const size_t TEMPLATE_LATENCY_BUCKETS = sizeof(TEMPLATE_LATENCY_BOUNDS) / sizeof(TEMPLATE_LATENCY_BOUNDS[0]) + 1;
+static std::atomic<uint64_t> nTemplateLatency[TEMPLATE_LATENCY_BUCKETS];
+static std::atomic<int64_t> nLastTemplateMicros(0);
+
+static std::atomic<uint64_t> nWorkAccepted(0);
+static std::atomic<uint64_t> nWorkStale(0);
+static std::atomic<uint64_t> nWorkInvalid(0);
+
+static void RecordTemplateLatency(int64_t nMicros)
+{
+    size_t i = 0;
+    while (i < TEMPLATE_LATENCY_BUCKETS - 1 && nMicros > TEMPLATE_LATENCY_BOUNDS[i] * 1000)
+        ++i;
+    ++nTemplateLatency[i];
+    nLastTemplateMicros = nMicros;
+}
+
 class ScoreCompare
 {
 public:
     ScoreCompare() {}
 
-    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
+    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b) const
     {
         return CompareTxMemPoolEntryByScore()(*b,*a); // Convert to less than
     }
@@ -121,9 +148,12 @@ void BlockAssembler::resetBlock()
 
     lastFewTxs = 0;
     blockFinished = false;
+
+    nPackagesSelected = 0;
+    nDescendantsUpdated = 0;
 }
 
-CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
+CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, bool fAddTransactions, bool fTestValidity)
 {
     resetBlock();
 
@@ -134,7 +164,7 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     pblock = &pblocktemplate->block; // pointer for convenience
 
     // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
+    pblock->vtx.emplace_back();
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
 
@@ -164,8 +194,12 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     // transaction (which in most cases can be a no-op).
     fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
 
-    addPriorityTxs();
-    addPackageTxs();
+    int64_t nTimeStart = GetTimeMicros();
+    if (fAddTransactions) {
+        addPriorityTxs();
+        addPackageTxs();
+    }
+    int64_t nTimeTxs = GetTimeMicros();
 
     nLastBlockTx = nBlockTx;
     nLastBlockSize = nBlockSize;
@@ -184,7 +218,7 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     coinbaseTx.vout[0].nValue = charityAmount;
     coinbaseTx.vout[1].nValue = nFees + (GetBlockSubsidy(nHeight, pindexPrev->nNonce, chainparams.GetConsensus()) - charityAmount);
     coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
-    pblock->vtx[0] = coinbaseTx;
+    pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
     pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
     pblocktemplate->vTxFees[0] = -nFees;
 
@@ -196,12 +230,18 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
     pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
     pblock->nNonce         = 0;
-    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(pblock->vtx[0]);
+    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
+    pblocktemplate->vCoinbaseMerkleBranch = BlockMerkleBranch(*pblock, 0);
 
     CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+    if (fTestValidity && !TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
         throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
     }
+    int64_t nTimeValidity = GetTimeMicros();
+    RecordTemplateLatency(nTimeValidity - nTimeStart);
+    LogPrint("bench", "CreateNewBlock() txs: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n",
+             0.001 * (nTimeTxs - nTimeStart), nPackagesSelected, nDescendantsUpdated,
+             0.001 * (nTimeValidity - nTimeTxs), 0.001 * (nTimeValidity - nTimeStart));
 
     return pblocktemplate.release();
 }
@@ -318,7 +358,7 @@ bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
 
 void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 {
-    pblock->vtx.push_back(iter->GetTx());
+    pblock->vtx.push_back(iter->GetSharedTx());
     pblocktemplate->vTxFees.push_back(iter->GetFee());
     pblocktemplate->vTxSigOpsCost.push_back(iter->GetSigOpCost());
     if (fNeedSizeAccounting) {
@@ -342,9 +382,10 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     }
 }
 
-void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
         indexed_modified_transaction_set &mapModifiedTx)
 {
+    int nDescendantsUpdated = 0;
     BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
         CTxMemPool::setEntries descendants;
         mempool.CalculateDescendants(it, descendants);
@@ -352,6 +393,7 @@ void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alread
         BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
             if (alreadyAdded.count(desc))
                 continue;
+            ++nDescendantsUpdated;
             modtxiter mit = mapModifiedTx.find(desc);
             if (mit == mapModifiedTx.end()) {
                 CTxMemPoolModifiedEntry modEntry(desc);
@@ -364,6 +406,7 @@ void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alread
             }
         }
     }
+    return nDescendantsUpdated;
 }
 
 // Skip entries in mapTx that are already in a block or are present
@@ -414,7 +457,10 @@ void BlockAssembler::addPackageTxs()
 
     // Start by adding all descendants of previously added txs to mapModifiedTx
     // and modifying them for their already included ancestors
-    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+    nDescendantsUpdated += UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    // Limits the walk once the block is close to full
+    int64_t nConsecutiveFailed = 0;
 
     CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
     CTxMemPool::txiter iter;
@@ -479,6 +525,13 @@ void BlockAssembler::addPackageTxs()
                 mapModifiedTx.get<ancestor_score>().erase(modit);
                 failedTx.insert(iter);
             }
+
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && (nBlockWeight > nBlockMaxWeight - 4000 ||
+                    (fNeedSizeAccounting && nBlockSize > nBlockMaxSize - 1000))) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
             continue;
         }
 
@@ -499,6 +552,9 @@ void BlockAssembler::addPackageTxs()
             continue;
         }
 
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
         // Package can be added. Sort the entries in a valid order.
         vector<CTxMemPool::txiter> sortedEntries;
         SortForBlock(ancestors, iter, sortedEntries);
@@ -509,8 +565,10 @@ void BlockAssembler::addPackageTxs()
             mapModifiedTx.erase(sortedEntries[i]);
         }
 
+        ++nPackagesSelected;
+
         // Update transactions that depend on each of these
-        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+        nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
     }
 }
 
@@ -596,7 +654,7 @@ void BlockAssembler::addPriorityTxs()
     fNeedSizeAccounting = fSizeAccounting;
 }
 
-void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce, const std::vector<uint256>* pvMerkleBranch)
 {
     // Update nExtraNonce
     static uint256 hashPrevBlock;
@@ -607,10 +665,512 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
-    pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
+    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
+    // Only the coinbase changed, the other transactions of the tree need not be hashed again
+    if (pvMerkleBranch)
+        pblock->hashMerkleRoot = ComputeMerkleRootFromBranch(pblock->vtx[0]->GetHash(), *pvMerkleBranch, 0);
+    else
+        pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
+}
+
+static boost::mutex csWorkTemplate;
+static boost::condition_variable cvWorkTemplate;
+static bool fWorkTemplateActive = false; // guarded by csWorkTemplate
+static bool fWorkTipChanged = false;     // guarded by csWorkTemplate
+static bool fWorkMempoolChanged = false; // guarded by csWorkTemplate
+static bool fWorkEmptyFirst = DEFAULT_WORK_EMPTY_FIRST;
+bool fAsyncTemplateCheck = DEFAULT_ASYNC_TEMPLATE_CHECK;
+/** Only accessed through std::atomic_load and std::atomic_store */
+static std::shared_ptr<const CWorkTemplate> pworkTemplate;
+/** Bumped on every new tip; a SolveBlock started on an older tip gives up */
+static std::atomic<unsigned int> nMinerTipChanges(0);
+
+static boost::mutex csWorkJobs;
+/** Recent templates by header hash, oldest first in listWorkJobs */
+static std::map<uint256, std::shared_ptr<const CWorkTemplate> > mapWorkJobs; // guarded by csWorkJobs
+static std::list<uint256> listWorkJobs;                                      // guarded by csWorkJobs
+
+/** Stop handing out a template that failed its validity check, the next
+ *  GetWorkTemplate() builds a new one */
+static void WithdrawWorkTemplate(const std::shared_ptr<const CWorkTemplate>& work)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csWorkJobs);
+        std::map<uint256, std::shared_ptr<const CWorkTemplate> >::iterator it = mapWorkJobs.find(work->hashPrevBlock);
+        if (it != mapWorkJobs.end() && it->second == work) {
+            mapWorkJobs.erase(it);
+            listWorkJobs.remove(work->hashPrevBlock);
+        }
+    }
+    std::shared_ptr<const CWorkTemplate> expected = work;
+    std::atomic_compare_exchange_strong(&pworkTemplate, &expected, std::shared_ptr<const CWorkTemplate>());
+}
+
+static void PublishWorkTemplate(const std::shared_ptr<const CWorkTemplate>& work)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csWorkJobs);
+        // Mempool refreshes keep the header hash, the newest template replaces the old one
+        if (!mapWorkJobs.count(work->hashPrevBlock)) {
+            listWorkJobs.push_back(work->hashPrevBlock);
+            if (listWorkJobs.size() > MAX_WORK_JOBS) {
+                mapWorkJobs.erase(listWorkJobs.front());
+                listWorkJobs.pop_front();
+            }
+        }
+        mapWorkJobs[work->hashPrevBlock] = work;
+    }
+    std::atomic_store(&pworkTemplate, work);
+    if (fAsyncTemplateCheck)
+        CheckBlockTemplateLater(std::shared_ptr<const CBlock>(work, &work->pblocktemplate->block), [work] { WithdrawWorkTemplate(work); });
+}
+
+static std::shared_ptr<const CWorkTemplate> BuildWorkTemplate(bool fEmpty = false)
+{
+    std::shared_ptr<CWorkTemplate> work = std::make_shared<CWorkTemplate>();
+    work->fEmpty = fEmpty;
+    try {
+        CScript scriptDummy = CScript() << OP_TRUE;
+        work->pblocktemplate.reset(BlockAssembler(Params()).CreateNewBlock(scriptDummy, !fEmpty, !fAsyncTemplateCheck));
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    if (!work->pblocktemplate)
+        return std::shared_ptr<const CWorkTemplate>();
+    const CBlock& block = work->pblocktemplate->block;
+    work->hashPrevBlock = block.hashPrevBlock;
+    work->seedHash = block.GetSeed();
+    work->target.SetCompact(block.nBits);
+    return work;
+}
+
+std::shared_ptr<const CWorkTemplate> GetWorkTemplate()
+{
+    std::shared_ptr<const CWorkTemplate> work = std::atomic_load(&pworkTemplate);
+    if (work)
+        return work;
+    {
+        boost::unique_lock<boost::mutex> lock(csWorkTemplate);
+        fWorkTemplateActive = true;
+    }
+    work = BuildWorkTemplate();
+    if (work)
+        PublishWorkTemplate(work);
+    return work;
+}
+
+static void ThreadWorkTemplates()
+{
+    RenameThread("mil-worktmpl");
+    int64_t nLastBuild = 0;
+    while (true) {
+        bool fTipChanged;
+        {
+            boost::unique_lock<boost::mutex> lock(csWorkTemplate);
+            while (!fWorkTemplateActive || !(fWorkTipChanged || (fWorkMempoolChanged && GetTime() - nLastBuild >= WORK_TEMPLATE_MEMPOOL_REFRESH))) {
+                if (fWorkTemplateActive && fWorkMempoolChanged)
+                    cvWorkTemplate.timed_wait(lock, boost::posix_time::seconds(1));
+                else
+                    cvWorkTemplate.wait(lock);
+            }
+            fTipChanged = fWorkTipChanged;
+            fWorkTipChanged = false;
+            fWorkMempoolChanged = false;
+        }
+        if (fTipChanged && fWorkEmptyFirst) {
+            // Get miners off the old tip before the mempool is assembled
+            std::shared_ptr<const CWorkTemplate> empty = BuildWorkTemplate(true);
+            if (empty)
+                PublishWorkTemplate(empty);
+        }
+        std::shared_ptr<const CWorkTemplate> work = BuildWorkTemplate();
+        if (work)
+            PublishWorkTemplate(work);
+        nLastBuild = GetTime();
+    }
+}
+
+static boost::mutex csTemplateCheck;
+static boost::condition_variable cvTemplateCheck;
+/** Templates waiting for TestBlockValidity, oldest first */
+static std::list<std::pair<std::shared_ptr<const CBlock>, std::function<void()> > > listTemplateChecks; // guarded by csTemplateCheck
+
+void CheckBlockTemplateLater(const std::shared_ptr<const CBlock>& pblock, const std::function<void()>& fnInvalid)
+{
+    boost::unique_lock<boost::mutex> lock(csTemplateCheck);
+    // Nobody mines on an older tip any more, its templates need no check
+    while (!listTemplateChecks.empty() && listTemplateChecks.front().first->hashPrevBlock != pblock->hashPrevBlock)
+        listTemplateChecks.pop_front();
+    listTemplateChecks.push_back(std::make_pair(pblock, fnInvalid));
+    if (listTemplateChecks.size() > MAX_TEMPLATE_CHECKS)
+        listTemplateChecks.pop_front();
+    cvTemplateCheck.notify_one();
+}
+
+static void ThreadCheckTemplates()
+{
+    RenameThread("mil-tmplcheck");
+    while (true) {
+        std::shared_ptr<const CBlock> pblock;
+        std::function<void()> fnInvalid;
+        {
+            boost::unique_lock<boost::mutex> lock(csTemplateCheck);
+            while (listTemplateChecks.empty())
+                cvTemplateCheck.wait(lock);
+            pblock = listTemplateChecks.front().first;
+            fnInvalid = listTemplateChecks.front().second;
+            listTemplateChecks.pop_front();
+        }
+        CValidationState state;
+        {
+            LOCK(cs_main);
+            // TestBlockValidity only works on the tip, a template on an older one is stale anyway
+            CBlockIndex* pindexPrev = chainActive.Tip();
+            if (pblock->hashPrevBlock != pindexPrev->GetBlockHash())
+                continue;
+            int64_t nTimeStart = GetTimeMicros();
+            bool fValid = TestBlockValidity(state, Params(), *pblock, pindexPrev, false, false);
+            LogPrint("bench", "%s: validity: %.2fms\n", __func__, 0.001 * (GetTimeMicros() - nTimeStart));
+            if (fValid)
+                continue;
+        }
+        LogPrintf("%s: template on %s failed TestBlockValidity: %s\n", __func__, pblock->hashPrevBlock.ToString(), FormatStateMessage(state));
+        fnInvalid();
+    }
+}
+
+class CMinerNotifier : public CValidationInterface
+{
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex, const CBlock* pblock)
+    {
+        ++nMinerTipChanges;
+        boost::unique_lock<boost::mutex> lock(csWorkTemplate);
+        fWorkTipChanged = true;
+        cvWorkTemplate.notify_one();
+    }
+    void SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, const CBlock* pblock)
+    {
+        // Transactions entering the mempool; connected blocks come with a new tip
+        if (pindex)
+            return;
+        // getblocktemplate long polls wait for new transactions too
+        cvBlockChange.notify_all();
+        boost::unique_lock<boost::mutex> lock(csWorkTemplate);
+        fWorkMempoolChanged = true;
+        cvWorkTemplate.notify_one();
+    }
+};
+
+static CMinerNotifier minerNotifier;
+
+void StartWorkTemplateBuilder(boost::thread_group& threadGroup)
+{
+    fWorkEmptyFirst = GetBoolArg("-workemptyfirst", DEFAULT_WORK_EMPTY_FIRST);
+    fAsyncTemplateCheck = GetBoolArg("-asynctemplatecheck", DEFAULT_ASYNC_TEMPLATE_CHECK);
+    RegisterValidationInterface(&minerNotifier);
+    threadGroup.create_thread(&ThreadWorkTemplates);
+    if (fAsyncTemplateCheck)
+        threadGroup.create_thread(&ThreadCheckTemplates);
+}
+
+std::shared_ptr<const CWorkTemplate> FindWorkTemplate(const uint256& hashHeader)
+{
+    boost::unique_lock<boost::mutex> lock(csWorkJobs);
+    std::map<uint256, std::shared_ptr<const CWorkTemplate> >::const_iterator it = mapWorkJobs.find(hashHeader);
+    if (it == mapWorkJobs.end())
+        return std::shared_ptr<const CWorkTemplate>();
+    return it->second;
+}
+
+void FinalizeWorkBlock(const CWorkTemplate& work, const CScript& scriptPubKey, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce, CBlock& block)
+{
+    block = work.pblocktemplate->block;
+    block.fChecked = false;
+    // Templates are built for a dummy script, vout[0] is the charity output
+    CMutableTransaction txCoinbase(*block.vtx[0]);
+    txCoinbase.vout[1].scriptPubKey = scriptPubKey;
+    block.vtx[0] = MakeTransactionRef(std::move(txCoinbase));
+    IncrementExtraNonce(&block, pindexPrev, nExtraNonce, &work.pblocktemplate->vCoinbaseMerkleBranch);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Internal miner
+//
+
+/** Nonces scanned between checks for a solution found elsewhere, a new tip or a stop request */
+static const uint64_t MINER_NONCE_BATCH = 0x400;
+/** Seconds over which the miner hash rate is averaged */
+static const int64_t MINER_HASHMETER_INTERVAL = 4;
+
+static boost::mutex csMinerHashMeter;
+static int64_t nMinerMeterStart = 0;   // guarded by csMinerHashMeter
+static uint64_t nMinerMeterHashes = 0; // guarded by csMinerHashMeter
+static double dMinerHashesPerSec = 0;  // guarded by csMinerHashMeter
+
+static void CountMinerHashes(uint64_t nHashes)
+{
+    boost::unique_lock<boost::mutex> lock(csMinerHashMeter);
+    int64_t nNow = GetTimeMillis();
+    nMinerMeterHashes += nHashes;
+    if (nNow - nMinerMeterStart > 2 * MINER_HASHMETER_INTERVAL * 1000) {
+        // Idle for a while, start a new interval
+        nMinerMeterStart = nNow;
+        nMinerMeterHashes = nHashes;
+    } else if (nNow - nMinerMeterStart >= MINER_HASHMETER_INTERVAL * 1000) {
+        dMinerHashesPerSec = 1000.0 * nMinerMeterHashes / (nNow - nMinerMeterStart);
+        nMinerMeterStart = nNow;
+        nMinerMeterHashes = 0;
+    }
+}
+
+double GetMinerHashRate()
+{
+    boost::unique_lock<boost::mutex> lock(csMinerHashMeter);
+    if (GetTimeMillis() - nMinerMeterStart > 2 * MINER_HASHMETER_INTERVAL * 1000)
+        return 0;
+    return dMinerHashesPerSec;
+}
+
+/** Shared by the threads of one SolveBlock call */
+struct CBlockSolver
+{
+    const CBlock& block;
+    const std::function<bool()>& fnStop;
+    unsigned int nTipChanges;
+    EthashAux::FullType dag;
+    uint256 target;
+
+    std::atomic<bool> fDone;
+    std::atomic<bool> fFound;
+    std::atomic<uint64_t> nTried;
+    // Written by the thread that set fFound
+    uint64_t nNonce;
+    uint256 mixhash;
+
+    CBlockSolver(const CBlock& blockIn, const std::function<bool()>& fnStopIn)
+        : block(blockIn), fnStop(fnStopIn), nTipChanges(nMinerTipChanges),
+          fDone(false), fFound(false), nTried(0), nNonce(0) {}
+
+    bool Stale() const { return nMinerTipChanges != nTipChanges || (fnStop && fnStop()); }
+
+    void ScanRange(uint64_t nStart, uint64_t nCount, ethash_full_t copy = NULL)
+    {
+        uint64_t n = 0;
+        while (n < nCount && !fDone) {
+            uint64_t nBatch = std::min(nCount - n, MINER_NONCE_BATCH);
+            uint64_t nNonceFound;
+            uint256 mixhashFound;
+            if (dag->search(block.hashPrevBlock, nStart + n, nBatch, target, nNonceFound, mixhashFound, copy)) {
+                bool fExpected = false;
+                if (fFound.compare_exchange_strong(fExpected, true)) {
+                    nNonce = nNonceFound;
+                    mixhash = mixhashFound;
+                }
+                fDone = true;
+                nBatch = nNonceFound - (nStart + n) + 1;
+            }
+            n += nBatch;
+            nTried += nBatch;
+            CountMinerHashes(nBatch);
+            if (Stale())
+                fDone = true;
+        }
+    }
+
+    /** Scans from a thread pinned to the CPUs of NUMA node nNode, with the copy of the DAG in its memory */
+    void ScanRangeOnNode(unsigned nNode, const std::vector<int>& vCpus, uint64_t nStart, uint64_t nCount)
+    {
+        if (!SetThreadAffinity(vCpus)) {
+            ScanRange(nStart, nCount);
+            return;
+        }
+        ScanRange(nStart, nCount, dag->replica(nNode));
+    }
+};
+
+bool SolveBlock(CBlock& block, int nThreads, uint64_t& nMaxTries, const std::function<bool()>& fnStop)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    CBlockSolver solver(block, fnStop);
+
+    if (!DeriveTarget(block.nBits, consensusParams.powLimit, solver.target)) {
+        // No nonce can solve it
+        nMaxTries = 0;
+        return false;
+    }
+
+    // Resolve the DAG once, every thread shares it
+    uint256 seed = EthashAux::seedHash(block.nHeight);
+    block.EnsurePrecomputed(block.nHeight);
+    while (EthashAux::computeFull(seed, true) != 100 || !(solver.dag = EthashAux::full(seed, false))) {
+        if (solver.Stale())
+            return false;
+        MilliSleep(100);
+    }
+
+    // Contiguous nonce ranges, the calling thread takes the first one and the remainder
+    nThreads = std::max(nThreads, 1);
+    uint64_t nPerThread = nMaxTries / nThreads;
+    uint64_t nFirst = nMaxTries - nPerThread * (nThreads - 1);
+    boost::thread_group workers;
+    static const std::vector<std::vector<int> > vNodeCpus = GetNumaNodeCpus();
+    if (EthashAux::dagNuma() && vNodeCpus.size() > 1 && !solver.dag->device) {
+        // Threads are spread over the nodes and read the DAG from their own; the calling
+        // thread, which may be an RPC worker, is not pinned and only waits
+        for (int i = 0; i < nThreads; i++) {
+            unsigned nNode = i % vNodeCpus.size();
+            uint64_t nStart = i == 0 ? block.nNonce : block.nNonce + nFirst + nPerThread * (i - 1);
+            workers.create_thread(boost::bind(&CBlockSolver::ScanRangeOnNode, &solver, nNode, boost::cref(vNodeCpus[nNode]), nStart, i == 0 ? nFirst : nPerThread));
+        }
+    } else {
+        for (int i = 1; i < nThreads; i++)
+            workers.create_thread(boost::bind(&CBlockSolver::ScanRange, &solver, block.nNonce + nFirst + nPerThread * (i - 1), nPerThread, (ethash_full_t)NULL));
+        solver.ScanRange(block.nNonce, nFirst);
+    }
+    workers.join_all();
+
+    nMaxTries -= std::min(nMaxTries, (uint64_t)solver.nTried);
+    if (!solver.fFound)
+        return false;
+    block.nNonce = solver.nNonce;
+    block.mixhash = solver.mixhash;
+    return true;
+}
+
+static boost::mutex csMiner;
+static boost::thread* minerThread = NULL; // guarded by csMiner
+static std::atomic<bool> fMinerStop(false);
+
+static void BitcoinMiner(const CChainParams& chainparams, int nThreads)
+{
+    LogPrintf("MilMiner started with %d threads\n", nThreads);
+    RenameThread("mil-miner");
+
+    unsigned int nExtraNonce = 0;
+    boost::shared_ptr<CReserveScript> coinbaseScript;
+    GetMainSignals().ScriptForMining(coinbaseScript);
+
+    try {
+        // Throw an error if no script was provided.  This can happen
+        // due to some internal error but also if the keypool is empty.
+        // In the latter case, already the pointer is NULL.
+        if (!coinbaseScript || coinbaseScript->reserveScript.empty())
+            throw std::runtime_error("No coinbase script available (mining requires a wallet)");
+
+        while (!fMinerStop) {
+            if (chainparams.MiningRequiresPeers()) {
+                // Wait for the network to come online so we don't waste time mining
+                // on an obsolete chain.
+                bool fWait = true;
+                while (fWait && !fMinerStop) {
+                    {
+                        LOCK(cs_vNodes);
+                        fWait = vNodes.empty();
+                    }
+                    fWait = fWait || IsInitialBlockDownload();
+                    if (fWait)
+                        MilliSleep(1000);
+                }
+                if (fMinerStop)
+                    break;
+            }
+
+            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            int64_t nStart = GetTime();
+            std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(chainparams).CreateNewBlock(coinbaseScript->reserveScript));
+            if (!pblocktemplate.get()) {
+                LogPrintf("Error in MilMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
+                return;
+            }
+            CBlock* pblock = &pblocktemplate->block;
+            {
+                LOCK(cs_main);
+                IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
+            }
+            // Templates for the same tip share the Ethash header, don't scan the same nonces twice
+            pblock->nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+
+            // Mine until the tip changes, or for a minute when there are new transactions
+            uint64_t nMaxTries = std::numeric_limits<uint64_t>::max();
+            std::function<bool()> fnStop = [&]() {
+                return fMinerStop || (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60);
+            };
+            if (SolveBlock(*pblock, nThreads, nMaxTries, fnStop)) {
+                LogPrintf("MilMiner:\n proof-of-work found\n  hash: %s\n", pblock->GetHash().GetHex());
+                CValidationState state;
+                if (!ProcessNewBlock(state, chainparams, NULL, pblock, true, NULL, false)) {
+                    LogPrintf("MilMiner: ProcessNewBlock, block not accepted: %s\n", FormatStateMessage(state));
+                    continue;
+                }
+                coinbaseScript->KeepScript();
+            }
+        }
+    } catch (const std::runtime_error &e) {
+        LogPrintf("MilMiner runtime error: %s\n", e.what());
+    }
+    LogPrintf("MilMiner terminated\n");
+}
+
+void GenerateBitcoins(bool fGenerate, int nThreads, const CChainParams& chainparams)
+{
+    boost::unique_lock<boost::mutex> lock(csMiner);
+
+    if (nThreads < 0)
+        nThreads = GetNumCores();
+
+    if (minerThread != NULL) {
+        fMinerStop = true;
+        minerThread->join();
+        delete minerThread;
+        minerThread = NULL;
+    }
+
+    if (nThreads == 0 || !fGenerate)
+        return;
+
+    fMinerStop = false;
+    minerThread = new boost::thread(boost::bind(&BitcoinMiner, boost::cref(chainparams), nThreads));
+}
+
+void RecordWorkSubmission(WorkSubmitResult result)
+{
+    switch (result) {
+    case WORK_ACCEPTED: ++nWorkAccepted; break;
+    case WORK_STALE:    ++nWorkStale;    break;
+    case WORK_INVALID:  ++nWorkInvalid;  break;
+    }
+}
+
+UniValue GetMiningMetrics()
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("hashespersec",     GetMinerHashRate()));
+
+    UniValue latency(UniValue::VOBJ);
+    uint64_t nBuilds = 0;
+    for (size_t i = 0; i < TEMPLATE_LATENCY_BUCKETS; i++) {
+        uint64_t nCount = nTemplateLatency[i];
+        nBuilds += nCount;
+        latency.push_back(Pair(i < TEMPLATE_LATENCY_BUCKETS - 1 ? i64tostr(TEMPLATE_LATENCY_BOUNDS[i]) : "inf", nCount));
+    }
+    obj.push_back(Pair("templatebuilds",   nBuilds));
+    obj.push_back(Pair("lasttemplatems",   0.001 * nLastTemplateMicros));
+    obj.push_back(Pair("templatelatency",  latency));
+
+    UniValue dagStatus(UniValue::VOBJ);
+    std::map<uint64_t, unsigned> mapStatus = EthashAux::dagStatus();
+    for (std::map<uint64_t, unsigned>::const_iterator it = mapStatus.begin(); it != mapStatus.end(); ++it)
+        dagStatus.push_back(Pair(i64tostr(it->first), (uint64_t)it->second));
+    obj.push_back(Pair("dagstatus",        dagStatus));
+
+    obj.push_back(Pair("acceptedwork",     (uint64_t)nWorkAccepted));
+    obj.push_back(Pair("stalework",        (uint64_t)nWorkStale));
+    obj.push_back(Pair("invalidwork",      (uint64_t)nWorkInvalid));
+    return obj;
 }
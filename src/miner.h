@@ -6,23 +6,41 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "arith_uint256.h"
 #include "primitives/block.h"
 #include "txmempool.h"
 
 #include <stdint.h>
+#include <functional>
 #include <memory>
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 
+namespace boost { class thread_group; }
+
 class CBlockIndex;
 class CChainParams;
 class CReserveKey;
 class CScript;
 class CWallet;
+class UniValue;
 
 namespace Consensus { struct Params; };
 
+static const bool DEFAULT_GENERATE = false;
+static const int DEFAULT_GENERATE_THREADS = 1;
+
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Minimum number of seconds between eth_getWork templates rebuilt for mempool changes */
+static const int64_t WORK_TEMPLATE_MEMPOOL_REFRESH = 5;
+/** Default for -workemptyfirst */
+static const bool DEFAULT_WORK_EMPTY_FIRST = false;
+/** Default for -asynctemplatecheck */
+static const bool DEFAULT_ASYNC_TEMPLATE_CHECK = false;
+/** Templates waiting for the background validity check beyond which the oldest is dropped */
+static const unsigned int MAX_TEMPLATE_CHECKS = 4;
+/** Number of recent eth_getWork jobs a submission can still be matched to */
+static const unsigned int MAX_WORK_JOBS = 16;
 
 struct CBlockTemplate
 {
@@ -30,6 +48,8 @@ struct CBlockTemplate
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOpsCost;
     std::vector<unsigned char> vchCoinbaseCommitment;
+    //! The merkle branch of the coinbase, which a new coinbase does not change
+    std::vector<uint256> vCoinbaseMerkleBranch;
 };
 
 // Container for tracking updates to ancestor feerate as we include (parent)
@@ -73,7 +93,7 @@ struct modifiedentry_iter {
 // except operating on CTxMemPoolModifiedEntry.
 // TODO: refactor to avoid duplication of this logic.
 struct CompareModifiedEntry {
-    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b)
+    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b) const
     {
         double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
         double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
@@ -88,7 +108,7 @@ struct CompareModifiedEntry {
 // This is sufficient to sort an ancestor package in an order that is valid
 // to appear in a block.
 struct CompareTxIterByAncestorCount {
-    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b)
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
     {
         if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
             return a->GetCountWithAncestors() < b->GetCountWithAncestors();
@@ -130,6 +150,9 @@ struct update_for_parent_inclusion
     CTxMemPool::txiter iter;
 };
 
+/** Packages that failed to fit in a row before addPackageTxs gives up on a nearly full block */
+static const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
 {
@@ -161,10 +184,17 @@ private:
     int lastFewTxs;
     bool blockFinished;
 
+    // Statistics of addPackageTxs, for -debug=bench
+    int nPackagesSelected;
+    int nDescendantsUpdated;
+
 public:
     BlockAssembler(const CChainParams& chainparams);
-    /** Construct a new block template with coinbase to scriptPubKeyIn */
-    CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+    /** Construct a new block template with coinbase to scriptPubKeyIn,
+     *  leaving out all mempool transactions unless fAddTransactions.
+     *  Without fTestValidity the template is not run through TestBlockValidity,
+     *  the caller hands it to CheckBlockTemplateLater() instead */
+    CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, bool fAddTransactions = true, bool fTestValidity = true);
 
 private:
     // utility functions
@@ -176,7 +206,9 @@ private:
     // Methods for how to add transactions to a block.
     /** Add transactions based on tx "priority" */
     void addPriorityTxs();
-    /** Add transactions based on feerate including unconfirmed ancestors */
+    /** Add transactions based on feerate including unconfirmed ancestors.
+      * Walks the mempool's ancestor score index from the top and stops once
+      * the block is close to full, so the cost follows the block, not the mempool. */
     void addPackageTxs();
 
     // helper function for addPriorityTxs
@@ -201,12 +233,72 @@ private:
     /** Sort the package in an order that is valid to appear in a block */
     void SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
     /** Add descendants of given transactions to mapModifiedTx with ancestor
-      * state updated assuming given transactions are inBlock. */
-    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+      * state updated assuming given transactions are inBlock. Returns the
+      * number of entries updated. */
+    int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+};
+
+/** Run the internal miner with nThreads threads (-1 = all cores), or stop it */
+void GenerateBitcoins(bool fGenerate, int nThreads, const CChainParams& chainparams);
+/** Search the nonces of a block for a proof of work. The range starting at
+ *  pblock->nNonce of nMaxTries nonces is split among nThreads threads that
+ *  share one DAG. Gives up early when the tip changes or fnStop returns true.
+ *  nMaxTries is reduced by the nonces tried. */
+bool SolveBlock(CBlock& block, int nThreads, uint64_t& nMaxTries, const std::function<bool()>& fnStop);
+/** Hashes per second computed by SolveBlock recently */
+double GetMinerHashRate();
+
+/** Outcome of a block solution handed in by an external miner */
+enum WorkSubmitResult
+{
+    WORK_ACCEPTED,
+    WORK_STALE,   //!< For an outdated or unknown job
+    WORK_INVALID, //!< Bad proof of work
 };
+/** Count a solution submitted through eth_submitWork or Stratum */
+void RecordWorkSubmission(WorkSubmitResult result);
+/** Mining telemetry: local hash rate, template build latency histogram,
+ *  DAG status by epoch and the submitted work counters */
+UniValue GetMiningMetrics();
 
-/** Modify the extranonce in a block */
-void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Modify the extranonce in a block, and update its merkle root from the coinbase merkle branch of its template when given */
+void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce, const std::vector<uint256>* pvMerkleBranch = NULL);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
+/** Work handed out by eth_getWork. Never modified once published. */
+struct CWorkTemplate
+{
+    std::shared_ptr<CBlockTemplate> pblocktemplate;
+    bool fEmpty; //!< Only a coinbase, published while the full template is built
+    uint256 hashPrevBlock;
+    uint256 seedHash;
+    arith_uint256 target;
+};
+
+/** Return the current eth_getWork template. Only the very first call builds
+ *  one itself; later ones read the snapshot published by the background
+ *  builder without taking any lock. Returns an empty pointer on failure. */
+std::shared_ptr<const CWorkTemplate> GetWorkTemplate();
+/** Start the background builder that refreshes the eth_getWork template on
+ *  new tips and, at most every WORK_TEMPLATE_MEMPOOL_REFRESH seconds, on
+ *  mempool changes. It stays idle until GetWorkTemplate() is first called.
+ *  With -workemptyfirst an empty block on a new tip is published before
+ *  the full one is assembled. */
+void StartWorkTemplateBuilder(boost::thread_group& threadGroup);
+/** Whether templates for external miners are handed out before TestBlockValidity
+ *  has run on them (-asynctemplatecheck). Blocks submitted back are still fully
+ *  validated by ProcessNewBlock. */
+extern bool fAsyncTemplateCheck;
+/** Queue a template that was handed out unchecked for TestBlockValidity on the
+ *  background checker started with the work template builder. Templates on an
+ *  older tip are skipped. fnInvalid is called on the checker thread if the
+ *  check fails, to withdraw the template. */
+void CheckBlockTemplateLater(const std::shared_ptr<const CBlock>& pblock, const std::function<void()>& fnInvalid);
+/** Return the latest template handed out for an Ethash header hash, or an
+ *  empty pointer if it is not among the last MAX_WORK_JOBS jobs. */
+std::shared_ptr<const CWorkTemplate> FindWorkTemplate(const uint256& hashHeader);
+/** Turn a template into a block paying the coinbase to scriptPubKey.
+ *  The caller still sets the nonce and mix hash. */
+void FinalizeWorkBlock(const CWorkTemplate& work, const CScript& scriptPubKey, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce, CBlock& block);
+
 #endif // BITCOIN_MINER_H
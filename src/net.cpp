@@ -18,6 +18,8 @@
 #include "hash.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
+#include "socketevents.h"
+#include "trace.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
 
@@ -25,6 +27,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -91,9 +94,15 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+//! Created by StartNode, what ThreadSocketHandler waits on
+static CSocketEvents* psocketEvents = NULL;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
+//! Set once ThreadLoadAddresses read peers.dat; addrman is neither saved nor used to pick peers before
+static std::atomic<bool> fAddressesLoaded(false);
+//! addrman.GetChangeCount() when peers.dat was last read or written
+static std::atomic<uint64_t> nAddressesSavedChangeCount(std::numeric_limits<uint64_t>::max());
 std::string strSubVersion;
 
 std::vector<CNode*> vNodes;
@@ -478,6 +487,14 @@ static void DumpBanlist()
         banmap.size(), GetTimeMillis() - nStart);
 }
 
+/** Have ThreadSocketHandler register the socket of pnode again, now */
+static void WakeSocketHandler(CNode* pnode)
+{
+    pnode->fSocketEventsDirty = true;
+    if (psocketEvents)
+        psocketEvents->Wake();
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
@@ -485,6 +502,7 @@ void CNode::CloseSocketDisconnect()
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
         CloseSocket(hSocket);
+        WakeSocketHandler(this);
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
@@ -751,40 +769,190 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete()) {
+        if (msg.complete())
+            MessageReceived(msg);
+    }
+
+    return true;
+}
 
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+void CNode::MessageReceived(CNetMessage& msg)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = GetTimeMicros();
+    // Any of the message handler threads may be the one for this node
+    messageHandlerCondition.notify_all();
+}
 
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+/** Most bytes kept in idle receive buffers */
+static const size_t MAX_IDLE_RECV_BUFFER_BYTES = 8 * 1024 * 1024;
+/** How far ahead of the data received so far a payload buffer is allocated */
+static const size_t RECV_BUFFER_AHEAD = 256 * 1024;
+
+static CRecvBufferPool recvBufferPool(MAX_IDLE_RECV_BUFFER_BYTES);
+static std::atomic<size_t> nTotalRecvBufferSize(0);
+static std::atomic<size_t> nTotalSendQueueSize(0);
+
+size_t TotalRecvBufferSize() { return nTotalRecvBufferSize.load(std::memory_order_relaxed); }
+size_t IdleRecvBufferSize() { return recvBufferPool.GetIdleBytes(); }
+size_t TotalSendQueueSize() { return nTotalSendQueueSize.load(std::memory_order_relaxed); }
+
+std::vector<CNodeBufferUsage> GetNodeBufferUsage()
+{
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    // Taken with no other lock held, as the message handler takes cs_vNodes under them
+    std::vector<CNodeBufferUsage> vUsage;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+        CNodeBufferUsage usage;
+        usage.nodeid = pnode->GetId();
+        usage.addrName = pnode->addrName;
+        {
+            LOCK(pnode->cs_vSend);
+            usage.nSendBytes = pnode->nSendSize + pnode->ssSend.size();
+        }
+        usage.nRecvBytes = 0;
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            BOOST_FOREACH(const CNetMessage& msg, pnode->vRecvMsg)
+                usage.nRecvBytes += msg.GetBufferSize();
         }
+        vUsage.push_back(usage);
     }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+    return vUsage;
+}
 
-    return true;
+CRecvBufferPool::CRecvBufferPool(size_t nMaxIdleBytesIn) : nIdleBytes(0), nMaxIdleBytes(nMaxIdleBytesIn)
+{
+}
+
+void CRecvBufferPool::Get(CSerializeData& data, size_t nSize)
+{
+    // The smallest class whose buffers all hold nSize
+    int nClass = MIN_CLASS_BITS;
+    while (nClass < MAX_CLASS_BITS && ((size_t)1 << nClass) < nSize)
+        nClass++;
+    data.clear();
+    if (((size_t)1 << nClass) >= nSize) {
+        LOCK(cs);
+        std::vector<CSerializeData>& vClass = vIdle[nClass - MIN_CLASS_BITS];
+        if (!vClass.empty()) {
+            data.swap(vClass.back());
+            vClass.pop_back();
+            nIdleBytes -= data.capacity();
+            return;
+        }
+    }
+    data.reserve(std::max(nSize, (size_t)1 << nClass));
+}
+
+void CRecvBufferPool::Release(CSerializeData& data)
+{
+    size_t nCapacity = data.capacity();
+    data.clear();
+    if (nCapacity >= ((size_t)1 << MIN_CLASS_BITS)) {
+        // The largest class whose buffers this one can stand in for
+        int nClass = MIN_CLASS_BITS;
+        while (nClass < MAX_CLASS_BITS && ((size_t)2 << nClass) <= nCapacity)
+            nClass++;
+        LOCK(cs);
+        std::vector<CSerializeData>& vClass = vIdle[nClass - MIN_CLASS_BITS];
+        if (vClass.size() < MAX_IDLE_PER_CLASS && nIdleBytes + nCapacity <= nMaxIdleBytes) {
+            vClass.push_back(CSerializeData());
+            vClass.back().swap(data);
+            nIdleBytes += nCapacity;
+            return;
+        }
+    }
+    CSerializeData().swap(data);
+}
+
+size_t CRecvBufferPool::GetIdleBytes() const
+{
+    LOCK(cs);
+    return nIdleBytes;
+}
+
+CNetMessage::CNetMessage(CNetMessage&& msg) :
+    nBufferSize(msg.nBufferSize), in_data(msg.in_data), hdr(msg.hdr), nHdrPos(msg.nHdrPos),
+    vRecv(std::move(msg.vRecv)), nDataPos(msg.nDataPos), nTime(msg.nTime)
+{
+    memcpy(hdrbuf, msg.hdrbuf, sizeof(hdrbuf));
+    msg.nBufferSize = 0;
+}
+
+CNetMessage& CNetMessage::operator=(CNetMessage&& msg)
+{
+    if (this != &msg) {
+        CSerializeData data;
+        vRecv.SwapBuffer(data);
+        recvBufferPool.Release(data);
+        nTotalRecvBufferSize -= nBufferSize;
+
+        nBufferSize = msg.nBufferSize;
+        in_data = msg.in_data;
+        memcpy(hdrbuf, msg.hdrbuf, sizeof(hdrbuf));
+        hdr = msg.hdr;
+        nHdrPos = msg.nHdrPos;
+        vRecv = std::move(msg.vRecv);
+        nDataPos = msg.nDataPos;
+        nTime = msg.nTime;
+        msg.nBufferSize = 0;
+    }
+    return *this;
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData data;
+    vRecv.SwapBuffer(data);
+    recvBufferPool.Release(data);
+    nTotalRecvBufferSize -= nBufferSize;
+}
+
+void CNetMessage::UpdateBufferSize()
+{
+    size_t nCapacity = vRecv.capacity();
+    if (nCapacity >= nBufferSize)
+        nTotalRecvBufferSize += nCapacity - nBufferSize;
+    else
+        nTotalRecvBufferSize -= nBufferSize - nCapacity;
+    nBufferSize = nCapacity;
 }
 
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CSpanReader(hdrbuf, hdrbuf + sizeof(hdrbuf), vRecv.GetType(), vRecv.GetVersion()) >> hdr;
     }
     catch (const std::exception&) {
         return -1;
@@ -797,23 +965,61 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Take a buffer from the pool for the payload, or for the start of a large one
+    if (hdr.nMessageSize > 0) {
+        CSerializeData data;
+        recvBufferPool.Get(data, std::min<size_t>(hdr.nMessageSize, RECV_BUFFER_AHEAD));
+        vRecv.SwapBuffer(data);
+        UpdateBufferSize();
+    }
+
     return nCopy;
 }
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nCopy;
+    char* pchData = prepareData(nBytes, nCopy);
+    memcpy(pchData, pch, nCopy);
+    commitData(nCopy);
+
+    return nCopy;
+}
+
+char* CNetMessage::prepareData(unsigned int nMax, unsigned int& nSpace)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    nSpace = std::min(nRemaining, nMax);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() < nDataPos + nSpace) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min<size_t>(hdr.nMessageSize, nDataPos + nSpace + RECV_BUFFER_AHEAD));
+        if (vRecv.capacity() != nBufferSize)
+            UpdateBufferSize();
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return &vRecv[nDataPos];
+}
 
-    return nCopy;
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvPayloadBuffer(unsigned int nMin, unsigned int& nSpace)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (msg.hdr.nMessageSize - msg.nDataPos < nMin)
+        return NULL;
+    // Grow the buffer as ReceiveMsgBytes would, not to the announced size at once
+    return msg.prepareData(RECV_BUFFER_AHEAD, nSpace);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedPayloadBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.commitData(nBytes);
+    if (msg.complete())
+        MessageReceived(msg);
 }
 
 
@@ -824,26 +1030,91 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+CSharedPayload::CSharedPayload(CSerializeData& data)
+{
+    vchData.swap(data);
+    pbegin = vchData.empty() ? NULL : &vchData[0];
+    nSize = vchData.size();
+    SetChecksum();
+}
+
+CSharedPayload::CSharedPayload(const char* pch, size_t nSizeIn, const boost::shared_ptr<const void>& pKeepAliveIn) :
+    pKeepAlive(pKeepAliveIn), pbegin(pch), nSize(nSizeIn)
+{
+    SetChecksum();
+}
+
+void CSharedPayload::SetChecksum()
+{
+    uint256 hash = Hash(pbegin, pbegin + nSize);
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+}
+
+/** Most buffers passed to one send call; Windows sends one at a time */
+#ifdef WIN32
+static const int MAX_SEND_BUFFERS = 1;
+#else
+static const int MAX_SEND_BUFFERS = 64;
+#endif
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    while (!pnode->vSendMsg.empty()) {
+        // Gather what is left to send of the queued messages, the headers and
+        // the shared payloads in place, skipping what was sent of the first
+        const char* apch[MAX_SEND_BUFFERS];
+        size_t anSize[MAX_SEND_BUFFERS];
+        int nBuffers = 0;
+        size_t nGathered = 0;
+        size_t nSkip = pnode->nSendOffset;
+        for (std::deque<CSendMessage>::const_iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++it) {
+            const CSendMessage& msg = *it;
+            assert(msg.size() > nSkip || it != pnode->vSendMsg.begin());
+            const char* apchParts[2] = {msg.data.empty() ? NULL : &msg.data[0], msg.payload ? msg.payload->begin() : NULL};
+            size_t anParts[2] = {msg.data.size(), msg.payload ? msg.payload->size() : 0};
+            for (int i = 0; i < 2 && nBuffers < MAX_SEND_BUFFERS; i++) {
+                if (nSkip >= anParts[i]) {
+                    nSkip -= anParts[i];
+                    continue;
+                }
+                apch[nBuffers] = apchParts[i] + nSkip;
+                anSize[nBuffers] = anParts[i] - nSkip;
+                nGathered += anSize[nBuffers];
+                nBuffers++;
+                nSkip = 0;
+            }
+        }
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+        int nBytes = send(pnode->hSocket, apch[0], anSize[0], MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_BUFFERS];
+        for (int i = 0; i < nBuffers; i++) {
+            iov[i].iov_base = const_cast<char*>(apch[i]);
+            iov[i].iov_len = anSize[i];
+        }
+        struct msghdr msghdr;
+        memset(&msghdr, 0, sizeof(msghdr));
+        msghdr.msg_iov = iov;
+        msghdr.msg_iovlen = nBuffers;
+        int nBytes = sendmsg(pnode->hSocket, &msghdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
-                pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
+            // Drop the messages that were sent completely
+            size_t nSent = pnode->nSendOffset + nBytes;
+            while (!pnode->vSendMsg.empty() && nSent >= pnode->vSendMsg.front().size()) {
+                nSent -= pnode->vSendMsg.front().size();
+                pnode->nSendSize -= pnode->vSendMsg.front().size();
+                nTotalSendQueueSize -= pnode->vSendMsg.front().size();
+                pnode->vSendMsg.pop_front();
+            }
+            pnode->nSendOffset = nSent;
+            if ((size_t)nBytes < nGathered) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -861,11 +1132,10 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static std::list<CNode*> vNodesDisconnected;
@@ -1088,265 +1358,337 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
-void ThreadSocketHandler()
+/** Milliseconds between the sweeps for nodes to disconnect and for inactive peers */
+static const int SOCKET_HOUSEKEEPING_INTERVAL = 50;
+/** Milliseconds until a node whose locks were busy is registered again */
+static const int SOCKET_RETRY_INTERVAL = 10;
+
+/** Whether pnode has room for more received data; requires cs_vRecvMsg */
+static bool WantsToReceive(CNode* pnode)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
-    {
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-            {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+    // A peer with a complete message waiting pauses while all peers together
+    // are over budget; processing its messages makes room again
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           (pnode->GetTotalRecvSize() <= ReceiveFloodSize() && TotalRecvBufferSize() <= TotalReceiveFloodSize());
+}
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+/** Stop waiting on the socket of pnode, until UpdateSocketEvents registers it again */
+static void UnregisterSocket(CNode* pnode)
+{
+    if (pnode->hSocketEvents != INVALID_SOCKET)
+        psocketEvents->Remove(pnode->hSocketEvents, pnode);
+    pnode->hSocketEvents = INVALID_SOCKET;
+    pnode->nSocketEvents = 0;
+}
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+/**
+ * Register the socket of pnode for what it waits for now. Returns false, with
+ * the socket unregistered, if the locks to find out were busy.
+ */
+static bool UpdateSocketEvents(CNode* pnode)
+{
+    SOCKET hSocket = pnode->hSocket;
+    if (hSocket != pnode->hSocketEvents)
+        UnregisterSocket(pnode);
+    if (hSocket == INVALID_SOCKET)
+        return true;
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
-            }
+    // Implement the following logic:
+    // * If there is data to send, wait for sending data. As this only
+    //   happens when optimistic write failed, we choose to first drain the
+    //   write buffer in this case before receiving more. This avoids
+    //   needlessly queueing received data, if the remote peer is not themselves
+    //   receiving data. This means properly utilizing TCP flow control signalling.
+    // * Otherwise, if there is no (complete) message in the receive buffer,
+    //   or there is space left in the buffer, wait for receiving data.
+    // * (if neither of the above applies, there is certainly one message
+    //   in the receiver buffer ready to be processed, and the message handler
+    //   has us register the socket again once it made room).
+    // Together, that means that at least one of the following is always possible,
+    // so we don't deadlock:
+    // * We send some data.
+    // * We wait for data to be received (and disconnect after timeout).
+    // * We process a message in the buffer (message handler thread).
+    int nEvents = 0;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend) {
+            UnregisterSocket(pnode);
+            return false;
         }
+        if (!pnode->vSendMsg.empty())
+            nEvents = CSocketEvents::EVENT_SEND;
+    }
+    if (nEvents == 0) {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv) {
+            UnregisterSocket(pnode);
+            return false;
+        }
+        if (WantsToReceive(pnode))
+            nEvents = CSocketEvents::EVENT_RECV;
+    }
+    psocketEvents->Set(hSocket, pnode, nEvents);
+    pnode->hSocketEvents = hSocket;
+    pnode->nSocketEvents = nEvents;
+    return true;
+}
+
+/** Receive and send what the socket of pnode is ready for */
+static void ServiceSocket(CNode* pnode, int nReady)
+{
+    //
+    // Receive
+    //
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    if (nReady & CSocketEvents::EVENT_RECV)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
         {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                // typical socket buffer is 8K-64K
+                char pchBuf[0x10000];
+                // The bulk of a large payload goes straight into its message
+                // buffer; its last part and small messages, many of which fit
+                // in one read, go through pchBuf
+                unsigned int nPayloadSpace = 0;
+                char* pchPayload = pnode->GetRecvPayloadBuffer(sizeof(pchBuf), nPayloadSpace);
+                int nBytes = pchPayload ? recv(pnode->hSocket, pchPayload, nPayloadSpace, MSG_DONTWAIT)
+                                        : recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                if (nBytes > 0)
                 {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete)
+                    if (pchPayload)
+                        pnode->ReceivedPayloadBytes(nBytes);
+                    else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                        pnode->CloseSocketDisconnect();
+                    pnode->nLastRecv = GetTime();
+                    pnode->nRecvBytes += nBytes;
+                    pnode->RecordBytesRecv(nBytes);
+                }
+                else if (nBytes == 0)
+                {
+                    // socket closed gracefully
+                    if (!pnode->fDisconnect)
+                        LogPrint("net", "socket closed\n");
+                    pnode->CloseSocketDisconnect();
+                }
+                else if (nBytes < 0)
+                {
+                    // error
+                    int nErr = WSAGetLastError();
+                    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        if (!pnode->fDisconnect)
+                            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                        pnode->CloseSocketDisconnect();
                     }
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+        else
+        {
+            // The socket stays ready, wait for the lock instead
+            UnregisterSocket(pnode);
         }
+    }
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+    //
+    // Send
+    //
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    if (nReady & CSocketEvents::EVENT_SEND)
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            SocketSendData(pnode);
+        else
+            UnregisterSocket(pnode);
+    }
+}
+
+/** Disconnect nodes that went silent or stopped answering pings */
+static void CheckInactivity(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
         }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastHousekeeping = 0;
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket)
+        psocketEvents->Set(hListenSocket.socket, &hListenSocket, CSocketEvents::EVENT_RECV);
+    std::vector<std::pair<void*, int> > vReady;
+    while (true)
+    {
+        int64_t nNow = GetTimeMillis();
+        bool fHousekeeping = nNow - nLastHousekeeping >= SOCKET_HOUSEKEEPING_INTERVAL;
+        if (fHousekeeping)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            nLastHousekeeping = nNow;
+
+            //
+            // Disconnect nodes
+            //
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+                LOCK(cs_vNodes);
+                // Disconnect unused nodes
+                std::vector<CNode*> vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                    {
+                        // remove from vNodes
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                        // release outbound grant (if any)
+                        pnode->grantOutbound.Release();
+
+                        // close socket and cleanup
+                        UnregisterSocket(pnode);
+                        pnode->CloseSocketDisconnect();
+
+                        // hold in disconnected pool until all refs are released
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
                     }
                 }
+            }
+            {
+                // Delete disconnected nodes
+                std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
                 {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0)
+                    {
+                        bool fDelete = false;
+                        {
+                            TRY_LOCK(pnode->cs_vSend, lockSend);
+                            if (lockSend)
+                            {
+                                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                                if (lockRecv)
+                                {
+                                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                                    if (lockInv)
+                                        fDelete = true;
+                                }
+                            }
+                        }
+                        if (fDelete)
+                        {
+                            vNodesDisconnected.remove(pnode);
+                            delete pnode;
+                        }
+                    }
                 }
             }
+            if(vNodes.size() != nPrevNodeCount) {
+                nPrevNodeCount = vNodes.size();
+                uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
+        std::vector<CNode*> vNodesCopy;
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
 
         //
-        // Accept new connections
+        // Register the sockets of new nodes, and of those whose buffers changed
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        bool fRetry = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
+            if (pnode->fSocketEventsDirty.exchange(false) && !UpdateSocketEvents(pnode)) {
+                pnode->fSocketEventsDirty = true;
+                fRetry = true;
             }
         }
 
         //
-        // Service each socket
+        // Wait for sockets to be ready, or to be woken up by a node with data to send
         //
-        std::vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        int nTimeout = std::max<int>(0, SOCKET_HOUSEKEEPING_INTERVAL - (GetTimeMillis() - nLastHousekeeping));
+        if (fRetry)
+            nTimeout = std::min(nTimeout, SOCKET_RETRY_INTERVAL);
+        psocketEvents->Wait(nTimeout, vReady);
+        boost::this_thread::interruption_point();
+
+        //
+        // Accept new connections, and service each ready socket
+        //
+        for (unsigned int i = 0; i < vReady.size(); i++)
         {
             boost::this_thread::interruption_point();
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fListen = false;
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (vReady[i].first == &hListenSocket)
                 {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    fListen = true;
+                    if (hListenSocket.socket != INVALID_SOCKET)
+                        AcceptConnection(hListenSocket);
                 }
             }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
+            if (fListen)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            // Registered nodes are in vNodes until unregistered above, so in vNodesCopy
+            CNode* pnode = static_cast<CNode*>(vReady[i].first);
+            ServiceSocket(pnode, vReady[i].second);
+            // What to wait for next depends on the buffers just filled or drained
+            pnode->fSocketEventsDirty = true;
+        }
+
+        //
+        // Inactivity checking
+        //
+        if (fHousekeeping)
+        {
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+                CheckInactivity(pnode);
+                // Peers paused for the total receive budget resume once
+                // other peers' messages were processed
+                if (pnode->nSocketEvents == 0)
+                    pnode->fSocketEventsDirty = true;
             }
         }
+
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
@@ -1494,8 +1836,22 @@ static std::string GetDNSHost(const CDNSSeedData& data, ServiceFlags* requiredSe
 }
 
 
+bool AddressesLoaded()
+{
+    return fAddressesLoaded;
+}
+
+/** Wait for ThreadLoadAddresses, as peers picked before would leave the saved addresses out */
+static void WaitForAddressesLoaded()
+{
+    while (!fAddressesLoaded)
+        MilliSleep(100);
+}
+
 void ThreadDNSAddressSeed()
 {
+    WaitForAddressesLoaded();
+
     // goal: only query DNS seeds if address need is acute
     // Avoiding DNS seeds when we don't need them improves user privacy by
     //  creating fewer identifying DNS requests, reduces trust by giving seeds
@@ -1566,10 +1922,16 @@ void ThreadDNSAddressSeed()
 
 void DumpAddresses()
 {
+    // Not before peers.dat was read, and not again while nothing changed
+    uint64_t nChangeCount = addrman.GetChangeCount();
+    if (!fAddressesLoaded || nChangeCount == nAddressesSavedChangeCount)
+        return;
+
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (adb.Write(addrman))
+        nAddressesSavedChangeCount = nChangeCount;
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1620,6 +1982,8 @@ void ThreadOpenConnections()
         }
     }
 
+    WaitForAddressesLoaded();
+
     // Initiate network connections
     int64_t nStart = GetTime();
 
@@ -1849,7 +2213,13 @@ bool OpenNetworkConnection(const CAddress& addrConnect, bool fCountFailure, CSem
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Process the messages of the peers whose id is nThread modulo nThreads, so
+ * that each peer's messages are handled in order by one thread while other
+ * peers are served concurrently. What changes the chain state or the peer
+ * bookkeeping in CNodeState stays serialized by cs_main.
+ */
+void ThreadMessageHandler(int nThread, int nThreads)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1859,8 +2229,10 @@ void ThreadMessageHandler()
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->id % nThreads != nThread)
+                    continue;
+                vNodesCopy.push_back(pnode);
                 pnode->AddRef();
             }
         }
@@ -1880,6 +2252,10 @@ void ThreadMessageHandler()
                     if (!GetNodeSignals().ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // The socket handler stopped reading while the receive buffer was full
+                    if (pnode->hSocket != INVALID_SOCKET && pnode->nSocketEvents == 0 && !pnode->fSocketEventsDirty && WantsToReceive(pnode))
+                        WakeSocketHandler(pnode);
+
                     if (pnode->nSendSize < SendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
@@ -2065,25 +2441,31 @@ void static Discover(boost::thread_group& threadGroup)
 #endif
 }
 
-void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
+/** Load addresses from peers.dat while the rest of the node starts */
+static void ThreadLoadAddresses()
 {
-    uiInterface.InitMessage(_("Loading addresses..."));
-    // Load addresses from peers.dat
     int64_t nStart = GetTimeMillis();
-    {
-        CAddrDB adb;
-        if (adb.Read(addrman))
-            LogPrintf("Loaded %i addresses from peers.dat  %dms\n", addrman.size(), GetTimeMillis() - nStart);
-        else {
-            addrman.Clear(); // Addrman can be in an inconsistent state after failure, reset it
-            LogPrintf("Invalid or missing peers.dat; recreating\n");
-            DumpAddresses();
-        }
+    CAddrDB adb;
+    if (adb.Read(addrman)) {
+        nAddressesSavedChangeCount = addrman.GetChangeCount();
+        fAddressesLoaded = true;
+        LogPrintf("Loaded %i addresses from peers.dat  %dms\n", addrman.size(), GetTimeMillis() - nStart);
+    } else {
+        addrman.Clear(); // Addrman can be in an inconsistent state after failure, reset it
+        fAddressesLoaded = true;
+        LogPrintf("Invalid or missing peers.dat; recreating\n");
+        DumpAddresses();
     }
+}
+
+void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
+{
+    // Peers connect only once the threads below run, so few addresses can be learnt before peers.dat replaces them
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "loadaddr", &ThreadLoadAddresses));
 
     uiInterface.InitMessage(_("Loading banlist..."));
     // Load addresses from banlist.dat
-    nStart = GetTimeMillis();
+    int64_t nStart = GetTimeMillis();
     CBanDB bandb;
     banmap_t banmap;
     if (bandb.Read(banmap)) {
@@ -2127,6 +2509,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+    if (psocketEvents == NULL) {
+        psocketEvents = new CSocketEvents(GetArg("-socketevents", ""));
+        LogPrintf("Waiting for socket events with %s\n", psocketEvents->GetMethod());
+    }
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -2135,11 +2521,19 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
-    // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    // Process messages, -msghandthreads=0 means autodetect like -par
+    int nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads += GetNumCores();
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MSGHAND_THREADS));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        boost::function<void()> handlerLoop = boost::bind(&ThreadMessageHandler, i, nMessageHandlerThreads);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", handlerLoop));
+    }
 
     // Dump network addresses
-    scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
+    scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL, CScheduler::PRIORITY_LOW, "dumpdata");
 }
 
 bool StopNode()
@@ -2185,6 +2579,8 @@ public:
         vhListenSocket.clear();
         delete semOutbound;
         semOutbound = NULL;
+        delete psocketEvents;
+        psocketEvents = NULL;
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
 
@@ -2460,17 +2856,22 @@ bool CAddrDB::Read(CAddrMan& addr, CDataStream& ssPeers)
 
 unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", DEFAULT_MAXRECEIVEBUFFER); }
 unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", DEFAULT_MAXSENDBUFFER); }
+size_t TotalReceiveFloodSize() { return 1000*(size_t)GetArg("-maxtotalreceivebuffer", DEFAULT_MAXTOTALRECEIVEBUFFER); }
 
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addr(addrIn),
     nKeyedNetGroup(CalculateKeyedNetGroup(addrIn)),
     addrKnown(5000, 0.001),
-    filterInventoryKnown(50000, 0.000001)
+    filterInventoryKnown(50000, 0.000001),
+    filterInventoryAnnounced(INVENTORY_MAX_RECENT_RELAY, 0.000001)
 {
     nServices = NODE_NONE;
     nServicesExpected = NODE_NONE;
     hSocket = hSocketIn;
+    fSocketEventsDirty = true;
+    nSocketEvents = 0;
+    hSocketEvents = INVALID_SOCKET;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
@@ -2539,6 +2940,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
 CNode::~CNode()
 {
     CloseSocket(hSocket);
+    nTotalSendQueueSize -= nSendSize;
 
     if (pfilter)
         delete pfilter;
@@ -2597,7 +2999,7 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
     LogPrint("net", "(aborted)\n");
 }
 
-void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
+void CNode::EndMessage(const char* pszCommand, const CSharedPayloadRef& payload) UNLOCK_FUNCTION(cs_vSend)
 {
     // The -*messagestest options are intentionally not documented in the help message,
     // since they are only used during development to debug the networking code and are
@@ -2616,30 +3018,42 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
+    assert(!payload || ssSend.size() == CMessageHeader::HEADER_SIZE);
     // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
+    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE + (payload ? payload->size() : 0);
     WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
 
     //log total amount of bytes per command
     mapSendBytesPerMsgCmd[std::string(pszCommand)] += nSize + CMessageHeader::HEADER_SIZE;
+    TRACE4(net, outbound_message, id, addrName.c_str(), pszCommand, nSize);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+    // Set the checksum, which a shared payload computed once for all peers
     unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    if (payload) {
+        nChecksum = payload->GetChecksum();
+    } else {
+        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    }
     assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
     memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::deque<CSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMessage());
+    ssSend.GetAndClear(it->data);
+    it->payload = payload;
+    nSendSize += it->size();
+    nTotalSendQueueSize += it->size();
 
     // If write queue empty, attempt "optimistic write"
     if (it == vSendMsg.begin())
         SocketSendData(this);
 
+    // Have the socket handler wait until the socket takes the rest
+    if (!vSendMsg.empty() && !(nSocketEvents & CSocketEvents::EVENT_SEND))
+        WakeSocketHandler(this);
+
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
@@ -27,6 +27,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -45,6 +46,8 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const int FEELER_INTERVAL = 120;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** The number of transactions announced to a peer remembered, it may fetch those from the mempool */
+static const unsigned int INVENTORY_MAX_RECENT_RELAY = 3500;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 4 MB is currently acceptable). */
@@ -63,6 +66,10 @@ static const bool DEFAULT_UPNP = false;
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 /** The maximum number of entries in setAskFor (larger due to getdata latency)*/
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
+/** -msghandthreads default: the number of threads processing the messages of peers */
+static const int DEFAULT_MSGHAND_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The default for -maxuploadtarget. 0 = Unlimited */
@@ -73,6 +80,8 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Default for -maxtotalreceivebuffer, the receive buffers of all peers together */
+static const size_t DEFAULT_MAXTOTALRECEIVEBUFFER = 100 * 1000;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -81,9 +90,30 @@ static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Defaul
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
+size_t TotalReceiveFloodSize();
+/** Bytes allocated for the payloads of received messages not yet processed, over all peers */
+size_t TotalRecvBufferSize();
+/** Bytes kept in idle receive buffers for reuse */
+size_t IdleRecvBufferSize();
+/** Bytes of the messages queued to send, over all peers */
+size_t TotalSendQueueSize();
 
 typedef int NodeId;
 
+/** The bytes the message queues of one peer hold */
+struct CNodeBufferUsage
+{
+    NodeId nodeid;
+    std::string addrName;
+    //! Messages queued to send; a payload shared by several peers counts for each
+    size_t nSendBytes;
+    //! Buffers of the messages received and not yet processed
+    size_t nRecvBytes;
+};
+
+/** The message queues of every peer */
+std::vector<CNodeBufferUsage> GetNodeBufferUsage();
+
 void AddOneShot(const std::string& strDest);
 void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
@@ -97,6 +127,8 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
+/** Whether peers.dat was read, which StartNode does in the background */
+bool AddressesLoaded();
 void SocketSendData(CNode *pnode);
 
 struct CombinerAll
@@ -217,11 +249,52 @@ public:
 
 
 
+/**
+ * Buffers for the payloads of received messages, kept once the messages are
+ * processed so that the next ones of a similar size reuse them instead of
+ * going back to the allocator. Buffers are sorted into power-of-two size
+ * classes, and only a limited number of bytes is kept idle.
+ */
+class CRecvBufferPool
+{
+public:
+    //! Buffers in the smallest class hold 512 bytes
+    static const int MIN_CLASS_BITS = 9;
+    //! Buffers in the largest class hold 4 MiB, enough for any message
+    static const int MAX_CLASS_BITS = 22;
+    //! Most buffers kept idle in one size class
+    static const size_t MAX_IDLE_PER_CLASS = 64;
+
+    explicit CRecvBufferPool(size_t nMaxIdleBytesIn);
+
+    //! Put an empty buffer with room for at least nSize bytes into data
+    void Get(CSerializeData& data, size_t nSize);
+    //! Take back the buffer in data, which is left empty
+    void Release(CSerializeData& data);
+    //! Bytes in the buffers kept for reuse
+    size_t GetIdleBytes() const;
+
+private:
+    mutable CCriticalSection cs;
+    std::vector<CSerializeData> vIdle[MAX_CLASS_BITS - MIN_CLASS_BITS + 1];
+    size_t nIdleBytes;
+    const size_t nMaxIdleBytes;
+
+    CRecvBufferPool(const CRecvBufferPool&);
+    CRecvBufferPool& operator=(const CRecvBufferPool&);
+};
+
 class CNetMessage {
+private:
+    //! Bytes of the vRecv buffer counted in TotalRecvBufferSize()
+    size_t nBufferSize;
+
+    void UpdateBufferSize();
+
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -230,14 +303,21 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    size_t GetBufferSize() const { return nBufferSize; }
+
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
+        nBufferSize = 0;
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    // The payload buffer goes back to the pool once, from the last owner
+    CNetMessage(CNetMessage&& msg);
+    CNetMessage& operator=(CNetMessage&& msg);
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -247,12 +327,58 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+    /** Make room for up to nMax more bytes of the payload and return where they go, with their number in nSpace */
+    char* prepareData(unsigned int nMax, unsigned int& nSpace);
+    /** Take nBytes written to the room prepareData made as received */
+    void commitData(unsigned int nBytes) { nDataPos += nBytes; }
+};
+
+
+/**
+ * A message payload that is serialized once and queued as it is for every
+ * peer it goes to, such as a block relayed to many peers. The checksum for
+ * the message header is computed once as well.
+ */
+class CSharedPayload
+{
+public:
+    //! Take over the serialized payload in data, which is left empty
+    explicit CSharedPayload(CSerializeData& data);
+    //! Refer to nSize bytes at pch, which pKeepAlive keeps valid
+    CSharedPayload(const char* pch, size_t nSize, const boost::shared_ptr<const void>& pKeepAlive);
+
+    const char* begin() const { return pbegin; }
+    size_t size() const { return nSize; }
+    uint32_t GetChecksum() const { return nChecksum; }
+
+private:
+    CSerializeData vchData;
+    boost::shared_ptr<const void> pKeepAlive;
+    const char* pbegin;
+    size_t nSize;
+    uint32_t nChecksum;
+
+    void SetChecksum();
+};
+
+typedef boost::shared_ptr<const CSharedPayload> CSharedPayloadRef;
+
+/** A message in the send queue of a node: its header, and its payload either in data or shared */
+class CSendMessage
+{
+public:
+    CSerializeData data;
+    CSharedPayloadRef payload;
+
+    size_t size() const
+    {
+        return data.size() + (payload ? payload->size() : 0);
+    }
 };
 
 
@@ -325,11 +451,16 @@ public:
     ServiceFlags nServices;
     ServiceFlags nServicesExpected;
     SOCKET hSocket;
+    //! Set when the socket handler should register the socket for what it waits for again
+    std::atomic<bool> fSocketEventsDirty;
+    //! What the socket handler waits for on hSocketEvents, the socket as it registered it
+    std::atomic<int> nSocketEvents;
+    SOCKET hSocketEvents;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -396,8 +527,11 @@ public:
     int nStartingHeight;
 
     // flood relay
+    // vAddrToSend and addrKnown are protected by cs_addr, as the message
+    // handler threads of other peers relay addresses to this one
     std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    CRollingBlockedBloomFilter addrKnown;
+    CCriticalSection cs_addr;
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -405,6 +539,8 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
+    // Transactions announced to the peer lately, protected by cs_inventory
+    CRollingBloomFilter filterInventoryAnnounced;
     // Set of transaction ids we still have to announce.
     // They are sorted by the mempool before relay, so the order is not important.
     std::set<uint256> setInventoryTxToSend;
@@ -467,6 +603,9 @@ private:
 
     static uint64_t CalculateKeyedNetGroup(const CAddress& ad);
 
+    //! Count a completely received message and wake the message handlers
+    void MessageReceived(CNetMessage& msg);
+
 public:
 
     NodeId GetId() const {
@@ -491,6 +630,17 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    /**
+     * Where the rest of the payload of a partly received message goes, when
+     * at least nMin bytes of it are missing, so that the socket receives into
+     * it without the copy of ReceiveMsgBytes; NULL otherwise. Pass the bytes
+     * written there to ReceivedPayloadBytes.
+     */
+    // requires LOCK(cs_vRecvMsg)
+    char* GetRecvPayloadBuffer(unsigned int nMin, unsigned int& nSpace);
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedPayloadBytes(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -514,6 +664,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addr);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -522,6 +673,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addr);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -567,7 +719,8 @@ public:
     void AbortMessage() UNLOCK_FUNCTION(cs_vSend);
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
-    void EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend);
+    // A payload, if given, is the whole payload: nothing follows the header in ssSend.
+    void EndMessage(const char* pszCommand, const CSharedPayloadRef& payload = CSharedPayloadRef()) UNLOCK_FUNCTION(cs_vSend);
 
     void PushVersion();
 
@@ -619,6 +772,21 @@ public:
         }
     }
 
+    /** Send a message whose payload is shared with the send queues of other peers, without copying it. */
+    void PushMessageShared(const char* pszCommand, const CSharedPayloadRef& payload)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            EndMessage(pszCommand, payload);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
@@ -13,15 +13,45 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <algorithm>
+#include <cmath>
+
+void TxConfirmStats::InitBucketIndex()
+{
+    logFirstBucket = 0;
+    logBucketSpacing = 0;
+    if (buckets.size() > 2 && buckets[0] > 0 && buckets[1] > buckets[0]) {
+        logFirstBucket = log(buckets[0]);
+        logBucketSpacing = log(buckets[1] / buckets[0]);
+    }
+}
+
+unsigned int TxConfirmStats::FindBucketIndex(double val) const
+{
+    unsigned int last = buckets.size() - 1;
+    if (logBucketSpacing <= 0)
+        return std::min((unsigned int)(std::lower_bound(buckets.begin(), buckets.end(), val) - buckets.begin()), last);
+
+    // Guess from the logarithm, then step over the rounding of the boundaries
+    unsigned int index = 0;
+    if (val > buckets[0]) {
+        double guess = ceil((log(val) - logFirstBucket) / logBucketSpacing);
+        index = guess < last ? (unsigned int)guess : last;
+    }
+    while (index > 0 && buckets[index - 1] >= val)
+        index--;
+    while (index < last && buckets[index] < val)
+        index++;
+    return index;
+}
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
                                 unsigned int maxConfirms, double _decay, std::string _dataTypeString)
 {
     decay = _decay;
     dataTypeString = _dataTypeString;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
+    buckets = defaultBuckets;
+    InitBucketIndex();
     confAvg.resize(maxConfirms);
     curBlockConf.resize(maxConfirms);
     unconfTxs.resize(maxConfirms);
@@ -57,7 +87,7 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    unsigned int bucketindex = FindBucketIndex(val);
     for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
         curBlockConf[i - 1][bucketindex]++;
     }
@@ -222,7 +252,7 @@ void TxConfirmStats::Read(CAutoFile& filein)
     avg = fileAvg;
     confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
+    InitBucketIndex();
 
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
@@ -239,16 +269,13 @@ void TxConfirmStats::Read(CAutoFile& filein)
     }
     oldUnconfTxs.resize(buckets.size());
 
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
-
     LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
              numBuckets, dataTypeString, maxConfirms);
 }
 
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    unsigned int bucketindex = FindBucketIndex(val);
     unsigned int blockIndex = nBlockHeight % unconfTxs.size();
     unconfTxs[blockIndex][bucketindex]++;
     LogPrint("estimatefee", "adding to %s", dataTypeString);
@@ -285,7 +312,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
 
 void CBlockPolicyEstimator::removeTx(uint256 hash)
 {
-    std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
+    FlatHashMap<uint256, TxStatsInfo, SaltedTxidHasher>::iterator pos = mapMemPoolTxs.find(hash);
     if (pos == mapMemPoolTxs.end()) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s not found for removeTx\n",
                  hash.ToString().c_str());
@@ -297,7 +324,7 @@ void CBlockPolicyEstimator::removeTx(uint256 hash)
 
     if (stats != NULL)
         stats->removeTx(entryHeight, nBestSeenHeight, bucketIndex);
-    mapMemPoolTxs.erase(hash);
+    mapMemPoolTxs.erase(pos);
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
@@ -323,6 +350,20 @@ CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
     feeLikely = CFeeRate(INF_FEERATE);
     priUnlikely = 0;
     priLikely = INF_PRIORITY;
+
+    UpdateEstimateCache();
+}
+
+void CBlockPolicyEstimator::UpdateEstimateCache()
+{
+    std::shared_ptr<EstimateCache> cache = std::make_shared<EstimateCache>();
+    // It's not possible to get reasonable fee estimates for a target of 1
+    cache->fee.push_back(-1);
+    for (unsigned int confTarget = 2; confTarget <= feeStats.GetMaxConfirms(); confTarget++)
+        cache->fee.push_back(feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight));
+    for (unsigned int confTarget = 1; confTarget <= priStats.GetMaxConfirms(); confTarget++)
+        cache->pri.push_back(priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight));
+    std::atomic_store(&estimateCache, std::shared_ptr<const EstimateCache>(cache));
 }
 
 bool CBlockPolicyEstimator::isFeeDataPoint(const CFeeRate &fee, double pri)
@@ -347,7 +388,8 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
 {
     unsigned int txHeight = entry.GetHeight();
     uint256 hash = entry.GetTx().GetHash();
-    if (mapMemPoolTxs[hash].stats != NULL) {
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    if (info.stats != NULL) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n",
                  hash.ToString().c_str());
 	return;
@@ -378,18 +420,18 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     // what that will be and its too hard to continue updating it
     // so use starting priority as a proxy
     double curPri = entry.GetPriority(txHeight);
-    mapMemPoolTxs[hash].blockHeight = txHeight;
+    info.blockHeight = txHeight;
 
     LogPrint("estimatefee", "Blockpolicy mempool tx %s ", hash.ToString().substr(0,10));
     // Record this as a priority estimate
     if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &priStats;
-        mapMemPoolTxs[hash].bucketIndex =  priStats.NewTx(txHeight, curPri);
+        info.stats = &priStats;
+        info.bucketIndex = priStats.NewTx(txHeight, curPri);
     }
     // Record this as a fee estimate
     else if (isFeeDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &feeStats;
-        mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+        info.stats = &feeStats;
+        info.bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
     }
     else {
         LogPrint("estimatefee", "not adding");
@@ -443,14 +485,18 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
         // And if an attacker can re-org the chain at will, then
         // you've got much bigger problems than "attacker can influence
         // transaction fees."
+        // Its transactions did leave the mempool counts though.
+        UpdateEstimateCache();
         return;
     }
     nBestSeenHeight = nBlockHeight;
 
     // Only want to be updating estimates when our blockchain is synced,
     // otherwise we'll miscalculate how many blocks its taking to get included.
-    if (!fCurrentEstimate)
+    if (!fCurrentEstimate) {
+        UpdateEstimateCache();
         return;
+    }
 
     // Update the dynamic cutoffs
     // a fee/priority is "likely" the reason your tx was included in a block if >85% of such tx's
@@ -487,6 +533,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     // Update all exponential averages with the current block states
     feeStats.UpdateMovingAverages();
     priStats.UpdateMovingAverages();
+    UpdateEstimateCache();
 
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
              entries.size(), mapMemPoolTxs.size());
@@ -494,12 +541,13 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
 
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
+    std::shared_ptr<const EstimateCache> cache = std::atomic_load(&estimateCache);
     // Return failure if trying to analyze a target we're not tracking
     // It's not possible to get reasonable estimates for confTarget of 1
-    if (confTarget <= 1 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 1 || (unsigned int)confTarget > cache->fee.size())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median = cache->fee[confTarget - 1];
 
     if (median < 0)
         return CFeeRate(0);
@@ -509,10 +557,11 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 
 CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
+    std::shared_ptr<const EstimateCache> cache = std::atomic_load(&estimateCache);
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > cache->fee.size())
         return CFeeRate(0);
 
     // It's not possible to get reasonable estimates for confTarget of 1
@@ -520,8 +569,8 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
         confTarget = 2;
 
     double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
-        median = feeStats.EstimateMedianVal(confTarget++, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    while (median < 0 && (unsigned int)confTarget <= cache->fee.size()) {
+        median = cache->fee[confTarget++ - 1];
     }
 
     if (answerFoundAtTarget)
@@ -540,19 +589,21 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
 
 double CBlockPolicyEstimator::estimatePriority(int confTarget)
 {
+    std::shared_ptr<const EstimateCache> cache = std::atomic_load(&estimateCache);
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > cache->pri.size())
         return -1;
 
-    return priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    return cache->pri[confTarget - 1];
 }
 
 double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
+    std::shared_ptr<const EstimateCache> cache = std::atomic_load(&estimateCache);
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > cache->pri.size())
         return -1;
 
     // If mempool is limiting txs, no priority txs are allowed
@@ -561,8 +612,8 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerF
         return INF_PRIORITY;
 
     double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= priStats.GetMaxConfirms()) {
-        median = priStats.EstimateMedianVal(confTarget++, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    while (median < 0 && (unsigned int)confTarget <= cache->pri.size()) {
+        median = cache->pri[confTarget++ - 1];
     }
 
     if (answerFoundAtTarget)
@@ -585,6 +636,7 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein)
     feeStats.Read(filein);
     priStats.Read(filein);
     nBestSeenHeight = nFileBestSeenHeight;
+    UpdateEstimateCache();
 }
 
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
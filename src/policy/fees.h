@@ -6,9 +6,12 @@
 #define BITCOIN_POLICYESTIMATOR_H
 
 #include "amount.h"
+#include "coins.h"
+#include "flathashmap.h"
 #include "uint256.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -81,7 +84,10 @@ class TxConfirmStats
 private:
     //Define the buckets we will group transactions into (both fee buckets and priority buckets)
     std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    // The buckets are spaced exponentially, so the index of the bucket of a
+    // value is found from its logarithm (0 spacing when they are not)
+    double logFirstBucket;
+    double logBucketSpacing;
 
     // For each bucket X:
     // Count the total # of txs in each bucket
@@ -115,7 +121,15 @@ private:
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    /** Work out logFirstBucket and logBucketSpacing from the buckets */
+    void InitBucketIndex();
+
+    /** Index of the lowest bucket whose upper bound is at least val */
+    unsigned int FindBucketIndex(double val) const;
+
 public:
+    TxConfirmStats() : logFirstBucket(0), logBucketSpacing(0), decay(0) {}
+
     /**
      * Initialize the data structures.  This is called by BlockPolicyEstimator's
      * constructor with default values.
@@ -240,7 +254,9 @@ public:
     /** Is this transaction likely included in a block because of its priority?*/
     bool isPriDataPoint(const CFeeRate &fee, double pri);
 
-    /** Return a fee estimate */
+    /** Return a fee estimate. The estimate functions only read the estimates
+     *  worked out after the last block, and may be called without the lock
+     *  that guards the other ones. */
     CFeeRate estimateFee(int confTarget);
 
     /** Estimate fee rate needed to get be included in a block within
@@ -277,11 +293,23 @@ private:
     };
 
     // map of txids to information about that transaction
-    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
+    FlatHashMap<uint256, TxStatsInfo, SaltedTxidHasher> mapMemPoolTxs;
 
     /** Classes to track historical data on transaction confirmations */
     TxConfirmStats feeStats, priStats;
 
+    /** The estimates at every target, indexed by target - 1, or -1 where there is no answer */
+    struct EstimateCache
+    {
+        std::vector<double> fee;
+        std::vector<double> pri;
+    };
+    //! Replaced as a whole and only accessed through std::atomic_load/atomic_store
+    std::shared_ptr<const EstimateCache> estimateCache;
+
+    /** Work out the estimates at every target from the current stats and publish them */
+    void UpdateEstimateCache();
+
     /** Breakpoints to help determine whether a transaction was confirmed by priority or Fee */
     CFeeRate feeLikely, feeUnlikely;
     double priLikely, priUnlikely;
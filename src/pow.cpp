@@ -18,33 +18,38 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHead
     return DigiShield(pindexLast, pblock, params);
 }
 
-unsigned int DigiShield(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
+/** The work required after a block, as far as it does not depend on the time of the next one */
+struct CWorkCacheEntry
 {
-    unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
+    const CBlockIndex* pindexLast;
+    uint256 hashLast;
+    const Consensus::Params* params;
+    unsigned int nBits;
 
-    // Genesis block
-    if (pindexLast == NULL)
-        return nProofOfWorkLimit;
+    CWorkCacheEntry() : pindexLast(NULL), params(NULL), nBits(0) {}
+};
+
+/** Header checks, block templates and getblocktemplate all ask again for the same
+ *  parent. Index entries only go away with the whole index, so the hash guards
+ *  against an entry reusing the address of a freed one. */
+static const unsigned int WORK_CACHE_SIZE = 8;
+static thread_local CWorkCacheEntry workCache[WORK_CACHE_SIZE];
+
+static unsigned int DigiShieldNoCache(const CBlockIndex* pindexLast, const Consensus::Params& params)
+{
+    unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
 
     // Only change once per interval
     if ((pindexLast->nHeight+1) % params.DifficultyAdjustmentInterval() != 0)
     {
         if (params.fPowAllowMinDifficultyBlocks)
         {
-            // Special difficulty rule for testnet:
-            // If the new block's timestamp is more than 2* 10 minutes
-            // then allow mining of a min-difficulty block.
-            if (pblock->GetBlockTime() > pindexLast->GetBlockTime() + params.nPowTargetSpacing*2)
-                return nProofOfWorkLimit;
-            else
-            {
-                // Return the last non-special-min-difficulty-rules-block
-                const CBlockIndex* pindex = pindexLast;
-                while (pindex->pprev && pindex->nHeight % params.DifficultyAdjustmentInterval() != 0 && pindex->nBits == nProofOfWorkLimit)
-                    pindex = pindex->pprev;
-                return pindex->nBits;
-            }
-         }
+            // Return the last non-special-min-difficulty-rules-block
+            const CBlockIndex* pindex = pindexLast;
+            while (pindex->pprev && pindex->nHeight % params.DifficultyAdjustmentInterval() != 0 && pindex->nBits == nProofOfWorkLimit)
+                pindex = pindex->pprev;
+            return pindex->nBits;
+        }
         return pindexLast->nBits;
     }
 
@@ -55,13 +60,40 @@ unsigned int DigiShield(const CBlockIndex* pindexLast, const CBlockHeader *pbloc
         blockstogoback = params.DifficultyAdjustmentInterval();
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback);
     assert(pindexFirst);
 
 	return CalculateNextWorkRequired(pindexLast, pindexFirst->GetBlockTime(), params);
 }	
+
+unsigned int DigiShield(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
+{
+    unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
+
+    // Genesis block
+    if (pindexLast == NULL)
+        return nProofOfWorkLimit;
+
+    // Special difficulty rule for testnet:
+    // If the new block's timestamp is more than 2* 10 minutes
+    // then allow mining of a min-difficulty block.
+    if (params.fPowAllowMinDifficultyBlocks && (pindexLast->nHeight+1) % params.DifficultyAdjustmentInterval() != 0 &&
+        pblock->GetBlockTime() > pindexLast->GetBlockTime() + params.nPowTargetSpacing*2)
+        return nProofOfWorkLimit;
+
+    // Index entries made up outside the block index have no hash to check the cache with
+    if (pindexLast->phashBlock == NULL)
+        return DigiShieldNoCache(pindexLast, params);
+
+    CWorkCacheEntry& entry = workCache[(((uintptr_t)pindexLast) >> 4) % WORK_CACHE_SIZE];
+    if (entry.pindexLast != pindexLast || entry.params != &params || entry.hashLast != *pindexLast->phashBlock) {
+        entry.nBits = DigiShieldNoCache(pindexLast, params);
+        entry.pindexLast = pindexLast;
+        entry.hashLast = *pindexLast->phashBlock;
+        entry.params = &params;
+    }
+    return entry.nBits;
+}
 	
 unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params& params)	
 {
@@ -93,18 +125,51 @@ unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nF
     return bnNew.GetCompact();
 }
 
-bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
+/** An nBits and the target it expands to, for the powLimit it was checked against */
+struct CTargetCacheEntry
 {
-    bool fNegative;
-    bool fOverflow;
-    arith_uint256 bnTarget;
-
-    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    unsigned int nBits;
+    uint256 powLimit;
+    uint256 target;
+    bool fValid;
+    bool fSet;
+
+    CTargetCacheEntry() : nBits(0), fValid(false), fSet(false) {}
+};
+
+/** Targets come in runs: the headers of a chain, the blocks read from disk and
+ *  the attempts of the miner mostly share a few nBits. A cache per thread needs
+ *  no lock. */
+static const unsigned int TARGET_CACHE_SIZE = 16;
+static thread_local CTargetCacheEntry targetCache[TARGET_CACHE_SIZE];
+
+bool DeriveTarget(unsigned int nBits, const uint256& powLimit, uint256& target)
+{
+    CTargetCacheEntry& entry = targetCache[(nBits ^ (nBits >> 8) ^ (nBits >> 24)) % TARGET_CACHE_SIZE];
+    if (!entry.fSet || entry.nBits != nBits || entry.powLimit != powLimit) {
+        bool fNegative;
+        bool fOverflow;
+        arith_uint256 bnTarget;
+
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+
+        // Check range
+        //for testnet bnTarget = uint256S("00000fffff000000000000000000000000000000000000000000000000000000");
+        //for testnet powLimit = uint256S("00000fffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
+        entry.fValid = !(fNegative || bnTarget == 0 || fOverflow || bnTarget > UintToArith256(powLimit));
+        entry.nBits = nBits;
+        entry.powLimit = powLimit;
+        entry.target = ArithToUint256(bnTarget);
+        entry.fSet = true;
+    }
+    target = entry.target;
+    return entry.fValid;
+}
 
-    // Check range
-    //for testnet bnTarget = uint256S("00000fffff000000000000000000000000000000000000000000000000000000");
-    //for testnet powLimit = uint256S("00000fffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
-    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > UintToArith256(params.powLimit)) {
+bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
+{
+    uint256 target;
+    if (!DeriveTarget(nBits, params.powLimit, target)) {
         return false;
     }
 
@@ -113,11 +178,12 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&
         return false;
     }
 
-    // Check proof of work matches claimed amount
-    if (UintToArith256(hash) > bnTarget) {
-        return false;
+    // Check proof of work matches claimed amount, comparing the little endian
+    // bytes from the most significant one
+    for (int i = hash.size() - 1; i >= 0; i--) {
+        if (hash.begin()[i] != target.begin()[i])
+            return hash.begin()[i] < target.begin()[i];
     }
 
     return true;
 }
-
@@ -19,6 +19,12 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHead
 unsigned int DigiShield(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params&);
 unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params&);
 
+/**
+ * Expand nBits to the target it encodes, the hash a proof of work must not exceed.
+ * Returns false if nBits is negative, zero, overflows or is easier than powLimit.
+ */
+bool DeriveTarget(unsigned int nBits, const uint256& powLimit, uint256& target);
+
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
 
@@ -9,7 +9,12 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "support/allocators/arena.h"
+
+#include <algorithm>
 #include <iterator>
+#include <memory>
+#include <type_traits>
 
 #pragma pack(push, 1)
 /** Implements a drop-in replacement for std::vector<T> which stores up to N
@@ -29,6 +34,10 @@
  *
  *  The data type T must be movable by memmove/realloc(). Once we switch to C++,
  *  move constructors can be used instead.
+ *
+ *  Indirect storage is taken from the PrevectorArena of the thread, if it has
+ *  one, and marked so by the top bit of capacity; else from malloc, rounded up
+ *  to the size class malloc would use anyway.
  */
 template<unsigned int N, typename T, typename Size = uint32_t, typename Diff = int32_t>
 class prevector {
@@ -158,28 +167,72 @@ private:
     const T* indirect_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.indirect) + pos; }
     bool is_direct() const { return _size <= N; }
 
+    //! Marks indirect storage taken from a PrevectorArena, in capacity
+    static const size_type ARENA_FLAG = (size_type)1 << (sizeof(size_type) * 8 - 1);
+    bool is_arena() const { return (_union.capacity & ARENA_FLAG) != 0; }
+
+    /** Allocations are made in steps of 16 bytes (see MallocUsage): the elements the
+     *  whole step holds, at least new_capacity */
+    static size_type malloc_capacity(size_type new_capacity) {
+        size_t usable = ((((size_t)sizeof(T)) * new_capacity + 31) >> 4 << 4) - 16;
+        return usable / sizeof(T) < ARENA_FLAG ? usable / sizeof(T) : new_capacity;
+    }
+
+    /** Storage for at least new_capacity elements, from the arena of the thread if it
+     *  has one; new_capacity is set to the capacity of the storage */
+    static char* allocate(size_type& new_capacity) {
+        size_t bytes = ((size_t)sizeof(T)) * new_capacity;
+        PrevectorArena* arena = PrevectorArena::Current();
+        char* p = arena ? static_cast<char*>(arena->Allocate(bytes)) : NULL;
+        if (p) {
+            new_capacity = (PrevectorArena::BlockSize(bytes) / sizeof(T)) | ARENA_FLAG;
+            return p;
+        }
+        new_capacity = malloc_capacity(new_capacity);
+        p = static_cast<char*>(malloc(((size_t)sizeof(T)) * new_capacity));
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void deallocate() {
+        if (is_arena())
+            PrevectorArena::Free(_union.indirect);
+        else
+            free(_union.indirect);
+    }
+
     void change_capacity(size_type new_capacity) {
         if (new_capacity <= N) {
             if (!is_direct()) {
-                T* indirect = indirect_ptr(0);
-                T* src = indirect;
-                T* dst = direct_ptr(0);
-                memcpy(dst, src, size() * sizeof(T));
-                free(indirect);
+                char* indirect = _union.indirect;
+                bool arena = is_arena();
+                memcpy(direct_ptr(0), indirect, size() * sizeof(T));
+                if (arena)
+                    PrevectorArena::Free(indirect);
+                else
+                    free(indirect);
                 _size -= N + 1;
             }
         } else {
-            if (!is_direct()) {
-                _union.indirect = static_cast<char*>(realloc(_union.indirect, ((size_t)sizeof(T)) * new_capacity));
+            if (!is_direct() && !is_arena()) {
+                new_capacity = malloc_capacity(new_capacity);
+                char* new_indirect = static_cast<char*>(realloc(_union.indirect, ((size_t)sizeof(T)) * new_capacity));
+                if (!new_indirect)
+                    throw std::bad_alloc();
+                _union.indirect = new_indirect;
                 _union.capacity = new_capacity;
             } else {
-                char* new_indirect = static_cast<char*>(malloc(((size_t)sizeof(T)) * new_capacity));
-                T* src = direct_ptr(0);
+                char* new_indirect = allocate(new_capacity);
+                T* src = item_ptr(0);
                 T* dst = reinterpret_cast<T*>(new_indirect);
                 memcpy(dst, src, size() * sizeof(T));
+                if (!is_direct())
+                    deallocate();
+                else
+                    _size += N + 1;
                 _union.indirect = new_indirect;
                 _union.capacity = new_capacity;
-                _size += N + 1;
             }
         }
     }
@@ -187,16 +240,30 @@ private:
     T* item_ptr(difference_type pos) { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
     const T* item_ptr(difference_type pos) const { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
 
+    /** Construct elements into already allocated storage. The storage
+     *  location is resolved once, rather than per element, which lets the
+     *  compiler turn these loops into plain copies. */
+    void fill(T* dst, difference_type count, const T& value) {
+        std::uninitialized_fill_n(dst, count, value);
+    }
+
+    template<typename InputIterator>
+    void fill(T* dst, InputIterator first, InputIterator last) {
+        while (first != last) {
+            new(static_cast<void*>(dst)) T(*first);
+            ++dst;
+            ++first;
+        }
+    }
+
 public:
     void assign(size_type n, const T& val) {
         clear();
         if (capacity() < n) {
             change_capacity(n);
         }
-        while (size() < n) {
-            _size++;
-            new(static_cast<void*>(item_ptr(size() - 1))) T(val);
-        }
+        _size += n;
+        fill(item_ptr(0), n, val);
     }
 
     template<typename InputIterator>
@@ -206,11 +273,8 @@ public:
         if (capacity() < n) {
             change_capacity(n);
         }
-        while (first != last) {
-            _size++;
-            new(static_cast<void*>(item_ptr(size() - 1))) T(*first);
-            ++first;
-        }
+        _size += n;
+        fill(item_ptr(0), first, last);
     }
 
     prevector() : _size(0) {}
@@ -221,45 +285,39 @@ public:
 
     explicit prevector(size_type n, const T& val = T()) : _size(0) {
         change_capacity(n);
-        while (size() < n) {
-            _size++;
-            new(static_cast<void*>(item_ptr(size() - 1))) T(val);
-        }
+        _size += n;
+        fill(item_ptr(0), n, val);
     }
 
     template<typename InputIterator>
     prevector(InputIterator first, InputIterator last) : _size(0) {
         size_type n = last - first;
         change_capacity(n);
-        while (first != last) {
-            _size++;
-            new(static_cast<void*>(item_ptr(size() - 1))) T(*first);
-            ++first;
-        }
+        _size += n;
+        fill(item_ptr(0), first, last);
     }
 
     prevector(const prevector<N, T, Size, Diff>& other) : _size(0) {
-        change_capacity(other.size());
-        const_iterator it = other.begin();
-        while (it != other.end()) {
-            _size++;
-            new(static_cast<void*>(item_ptr(size() - 1))) T(*it);
-            ++it;
-        }
+        size_type n = other.size();
+        change_capacity(n);
+        _size += n;
+        fill(item_ptr(0), other.begin(), other.end());
+    }
+
+    prevector(prevector<N, T, Size, Diff>&& other) : _size(0) {
+        swap(other);
     }
 
     prevector& operator=(const prevector<N, T, Size, Diff>& other) {
         if (&other == this) {
             return *this;
         }
-        resize(0);
-        change_capacity(other.size());
-        const_iterator it = other.begin();
-        while (it != other.end()) {
-            _size++;
-            new(static_cast<void*>(item_ptr(size() - 1))) T(*it);
-            ++it;
-        }
+        assign(other.begin(), other.end());
+        return *this;
+    }
+
+    prevector& operator=(prevector<N, T, Size, Diff>&& other) {
+        swap(other);
         return *this;
     }
 
@@ -285,7 +343,7 @@ public:
         if (is_direct()) {
             return N;
         } else {
-            return _union.capacity;
+            return _union.capacity & ~ARENA_FLAG;
         }
     }
 
@@ -304,10 +362,9 @@ public:
         if (new_size > capacity()) {
             change_capacity(new_size);
         }
-        while (size() < new_size) {
-            _size++;
-            new(static_cast<void*>(item_ptr(size() - 1))) T();
-        }
+        size_type increase = new_size - size();
+        _size += increase;
+        fill(item_ptr(new_size - increase), increase, T());
     }
 
     void reserve(size_type new_capacity) {
@@ -344,9 +401,7 @@ public:
         }
         memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
         _size += count;
-        for (size_type i = 0; i < count; i++) {
-            new(static_cast<void*>(item_ptr(p + i))) T(value);
-        }
+        fill(item_ptr(p), count, value);
     }
 
     template<typename InputIterator>
@@ -359,11 +414,7 @@ public:
         }
         memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
         _size += count;
-        while (first != last) {
-            new(static_cast<void*>(item_ptr(p))) T(*first);
-            ++p;
-            ++first;
-        }
+        fill(item_ptr(p), first, last);
     }
 
     iterator erase(iterator pos) {
@@ -373,10 +424,14 @@ public:
     iterator erase(iterator first, iterator last) {
         iterator p = first;
         char* endp = (char*)&(*end());
-        while (p != last) {
-            (*p).~T();
-            _size--;
-            ++p;
+        if (!std::is_trivially_destructible<T>::value) {
+            while (p != last) {
+                (*p).~T();
+                _size--;
+                ++p;
+            }
+        } else {
+            _size -= last - p;
         }
         memmove(&(*first), &(*last), endp - ((char*)(&(*last))));
         return first;
@@ -411,6 +466,14 @@ public:
         return *item_ptr(size() - 1);
     }
 
+    T* data() {
+        return item_ptr(0);
+    }
+
+    const T* data() const {
+        return item_ptr(0);
+    }
+
     void swap(prevector<N, T, Size, Diff>& other) {
         std::swap(_union, other._union);
         std::swap(_size, other._size);
@@ -419,7 +482,7 @@ public:
     ~prevector() {
         clear();
         if (!is_direct()) {
-            free(_union.indirect);
+            deallocate();
             _union.indirect = NULL;
         }
     }
@@ -472,7 +535,7 @@ public:
         if (is_direct()) {
             return 0;
         } else {
-            return ((size_t)(sizeof(T))) * _union.capacity;
+            return ((size_t)(sizeof(T))) * capacity();
         }
     }
 };
@@ -58,10 +58,10 @@ uint256 CBlockHeader::MakePoWHash()
 
 void CBlockHeader::EnsurePrecomputed(unsigned _number) const
 {
-	if (_number % ETHASH_EPOCH_LENGTH > ETHASH_EPOCH_LENGTH * 9 / 10)
+	if (EthashAux::shouldPrefetch(_number))
     {
-        // 90% of the way to the new epoch
-		EthashAux::computeFull(EthashAux::seedHash(_number + ETHASH_EPOCH_LENGTH), true);
+        // -dagprefetch of the way to the new epoch
+		EthashAux::computeFull(EthashAux::seedHash(_number + EthashAux::epochLength()), true);
     }	
 }
 
@@ -79,7 +79,7 @@ std::string CBlock::ToString() const
     
     for (unsigned int i = 0; i < vtx.size(); i++)
     {
-        s << "  " << vtx[i].ToString() << "\n";
+        s << "  " << vtx[i]->ToString() << "\n";
     }
     return s.str();
 }
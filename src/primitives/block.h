@@ -8,6 +8,7 @@
 
 #include "primitives/transaction.h"
 #include "serialize.h"
+#include "support/allocators/arena.h"
 #include "uint256.h"
 
 /** Nodes collect new transactions into a block, hash them into a hash tree,
@@ -88,10 +89,12 @@ class CBlock : public CBlockHeader
 {
 public:
     // network and disk
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
 
     // memory only
     mutable bool fChecked;
+    //! How long CheckBlock took to check the proof of work, in microseconds
+    mutable int64_t nPoWCheckMicros;
 
     CBlock()
     {
@@ -109,6 +112,8 @@ public:
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         READWRITE(*(CBlockHeader*)this);
+        // The scripts of the transactions read are laid out one after the other
+        PrevectorArenaScope arena(ser_action.ForRead());
         READWRITE(vtx);
     }
 
@@ -117,6 +122,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         fChecked = false;
+        nPoWCheckMicros = 0;
     }
 
     CBlockHeader GetBlockHeader() const
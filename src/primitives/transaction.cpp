@@ -70,19 +70,64 @@ uint256 CMutableTransaction::GetHash() const
 void CTransaction::UpdateHash() const
 {
     *const_cast<uint256*>(&hash) = SerializeHash(*this, SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS);
+    witnessHashState.store(WITNESS_HASH_NONE, std::memory_order_relaxed);
 }
 
 uint256 CTransaction::GetWitnessHash() const
 {
-    return SerializeHash(*this, SER_GETHASH, 0);
+    // Without a witness both serializations are the same
+    if (wit.IsNull())
+        return hash;
+    if (witnessHashState.load(std::memory_order_acquire) == WITNESS_HASH_READY)
+        return witnessHash;
+    uint256 hashWitness = SerializeHash(*this, SER_GETHASH, 0);
+    // Only the first thread to get here stores it, the others return their own copy
+    int expected = WITNESS_HASH_NONE;
+    if (witnessHashState.compare_exchange_strong(expected, WITNESS_HASH_STORING, std::memory_order_relaxed)) {
+        witnessHash = hashWitness;
+        witnessHashState.store(WITNESS_HASH_READY, std::memory_order_release);
+    }
+    return hashWitness;
+}
+
+void CTransaction::SetWitness(const CTxWitness& witIn)
+{
+    *const_cast<CTxWitness*>(&wit) = witIn;
+    witnessHashState.store(WITNESS_HASH_NONE, std::memory_order_relaxed);
 }
 
-CTransaction::CTransaction() : nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) { }
+void CTransaction::CopyWitnessHash(const CTransaction& tx)
+{
+    if (tx.witnessHashState.load(std::memory_order_acquire) == WITNESS_HASH_READY) {
+        witnessHash = tx.witnessHash;
+        witnessHashState.store(WITNESS_HASH_READY, std::memory_order_relaxed);
+    } else {
+        witnessHashState.store(WITNESS_HASH_NONE, std::memory_order_relaxed);
+    }
+}
+
+CTransaction::CTransaction() : witnessHashState(WITNESS_HASH_NONE), nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) { }
+
+CTransaction::CTransaction(const CMutableTransaction &tx) : witnessHashState(WITNESS_HASH_NONE), nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), wit(tx.wit), nLockTime(tx.nLockTime) {
+    UpdateHash();
+}
 
-CTransaction::CTransaction(const CMutableTransaction &tx) : nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), wit(tx.wit), nLockTime(tx.nLockTime) {
+CTransaction::CTransaction(CMutableTransaction &&tx) : witnessHashState(WITNESS_HASH_NONE), nVersion(tx.nVersion), vin(std::move(tx.vin)), vout(std::move(tx.vout)), wit(std::move(tx.wit)), nLockTime(tx.nLockTime) {
     UpdateHash();
 }
 
+CTransaction::CTransaction(const CTransaction &tx) : hash(tx.hash), witnessHashState(WITNESS_HASH_NONE), nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), wit(tx.wit), nLockTime(tx.nLockTime) {
+    CopyWitnessHash(tx);
+}
+
+CTransaction::CTransaction(CTransaction &&tx) : hash(tx.hash), witnessHashState(WITNESS_HASH_NONE), nVersion(tx.nVersion), vin(), vout(), wit(), nLockTime(tx.nLockTime) {
+    // The members are const, so they are moved by swapping with the empty ones
+    const_cast<std::vector<CTxIn>*>(&vin)->swap(*const_cast<std::vector<CTxIn>*>(&tx.vin));
+    const_cast<std::vector<CTxOut>*>(&vout)->swap(*const_cast<std::vector<CTxOut>*>(&tx.vout));
+    const_cast<CTxWitness*>(&wit)->vtxinwit.swap(const_cast<CTxWitness*>(&tx.wit)->vtxinwit);
+    CopyWitnessHash(tx);
+}
+
 CTransaction& CTransaction::operator=(const CTransaction &tx) {
     *const_cast<int*>(&nVersion) = tx.nVersion;
     *const_cast<std::vector<CTxIn>*>(&vin) = tx.vin;
@@ -90,6 +135,18 @@ CTransaction& CTransaction::operator=(const CTransaction &tx) {
     *const_cast<CTxWitness*>(&wit) = tx.wit;
     *const_cast<unsigned int*>(&nLockTime) = tx.nLockTime;
     *const_cast<uint256*>(&hash) = tx.hash;
+    CopyWitnessHash(tx);
+    return *this;
+}
+
+CTransaction& CTransaction::operator=(CTransaction &&tx) {
+    *const_cast<int*>(&nVersion) = tx.nVersion;
+    const_cast<std::vector<CTxIn>*>(&vin)->swap(*const_cast<std::vector<CTxIn>*>(&tx.vin));
+    const_cast<std::vector<CTxOut>*>(&vout)->swap(*const_cast<std::vector<CTxOut>*>(&tx.vout));
+    const_cast<CTxWitness*>(&wit)->vtxinwit.swap(const_cast<CTxWitness*>(&tx.wit)->vtxinwit);
+    *const_cast<unsigned int*>(&nLockTime) = tx.nLockTime;
+    *const_cast<uint256*>(&hash) = tx.hash;
+    CopyWitnessHash(tx);
     return *this;
 }
 
@@ -11,6 +11,9 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <atomic>
+#include <memory>
+
 static const int SERIALIZE_TRANSACTION_NO_WITNESS = 0x40000000;
 
 static const int WITNESS_SCALE_FACTOR = 4;
@@ -313,7 +316,7 @@ inline void SerializeTransaction(TxType& tx, Stream& s, Operation ser_action, in
             /* The witness flag is present, and we support witnesses. */
             flags ^= 1;
             const_cast<CTxWitness*>(&tx.wit)->vtxinwit.resize(tx.vin.size());
-            READWRITE(tx.wit);
+            READWRITE(*const_cast<CTxWitness*>(&tx.wit));
         }
         if (flags) {
             /* Unknown flag in the serialization */
@@ -338,7 +341,7 @@ inline void SerializeTransaction(TxType& tx, Stream& s, Operation ser_action, in
         READWRITE(*const_cast<std::vector<CTxOut>*>(&tx.vout));
         if (flags & 1) {
             const_cast<CTxWitness*>(&tx.wit)->vtxinwit.resize(tx.vin.size());
-            READWRITE(tx.wit);
+            READWRITE(*const_cast<CTxWitness*>(&tx.wit));
         }
     }
     READWRITE(*const_cast<uint32_t*>(&tx.nLockTime));
@@ -353,6 +356,14 @@ private:
     /** Memory only. */
     const uint256 hash;
 
+    /** Memory only. Computed on the first GetWitnessHash of a transaction with a witness; witnessHashState
+     *  guards it, so that transactions shared between threads compute it at most once each and never tear it. */
+    enum { WITNESS_HASH_NONE, WITNESS_HASH_STORING, WITNESS_HASH_READY };
+    mutable uint256 witnessHash;
+    mutable std::atomic<int> witnessHashState;
+
+    void CopyWitnessHash(const CTransaction& tx);
+
 public:
     // Default transaction version.
     static const int32_t CURRENT_VERSION=1;
@@ -364,14 +375,15 @@ public:
     static const int32_t MAX_STANDARD_VERSION=2;
 
     // The local variables are made const to prevent unintended modification
-    // without updating the cached hash value. However, CTransaction is not
+    // without updating the cached hash values. However, CTransaction is not
     // actually immutable; deserialization and assignment are implemented,
     // and bypass the constness. This is safe, as they update the entire
-    // structure, including the hash.
+    // structure, including the hashes. The witness does not change the txid,
+    // but it does change the witness hash, so it goes through SetWitness.
     const int32_t nVersion;
     const std::vector<CTxIn> vin;
     const std::vector<CTxOut> vout;
-    CTxWitness wit; // Not const: can change without invalidating the txid cache
+    const CTxWitness wit;
     const uint32_t nLockTime;
 
     /** Construct a CTransaction that qualifies as IsNull() */
@@ -379,8 +391,14 @@ public:
 
     /** Convert a CMutableTransaction into a CTransaction. */
     CTransaction(const CMutableTransaction &tx);
+    CTransaction(CMutableTransaction &&tx);
+
+    /** Copies and moves keep the hashes already computed. */
+    CTransaction(const CTransaction &tx);
+    CTransaction(CTransaction &&tx);
 
     CTransaction& operator=(const CTransaction& tx);
+    CTransaction& operator=(CTransaction&& tx);
 
     ADD_SERIALIZE_METHODS;
 
@@ -400,9 +418,13 @@ public:
         return hash;
     }
 
-    // Compute a hash that includes both transaction and witness data
+    // Compute a hash that includes both transaction and witness data.
+    // It is the txid when there is no witness, and cached once computed.
     uint256 GetWitnessHash() const;
 
+    /** Replace the witness, which leaves the txid as it is */
+    void SetWitness(const CTxWitness& witIn);
+
     // Return sum of txouts.
     CAmount GetValueOut() const;
     // GetValueIn() is a method on CCoinsViewCache, because
@@ -459,6 +481,10 @@ struct CMutableTransaction
     uint256 GetHash() const;
 };
 
+/** A transaction shared by its holders, such as the mempool, relay and compact block code, instead of copied */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 /** Compute the weight of a transaction, as defined by BIP 141 */
 int64_t GetTransactionWeight(const CTransaction &tx);
 
@@ -0,0 +1,303 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "profiler.h"
+
+#include "sync.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#if defined(__linux__) && defined(HAVE_EXECINFO_H) && defined(HAVE_SYS_PRCTL_H)
+#define HAVE_PROFILER 1
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#endif
+
+#if HAVE_PROFILER
+
+/* Deepest stack recorded, and frames of the signal handler and trampoline at its top */
+static const int MAX_DEPTH = 48;
+static const int SKIP_FRAMES = 2;
+/* Samples a buffer holds; FlushProfiler empties one a second */
+static const int SAMPLES_PER_BUFFER = 8192;
+
+struct CProfileSample
+{
+    char szThread[16];
+    int nDepth;
+    void* pc[MAX_DEPTH];
+};
+
+/**
+ * The signal handler writes to the active buffer, without locks or
+ * allocation. FlushProfiler swaps the buffers, waits until no handler writes
+ * to the old one and collects it. A handler that takes a buffer just as it is
+ * swapped out sees that after registering as a writer, and drops its sample.
+ */
+struct CProfileBuffer
+{
+    std::atomic<int> nNext;
+    std::atomic<int> nWriters;
+    CProfileSample vSamples[SAMPLES_PER_BUFFER];
+};
+
+static CProfileBuffer* pBuffers[2] = {NULL, NULL};
+static std::atomic<CProfileBuffer*> pActiveBuffer(NULL);
+static std::atomic<uint64_t> nDroppedSamples(0);
+
+/* The aggregated samples, by thread name and stack */
+typedef std::map<std::vector<void*>, uint64_t> ProfileStacks;
+
+static CCriticalSection cs_profiler;
+static bool fProfilerRunning = false;
+static std::string strProfileFile;
+static int nProfileHz = 0;
+static std::map<std::string, ProfileStacks> mapProfile;
+static uint64_t nProfileSamples = 0;
+static int64_t nLastProfileWrite = 0;
+
+static void ProfileSignalHandler(int)
+{
+    int nSavedErrno = errno;
+    CProfileBuffer* pBuffer = pActiveBuffer.load();
+    if (pBuffer) {
+        pBuffer->nWriters++;
+        if (pActiveBuffer.load() == pBuffer) {
+            int i = pBuffer->nNext++;
+            if (i < SAMPLES_PER_BUFFER) {
+                CProfileSample& sample = pBuffer->vSamples[i];
+                void* pc[MAX_DEPTH + SKIP_FRAMES];
+                int nDepth = backtrace(pc, MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+                sample.nDepth = std::max(nDepth, 0);
+                memcpy(sample.pc, pc + SKIP_FRAMES, sample.nDepth * sizeof(void*));
+                memset(sample.szThread, 0, sizeof(sample.szThread));
+                prctl(PR_GET_NAME, sample.szThread, 0, 0, 0);
+            } else {
+                nDroppedSamples++;
+            }
+        } else {
+            nDroppedSamples++;
+        }
+        pBuffer->nWriters--;
+    }
+    errno = nSavedErrno;
+}
+
+static bool SetProfileTimer(int nHz)
+{
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = nHz > 0 ? 1000000 / nHz : 0;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+/* Move the samples of the active buffer into mapProfile (requires cs_profiler) */
+static void CollectSamples()
+{
+    CProfileBuffer* pBuffer = pActiveBuffer.load();
+    if (!pBuffer)
+        return;
+    pActiveBuffer = pBuffer == pBuffers[0] ? pBuffers[1] : pBuffers[0];
+    while (pBuffer->nWriters.load() != 0)
+        MilliSleep(1);
+    int nSamples = std::min(pBuffer->nNext.load(), SAMPLES_PER_BUFFER);
+    for (int i = 0; i < nSamples; i++) {
+        const CProfileSample& sample = pBuffer->vSamples[i];
+        std::vector<void*> vStack(sample.pc, sample.pc + sample.nDepth);
+        mapProfile[std::string(sample.szThread, strnlen(sample.szThread, sizeof(sample.szThread)))][vStack]++;
+    }
+    nProfileSamples += nSamples;
+    pBuffer->nNext = 0;
+}
+
+static void WriteWord(FILE* file, uintptr_t nWord)
+{
+    fwrite(&nWord, sizeof(nWord), 1, file);
+}
+
+/* Write stacks in the gperftools CPU profile format: a header, one record per stack, a trailer and the memory map pprof symbolizes with */
+static bool WriteProfile(const boost::filesystem::path& path, const std::vector<const ProfileStacks*>& vStacks)
+{
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return false;
+    WriteWord(file, 0);
+    WriteWord(file, 3);
+    WriteWord(file, 0);
+    WriteWord(file, 1000000 / nProfileHz);
+    WriteWord(file, 0);
+    for (size_t i = 0; i < vStacks.size(); i++) {
+        for (ProfileStacks::const_iterator it = vStacks[i]->begin(); it != vStacks[i]->end(); ++it) {
+            WriteWord(file, it->second);
+            WriteWord(file, it->first.size());
+            for (size_t j = 0; j < it->first.size(); j++)
+                WriteWord(file, (uintptr_t)it->first[j]);
+        }
+    }
+    WriteWord(file, 0);
+    WriteWord(file, 1);
+    WriteWord(file, 0);
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+            fwrite(buf, 1, n, file);
+        fclose(maps);
+    }
+    bool fOk = !ferror(file);
+    fOk = fclose(file) == 0 && fOk;
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return false;
+    }
+    return true;
+}
+
+/* Write the file of all threads and one per thread name (requires cs_profiler) */
+static void WriteProfiles()
+{
+    boost::filesystem::path path = GetDataDir() / strProfileFile;
+    std::vector<const ProfileStacks*> vAll;
+    for (std::map<std::string, ProfileStacks>::const_iterator it = mapProfile.begin(); it != mapProfile.end(); ++it) {
+        vAll.push_back(&it->second);
+        // Thread names are our own, but keep a path separator from escaping the datadir
+        std::string strThread = it->first.empty() ? "unnamed" : it->first;
+        for (size_t i = 0; i < strThread.size(); i++)
+            if (!isalnum(strThread[i]) && strThread[i] != '-' && strThread[i] != '_')
+                strThread[i] = '_';
+        if (!WriteProfile(path.string() + "." + strThread, std::vector<const ProfileStacks*>(1, &it->second)))
+            LogPrintf("%s: writing the profile of %s failed\n", __func__, it->first);
+    }
+    if (!WriteProfile(path, vAll))
+        LogPrintf("%s: writing %s failed\n", __func__, path.string());
+    nLastProfileWrite = GetTime();
+}
+
+bool StartProfiler(const std::string& strFile, int nHz, std::string& strError)
+{
+    LOCK(cs_profiler);
+    if (fProfilerRunning) {
+        strError = "The profiler is already running";
+        return false;
+    }
+    if (nHz <= 0 || nHz > 1000) {
+        strError = "The sampling frequency must be between 1 and 1000 Hz";
+        return false;
+    }
+    // backtrace loads libgcc on its first call, which must not happen in the signal handler
+    void* pc[1];
+    backtrace(pc, 1);
+
+    pBuffers[0] = new CProfileBuffer();
+    pBuffers[1] = new CProfileBuffer();
+    pBuffers[0]->nNext = pBuffers[0]->nWriters = 0;
+    pBuffers[1]->nNext = pBuffers[1]->nWriters = 0;
+    nDroppedSamples = 0;
+    mapProfile.clear();
+    nProfileSamples = 0;
+    strProfileFile = strFile;
+    nProfileHz = nHz;
+    nLastProfileWrite = GetTime();
+    pActiveBuffer = pBuffers[0];
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ProfileSignalHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0 || !SetProfileTimer(nHz)) {
+        pActiveBuffer = NULL;
+        delete pBuffers[0];
+        delete pBuffers[1];
+        pBuffers[0] = pBuffers[1] = NULL;
+        strError = "Setting up the profiling timer failed";
+        return false;
+    }
+    fProfilerRunning = true;
+    LogPrintf("Profiling at %d Hz to %s\n", nHz, (GetDataDir() / strFile).string());
+    return true;
+}
+
+void StopProfiler()
+{
+    LOCK(cs_profiler);
+    if (!fProfilerRunning)
+        return;
+    SetProfileTimer(0);
+    // Collect both buffers, so that a handler still running has written or dropped its sample
+    CollectSamples();
+    CollectSamples();
+    pActiveBuffer = NULL;
+    while (pBuffers[0]->nWriters.load() != 0 || pBuffers[1]->nWriters.load() != 0)
+        MilliSleep(1);
+    WriteProfiles();
+    delete pBuffers[0];
+    delete pBuffers[1];
+    pBuffers[0] = pBuffers[1] = NULL;
+    fProfilerRunning = false;
+    LogPrintf("Profiling stopped: %u samples, %u dropped\n", nProfileSamples, nDroppedSamples.load());
+}
+
+void FlushProfiler()
+{
+    LOCK(cs_profiler);
+    if (!fProfilerRunning)
+        return;
+    CollectSamples();
+    if (GetTime() - nLastProfileWrite >= PROFILE_WRITE_INTERVAL)
+        WriteProfiles();
+}
+
+CProfilerStats GetProfilerStats()
+{
+    LOCK(cs_profiler);
+    CProfilerStats stats;
+    stats.fRunning = fProfilerRunning;
+    stats.strFile = fProfilerRunning ? (GetDataDir() / strProfileFile).string() : "";
+    stats.nHz = fProfilerRunning ? nProfileHz : 0;
+    stats.nSamples = nProfileSamples;
+    stats.nDropped = nDroppedSamples.load();
+    return stats;
+}
+
+#else
+
+bool StartProfiler(const std::string& strFile, int nHz, std::string& strError)
+{
+    strError = "The profiler is not supported on this platform";
+    return false;
+}
+
+void StopProfiler() {}
+void FlushProfiler() {}
+
+CProfilerStats GetProfilerStats()
+{
+    CProfilerStats stats;
+    stats.fRunning = false;
+    stats.nHz = 0;
+    stats.nSamples = 0;
+    stats.nDropped = 0;
+    return stats;
+}
+
+#endif
@@ -0,0 +1,44 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PROFILER_H
+#define BITCOIN_PROFILER_H
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * A sampling CPU profiler: a SIGPROF timer interrupts the threads using the
+ * CPU nProfileHz times a CPU second, and the interrupted thread records its
+ * stack and its name as set by RenameThread. The samples are written in the
+ * gperftools CPU profile format, which pprof reads: all threads to the given
+ * file, and the samples of each thread name to the file with the name
+ * appended, e.g. mild.prof.mil-msghand. The files are rewritten every
+ * PROFILE_WRITE_INTERVAL seconds and when the profiler stops, so they always
+ * hold everything since it started.
+ *
+ * Only available on Linux with glibc's backtrace; elsewhere StartProfiler
+ * fails.
+ */
+static const int DEFAULT_PROFILE_HZ = 100;
+/** Seconds between two rewrites of the profile files */
+static const int64_t PROFILE_WRITE_INTERVAL = 60;
+
+struct CProfilerStats
+{
+    bool fRunning;
+    std::string strFile;
+    int nHz;
+    uint64_t nSamples;
+    uint64_t nDropped;
+};
+
+bool StartProfiler(const std::string& strFile, int nHz, std::string& strError);
+/** Stop sampling and write the profile files */
+void StopProfiler();
+/** Collect the samples taken since the last call, and rewrite the files if they are PROFILE_WRITE_INTERVAL old; a scheduler task */
+void FlushProfiler();
+CProfilerStats GetProfilerStats();
+
+#endif // BITCOIN_PROFILER_H
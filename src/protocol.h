@@ -243,6 +243,35 @@ extern const char *GETBLOCKTXN;
  * @since protocol version 70014 as described by BIP 152
  */
 extern const char *BLOCKTXN;
+/**
+ * Asks for the compact filters of a range of blocks, given by filter type, start
+ * height and stop hash. Peer should respond with a "cfilter" message per block.
+ * Only available with service bit NODE_COMPACT_FILTERS, as described by BIP 157.
+ */
+extern const char *GETCFILTERS;
+/**
+ * Contains a BlockFilter, the filter of one block, in response to "getcfilters".
+ */
+extern const char *CFILTER;
+/**
+ * Asks for the filter hashes of a range of blocks, given as for "getcfilters".
+ * Peer should respond with a "cfheaders" message.
+ */
+extern const char *GETCFHEADERS;
+/**
+ * Contains the filter type, the stop hash, the filter header of the block before
+ * the range and the filter hashes of the range.
+ */
+extern const char *CFHEADERS;
+/**
+ * Asks for the filter headers at every CFCHECKPT_INTERVAL blocks up to a stop
+ * hash. Peer should respond with a "cfcheckpt" message.
+ */
+extern const char *GETCFCHECKPT;
+/**
+ * Contains the filter type, the stop hash and the filter headers.
+ */
+extern const char *CFCHECKPT;
 };
 
 /* Get a vector of all valid message types (see above) */
@@ -267,6 +296,9 @@ enum ServiceFlags : uint64_t {
     // Indicates that a node can be asked for blocks and transactions including
     // witness data.
     NODE_WITNESS = (1 << 3),
+    // NODE_COMPACT_FILTERS means the node will serve the basic compact filters of
+    // blocks, and their headers, as described by BIP 157.
+    NODE_COMPACT_FILTERS = (1 << 6),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
@@ -237,7 +237,9 @@ struct CExtPubKey {
 };
 
 /** Users of this module must hold an ECCVerifyHandle. The constructor and
- *  destructor of these are not allowed to run in parallel, though. */
+ *  destructor of these are not allowed to run in parallel, though. The first
+ *  handle builds the verification context's precomputed table, whose size is
+ *  set at build time by --with-secp256k1-ecmult-window. */
 class ECCVerifyHandle
 {
     static int refcount;
@@ -12,6 +12,7 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "clientversion.h"
+#include "main.h"
 #include "net.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -65,8 +66,7 @@ int ClientModel::getNumConnections(unsigned int flags) const
 
 int ClientModel::getNumBlocks() const
 {
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshot()->nHeight;
 }
 
 quint64 ClientModel::getTotalBytesRecv() const
@@ -81,10 +81,9 @@ quint64 ClientModel::getTotalBytesSent() const
 
 QDateTime ClientModel::getLastBlockDate() const
 {
-    LOCK(cs_main);
-
-    if (chainActive.Tip())
-        return QDateTime::fromTime_t(chainActive.Tip()->GetBlockTime());
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+    if (tip->pindex)
+        return QDateTime::fromTime_t(tip->pindex->GetBlockTime());
 
     return QDateTime::fromTime_t(Params().GenesisBlock().GetBlockTime()); // Genesis block's time of current network
 }
@@ -103,10 +102,7 @@ double ClientModel::getVerificationProgress(const CBlockIndex *tipIn) const
 {
     CBlockIndex *tip = const_cast<CBlockIndex *>(tipIn);
     if (!tip)
-    {
-        LOCK(cs_main);
-        tip = chainActive.Tip();
-    }
+        tip = const_cast<CBlockIndex *>(GetChainTipSnapshot()->pindex);
     return Checkpoints::GuessVerificationProgress(Params().Checkpoints(), tip);
 }
 
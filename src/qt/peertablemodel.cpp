@@ -74,13 +74,15 @@ public:
             }
         }
 
-        // Try to retrieve the CNodeStateStats for each node.
+        // Retrieve the CNodeStateStats for each node from the last snapshot, without cs_main
         {
-            TRY_LOCK(cs_main, lockMain);
-            if (lockMain)
+            std::shared_ptr<const NodeStateStatsMap> stateStats = GetNodeStateStatsSnapshot();
+            BOOST_FOREACH(CNodeCombinedStats &stats, cachedNodeStats)
             {
-                BOOST_FOREACH(CNodeCombinedStats &stats, cachedNodeStats)
-                    stats.fNodeStateStatsAvailable = GetNodeStateStats(stats.nodeStats.nodeid, stats.nodeStateStats);
+                NodeStateStatsMap::const_iterator it = stateStats->find(stats.nodeStats.nodeid);
+                stats.fNodeStateStatsAvailable = (it != stateStats->end());
+                if (stats.fNodeStateStatsAvailable)
+                    stats.nodeStateStats = it->second;
             }
         }
 
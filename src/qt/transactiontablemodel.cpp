@@ -26,7 +26,13 @@
 #include <QIcon>
 #include <QList>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
 // Amount column is right-aligned it contains numbers
 static int column_alignments[] = {
@@ -55,38 +61,127 @@ struct TxLessThan
     }
 };
 
+// Number of wallet transactions the loader decomposes per lock of cs_main and cs_wallet
+static const size_t LOAD_PAGE_SIZE = 500;
+
 // Private implementation
 class TransactionTablePriv
 {
 public:
     TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent) :
         wallet(wallet),
-        parent(parent)
+        parent(parent),
+        fStopLoading(false)
+    {
+    }
+
+    ~TransactionTablePriv()
     {
+        fStopLoading = true;
+        if(loaderThread.joinable())
+            loaderThread.join();
     }
 
     CWallet *wallet;
     TransactionTableModel *parent;
 
-    /* Local cache of wallet.
-     * As it is in the same order as the CWallet, by definition
-     * this is sorted by sha256.
+    /* Local cache of wallet, sorted by sha256.
      */
     QList<TransactionRecord> cachedWallet;
 
-    /* Query entire wallet anew from core.
+    boost::thread loaderThread;
+    std::atomic<bool> fStopLoading;
+    /* Pages decomposed by the loader thread, one per queued addLoadedTransactions call */
+    CCriticalSection cs_loadedPages;
+    std::deque<QList<TransactionRecord> > loadedPages;
+
+    /* Query entire wallet anew from core. The rows are decomposed on a thread of
+     * their own and arrive a page at a time, so that a large wallet does not
+     * hold up the GUI, nor cs_main and cs_wallet for long.
      */
     void refreshWallet()
     {
         qDebug() << "TransactionTablePriv::refreshWallet";
         cachedWallet.clear();
+        loaderThread = boost::thread(boost::bind(&TransactionTablePriv::loadWallet, this));
+    }
+
+    void loadWallet()
+    {
+        RenameThread("mil-txtable");
+        std::vector<uint256> vHashes;
         {
+            LOCK(wallet->cs_wallet);
+            vHashes.reserve(wallet->mapWallet.size());
+            for(WalletTxMap::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+                vHashes.push_back(it->first);
+        }
+        // In the order of cachedWallet, so that most pages go at its end
+        std::sort(vHashes.begin(), vHashes.end());
+
+        for (size_t nPos = 0; nPos < vHashes.size() && !fStopLoading; nPos += LOAD_PAGE_SIZE)
+        {
+            QList<TransactionRecord> page;
             LOCK2(cs_main, wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+            for (size_t i = nPos; i < std::min(nPos + LOAD_PAGE_SIZE, vHashes.size()); i++)
+            {
+                // Gone since the hashes were taken: its CT_DELETED is on its way or already handled
+                WalletTxMap::iterator mi = wallet->mapWallet.find(vHashes[i]);
+                if(mi != wallet->mapWallet.end() && TransactionRecord::showTransaction(mi->second))
+                    page.append(TransactionRecord::decomposeTransaction(wallet, mi->second));
+            }
+            if(page.isEmpty())
+                continue;
+            // Queued while cs_wallet is held, so that the page reaches the model
+            // before the notifications of any later change to its transactions
             {
-                if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+                LOCK(cs_loadedPages);
+                loadedPages.push_back(page);
             }
+            QMetaObject::invokeMethod(parent, "addLoadedTransactions", Qt::QueuedConnection);
+        }
+    }
+
+    /* Merge the oldest page of the loader into the model */
+    void addLoadedPage()
+    {
+        QList<TransactionRecord> page;
+        {
+            LOCK(cs_loadedPages);
+            if(loadedPages.empty())
+                return;
+            page.swap(loadedPages.front());
+            loadedPages.pop_front();
+        }
+
+        // Nothing was added by notifications past the start of the page: one insertion
+        if(cachedWallet.isEmpty() || cachedWallet.last().hash < page.first().hash)
+        {
+            parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size()+page.size()-1);
+            cachedWallet.append(page);
+            parent->endInsertRows();
+            return;
+        }
+
+        // The records of a transaction are next to each other
+        int nStart = 0;
+        while(nStart < page.size())
+        {
+            int nEnd = nStart + 1;
+            while(nEnd < page.size() && page[nEnd].hash == page[nStart].hash)
+                nEnd++;
+            QList<TransactionRecord>::iterator lower = qLowerBound(
+                cachedWallet.begin(), cachedWallet.end(), page[nStart].hash, TxLessThan());
+            // Already in the model if a CT_NEW or CT_UPDATED got there first
+            if(lower == cachedWallet.end() || lower->hash != page[nStart].hash)
+            {
+                int lowerIndex = (lower - cachedWallet.begin());
+                parent->beginInsertRows(QModelIndex(), lowerIndex, lowerIndex+nEnd-nStart-1);
+                for(int i = nStart; i < nEnd; i++)
+                    cachedWallet.insert(lowerIndex+i-nStart, page[i]);
+                parent->endInsertRows();
+            }
+            nStart = nEnd;
         }
     }
 
@@ -132,7 +227,7 @@ public:
             {
                 LOCK2(cs_main, wallet->cs_wallet);
                 // Find transaction in wallet
-                std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
+                WalletTxMap::iterator mi = wallet->mapWallet.find(hash);
                 if(mi == wallet->mapWallet.end())
                 {
                     qWarning() << "TransactionTablePriv::updateWallet: Warning: Got CT_NEW, but transaction is not in wallet";
@@ -196,7 +291,7 @@ public:
                 TRY_LOCK(wallet->cs_wallet, lockWallet);
                 if(lockWallet && rec->statusUpdateNeeded())
                 {
-                    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
+                    WalletTxMap::iterator mi = wallet->mapWallet.find(rec->hash);
 
                     if(mi != wallet->mapWallet.end())
                     {
@@ -213,7 +308,7 @@ public:
     {
         {
             LOCK2(cs_main, wallet->cs_wallet);
-            std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
+            WalletTxMap::iterator mi = wallet->mapWallet.find(rec->hash);
             if(mi != wallet->mapWallet.end())
             {
                 return TransactionDesc::toHTML(wallet, mi->second, rec, unit);
@@ -225,7 +320,7 @@ public:
     QString getTxHex(TransactionRecord *rec)
     {
         LOCK2(cs_main, wallet->cs_wallet);
-        std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
+        WalletTxMap::iterator mi = wallet->mapWallet.find(rec->hash);
         if(mi != wallet->mapWallet.end())
         {
             std::string strHex = EncodeHexTx(static_cast<CTransaction>(mi->second));
@@ -244,16 +339,17 @@ TransactionTableModel::TransactionTableModel(const PlatformStyle *platformStyle,
         platformStyle(platformStyle)
 {
     columns << QString() << QString() << tr("Date") << tr("Type") << tr("Label") << BitcoinUnits::getAmountColumnTitle(walletModel->getOptionsModel()->getDisplayUnit());
+    // Subscribed first, so that no transaction added while the wallet loads is missed
+    subscribeToCoreSignals();
     priv->refreshWallet();
 
     connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
-
-    subscribeToCoreSignals();
 }
 
 TransactionTableModel::~TransactionTableModel()
 {
     unsubscribeFromCoreSignals();
+    // Waits for the loader thread
     delete priv;
 }
 
@@ -272,6 +368,15 @@ void TransactionTableModel::updateTransaction(const QString &hash, int status, b
     priv->updateWallet(updated, status, showTransaction);
 }
 
+void TransactionTableModel::addLoadedTransactions()
+{
+    // Transactions the wallet had all along: no notifications for them
+    bool fProcessing = fProcessingQueuedTransactions;
+    fProcessingQueuedTransactions = true;
+    priv->addLoadedPage();
+    fProcessingQueuedTransactions = fProcessing;
+}
+
 void TransactionTableModel::updateConfirmations()
 {
     // Blocks came in since last poll.
@@ -738,7 +843,7 @@ static std::vector< TransactionNotification > vQueueNotifications;
 static void NotifyTransactionChanged(TransactionTableModel *ttm, CWallet *wallet, const uint256 &hash, ChangeType status)
 {
     // Find transaction in wallet
-    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
+    WalletTxMap::iterator mi = wallet->mapWallet.find(hash);
     // Determine whether to show transaction or not (determine this here so that no relocking is needed in GUI thread)
     bool inWallet = mi != wallet->mapWallet.end();
     bool showTransaction = (inWallet && TransactionRecord::showTransaction(mi->second));
@@ -3,15 +3,20 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "base58.h"
+#include "blockfilter.h"
 #include "chain.h"
 #include "chainparams.h"
+#include "indexbuilder.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "main.h"
 #include "httpserver.h"
+#include "rpc/blockchain.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "utilstrencodings.h"
 #include "version.h"
@@ -64,6 +69,11 @@ extern UniValue mempoolInfoToJSON();
 extern UniValue mempoolToJSON(bool fVerbose = false);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
+extern UniValue getaddressutxos(const UniValue& params, bool fHelp);
+extern UniValue getaddresstxids(const UniValue& params, bool fHelp);
+extern UniValue getaddressbalance(const UniValue& params, bool fHelp);
+extern UniValue getspentinfo(const UniValue& params, bool fHelp);
+extern UniValue getrpcstats(const UniValue& params, bool fHelp);
 
 static bool RESTERR(HTTPRequest* req, enum HTTPStatusCode status, string message)
 {
@@ -126,6 +136,66 @@ static bool CheckWarmup(HTTPRequest* req)
     return true;
 }
 
+/** The ETag of results that only change when the chain tip does */
+static string TipETag()
+{
+    LOCK(cs_main);
+    return "\"" + chainActive.Tip()->GetBlockHash().GetHex() + "\"";
+}
+
+/** Reply 304 if the client already has the results tagged strETag */
+static bool NotModified(HTTPRequest* req, const string& strETag)
+{
+    std::pair<bool, string> ifNoneMatch = req->GetHeader("If-None-Match");
+    if (!ifNoneMatch.first || ifNoneMatch.second != strETag)
+        return false;
+    req->WriteHeader("ETag", strETag);
+    req->WriteReply(HTTP_NOT_MODIFIED);
+    return true;
+}
+
+/** Let caches keep the reply, checking back with strETag before reusing it */
+static void WriteCacheHeaders(HTTPRequest* req, const string& strETag)
+{
+    req->WriteHeader("ETag", strETag);
+    req->WriteHeader("Cache-Control", "public, no-cache");
+}
+
+/** Reply with ssData in the binary or hex format, or return false for another format */
+static bool WriteBinaryReply(HTTPRequest* req, enum RetFormat rf, const CDataStream& ssData)
+{
+    if (rf == RF_BINARY) {
+        string binaryData = ssData.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryData);
+        return true;
+    }
+    if (rf == RF_HEX) {
+        string strHex = HexStr(ssData.begin(), ssData.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+    return false;
+}
+
+/** Reply with the result of an RPC call in JSON, or its error message */
+static bool WriteRPCReply(HTTPRequest* req, rpcfn_type actor, const UniValue& params)
+{
+    UniValue result;
+    try {
+        result = actor(params, false);
+    } catch (const UniValue& objError) {
+        return RESTERR(req, HTTP_NOT_FOUND, find_value(objError, "message").get_str());
+    } catch (const std::exception& e) {
+        return RESTERR(req, HTTP_INTERNAL_SERVER_ERROR, e.what());
+    }
+    string strJSON = result.write() + "\n";
+    req->WriteHeader("Content-Type", "application/json");
+    req->WriteReply(HTTP_OK, strJSON);
+    return true;
+}
+
 static bool rest_headers(HTTPRequest* req,
                          const std::string& strURIPart)
 {
@@ -154,11 +224,12 @@ static bool rest_headers(HTTPRequest* req,
         LOCK(cs_main);
         BlockMap::const_iterator it = mapBlockIndex.find(hash);
         const CBlockIndex *pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
-        while (pindex != NULL && chainActive.Contains(pindex)) {
+        const CChain& chain = HeadersChain();
+        while (pindex != NULL && chain.Contains(pindex)) {
             headers.push_back(pindex);
             if (headers.size() == (unsigned long)count)
                 break;
-            pindex = chainActive.Next(pindex);
+            pindex = chain.Next(pindex);
         }
     }
 
@@ -200,6 +271,115 @@ static bool rest_headers(HTTPRequest* req,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+/** The filter type and the rest of the path of a block filter query, false once an error is replied */
+static bool ParseBlockFilterPath(HTTPRequest* req, const std::string& strPath, const std::string& strUsage, BlockFilterType& filterType, vector<string>& path)
+{
+    boost::split(path, strPath, boost::is_any_of("/"));
+    if (path.size() < 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Use " + strUsage);
+    if (!BlockFilterTypeByName(path[0], filterType))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Unknown filter type: " + path[0]);
+    if (!fBlockFilterIndex)
+        return RESTERR(req, HTTP_NOT_FOUND, "The block filter index is not enabled (-blockfilterindex)");
+    if (IsIndexBuilding("blockfilterindex"))
+        return RESTERR(req, HTTP_SERVICE_UNAVAILABLE, "The block filter index is still being built");
+    path.erase(path.begin());
+    return true;
+}
+
+static bool rest_blockfilter(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    const std::string strUsage = "/rest/blockfilter/<type>/<hash>.<ext>";
+    BlockFilterType filterType;
+    vector<string> path;
+    if (!ParseBlockFilterPath(req, param, strUsage, filterType, path))
+        return false;
+    if (path.size() != 1)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Use " + strUsage);
+    if (rf == RF_UNDEF)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+
+    uint256 hash;
+    if (!ParseHashStr(path[0], hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[0]);
+    BlockFilter filter;
+    if (!pblockfilterdb->ReadBlockFilter(hash, filter))
+        return RESTERR(req, HTTP_NOT_FOUND, hash.GetHex() + " filter not found");
+
+    if (rf == RF_JSON) {
+        UniValue result(UniValue::VOBJ);
+        result.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+        result.push_back(Pair("hash", filter.GetHash().GetHex()));
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, result.write() + "\n");
+        return true;
+    }
+    CDataStream ssData(SER_NETWORK, PROTOCOL_VERSION);
+    ssData << filter.GetEncodedFilter();
+    return WriteBinaryReply(req, rf, ssData);
+}
+
+static bool rest_blockfilterheaders(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    const std::string strUsage = "/rest/blockfilterheaders/<type>/<count>/<hash>.<ext>";
+    BlockFilterType filterType;
+    vector<string> path;
+    if (!ParseBlockFilterPath(req, param, strUsage, filterType, path))
+        return false;
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Use " + strUsage);
+    if (rf == RF_UNDEF)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+
+    long count = strtol(path[0].c_str(), NULL, 10);
+    if (count < 1 || count > (long)MAX_GETCFHEADERS_SIZE)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Header count out of range: " + path[0]);
+    uint256 hash;
+    if (!ParseHashStr(path[1], hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[1]);
+
+    std::vector<uint256> vHashes;
+    vHashes.reserve(count);
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        const CBlockIndex *pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
+        while (pindex != NULL && chainActive.Contains(pindex)) {
+            vHashes.push_back(pindex->GetBlockHash());
+            if (vHashes.size() == (unsigned long)count)
+                break;
+            pindex = chainActive.Next(pindex);
+        }
+    }
+
+    std::vector<uint256> vHeaders(vHashes.size());
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        if (!pblockfilterdb->ReadBlockFilterHeader(vHashes[i], vHeaders[i]))
+            return RESTERR(req, HTTP_NOT_FOUND, vHashes[i].GetHex() + " filter header not found");
+    }
+
+    if (rf == RF_JSON) {
+        UniValue result(UniValue::VARR);
+        BOOST_FOREACH(const uint256& header, vHeaders)
+            result.push_back(header.GetHex());
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, result.write() + "\n");
+        return true;
+    }
+    CDataStream ssData(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH(const uint256& header, vHeaders)
+        ssData << header;
+    return WriteBinaryReply(req, rf, ssData);
+}
+
 static bool rest_block(HTTPRequest* req,
                        const std::string& strURIPart,
                        bool showTxDetails)
@@ -213,7 +393,11 @@ static bool rest_block(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
+    if (rf != RF_BINARY && rf != RF_HEX && rf != RF_JSON)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+
     CBlock block;
+    std::shared_ptr<const CBlockRendering> rendering;
     CBlockIndex* pblockindex = NULL;
     {
         LOCK(cs_main);
@@ -224,15 +408,21 @@ static bool rest_block(HTTPRequest* req,
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        // The hex and JSON renderings come from the cache getblock shares
+        if (rf == RF_BINARY) {
+            if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        } else {
+            BlockRenderMode mode = rf == RF_HEX ? BLOCK_RENDER_HEX : showTxDetails ? BLOCK_RENDER_JSON_TXDETAILS : BLOCK_RENDER_JSON;
+            if (!GetBlockRendering(pblockindex, mode, rendering))
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        }
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+        ssBlock << block;
         string binaryBlock = ssBlock.str();
         req->WriteHeader("Content-Type", "application/octet-stream");
         req->WriteReply(HTTP_OK, binaryBlock);
@@ -240,15 +430,14 @@ static bool rest_block(HTTPRequest* req,
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
+        string strHex = rendering->strHex + "\n";
         req->WriteHeader("Content-Type", "text/plain");
         req->WriteReply(HTTP_OK, strHex);
         return true;
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
+        string strJSON = BlockRenderingToJSONString(pblockindex, *rendering) + "\n";
         req->WriteHeader("Content-Type", "application/json");
         req->WriteReply(HTTP_OK, strJSON);
         return true;
@@ -301,6 +490,29 @@ static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_rpcstats(HTTPRequest* req, const std::string& strURIPart)
+{
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue rpcParams(UniValue::VARR);
+        UniValue statsObject = getrpcstats(rpcParams, false);
+        string strJSON = statsObject.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static bool rest_mempool_info(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -333,7 +545,34 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
     std::string param;
     const RetFormat rf = ParseDataFormat(param, strURIPart);
 
+    // The binary formats take the sequence number of an earlier snapshot,
+    // /rest/mempool/contents/<sequence>.bin, to get the delta since
+    uint64_t nSinceSequence = 0;
+    if (!param.empty()) {
+        if (rf == RF_JSON || param[0] != '/' || !ParseUInt64(param.substr(1), &nSinceSequence))
+            return RESTERR(req, HTTP_BAD_REQUEST, "Invalid sequence number: " + param);
+    }
+
     switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        CMempoolSnapshot snapshot;
+        mempool.GetSnapshot(nSinceSequence, snapshot);
+
+        CDataStream ssSnapshot(SER_NETWORK, PROTOCOL_VERSION);
+        ssSnapshot << snapshot;
+        if (rf == RF_BINARY) {
+            string binarySnapshot = ssSnapshot.str();
+            req->WriteHeader("Content-Type", "application/octet-stream");
+            req->WriteReply(HTTP_OK, binarySnapshot);
+        } else {
+            string strHex = HexStr(ssSnapshot.begin(), ssSnapshot.end()) + "\n";
+            req->WriteHeader("Content-Type", "text/plain");
+            req->WriteReply(HTTP_OK, strHex);
+        }
+        return true;
+    }
+
     case RF_JSON: {
         UniValue mempoolObject = mempoolToJSON(true);
 
@@ -343,7 +582,7 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
         return true;
     }
     default: {
-        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
     }
     }
 
@@ -403,6 +642,121 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_address(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    vector<string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+
+    if (path.size() != 2 || (path[1] != "utxos" && path[1] != "txids" && path[1] != "balance"))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Use /rest/address/<address>/<utxos|txids|balance>.<ext>");
+    if (rf == RF_UNDEF)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+
+    uint160 hashBytes;
+    int type = 0;
+    if (!CBitcoinAddress(path[0]).GetIndexKey(hashBytes, type))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid address: " + path[0]);
+    if (IsIndexBuilding("addressindex"))
+        return RESTERR(req, HTTP_SERVICE_UNAVAILABLE, "The address index is still being built");
+
+    // The address index only covers the chain, so these results are those
+    // of the current tip
+    const string strETag = TipETag();
+    if (NotModified(req, strETag))
+        return true;
+
+    CDataStream ssData(SER_NETWORK, PROTOCOL_VERSION);
+    if (path[1] == "utxos") {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+        if (rf != RF_JSON) {
+            if (!GetAddressUnspent(hashBytes, type, unspentOutputs))
+                return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+            ssData << unspentOutputs;
+        }
+    } else if (path[1] == "txids") {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        if (rf != RF_JSON) {
+            if (!GetAddressIndex(hashBytes, type, addressIndex))
+                return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+            // The entries of a transaction are next to each other
+            std::vector<uint256> vTxid;
+            for (size_t i = 0; i < addressIndex.size(); i++)
+                if (vTxid.empty() || vTxid.back() != addressIndex[i].first.txhash)
+                    vTxid.push_back(addressIndex[i].first.txhash);
+            ssData << vTxid;
+        }
+    } else {
+        CAddressBalanceValue balance;
+        if (rf != RF_JSON) {
+            if (!GetAddressBalance(hashBytes, type, balance))
+                return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+            ssData << balance;
+        }
+    }
+
+    WriteCacheHeaders(req, strETag);
+    if (rf == RF_JSON) {
+        UniValue params(UniValue::VARR);
+        params.push_back(path[0]);
+        rpcfn_type actor = path[1] == "utxos" ? getaddressutxos : path[1] == "txids" ? getaddresstxids : getaddressbalance;
+        return WriteRPCReply(req, actor, params);
+    }
+    return WriteBinaryReply(req, rf, ssData);
+}
+
+static bool rest_spent(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    vector<string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Use /rest/spent/<txid>/<n>.<ext>");
+    if (rf == RF_UNDEF)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+
+    uint256 txid;
+    if (!ParseHashStr(path[0], txid))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[0]);
+    int32_t nOutput;
+    if (!ParseInt32(path[1], &nOutput) || nOutput < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid output index: " + path[1]);
+    if (IsIndexBuilding("spentindex"))
+        return RESTERR(req, HTTP_SERVICE_UNAVAILABLE, "The spent index is still being built");
+
+    const string strETag = TipETag();
+    CSpentIndexKey key(txid, nOutput);
+    CSpentIndexValue value;
+    if (!GetSpentIndex(key, value))
+        return RESTERR(req, HTTP_NOT_FOUND, "Unable to get spent info");
+
+    // A spend still in the mempool may yet change without the tip doing so
+    if (value.blockHeight > 0) {
+        if (NotModified(req, strETag))
+            return true;
+        WriteCacheHeaders(req, strETag);
+    }
+
+    if (rf == RF_JSON) {
+        UniValue spent(UniValue::VOBJ);
+        spent.push_back(Pair("txid", txid.GetHex()));
+        spent.push_back(Pair("index", nOutput));
+        UniValue params(UniValue::VARR);
+        params.push_back(spent);
+        return WriteRPCReply(req, getspentinfo, params);
+    }
+    CDataStream ssData(SER_NETWORK, PROTOCOL_VERSION);
+    ssData << value;
+    return WriteBinaryReply(req, rf, ssData);
+}
+
 static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -607,10 +961,15 @@ static const struct {
       {"/rest/block/notxdetails/", rest_block_notxdetails},
       {"/rest/block/", rest_block_extended},
       {"/rest/chaininfo", rest_chaininfo},
+      {"/rest/rpcstats", rest_rpcstats},
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
+      {"/rest/blockfilter/", rest_blockfilter},
+      {"/rest/blockfilterheaders/", rest_blockfilterheaders},
       {"/rest/getutxos", rest_getutxos},
+      {"/rest/address/", rest_address},
+      {"/rest/spent/", rest_spent},
 };
 
 bool StartREST()
@@ -7,24 +7,36 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coins.h"
 #include "consensus/validation.h"
+#include "indexbuilder.h"
 #include "main.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
 #include "wallet/rpcwallet.h"
+#include "rpc/blockchain.h"
+#include "rpc/jobs.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utxosnapshot.h"
+#include "utxostats.h"
 #include "hash.h"
 
+#include <list>
+#include <map>
 #include <stdint.h>
+#include <tuple>
 
 //#include <univalue.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread/thread.hpp> // boost::thread::interrupt
 
 using namespace std;
@@ -66,11 +78,13 @@ double GetDifficulty(const CBlockIndex* blockindex)
 UniValue blockheaderToJSON(const CBlockIndex* blockindex)
 {
     UniValue result(UniValue::VOBJ);
+    // Needs no cs_main: the tip snapshot stands in for chainActive
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
+    if (tip->Contains(blockindex))
+        confirmations = tip->nHeight - blockindex->nHeight + 1;
     result.push_back(Pair("confirmations", confirmations));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", blockindex->nVersion));
@@ -80,26 +94,23 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("mediantime", (int64_t)blockindex->GetMedianTimePast()));
     result.push_back(Pair("nonce", (uint64_t)blockindex->nNonce));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
+    if (blockindex->nStatus & BLOCK_HAVE_POWHASH)
+        result.push_back(Pair("powhash", blockindex->hashPoW.GetHex()));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+    const CBlockIndex *pnext = tip->Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     return result;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+/** The fields of blockToJSON that do not change with the active chain: all but hash, confirmations and nextblockhash */
+static UniValue blockBodyToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails)
 {
     UniValue result(UniValue::VOBJ);
-    result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
-    int confirmations = -1;
-    // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
     result.push_back(Pair("strippedsize", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS)));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("weight", (int)::GetBlockWeight(block)));
@@ -108,16 +119,16 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("versionHex", strprintf("%08x", block.nVersion)));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
     {
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
-            TxToJSON(tx, uint256(), objTx);
+            TxToJSON(*tx, uint256(), objTx);
             txs.push_back(objTx);
         }
         else
-            txs.push_back(tx.GetHash().GetHex());
+            txs.push_back(tx->GetHash().GetHex());
     }
     result.push_back(Pair("tx", txs));
     result.push_back(Pair("time", block.GetBlockTime()));
@@ -128,17 +139,151 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
         result.push_back(Pair("mixhash", block.mixhash.GetHex()));
         result.push_back(Pair("blockheight",(int) block.nHeight));
     }
+    if (blockindex->nStatus & BLOCK_HAVE_POWHASH)
+        result.push_back(Pair("powhash", blockindex->hashPoW.GetHex()));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+    return result;
+}
+
+/** The confirmations of blockindex in tip, -1 if it is not on the main chain */
+static int GetConfirmations(const CChainTipSnapshot& tip, const CBlockIndex* blockindex)
+{
+    // Only report confirmations if the block is on the main chain
+    if (tip.Contains(blockindex))
+        return tip.nHeight - blockindex->nHeight + 1;
+    return -1;
+}
+
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    UniValue result(UniValue::VOBJ);
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+    result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
+    result.push_back(Pair("confirmations", GetConfirmations(*tip, blockindex)));
+    result.pushKVs(blockBodyToJSON(block, blockindex, txDetails));
+    const CBlockIndex *pnext = tip->Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     return result;
 }
 
+/**
+ * The most recently requested blocks as getblock and /rest/block render them, keyed by
+ * hash, rendering and serialization flags. Only what does not change with the active
+ * chain is kept, so a reorganization leaves the entries valid: the confirmations and the
+ * next block are filled in from the tip snapshot whenever an entry is served.
+ */
+class CBlockRenderCache
+{
+public:
+    typedef std::tuple<uint256, int, int> key_type;
+
+private:
+    typedef std::list<std::pair<key_type, std::shared_ptr<const CBlockRendering> > > list_type;
+
+    CCriticalSection cs;
+    size_t nUsage;
+    //! Most recently used first
+    list_type listEntries;
+    std::map<key_type, list_type::iterator> mapEntries;
+
+public:
+    CBlockRenderCache() : nUsage(0) {}
+
+    std::shared_ptr<const CBlockRendering> Get(const key_type& key)
+    {
+        LOCK(cs);
+        std::map<key_type, list_type::iterator>::iterator it = mapEntries.find(key);
+        if (it == mapEntries.end())
+            return std::shared_ptr<const CBlockRendering>();
+        listEntries.splice(listEntries.begin(), listEntries, it->second);
+        return it->second->second;
+    }
+
+    void Put(const key_type& key, const std::shared_ptr<const CBlockRendering>& rendering, size_t nMaxUsage)
+    {
+        LOCK(cs);
+        if (mapEntries.count(key) || rendering->DynamicUsage() > nMaxUsage)
+            return;
+        listEntries.push_front(std::make_pair(key, rendering));
+        mapEntries[key] = listEntries.begin();
+        nUsage += rendering->DynamicUsage();
+        while (nUsage > nMaxUsage) {
+            nUsage -= listEntries.back().second->DynamicUsage();
+            mapEntries.erase(listEntries.back().first);
+            listEntries.pop_back();
+        }
+    }
+};
+
+static CBlockRenderCache blockRenderCache;
+
+bool GetBlockRendering(const CBlockIndex* pblockindex, BlockRenderMode mode, std::shared_ptr<const CBlockRendering>& rendering)
+{
+    AssertLockHeld(cs_main);
+    const int nSerFlags = RPCSerializationFlags();
+    const CBlockRenderCache::key_type key(pblockindex->GetBlockHash(), (int)mode, nSerFlags);
+    const size_t nMaxUsage = GetArg("-rpcblockcache", DEFAULT_RPC_BLOCK_CACHE) << 20;
+    if (nMaxUsage) {
+        rendering = blockRenderCache.Get(key);
+        // The Ethash result may have been stored in the index since
+        if (rendering && rendering->fPowHash == !!(pblockindex->nStatus & BLOCK_HAVE_POWHASH))
+            return true;
+    }
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        return false;
+    std::shared_ptr<CBlockRendering> rendered = std::make_shared<CBlockRendering>();
+    rendered->fPowHash = pblockindex->nStatus & BLOCK_HAVE_POWHASH;
+    if (mode == BLOCK_RENDER_HEX) {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | nSerFlags);
+        ssBlock << block;
+        rendered->strHex = HexStr(ssBlock.begin(), ssBlock.end());
+    } else {
+        rendered->body = blockBodyToJSON(block, pblockindex, mode == BLOCK_RENDER_JSON_TXDETAILS);
+        rendered->strBody = rendered->body.write();
+    }
+    rendering = rendered;
+    if (nMaxUsage)
+        blockRenderCache.Put(key, rendering, nMaxUsage);
+    return true;
+}
+
+UniValue BlockRenderingToJSON(const CBlockIndex* pblockindex, const CBlockRendering& rendering)
+{
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("hash", pblockindex->GetBlockHash().GetHex()));
+    result.push_back(Pair("confirmations", GetConfirmations(*tip, pblockindex)));
+    result.pushKVs(rendering.body);
+    const CBlockIndex *pnext = tip->Next(pblockindex);
+    if (pnext)
+        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
+    return result;
+}
+
+std::string BlockRenderingToJSONString(const CBlockIndex* pblockindex, const CBlockRendering& rendering)
+{
+    // The rendered body, an object, is spliced in rather than written again
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+    std::string strJSON = strprintf("{\"hash\":\"%s\",\"confirmations\":%d", pblockindex->GetBlockHash().GetHex(), GetConfirmations(*tip, pblockindex));
+    strJSON.reserve(strJSON.size() + rendering.strBody.size() + 90);
+    if (rendering.strBody.size() > 2) {
+        strJSON += ',';
+        strJSON.append(rendering.strBody, 1, rendering.strBody.size() - 2);
+    }
+    const CBlockIndex *pnext = tip->Next(pblockindex);
+    if (pnext)
+        strJSON += strprintf(",\"nextblockhash\":\"%s\"", pnext->GetBlockHash().GetHex());
+    strJSON += '}';
+    return strJSON;
+}
+
 UniValue getblockcount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -152,8 +297,7 @@ UniValue getblockcount(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshot()->nHeight;
 }
 
 UniValue getbestblockhash(const UniValue& params, bool fHelp)
@@ -169,8 +313,7 @@ UniValue getbestblockhash(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSnapshot()->hashBlock.GetHex();
 }
 
 UniValue getdifficulty(const UniValue& params, bool fHelp)
@@ -186,8 +329,10 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getdifficulty", "")
         );
 
-    LOCK(cs_main);
-    return GetDifficulty();
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+    if (tip->pindex == NULL)
+        return 1.0;
+    return GetDifficulty(tip->pindex);
 }
 
 std::string EntryDescriptionString()
@@ -303,6 +448,41 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     return mempoolToJSON(fVerbose);
 }
 
+/** getrawmempool, writing out each entry in turn instead of the whole result at the end */
+static void getrawmempoolStream(const UniValue& params, JSONStreamWriter& writer)
+{
+    if (params.size() > 1)
+        getrawmempool(params, true); // throws the usage
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        writer.BeginObject();
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
+        {
+            UniValue info(UniValue::VOBJ);
+            entryToJSON(info, e);
+            writer.Key(e.GetTx().GetHash().ToString());
+            writer.Value(info);
+        }
+        writer.EndObject();
+    }
+    else
+    {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        writer.BeginArray();
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            writer.Value(hash.ToString());
+        writer.EndArray();
+    }
+}
+
 UniValue getmempoolancestors(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2) {
@@ -512,11 +692,12 @@ UniValue getblockhashes(const UniValue& params, bool fHelp)
         }
     }
 
+    // The active chain is answered from the block index, only orphans need the built database
+    if (!fActiveOnly && IsIndexBuilding("timestampindex"))
+        throw JSONRPCError(RPC_IN_WARMUP, "The timestamp index is still being built, see getindexinfo");
+
     std::vector<std::pair<uint256, unsigned int> > blockHashes;
 
-    if (fActiveOnly)
-        LOCK(cs_main);
-    
     if(!GetTimestampIndex(high, low, fActiveOnly, blockHashes)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
     }
@@ -538,6 +719,420 @@ UniValue getblockhashes(const UniValue& params, bool fHelp)
 
 }
 
+UniValue getindexinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getindexinfo\n"
+            "\nReturns the state of the optional indexes. An index switched on for an existing chain\n"
+            "is built in the background, its queries fail until it is synced.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {              (string) txindex, addressindex, spentindex, timestampindex or blockfilterindex\n"
+            "    \"enabled\": true|false,  (boolean) If the index is maintained\n"
+            "    \"synced\": true|false,   (boolean) If the index covers the whole active chain\n"
+            "    \"nextheight\": n,        (numeric) While building, the first height not indexed yet\n"
+            "    \"targetheight\": n       (numeric) While building, the height the background build ends at\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getindexinfo", "")
+            + HelpExampleRpc("getindexinfo", "")
+        );
+
+    std::map<std::string, CIndexBuildState> mapBuilds = GetIndexBuilds();
+    const std::pair<const char*, bool> indexes[] = {
+        std::make_pair("txindex", fTxIndex),
+        std::make_pair("addressindex", fAddressIndex),
+        std::make_pair("spentindex", fSpentIndex),
+        std::make_pair("timestampindex", fTimestampIndex),
+        std::make_pair("blockfilterindex", fBlockFilterIndex),
+    };
+
+    UniValue result(UniValue::VOBJ);
+    for (const std::pair<const char*, bool>& index : indexes) {
+        UniValue info(UniValue::VOBJ);
+        info.push_back(Pair("enabled", index.second));
+        std::map<std::string, CIndexBuildState>::const_iterator it = mapBuilds.find(index.first);
+        info.push_back(Pair("synced", index.second && it == mapBuilds.end()));
+        if (it != mapBuilds.end()) {
+            info.push_back(Pair("nextheight", it->second.nNextHeight));
+            info.push_back(Pair("targetheight", it->second.nTargetHeight));
+        }
+        result.push_back(Pair(index.first, info));
+    }
+    return result;
+}
+
+static UniValue LatencyToJSON(const CDBLatencyHistogram& histogram)
+{
+    UniValue result(UniValue::VOBJ);
+    uint64_t nCount = histogram.GetCount();
+    result.push_back(Pair("count", nCount));
+    result.push_back(Pair("average_us", nCount ? (double)histogram.GetTotalMicros() / nCount : 0.0));
+    UniValue buckets(UniValue::VOBJ);
+    for (int i = 0; i < CDBLatencyHistogram::BUCKETS; i++) {
+        if (histogram.GetBucket(i) == 0)
+            continue;
+        std::string strBound = i == CDBLatencyHistogram::BUCKETS - 1 ? "inf" : strprintf("%d", int64_t(1) << i);
+        buckets.push_back(Pair(strBound, histogram.GetBucket(i)));
+    }
+    result.push_back(Pair("buckets", buckets));
+    return result;
+}
+
+static void DBStatsToJSON(const CDBWrapper& db, UniValue& result)
+{
+    const CDBStats& stats = db.GetStats();
+    // Named by the path in the data directory, such as blocks/index or indexes/txindex
+    std::string strName = db.GetPath().string();
+    std::string strDataDir = GetDataDir().string() + "/";
+    if (strName.compare(0, strDataDir.size(), strDataDir) == 0)
+        strName = strName.substr(strDataDir.size());
+
+    UniValue info(UniValue::VOBJ);
+    info.push_back(Pair("reads_found", (uint64_t)stats.nReadsFound));
+    info.push_back(Pair("read_latency", LatencyToJSON(stats.readLatency)));
+    info.push_back(Pair("batch_bytes", (uint64_t)stats.nBatchBytes));
+    info.push_back(Pair("batch_bytes_max", (uint64_t)stats.nBatchBytesMax));
+    info.push_back(Pair("write_latency", LatencyToJSON(stats.writeLatency)));
+    info.push_back(Pair("nexts", (uint64_t)stats.nNexts));
+    info.push_back(Pair("seek_latency", LatencyToJSON(stats.seekLatency)));
+    uint64_t nHits = stats.nCacheHits;
+    uint64_t nLookups = nHits + stats.nCacheMisses;
+    info.push_back(Pair("cache_hits", nHits));
+    info.push_back(Pair("cache_misses", nLookups - nHits));
+    info.push_back(Pair("cache_hit_rate", nLookups ? (double)nHits / nLookups : 0.0));
+    std::string strUsage = db.GetProperty("leveldb.approximate-memory-usage");
+    if (!strUsage.empty())
+        info.push_back(Pair("memory_usage", atoi64(strUsage)));
+    info.push_back(Pair("leveldb_stats", db.GetProperty("leveldb.stats")));
+    result.push_back(Pair(strName, info));
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns what the LevelDB databases did since they were opened, to tell slow queries\n"
+            "caused by compactions, block cache misses or long iterations apart.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {                (string) The path in the data directory, such as chainstate or indexes/txindex\n"
+            "    \"reads_found\": n,         (numeric) Reads that found their key\n"
+            "    \"read_latency\": {         (json object) Latency of the reads\n"
+            "      \"count\": n,             (numeric) Number of reads\n"
+            "      \"average_us\": x.x,      (numeric) Average in microseconds\n"
+            "      \"buckets\": {            (json object) Reads by latency, each bucket counting those below its bound in microseconds\n"
+            "        \"bound\": n,\n"
+            "        ...\n"
+            "      }\n"
+            "    },\n"
+            "    \"batch_bytes\": n,         (numeric) Bytes written in batches\n"
+            "    \"batch_bytes_max\": n,     (numeric) Bytes of the largest batch\n"
+            "    \"write_latency\": {...},   (json object) Latency of the batches, as read_latency\n"
+            "    \"nexts\": n,               (numeric) Steps of iterators\n"
+            "    \"seek_latency\": {...},    (json object) Latency of the iterator seeks, as read_latency\n"
+            "    \"cache_hits\": n,          (numeric) Table blocks found in the block cache\n"
+            "    \"cache_misses\": n,        (numeric) Table blocks read from disk\n"
+            "    \"cache_hit_rate\": x.x,    (numeric) Share of the table blocks found in the block cache\n"
+            "    \"memory_usage\": n,        (numeric) Memory LevelDB uses for the database\n"
+            "    \"leveldb_stats\": \"str\"    (string) The compaction statistics of LevelDB\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    UniValue result(UniValue::VOBJ);
+    CDBWrapper::ForEachOpen(boost::bind(&DBStatsToJSON, _1, boost::ref(result)));
+    return result;
+}
+
+static UniValue CacheStatsToJSON(uint64_t nLookups, uint64_t nHits, uint64_t nInserts)
+{
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("lookups", nLookups));
+    result.push_back(Pair("hits", nHits));
+    result.push_back(Pair("hit_rate", nLookups ? (double)nHits / nLookups : 0.0));
+    result.push_back(Pair("inserts", nInserts));
+    return result;
+}
+
+static UniValue ConnectTimesToJSON(const CBlockConnectTimes& times, double nDivisor)
+{
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("check", 0.001 * times.nCheck / nDivisor));
+    result.push_back(Pair("forks", 0.001 * times.nForks / nDivisor));
+    result.push_back(Pair("inputs", 0.001 * times.nInputs / nDivisor));
+    result.push_back(Pair("scripts", 0.001 * times.nScripts / nDivisor));
+    result.push_back(Pair("undo", 0.001 * times.nUndo / nDivisor));
+    result.push_back(Pair("index", 0.001 * times.nIndex / nDivisor));
+    result.push_back(Pair("callbacks", 0.001 * times.nCallbacks / nDivisor));
+    return result;
+}
+
+static UniValue CheckQueueStatsToJSON(const CCheckQueueStats& stats)
+{
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("checks", stats.nAdded));
+    result.push_back(Pair("queued", (uint64_t)stats.nQueued));
+    result.push_back(Pair("queued_max", (uint64_t)stats.nMaxQueued));
+    int64_t nBusyTotal = 0;
+    BOOST_FOREACH(const CCheckQueueStats::Thread& thread, stats.vThreads)
+        nBusyTotal += thread.nBusyMicros;
+    UniValue threads(UniValue::VARR);
+    BOOST_FOREACH(const CCheckQueueStats::Thread& thread, stats.vThreads) {
+        UniValue info(UniValue::VOBJ);
+        info.push_back(Pair("checks", thread.nChecks));
+        info.push_back(Pair("stolen", thread.nStolen));
+        info.push_back(Pair("busy_ms", 0.001 * thread.nBusyMicros));
+        info.push_back(Pair("busy_share", nBusyTotal ? (double)thread.nBusyMicros / nBusyTotal : 0.0));
+        threads.push_back(info);
+    }
+    result.push_back(Pair("threads", threads));
+    return result;
+}
+
+UniValue getvalidationstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getvalidationstats\n"
+            "\nReturns what block validation did since startup: the time ConnectBlock spent in each phase,\n"
+            "the hit rates of the signature and script execution caches and how the script checks\n"
+            "were spread over the -par threads. With -debug=bench a summary is logged every minute.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": n,                 (numeric) Blocks connected\n"
+            "  \"blocks_checked\": n,         (numeric) Blocks only checked, such as block templates\n"
+            "  \"inputs\": n,                 (numeric) Inputs of the blocks connected\n"
+            "  \"average_ms\": {              (json object) Milliseconds per block spent in each phase, over all blocks\n"
+            "    \"check\": x.x,              (numeric) CheckBlock\n"
+            "    \"forks\": x.x,              (numeric) BIP30 and the script flags\n"
+            "    \"inputs\": x.x,             (numeric) Checking and spending the inputs, including the scripts when -par=1\n"
+            "    \"scripts\": x.x,            (numeric) Waiting for the script checks left after the last input\n"
+            "    \"undo\": x.x,               (numeric) Writing the undo data\n"
+            "    \"index\": x.x,              (numeric) Handing the updates to the index writer\n"
+            "    \"callbacks\": x.x           (numeric) Notifications and orphan cleanup\n"
+            "  },\n"
+            "  \"last_block\": {              (json object) The last block connected\n"
+            "    \"height\": n,               (numeric) Its height\n"
+            "    \"ms\": {...}                (json object) Milliseconds spent in each phase, as average_ms\n"
+            "  },\n"
+            "  \"sigcache\": {                (json object) The signature cache\n"
+            "    \"lookups\": n,              (numeric) Signatures looked up\n"
+            "    \"hits\": n,                 (numeric) Signatures found\n"
+            "    \"hit_rate\": x.x,           (numeric) Share of the lookups that found their signature\n"
+            "    \"inserts\": n               (numeric) Signatures added\n"
+            "  },\n"
+            "  \"script_execution_cache\": {...}, (json object) Transactions whose scripts passed, as sigcache\n"
+            "  \"script_checks\": {           (json object) The script check queue of ConnectBlock\n"
+            "    \"checks\": n,               (numeric) Input scripts queued\n"
+            "    \"queued\": n,               (numeric) Input scripts queued now\n"
+            "    \"queued_max\": n,           (numeric) The most input scripts ever queued at once\n"
+            "    \"threads\": [               (json array) The validating thread first, then the -par workers\n"
+            "      {\n"
+            "        \"checks\": n,           (numeric) Input scripts verified\n"
+            "        \"stolen\": n,           (numeric) Input scripts taken from the queue of another thread\n"
+            "        \"busy_ms\": x.x,        (numeric) Milliseconds spent verifying\n"
+            "        \"busy_share\": x.x      (numeric) Share of the verification time of all threads\n"
+            "      },\n"
+            "      ...\n"
+            "    ]\n"
+            "  },\n"
+            "  \"mempool_script_checks\": {...} (json object) The script check queue of the mempool, as script_checks\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getvalidationstats", "")
+            + HelpExampleRpc("getvalidationstats", "")
+        );
+
+    CBlockConnectStats connectStats = GetBlockConnectStats();
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("blocks", connectStats.nBlocks));
+    result.push_back(Pair("blocks_checked", connectStats.nBlocksChecked));
+    result.push_back(Pair("inputs", connectStats.nInputs));
+    result.push_back(Pair("average_ms", ConnectTimesToJSON(connectStats.total, std::max<uint64_t>(1, connectStats.nBlocks + connectStats.nBlocksChecked))));
+    UniValue last(UniValue::VOBJ);
+    last.push_back(Pair("height", connectStats.nLastHeight));
+    last.push_back(Pair("ms", ConnectTimesToJSON(connectStats.last, 1)));
+    result.push_back(Pair("last_block", last));
+
+    CSignatureCacheStats sigcache = GetSignatureCacheStats();
+    result.push_back(Pair("sigcache", CacheStatsToJSON(sigcache.nLookups, sigcache.nHits, sigcache.nInserts)));
+    CScriptExecutionCacheStats scriptcache = GetScriptExecutionCacheStats();
+    result.push_back(Pair("script_execution_cache", CacheStatsToJSON(scriptcache.nLookups, scriptcache.nHits, scriptcache.nInserts)));
+
+    CCheckQueueStats queueStats;
+    GetScriptCheckQueueStats(queueStats, false);
+    result.push_back(Pair("script_checks", CheckQueueStatsToJSON(queueStats)));
+    GetScriptCheckQueueStats(queueStats, true);
+    result.push_back(Pair("mempool_script_checks", CheckQueueStatsToJSON(queueStats)));
+    return result;
+}
+
+typedef int64_t CBlockLatency::*BlockLatencyPhase;
+static const std::pair<const char*, BlockLatencyPhase> blockLatencyPhases[] = {
+    {"total", &CBlockLatency::nTotal},
+    {"pow", &CBlockLatency::nPoW},
+    {"read", &CBlockLatency::nRead},
+    {"prefetch", &CBlockLatency::nPrefetch},
+    {"connect", &CBlockLatency::nConnect},
+    {"flush", &CBlockLatency::nFlush},
+    {"chainstate", &CBlockLatency::nChainState},
+    {"tip", &CBlockLatency::nTip},
+    {"callbacks", &CBlockLatency::nCallbacks},
+};
+
+typedef int64_t CBlockConnectTimes::*BlockConnectPhase;
+static const std::pair<const char*, BlockConnectPhase> blockConnectPhases[] = {
+    {"check", &CBlockConnectTimes::nCheck},
+    {"forks", &CBlockConnectTimes::nForks},
+    {"inputs", &CBlockConnectTimes::nInputs},
+    {"scripts", &CBlockConnectTimes::nScripts},
+    {"undo", &CBlockConnectTimes::nUndo},
+    {"index", &CBlockConnectTimes::nIndex},
+    {"callbacks", &CBlockConnectTimes::nCallbacks},
+};
+
+/** The mean, the 50th, 90th and 99th percentile and the maximum of vMicros, in milliseconds */
+static UniValue LatencyPercentilesToJSON(std::vector<int64_t>& vMicros)
+{
+    UniValue result(UniValue::VOBJ);
+    if (vMicros.empty())
+        return result;
+    std::sort(vMicros.begin(), vMicros.end());
+    int64_t nSum = 0;
+    BOOST_FOREACH(int64_t nMicros, vMicros)
+        nSum += nMicros;
+    result.push_back(Pair("mean", 0.001 * nSum / vMicros.size()));
+    const int percentiles[] = {50, 90, 99};
+    BOOST_FOREACH(int nPercentile, percentiles) {
+        // Nearest rank: the smallest value at least nPercentile percent of the values are at or below
+        size_t nRank = (vMicros.size() * nPercentile + 99) / 100;
+        result.push_back(Pair(strprintf("p%d", nPercentile), 0.001 * vMicros[std::max<size_t>(nRank, 1) - 1]));
+    }
+    result.push_back(Pair("max", 0.001 * vMicros.back()));
+    return result;
+}
+
+UniValue getblocklatency(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getblocklatency ( count verbose )\n"
+            "\nReturns how long connecting each of the last blocks to the tip took, by phase: the mean,\n"
+            "percentiles and maximum over the blocks, and with verbose each block's own phases.\n"
+            + strprintf("Up to %u blocks connected since startup are remembered.\n", BLOCK_LATENCY_HISTORY) +
+            "\nArguments:\n"
+            "1. count        (numeric, optional, default=all) How many of the last blocks to cover\n"
+            "2. verbose      (boolean, optional, default=false) Also list the phases of each block\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": n,                 (numeric) Blocks covered\n"
+            "  \"first_height\": n,           (numeric) Height of the oldest of them\n"
+            "  \"last_height\": n,            (numeric) Height of the newest of them\n"
+            "  \"ms\": {                      (json object) Milliseconds spent in each phase\n"
+            "    \"total\": {                 (json object) All of connecting the block to the tip\n"
+            "      \"mean\": x.x,             (numeric) The mean over the blocks\n"
+            "      \"p50\": x.x,              (numeric) The median\n"
+            "      \"p90\": x.x,              (numeric) The 90th percentile\n"
+            "      \"p99\": x.x,              (numeric) The 99th percentile\n"
+            "      \"max\": x.x               (numeric) The slowest block\n"
+            "    },\n"
+            "    \"pow\": {...},              (json object) Checking the Ethash proof of work when the block arrived, not part of total\n"
+            "    \"read\": {...},             (json object) Loading the block from disk\n"
+            "    \"prefetch\": {...},         (json object) Loading its inputs into the coins cache\n"
+            "    \"connect\": {...},          (json object) ConnectBlock, split in connect_ms\n"
+            "    \"flush\": {...},            (json object) Flushing its coins into the coins cache\n"
+            "    \"chainstate\": {...},       (json object) Writing the chainstate, block index and indexes when needed\n"
+            "    \"tip\": {...},              (json object) Updating the mempool and the tip\n"
+            "    \"callbacks\": {...}         (json object) The validation interface and wallet notifications\n"
+            "  },\n"
+            "  \"connect_ms\": {              (json object) The phases of ConnectBlock, as in getvalidationstats\n"
+            "    \"check\": {...},            (json object) As total\n"
+            "    ...\n"
+            "  },\n"
+            "  \"history\": [                 (json array) With verbose, the blocks, oldest first\n"
+            "    {\n"
+            "      \"height\": n,             (numeric) The block height\n"
+            "      \"hash\": \"hash\",          (string) The block hash\n"
+            "      \"time\": ttt,             (numeric) When it was connected, in seconds since 1 Jan 1970 GMT\n"
+            "      \"tx\": n,                 (numeric) Its transactions\n"
+            "      \"ms\": {...},             (json object) Milliseconds spent in each phase, as ms\n"
+            "      \"connect_ms\": {...}      (json object) Milliseconds spent in each phase of ConnectBlock\n"
+            "    },\n"
+            "    ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblocklatency", "")
+            + HelpExampleCli("getblocklatency", "100 true")
+            + HelpExampleRpc("getblocklatency", "100, true")
+        );
+
+    std::vector<CBlockLatency> vHistory = GetBlockLatencyHistory();
+    if (params.size() > 0 && !params[0].isNull()) {
+        int nCount = params[0].get_int();
+        if (nCount < 1)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid count, must be at least 1");
+        if ((size_t)nCount < vHistory.size())
+            vHistory.erase(vHistory.begin(), vHistory.end() - nCount);
+    }
+    bool fVerbose = params.size() > 1 && params[1].get_bool();
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("blocks", (uint64_t)vHistory.size()));
+    result.push_back(Pair("first_height", vHistory.empty() ? -1 : vHistory.front().nHeight));
+    result.push_back(Pair("last_height", vHistory.empty() ? -1 : vHistory.back().nHeight));
+
+    std::vector<int64_t> vMicros;
+    vMicros.reserve(vHistory.size());
+    UniValue ms(UniValue::VOBJ);
+    BOOST_FOREACH(const PAIRTYPE(const char*, BlockLatencyPhase)& phase, blockLatencyPhases) {
+        vMicros.clear();
+        BOOST_FOREACH(const CBlockLatency& latency, vHistory)
+            vMicros.push_back(latency.*phase.second);
+        ms.push_back(Pair(phase.first, LatencyPercentilesToJSON(vMicros)));
+    }
+    result.push_back(Pair("ms", ms));
+    UniValue connectMs(UniValue::VOBJ);
+    BOOST_FOREACH(const PAIRTYPE(const char*, BlockConnectPhase)& phase, blockConnectPhases) {
+        vMicros.clear();
+        BOOST_FOREACH(const CBlockLatency& latency, vHistory)
+            vMicros.push_back(latency.connect.*phase.second);
+        connectMs.push_back(Pair(phase.first, LatencyPercentilesToJSON(vMicros)));
+    }
+    result.push_back(Pair("connect_ms", connectMs));
+
+    if (fVerbose) {
+        UniValue history(UniValue::VARR);
+        BOOST_FOREACH(const CBlockLatency& latency, vHistory) {
+            UniValue entry(UniValue::VOBJ);
+            entry.push_back(Pair("height", latency.nHeight));
+            entry.push_back(Pair("hash", latency.hash.GetHex()));
+            entry.push_back(Pair("time", latency.nTime));
+            entry.push_back(Pair("tx", (uint64_t)latency.nTx));
+            UniValue entryMs(UniValue::VOBJ);
+            BOOST_FOREACH(const PAIRTYPE(const char*, BlockLatencyPhase)& phase, blockLatencyPhases)
+                entryMs.push_back(Pair(phase.first, 0.001 * (latency.*phase.second)));
+            entry.push_back(Pair("ms", entryMs));
+            UniValue entryConnectMs(UniValue::VOBJ);
+            BOOST_FOREACH(const PAIRTYPE(const char*, BlockConnectPhase)& phase, blockConnectPhases)
+                entryConnectMs.push_back(Pair(phase.first, 0.001 * (latency.connect.*phase.second)));
+            entry.push_back(Pair("connect_ms", entryConnectMs));
+            history.push_back(entry);
+        }
+        result.push_back(Pair("history", history));
+    }
+    return result;
+}
+
 UniValue getblockhash(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -553,13 +1148,12 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockhash", "1000")
         );
 
-    LOCK(cs_main);
-
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > chainActive.Height())
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+    const CBlockIndex* pblockindex = (*tip)[nHeight];
+    if (pblockindex == NULL)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
 
-    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->GetBlockHash().GetHex();
 }
 
@@ -585,6 +1179,7 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
             "  \"mediantime\" : ttt,    (numeric) The median block time in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"nonce\" : n,           (numeric) The nonce\n"
             "  \"bits\" : \"1d00ffff\", (string) The bits\n"
+            "  \"powhash\" : \"hash\",  (string, optional) The Ethash result of the header, if stored in the block index\n"
             "  \"difficulty\" : x.xxx,  (numeric) The difficulty\n"
             "  \"previousblockhash\" : \"hash\",  (string) The hash of the previous block\n"
             "  \"nextblockhash\" : \"hash\",      (string) The hash of the next block\n"
@@ -597,8 +1192,6 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockheader", "\"e2acdf2dd19a702e5d12a925f1e984b01e47a933562ca893656d4afb38b44ee3\"")
         );
 
-    LOCK(cs_main);
-
     std::string strHash = params[0].get_str();
     uint256 hash(uint256S(strHash));
 
@@ -606,11 +1199,11 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
+    // Needs no cs_main; block index entries outlive the call
+    CBlockIndex* pblockindex = LookupBlockIndex(hash);
+    if (pblockindex == NULL)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
     if (!fVerbose)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -624,29 +1217,38 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
 
 UniValue getreceivedaddresses(const UniValue& params, bool fHelp)
 {
-    LOCK(cs_main);
-
     std::string strHash = params[0].get_str();
     uint256 hash(uint256S(strHash));
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    // Hold cs_main for the lookup only, and read the block without it
+    CDiskBlockPos pos;
+    bool fCheckPOW;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        CBlockIndex* pblockindex = mi->second;
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+        if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+        pos = pblockindex->GetBlockPos();
+        fCheckPOW = !(pblockindex->nStatus & BLOCK_POW_VERIFIED);
+    }
 
-    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pos, Params().GetConsensus(), fCheckPOW) || block.GetHash() != hash)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
     
     //block holds object
     UniValue result(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
     {
         //foreach transaction
-        GetReceivedWalletAddresses(tx, result);
+#ifdef ENABLE_WALLET
+        GetReceivedWalletAddresses(*tx, result);
+#endif
     }
     return result;
 }
@@ -680,6 +1282,7 @@ UniValue getblock(const UniValue& params, bool fHelp)
             "  \"mediantime\" : ttt,    (numeric) The median block time in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"nonce\" : n,           (numeric) The nonce\n"
             "  \"bits\" : \"1d00ffff\", (string) The bits\n"
+            "  \"powhash\" : \"hash\",  (string, optional) The Ethash result of the header, if stored in the block index\n"
             "  \"difficulty\" : x.xxx,  (numeric) The difficulty\n"
             "  \"chainwork\" : \"xxxx\",  (string) Expected number of hashes required to produce the chain up to this block (in hex)\n"
             "  \"previousblockhash\" : \"hash\",  (string) The hash of the previous block\n"
@@ -704,87 +1307,79 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+    std::shared_ptr<const CBlockRendering> rendering;
+    if (!GetBlockRendering(pblockindex, fVerbose ? BLOCK_RENDER_JSON : BLOCK_RENDER_HEX, rendering))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
     if (!fVerbose)
-    {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
-    }
+        return rendering->strHex;
 
-    return blockToJSON(block, pblockindex);
+    return BlockRenderingToJSON(pblockindex, *rendering);
 }
 
-struct CCoinsStats
-{
-    int nHeight;
-    uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nSerializedSize;
-    uint256 hashSerialized;
-    CAmount nTotalAmount;
-
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
-};
-
-//! Calculate statistics about the unspent transaction output set
-static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
+//! Scan the unspent transaction output set, and its hash_serialized if phashSerialized is given
+static bool ScanUTXOStats(CCoinsView *view, CUTXOStats &stats, uint256 *phashSerialized)
 {
     boost::scoped_ptr<CCoinsViewCursor> pcursor(view->Cursor());
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    stats.SetNull();
     stats.hashBlock = pcursor->GetBestBlock();
-    {
-        LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
-    }
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    CUTXOSetHasher hasher(stats.hashBlock);
+    int nProgress = -1;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         uint256 key;
         CCoins coins;
         if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
+            // The txids are spread evenly, so their first byte tells how far the scan is
+            if (key.begin()[0] * 100 / 256 != nProgress) {
+                nProgress = key.begin()[0] * 100 / 256;
+                RPCJobProgress("Scanning the UTXO set...", nProgress);
             }
-            stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
+            if (phashSerialized)
+                hasher.Add(key, coins);
+            stats.Add(key, coins);
         } else {
             return error("%s: unable to read value", __func__);
         }
         pcursor->Next();
     }
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    if (phashSerialized)
+        *phashSerialized = hasher.GetHash();
     return true;
 }
 
+static UniValue UTXOStatsToJSON(const CUTXOStats& stats)
+{
+    UniValue ret(UniValue::VOBJ);
+    {
+        LOCK(cs_main);
+        ret.push_back(Pair("height", (int64_t)mapBlockIndex.find(stats.hashBlock)->second->nHeight));
+    }
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+    ret.push_back(Pair("hash_set", stats.GetSetHash().GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    return ret;
+}
+
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( full )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "They are kept up to date block by block unless -utxostats=0, else this call scans the set,\n"
+            "which may take some time.\n"
+            "\nArguments:\n"
+            "1. full    (boolean, optional, default=false) Scan the set, and hash it as hash_serialized too\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -792,32 +1387,135 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_set\": \"hash\",   (string) The MuHash3072 of the set's outputs, independent of their order\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, if full\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
-    UniValue ret(UniValue::VOBJ);
+    bool fFull = params.size() > 0 && params[0].get_bool();
 
-    CCoinsStats stats;
+    CUTXOStats stats;
+    if (!fFull) {
+        LOCK(cs_main);
+        if (GetTipUTXOStats(stats))
+            return UTXOStatsToJSON(stats);
+        if (GetBoolArg("-utxostats", DEFAULT_UTXO_STATS)) {
+            // Scanned once while the tip cannot move, they are followed from here on
+            int64_t nStart = GetTimeMillis();
+            FlushStateToDisk();
+            if (!ScanUTXOStats(pcoinsTip, stats, NULL))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+            SetTipUTXOStats(stats);
+            LogPrintf("%s: scanned the UTXO set at %s in %dms\n", __func__, stats.hashBlock.ToString(), GetTimeMillis() - nStart);
+            return UTXOStatsToJSON(stats);
+        }
+    }
+
+    uint256 hashSerialized;
     FlushStateToDisk();
-    if (GetUTXOStats(pcoinsTip, stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
-    } else {
+    if (!ScanUTXOStats(pcoinsTip, stats, fFull ? &hashSerialized : NULL))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
-    }
+    UniValue ret = UTXOStatsToJSON(stats);
+    if (fFull)
+        ret.push_back(Pair("hash_serialized", hashSerialized.GetHex()));
     return ret;
 }
 
+static UniValue SnapshotHeaderToJSON(const boost::filesystem::path& path, const CUTXOSnapshotHeader& header)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("height", (int64_t)header.nHeight));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)header.nTransactions));
+    ret.push_back(Pair("chaintx", (int64_t)header.nChainTx));
+    ret.push_back(Pair("hash_serialized", header.hashSerialized.GetHex()));
+    return ret;
+}
+
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set at the current tip to a snapshot file,\n"
+            "which loadtxoutset can bootstrap another node from.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) The file to create, relative to the data directory if not absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",           (string) The snapshot file\n"
+            "  \"height\": n,               (numeric) The height of the block the set was taken at\n"
+            "  \"bestblock\": \"hex\",        (string) The hash of that block\n"
+            "  \"transactions\": n,         (numeric) The number of transactions with unspent outputs\n"
+            "  \"chaintx\": n,              (numeric) The number of transactions in the chain up to the block\n"
+            "  \"hash_serialized\": \"hash\" (string) The hash of the set, as gettxoutsetinfo true reports it\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    CUTXOSnapshotHeader header;
+    std::string strError;
+    FlushStateToDisk();
+    if (!WriteUTXOSnapshot(pcoinsTip, path, header, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    return SnapshotHeaderToJSON(path, header);
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "loadtxoutset \"path\" ( \"hash\" )\n"
+            "\nMakes a snapshot written by dumptxoutset the chainstate of this node, which then only\n"
+            "downloads and validates the blocks after it. The node must have the headers up to the\n"
+            "snapshot block and no blocks connected past genesis, and the optional indexes must be off.\n"
+            "The blocks below the snapshot are not downloaded, the node treats them as pruned.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) The snapshot file, relative to the data directory if not absolute\n"
+            "2. \"hash\"     (string, optional) The hash_serialized the snapshot must have, as a trusted node's gettxoutsetinfo true reports it\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",           (string) The snapshot file\n"
+            "  \"height\": n,               (numeric) The height of the new tip\n"
+            "  \"bestblock\": \"hex\",        (string) The hash of the new tip\n"
+            "  \"transactions\": n,         (numeric) The number of transactions with unspent outputs\n"
+            "  \"chaintx\": n,              (numeric) The number of transactions in the chain up to the tip\n"
+            "  \"hash_serialized\": \"hash\" (string) The hash of the set\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    uint256 hashExpected;
+    if (params.size() > 1)
+        hashExpected = ParseHashV(params[1], "hash");
+    CUTXOSnapshotHeader header;
+    std::string strError;
+    if (!LoadUTXOSnapshot(path, hashExpected, header, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    // Connect the blocks after the snapshot that were received already
+    CValidationState state;
+    ActivateBestChain(state, Params());
+    if (!state.IsValid())
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+
+    return SnapshotHeaderToJSON(path, header);
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -926,6 +1624,50 @@ UniValue verifychain(const UniValue& params, bool fHelp)
     return CVerifyDB().VerifyDB(Params(), pcoinsTip, nCheckLevel, nCheckDepth);
 }
 
+UniValue pruneblockchain(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "pruneblockchain height\n"
+            "\nDeletes the block and undo files of the blocks up to height. The last " + strprintf("%d", MIN_BLOCKS_TO_KEEP) + " blocks,\n"
+            "the blocks an index build has yet to read and the optional indexes are kept.\n"
+            "\nArguments:\n"
+            "1. \"height\"       (numeric, required) The block height to prune up to.\n"
+            "\nResult:\n"
+            "n    (numeric) Height of the last block pruned.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("pruneblockchain", "1000")
+            + HelpExampleRpc("pruneblockchain", "1000")
+        );
+
+    if (!fPruneMode)
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot prune blocks because node is not in prune mode.");
+
+    LOCK(cs_main);
+
+    int heightParam = params[0].get_int();
+    if (heightParam < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative block height.");
+
+    unsigned int height = (unsigned int)heightParam;
+    unsigned int chainHeight = (unsigned int)chainActive.Height();
+    if (chainHeight < Params().PruneAfterHeight())
+        throw JSONRPCError(RPC_MISC_ERROR, "Blockchain is too short for pruning.");
+    else if (height > chainHeight)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Blockchain is shorter than the attempted prune height.");
+    else if (height > chainHeight - MIN_BLOCKS_TO_KEEP) {
+        LogPrint("rpc", "Attempt to prune blocks close to the tip.  Retaining the minimum number of blocks.");
+        height = chainHeight - MIN_BLOCKS_TO_KEEP;
+    }
+
+    PruneBlockFilesManual(height);
+    // The files go on the block store writer thread, the block index already says which blocks are gone
+    CBlockIndex* block = chainActive.Tip();
+    while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+        block = block->pprev;
+    return uint64_t(block->nHeight > 0 ? block->nHeight - 1 : 0);
+}
+
 /** Implementation of IsSuperMajority with better feedback */
 static UniValue SoftForkMajorityDesc(int minVersion, CBlockIndex* pindex, int nRequired, const Consensus::Params& consensusParams)
 {
@@ -1187,6 +1929,7 @@ UniValue getchaintips(const UniValue& params, bool fHelp)
 UniValue mempoolInfoToJSON()
 {
     UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("loaded", mempool.IsLoaded()));
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
@@ -1205,6 +1948,7 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "\nReturns details on the active state of the TX memory pool.\n"
             "\nResult:\n"
             "{\n"
+            "  \"loaded\": true|false,        (boolean) If the mempool saved at the last shutdown is fully loaded\n"
             "  \"size\": xxxxx,               (numeric) Current tx count\n"
             "  \"bytes\": xxxxx,              (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
@@ -1304,17 +2048,24 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockhashes",         &getblockhashes,         true  },
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
+    { "blockchain",         "getblocklatency",        &getblocklatency,        true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
+    { "blockchain",         "getdbstats",             &getdbstats,             true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
+    { "blockchain",         "getindexinfo",           &getindexinfo,           true  },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true  },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true  },
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,  &getrawmempoolStream },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
+    { "blockchain",         "getvalidationstats",     &getvalidationstats,     true  },
+    { "blockchain",         "pruneblockchain",        &pruneblockchain,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
     { "blockchain",         "getreceivedaddresses",   &getreceivedaddresses,   true  },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           false },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        true  },
@@ -0,0 +1,50 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCBLOCKCHAIN_H
+#define BITCOIN_RPCBLOCKCHAIN_H
+
+#include <univalue.h>
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class CBlockIndex;
+
+/** Default for -rpcblockcache, in megabytes of rendered blocks kept for getblock and /rest/block */
+static const int64_t DEFAULT_RPC_BLOCK_CACHE = 32;
+
+enum BlockRenderMode {
+    BLOCK_RENDER_HEX,
+    BLOCK_RENDER_JSON,
+    BLOCK_RENDER_JSON_TXDETAILS,
+};
+
+/** A block rendered for getblock or /rest/block, without what changes with the active chain */
+struct CBlockRendering
+{
+    //! Whether the Ethash result was in the block index when it was rendered
+    bool fPowHash;
+    //! BLOCK_RENDER_HEX: the serialized block
+    std::string strHex;
+    //! The JSON modes: the fields of blockToJSON but hash, confirmations and nextblockhash, and their JSON
+    UniValue body;
+    std::string strBody;
+
+    CBlockRendering() : fPowHash(false) {}
+
+    /** An estimate, a UniValue taking about twice the memory of its JSON */
+    size_t DynamicUsage() const { return strHex.capacity() + 3 * strBody.capacity(); }
+};
+
+/** The block rendered in mode, from the cache of recently rendered blocks or read from disk; false if it cannot be read (requires cs_main) */
+bool GetBlockRendering(const CBlockIndex* pblockindex, BlockRenderMode mode, std::shared_ptr<const CBlockRendering>& rendering);
+/** The JSON of a rendered block as blockToJSON makes it, against the current tip */
+UniValue BlockRenderingToJSON(const CBlockIndex* pblockindex, const CBlockRendering& rendering);
+/** The same, written out */
+std::string BlockRenderingToJSONString(const CBlockIndex* pblockindex, const CBlockRendering& rendering);
+
+#endif // BITCOIN_RPCBLOCKCHAIN_H
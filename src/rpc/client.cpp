@@ -26,11 +26,18 @@ static const CRPCConvertParam vRPCConvertParams[] =
 {
     { "stop", 0 },
     { "setmocktime", 0 },
+    { "getlockcontention", 0 },
+    { "getlockcontention", 2 },
+    { "setlockprofiling", 0 },
+    { "setprofiling", 0 },
+    { "setprofiling", 2 },
     { "getaddednodeinfo", 0 },
     { "generate", 0 },
     { "generate", 1 },
     { "generatetoaddress", 0 },
     { "generatetoaddress", 2 },
+    { "setgenerate", 0 },
+    { "setgenerate", 1 },
     { "getnetworkhashps", 0 },
     { "getnetworkhashps", 1 },
     { "sendtoaddress", 1 },
@@ -54,6 +61,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "listtransactions", 1 },
     { "listtransactions", 2 },
     { "listtransactions", 3 },
+    { "listtransactions", 4 },
     { "listaccounts", 0 },
     { "listaccounts", 1 },
     { "walletpassphrase", 1 },
@@ -72,6 +80,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "listunspent", 2 },
     { "getblock", 1 },
     { "getblockheader", 1 },
+    { "getblocklatency", 0 },
+    { "getblocklatency", 1 },
     { "gettransaction", 1 },
     { "gettransactions", 0},
     { "gettransactions", 1},
@@ -86,12 +96,17 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "gettxout", 1 },
     { "gettxout", 2 },
     { "gettxoutproof", 0 },
+    { "gettxoutsetinfo", 0 },
+    { "submitjob", 1 },
+    { "getjob", 0 },
+    { "canceljob", 0 },
     { "lockunspent", 0 },
     { "lockunspent", 1 },
     { "importprivkey", 2 },
     { "importaddress", 2 },
     { "importaddress", 3 },
     { "importpubkey", 2 },
+    { "pruneblockchain", 0 },
     { "verifychain", 0 },
     { "verifychain", 1 },
     { "keypoolrefill", 0 },
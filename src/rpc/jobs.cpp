@@ -0,0 +1,398 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpc/jobs.h"
+
+#include "rpc/server.h"
+#include "sync.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include <univalue.h>
+
+#include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/signals2/signal.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+enum RPCJobState {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED,
+};
+
+static const char* JobStateName(RPCJobState state)
+{
+    switch (state) {
+    case JOB_QUEUED: return "queued";
+    case JOB_RUNNING: return "running";
+    case JOB_DONE: return "done";
+    case JOB_FAILED: return "failed";
+    case JOB_CANCELLED: return "cancelled";
+    }
+    assert(false);
+}
+
+/** An RPC call submitted with submitjob; all but the cancel flag and the progress are protected by cs_rpcJobs */
+struct CRPCJob
+{
+    uint64_t nId;
+    std::string strMethod;
+    UniValue params;
+    RPCJobState state;
+    //! The job thread running it, -1 while it is not running
+    int nThread;
+    std::shared_ptr<std::atomic<bool> > pfCancelled;
+    std::atomic<int> nProgress;
+    //! Protected by cs_progress, as it is set from the job thread while the job is running
+    CCriticalSection cs_progress;
+    std::string strStage;
+    UniValue result;
+    UniValue error;
+    int64_t nSubmitTime;
+    int64_t nStartTime;
+    int64_t nEndTime;
+
+    CRPCJob() : nId(0), state(JOB_QUEUED), nThread(-1), pfCancelled(std::make_shared<std::atomic<bool> >(false)),
+                nProgress(0), nSubmitTime(0), nStartTime(0), nEndTime(0) {}
+
+    UniValue ToJSON(bool fResult)
+    {
+        UniValue ret(UniValue::VOBJ);
+        ret.push_back(Pair("jobid", nId));
+        ret.push_back(Pair("method", strMethod));
+        ret.push_back(Pair("status", JobStateName(state)));
+        ret.push_back(Pair("progress", nProgress.load()));
+        {
+            LOCK(cs_progress);
+            if (!strStage.empty())
+                ret.push_back(Pair("stage", strStage));
+        }
+        ret.push_back(Pair("submittime", nSubmitTime));
+        if (nStartTime)
+            ret.push_back(Pair("starttime", nStartTime));
+        if (nEndTime)
+            ret.push_back(Pair("endtime", nEndTime));
+        if (fResult && state == JOB_DONE)
+            ret.push_back(Pair("result", result));
+        if (state == JOB_FAILED)
+            ret.push_back(Pair("error", error));
+        return ret;
+    }
+};
+
+typedef std::shared_ptr<CRPCJob> CRPCJobRef;
+
+static boost::mutex cs_rpcJobs;
+static boost::condition_variable condRPCJobs;
+static std::map<uint64_t, CRPCJobRef> mapRPCJobs;
+static std::deque<CRPCJobRef> queueRPCJobs;
+//! The ids of the finished jobs, oldest first
+static std::deque<uint64_t> finishedRPCJobs;
+static uint64_t nLastRPCJobId = 0;
+static std::vector<boost::thread*> vRPCJobThreads;
+static bool fRPCJobsStopping = false;
+static boost::signals2::connection connRPCJobProgress;
+
+static boost::signals2::signal<void (const UniValue&)> sigRPCJobFinished;
+
+//! The job the thread is running, if any
+static thread_local CRPCJob* pCurrentRPCJob = NULL;
+
+void RPCServer::OnJobFinished(boost::function<void (const UniValue&)> slot)
+{
+    sigRPCJobFinished.connect(slot);
+}
+
+void RPCJobProgress(const std::string& strStage, int nProgress)
+{
+    CRPCJob* pjob = pCurrentRPCJob;
+    if (!pjob)
+        return;
+    pjob->nProgress = std::max(0, std::min(100, nProgress));
+    if (!strStage.empty()) {
+        LOCK(pjob->cs_progress);
+        pjob->strStage = strStage;
+    }
+}
+
+std::function<bool()> GetRPCJobCancelled()
+{
+    if (!pCurrentRPCJob)
+        return [] { return false; };
+    std::shared_ptr<std::atomic<bool> > pfCancelled = pCurrentRPCJob->pfCancelled;
+    return [pfCancelled] { return pfCancelled->load(); };
+}
+
+/** Record a job as finished, forgetting the oldest finished ones past MAX_RPC_FINISHED_JOBS; returns its getjob object (requires cs_rpcJobs) */
+static UniValue FinishRPCJob(CRPCJob& job, RPCJobState state)
+{
+    job.state = state;
+    job.nThread = -1;
+    job.nEndTime = GetTime();
+    finishedRPCJobs.push_back(job.nId);
+    while (finishedRPCJobs.size() > MAX_RPC_FINISHED_JOBS) {
+        mapRPCJobs.erase(finishedRPCJobs.front());
+        finishedRPCJobs.pop_front();
+    }
+    return job.ToJSON(false);
+}
+
+static void RPCJobThread(int nThread)
+{
+    while (true) {
+        CRPCJobRef pjob;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+            while (!fRPCJobsStopping && queueRPCJobs.empty())
+                condRPCJobs.wait(lock);
+            if (fRPCJobsStopping)
+                return;
+            pjob = queueRPCJobs.front();
+            queueRPCJobs.pop_front();
+            pjob->state = JOB_RUNNING;
+            pjob->nThread = nThread;
+            pjob->nStartTime = GetTime();
+        }
+
+        RPCJobState state = JOB_DONE;
+        UniValue result, error;
+        pCurrentRPCJob = pjob.get();
+        try {
+            result = tableRPC.execute(pjob->strMethod, pjob->params);
+        } catch (const boost::thread_interrupted&) {
+            state = JOB_CANCELLED;
+        } catch (const UniValue& objError) {
+            state = JOB_FAILED;
+            error = objError;
+        } catch (const std::exception& e) {
+            state = JOB_FAILED;
+            error = JSONRPCError(RPC_MISC_ERROR, e.what());
+        }
+        pCurrentRPCJob = NULL;
+        // A call can finish, or fail on its own, between being cancelled and being interrupted
+        if (pjob->pfCancelled->load())
+            state = JOB_CANCELLED;
+
+        UniValue objJob;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+            pjob->result = std::move(result);
+            pjob->error = std::move(error);
+            if (state == JOB_DONE)
+                pjob->nProgress = 100;
+            objJob = FinishRPCJob(*pjob, state);
+            // No job refers to this thread any more, clear an interruption that arrived after the call returned
+            try {
+                boost::this_thread::interruption_point();
+            } catch (const boost::thread_interrupted&) {}
+        }
+        LogPrint("rpc", "RPC job %d (%s) %s after %ds\n", pjob->nId, pjob->strMethod, JobStateName(state), pjob->nEndTime - pjob->nStartTime);
+        sigRPCJobFinished(objJob);
+    }
+}
+
+void StartRPCJobs()
+{
+    int nThreads = std::max((int)GetArg("-rpcjobthreads", DEFAULT_RPC_JOB_THREADS), 0);
+    boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+    fRPCJobsStopping = false;
+    connRPCJobProgress = uiInterface.ShowProgress.connect(&RPCJobProgress);
+    for (int i = 0; i < nThreads; i++)
+        vRPCJobThreads.push_back(new boost::thread(boost::bind(&TraceThread<boost::function<void()> >, "rpcjob", boost::function<void()>(boost::bind(&RPCJobThread, i)))));
+}
+
+void InterruptRPCJobs()
+{
+    boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+    fRPCJobsStopping = true;
+    for (const auto& entry : mapRPCJobs) {
+        CRPCJob& job = *entry.second;
+        if (job.state != JOB_QUEUED && job.state != JOB_RUNNING)
+            continue;
+        *job.pfCancelled = true;
+        if (job.nThread >= 0)
+            vRPCJobThreads[job.nThread]->interrupt();
+    }
+    condRPCJobs.notify_all();
+}
+
+void StopRPCJobs()
+{
+    // The threads take cs_rpcJobs to finish their jobs
+    for (boost::thread* pthread : vRPCJobThreads) {
+        pthread->join();
+        delete pthread;
+    }
+    vRPCJobThreads.clear();
+    connRPCJobProgress.disconnect();
+
+    boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+    queueRPCJobs.clear();
+    mapRPCJobs.clear();
+    finishedRPCJobs.clear();
+}
+
+/** The job of the jobid parameter (requires cs_rpcJobs) */
+static CRPCJobRef GetRPCJob(const UniValue& jobid)
+{
+    std::map<uint64_t, CRPCJobRef>::iterator it = mapRPCJobs.find(jobid.get_int64());
+    if (it == mapRPCJobs.end())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown or forgotten job");
+    return it->second;
+}
+
+UniValue submitjob(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "submitjob \"method\" ( [params] )\n"
+            "\nQueue an RPC call to run on a job thread rather than an RPC worker, and return its job id at once.\n"
+            "Follow it with getjob, or the rpcjob ZMQ notification, and cancel it with canceljob.\n"
+            "\nArguments:\n"
+            "1. \"method\"     (string, required) The RPC method, such as verifychain or gettxoutsetinfo\n"
+            "2. params       (array, optional) Its parameters\n"
+            "\nResult:\n"
+            "n               (numeric) The job id\n"
+            "\nExamples:\n"
+            + HelpExampleCli("submitjob", "verifychain '[4, 1000]'")
+            + HelpExampleRpc("submitjob", "\"verifychain\", [4, 1000]")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VSTR)(UniValue::VARR), true);
+
+    CRPCJobRef pjob = std::make_shared<CRPCJob>();
+    pjob->strMethod = params[0].get_str();
+    pjob->params = params.size() > 1 ? params[1] : UniValue(UniValue::VARR);
+    if (!tableRPC[pjob->strMethod])
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    if (pjob->strMethod == "stop" || pjob->strMethod == "submitjob")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, pjob->strMethod + " cannot run as a job");
+    pjob->nSubmitTime = GetTime();
+
+    boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+    if (vRPCJobThreads.empty() || fRPCJobsStopping)
+        throw JSONRPCError(RPC_MISC_ERROR, "No job threads are running (-rpcjobthreads=0)");
+    pjob->nId = ++nLastRPCJobId;
+    mapRPCJobs[pjob->nId] = pjob;
+    queueRPCJobs.push_back(pjob);
+    condRPCJobs.notify_one();
+    return pjob->nId;
+}
+
+UniValue getjob(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getjob jobid\n"
+            "\nReturns the state of a job submitted with submitjob, and its result once it is done.\n"
+            "The last " + strprintf("%d", MAX_RPC_FINISHED_JOBS) + " finished jobs are kept.\n"
+            "\nArguments:\n"
+            "1. jobid          (numeric, required) The job id\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"jobid\": n,         (numeric) The job id\n"
+            "  \"method\": \"name\",   (string) The RPC method\n"
+            "  \"status\": \"s\",      (string) queued, running, done, failed or cancelled\n"
+            "  \"progress\": n,      (numeric) How far the call is, 0 to 100, for the calls that report it\n"
+            "  \"stage\": \"s\",       (string, optional) What the call is doing\n"
+            "  \"submittime\": ttt,  (numeric) When the job was submitted\n"
+            "  \"starttime\": ttt,   (numeric, optional) When it started\n"
+            "  \"endtime\": ttt,     (numeric, optional) When it finished\n"
+            "  \"result\": ...,      (any, optional) The result, once done\n"
+            "  \"error\": {...}      (json object, optional) The error, if failed\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getjob", "1")
+            + HelpExampleRpc("getjob", "1")
+        );
+
+    boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+    return GetRPCJob(params[0])->ToJSON(true);
+}
+
+UniValue canceljob(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "canceljob jobid\n"
+            "\nCancel a queued or running job. A running call stops at its next interruption point.\n"
+            "\nArguments:\n"
+            "1. jobid          (numeric, required) The job id\n"
+            "\nResult:\n"
+            "true|false        (boolean) Whether the job was still queued or running\n"
+            "\nExamples:\n"
+            + HelpExampleCli("canceljob", "1")
+            + HelpExampleRpc("canceljob", "1")
+        );
+
+    UniValue objJob;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+        CRPCJobRef pjob = GetRPCJob(params[0]);
+        if (pjob->state == JOB_RUNNING) {
+            *pjob->pfCancelled = true;
+            vRPCJobThreads[pjob->nThread]->interrupt();
+            return true;
+        }
+        if (pjob->state != JOB_QUEUED)
+            return false;
+        *pjob->pfCancelled = true;
+        for (std::deque<CRPCJobRef>::iterator it = queueRPCJobs.begin(); it != queueRPCJobs.end(); ++it) {
+            if (*it == pjob) {
+                queueRPCJobs.erase(it);
+                break;
+            }
+        }
+        objJob = FinishRPCJob(*pjob, JOB_CANCELLED);
+    }
+    sigRPCJobFinished(objJob);
+    return true;
+}
+
+UniValue listjobs(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "listjobs\n"
+            "\nReturns the queued, running and last finished jobs, as getjob does without their results.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("listjobs", "")
+            + HelpExampleRpc("listjobs", "")
+        );
+
+    UniValue ret(UniValue::VARR);
+    boost::unique_lock<boost::mutex> lock(cs_rpcJobs);
+    for (const auto& entry : mapRPCJobs)
+        ret.push_back(entry.second->ToJSON(false));
+    return ret;
+}
+
+static const CRPCCommand commands[] =
+{ //  category              name                      actor (function)         okSafeMode
+  //  --------------------- ------------------------  -----------------------  ----------
+    { "control",            "submitjob",              &submitjob,              true  },
+    { "control",            "getjob",                 &getjob,                 true  },
+    { "control",            "canceljob",              &canceljob,              true  },
+    { "control",            "listjobs",               &listjobs,               true  },
+};
+
+void RegisterJobRPCCommands(CRPCTable &tableRPC)
+{
+    for (unsigned int vcidx = 0; vcidx < ARRAYLEN(commands); vcidx++)
+        tableRPC.appendCommand(commands[vcidx].name, &commands[vcidx]);
+}
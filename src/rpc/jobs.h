@@ -0,0 +1,46 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCJOBS_H
+#define BITCOIN_RPCJOBS_H
+
+#include <functional>
+#include <string>
+
+#include <boost/function.hpp>
+
+class UniValue;
+
+/** Default for -rpcjobthreads, the threads running RPC calls submitted with submitjob */
+static const int DEFAULT_RPC_JOB_THREADS = 2;
+/** Finished jobs kept for getjob, the oldest are forgotten first */
+static const size_t MAX_RPC_FINISHED_JOBS = 100;
+
+namespace RPCServer
+{
+    /** Called with the getjob object of a job, without its result, when it finishes, fails or is cancelled */
+    void OnJobFinished(boost::function<void (const UniValue&)> slot);
+}
+
+/** Start the -rpcjobthreads job threads */
+void StartRPCJobs();
+/** Cancel the queued and running jobs and let the threads exit */
+void InterruptRPCJobs();
+void StopRPCJobs();
+
+/**
+ * Report the progress of the job running on this thread, 0 to 100, with what it is doing;
+ * nothing if the thread is not running a job. Connected to uiInterface.ShowProgress, so
+ * verifychain and the like report theirs without knowing of jobs.
+ */
+void RPCJobProgress(const std::string& strStage, int nProgress);
+
+/**
+ * Whether the job running on this thread has been cancelled, as a function that other threads
+ * it hands work to can call; it returns false if the thread is not running a job. Running jobs
+ * are also interrupted, so boost::this_thread::interruption_point() ends them.
+ */
+std::function<bool()> GetRPCJobCancelled();
+
+#endif // BITCOIN_RPCJOBS_H
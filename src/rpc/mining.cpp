@@ -12,21 +12,25 @@
 #include "consensus/params.h"
 #include "consensus/validation.h"
 #include "core_io.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
 #include "init.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
 #include "pow.h"
+#include "rpc/jobs.h"
 #include "rpc/server.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 
+#include <atomic>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <univalue.h>
 
@@ -96,41 +100,52 @@ UniValue getnetworkhashps(const UniValue& params, bool fHelp)
     return GetNetworkHashPS(params.size() > 0 ? params[0].get_int() : 120, params.size() > 1 ? params[1].get_int() : -1);
 }
 
-UniValue testwork(const UniValue& params, bool fHelp)
+/** Parse an eth_submitWork style [nonce, header hash, mix hash] triple */
+static void ParseWorkParams(const UniValue& params, uint64_t& nonce, uint256& previoushash, uint256& mixhash)
 {
-    uint64_t nonce;
-    uint256 previoushash;
-    uint256 mixhash;
     string a_nonce = params[0].get_str();
     string a_prevhash = params[1].get_str();
     string a_mixhash = params[2].get_str();
-    //parse Nonce in two parts
+    //parse Nonce
     std::istringstream nNonce1(a_nonce.substr(2,16));
     nNonce1 >> std::hex >> nonce;
     //parse prevhash
     previoushash.SetHex(a_prevhash);
     //parse mixhash
     mixhash.SetHex(a_mixhash);
+}
 
-    unsigned int nExtraNonce = 0;
-    boost::shared_ptr<CReserveScript> coinbaseScript;
-    GetMainSignals().ScriptForMining(coinbaseScript);
-    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript));
-    if (!pblocktemplate.get())
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Couldn't create new block");
-    CBlock *pblock = &pblocktemplate->block;
-    {
+/** Match a submission to the job it was mined on and check its proof of work
+ *  with a single light evaluation. Stale and invalid work throw. */
+static std::shared_ptr<const CWorkTemplate> CheckSubmittedWork(uint64_t nonce, const uint256& previoushash, const uint256& mixhash)
+{
+    std::shared_ptr<const CWorkTemplate> work = FindWorkTemplate(previoushash);
+    bool fStale = !work;
+    if (work) {
         LOCK(cs_main);
-        IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
+        fStale = work->hashPrevBlock != chainActive.Tip()->GetBlockHash();
+    }
+    if (fStale) {
+        RecordWorkSubmission(WORK_STALE);
+        throw JSONRPCError(RPC_VERIFY_ERROR, "Stale work");
     }
-    pblock->hashPrevBlock = previoushash;
-    pblock->mixhash = mixhash;
-    pblock->nNonce = nonce;
 
-    CValidationState state;
-    //consider blocknumber 0, as first seed ever
-    if(!CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, Params().GetConsensus()))
+    EthashProofOfWork::Result result = EthashAux::eval(work->seedHash, previoushash, nonce);
+    if (result.mixHash != mixhash || UintToArith256(result.value) > work->target) {
+        RecordWorkSubmission(WORK_INVALID);
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Bad PoW!");
+    }
+    return work;
+}
+
+UniValue testwork(const UniValue& params, bool fHelp)
+{
+    uint64_t nonce;
+    uint256 previoushash;
+    uint256 mixhash;
+    ParseWorkParams(params, nonce, previoushash, mixhash);
+
+    CheckSubmittedWork(nonce, previoushash, mixhash);
     return true;  
 }
 
@@ -139,34 +154,33 @@ UniValue submitWork(const UniValue& params, bool fHelp)
     uint64_t nonce1;
     uint256 previoushash;
     uint256 mixhash;
-    string a_nonce = params[0].get_str();
-    string a_prevhash = params[1].get_str();
-    string a_mixhash = params[2].get_str();
-    //parse Nonce
-    std::istringstream nNonce1(a_nonce.substr(2,16));
-    nNonce1 >> std::hex >> nonce1;
-    //parse prevhash
-    previoushash.SetHex(a_prevhash); //Test prevhash is it inside. TODO !!! is it top?
-    //parse mixhash
-    mixhash.SetHex(a_mixhash);
+    ParseWorkParams(params, nonce1, previoushash, mixhash);
+
+    std::shared_ptr<const CWorkTemplate> work = CheckSubmittedWork(nonce1, previoushash, mixhash);
 
-    unsigned int nExtraNonce = 0;
     boost::shared_ptr<CReserveScript> coinbaseScript;
     GetMainSignals().ScriptForMining(coinbaseScript);
-    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript));
-    if (!pblocktemplate.get())
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Couldn't create new block");
-    CBlock *pblock = &pblocktemplate->block;
+    if (!coinbaseScript || coinbaseScript->reserveScript.empty())
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "No coinbase script available (mining requires a wallet)");
+
+    // The job already holds the assembled block, only the coinbase is filled in
+    unsigned int nExtraNonce = 0;
+    CBlock block;
     {
         LOCK(cs_main);
-        IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
+        if (work->hashPrevBlock != chainActive.Tip()->GetBlockHash()) {
+            RecordWorkSubmission(WORK_STALE);
+            throw JSONRPCError(RPC_VERIFY_ERROR, "Stale work");
+        }
+        FinalizeWorkBlock(*work, coinbaseScript->reserveScript, chainActive.Tip(), nExtraNonce, block);
     }
-    pblock->mixhash = mixhash;
-    pblock->nNonce = nonce1;
+    block.mixhash = mixhash;
+    block.nNonce = nonce1;
 
     CValidationState state;
-    if (!ProcessNewBlock(state, Params(), NULL, pblock, true, NULL, false))
+    if (!ProcessNewBlock(state, Params(), NULL, &block, true, NULL, false))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "ProcessNewBlock, block not accepted");
+    RecordWorkSubmission(WORK_ACCEPTED);
     //mark script as important because it was used at least for one coinbase output if the script came from the wallet
     coinbaseScript->KeepScript();
 
@@ -175,10 +189,12 @@ UniValue submitWork(const UniValue& params, bool fHelp)
 
 UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript)
 {
-    static const int nInnerLoopCount = 0x10000;
     int nHeightStart = 0;
     int nHeightEnd = 0;
     int nHeight = 0;
+    int nThreads = GetArg("-genproclimit", DEFAULT_GENERATE_THREADS);
+    if (nThreads <= 0)
+        nThreads = GetNumCores();
 
     {   // Don't keep cs_main locked
         LOCK(cs_main);
@@ -188,8 +204,13 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
     }
     unsigned int nExtraNonce = 0;
     UniValue blockHashes(UniValue::VARR);
+    // The solver threads stop for a cancelled RPC job too, which then ends here
+    std::function<bool()> fnCancelled = GetRPCJobCancelled();
+    std::function<bool()> fnStop = [&fnCancelled] { return ShutdownRequested() || fnCancelled(); };
     while (nHeight < nHeightEnd)
     {
+        boost::this_thread::interruption_point();
+        RPCJobProgress(_("Generating blocks..."), (nHeight - nHeightStart) * 100 / nGenerate);
         std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript));
         if (!pblocktemplate.get())
             throw JSONRPCError(RPC_INTERNAL_ERROR, "Couldn't create new block");
@@ -199,17 +220,14 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
             IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
         }
 
-        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount && !CheckProofOfWork(pblock->MakePoWHash(), pblock->nBits, Params().GetConsensus())) {
-            ++pblock->nNonce;
-            --nMaxTries;
-        }
-        if (nMaxTries == 0) {
-            break;
-        }
-        if (pblock->nNonce == nInnerLoopCount) {
+        if (!SolveBlock(*pblock, nThreads, nMaxTries, fnStop)) {
+            boost::this_thread::interruption_point();
+            if (nMaxTries == 0 || ShutdownRequested())
+                break;
+            // The tip changed, start over on top of it
             continue;
         }
-        
+
         CValidationState state;
         if (!ProcessNewBlock(state, Params(), NULL, pblock, true, NULL, false))
             throw JSONRPCError(RPC_INTERNAL_ERROR, "ProcessNewBlock, block not accepted");
@@ -225,6 +243,64 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
     return blockHashes;
 }
 
+UniValue getgenerate(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getgenerate\n"
+            "\nReturn if the server is set to generate coins or not. The default is false.\n"
+            "It is set with the command line argument -gen (or " + std::string(BITCOIN_CONF_FILENAME) + " setting gen)\n"
+            "It can also be set with the setgenerate call.\n"
+            "\nResult\n"
+            "true|false      (boolean) If the server is set to generate coins or not\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getgenerate", "")
+            + HelpExampleRpc("getgenerate", "")
+        );
+
+    return GetBoolArg("-gen", DEFAULT_GENERATE);
+}
+
+UniValue setgenerate(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "setgenerate generate ( genproclimit )\n"
+            "\nSet 'generate' true or false to turn generation on or off.\n"
+            "Generation is limited to 'genproclimit' processors, -1 is unlimited.\n"
+            "The threads split the nonces of one block between them.\n"
+            "See the getgenerate call for the current setting.\n"
+            "\nArguments:\n"
+            "1. generate         (boolean, required) Set to true to turn on generation, off to turn off.\n"
+            "2. genproclimit     (numeric, optional) Set the processor limit for when generation is on. Can be -1 for unlimited.\n"
+            "\nExamples:\n"
+            "\nSet the generation on with a limit of one processor\n"
+            + HelpExampleCli("setgenerate", "true 1") +
+            "\nCheck the setting\n"
+            + HelpExampleCli("getgenerate", "") +
+            "\nTurn off generation\n"
+            + HelpExampleCli("setgenerate", "false") +
+            "\nUsing json rpc\n"
+            + HelpExampleRpc("setgenerate", "true, 1")
+        );
+
+    bool fGenerate = params[0].get_bool();
+
+    int nGenProcLimit = GetArg("-genproclimit", DEFAULT_GENERATE_THREADS);
+    if (params.size() > 1)
+    {
+        nGenProcLimit = params[1].get_int();
+        if (nGenProcLimit == 0)
+            fGenerate = false;
+    }
+
+    mapArgs["-gen"] = (fGenerate ? "1" : "0");
+    mapArgs["-genproclimit"] = itostr(nGenProcLimit);
+    GenerateBitcoins(fGenerate, nGenProcLimit, Params());
+
+    return NullUniValue;
+}
+
 UniValue generate(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -234,6 +310,7 @@ UniValue generate(const UniValue& params, bool fHelp)
             "\nArguments:\n"
             "1. numblocks    (numeric, required) How many blocks are generated immediately.\n"
             "2. maxtries     (numeric, optional) How many iterations to try (default = 1000000).\n"
+            "\nThe nonces are searched with -genproclimit threads.\n"
             "\nResult\n"
             "[ blockhashes ]     (array) hashes of blocks generated\n"
             "\nExamples:\n"
@@ -308,10 +385,29 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
             "  \"currentblocktx\": nnn,     (numeric) The last block transaction\n"
             "  \"difficulty\": xxx.xxxxx    (numeric) The current difficulty\n"
             "  \"errors\": \"...\"            (string) Current errors\n"
+            "  \"generate\": true|false     (boolean) If the internal miner is on or off (see getgenerate or setgenerate calls)\n"
+            "  \"genproclimit\": n          (numeric) The processor limit for generation. -1 if no generation. (see getgenerate or setgenerate calls)\n"
+            "  \"hashespersec\": n          (numeric) The hashes per second of the internal miner and the generate calls\n"
             "  \"networkhashps\": nnn,      (numeric) The network hashes per second\n"
             "  \"pooledtx\": n              (numeric) The size of the mempool\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "  \"chain\": \"xxxx\",           (string) current network name as defined in BIP70 (main, test, regtest)\n"
+            "  \"lightcachesize\": n,       (numeric) The memory held by Ethash light caches in bytes\n"
+            "  \"lightcacheevictions\": n,  (numeric) The number of Ethash light caches evicted to stay within -ethashlightcache\n"
+            "  \"dagprogress\": {           (json object) The DAGs being generated\n"
+            "     \"epoch\": n              (numeric) The progress of the DAG of this epoch in percent\n"
+            "  },\n"
+            "  \"templatebuilds\": n,       (numeric) The number of block templates built since startup\n"
+            "  \"lasttemplatems\": n,       (numeric) How long the last block template took to build in milliseconds\n"
+            "  \"templatelatency\": {       (json object) Histogram of block template build times\n"
+            "     \"ms\": n                 (numeric) The number of builds taking at most this many milliseconds (\"inf\" for the rest)\n"
+            "  },\n"
+            "  \"dagstatus\": {             (json object) The DAGs being generated or held in memory\n"
+            "     \"epoch\": n              (numeric) The progress of the DAG of this epoch in percent, 100 once usable\n"
+            "  },\n"
+            "  \"acceptedwork\": n,         (numeric) The number of submitted blocks accepted (eth_submitWork and Stratum)\n"
+            "  \"stalework\": n,            (numeric) The number of submissions for outdated or unknown jobs\n"
+            "  \"invalidwork\": n           (numeric) The number of submissions with a bad proof of work\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmininginfo", "")
@@ -328,10 +424,20 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("currentblocktx",   (uint64_t)nLastBlockTx));
     obj.push_back(Pair("difficulty",       (double)GetDifficulty()));
     obj.push_back(Pair("errors",           GetWarnings("statusbar")));
+    obj.push_back(Pair("generate",         getgenerate(params, false)));
+    obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", DEFAULT_GENERATE_THREADS)));
     obj.push_back(Pair("networkhashps",    getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",          Params().TestnetToBeDeprecatedFieldRPC()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
+    obj.push_back(Pair("lightcachesize",   EthashAux::lightCacheUsage()));
+    obj.push_back(Pair("lightcacheevictions", EthashAux::lightEvictions()));
+    UniValue dagProgress(UniValue::VOBJ);
+    std::map<uint64_t, unsigned> mapProgress = EthashAux::dagProgress();
+    for (std::map<uint64_t, unsigned>::const_iterator it = mapProgress.begin(); it != mapProgress.end(); ++it)
+        dagProgress.push_back(Pair(i64tostr(it->first), (uint64_t)it->second));
+    obj.push_back(Pair("dagprogress",      dagProgress));
+    obj.pushKVs(GetMiningMetrics());
     return obj;
 }
 
@@ -396,6 +502,11 @@ std::string gbt_vb_name(const Consensus::DeploymentPos pos) {
     return s;
 }
 
+/** Set when the cached template of the pending block or of getblocktemplate
+ *  fails its -asynctemplatecheck, so that the next call builds a new one */
+static std::atomic<bool> fPendingTemplateInvalid(false);
+static std::atomic<bool> fBlockTemplateInvalid(false);
+
 UniValue getblockbynumber(const UniValue& params, bool fHelp)
 {
     LOCK(cs_main);
@@ -432,7 +543,7 @@ UniValue getblockbynumber(const UniValue& params, bool fHelp)
         static CBlockIndex* pindexPrev;
         static int64_t nStart;
         static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != chainActive.Tip() ||
+        if (fPendingTemplateInvalid.exchange(false) || pindexPrev != chainActive.Tip() ||
             (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
         {
             // Clear pindexPrev so future calls make a new block, despite any failures from here on
@@ -450,9 +561,11 @@ UniValue getblockbynumber(const UniValue& params, bool fHelp)
                 pblocktemplate = NULL;
             }
             CScript scriptDummy = CScript() << OP_TRUE;
-            pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy);
+            pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, true, !fAsyncTemplateCheck);
             if (!pblocktemplate)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            if (fAsyncTemplateCheck)
+                CheckBlockTemplateLater(std::make_shared<const CBlock>(pblocktemplate->block), [] { fPendingTemplateInvalid = true; });
 
             // Need to update only after we know CreateNewBlock succeeded
             pindexPrev = pindexPrevNew;
@@ -461,17 +574,17 @@ UniValue getblockbynumber(const UniValue& params, bool fHelp)
         //difficulty = GetDifficulty();
     }
 
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
     {
         UniValue transaction(UniValue::VOBJ);
-        transaction.push_back(Pair("hash",tx.GetHash().GetHex()));
+        transaction.push_back(Pair("hash",tx->GetHash().GetHex()));
         txs.push_back(transaction);
     }
 
     arith_uint256 hashTarget = arith_uint256().SetCompact(block.nBits);
 
     std::stringstream reward_stream;
-    reward_stream << (int64_t)block.vtx[0].vout[1].nValue;
+    reward_stream << (int64_t)block.vtx[0]->vout[1].nValue;
     reward.setStr(reward_stream.str());
 
     std::stringstream height_stream;
@@ -506,49 +619,19 @@ UniValue getblockbynumber(const UniValue& params, bool fHelp)
 
 UniValue getwork(const UniValue& params, bool fHelp)
 {
-    LOCK(cs_main);
-    static unsigned int nTransactionsUpdatedLast;
     UniValue values(UniValue::VARR);
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-    arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+    // The template is rebuilt in the background, no need for cs_main here
+    std::shared_ptr<const CWorkTemplate> work = GetWorkTemplate();
+    if (!work)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
     UniValue prevHash(UniValue::VOBJ);
-    prevHash.setStr("0x"+pblock->hashPrevBlock.GetHex());
+    prevHash.setStr("0x"+work->hashPrevBlock.GetHex());
     UniValue seedHash(UniValue::VOBJ);
-    seedHash.setStr(pblock->GetSeed().GetHex());
+    seedHash.setStr(work->seedHash.GetHex());
     UniValue targHash(UniValue::VOBJ);
-    targHash.setStr(hashTarget.GetHex());
+    targHash.setStr(work->target.GetHex());
 
     values.push_back(prevHash);
     values.push_back(seedHash);
@@ -628,7 +711,9 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             "  \"weightlimit\" : n,                (numeric) limit of block weight\n"
             "  \"curtime\" : ttt,                  (numeric) current timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"bits\" : \"xxxxxxxx\",              (string) compressed target of next block\n"
-            "  \"height\" : n                      (numeric) The height of the next block\n"
+            "  \"height\" : n,                     (numeric) The height of the next block\n"
+            "  \"seedhash\" : \"xxxx\",              (string) The Ethash seed hash of the next block's epoch, as in eth_getWork\n"
+            "  \"longpollid\" : \"xxxx\",            (string) Send back to wait until a new tip, or new transactions after " + i64tostr(WORK_TEMPLATE_MEMPOOL_REFRESH) + " seconds\n"
             "}\n"
 
             "\nExamples:\n"
@@ -737,18 +822,17 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         // Release the wallet and main lock while waiting
         LEAVE_CRITICAL_SECTION(cs_main);
         {
-            checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+            // New transactions only count once the template is a little older, like for eth_getWork
+            checktxtime = boost::get_system_time() + boost::posix_time::seconds(WORK_TEMPLATE_MEMPOOL_REFRESH);
 
             boost::unique_lock<boost::mutex> lock(csBestBlock);
             while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
             {
-                if (!cvBlockChange.timed_wait(lock, checktxtime))
-                {
-                    // Timeout: Check transactions for update
-                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
-                        break;
-                    checktxtime += boost::posix_time::seconds(10);
-                }
+                boost::system_time now = boost::get_system_time();
+                if (now >= checktxtime && mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                    break;
+                // New tips and mempool transactions signal cvBlockChange, the timeout covers a missed one
+                cvBlockChange.timed_wait(lock, now < checktxtime ? checktxtime : now + boost::posix_time::seconds(10));
             }
         }
         ENTER_CRITICAL_SECTION(cs_main);
@@ -762,7 +846,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     static CBlockIndex* pindexPrev;
     static int64_t nStart;
     static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
+    if (fBlockTemplateInvalid.exchange(false) || pindexPrev != chainActive.Tip() ||
         (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
@@ -780,9 +864,11 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             pblocktemplate = NULL;
         }
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy);
+        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, true, !fAsyncTemplateCheck);
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        if (fAsyncTemplateCheck)
+            CheckBlockTemplateLater(std::make_shared<const CBlock>(pblocktemplate->block), [] { fBlockTemplateInvalid = true; });
 
         // Need to update only after we know CreateNewBlock succeeded
         pindexPrev = pindexPrevNew;
@@ -802,7 +888,8 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     UniValue transactions(UniValue::VARR);
     map<uint256, int64_t> setTxIndex;
     int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, pblock->vtx) {
+        const CTransaction& tx = *ptx;
         uint256 txHash = tx.GetHash();
         setTxIndex[txHash] = i++;
 
@@ -907,8 +994,8 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue + (int64_t)pblock->vtx[0].vout[1].nValue)); //<--MIL: Specifications
-    result.push_back(Pair("charityvalue", (int64_t)pblock->vtx[0].vout[0].nValue)); //<--MIL: Specifications
+    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0]->vout[0].nValue + (int64_t)pblock->vtx[0]->vout[1].nValue)); //<--MIL: Specifications
+    result.push_back(Pair("charityvalue", (int64_t)pblock->vtx[0]->vout[0].nValue)); //<--MIL: Specifications
     result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
@@ -926,6 +1013,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
     result.push_back(Pair("seed", pblock->GetSeed().GetHex()));
+    result.push_back(Pair("seedhash", pblock->GetSeed().GetHex()));
 
     const struct BIP9DeploymentInfo& segwit_info = VersionBitsDeploymentInfo[Consensus::DEPLOYMENT_SEGWIT];
     if (!pblocktemplate->vchCoinbaseCommitment.empty() && setClientRules.find(segwit_info.name) != setClientRules.end()) {
@@ -1169,6 +1257,8 @@ static const CRPCCommand commands[] =
 
     { "generating",         "generate",               &generate,               true  },
     { "generating",         "generatetoaddress",      &generatetoaddress,      true  },
+    { "generating",         "getgenerate",            &getgenerate,            true  },
+    { "generating",         "setgenerate",            &setgenerate,            true  },
 
     { "util",               "estimatefee",            &estimatefee,            true  },
     { "util",               "estimatepriority",       &estimatepriority,       true  },
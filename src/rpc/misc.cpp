@@ -5,10 +5,14 @@
 
 #include "base58.h"
 #include "clientversion.h"
+#include "dbwrapper.h"
+#include "indexbuilder.h"
+#include "indexwriter.h"
 #include "init.h"
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
+#include "profiler.h"
 #include "rpc/server.h"
 #include "timedata.h"
 #include "txmempool.h"
@@ -22,6 +26,7 @@
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 
 #include <univalue.h>
 
@@ -448,6 +453,310 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+static bool CompareLockWait(const CLockProfileStats& a, const CLockProfileStats& b)
+{
+    return a.nWaitMicros > b.nWaitMicros;
+}
+
+static bool CompareLockHold(const CLockProfileStats& a, const CLockProfileStats& b)
+{
+    return a.nHoldMicros > b.nHoldMicros;
+}
+
+UniValue getlockcontention(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "getlockcontention ( count \"sortby\" reset )\n"
+            "\nReturns the lock acquisition sites that waited or held longest while lock profiling\n"
+            "was on, see -lockprofiling and setlockprofiling.\n"
+            "\nArguments:\n"
+            "1. count     (numeric, optional, default=20) How many sites to return, 0 for all\n"
+            "2. \"sortby\"  (string, optional, default=\"wait\") \"wait\" or \"hold\", the total time to sort by\n"
+            "3. reset     (boolean, optional, default=false) Clear the counters afterwards\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,       (boolean) whether locks are being profiled\n"
+            "  \"sites\": [\n"
+            "    {\n"
+            "      \"lock\": \"name\",          (string) the lock, as written at the site\n"
+            "      \"site\": \"file:line\",     (string) where it is taken\n"
+            "      \"acquired\": n,           (numeric) times it was taken there\n"
+            "      \"contended\": n,          (numeric) times it had to wait, or a TRY_LOCK failed\n"
+            "      \"wait_us\": n,            (numeric) total microseconds waited\n"
+            "      \"max_wait_us\": n,        (numeric) longest wait\n"
+            "      \"hold_us\": n,            (numeric) total microseconds held\n"
+            "      \"max_hold_us\": n         (numeric) longest hold\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getlockcontention", "")
+            + HelpExampleCli("getlockcontention", "10 \"hold\" true")
+            + HelpExampleRpc("getlockcontention", "10, \"wait\"")
+        );
+
+    int nCount = params.size() > 0 ? params[0].get_int() : 20;
+    if (nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+    std::string strSortBy = params.size() > 1 ? params[1].get_str() : "wait";
+    if (strSortBy != "wait" && strSortBy != "hold")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "sortby must be \"wait\" or \"hold\"");
+    bool fReset = params.size() > 2 && params[2].get_bool();
+
+    std::vector<CLockProfileStats> vStats = GetLockProfile();
+    if (fReset)
+        ResetLockProfile();
+    std::sort(vStats.begin(), vStats.end(), strSortBy == "wait" ? CompareLockWait : CompareLockHold);
+    if (nCount > 0 && vStats.size() > (size_t)nCount)
+        vStats.resize(nCount);
+
+    UniValue sites(UniValue::VARR);
+    BOOST_FOREACH(const CLockProfileStats& stats, vStats) {
+        UniValue site(UniValue::VOBJ);
+        site.push_back(Pair("lock", stats.strName));
+        site.push_back(Pair("site", stats.strSite));
+        site.push_back(Pair("acquired", stats.nAcquired));
+        site.push_back(Pair("contended", stats.nContended));
+        site.push_back(Pair("wait_us", stats.nWaitMicros));
+        site.push_back(Pair("max_wait_us", stats.nMaxWaitMicros));
+        site.push_back(Pair("hold_us", stats.nHoldMicros));
+        site.push_back(Pair("max_hold_us", stats.nMaxHoldMicros));
+        sites.push_back(site);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("enabled", fLockProfiling.load()));
+    result.push_back(Pair("sites", sites));
+    return result;
+}
+
+UniValue setlockprofiling(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "setlockprofiling enable\n"
+            "\nTurns lock profiling on or off; the counters of getlockcontention are kept either way.\n"
+            "\nArguments:\n"
+            "1. enable    (boolean, required) Whether to profile locks\n"
+            "\nExamples:\n"
+            + HelpExampleCli("setlockprofiling", "true")
+            + HelpExampleRpc("setlockprofiling", "false")
+        );
+
+    fLockProfiling = params[0].get_bool();
+    return NullUniValue;
+}
+
+UniValue getstartupinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getstartupinfo\n"
+            "\nReturns the phase startup is in, how long each phase took and whether the node is ready\n"
+            "for traffic. Unlike other calls it also answers while the node starts; GET /health on the\n"
+            "RPC port reports the same readiness without authentication, with status 200 or 503.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"phase\": \"name\",          (string) the current phase, \"done\" once startup finished\n"
+            "  \"status\": \"message\",      (string) what startup is doing, as the warmup error reports it\n"
+            "  \"ready\": true|false,      (boolean) startup finished, the node left initial block download and loaded peers.dat\n"
+            "  \"waitingfor\": \"what\",     (string, if not ready) the phase, \"initialblockdownload\" or \"loadaddresses\"\n"
+            "  \"elapsed_ms\": n,          (numeric) milliseconds from the start of startup to now, or to its end\n"
+            "  \"phases\": [\n"
+            "    {\n"
+            "      \"name\": \"name\",        (string) setup, parameters, datadir, verifywallet, network, loadblockindex,\n"
+            "                              verifyblocks, loadwallet, maintenance, importblocks, ethash, startnode or done\n"
+            "      \"ms\": n                (numeric) how long it took, or has taken so far for the current phase\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getstartupinfo", "")
+            + HelpExampleRpc("getstartupinfo", "")
+        );
+
+    std::vector<CStartupPhase> vPhases = GetStartupPhases();
+    std::string strReason;
+    bool fReady = IsNodeReady(strReason);
+    std::string strStatus;
+    if (!RPCIsInWarmup(&strStatus))
+        strStatus = "Done loading";
+
+    int64_t nNow = GetTimeMillis();
+    UniValue phases(UniValue::VARR);
+    BOOST_FOREACH(const CStartupPhase& phase, vPhases) {
+        if (phase.strName == "done")
+            break;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", phase.strName));
+        obj.push_back(Pair("ms", phase.nDurationMillis < 0 ? nNow - phase.nStartMillis : phase.nDurationMillis));
+        phases.push_back(obj);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("phase", vPhases.empty() ? "starting" : vPhases.back().strName));
+    result.push_back(Pair("status", strStatus));
+    result.push_back(Pair("ready", fReady));
+    if (!fReady)
+        result.push_back(Pair("waitingfor", strReason));
+    if (!vPhases.empty()) {
+        bool fDone = vPhases.back().strName == "done";
+        result.push_back(Pair("elapsed_ms", (fDone ? vPhases.back().nStartMillis : nNow) - vPhases[0].nStartMillis));
+    }
+    result.push_back(Pair("phases", phases));
+    return result;
+}
+
+UniValue setprofiling(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "setprofiling ( enable \"file\" hz )\n"
+            "\nStarts or stops the sampling CPU profiler, see -profile, and returns its state.\n"
+            "Stopping writes the profile files, which are also rewritten every minute while it runs.\n"
+            "Read them with pprof, e.g. pprof --text mild <file>.\n"
+            "\nArguments:\n"
+            "1. enable    (boolean, optional) Whether to profile; without it only the state is returned\n"
+            "2. \"file\"    (string, optional, default=\"mild.prof\") The profile file, relative to the data directory\n"
+            "3. hz        (numeric, optional, default=" + strprintf("%d", DEFAULT_PROFILE_HZ) + ") Samples per CPU second\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,  (boolean) whether the profiler runs\n"
+            "  \"file\": \"path\",        (string) the file of all threads; <file>.<thread> holds those of one thread name\n"
+            "  \"hz\": n,               (numeric) samples per CPU second\n"
+            "  \"samples\": n,          (numeric) samples collected since it started\n"
+            "  \"dropped\": n           (numeric) samples lost because the buffers were full\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("setprofiling", "true \"mild.prof\"")
+            + HelpExampleCli("setprofiling", "false")
+            + HelpExampleRpc("setprofiling", "true, \"mild.prof\", 200")
+        );
+
+    if (params.size() > 0) {
+        if (params[0].get_bool()) {
+            std::string strFile = params.size() > 1 ? params[1].get_str() : "mild.prof";
+            int nHz = params.size() > 2 ? params[2].get_int() : DEFAULT_PROFILE_HZ;
+            std::string strError;
+            if (!StartProfiler(strFile, nHz, strError))
+                throw JSONRPCError(RPC_MISC_ERROR, strError);
+        } else {
+            StopProfiler();
+        }
+    }
+
+    CProfilerStats stats = GetProfilerStats();
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("enabled", stats.fRunning));
+    result.push_back(Pair("file", stats.strFile));
+    result.push_back(Pair("hz", stats.nHz));
+    result.push_back(Pair("samples", stats.nSamples));
+    result.push_back(Pair("dropped", stats.nDropped));
+    return result;
+}
+
+static void DBMemoryUsageToJSON(const CDBWrapper& db, UniValue& result)
+{
+    std::string strUsage = db.GetProperty("leveldb.approximate-memory-usage");
+    result.push_back(Pair(db.GetPath().filename().string(), strUsage.empty() ? 0 : atoi64(strUsage)));
+}
+
+UniValue getmemoryinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getmemoryinfo ( \"mode\" )\n"
+            "\nReturns the memory the main structures of the node take, in bytes, as the node estimates it.\n"
+            "Allocator overhead outside the estimates, code and thread stacks are not included.\n"
+            "\nArguments:\n"
+            "1. \"mode\"    (string, optional, default=\"summary\") \"summary\", or \"detailed\" to also break the\n"
+            "              databases and the peer buffers down\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"total\": n,              (numeric) The sum of the structures below but the wallet\n"
+            "  \"limit\": n,              (numeric) -maxmemory in bytes, 0 if not set\n"
+            "  \"coins_cache\": n,        (numeric) The UTXO cache, limited by -dbcache\n"
+            "  \"mempool\": n,            (numeric) The mempool, limited by -maxmempool\n"
+            "  \"block_index\": n,        (numeric) The block index\n"
+            "  \"leveldb\": n,            (numeric) The write buffers and block caches of the databases\n"
+            "  \"sigcache\": n,           (numeric) The signature cache\n"
+            "  \"script_cache\": n,       (numeric) The script execution cache\n"
+            "  \"ethash_light\": n,       (numeric) The Ethash light caches, limited by -ethashlightcache\n"
+            "  \"ethash_dag\": n,         (numeric) The Ethash DAGs, in memory or mapped from their files\n"
+            "  \"peer_send\": n,          (numeric) Messages queued to send to peers\n"
+            "  \"peer_recv\": n,          (numeric) Messages received from peers and not yet processed, and idle buffers\n"
+            "  \"wallet\": n,             (numeric) The transactions of the wallet, if it is enabled\n"
+            "  \"databases\": {           (json object) With detailed, the memory of each database\n"
+            "    \"name\": n,             (numeric) Bytes, by database directory name\n"
+            "    ...\n"
+            "  },\n"
+            "  \"peers\": [               (json array) With detailed, the buffers of each peer\n"
+            "    {\n"
+            "      \"id\": n,             (numeric) Peer index\n"
+            "      \"addr\": \"host:port\", (string) The address of the peer\n"
+            "      \"send\": n,           (numeric) Bytes queued to send; payloads shared by several peers count for each\n"
+            "      \"recv\": n            (numeric) Bytes of the messages received and not yet processed\n"
+            "    },\n"
+            "    ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmemoryinfo", "")
+            + HelpExampleCli("getmemoryinfo", "\"detailed\"")
+            + HelpExampleRpc("getmemoryinfo", "\"detailed\"")
+        );
+
+    bool fDetailed = false;
+    if (params.size() > 0) {
+        std::string strMode = params[0].get_str();
+        if (strMode == "detailed")
+            fDetailed = true;
+        else if (strMode != "summary")
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown mode " + strMode);
+    }
+
+    CNodeMemoryUsage usage = GetNodeMemoryUsage();
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("total", (uint64_t)usage.Total()));
+    result.push_back(Pair("limit", std::max<int64_t>(0, GetArg("-maxmemory", DEFAULT_MAX_MEMORY)) << 20));
+    result.push_back(Pair("coins_cache", (uint64_t)usage.nCoinsCache));
+    result.push_back(Pair("mempool", (uint64_t)usage.nMempool));
+    result.push_back(Pair("block_index", (uint64_t)usage.nBlockIndex));
+    result.push_back(Pair("leveldb", (uint64_t)usage.nLevelDB));
+    result.push_back(Pair("sigcache", (uint64_t)usage.nSigCache));
+    result.push_back(Pair("script_cache", (uint64_t)usage.nScriptCache));
+    result.push_back(Pair("ethash_light", (uint64_t)usage.nEthashLight));
+    result.push_back(Pair("ethash_dag", (uint64_t)usage.nEthashDAG));
+    result.push_back(Pair("peer_send", (uint64_t)usage.nPeerSend));
+    result.push_back(Pair("peer_recv", (uint64_t)usage.nPeerRecv));
+#ifdef ENABLE_WALLET
+    if (pwalletMain) {
+        LOCK(pwalletMain->cs_wallet);
+        result.push_back(Pair("wallet", (uint64_t)(pwalletMain->mapWallet.size() * sizeof(CWalletTx) + pwalletMain->GetTxMemoryUsage())));
+    }
+#endif
+
+    if (fDetailed) {
+        UniValue databases(UniValue::VOBJ);
+        CDBWrapper::ForEachOpen(boost::bind(&DBMemoryUsageToJSON, _1, boost::ref(databases)));
+        result.push_back(Pair("databases", databases));
+        UniValue peers(UniValue::VARR);
+        BOOST_FOREACH(const CNodeBufferUsage& buffers, GetNodeBufferUsage()) {
+            UniValue peer(UniValue::VOBJ);
+            peer.push_back(Pair("id", buffers.nodeid));
+            peer.push_back(Pair("addr", buffers.addrName));
+            peer.push_back(Pair("send", (uint64_t)buffers.nSendBytes));
+            peer.push_back(Pair("recv", (uint64_t)buffers.nRecvBytes));
+            peers.push_back(peer);
+        }
+        result.push_back(Pair("peers", peers));
+    }
+    return result;
+}
+
 bool getAddressFromIndex(const int &type, const uint160 &hash, std::string &address)
 {
     if (type == 2) {
@@ -498,9 +807,88 @@ bool getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint16
     return true;
 }
 
-bool heightSort(std::pair<CAddressUnspentKey, CAddressUnspentValue> a,
-                std::pair<CAddressUnspentKey, CAddressUnspentValue> b) {
-    return a.second.blockHeight < b.second.blockHeight;
+/** Read the "limit" and "cursor" of a paged address index call, nLimit is 0 if the call is not paged */
+template <typename Key>
+static void getAddressPageFromParams(const UniValue& params, const std::vector<std::pair<uint160, int> > &addresses,
+                                     size_t &nLimit, unsigned int &nAddress, Key &key, bool &fHaveKey, uint256 &hashTip)
+{
+    nLimit = 0;
+    nAddress = 0;
+    fHaveKey = false;
+    if (!params[0].isObject())
+        return;
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    if (limitValue.isNull()) {
+        if (!cursorValue.isNull())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "A cursor is only valid together with a limit");
+        return;
+    }
+    if (!limitValue.isNum() || limitValue.get_int() <= 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be greater than zero");
+    nLimit = limitValue.get_int();
+    if (cursorValue.isNull())
+        return;
+
+    if (!cursorValue.isStr() || !IsHex(cursorValue.get_str()))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    CDataStream ssCursor(ParseHex(cursorValue.get_str()), SER_DISK, CLIENT_VERSION);
+    try {
+        ssCursor >> hashTip >> nAddress >> key;
+    } catch (const std::exception&) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    // A cursor is only valid for the address list it was handed out for
+    if (nAddress >= addresses.size() || key.type != (unsigned int)addresses[nAddress].second || key.hashBytes != addresses[nAddress].first)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    fHaveKey = true;
+}
+
+/** The index snapshot an address index call reads, without cs_main. Later pages read the snapshot
+ * the first page did, so that blocks connected in between neither repeat nor skip entries. */
+static std::shared_ptr<const CIndexSnapshot> getAddressIndexSnapshot(bool fCursor, const uint256 &hashTip)
+{
+    std::shared_ptr<const CIndexSnapshot> snapshot = fCursor ? GetIndexSnapshot(hashTip) : GetIndexSnapshot();
+    if (!snapshot && fCursor)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cursor expired, start again without a cursor");
+    if (!snapshot || !snapshot->pindex || !snapshot->address)
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+    return snapshot;
+}
+
+/** The opaque continuation key of a paged address index call: the snapshot the page was read from
+ * and the first entry of the next page */
+template <typename Key>
+static std::string getAddressPageCursor(const CIndexSnapshot &snapshot, unsigned int nAddress, const Key &key)
+{
+    CDataStream ssCursor(SER_DISK, CLIENT_VERSION);
+    ssCursor << snapshot.pindex->GetBlockHash() << nAddress << key;
+    return HexStr(ssCursor.begin(), ssCursor.end());
+}
+
+static UniValue addressUnspentToJSON(const std::string &address, const CAddressUnspentKey &key, const CAddressUnspentValue &value)
+{
+    UniValue output(UniValue::VOBJ);
+    output.push_back(Pair("address", address));
+    output.push_back(Pair("txid", key.txhash.GetHex()));
+    output.push_back(Pair("outputIndex", (int)key.index));
+    output.push_back(Pair("script", HexStr(value.script.begin(), value.script.end())));
+    output.push_back(Pair("satoshis", value.satoshis));
+    output.push_back(Pair("height", value.blockHeight));
+    return output;
+}
+
+static UniValue addressDeltaToJSON(const std::string &address, const CAddressIndexKey &key, CAmount amount)
+{
+    UniValue delta(UniValue::VOBJ);
+    delta.push_back(Pair("satoshis", amount));
+    delta.push_back(Pair("txid", key.txhash.GetHex()));
+    delta.push_back(Pair("index", (int)key.index));
+    delta.push_back(Pair("blockindex", (int)key.txindex));
+    delta.push_back(Pair("height", key.blockHeight));
+    delta.push_back(Pair("address", address));
+    return delta;
 }
 
 bool timestampSort(std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> a,
@@ -508,6 +896,13 @@ bool timestampSort(std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> a,
     return a.second.time < b.second.time;
 }
 
+/** Refuse queries while the address index is built in the background, its answers would be incomplete */
+static void EnsureAddressIndexBuilt()
+{
+    if (IsIndexBuilding("addressindex"))
+        throw JSONRPCError(RPC_IN_WARMUP, "The address index is still being built, see getindexinfo");
+}
+
 UniValue getaddressmempool(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -592,6 +987,9 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "      ,...\n"
             "    ],\n"
             "  \"chainInfo\"  (boolean) Include chain info with results\n"
+            "  \"limit\"  (number, optional) Return at most this many results, together with a cursor for the rest\n"
+            "  \"cursor\"  (string, optional) The cursor returned by the previous page, pages are read as of the chain tip of the first\n"
+            "              one and a cursor expires once the tip has moved on a few blocks\n"
             "}\n"
             "\nResult\n"
             "[\n"
@@ -604,6 +1002,11 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "    \"satoshis\"  (number) The number of satoshis of the output\n"
             "  }\n"
             "]\n"
+            "\nWith a limit the results are returned address by address in index order as\n"
+            "{\n"
+            "  \"utxos\": [ ... ],\n"
+            "  \"cursor\": \"hex\"  (string) Pass this to get the next page, null after the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
             + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
@@ -617,47 +1020,75 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         }
     }   
 
+    EnsureAddressIndexBuilt();
+
     std::vector<std::pair<uint160, int> > addresses;
 
     if (!getAddressesFromParams(params, addresses)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
-    }
-
-    std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+    size_t nLimit;
+    unsigned int nAddress;
+    CAddressUnspentKey cursorKey;
+    bool fCursor;
+    uint256 hashTip;
+    getAddressPageFromParams(params, addresses, nLimit, nAddress, cursorKey, fCursor, hashTip);
+    std::shared_ptr<const CIndexSnapshot> snapshot = getAddressIndexSnapshot(fCursor, hashTip);
 
     UniValue utxos(UniValue::VARR);
+    UniValue cursor(UniValue::VNULL);
 
-    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=unspentOutputs.begin(); it!=unspentOutputs.end(); it++) {
-        UniValue output(UniValue::VOBJ);
-        std::string address;
-        if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+    if (nLimit > 0) {
+        for (unsigned int i = nAddress; i < addresses.size() && cursor.isNull(); i++) {
+            std::string address;
+            if (!getAddressFromIndex(addresses[i].second, addresses[i].first, address)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+            }
+            bool fFound = ScanAddressUnspent(addresses[i].first, addresses[i].second,
+                [&](const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+                    if (utxos.size() == nLimit) {
+                        cursor = getAddressPageCursor(*snapshot, i, key);
+                        return false;
+                    }
+                    utxos.push_back(addressUnspentToJSON(address, key, value));
+                    return true;
+                }, (i == nAddress && fCursor) ? &cursorKey : NULL, snapshot->address.get());
+            if (!fFound) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+            if (cursor.isNull() && utxos.size() == nLimit && i + 1 < addresses.size()) {
+                cursor = getAddressPageCursor(*snapshot, i + 1, CAddressUnspentKey(addresses[i + 1].second, addresses[i + 1].first, uint256(), 0));
+            }
+        }
+    } else {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+
+        if (!GetAddressUnspent(addresses, unspentOutputs, snapshot->address.get())) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
 
-        output.push_back(Pair("address", address));
-        output.push_back(Pair("txid", it->first.txhash.GetHex()));
-        output.push_back(Pair("outputIndex", (int)it->first.index));
-        output.push_back(Pair("script", HexStr(it->second.script.begin(), it->second.script.end())));
-        output.push_back(Pair("satoshis", it->second.satoshis));
-        output.push_back(Pair("height", it->second.blockHeight));
-        utxos.push_back(output);
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=unspentOutputs.begin(); it!=unspentOutputs.end(); it++) {
+            std::string address;
+            if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+            }
+            utxos.push_back(addressUnspentToJSON(address, it->first, it->second));
+        }
     }
 
-    if (includeChainInfo) {
+    if (includeChainInfo || nLimit > 0) {
         UniValue result(UniValue::VOBJ);
         result.push_back(Pair("utxos", utxos));
+        if (nLimit > 0) {
+            result.push_back(Pair("cursor", cursor));
+        }
 
-        LOCK(cs_main);
-        result.push_back(Pair("hash", chainActive.Tip()->GetBlockHash().GetHex()));
-        result.push_back(Pair("height", (int)chainActive.Height()));
+        if (includeChainInfo) {
+            // The tip the outputs are as of, even if the chain has moved on since
+            result.push_back(Pair("hash", snapshot->pindex->GetBlockHash().GetHex()));
+            result.push_back(Pair("height", snapshot->pindex->nHeight));
+        }
         return result;
     } else {
         return utxos;
@@ -670,6 +1101,7 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         throw runtime_error(
             "getaddressdeltas\n"
             "\nReturns all changes for an address (requires addressindex to be enabled).\n"
+            "The changes of several addresses are merged in height order.\n"
             "\nArguments:\n"
             "{\n"
             "  \"addresses\"\n"
@@ -680,6 +1112,9 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
             "  \"chainInfo\" (boolean) Include chain info in results, only applies if start and end specified\n"
+            "  \"limit\"  (number, optional) Return at most this many results, together with a cursor for the rest\n"
+            "  \"cursor\"  (string, optional) The cursor returned by the previous page, pages are read as of the chain tip of the first\n"
+            "              one and a cursor expires once the tip has moved on a few blocks\n"
             "}\n"
             "\nResult:\n"
             "[\n"
@@ -691,6 +1126,11 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    \"address\"  (string) The base58check encoded address\n"
             "  }\n"
             "]\n"
+            "\nWith a limit the results are returned address by address in index order as\n"
+            "{\n"
+            "  \"deltas\": [ ... ],\n"
+            "  \"cursor\": \"hex\"  (string) Pass this to get the next page, null after the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
             + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
@@ -720,55 +1160,73 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         }
     }
 
+    EnsureAddressIndexBuilt();
+
     std::vector<std::pair<uint160, int> > addresses;
 
     if (!getAddressesFromParams(params, addresses)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    size_t nLimit;
+    unsigned int nAddress;
+    CAddressIndexKey cursorKey;
+    bool fCursor;
+    uint256 hashTip;
+    getAddressPageFromParams(params, addresses, nLimit, nAddress, cursorKey, fCursor, hashTip);
+    std::shared_ptr<const CIndexSnapshot> snapshot = getAddressIndexSnapshot(fCursor, hashTip);
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    UniValue deltas(UniValue::VARR);
+    UniValue cursor(UniValue::VNULL);
+
+    if (nLimit > 0) {
+        for (unsigned int i = nAddress; i < addresses.size() && cursor.isNull(); i++) {
+            std::string address;
+            if (!getAddressFromIndex(addresses[i].second, addresses[i].first, address)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
             }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+            bool fFound = ScanAddressIndex(addresses[i].first, addresses[i].second,
+                [&](const CAddressIndexKey& key, CAmount amount) {
+                    if (deltas.size() == nLimit) {
+                        cursor = getAddressPageCursor(*snapshot, i, key);
+                        return false;
+                    }
+                    deltas.push_back(addressDeltaToJSON(address, key, amount));
+                    return true;
+                }, start, end, (i == nAddress && fCursor) ? &cursorKey : NULL, snapshot->address.get());
+            if (!fFound) {
                 throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
             }
+            if (cursor.isNull() && deltas.size() == nLimit && i + 1 < addresses.size()) {
+                cursor = getAddressPageCursor(*snapshot, i + 1, CAddressIndexKey(addresses[i + 1].second, addresses[i + 1].first, 0, 0, uint256(), 0, false));
+            }
         }
-    }
-
-    UniValue deltas(UniValue::VARR);
+    } else {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it!=addressIndex.end(); it++) {
-        std::string address;
-        if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        if (!GetAddressIndex(addresses, addressIndex, start, end, snapshot->address.get())) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
 
-        UniValue delta(UniValue::VOBJ);
-        delta.push_back(Pair("satoshis", it->second));
-        delta.push_back(Pair("txid", it->first.txhash.GetHex()));
-        delta.push_back(Pair("index", (int)it->first.index));
-        delta.push_back(Pair("blockindex", (int)it->first.txindex));
-        delta.push_back(Pair("height", it->first.blockHeight));
-        delta.push_back(Pair("address", address));
-        deltas.push_back(delta);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it!=addressIndex.end(); it++) {
+            std::string address;
+            if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+            }
+            deltas.push_back(addressDeltaToJSON(address, it->first, it->second));
+        }
     }
 
     UniValue result(UniValue::VOBJ);
 
     if(includeChainInfo && start > 0 && end > 0) {
-        LOCK(cs_main);
-
-        if(start > chainActive.Height() || end > chainActive.Height()) {
+        if(start > snapshot->pindex->nHeight || end > snapshot->pindex->nHeight) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Start or end is outside chain range");
         }
 
-        CBlockIndex* startIndex = chainActive[start];
-        CBlockIndex* endIndex = chainActive[end];
+        // The blocks of the chain the deltas were read from
+        const CBlockIndex* startIndex = snapshot->pindex->GetAncestor(start);
+        const CBlockIndex* endIndex = snapshot->pindex->GetAncestor(end);
 
         UniValue startInfo(UniValue::VOBJ);
         UniValue endInfo(UniValue::VOBJ);
@@ -780,9 +1238,16 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         endInfo.push_back(Pair("height", end));
 
         result.push_back(Pair("deltas", deltas));
+        if (nLimit > 0) {
+            result.push_back(Pair("cursor", cursor));
+        }
         result.push_back(Pair("start", startInfo));
         result.push_back(Pair("end", endInfo));
 
+        return result;
+    } else if (nLimit > 0) {
+        result.push_back(Pair("deltas", deltas));
+        result.push_back(Pair("cursor", cursor));
         return result;
     } else {
         return deltas;
@@ -808,39 +1273,50 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
             "{\n"
             "  \"balance\"  (string) The current balance in satoshis\n"
             "  \"received\"  (string) The total number of satoshis received (including change)\n"
+            "  \"txcount\"  (numeric) The number of transactions involving the address(es), counted per address\n"
+            "  \"firstheight\"  (numeric) The height of the first block with activity, 0 if there is none\n"
+            "  \"lastheight\"  (numeric) The height of the last block with activity, 0 if there is none\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
             + HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
         );
-    
+
+    EnsureAddressIndexBuilt();
+
     std::vector<std::pair<uint160,int> > addresses;
 
     if(!getAddressesFromParams(params,addresses)){
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY,"Invalid adress");
     } 
 
-    std::vector<std::pair<CAddressIndexKey,CAmount> > addressIndex;
-
-    for(std::vector<std::pair<uint160,int> >::iterator it = addresses.begin(); it != addresses.end(); it++){
-        if(!GetAddressIndex((*it).first,(*it).second, addressIndex)){
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
-    }
-
     CAmount balance = 0;
     CAmount received = 0;
+    int64_t txCount = 0;
+    int firstHeight = 0;
+    int lastHeight = 0;
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if(it->second > 0){
-            received += it->second;
+    for(std::vector<std::pair<uint160,int> >::iterator it = addresses.begin(); it != addresses.end(); it++){
+        CAddressBalanceValue value;
+        if(!GetAddressBalance((*it).first,(*it).second, value)){
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
-        balance += it->second;
+        if (value.IsNull())
+            continue;
+        balance += value.balance;
+        received += value.received;
+        txCount += value.txCount;
+        if (firstHeight == 0 || value.firstHeight < firstHeight)
+            firstHeight = value.firstHeight;
+        lastHeight = std::max(lastHeight, value.lastHeight);
     }
 
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("balance", ValueFromAmount(balance)));
     result.push_back(Pair("received", ValueFromAmount(received)));
+    result.push_back(Pair("txcount", txCount));
+    result.push_back(Pair("firstheight", firstHeight));
+    result.push_back(Pair("lastheight", lastHeight));
 
     return result;
     
@@ -861,17 +1337,28 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\"  (number, optional) Return at most this many results, together with a cursor for the rest\n"
+            "  \"cursor\"  (string, optional) The cursor returned by the previous page, pages are read as of the chain tip of the first\n"
+            "              one and a cursor expires once the tip has moved on a few blocks\n"
             "}\n"
             "\nResult:\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nWith a limit the results are returned address by address in index order as\n"
+            "{\n"
+            "  \"txids\": [ ... ],\n"
+            "  \"cursor\": \"hex\"  (string) Pass this to get the next page, null after the last page\n"
+            "}\n"
+
             "\nExamples:\n"
             + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
             + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
         );
 
+    EnsureAddressIndexBuilt();
+
     std::vector<std::pair<uint160, int> > addresses;
 
     if(!getAddressesFromParams(params, addresses)) {
@@ -889,18 +1376,54 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if(start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+    size_t nLimit;
+    unsigned int nAddress;
+    CAddressIndexKey cursorKey;
+    bool fCursor;
+    uint256 hashTip;
+    getAddressPageFromParams(params, addresses, nLimit, nAddress, cursorKey, fCursor, hashTip);
+    std::shared_ptr<const CIndexSnapshot> snapshot = getAddressIndexSnapshot(fCursor, hashTip);
+
+    if (nLimit > 0) {
+        UniValue txids(UniValue::VARR);
+        UniValue cursor(UniValue::VNULL);
+
+        for (unsigned int i = nAddress; i < addresses.size() && cursor.isNull(); i++) {
+            // The entries of a transaction are next to each other, a page never splits them
+            std::pair<int, uint256> lastTx(-1, uint256());
+            bool fFound = ScanAddressIndex(addresses[i].first, addresses[i].second,
+                [&](const CAddressIndexKey& key, CAmount amount) {
+                    std::pair<int, uint256> tx(key.blockHeight, key.txhash);
+                    if (tx == lastTx)
+                        return true;
+                    if (txids.size() == nLimit) {
+                        cursor = getAddressPageCursor(*snapshot, i, key);
+                        return false;
+                    }
+                    lastTx = tx;
+                    txids.push_back(key.txhash.GetHex());
+                    return true;
+                }, start, end, (i == nAddress && fCursor) ? &cursorKey : NULL, snapshot->address.get());
+            if (!fFound) {
                 throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
             }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            if (cursor.isNull() && txids.size() == nLimit && i + 1 < addresses.size()) {
+                cursor = getAddressPageCursor(*snapshot, i + 1, CAddressIndexKey(addresses[i + 1].second, addresses[i + 1].first, 0, 0, uint256(), 0, false));
             }
         }
+
+        UniValue result(UniValue::VOBJ);
+        result.push_back(Pair("txids", txids));
+        result.push_back(Pair("cursor", cursor));
+        return result;
+    }
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+
+    bool fFound = (start > 0 && end > 0) ? GetAddressIndex(addresses, addressIndex, start, end, snapshot->address.get()) :
+                                           GetAddressIndex(addresses, addressIndex, 0, 0, snapshot->address.get());
+    if (!fFound) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
     std::set<std::pair<int, std::string> > txids;
@@ -928,9 +1451,35 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
     return result;
 }
 
+static void ParseSpentInfoKey(const UniValue& request, std::vector<CSpentIndexKey>& keys)
+{
+    if (!request.isObject())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an object with txid and index");
+
+    UniValue txidValue = find_value(request.get_obj(), "txid");
+    UniValue indexValue = find_value(request.get_obj(), "index");
+
+    if (!txidValue.isStr() || !indexValue.isNum()) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid txid or index");
+    }
+
+    uint256 txid = ParseHashV(txidValue, "txid");
+    int outputIndex = indexValue.get_int();
+    keys.push_back(CSpentIndexKey(txid, outputIndex));
+}
+
+static UniValue SpentInfoToJSON(const CSpentIndexValue& value)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("txid", value.txid.GetHex()));
+    obj.push_back(Pair("index", (int)value.inputIndex));
+    obj.push_back(Pair("height", value.blockHeight));
+    return obj;
+}
+
 UniValue getspentinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 1 || !params[0].isObject())
+    if (fHelp || params.size() != 1 || !(params[0].isObject() || params[0].isArray()))
         throw runtime_error(
             "getspentinfo\n"
             "\nReturns the txid and index where an output is spent.\n"
@@ -939,41 +1488,48 @@ UniValue getspentinfo(const UniValue& params, bool fHelp)
             "  \"txid\" (string) The hex string of the txid\n"
             "  \"index\" (number) The start block height\n"
             "}\n"
+            "or an array of such objects, to look up many outputs at once\n"
             "\nResult:\n"
             "{\n"
             "  \"txid\"  (string) The transaction id\n"
             "  \"index\"  (number) The spending input index\n"
             "  ,...\n"
             "}\n"
+            "or for an array, an array with one such object per output, null for an unspent output\n"
             "\nExamples:\n"
             + HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'")
+            + HelpExampleCli("getspentinfo", "'[{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}, {\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 1}]'")
             + HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}")
         );
-    
-    UniValue txidValue = find_value(params[0].get_obj(), "txid");
-    UniValue indexValue = find_value(params[0].get_obj(), "index");
 
-    if (!txidValue.isStr() || !indexValue.isNum()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid txid or index");
+    std::vector<CSpentIndexKey> keys;
+    if (params[0].isArray()) {
+        for (size_t i = 0; i < params[0].size(); i++)
+            ParseSpentInfoKey(params[0][i], keys);
+    } else {
+        ParseSpentInfoKey(params[0], keys);
     }
 
-    uint256 txid = ParseHashV(txidValue, "txid");
-    int outputIndex = indexValue.get_int();
+    if (IsIndexBuilding("spentindex"))
+        throw JSONRPCError(RPC_IN_WARMUP, "The spent index is still being built, see getindexinfo");
 
-    CSpentIndexKey key(txid, outputIndex);
-    CSpentIndexValue value;
+    if (params[0].isObject()) {
+        CSpentIndexValue value;
+        if (!GetSpentIndex(keys[0], value)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+        }
+        return SpentInfoToJSON(value);
+    }
 
-    if (!GetSpentIndex(key, value)) {
+    std::vector<CSpentIndexValue> values;
+    if (!GetSpentIndex(keys, values)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
     }
 
-    UniValue obj(UniValue::VOBJ);
-    obj.push_back(Pair("txid", value.txid.GetHex()));
-    obj.push_back(Pair("index", (int)value.inputIndex));
-    obj.push_back(Pair("height", value.blockHeight));
-
-    return obj;
-
+    UniValue result(UniValue::VARR);
+    for (size_t i = 0; i < values.size(); i++)
+        result.push_back(values[i].IsNull() ? NullUniValue : SpentInfoToJSON(values[i]));
+    return result;
 }
 
 static const CRPCCommand commands[] =
@@ -984,6 +1540,11 @@ static const CRPCCommand commands[] =
     { "util",               "createmultisig",         &createmultisig,         true  },
     { "util",               "verifymessage",          &verifymessage,          true  },
     { "util",               "signmessagewithprivkey", &signmessagewithprivkey, true  },
+    { "control",            "getlockcontention",      &getlockcontention,      true  },
+    { "control",            "setlockprofiling",       &setlockprofiling,       true  },
+    { "control",            "getmemoryinfo",          &getmemoryinfo,          true  },
+    { "control",            "setprofiling",           &setprofiling,           true  },
+    { "control",            "getstartupinfo",         &getstartupinfo,         true,  NULL, true },
 
     /* Address index */
     { "addressindex",       "getaddressmempool",      &getaddressmempool,      true },
@@ -128,6 +128,8 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ]\n"
+            "    \"downloadrate\": n,         (numeric) Bytes per second the blocks we asked from this peer came in at, averaged\n"
+            "    \"inflightquota\": n,        (numeric) How many blocks we ask from this peer at once, sized by its download rate\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,             (numeric) The total bytes sent aggregated by message type\n"
             "       ...\n"
@@ -189,6 +191,8 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("downloadrate", statestats.nDownloadRate));
+            obj.push_back(Pair("inflightquota", statestats.nBlocksInTransitQuota));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -393,6 +397,58 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getcompactblockstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcompactblockstats\n"
+            "\nReturns how compact block relay went since startup. Sent compact blocks prefill the transactions\n"
+            "a peer is predicted to lack, so that it rebuilds the block without asking for them.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"sent\": {                    (json object) Compact blocks we sent\n"
+            "    \"blocks\": n,               (numeric) Compact blocks sent\n"
+            "    \"predicted\": n,            (numeric) ... of which with transactions prefilled on a prediction\n"
+            "    \"prefilled_txs\": n,        (numeric) Transactions prefilled on a prediction\n"
+            "    \"getblocktxn\": n,          (numeric) Requests for transactions we did not prefill\n"
+            "    \"requested_txs\": n         (numeric) Transactions sent in answer to them\n"
+            "  },\n"
+            "  \"received\": {                (json object) Compact blocks we fetched from peers\n"
+            "    \"blocks\": n,               (numeric) Compact blocks received\n"
+            "    \"prefilled_txs\": n,        (numeric) Transactions prefilled in them, coinbases included\n"
+            "    \"reconstructed\": n,        (numeric) Blocks rebuilt from the compact block and our mempool alone\n"
+            "    \"reconstructed_after_getblocktxn\": n, (numeric) Blocks rebuilt after asking for missing transactions\n"
+            "    \"requested_txs\": n,        (numeric) Transactions asked for\n"
+            "    \"failed\": n,               (numeric) Blocks fetched in full after all\n"
+            "    \"reconstruct_rate\": x.x    (numeric) Share of the compact blocks rebuilt without a round trip\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcompactblockstats", "")
+            + HelpExampleRpc("getcompactblockstats", "")
+        );
+
+    CCompactBlockStats stats = GetCompactBlockStats();
+    UniValue sent(UniValue::VOBJ);
+    sent.push_back(Pair("blocks", stats.nSent));
+    sent.push_back(Pair("predicted", stats.nSentPredicted));
+    sent.push_back(Pair("prefilled_txs", stats.nPrefilledTxSent));
+    sent.push_back(Pair("getblocktxn", stats.nBlockTxnRequestsReceived));
+    sent.push_back(Pair("requested_txs", stats.nBlockTxnTxSent));
+    UniValue received(UniValue::VOBJ);
+    received.push_back(Pair("blocks", stats.nReceived));
+    received.push_back(Pair("prefilled_txs", stats.nPrefilledTxReceived));
+    received.push_back(Pair("reconstructed", stats.nReconstructed));
+    received.push_back(Pair("reconstructed_after_getblocktxn", stats.nReconstructedAfterRequest));
+    received.push_back(Pair("requested_txs", stats.nBlockTxnTxRequested));
+    received.push_back(Pair("failed", stats.nFailed));
+    received.push_back(Pair("reconstruct_rate", stats.nReceived ? (double)stats.nReconstructed / stats.nReceived : 0.0));
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("sent", sent));
+    result.push_back(Pair("received", received));
+    return result;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -599,6 +655,7 @@ static const CRPCCommand commands[] =
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
+    { "network",            "getcompactblockstats",   &getcompactblockstats,   true  },
     { "network",            "setban",                 &setban,                 true  },
     { "network",            "listbanned",             &listbanned,             true  },
     { "network",            "clearbanned",            &clearbanned,            true  },
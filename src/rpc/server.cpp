@@ -6,8 +6,11 @@
 #include "rpc/server.h"
 
 #include "base58.h"
+#include "httpserver.h"
 #include "init.h"
+#include "main.h"
 #include "random.h"
+#include "rpc/jobs.h"
 #include "sync.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -265,12 +268,152 @@ UniValue stop(const UniValue& params, bool fHelp)
 /**
  * Call Table
  */
+/** Calls of one RPC method since startup */
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    //! Time the calls held cs_main
+    int64_t nMainMicros;
+    uint64_t vBuckets[RPC_LATENCY_BUCKETS];
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nTotalMicros(0), nMaxMicros(0), nMainMicros(0)
+    {
+        std::fill(vBuckets, vBuckets + RPC_LATENCY_BUCKETS, 0);
+    }
+};
+
+static CCriticalSection cs_rpcStats;
+static std::map<std::string, CRPCMethodStats> mapRPCStats;
+
+/** Times an RPC call and how long it holds cs_main, for getrpcstats and -rpcslowlog */
+class CRPCCallTimer
+{
+private:
+    const std::string& strMethod;
+    int64_t nStartMicros;
+    CLockHoldTimer mainTimer;
+    bool fError;
+
+public:
+    CRPCCallTimer(const std::string& strMethodIn) :
+        strMethod(strMethodIn), nStartMicros(GetTimeMicros()), mainTimer(&cs_main), fError(true) {}
+
+    void Succeeded() { fError = false; }
+
+    ~CRPCCallTimer()
+    {
+        int64_t nMicros = GetTimeMicros() - nStartMicros;
+        int64_t nMainMicros = mainTimer.GetHeldMicros();
+        int nBucket = 0;
+        while (nBucket < RPC_LATENCY_BUCKETS - 1 && nMicros >= (int64_t(1) << nBucket))
+            nBucket++;
+        {
+            LOCK(cs_rpcStats);
+            CRPCMethodStats& stats = mapRPCStats[strMethod];
+            stats.nCalls++;
+            if (fError)
+                stats.nErrors++;
+            stats.nTotalMicros += nMicros;
+            stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+            stats.nMainMicros += nMainMicros;
+            stats.vBuckets[nBucket]++;
+        }
+
+        int64_t nSlowLog = GetArg("-rpcslowlog", DEFAULT_RPC_SLOWLOG);
+        if (nSlowLog > 0 && nMicros >= nSlowLog * 1000)
+            LogPrintf("Slow RPC call: %s took %.3fms, holding cs_main for %.3fms%s\n", strMethod,
+                      nMicros * 0.001, nMainMicros * 0.001, fError ? " (failed)" : "");
+    }
+};
+
+UniValue getrpcstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcstats\n"
+            "\nReturns how the RPC methods called since startup performed, and the state of the HTTP work queue.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"workqueue\": {\n"
+            "    \"depth\": n,         (numeric) Requests waiting for a worker thread\n"
+            "    \"maxdepth\": n,      (numeric) The most requests that can wait, see -rpcworkqueue\n"
+            "    \"peakdepth\": n,     (numeric) The most requests that waited at once\n"
+            "    \"rejected\": n,      (numeric) Requests rejected because the queue was full\n"
+            "    \"latency_us\": n,    (numeric) How long the oldest waiting request has waited, in microseconds\n"
+            "    \"latencyrejected\": n, (numeric) Requests rejected because that exceeded -rpcmaxqueuelatency\n"
+            "    \"threads\": n        (numeric) Worker threads\n"
+            "  },\n"
+            "  \"methods\": {\n"
+            "    \"method\": {\n"
+            "      \"calls\": n,       (numeric) Calls made\n"
+            "      \"errors\": n,      (numeric) Calls that failed\n"
+            "      \"average_us\": x,  (numeric) Average duration in microseconds\n"
+            "      \"max_us\": n,      (numeric) Longest duration in microseconds\n"
+            "      \"cs_main_us\": n,  (numeric) Total time the calls held cs_main, in microseconds\n"
+            "      \"buckets\": {      (json object) Calls by duration, keyed by the upper bound in microseconds\n"
+            "        \"bound\": n,\n"
+            "        ...\n"
+            "      }\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcstats", "")
+            + HelpExampleRpc("getrpcstats", "")
+        );
+
+    UniValue result(UniValue::VOBJ);
+    HTTPWorkQueueStats queueStats;
+    if (GetHTTPWorkQueueStats(queueStats)) {
+        UniValue queue(UniValue::VOBJ);
+        queue.push_back(Pair("depth", (uint64_t)queueStats.nDepth));
+        queue.push_back(Pair("maxdepth", (uint64_t)queueStats.nMaxDepth));
+        queue.push_back(Pair("peakdepth", (uint64_t)queueStats.nPeakDepth));
+        queue.push_back(Pair("rejected", queueStats.nRejected));
+        queue.push_back(Pair("latency_us", queueStats.nLatencyMicros));
+        queue.push_back(Pair("latencyrejected", queueStats.nRejectedLatency));
+        queue.push_back(Pair("threads", queueStats.nThreads));
+        result.push_back(Pair("workqueue", queue));
+    }
+
+    std::map<std::string, CRPCMethodStats> mapStats;
+    {
+        LOCK(cs_rpcStats);
+        mapStats = mapRPCStats;
+    }
+    UniValue methods(UniValue::VOBJ);
+    for (const auto& entry : mapStats) {
+        const CRPCMethodStats& stats = entry.second;
+        UniValue info(UniValue::VOBJ);
+        info.push_back(Pair("calls", stats.nCalls));
+        info.push_back(Pair("errors", stats.nErrors));
+        info.push_back(Pair("average_us", stats.nCalls ? (double)stats.nTotalMicros / stats.nCalls : 0.0));
+        info.push_back(Pair("max_us", stats.nMaxMicros));
+        info.push_back(Pair("cs_main_us", stats.nMainMicros));
+        UniValue buckets(UniValue::VOBJ);
+        for (int i = 0; i < RPC_LATENCY_BUCKETS; i++) {
+            if (stats.vBuckets[i] == 0)
+                continue;
+            std::string strBound = i == RPC_LATENCY_BUCKETS - 1 ? "inf" : strprintf("%d", int64_t(1) << i);
+            buckets.push_back(Pair(strBound, stats.vBuckets[i]));
+        }
+        info.push_back(Pair("buckets", buckets));
+        methods.push_back(Pair(entry.first, info));
+    }
+    result.push_back(Pair("methods", methods));
+    return result;
+}
+
 static const CRPCCommand vRPCCommands[] =
 { //  category              name                      actor (function)         okSafeMode
   //  --------------------- ------------------------  -----------------------  ----------
     /* Overall control/query calls */
     { "control",            "help",                   &help,                   true  },
     { "control",            "stop",                   &stop,                   true  },
+    { "control",            "getrpcstats",            &getrpcstats,            true  },
 };
 
 CRPCTable::CRPCTable()
@@ -311,6 +454,7 @@ bool StartRPC()
 {
     LogPrint("rpc", "Starting RPC\n");
     fRPCRunning = true;
+    StartRPCJobs();
     g_rpcSignals.Started();
     return true;
 }
@@ -320,12 +464,14 @@ void InterruptRPC()
     LogPrint("rpc", "Interrupting RPC\n");
     // Interrupt e.g. running longpolls
     fRPCRunning = false;
+    InterruptRPCJobs();
 }
 
 void StopRPC()
 {
     LogPrint("rpc", "Stopping RPC\n");
     deadlineTimers.clear();
+    StopRPCJobs();
     g_rpcSignals.Stopped();
 }
 
@@ -414,33 +560,79 @@ static UniValue JSONRPCExecOne(const UniValue& req)
 
 std::string JSONRPCExecBatch(const UniValue& vReq)
 {
+    // The calls run on up to -rpcbatchthreads threads, the replies keep their order
+    std::vector<UniValue> vReply(vReq.size());
+    ParallelForEach(vReq.size(), GetArg("-rpcbatchthreads", DEFAULT_RPC_BATCH_THREADS), [&](size_t reqIdx) {
+        vReply[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+        return true;
+    });
+
     UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    for (unsigned int reqIdx = 0; reqIdx < vReply.size(); reqIdx++)
+        ret.push_back(vReply[reqIdx]);
 
     return ret.write() + "\n";
 }
 
 UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params) const
 {
+    // Find method
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+
     // Return immediately if in warmup
     {
         LOCK(cs_rpcWarmup);
-        if (fRPCInWarmup)
+        if (fRPCInWarmup && !(pcmd && pcmd->okWarmup))
             throw JSONRPCError(RPC_IN_WARMUP, rpcWarmupStatus);
     }
 
-    // Find method
-    const CRPCCommand *pcmd = tableRPC[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
 
     g_rpcSignals.PreCommand(*pcmd);
 
+    CRPCCallTimer timer(pcmd->name);
     try
     {
         // Execute
-        return pcmd->actor(params, false);
+        UniValue result = pcmd->actor(params, false);
+        timer.Succeeded();
+        return result;
+    }
+    catch (const std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+
+    g_rpcSignals.PostCommand(*pcmd);
+}
+
+bool CRPCTable::isStreamable(const std::string& strMethod) const
+{
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    return pcmd && pcmd->streamActor;
+}
+
+void CRPCTable::executeStream(const std::string &strMethod, const UniValue &params, JSONStreamWriter& writer) const
+{
+    // Return immediately if in warmup
+    {
+        LOCK(cs_rpcWarmup);
+        if (fRPCInWarmup)
+            throw JSONRPCError(RPC_IN_WARMUP, rpcWarmupStatus);
+    }
+
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    if (!pcmd || !pcmd->streamActor)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+
+    g_rpcSignals.PreCommand(*pcmd);
+
+    CRPCCallTimer timer(pcmd->name);
+    try
+    {
+        pcmd->streamActor(params, writer);
+        timer.Succeeded();
     }
     catch (const std::exception& e)
     {
@@ -450,6 +642,90 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
     g_rpcSignals.PostCommand(*pcmd);
 }
 
+JSONStreamWriter::JSONStreamWriter(const boost::function<void(const std::string&)>& sinkIn) :
+    sink(sinkIn), fAfterKey(false)
+{
+    strBuffer.reserve(RPC_STREAM_FLUSH_SIZE + 1024);
+}
+
+void JSONStreamWriter::Separate()
+{
+    if (fAfterKey) {
+        fAfterKey = false;
+    } else if (!vHasMember.empty()) {
+        if (vHasMember.back())
+            strBuffer += ',';
+        vHasMember.back() = true;
+    }
+}
+
+void JSONStreamWriter::MaybeFlush()
+{
+    if (strBuffer.size() >= RPC_STREAM_FLUSH_SIZE)
+        Flush();
+}
+
+void JSONStreamWriter::BeginObject()
+{
+    Separate();
+    strBuffer += '{';
+    vHasMember.push_back(false);
+}
+
+void JSONStreamWriter::EndObject()
+{
+    assert(!vHasMember.empty() && !fAfterKey);
+    strBuffer += '}';
+    vHasMember.pop_back();
+    MaybeFlush();
+}
+
+void JSONStreamWriter::BeginArray()
+{
+    Separate();
+    strBuffer += '[';
+    vHasMember.push_back(false);
+}
+
+void JSONStreamWriter::EndArray()
+{
+    assert(!vHasMember.empty() && !fAfterKey);
+    strBuffer += ']';
+    vHasMember.pop_back();
+    MaybeFlush();
+}
+
+void JSONStreamWriter::Key(const std::string& key)
+{
+    assert(!fAfterKey);
+    Separate();
+    strBuffer += UniValue(key).write();
+    strBuffer += ':';
+    fAfterKey = true;
+}
+
+void JSONStreamWriter::Value(const UniValue& val)
+{
+    Separate();
+    strBuffer += val.write();
+    MaybeFlush();
+}
+
+void JSONStreamWriter::Flush()
+{
+    if (strBuffer.empty())
+        return;
+    sink(strBuffer);
+    strBuffer.clear();
+}
+
+std::string JSONStreamWriter::Release()
+{
+    std::string strRet;
+    strRet.swap(strBuffer);
+    return strRet;
+}
+
 std::vector<std::string> CRPCTable::listCommands() const
 {
     std::vector<std::string> commandList;
@@ -14,12 +14,21 @@
 #include <map>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include <boost/function.hpp>
 
 #include <univalue.h>
 
 static const unsigned int DEFAULT_RPC_SERIALIZE_VERSION = 1;
+/** Default for -rpcbatchthreads, the most threads executing the calls of one JSON-RPC batch */
+static const int DEFAULT_RPC_BATCH_THREADS = 4;
+/** Default for -rpcslowlog, the milliseconds from which an RPC call is logged, 0 to log none */
+static const int64_t DEFAULT_RPC_SLOWLOG = 0;
+/** Buckets of the per-method latency histograms of getrpcstats; bucket i counts calls under 2^i us */
+static const int RPC_LATENCY_BUCKETS = 26;
+/** Bytes of JSON a JSONStreamWriter collects before handing them on */
+static const size_t RPC_STREAM_FLUSH_SIZE = 64 * 1024;
 
 class CRPCCommand;
 
@@ -124,7 +133,42 @@ void RPCUnsetTimerInterface(RPCTimerInterface *iface);
  */
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
+/**
+ * Writes one JSON value piece by piece, for results too large to build as a
+ * UniValue first. Output is passed to the sink every RPC_STREAM_FLUSH_SIZE
+ * bytes or so; the caller deals with whatever is left at the end.
+ */
+class JSONStreamWriter
+{
+private:
+    boost::function<void(const std::string&)> sink;
+    std::string strBuffer;
+    //! Per open array or object, whether it has a member yet
+    std::vector<bool> vHasMember;
+    bool fAfterKey;
+
+    void Separate();
+    void MaybeFlush();
+
+public:
+    JSONStreamWriter(const boost::function<void(const std::string&)>& sinkIn);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    /** Start a member of the current object; write its value next */
+    void Key(const std::string& key);
+    void Value(const UniValue& val);
+
+    /** Pass what was written so far to the sink */
+    void Flush();
+    /** Take what was written since the last flush, without passing it to the sink */
+    std::string Release();
+};
+
 typedef UniValue(*rpcfn_type)(const UniValue& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const UniValue& params, JSONStreamWriter& writer);
 
 class CRPCCommand
 {
@@ -133,6 +177,10 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    //! Optional variant of actor that writes its result into a JSONStreamWriter
+    rpcstreamfn_type streamActor;
+    //! Whether it answers while the server is in warmup, e.g. to report how far startup got
+    bool okWarmup;
 };
 
 /**
@@ -156,6 +204,16 @@ public:
      */
     UniValue execute(const std::string &method, const UniValue &params) const;
 
+    /** Whether method can write its result with executeStream */
+    bool isStreamable(const std::string& method) const;
+
+    /**
+     * Execute a method, writing its result into writer as it goes.
+     * @throws an exception (UniValue) when an error happens, possibly after
+     * part of the result was written.
+     */
+    void executeStream(const std::string &method, const UniValue &params, JSONStreamWriter& writer) const;
+
     /**
     * Returns a list of registered commands
     * @returns List of registered commands.
@@ -6,11 +6,12 @@
 
 #include "reverselock.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <boost/bind.hpp>
 #include <utility>
 
-CScheduler::CScheduler() : nThreadsServicingQueue(0), stopRequested(false), stopWhenEmpty(false)
+CScheduler::CScheduler() : nThreadsServicingQueue(0), nThreadsRunningLow(0), stopRequested(false), stopWhenEmpty(false)
 {
 }
 
@@ -36,51 +37,83 @@ void CScheduler::serviceQueue()
     // when the thread is waiting or when the user's function
     // is called.
     while (!shouldStop()) {
+        bool fLow = false;
         try {
-            while (!shouldStop() && taskQueue.empty()) {
-                // Wait until there is something to do.
-                newTaskScheduled.wait(lock);
+            // Pick the most urgent of the due tasks this thread may run. A low priority
+            // one only if another thread is left for the rest.
+            boost::chrono::system_clock::time_point now = boost::chrono::system_clock::now();
+            bool fMayRunLow = nThreadsServicingQueue == 1 || nThreadsRunningLow + 1 < nThreadsServicingQueue;
+            TaskQueue::iterator itRun = taskQueue.end();
+            TaskQueue::iterator itNext = taskQueue.end();
+            for (TaskQueue::iterator it = taskQueue.begin(); it != taskQueue.end(); ++it) {
+                if (!fMayRunLow && it->second.priority == PRIORITY_LOW)
+                    continue;
+                if (it->first > now) {
+                    itNext = it;
+                    break;
+                }
+                if (itRun == taskQueue.end() || it->second.priority < itRun->second.priority)
+                    itRun = it;
             }
 
-            // Wait until either there is a new task, or until
-            // the time of the first item on the queue:
-
+            if (itRun == taskQueue.end()) {
+                // Wait until either there is a new task or one finished, or until
+                // the time of the first task this thread may run:
+                if (itNext == taskQueue.end()) {
+                    newTaskScheduled.wait(lock);
+                } else {
 // wait_until needs boost 1.50 or later; older versions have timed_wait:
 #if BOOST_VERSION < 105000
-            while (!shouldStop() && !taskQueue.empty() &&
-                   newTaskScheduled.timed_wait(lock, toPosixTime(taskQueue.begin()->first))) {
-                // Keep waiting until timeout
-            }
+                    newTaskScheduled.timed_wait(lock, toPosixTime(itNext->first));
 #else
-            // Some boost versions have a conflicting overload of wait_until that returns void.
-            // Explicitly use a template here to avoid hitting that overload.
-            while (!shouldStop() && !taskQueue.empty()) {
-                boost::chrono::system_clock::time_point timeToWaitFor = taskQueue.begin()->first;
-                if (newTaskScheduled.wait_until<>(lock, timeToWaitFor) == boost::cv_status::timeout)
-                    break; // Exit loop after timeout, it means we reached the time of the event
-            }
+                    // Some boost versions have a conflicting overload of wait_until that returns void.
+                    // Explicitly use a template here to avoid hitting that overload.
+                    newTaskScheduled.wait_until<>(lock, itNext->first);
 #endif
-            // If there are multiple threads, the queue can empty while we're waiting (another
-            // thread may service the task we were waiting on).
-            if (shouldStop() || taskQueue.empty())
+                }
                 continue;
+            }
 
-            Function f = taskQueue.begin()->second;
-            taskQueue.erase(taskQueue.begin());
+            boost::chrono::system_clock::time_point timeScheduled = itRun->first;
+            Task task = itRun->second;
+            taskQueue.erase(itRun);
+            fLow = task.priority == PRIORITY_LOW;
+            if (fLow)
+                ++nThreadsRunningLow;
 
+            boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
             {
                 // Unlock before calling f, so it can reschedule itself or another task
                 // without deadlocking:
                 reverse_lock<boost::unique_lock<boost::mutex> > rlock(lock);
-                f();
+                task.f();
+            }
+
+            if (!task.strName.empty()) {
+                CSchedulerTaskStats& stats = mapTaskStats[task.strName];
+                int64_t nMicros = boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - start).count();
+                int64_t nDelayMicros = boost::chrono::duration_cast<boost::chrono::microseconds>(now - timeScheduled).count();
+                stats.nRuns++;
+                stats.nTotalMicros += nMicros;
+                stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+                stats.nMaxDelayMicros = std::max(stats.nMaxDelayMicros, nDelayMicros);
+            }
+            if (fLow) {
+                --nThreadsRunningLow;
+                // A thread may have waited for this one to free up
+                newTaskScheduled.notify_all();
             }
         } catch (...) {
+            // The lock is held again, the task threw or the thread was interrupted
+            if (fLow)
+                --nThreadsRunningLow;
             --nThreadsServicingQueue;
+            newTaskScheduled.notify_all();
             throw;
         }
     }
     --nThreadsServicingQueue;
-    newTaskScheduled.notify_one();
+    newTaskScheduled.notify_all();
 }
 
 void CScheduler::stop(bool drain)
@@ -95,29 +128,34 @@ void CScheduler::stop(bool drain)
     newTaskScheduled.notify_all();
 }
 
-void CScheduler::schedule(CScheduler::Function f, boost::chrono::system_clock::time_point t)
+void CScheduler::schedule(CScheduler::Function f, boost::chrono::system_clock::time_point t, Priority priority, const std::string& strName)
 {
     {
         boost::unique_lock<boost::mutex> lock(newTaskMutex);
-        taskQueue.insert(std::make_pair(t, f));
+        Task task;
+        task.f = f;
+        task.priority = priority;
+        task.strName = strName;
+        taskQueue.insert(std::make_pair(t, task));
     }
-    newTaskScheduled.notify_one();
+    // Threads wait for the tasks they may run, only some of them may run this one
+    newTaskScheduled.notify_all();
 }
 
-void CScheduler::scheduleFromNow(CScheduler::Function f, int64_t deltaSeconds)
+void CScheduler::scheduleFromNow(CScheduler::Function f, int64_t deltaSeconds, Priority priority, const std::string& strName)
 {
-    schedule(f, boost::chrono::system_clock::now() + boost::chrono::seconds(deltaSeconds));
+    schedule(f, boost::chrono::system_clock::now() + boost::chrono::seconds(deltaSeconds), priority, strName);
 }
 
-static void Repeat(CScheduler* s, CScheduler::Function f, int64_t deltaSeconds)
+static void Repeat(CScheduler* s, CScheduler::Function f, int64_t deltaSeconds, CScheduler::Priority priority, const std::string& strName)
 {
     f();
-    s->scheduleFromNow(boost::bind(&Repeat, s, f, deltaSeconds), deltaSeconds);
+    s->scheduleFromNow(boost::bind(&Repeat, s, f, deltaSeconds, priority, strName), deltaSeconds, priority, strName);
 }
 
-void CScheduler::scheduleEvery(CScheduler::Function f, int64_t deltaSeconds)
+void CScheduler::scheduleEvery(CScheduler::Function f, int64_t deltaSeconds, Priority priority, const std::string& strName)
 {
-    scheduleFromNow(boost::bind(&Repeat, this, f, deltaSeconds), deltaSeconds);
+    scheduleFromNow(boost::bind(&Repeat, this, f, deltaSeconds, priority, strName), deltaSeconds, priority, strName);
 }
 
 size_t CScheduler::getQueueInfo(boost::chrono::system_clock::time_point &first,
@@ -131,3 +169,9 @@ size_t CScheduler::getQueueInfo(boost::chrono::system_clock::time_point &first,
     }
     return result;
 }
+
+std::map<std::string, CSchedulerTaskStats> CScheduler::getTaskStats() const
+{
+    boost::unique_lock<boost::mutex> lock(newTaskMutex);
+    return mapTaskStats;
+}
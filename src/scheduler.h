@@ -14,6 +14,7 @@
 #include <boost/chrono/chrono.hpp>
 #include <boost/thread.hpp>
 #include <map>
+#include <string>
 
 //
 // Simple class for background tasks that should be run
@@ -32,6 +33,22 @@
 // delete t;
 // delete s; // Must be done after thread is interrupted/joined.
 //
+// Of the tasks that are due, those of a higher priority run first. When
+// several threads service the queue, PRIORITY_LOW tasks never occupy all
+// of them, so slow maintenance can't hold up anything more urgent.
+//
+
+/** How often and how long a named task ran, see CScheduler::getTaskStats */
+struct CSchedulerTaskStats
+{
+    uint64_t nRuns;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    //! The longest a run started after its time
+    int64_t nMaxDelayMicros;
+
+    CSchedulerTaskStats() : nRuns(0), nTotalMicros(0), nMaxMicros(0), nMaxDelayMicros(0) {}
+};
 
 class CScheduler
 {
@@ -41,18 +58,25 @@ public:
 
     typedef boost::function<void(void)> Function;
 
-    // Call func at/after time t
-    void schedule(Function f, boost::chrono::system_clock::time_point t);
+    enum Priority {
+        PRIORITY_HIGH,
+        PRIORITY_NORMAL,
+        PRIORITY_LOW,
+    };
+
+    // Call func at/after time t. Tasks given a name have their runs
+    // counted and timed in getTaskStats.
+    void schedule(Function f, boost::chrono::system_clock::time_point t, Priority priority = PRIORITY_NORMAL, const std::string& strName = std::string());
 
     // Convenience method: call f once deltaSeconds from now
-    void scheduleFromNow(Function f, int64_t deltaSeconds);
+    void scheduleFromNow(Function f, int64_t deltaSeconds, Priority priority = PRIORITY_NORMAL, const std::string& strName = std::string());
 
     // Another convenience method: call f approximately
     // every deltaSeconds forever, starting deltaSeconds from now.
     // To be more precise: every time f is finished, it
     // is rescheduled to run deltaSeconds later. If you
     // need more accurate scheduling, don't use this method.
-    void scheduleEvery(Function f, int64_t deltaSeconds);
+    void scheduleEvery(Function f, int64_t deltaSeconds, Priority priority = PRIORITY_NORMAL, const std::string& strName = std::string());
 
     // To keep things as simple as possible, there is no unschedule.
 
@@ -70,11 +94,24 @@ public:
     size_t getQueueInfo(boost::chrono::system_clock::time_point &first,
                         boost::chrono::system_clock::time_point &last) const;
 
+    // Returns the run counts and times of the named tasks, by name
+    std::map<std::string, CSchedulerTaskStats> getTaskStats() const;
+
 private:
-    std::multimap<boost::chrono::system_clock::time_point, Function> taskQueue;
+    struct Task {
+        Function f;
+        Priority priority;
+        std::string strName;
+    };
+    typedef std::multimap<boost::chrono::system_clock::time_point, Task> TaskQueue;
+
+    TaskQueue taskQueue;
     boost::condition_variable newTaskScheduled;
     mutable boost::mutex newTaskMutex;
     int nThreadsServicingQueue;
+    //! Threads running a PRIORITY_LOW task
+    int nThreadsRunningLow;
+    std::map<std::string, CSchedulerTaskStats> mapTaskStats;
     bool stopRequested;
     bool stopWhenEmpty;
     bool shouldStop() { return stopRequested || (stopWhenEmpty && taskQueue.empty()); }
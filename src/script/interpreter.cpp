@@ -9,16 +9,55 @@
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
+#include "prevector.h"
 #include "pubkey.h"
 #include "script/script.h"
 #include "uint256.h"
 
+#include <boost/thread/tss.hpp>
+
 using namespace std;
 
-typedef vector<unsigned char> valtype;
+/**
+ * Stack elements are kept inline up to the largest direct push, which covers
+ * signatures, public keys, hashes and numbers, so that pushing them onto the
+ * stack does not allocate.
+ */
+typedef prevector<75, unsigned char> valtype;
 
 namespace {
 
+/**
+ * Per-thread scratch space for script evaluation. The stacks are cleared
+ * rather than freed between scripts, so their capacity is reused by the next
+ * script verified on the same thread. EvalScript and VerifyScript never
+ * re-enter themselves on one thread, so each buffer has a single user at a time.
+ */
+struct ScriptEvalArena
+{
+    vector<valtype> stack;
+    vector<valtype> stackCopy;
+    vector<valtype> witnessStack;
+    vector<valtype> altstack;
+    vector<bool> vfExec;
+    vector<unsigned char> vchPushValue;
+    vector<unsigned char> vchSig;
+    vector<unsigned char> vchPubKey;
+    vector<valtype> vPubKeys;
+};
+
+boost::thread_specific_ptr<ScriptEvalArena> scriptEvalArena;
+
+ScriptEvalArena& GetScriptEvalArena()
+{
+    ScriptEvalArena* arena = scriptEvalArena.get();
+    if (!arena) {
+        arena = new ScriptEvalArena();
+        scriptEvalArena.reset(arena);
+    }
+    return *arena;
+}
+
 inline bool set_success(ScriptError* ret)
 {
     if (ret)
@@ -63,7 +102,13 @@ static inline void popstack(vector<valtype>& stack)
     stack.pop_back();
 }
 
-bool static IsCompressedOrUncompressedPubKey(const valtype &vchPubKey) {
+static inline void pushnum(vector<valtype>& stack, const CScriptNum& bn)
+{
+    stack.push_back(valtype());
+    bn.getvch(stack.back());
+}
+
+bool static IsCompressedOrUncompressedPubKey(const vector<unsigned char> &vchPubKey) {
     if (vchPubKey.size() < 33) {
         //  Non-canonical public key: too short
         return false;
@@ -85,7 +130,7 @@ bool static IsCompressedOrUncompressedPubKey(const valtype &vchPubKey) {
     return true;
 }
 
-bool static IsCompressedPubKey(const valtype &vchPubKey) {
+bool static IsCompressedPubKey(const vector<unsigned char> &vchPubKey) {
     if (vchPubKey.size() != 33) {
         //  Non-canonical public key: invalid length for compressed key
         return false;
@@ -172,7 +217,7 @@ bool static IsValidSignatureEncoding(const std::vector<unsigned char> &sig) {
     return true;
 }
 
-bool static IsLowDERSignature(const valtype &vchSig, ScriptError* serror) {
+bool static IsLowDERSignature(const vector<unsigned char> &vchSig, ScriptError* serror) {
     if (!IsValidSignatureEncoding(vchSig)) {
         return set_error(serror, SCRIPT_ERR_SIG_DER);
     }
@@ -183,7 +228,7 @@ bool static IsLowDERSignature(const valtype &vchSig, ScriptError* serror) {
     return true;
 }
 
-bool static IsDefinedHashtypeSignature(const valtype &vchSig) {
+bool static IsDefinedHashtypeSignature(const vector<unsigned char> &vchSig) {
     if (vchSig.size() == 0) {
         return false;
     }
@@ -211,7 +256,7 @@ bool CheckSignatureEncoding(const vector<unsigned char> &vchSig, unsigned int fl
     return true;
 }
 
-bool static CheckPubKeyEncoding(const valtype &vchPubKey, unsigned int flags, const SigVersion &sigversion, ScriptError* serror) {
+bool static CheckPubKeyEncoding(const vector<unsigned char> &vchPubKey, unsigned int flags, const SigVersion &sigversion, ScriptError* serror) {
     if ((flags & SCRIPT_VERIFY_STRICTENC) != 0 && !IsCompressedOrUncompressedPubKey(vchPubKey)) {
         return set_error(serror, SCRIPT_ERR_PUBKEYTYPE);
     }
@@ -222,7 +267,7 @@ bool static CheckPubKeyEncoding(const valtype &vchPubKey, unsigned int flags, co
     return true;
 }
 
-bool static CheckMinimalPush(const valtype& data, opcodetype opcode) {
+bool static CheckMinimalPush(const vector<unsigned char>& data, opcodetype opcode) {
     if (data.size() == 0) {
         // Could have used OP_0.
         return opcode == OP_0;
@@ -245,23 +290,26 @@ bool static CheckMinimalPush(const valtype& data, opcodetype opcode) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+static bool EvalScript(vector<valtype>& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
 {
     static const CScriptNum bnZero(0);
     static const CScriptNum bnOne(1);
     static const CScriptNum bnFalse(0);
     static const CScriptNum bnTrue(1);
-    static const valtype vchFalse(0);
-    static const valtype vchZero(0);
-    static const valtype vchTrue(1, 1);
+    static const valtype vchFalse;
+    static const valtype vchZero;
+    static const valtype vchTrue(1, (unsigned char)1);
 
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
-    valtype vchPushValue;
-    vector<bool> vfExec;
-    vector<valtype> altstack;
+    ScriptEvalArena& arena = GetScriptEvalArena();
+    vector<unsigned char>& vchPushValue = arena.vchPushValue;
+    vector<bool>& vfExec = arena.vfExec;
+    vector<valtype>& altstack = arena.altstack;
+    vfExec.clear();
+    altstack.clear();
     set_error(serror, SCRIPT_ERR_UNKNOWN_ERROR);
     if (script.size() > MAX_SCRIPT_SIZE)
         return set_error(serror, SCRIPT_ERR_SCRIPT_SIZE);
@@ -307,7 +355,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 if (fRequireMinimal && !CheckMinimalPush(vchPushValue, opcode)) {
                     return set_error(serror, SCRIPT_ERR_MINIMALDATA);
                 }
-                stack.push_back(vchPushValue);
+                stack.push_back(valtype(vchPushValue.begin(), vchPushValue.end()));
             } else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -334,7 +382,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 {
                     // ( -- value)
                     CScriptNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                     // The result of these opcodes should always be the minimal way to push the data
                     // they push, so no need for a CheckMinimalPush here.
                 }
@@ -603,7 +651,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 {
                     // -- stacksize
                     CScriptNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -701,7 +749,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     if (stack.size() < 1)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
                     CScriptNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -763,7 +811,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -812,7 +860,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -854,17 +902,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     if (stack.size() < 1)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
                     valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    valtype vchHash;
+                    vchHash.resize((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
                     if (opcode == OP_RIPEMD160)
-                        CRIPEMD160().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CRIPEMD160().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_SHA1)
-                        CSHA1().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CSHA1().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_SHA256)
-                        CSHA256().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CSHA256().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_HASH160)
-                        CHash160().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CHash160().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_HASH256)
-                        CHash256().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CHash256().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     popstack(stack);
                     stack.push_back(vchHash);
                 }
@@ -884,8 +933,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     if (stack.size() < 2)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    // The checker takes byte vectors; copy into the arena's so no allocation is needed
+                    vector<unsigned char>& vchSig = arena.vchSig;
+                    vector<unsigned char>& vchPubKey = arena.vchPubKey;
+                    vchSig.assign(stacktop(-2).begin(), stacktop(-2).end());
+                    vchPubKey.assign(stacktop(-1).begin(), stacktop(-1).end());
 
                     // Subset of script starting at the most recent codeseparator
                     CScript scriptCode(pbegincodehash, pend);
@@ -954,17 +1006,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     // Drop the signature in pre-segwit scripts but not segwit scripts
                     for (int k = 0; k < nSigsCount; k++)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
                         if (sigversion == SIGVERSION_BASE) {
-                            scriptCode.FindAndDelete(CScript(vchSig));
+                            arena.vchSig.assign(stacktop(-isig-k).begin(), stacktop(-isig-k).end());
+                            scriptCode.FindAndDelete(CScript(arena.vchSig));
                         }
                     }
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        vector<unsigned char>& vchSig = arena.vchSig;
+                        vector<unsigned char>& vchPubKey = arena.vchPubKey;
+                        vchSig.assign(stacktop(-isig).begin(), stacktop(-isig).end());
+                        vchPubKey.assign(stacktop(-ikey).begin(), stacktop(-ikey).end());
 
                         // Note how this makes the exact order of pubkey/signature evaluation
                         // distinguishable by CHECKMULTISIG NOT if the STRICTENC flag is set.
@@ -1045,6 +1099,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
     return set_success(serror);
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+{
+    vector<valtype> evalStack;
+    evalStack.reserve(stack.size());
+    for (unsigned int i = 0; i < stack.size(); i++)
+        evalStack.push_back(valtype(stack[i].begin(), stack[i].end()));
+    bool fResult = EvalScript(evalStack, script, flags, checker, sigversion, serror);
+    stack.clear();
+    for (unsigned int i = 0; i < evalStack.size(); i++)
+        stack.push_back(vector<unsigned char>(evalStack[i].begin(), evalStack[i].end()));
+    return fResult;
+}
+
 namespace {
 
 /**
@@ -1142,6 +1209,71 @@ public:
     }
 };
 
+/** Appends what is serialized to a byte vector */
+class CByteVectorWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+
+public:
+    CByteVectorWriter(std::vector<unsigned char>& vchIn) : vch(vchIn) {}
+
+    CByteVectorWriter& write(const char* pch, size_t nSize)
+    {
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + nSize);
+        return *this;
+    }
+};
+
+/** Like CHashWriter, but continuing from a SHA256 midstate */
+class CMidstateHashWriter
+{
+private:
+    CSHA256 ctx;
+
+public:
+    CMidstateHashWriter(const CSHA256& midstate) : ctx(midstate) {}
+
+    CMidstateHashWriter& write(const char* pch, size_t nSize)
+    {
+        ctx.Write((const unsigned char*)pch, nSize);
+        return *this;
+    }
+
+    uint256 GetHash()
+    {
+        uint256 result;
+        ctx.Finalize(result.begin());
+        CSHA256().Write(result.begin(), CSHA256::OUTPUT_SIZE).Finalize(result.begin());
+        return result;
+    }
+};
+
+//! Number of inputs between the midstates of PrecomputedTransactionData
+const size_t LEGACY_MIDSTATE_INTERVAL = 8;
+//! Size of an input with a blanked script: prevout, empty script, nSequence
+const size_t BLANKED_INPUT_SIZE = 36 + 1 + 4;
+
+/** SignatureHash for SIGHASH_ALL without SIGHASH_ANYONECANPAY, from the blanked serialization */
+uint256 LegacySignatureHashAll(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData& cache)
+{
+    const char* pch = (const char*)&cache.vLegacyBlanked[0];
+    size_t nMid = nIn / LEGACY_MIDSTATE_INTERVAL;
+    size_t nMidPos = cache.nLegacyInputsPos + nMid * LEGACY_MIDSTATE_INTERVAL * BLANKED_INPUT_SIZE;
+    size_t nPos = cache.nLegacyInputsPos + nIn * BLANKED_INPUT_SIZE;
+    size_t nEnd = nPos + BLANKED_INPUT_SIZE;
+
+    CMidstateHashWriter ss(cache.vLegacyMidstates[nMid]);
+    ss.write(pch + nMidPos, nPos - nMidPos);
+    // The input being signed, with scriptCode instead of the empty script
+    ss.write(pch + nPos, 36);
+    CTransactionSignatureSerializer(txTo, scriptCode, nIn, nHashType).SerializeScriptCode(ss, SER_GETHASH, 0);
+    ss.write(pch + nEnd - 4, 4);
+    ss.write(pch + nEnd, cache.vLegacyBlanked.size() - nEnd);
+    ::Serialize(ss, nHashType, SER_GETHASH, 0);
+    return ss.GetHash();
+}
+
 uint256 GetPrevoutHash(const CTransaction& txTo) {
     CHashWriter ss(SER_GETHASH, 0);
     for (unsigned int n = 0; n < txTo.vin.size(); n++) {
@@ -1173,6 +1305,25 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
     hashPrevouts = GetPrevoutHash(txTo);
     hashSequence = GetSequenceHash(txTo);
     hashOutputs = GetOutputsHash(txTo);
+
+    nLegacyInputsPos = 0;
+    if (txTo.vin.size() > 1) {
+        // An input index past the end blanks the scripts of all inputs
+        CScript scriptEmpty;
+        CByteVectorWriter writer(vLegacyBlanked);
+        CTransactionSignatureSerializer(txTo, scriptEmpty, txTo.vin.size(), SIGHASH_ALL).Serialize(writer, SER_GETHASH, 0);
+        nLegacyInputsPos = sizeof(txTo.nVersion) + GetSizeOfCompactSize(txTo.vin.size());
+        assert(vLegacyBlanked.size() >= nLegacyInputsPos + txTo.vin.size() * BLANKED_INPUT_SIZE);
+
+        CSHA256 ctx;
+        size_t nHashed = 0;
+        for (size_t n = 0; n < txTo.vin.size(); n += LEGACY_MIDSTATE_INTERVAL) {
+            size_t nPos = nLegacyInputsPos + n * BLANKED_INPUT_SIZE;
+            ctx.Write(&vLegacyBlanked[nHashed], nPos - nHashed);
+            nHashed = nPos;
+            vLegacyMidstates.push_back(ctx);
+        }
+    }
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1236,6 +1387,11 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    if (cache && !cache->vLegacyBlanked.empty() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        return LegacySignatureHashAll(scriptCode, txTo, nIn, nHashType, *cache);
+    }
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
@@ -1353,9 +1509,198 @@ bool TransactionSignatureChecker::CheckSequence(const CScriptNum& nSequence) con
     return true;
 }
 
-static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion, const std::vector<unsigned char>& program, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+namespace {
+
+/**
+ * Read the next opcode of a push-only script into vchRet, applying the checks
+ * EvalScript applies to pushes. Returns false on anything else, in which case
+ * the script is left to the interpreter.
+ */
+bool GetPush(const CScript& script, CScript::const_iterator& pc, unsigned int flags, vector<unsigned char>& vchRet)
+{
+    opcodetype opcode;
+    if (!script.GetOp(pc, opcode, vchRet) || opcode > OP_PUSHDATA4)
+        return false;
+    if (vchRet.size() > MAX_SCRIPT_ELEMENT_SIZE)
+        return false;
+    if ((flags & SCRIPT_VERIFY_MINIMALDATA) != 0 && !CheckMinimalPush(vchRet, opcode))
+        return false;
+    return true;
+}
+
+/**
+ * Run DUP HASH160 <hash> EQUALVERIFY CHECKSIG on a stack of exactly
+ * [vchSig, vchPubKey], failing with the same errors the interpreter would.
+ * On success the interpreter would be left with a single true item.
+ */
+bool EvalPubKeyHash(const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey, const unsigned char* pHash, const CScript& scriptCode, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+{
+    uint160 hashPubKey;
+    CHash160().Write(begin_ptr(vchPubKey), vchPubKey.size()).Finalize(hashPubKey.begin());
+    if (memcmp(hashPubKey.begin(), pHash, 20))
+        return set_error(serror, SCRIPT_ERR_EQUALVERIFY);
+
+    CScript scriptCodeSig(scriptCode);
+    if (sigversion == SIGVERSION_BASE) {
+        scriptCodeSig.FindAndDelete(CScript(vchSig));
+    }
+    if (!CheckSignatureEncoding(vchSig, flags, serror) || !CheckPubKeyEncoding(vchPubKey, flags, sigversion, serror)) {
+        // serror is set
+        return false;
+    }
+    if (!checker.CheckSig(vchSig, vchPubKey, scriptCodeSig, sigversion)) {
+        if ((flags & SCRIPT_VERIFY_NULLFAIL) && vchSig.size())
+            return set_error(serror, SCRIPT_ERR_SIG_NULLFAIL);
+        return set_error(serror, SCRIPT_ERR_EVAL_FALSE);
+    }
+    return true;
+}
+
+/**
+ * Match OP_m <pubkey>... OP_n OP_CHECKMULTISIG as Solver's TX_MULTISIG
+ * template does, collecting the public keys in script order.
+ */
+bool MatchMultisig(const CScript& script, unsigned int flags, int& nRequired, vector<valtype>& vPubKeys, vector<unsigned char>& vchPushValue)
+{
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    vPubKeys.clear();
+    if (!script.GetOp(pc, opcode) || opcode < OP_1 || opcode > OP_16)
+        return false;
+    nRequired = CScript::DecodeOP_N(opcode);
+    while (pc < script.end()) {
+        CScript::const_iterator pcKey = pc;
+        if (!script.GetOp(pc, opcode, vchPushValue))
+            return false;
+        if (opcode > OP_PUSHDATA4) {
+            pc = pcKey;
+            break;
+        }
+        if (vchPushValue.size() < 33 || vchPushValue.size() > 65)
+            return false;
+        if ((flags & SCRIPT_VERIFY_MINIMALDATA) != 0 && !CheckMinimalPush(vchPushValue, opcode))
+            return false;
+        vPubKeys.push_back(valtype(vchPushValue.begin(), vchPushValue.end()));
+    }
+    if (!script.GetOp(pc, opcode) || opcode < OP_1 || opcode > OP_16)
+        return false;
+    if (CScript::DecodeOP_N(opcode) != (int)vPubKeys.size() || nRequired > (int)vPubKeys.size())
+        return false;
+    return script.GetOp(pc, opcode) && opcode == OP_CHECKMULTISIG && pc == script.end();
+}
+
+/**
+ * Run CHECKMULTISIG of a matched redeem script on the stack its scriptSig
+ * pushed (the dummy, the signatures, then the redeem script itself),
+ * mirroring the interpreter's signature walk (last key and signature first)
+ * and its failure ordering.
+ */
+bool EvalMultisig(const vector<valtype>& stack, const vector<valtype>& vPubKeys, const CScript& redeemScript, unsigned int flags, const BaseSignatureChecker& checker, ScriptEvalArena& arena, ScriptError* serror)
+{
+    const valtype& vchDummy = stack.front();
+    int nSigsCount = stack.size() - 2;
+    int nKeysCount = vPubKeys.size();
+
+    CScript scriptCode(redeemScript);
+    for (int k = nSigsCount; k >= 1; k--) {
+        arena.vchSig.assign(stack[k].begin(), stack[k].end());
+        scriptCode.FindAndDelete(CScript(arena.vchSig));
+    }
+
+    int isig = nSigsCount;
+    int ikey = nKeysCount - 1;
+    bool fSuccess = true;
+    while (fSuccess && nSigsCount > 0)
+    {
+        arena.vchSig.assign(stack[isig].begin(), stack[isig].end());
+        arena.vchPubKey.assign(vPubKeys[ikey].begin(), vPubKeys[ikey].end());
+        if (!CheckSignatureEncoding(arena.vchSig, flags, serror) || !CheckPubKeyEncoding(arena.vchPubKey, flags, SIGVERSION_BASE, serror)) {
+            // serror is set
+            return false;
+        }
+        if (checker.CheckSig(arena.vchSig, arena.vchPubKey, scriptCode, SIGVERSION_BASE)) {
+            isig--;
+            nSigsCount--;
+        }
+        ikey--;
+        nKeysCount--;
+        if (nSigsCount > nKeysCount)
+            fSuccess = false;
+    }
+
+    if (!fSuccess && (flags & SCRIPT_VERIFY_NULLFAIL)) {
+        for (unsigned int k = 1; k + 1 < stack.size(); k++) {
+            if (stack[k].size())
+                return set_error(serror, SCRIPT_ERR_SIG_NULLFAIL);
+        }
+    }
+    if ((flags & SCRIPT_VERIFY_NULLDUMMY) && vchDummy.size())
+        return set_error(serror, SCRIPT_ERR_SIG_NULLDUMMY);
+    if (!fSuccess)
+        return set_error(serror, SCRIPT_ERR_EVAL_FALSE);
+    return true;
+}
+
+/**
+ * Verify P2PKH outputs and P2SH-wrapped multisig outputs without the opcode
+ * interpreter. Returns false when the scripts do not match those templates
+ * exactly (or carry witness data the interpreter would reject), leaving them
+ * to VerifyScriptGeneric; otherwise fResult and serror are what
+ * VerifyScriptGeneric would have produced. The templates are those of Solver,
+ * matched by their bytes here since Solver is policy code.
+ */
+bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness& witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror, bool& fResult)
 {
-    vector<vector<unsigned char> > stack;
+    if ((flags & SCRIPT_VERIFY_WITNESS) && !witness.IsNull())
+        return false;
+
+    ScriptEvalArena& arena = GetScriptEvalArena();
+    CScript::const_iterator pc = scriptSig.begin();
+    if (scriptPubKey.IsPayToPublicKeyHash()) {
+        if (!GetPush(scriptSig, pc, flags, arena.vchSig) || !GetPush(scriptSig, pc, flags, arena.vchPubKey) || pc != scriptSig.end())
+            return false;
+        fResult = EvalPubKeyHash(arena.vchSig, arena.vchPubKey, &scriptPubKey[3], scriptPubKey, flags, checker, SIGVERSION_BASE, serror);
+        if (fResult)
+            set_success(serror);
+        return true;
+    }
+
+    if ((flags & SCRIPT_VERIFY_P2SH) && scriptPubKey.IsPayToScriptHash()) {
+        // No multisig redemption pushes more than the dummy, the signatures and the redeem script
+        vector<valtype>& stack = arena.stack;
+        stack.clear();
+        while (pc < scriptSig.end()) {
+            if ((int)stack.size() == MAX_PUBKEYS_PER_MULTISIG + 2 || !GetPush(scriptSig, pc, flags, arena.vchPushValue))
+                return false;
+            stack.push_back(valtype(arena.vchPushValue.begin(), arena.vchPushValue.end()));
+        }
+        if (stack.size() < 2)
+            return false;
+        const valtype& vchRedeemScript = stack.back();
+        uint160 hashRedeemScript;
+        CHash160().Write(vchRedeemScript.data(), vchRedeemScript.size()).Finalize(hashRedeemScript.begin());
+        if (memcmp(hashRedeemScript.begin(), &scriptPubKey[2], 20))
+            return false;
+
+        CScript redeemScript(vchRedeemScript.data(), vchRedeemScript.data() + vchRedeemScript.size());
+        int nRequired;
+        if (!MatchMultisig(redeemScript, flags, nRequired, arena.vPubKeys, arena.vchPushValue) || (int)stack.size() != nRequired + 2)
+            return false;
+        fResult = EvalMultisig(stack, arena.vPubKeys, redeemScript, flags, checker, arena, serror);
+        if (fResult)
+            set_success(serror);
+        return true;
+    }
+
+    return false;
+}
+
+} // anon namespace
+
+static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion, const std::vector<unsigned char>& program, unsigned int flags, const BaseSignatureChecker& checker, bool fFastPaths, ScriptError* serror)
+{
+    vector<valtype>& stack = GetScriptEvalArena().witnessStack;
+    stack.clear();
     CScript scriptPubKey;
 
     if (witversion == 0) {
@@ -1365,7 +1710,8 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
                 return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_WITNESS_EMPTY);
             }
             scriptPubKey = CScript(witness.stack.back().begin(), witness.stack.back().end());
-            stack = std::vector<std::vector<unsigned char> >(witness.stack.begin(), witness.stack.end() - 1);
+            for (unsigned int i = 0; i + 1 < witness.stack.size(); i++)
+                stack.push_back(valtype(witness.stack[i].begin(), witness.stack[i].end()));
             uint256 hashScriptPubKey;
             CSHA256().Write(&scriptPubKey[0], scriptPubKey.size()).Finalize(hashScriptPubKey.begin());
             if (memcmp(hashScriptPubKey.begin(), &program[0], 32)) {
@@ -1377,7 +1723,17 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
                 return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_MISMATCH); // 2 items in witness
             }
             scriptPubKey << OP_DUP << OP_HASH160 << program << OP_EQUALVERIFY << OP_CHECKSIG;
-            stack = witness.stack;
+            if (fFastPaths) {
+                // Disallow stack item size > MAX_SCRIPT_ELEMENT_SIZE in witness stack
+                for (unsigned int i = 0; i < witness.stack.size(); i++) {
+                    if (witness.stack[i].size() > MAX_SCRIPT_ELEMENT_SIZE)
+                        return set_error(serror, SCRIPT_ERR_PUSH_SIZE);
+                }
+                // The single CHECKSIG needs none of the generic stack machinery
+                return EvalPubKeyHash(witness.stack[0], witness.stack[1], &program[0], scriptPubKey, flags, checker, SIGVERSION_WITNESS_V0, serror);
+            }
+            for (unsigned int i = 0; i < witness.stack.size(); i++)
+                stack.push_back(valtype(witness.stack[i].begin(), witness.stack[i].end()));
         } else {
             return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_WRONG_LENGTH);
         }
@@ -1406,7 +1762,7 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
     return true;
 }
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+static bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, bool fFastPaths, ScriptError* serror)
 {
     static const CScriptWitness emptyWitness;
     if (witness == NULL) {
@@ -1414,13 +1770,21 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     }
     bool hadWitness = false;
 
+    bool fResult;
+    if (fFastPaths && VerifyStandardScript(scriptSig, scriptPubKey, *witness, flags, checker, serror, fResult))
+        return fResult;
+
     set_error(serror, SCRIPT_ERR_UNKNOWN_ERROR);
 
     if ((flags & SCRIPT_VERIFY_SIGPUSHONLY) != 0 && !scriptSig.IsPushOnly()) {
         return set_error(serror, SCRIPT_ERR_SIG_PUSHONLY);
     }
 
-    vector<vector<unsigned char> > stack, stackCopy;
+    ScriptEvalArena& arena = GetScriptEvalArena();
+    vector<valtype>& stack = arena.stack;
+    vector<valtype>& stackCopy = arena.stackCopy;
+    stack.clear();
+    stackCopy.clear();
     if (!EvalScript(stack, scriptSig, flags, checker, SIGVERSION_BASE, serror))
         // serror is set
         return false;
@@ -1444,7 +1808,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                 // The scriptSig must be _exactly_ CScript(), otherwise we reintroduce malleability.
                 return set_error(serror, SCRIPT_ERR_WITNESS_MALLEATED);
             }
-            if (!VerifyWitnessProgram(*witness, witnessversion, witnessprogram, flags, checker, serror)) {
+            if (!VerifyWitnessProgram(*witness, witnessversion, witnessprogram, flags, checker, fFastPaths, serror)) {
                 return false;
             }
             // Bypass the cleanstack check at the end. The actual stack is obviously not clean
@@ -1469,7 +1833,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         assert(!stack.empty());
 
         const valtype& pubKeySerialized = stack.back();
-        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        CScript pubKey2(pubKeySerialized.data(), pubKeySerialized.data() + pubKeySerialized.size());
         popstack(stack);
 
         if (!EvalScript(stack, pubKey2, flags, checker, SIGVERSION_BASE, serror))
@@ -1489,7 +1853,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                     // reintroduce malleability.
                     return set_error(serror, SCRIPT_ERR_WITNESS_MALLEATED_P2SH);
                 }
-                if (!VerifyWitnessProgram(*witness, witnessversion, witnessprogram, flags, checker, serror)) {
+                if (!VerifyWitnessProgram(*witness, witnessversion, witnessprogram, flags, checker, fFastPaths, serror)) {
                     return false;
                 }
                 // Bypass the cleanstack check at the end. The actual stack is obviously not clean
@@ -1525,6 +1889,16 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return set_success(serror);
 }
 
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+{
+    return VerifyScript(scriptSig, scriptPubKey, witness, flags, checker, true, serror);
+}
+
+bool VerifyScriptGeneric(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+{
+    return VerifyScript(scriptSig, scriptPubKey, witness, flags, checker, false, serror);
+}
+
 size_t static WitnessSigOps(int witversion, const std::vector<unsigned char>& witprogram, const CScriptWitness& witness, int flags)
 {
     if (witversion == 0) {
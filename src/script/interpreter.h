@@ -7,6 +7,7 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "crypto/sha256.h"
 #include "primitives/transaction.h"
 
 #include <vector>
@@ -110,10 +111,25 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
+/**
+ * Parts of the signature hashes of a transaction that are the same for all of its
+ * inputs, computed once and shared by the checks of every input.
+ */
 struct PrecomputedTransactionData
 {
+    //! BIP143 hashes
     uint256 hashPrevouts, hashSequence, hashOutputs;
 
+    /**
+     * For legacy SIGHASH_ALL signatures of transactions with several inputs: the
+     * transaction serialized with every input's script blanked, which only differs from
+     * what is hashed in the script of the input being signed. vLegacyMidstates holds
+     * the SHA256 state after every LEGACY_MIDSTATE_INTERVAL'th input of it.
+     */
+    std::vector<unsigned char> vLegacyBlanked;
+    std::vector<CSHA256> vLegacyMidstates;
+    size_t nLegacyInputsPos;
+
     PrecomputedTransactionData(const CTransaction& tx);
 };
 
@@ -160,6 +176,7 @@ protected:
 public:
     TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn) : txTo(txToIn), nIn(nInIn), amount(amountIn), txdata(NULL) {}
     TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, const PrecomputedTransactionData& txdataIn) : txTo(txToIn), nIn(nInIn), amount(amountIn), txdata(&txdataIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, const PrecomputedTransactionData* txdataIn) : txTo(txToIn), nIn(nInIn), amount(amountIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
     bool CheckSequence(const CScriptNum& nSequence) const;
@@ -176,6 +193,8 @@ public:
 
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* error = NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror = NULL);
+/** VerifyScript without the fast paths for standard templates: every script goes through EvalScript. */
+bool VerifyScriptGeneric(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror = NULL);
 
 size_t CountWitnessSigOps(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags);
 
@@ -214,7 +214,9 @@ public:
 
     static const size_t nDefaultMaxNumSize = 4;
 
-    explicit CScriptNum(const std::vector<unsigned char>& vch, bool fRequireMinimal,
+    /** vch may be any contiguous byte container, such as the interpreter's stack elements */
+    template <typename ByteContainer>
+    explicit CScriptNum(const ByteContainer& vch, bool fRequireMinimal,
                         const size_t nMaxNumSize = nDefaultMaxNumSize)
     {
         if (vch.size() > nMaxNumSize) {
@@ -316,12 +318,27 @@ public:
         return serialize(m_value);
     }
 
+    /** Serialize into an existing byte container, reusing its storage */
+    template <typename ByteContainer>
+    void getvch(ByteContainer& result) const
+    {
+        serialize(m_value, result);
+    }
+
     static std::vector<unsigned char> serialize(const int64_t& value)
     {
+        std::vector<unsigned char> result;
+        serialize(value, result);
+        return result;
+    }
+
+    template <typename ByteContainer>
+    static void serialize(const int64_t& value, ByteContainer& result)
+    {
+        result.clear();
         if(value == 0)
-            return std::vector<unsigned char>();
+            return;
 
-        std::vector<unsigned char> result;
         const bool neg = value < 0;
         uint64_t absvalue = neg ? -value : value;
 
@@ -345,12 +362,11 @@ public:
             result.push_back(neg ? 0x80 : 0);
         else if (neg)
             result.back() |= 0x80;
-
-        return result;
     }
 
 private:
-    static int64_t set_vch(const std::vector<unsigned char>& vch)
+    template <typename ByteContainer>
+    static int64_t set_vch(const ByteContainer& vch)
     {
       if (vch.empty())
           return 0;
@@ -5,29 +5,18 @@
 
 #include "sigcache.h"
 
-#include "memusage.h"
+#include "cuckoocache.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <atomic>
+
 #include <boost/thread.hpp>
-#include <boost/unordered_set.hpp>
 
 namespace {
 
-/**
- * We're hashing a nonce into the entries themselves, so we don't need extra
- * blinding in the set hash computation.
- */
-class CSignatureCacheHasher
-{
-public:
-    size_t operator()(const uint256& key) const {
-        return key.GetCheapHash();
-    }
-};
-
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
@@ -38,13 +27,16 @@ class CSignatureCache
 private:
      //! Entries are SHA256(nonce || signature hash || public key || signature):
     uint256 nonce;
-    typedef boost::unordered_set<uint256, CSignatureCacheHasher> map_type;
+    typedef CuckooCache::cache<uint256, SignatureCacheHasher> map_type;
     map_type setValid;
-    boost::shared_mutex cs_sigcache;
-
+    //! Only insert needs it exclusively; lookups and their erasures share it
+    mutable boost::shared_mutex cs_sigcache;
+    std::atomic<uint64_t> nLookups;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nInserts;
 
 public:
-    CSignatureCache()
+    CSignatureCache() : nLookups(0), nHits(0), nInserts(0)
     {
         GetRandBytes(nonce.begin(), 32);
     }
@@ -56,58 +48,69 @@ public:
     }
 
     bool
-    Get(const uint256& entry)
+    Get(const uint256& entry, const bool erase)
     {
+        nLookups.fetch_add(1, std::memory_order_relaxed);
         boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-        return setValid.count(entry);
+        if (!setValid.contains(entry, erase))
+            return false;
+        nHits.fetch_add(1, std::memory_order_relaxed);
+        return true;
     }
 
-    void Erase(const uint256& entry)
+    void Set(const uint256& entry)
     {
+        nInserts.fetch_add(1, std::memory_order_relaxed);
         boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        setValid.erase(entry);
+        setValid.insert(entry);
     }
 
-    void Set(const uint256& entry)
+    uint32_t setup_bytes(size_t n)
     {
-        size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
-        {
-            map_type::size_type s = GetRand(setValid.bucket_count());
-            map_type::local_iterator it = setValid.begin(s);
-            if (it != setValid.end(s)) {
-                setValid.erase(*it);
-            }
-        }
+        return setValid.setup_bytes(n);
+    }
 
-        setValid.insert(entry);
+    CSignatureCacheStats GetStats() const
+    {
+        CSignatureCacheStats stats;
+        stats.nLookups = nLookups;
+        stats.nHits = nHits;
+        stats.nInserts = nInserts;
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        stats.nMemoryUsage = setValid.memory_usage();
+        return stats;
     }
 };
 
+// Not a local static of VerifySignature, which would check its guard on every call
+static CSignatureCache signatureCache;
 }
 
-bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+// To be called once in AppInit2/TestingSetup to initialize the signatureCache
+void InitSignatureCache()
 {
-    static CSignatureCache signatureCache;
+    // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
+    // setup_bytes creates the minimum possible cache (2 elements).
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = signatureCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for signature cache, able to store %zu elements\n",
+            (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
+}
+
+CSignatureCacheStats GetSignatureCacheStats()
+{
+    return signatureCache.GetStats();
+}
 
+bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+{
     uint256 entry;
     signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
-
-    if (signatureCache.Get(entry)) {
-        if (!store) {
-            signatureCache.Erase(entry);
-        }
+    if (signatureCache.Get(entry, !store))
         return true;
-    }
-
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
-
-    if (store) {
+    if (store)
         signatureCache.Set(entry);
-    }
     return true;
 }
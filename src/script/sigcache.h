@@ -8,14 +8,39 @@
 
 #include "script/interpreter.h"
 
+#include <cstring>
 #include <vector>
 
-// DoS prevention: limit cache size to less than 40MB (over 500000
-// entries on 64-bit systems).
+// DoS prevention: limit cache size to 40MB, split evenly between the
+// signature cache and the script execution cache (over 650000 entries
+// each). The flags kept per entry add two bits each on top of that.
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
+// Maximum sig cache size allowed
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
 
 class CPubKey;
 
+/**
+ * We're hashing a nonce into the entries themselves, so we don't need extra
+ * blinding in the set hash computation.
+ *
+ * This may exhibit platform endian dependent behavior but because these are
+ * nonced hashes (random) and this state is only ever used locally it is safe.
+ * All that matters is local consistency.
+ */
+class SignatureCacheHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select <8, "SignatureCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        std::memcpy(&u, key.begin()+4*hash_select, 4);
+        return u;
+    }
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -27,4 +52,17 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Use of the signature cache since startup */
+struct CSignatureCacheStats
+{
+    uint64_t nLookups;
+    uint64_t nHits;
+    uint64_t nInserts;
+    //! Bytes the cache table takes
+    size_t nMemoryUsage;
+};
+
+void InitSignatureCache();
+CSignatureCacheStats GetSignatureCacheStats();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
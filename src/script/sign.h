@@ -37,9 +37,11 @@ class TransactionSignatureCreator : public BaseSignatureCreator {
     int nHashType;
     CAmount amount;
     const TransactionSignatureChecker checker;
+    const PrecomputedTransactionData* txdata;
 
 public:
-    TransactionSignatureCreator(const CKeyStore* keystoreIn, const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, int nHashTypeIn=SIGHASH_ALL);
+    /** txdataIn, if given, must be computed from txToIn (or a copy differing in signatures only) */
+    TransactionSignatureCreator(const CKeyStore* keystoreIn, const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, int nHashTypeIn=SIGHASH_ALL, const PrecomputedTransactionData* txdataIn=NULL);
     const BaseSignatureChecker& Checker() const { return checker; }
     bool CreateSig(std::vector<unsigned char>& vchSig, const CKeyID& keyid, const CScript& scriptCode, SigVersion sigversion) const;
 };
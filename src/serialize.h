@@ -13,6 +13,7 @@
 #include <ios>
 #include <limits>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -574,6 +575,13 @@ template<typename K, typename Pred, typename A> unsigned int GetSerializeSize(co
 template<typename Stream, typename K, typename Pred, typename A> void Serialize(Stream& os, const std::set<K, Pred, A>& m, int nType, int nVersion);
 template<typename Stream, typename K, typename Pred, typename A> void Unserialize(Stream& is, std::set<K, Pred, A>& m, int nType, int nVersion);
 
+/**
+ * shared_ptr
+ */
+template<typename T> unsigned int GetSerializeSize(const std::shared_ptr<const T>& p, int nType, int nVersion);
+template<typename Stream, typename T> void Serialize(Stream& os, const std::shared_ptr<const T>& p, int nType, int nVersion);
+template<typename Stream, typename T> void Unserialize(Stream& is, std::shared_ptr<const T>& p, int nType, int nVersion);
+
 
 
 
@@ -911,6 +919,30 @@ void Unserialize(Stream& is, std::set<K, Pred, A>& m, int nType, int nVersion)
 
 
 
+/**
+ * shared_ptr
+ */
+template<typename T>
+unsigned int GetSerializeSize(const std::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    return GetSerializeSize(*p, nType, nVersion);
+}
+
+template<typename Stream, typename T>
+void Serialize(Stream& os, const std::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    Serialize(os, *p, nType, nVersion);
+}
+
+template<typename Stream, typename T>
+void Unserialize(Stream& is, std::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    std::shared_ptr<T> pNew = std::make_shared<T>();
+    Unserialize(is, *pNew, nType, nVersion);
+    p = pNew;
+}
+
+
 /**
  * Support for ADD_SERIALIZE_METHODS and READWRITE macro
  */
@@ -0,0 +1,292 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#define USE_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+/** Most events taken from the kernel by one Wait */
+static const int MAX_WAIT_EVENTS = 256;
+
+#ifdef WIN32
+/** Without a pipe to wake it, select() keeps polling in this interval */
+static const int SELECT_POLL_MILLIS = 50;
+#endif
+
+CSocketEvents::CSocketEvents(const std::string& strMethod) : method(METHOD_SELECT), fdPoll(-1)
+{
+    fdWake[0] = fdWake[1] = -1;
+#ifndef WIN32
+    if (pipe(fdWake) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(fdWake[i], F_SETFL, fcntl(fdWake[i], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fdWake[i], F_SETFD, FD_CLOEXEC);
+        }
+    } else {
+        LogPrintf("%s: could not create the wake pipe: %s\n", __func__, strerror(errno));
+        fdWake[0] = fdWake[1] = -1;
+    }
+#endif
+
+#if defined(USE_EPOLL)
+    if (strMethod.empty() || strMethod == "epoll") {
+        fdPoll = epoll_create1(EPOLL_CLOEXEC);
+        if (fdPoll != -1)
+            method = METHOD_EPOLL;
+        else
+            LogPrintf("%s: epoll_create1 failed, using select: %s\n", __func__, strerror(errno));
+    }
+#elif defined(USE_KQUEUE)
+    if (strMethod.empty() || strMethod == "kqueue") {
+        fdPoll = kqueue();
+        if (fdPoll != -1) {
+            fcntl(fdPoll, F_SETFD, FD_CLOEXEC);
+            method = METHOD_KQUEUE;
+        } else {
+            LogPrintf("%s: kqueue failed, using select: %s\n", __func__, strerror(errno));
+        }
+    }
+#endif
+
+    // Registered with this as its owner, which no socket has
+    if (method != METHOD_SELECT && fdWake[0] != -1)
+        Update(fdWake[0], this, 0, EVENT_RECV, true);
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifndef WIN32
+    if (fdPoll != -1)
+        close(fdPoll);
+    for (int i = 0; i < 2; i++)
+        if (fdWake[i] != -1)
+            close(fdWake[i]);
+#endif
+}
+
+const char* CSocketEvents::GetMethod() const
+{
+    switch (method) {
+    case METHOD_EPOLL: return "epoll";
+    case METHOD_KQUEUE: return "kqueue";
+    case METHOD_SELECT: break;
+    }
+    return "select";
+}
+
+bool CSocketEvents::Update(SOCKET hSocket, void* pOwner, int nEventsOld, int nEventsNew, bool fNew)
+{
+#if defined(USE_EPOLL)
+    if (method == METHOD_EPOLL) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = ((nEventsNew & EVENT_RECV) ? EPOLLIN : 0) | ((nEventsNew & EVENT_SEND) ? EPOLLOUT : 0);
+        event.data.ptr = pOwner;
+        if (fNew) {
+            if (epoll_ctl(fdPoll, EPOLL_CTL_ADD, hSocket, &event) == 0)
+                return true;
+            // Still there if the socket was replaced by a duplicate of it
+            if (errno != EEXIST)
+                return false;
+        }
+        return epoll_ctl(fdPoll, EPOLL_CTL_MOD, hSocket, &event) == 0;
+    }
+#elif defined(USE_KQUEUE)
+    if (method == METHOD_KQUEUE) {
+        // kqueue has a filter per direction, each added and deleted on its own
+        struct kevent changes[2];
+        int nChanges = 0;
+        if ((nEventsNew & EVENT_RECV) != (nEventsOld & EVENT_RECV))
+            EV_SET(&changes[nChanges++], hSocket, EVFILT_READ, (nEventsNew & EVENT_RECV) ? EV_ADD : EV_DELETE, 0, 0, pOwner);
+        if ((nEventsNew & EVENT_SEND) != (nEventsOld & EVENT_SEND))
+            EV_SET(&changes[nChanges++], hSocket, EVFILT_WRITE, (nEventsNew & EVENT_SEND) ? EV_ADD : EV_DELETE, 0, 0, pOwner);
+        return nChanges == 0 || kevent(fdPoll, changes, nChanges, NULL, 0, NULL) == 0;
+    }
+#endif
+    // select() reads mapSockets on every Wait
+    return true;
+}
+
+void CSocketEvents::Set(SOCKET hSocket, void* pOwner, int nEvents)
+{
+    std::map<SOCKET, Registration>::iterator it = mapSockets.find(hSocket);
+    // A socket registered by another owner was closed, which took it out of
+    // the epoll or kqueue set, and then reused
+    bool fNew = it == mapSockets.end() || it->second.pOwner != pOwner;
+    int nEventsOld = fNew ? 0 : it->second.nEvents;
+    if (!fNew && nEvents == nEventsOld)
+        return;
+    if (!Update(hSocket, pOwner, nEventsOld, nEvents, fNew))
+        LogPrint("net", "%s: could not wait for events %d of socket %d: %s\n", __func__, nEvents, (int)hSocket, NetworkErrorString(errno));
+    Registration& registration = mapSockets[hSocket];
+    registration.pOwner = pOwner;
+    registration.nEvents = nEvents;
+}
+
+void CSocketEvents::Remove(SOCKET hSocket, void* pOwner)
+{
+    std::map<SOCKET, Registration>::iterator it = mapSockets.find(hSocket);
+    if (it == mapSockets.end() || it->second.pOwner != pOwner)
+        return;
+#if defined(USE_EPOLL)
+    // Fails harmlessly if the socket was closed already
+    if (method == METHOD_EPOLL)
+        epoll_ctl(fdPoll, EPOLL_CTL_DEL, hSocket, NULL);
+#elif defined(USE_KQUEUE)
+    if (method == METHOD_KQUEUE)
+        Update(hSocket, pOwner, it->second.nEvents, 0, false);
+#endif
+    mapSockets.erase(it);
+}
+
+void CSocketEvents::Wake()
+{
+#ifndef WIN32
+    // A full pipe wakes the next Wait as well
+    char c = 0;
+    if (fdWake[1] != -1 && write(fdWake[1], &c, 1) < 0 && errno != EAGAIN)
+        LogPrint("net", "%s: write to the wake pipe failed: %s\n", __func__, strerror(errno));
+#endif
+}
+
+void CSocketEvents::DrainWake()
+{
+#ifndef WIN32
+    char buf[64];
+    while (read(fdWake[0], buf, sizeof(buf)) > 0) {}
+#endif
+}
+
+void CSocketEvents::Wait(int nTimeoutMillis, std::vector<std::pair<void*, int> >& vReady)
+{
+    vReady.clear();
+#if defined(USE_EPOLL)
+    if (method == METHOD_EPOLL) {
+        struct epoll_event events[MAX_WAIT_EVENTS];
+        int nEvents = epoll_wait(fdPoll, events, MAX_WAIT_EVENTS, nTimeoutMillis);
+        if (nEvents < 0) {
+            if (errno != EINTR) {
+                LogPrintf("socket epoll_wait error %s\n", strerror(errno));
+                MilliSleep(nTimeoutMillis);
+            }
+            return;
+        }
+        for (int i = 0; i < nEvents; i++) {
+            if (events[i].data.ptr == this) {
+                DrainWake();
+                continue;
+            }
+            int nReady = 0;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                nReady |= EVENT_RECV;
+            if (events[i].events & EPOLLOUT)
+                nReady |= EVENT_SEND;
+            vReady.push_back(std::make_pair((void*)events[i].data.ptr, nReady));
+        }
+        return;
+    }
+#elif defined(USE_KQUEUE)
+    if (method == METHOD_KQUEUE) {
+        struct kevent events[MAX_WAIT_EVENTS];
+        struct timespec timeout;
+        timeout.tv_sec = nTimeoutMillis / 1000;
+        timeout.tv_nsec = (nTimeoutMillis % 1000) * 1000000L;
+        int nEvents = kevent(fdPoll, NULL, 0, events, MAX_WAIT_EVENTS, &timeout);
+        if (nEvents < 0) {
+            if (errno != EINTR) {
+                LogPrintf("socket kevent error %s\n", strerror(errno));
+                MilliSleep(nTimeoutMillis);
+            }
+            return;
+        }
+        for (int i = 0; i < nEvents; i++) {
+            void* pOwner = (void*)events[i].udata;
+            if (pOwner == this) {
+                DrainWake();
+                continue;
+            }
+            if (events[i].filter == EVFILT_WRITE && !(events[i].flags & (EV_EOF | EV_ERROR)))
+                vReady.push_back(std::make_pair(pOwner, (int)EVENT_SEND));
+            else
+                vReady.push_back(std::make_pair(pOwner, (int)EVENT_RECV));
+        }
+        return;
+    }
+#endif
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+    for (std::map<SOCKET, Registration>::const_iterator it = mapSockets.begin(); it != mapSockets.end(); ++it) {
+        FD_SET(it->first, &fdsetError);
+        if (it->second.nEvents & EVENT_RECV)
+            FD_SET(it->first, &fdsetRecv);
+        if (it->second.nEvents & EVENT_SEND)
+            FD_SET(it->first, &fdsetSend);
+        hSocketMax = std::max(hSocketMax, it->first);
+        have_fds = true;
+    }
+#ifdef WIN32
+    nTimeoutMillis = std::min(nTimeoutMillis, SELECT_POLL_MILLIS);
+#else
+    if (fdWake[0] != -1) {
+        FD_SET(fdWake[0], &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, (SOCKET)fdWake[0]);
+        have_fds = true;
+    }
+#endif
+
+    struct timeval timeout;
+    timeout.tv_sec = nTimeoutMillis / 1000;
+    timeout.tv_usec = (nTimeoutMillis % 1000) * 1000;
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            // Let the sockets find out which of them failed
+            for (std::map<SOCKET, Registration>::const_iterator it = mapSockets.begin(); it != mapSockets.end(); ++it)
+                vReady.push_back(std::make_pair(it->second.pOwner, (int)EVENT_RECV));
+        }
+        MilliSleep(nTimeoutMillis);
+        return;
+    }
+#ifndef WIN32
+    if (fdWake[0] != -1 && FD_ISSET(fdWake[0], &fdsetRecv))
+        DrainWake();
+#endif
+    for (std::map<SOCKET, Registration>::const_iterator it = mapSockets.begin(); it != mapSockets.end(); ++it) {
+        int nReady = 0;
+        if (FD_ISSET(it->first, &fdsetRecv) || FD_ISSET(it->first, &fdsetError))
+            nReady |= EVENT_RECV;
+        if (FD_ISSET(it->first, &fdsetSend))
+            nReady |= EVENT_SEND;
+        if (nReady)
+            vReady.push_back(std::make_pair(it->second.pOwner, nReady));
+    }
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Waits for sockets to become readable or writable, for ThreadSocketHandler.
+ * Uses epoll on Linux and kqueue on the BSDs and OS X, so that a wait only
+ * costs in proportion to the sockets that are ready, and select() elsewhere.
+ *
+ * Sockets are registered with an owner, which is what Wait returns for them.
+ * All calls except Wake must come from one thread.
+ */
+class CSocketEvents
+{
+public:
+    enum {
+        EVENT_RECV = 1,
+        EVENT_SEND = 2,
+    };
+
+    //! strMethod is epoll, kqueue or select; empty picks the best one available
+    explicit CSocketEvents(const std::string& strMethod = "");
+    ~CSocketEvents();
+
+    //! The method in use, which is select if the one asked for is unavailable
+    const char* GetMethod() const;
+
+    /**
+     * Wait for nEvents on hSocket, replacing what it was registered with
+     * before. With no events it stays registered, and only epoll and select
+     * report its errors. A socket that was closed and reused by another owner
+     * may be registered again without unregistering it first.
+     */
+    void Set(SOCKET hSocket, void* pOwner, int nEvents);
+
+    //! Unregister hSocket, unless it was registered again by another owner since
+    void Remove(SOCKET hSocket, void* pOwner);
+
+    /**
+     * Wait up to nTimeoutMillis for registered sockets to be ready, or for
+     * Wake. Errors and hang-ups are reported as EVENT_RECV, so that the
+     * following recv() notices them.
+     */
+    void Wait(int nTimeoutMillis, std::vector<std::pair<void*, int> >& vReady);
+
+    //! Make the current or next Wait return; safe to call from any thread
+    void Wake();
+
+private:
+    enum Method {
+        METHOD_SELECT,
+        METHOD_EPOLL,
+        METHOD_KQUEUE,
+    };
+
+    struct Registration {
+        void* pOwner;
+        int nEvents;
+    };
+
+    Method method;
+    //! The epoll or kqueue descriptor
+    int fdPoll;
+    //! Wake writes to the one end, Wait reads from the other
+    int fdWake[2];
+    std::map<SOCKET, Registration> mapSockets;
+
+    bool Update(SOCKET hSocket, void* pOwner, int nEventsOld, int nEventsNew, bool fNew);
+    void DrainWake();
+
+    CSocketEvents(const CSocketEvents&);
+    CSocketEvents& operator=(const CSocketEvents&);
+};
+
+#endif // BITCOIN_SOCKETEVENTS_H
@@ -0,0 +1,438 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
+#include "httpserver.h"
+#include "main.h"
+#include "miner.h"
+#include "netbase.h"
+#include "pow.h"
+#include "sync.h"
+#include "timedata.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "validationinterface.h"
+
+#include <map>
+#include <set>
+
+#include <boost/shared_ptr.hpp>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include <univalue.h>
+
+/** Maximum length of a single Stratum request line */
+static const size_t MAX_STRATUM_LINE = 4096;
+
+/** EthereumStratum/1.0 error codes */
+enum StratumErrorCode {
+    STRATUM_OTHER = 20,
+    STRATUM_JOB_NOT_FOUND = 21,
+    STRATUM_DUPLICATE_SHARE = 22,
+    STRATUM_LOW_DIFFICULTY = 23,
+    STRATUM_UNAUTHORIZED = 24,
+    STRATUM_NOT_SUBSCRIBED = 25,
+};
+
+/** Work on top of the current tip. The Ethash header hash of this chain is
+ * the previous block hash, so transactions do not change the job; the block
+ * itself is assembled when a solution comes in, like eth_submitWork does.
+ */
+struct StratumJob {
+    std::string strId;
+    uint256 hashPrevBlock;
+    uint256 seedHash;
+    arith_uint256 target;
+};
+
+struct StratumClient {
+    uint16_t nExtraNonce;
+    bool fSubscribed;
+    bool fAuthorized;
+};
+
+static CCriticalSection cs_stratumJob;
+static StratumJob currentJob;   // guarded by cs_stratumJob
+static bool fHaveJob = false;   // guarded by cs_stratumJob
+static uint64_t nJobCounter = 0; // guarded by cs_stratumJob
+
+// Only accessed from the HTTP event loop thread
+static struct evconnlistener* stratumListener = 0;
+static std::map<struct bufferevent*, StratumClient> stratumClients;
+static std::set<uint64_t> setSubmittedNonces; ///< solutions to the current job
+static std::string strSubmittedJob;
+static uint16_t nNextExtraNonce = 0;
+
+bool ParseStratumNonce(const std::string& strHex, uint16_t nExtraNonce, uint64_t& nNonceRet)
+{
+    std::string str = strHex;
+    if (str.size() >= 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+        str = str.substr(2);
+    if (str.empty() || str.size() > 12 || !IsHex(str.size() % 2 ? "0" + str : str))
+        return false;
+    nNonceRet = ((uint64_t)nExtraNonce << 48) | strtoull(str.c_str(), NULL, 16);
+    return true;
+}
+
+double StratumDifficulty(const arith_uint256& target)
+{
+    if (target == 0)
+        return 0;
+    return (~arith_uint256(0) >> 32).getdouble() / target.getdouble();
+}
+
+static StratumJob MakeStratumJob(const CBlockIndex* pindexPrev)
+{
+    CBlockHeader header;
+    header.nTime = GetAdjustedTime();
+    header.nHeight = pindexPrev->nHeight + 1;
+
+    StratumJob job;
+    job.hashPrevBlock = pindexPrev->GetBlockHash();
+    job.seedHash = EthashAux::seedHash(header.nHeight);
+    job.target.SetCompact(GetNextWorkRequired(pindexPrev, &header, Params().GetConsensus()));
+    // Build the light cache now rather than when the first share arrives
+    EthashAux::light(job.seedHash);
+    return job;
+}
+
+static void SetStratumJob(StratumJob& job)
+{
+    LOCK(cs_stratumJob);
+    job.strId = strprintf("%x", ++nJobCounter);
+    currentJob = job;
+    fHaveJob = true;
+}
+
+static bool GetStratumJob(StratumJob& job)
+{
+    {
+        LOCK(cs_stratumJob);
+        if (fHaveJob) {
+            job = currentJob;
+            return true;
+        }
+    }
+    // No tip update since startup yet
+    const CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        pindexPrev = chainActive.Tip();
+    }
+    if (!pindexPrev)
+        return false;
+    job = MakeStratumJob(pindexPrev);
+    SetStratumJob(job);
+    return true;
+}
+
+static void StratumSend(struct bufferevent* bev, const UniValue& msg)
+{
+    std::string strMsg = msg.write() + "\n";
+    bufferevent_write(bev, strMsg.data(), strMsg.size());
+}
+
+static void StratumReply(struct bufferevent* bev, const UniValue& id, const UniValue& result, const UniValue& error)
+{
+    UniValue reply(UniValue::VOBJ);
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    StratumSend(bev, reply);
+}
+
+static UniValue StratumError(int nCode, const std::string& strMessage)
+{
+    UniValue error(UniValue::VARR);
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(NullUniValue);
+    return error;
+}
+
+static void StratumSendJob(struct bufferevent* bev, const StratumJob& job)
+{
+    UniValue difficulty(UniValue::VARR);
+    difficulty.push_back(StratumDifficulty(job.target));
+    UniValue setDifficulty(UniValue::VOBJ);
+    setDifficulty.push_back(Pair("id", NullUniValue));
+    setDifficulty.push_back(Pair("method", "mining.set_difficulty"));
+    setDifficulty.push_back(Pair("params", difficulty));
+    StratumSend(bev, setDifficulty);
+
+    UniValue params(UniValue::VARR);
+    params.push_back(job.strId);
+    params.push_back(job.seedHash.GetHex());
+    params.push_back(job.hashPrevBlock.GetHex());
+    params.push_back(true);
+    UniValue notify(UniValue::VOBJ);
+    notify.push_back(Pair("id", NullUniValue));
+    notify.push_back(Pair("method", "mining.notify"));
+    notify.push_back(Pair("params", params));
+    StratumSend(bev, notify);
+}
+
+/** Push the current job to every subscribed miner. Runs on the event loop. */
+static void StratumBroadcast()
+{
+    StratumJob job;
+    if (!stratumListener || !GetStratumJob(job))
+        return;
+    for (std::map<struct bufferevent*, StratumClient>::const_iterator it = stratumClients.begin(); it != stratumClients.end(); ++it) {
+        if (it->second.fSubscribed)
+            StratumSendJob(it->first, job);
+    }
+}
+
+/** Check a solution and hand it to validation if it meets the block target. */
+static int StratumSubmit(const std::string& strJobId, uint64_t nNonce, std::string& strError)
+{
+    StratumJob job;
+    if (!GetStratumJob(job) || job.strId != strJobId) {
+        RecordWorkSubmission(WORK_STALE);
+        strError = "Job not found";
+        return STRATUM_JOB_NOT_FOUND;
+    }
+    if (strSubmittedJob != job.strId) {
+        strSubmittedJob = job.strId;
+        setSubmittedNonces.clear();
+    }
+    if (!setSubmittedNonces.insert(nNonce).second) {
+        strError = "Duplicate share";
+        return STRATUM_DUPLICATE_SHARE;
+    }
+
+    EthashProofOfWork::Result result = EthashAux::eval(job.seedHash, job.hashPrevBlock, nNonce);
+    if (result.value.IsNull() || UintToArith256(result.value) > job.target) {
+        RecordWorkSubmission(WORK_INVALID);
+        strError = "Low difficulty share";
+        return STRATUM_LOW_DIFFICULTY;
+    }
+
+    boost::shared_ptr<CReserveScript> coinbaseScript;
+    GetMainSignals().ScriptForMining(coinbaseScript);
+    if (!coinbaseScript || coinbaseScript->reserveScript.empty()) {
+        strError = "No coinbase script available (mining requires a wallet)";
+        return STRATUM_OTHER;
+    }
+    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript));
+    if (!pblocktemplate.get()) {
+        strError = "Couldn't create new block";
+        return STRATUM_OTHER;
+    }
+    CBlock* pblock = &pblocktemplate->block;
+    if (pblock->hashPrevBlock != job.hashPrevBlock) {
+        RecordWorkSubmission(WORK_STALE);
+        strError = "Job not found";
+        return STRATUM_JOB_NOT_FOUND;
+    }
+    unsigned int nExtraNonce = 0;
+    {
+        LOCK(cs_main);
+        IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
+    }
+    pblock->mixhash = result.mixHash;
+    pblock->nNonce = nNonce;
+
+    CValidationState state;
+    if (!ProcessNewBlock(state, Params(), NULL, pblock, true, NULL, false)) {
+        strError = "Block not accepted: " + FormatStateMessage(state);
+        return STRATUM_OTHER;
+    }
+    coinbaseScript->KeepScript();
+    RecordWorkSubmission(WORK_ACCEPTED);
+    LogPrintf("Stratum: accepted block %s\n", pblock->GetHash().ToString());
+    return 0;
+}
+
+static void StratumHandleRequest(struct bufferevent* bev, StratumClient& client, const UniValue& request)
+{
+    const UniValue& id = find_value(request, "id");
+    const UniValue& method = find_value(request, "method");
+    const UniValue& params = find_value(request, "params");
+    if (!method.isStr()) {
+        StratumReply(bev, id, NullUniValue, StratumError(STRATUM_OTHER, "Missing method"));
+        return;
+    }
+
+    const std::string& strMethod = method.get_str();
+    if (strMethod == "mining.subscribe") {
+        client.fSubscribed = true;
+        UniValue subscription(UniValue::VARR);
+        subscription.push_back("mining.notify");
+        subscription.push_back(strprintf("%04x", client.nExtraNonce));
+        subscription.push_back("EthereumStratum/1.0.0");
+        UniValue result(UniValue::VARR);
+        result.push_back(subscription);
+        result.push_back(strprintf("%04x", client.nExtraNonce));
+        StratumReply(bev, id, result, NullUniValue);
+        StratumJob job;
+        if (GetStratumJob(job))
+            StratumSendJob(bev, job);
+    } else if (strMethod == "mining.extranonce.subscribe") {
+        StratumReply(bev, id, true, NullUniValue);
+    } else if (strMethod == "mining.authorize") {
+        client.fAuthorized = true;
+        StratumReply(bev, id, true, NullUniValue);
+    } else if (strMethod == "mining.submit") {
+        uint64_t nNonce;
+        std::string strError;
+        int nCode;
+        if (!client.fSubscribed) {
+            nCode = STRATUM_NOT_SUBSCRIBED;
+            strError = "Not subscribed";
+        } else if (!client.fAuthorized) {
+            nCode = STRATUM_UNAUTHORIZED;
+            strError = "Unauthorized worker";
+        } else if (!params.isArray() || params.size() < 3 || !params[1].isStr() || !params[2].isStr() ||
+                   !ParseStratumNonce(params[2].get_str(), client.nExtraNonce, nNonce)) {
+            nCode = STRATUM_OTHER;
+            strError = "Invalid parameters";
+        } else {
+            nCode = StratumSubmit(params[1].get_str(), nNonce, strError);
+        }
+        if (nCode == 0)
+            StratumReply(bev, id, true, NullUniValue);
+        else
+            StratumReply(bev, id, false, StratumError(nCode, strError));
+    } else {
+        StratumReply(bev, id, NullUniValue, StratumError(STRATUM_OTHER, "Method not found"));
+    }
+}
+
+static void StratumClose(struct bufferevent* bev)
+{
+    stratumClients.erase(bev);
+    bufferevent_free(bev);
+}
+
+static void stratum_read_cb(struct bufferevent* bev, void*)
+{
+    std::map<struct bufferevent*, StratumClient>::iterator it = stratumClients.find(bev);
+    if (it == stratumClients.end())
+        return;
+    struct evbuffer* input = bufferevent_get_input(bev);
+    size_t nLength;
+    char* line;
+    while ((line = evbuffer_readln(input, &nLength, EVBUFFER_EOL_CRLF)) != NULL) {
+        std::string strLine(line, nLength);
+        free(line);
+        if (strLine.empty())
+            continue;
+        UniValue request;
+        if (!request.read(strLine) || !request.isObject()) {
+            LogPrint("stratum", "Stratum: dropping client sending malformed request\n");
+            StratumClose(bev);
+            return;
+        }
+        StratumHandleRequest(bev, it->second, request);
+    }
+    if (evbuffer_get_length(input) > MAX_STRATUM_LINE) {
+        LogPrint("stratum", "Stratum: dropping client exceeding the maximum request size\n");
+        StratumClose(bev);
+    }
+}
+
+static void stratum_event_cb(struct bufferevent* bev, short what, void*)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        StratumClose(bev);
+}
+
+static void stratum_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr*, int, void*)
+{
+    struct bufferevent* bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return;
+    }
+    StratumClient client;
+    client.nExtraNonce = nNextExtraNonce++;
+    client.fSubscribed = false;
+    client.fAuthorized = false;
+    stratumClients[bev] = client;
+    bufferevent_setcb(bev, stratum_read_cb, NULL, stratum_event_cb, NULL);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+class CStratumNotifier : public CValidationInterface
+{
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex, const CBlock* pblock)
+    {
+        if (IsInitialBlockDownload())
+            return;
+        StratumJob job = MakeStratumJob(pindex);
+        SetStratumJob(job);
+        HTTPEvent* ev = new HTTPEvent(EventBase(), true, &StratumBroadcast);
+        ev->trigger(0);
+    }
+};
+
+static CStratumNotifier* pstratumNotifier = NULL;
+
+bool StartStratumServer()
+{
+    int nPort = GetArg("-stratumport", DEFAULT_STRATUM_PORT);
+    std::string strBind = GetArg("-stratumbind", "127.0.0.1");
+    CService addrBind;
+    if (!Lookup(strBind.c_str(), addrBind, nPort, false)) {
+        LogPrintf("Stratum: invalid -stratumbind address %s\n", strBind);
+        return false;
+    }
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len)) {
+        LogPrintf("Stratum: cannot bind to %s\n", addrBind.ToString());
+        return false;
+    }
+    stratumListener = evconnlistener_new_bind(EventBase(), stratum_accept_cb, NULL,
+        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_THREADSAFE, -1, (struct sockaddr*)&sockaddr, len);
+    if (!stratumListener) {
+        LogPrintf("Stratum: binding on %s failed\n", addrBind.ToString());
+        return false;
+    }
+    pstratumNotifier = new CStratumNotifier();
+    RegisterValidationInterface(pstratumNotifier);
+    LogPrintf("Stratum: listening on %s\n", addrBind.ToString());
+    return true;
+}
+
+/** Drop the listener and all connections; must run on the event loop. */
+static void StratumTeardown()
+{
+    if (stratumListener) {
+        evconnlistener_free(stratumListener);
+        stratumListener = 0;
+    }
+    while (!stratumClients.empty())
+        StratumClose(stratumClients.begin()->first);
+}
+
+void InterruptStratumServer()
+{
+    if (stratumListener) {
+        // The HTTP event loop only exits once nothing is listening any more
+        HTTPEvent* ev = new HTTPEvent(EventBase(), true, &StratumTeardown);
+        ev->trigger(0);
+    }
+}
+
+void StopStratumServer()
+{
+    if (pstratumNotifier) {
+        UnregisterValidationInterface(pstratumNotifier);
+        delete pstratumNotifier;
+        pstratumNotifier = NULL;
+    }
+}
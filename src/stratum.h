@@ -0,0 +1,35 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include "arith_uint256.h"
+
+#include <stdint.h>
+#include <string>
+
+static const bool DEFAULT_STRATUM_ENABLE = false;
+static const int DEFAULT_STRATUM_PORT = 8008;
+
+/** Start the Stratum (EthereumStratum/1.0) mining server.
+ * Precondition; the HTTP server has been initialized, its event base is shared.
+ */
+bool StartStratumServer();
+/** Stop accepting and drop all Stratum connections. */
+void InterruptStratumServer();
+/** Stop the Stratum server.
+ * Precondition; InterruptStratumServer has been called.
+ */
+void StopStratumServer();
+
+/** Combine a session's extranonce with the hex nonce part sent by a miner.
+ * The extranonce takes the upper 16 bits, the miner supplies the lower 48.
+ */
+bool ParseStratumNonce(const std::string& strHex, uint16_t nExtraNonce, uint64_t& nNonceRet);
+
+/** Share difficulty of a target in EthereumStratum terms (1 = 2^32 hashes). */
+double StratumDifficulty(const arith_uint256& target);
+
+#endif // BITCOIN_STRATUM_H
@@ -149,6 +149,7 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -328,10 +329,19 @@ public:
     }
 
     void GetAndClear(CSerializeData &data) {
-        data.insert(data.end(), begin(), end());
+        if (data.empty() && nReadPos == 0)
+            data.swap(vch); // hand the buffer over rather than copying it
+        else
+            data.insert(data.end(), begin(), end());
         clear();
     }
 
+    //! Exchange the buffer with data, to reuse an allocation; reading starts over
+    void SwapBuffer(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
@@ -356,6 +366,66 @@ public:
     }
 };
 
+/** Reads serialized data straight from memory it does not own, such as a value LevelDB
+ * returned, instead of copying it into a CDataStream first. An XOR applied when the data
+ * was written, as by CDataStream::Xor, is undone on the bytes read. The memory, and the
+ * key, must outlive the reader.
+ */
+class CSpanReader
+{
+private:
+    const char* pbegin;
+    const char* pcur;
+    const char* pend;
+    //! NULL when the data is not XORed
+    const std::vector<unsigned char>* pkey;
+
+public:
+    const int nType;
+    const int nVersion;
+
+    CSpanReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn, const std::vector<unsigned char>* pkeyIn = NULL) :
+        pbegin(pbeginIn), pcur(pbeginIn), pend(pendIn), pkey(pkeyIn && !pkeyIn->empty() ? pkeyIn : NULL), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+    size_t size() const { return pend - pcur; }
+    bool empty() const { return pcur == pend; }
+    bool eof() const { return pcur == pend; }
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read(): end of data");
+        memcpy(pch, pcur, nSize);
+        if (pkey) {
+            const std::vector<unsigned char>& key = *pkey;
+            // The key is applied from the start of the data, as CDataStream::Xor does
+            for (size_t i = 0, j = (pcur - pbegin) % key.size(); i < nSize; i++) {
+                pch[i] ^= key[j++];
+                if (j == key.size())
+                    j = 0;
+            }
+        }
+        pcur += nSize;
+    }
+
+    void ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::ignore(): end of data");
+        pcur += nSize;
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 
 
 
@@ -582,6 +652,17 @@ public:
         return (*this);
     }
 
+    // skip a number of bytes
+    CBufferedFile& ignore(size_t nSize) {
+        char data[4096];
+        while (nSize > 0) {
+            size_t nNow = std::min<size_t>(nSize, sizeof(data));
+            read(data, nNow);
+            nSize -= nNow;
+        }
+        return (*this);
+    }
+
     // return the current reading position
     uint64_t GetPos() {
         return nReadPos;
@@ -0,0 +1,137 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
+#define BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+/**
+ * Hands out the heap storage of prevectors from large chunks, one after the other,
+ * while a PrevectorArenaScope is active on the thread. The scripts of a block being
+ * deserialized then cost a malloc call per chunk rather than one each, and lie next
+ * to each other in memory.
+ *
+ * Every block carved from a chunk holds a reference to it, and the chunk is freed
+ * along with its last block, from whichever thread frees it. Transactions are shared
+ * and may outlive the block they came with, in the mempool or a wallet: they keep
+ * their chunk alive, not the other way round. Allocating is not thread safe, an
+ * arena is only used by the thread of its scope.
+ */
+class PrevectorArena
+{
+public:
+    //! Alignment, and granularity, of the blocks
+    static const size_t ALIGN = 8;
+    //! Size of the chunks
+    static const size_t CHUNK_SIZE = 64 * 1024;
+    //! Largest block handed out, larger allocations should use the heap
+    static const size_t MAX_BLOCK_SIZE = 4 * 1024;
+
+    PrevectorArena() : pChunk(NULL) {}
+
+    ~PrevectorArena()
+    {
+        if (pChunk)
+            Release(pChunk);
+    }
+
+    /** Usable size of a block of nBytes */
+    static size_t BlockSize(size_t nBytes) { return (nBytes + ALIGN - 1) & ~(ALIGN - 1); }
+
+    /** A block of BlockSize(nBytes) bytes, or NULL if nBytes is above MAX_BLOCK_SIZE */
+    void* Allocate(size_t nBytes)
+    {
+        if (nBytes == 0 || nBytes > MAX_BLOCK_SIZE)
+            return NULL;
+        size_t nSize = sizeof(BlockHeader) + BlockSize(nBytes);
+        if (!pChunk || CHUNK_SIZE - pChunk->nUsed < nSize) {
+            if (pChunk)
+                Release(pChunk);
+            void* p = malloc(CHUNK_SIZE);
+            if (!p)
+                throw std::bad_alloc();
+            // The arena holds a reference of its own until it moves on to the next chunk
+            pChunk = new (p) Chunk();
+        }
+        BlockHeader* pBlock = reinterpret_cast<BlockHeader*>(reinterpret_cast<char*>(pChunk) + pChunk->nUsed);
+        pBlock->pChunk = pChunk;
+        pChunk->nUsed += nSize;
+        pChunk->nRefs.fetch_add(1, std::memory_order_relaxed);
+        return pBlock + 1;
+    }
+
+    /** Give back a block of any arena */
+    static void Free(void* p)
+    {
+        Release((static_cast<BlockHeader*>(p) - 1)->pChunk);
+    }
+
+    /** The arena of the PrevectorArenaScope active on the thread, if any */
+    static PrevectorArena*& Current()
+    {
+        static thread_local PrevectorArena* pCurrent = NULL;
+        return pCurrent;
+    }
+
+private:
+    PrevectorArena(const PrevectorArena&);
+    void operator=(const PrevectorArena&);
+
+    struct Chunk {
+        std::atomic<size_t> nRefs;
+        size_t nUsed;
+        Chunk() : nRefs(1), nUsed(BlockSize(sizeof(Chunk))) {}
+    };
+    struct BlockHeader {
+        Chunk* pChunk;
+    };
+    static_assert(sizeof(BlockHeader) % ALIGN == 0, "blocks must stay aligned");
+
+    //! The chunk blocks are carved from
+    Chunk* pChunk;
+
+    static void Release(Chunk* pChunkIn)
+    {
+        if (pChunkIn->nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            pChunkIn->~Chunk();
+            free(pChunkIn);
+        }
+    }
+};
+
+/**
+ * Makes the prevectors allocated by the thread take their storage from an arena
+ * until it goes out of scope. Nested scopes share the arena of the outermost one.
+ */
+class PrevectorArenaScope
+{
+public:
+    explicit PrevectorArenaScope(bool fActive = true) : fOwner(false)
+    {
+        if (!fActive || PrevectorArena::Current())
+            return;
+        PrevectorArena::Current() = &arena;
+        fOwner = true;
+    }
+
+    ~PrevectorArenaScope()
+    {
+        if (fOwner)
+            PrevectorArena::Current() = NULL;
+    }
+
+private:
+    PrevectorArenaScope(const PrevectorArenaScope&);
+    void operator=(const PrevectorArenaScope&);
+
+    PrevectorArena arena;
+    bool fOwner;
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
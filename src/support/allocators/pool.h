@@ -0,0 +1,194 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * Hands out small blocks carved from large chunks, and keeps the blocks given back
+ * on a free list per size for the next allocation of that size. The chunks are only
+ * returned to the system all at once, by Release or the destructor.
+ *
+ * Meant for node based containers, which allocate one node at a time: a node costs
+ * no malloc call nor malloc overhead, and the memory in use is exactly the chunks.
+ * Not thread safe, give every container that is used under a lock of its own its
+ * own resource.
+ */
+class PoolResource
+{
+public:
+    //! Alignment, and granularity, of the blocks
+    static const size_t ALIGN = 8;
+    //! Largest block handed out, larger allocations should use the heap
+    static const size_t MAX_BLOCK_SIZE = 256;
+    //! Size of the first chunk blocks are carved from, each next one is twice as large
+    static const size_t MIN_CHUNK_SIZE = 4 * 1024;
+    //! Size the chunks grow to
+    static const size_t MAX_CHUNK_SIZE = 256 * 1024;
+
+    PoolResource() : pFree(NULL), pFreeEnd(NULL), nLive(0), nChunkBytes(0), nNextChunkSize(MIN_CHUNK_SIZE)
+    {
+        for (size_t i = 0; i <= MAX_BLOCK_SIZE / ALIGN; i++)
+            vFreeLists[i] = NULL;
+    }
+
+    ~PoolResource()
+    {
+        FreeChunks();
+    }
+
+    void* Allocate(size_t nBytes)
+    {
+        assert(nBytes > 0 && nBytes <= MAX_BLOCK_SIZE);
+        size_t nClass = SizeClass(nBytes);
+        nLive++;
+        if (vFreeLists[nClass] != NULL) {
+            FreeBlock* pBlock = vFreeLists[nClass];
+            vFreeLists[nClass] = pBlock->pNext;
+            return pBlock;
+        }
+        size_t nSize = nClass * ALIGN;
+        if ((size_t)(pFreeEnd - pFree) < nSize) {
+            // Keep what is left of the current chunk for smaller blocks
+            if (pFreeEnd - pFree >= (ptrdiff_t)ALIGN)
+                PushFree(pFree, (pFreeEnd - pFree) / ALIGN);
+            // Short lived pools stay small, busy ones soon take few large chunks
+            vChunks.push_back(static_cast<char*>(::operator new(nNextChunkSize)));
+            pFree = vChunks.back();
+            pFreeEnd = pFree + nNextChunkSize;
+            nChunkBytes += nNextChunkSize;
+            nNextChunkSize = std::min(nNextChunkSize * 2, MAX_CHUNK_SIZE);
+        }
+        void* p = pFree;
+        pFree += nSize;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes)
+    {
+        assert(nLive > 0);
+        PushFree(p, SizeClass(nBytes));
+        nLive--;
+    }
+
+    /** Number of blocks handed out and not given back */
+    size_t GetLiveBlocks() const { return nLive; }
+
+    /** Memory the chunks take, whether their blocks are in use or not */
+    size_t DynamicMemoryUsage() const
+    {
+        return nChunkBytes + vChunks.capacity() * sizeof(char*);
+    }
+
+    /** Return all chunks to the system; only when no block is in use any more */
+    void Release()
+    {
+        assert(nLive == 0);
+        FreeChunks();
+    }
+
+private:
+    PoolResource(const PoolResource&);
+    void operator=(const PoolResource&);
+
+    struct FreeBlock {
+        FreeBlock* pNext;
+    };
+
+    std::vector<char*> vChunks;
+    //! Blocks given back, by size in units of ALIGN
+    FreeBlock* vFreeLists[MAX_BLOCK_SIZE / ALIGN + 1];
+    //! The part of the newest chunk no block was carved from yet
+    char* pFree;
+    char* pFreeEnd;
+    size_t nLive;
+    size_t nChunkBytes;
+    size_t nNextChunkSize;
+
+    static size_t SizeClass(size_t nBytes) { return (nBytes + ALIGN - 1) / ALIGN; }
+
+    void PushFree(void* p, size_t nClass)
+    {
+        FreeBlock* pBlock = static_cast<FreeBlock*>(p);
+        pBlock->pNext = vFreeLists[nClass];
+        vFreeLists[nClass] = pBlock;
+    }
+
+    void FreeChunks()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        std::vector<char*>().swap(vChunks);
+        for (size_t i = 0; i <= MAX_BLOCK_SIZE / ALIGN; i++)
+            vFreeLists[i] = NULL;
+        pFree = pFreeEnd = NULL;
+        nChunkBytes = 0;
+        nNextChunkSize = MIN_CHUNK_SIZE;
+    }
+};
+
+/**
+ * Allocator taking single objects from a PoolResource, and everything else (such as
+ * the bucket array of a hash table) from the heap. Without a resource, or for objects
+ * too large or too strictly aligned for one, it is std::allocator.
+ */
+template <typename T>
+struct pool_allocator {
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    PoolResource* resource;
+
+    pool_allocator() throw() : resource(NULL) {}
+    explicit pool_allocator(PoolResource* resourceIn) throw() : resource(resourceIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : resource(a.resource)
+    {
+    }
+    template <typename _Other>
+    struct rebind {
+        typedef pool_allocator<_Other> other;
+    };
+
+    T* allocate(size_t n)
+    {
+        if (UsePool(n))
+            return static_cast<T*>(resource->Allocate(sizeof(T)));
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (UsePool(n))
+            resource->Deallocate(p, sizeof(T));
+        else
+            std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>& a) const throw() { return resource == a.resource; }
+    template <typename U>
+    bool operator!=(const pool_allocator<U>& a) const throw() { return resource != a.resource; }
+
+private:
+    bool UsePool(size_t n) const
+    {
+        return resource != NULL && n == 1 && sizeof(T) <= PoolResource::MAX_BLOCK_SIZE && PoolResource::ALIGN % alignof(T) == 0;
+    }
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -9,9 +9,161 @@
 
 #include <stdio.h>
 
+#include <map>
+
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+thread_local const void* pLockHoldTimed = NULL;
+//! How deep the current thread holds pLockHoldTimed, since when, and for how long before
+static thread_local int nLockHoldDepth = 0;
+static thread_local int64_t nLockHoldStartMicros = 0;
+static thread_local int64_t nLockHoldMicros = 0;
+
+void LockHoldTimerAcquired()
+{
+    if (nLockHoldDepth++ == 0)
+        nLockHoldStartMicros = GetTimeMicros();
+}
+
+void LockHoldTimerReleased()
+{
+    // Held already when the timer started: not counted
+    if (nLockHoldDepth == 0)
+        return;
+    if (--nLockHoldDepth == 0)
+        nLockHoldMicros += GetTimeMicros() - nLockHoldStartMicros;
+}
+
+CLockHoldTimer::CLockHoldTimer(const void* cs) :
+    pPrevLock(pLockHoldTimed), nPrevDepth(nLockHoldDepth),
+    nPrevStartMicros(nLockHoldStartMicros), nPrevHeldMicros(nLockHoldMicros)
+{
+    pLockHoldTimed = cs;
+    nLockHoldDepth = 0;
+    nLockHoldMicros = 0;
+}
+
+CLockHoldTimer::~CLockHoldTimer()
+{
+    int64_t nHeld = GetHeldMicros();
+    const void* pLock = pLockHoldTimed;
+    pLockHoldTimed = pPrevLock;
+    nLockHoldDepth = nPrevDepth;
+    nLockHoldStartMicros = nPrevStartMicros;
+    nLockHoldMicros = nPrevHeldMicros;
+    // An enclosing timer of the same lock also counts the time held in here,
+    // unless it held the lock throughout anyway
+    if (pLockHoldTimed == pLock && nLockHoldDepth == 0)
+        nLockHoldMicros += nHeld;
+}
+
+int64_t CLockHoldTimer::GetHeldMicros() const
+{
+    int64_t nHeld = nLockHoldMicros;
+    if (nLockHoldDepth > 0)
+        nHeld += GetTimeMicros() - nLockHoldStartMicros;
+    return nHeld;
+}
+
+std::atomic<bool> fLockProfiling(DEFAULT_LOCKPROFILING);
+
+CLockProfileSite::CLockProfileSite(const char* pszNameIn, const char* pszFileIn, int nLineIn) :
+    pszName(pszNameIn), pszFile(pszFileIn), nLine(nLineIn)
+{
+    Reset();
+}
+
+void CLockProfileSite::Reset()
+{
+    nAcquired = 0;
+    nContended = 0;
+    nWaitMicros = 0;
+    nMaxWaitMicros = 0;
+    nHoldMicros = 0;
+    nMaxHoldMicros = 0;
+}
+
+// Keyed by the string literals of LOCK and TRY_LOCK, which are the same for
+// every pass through one site
+typedef std::pair<const char*, int> LockProfileKey;
+
+static boost::mutex csLockProfile;
+static std::map<LockProfileKey, CLockProfileSite> mapLockProfileSites;
+//! Sites this thread already looked up, so that it rarely needs csLockProfile
+static thread_local std::map<LockProfileKey, CLockProfileSite*> mapThreadLockProfileSites;
+
+CLockProfileSite* GetLockProfileSite(const char* pszName, const char* pszFile, int nLine)
+{
+    LockProfileKey key(pszFile, nLine);
+    std::map<LockProfileKey, CLockProfileSite*>::const_iterator it = mapThreadLockProfileSites.find(key);
+    if (it != mapThreadLockProfileSites.end())
+        return it->second;
+
+    boost::unique_lock<boost::mutex> lock(csLockProfile);
+    std::map<LockProfileKey, CLockProfileSite>::iterator mi = mapLockProfileSites.find(key);
+    if (mi == mapLockProfileSites.end())
+        mi = mapLockProfileSites.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(pszName, pszFile, nLine)).first;
+    mapThreadLockProfileSites[key] = &mi->second;
+    return &mi->second;
+}
+
+static void UpdateMax(std::atomic<int64_t>& nMax, int64_t nValue)
+{
+    int64_t nPrev = nMax.load(std::memory_order_relaxed);
+    while (nValue > nPrev && !nMax.compare_exchange_weak(nPrev, nValue, std::memory_order_relaxed)) {}
+}
+
+void LockProfileAcquired(CLockProfileSite* pSite, bool fContended, int64_t nWaitMicros)
+{
+    pSite->nAcquired.fetch_add(1, std::memory_order_relaxed);
+    if (fContended) {
+        pSite->nContended.fetch_add(1, std::memory_order_relaxed);
+        pSite->nWaitMicros.fetch_add(nWaitMicros, std::memory_order_relaxed);
+        UpdateMax(pSite->nMaxWaitMicros, nWaitMicros);
+    }
+}
+
+void LockProfileFailedTry(CLockProfileSite* pSite)
+{
+    pSite->nContended.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LockProfileReleased(CLockProfileSite* pSite, int64_t nHoldMicros)
+{
+    pSite->nHoldMicros.fetch_add(nHoldMicros, std::memory_order_relaxed);
+    UpdateMax(pSite->nMaxHoldMicros, nHoldMicros);
+}
+
+std::vector<CLockProfileStats> GetLockProfile()
+{
+    std::vector<CLockProfileStats> vStats;
+    boost::unique_lock<boost::mutex> lock(csLockProfile);
+    for (std::map<LockProfileKey, CLockProfileSite>::const_iterator it = mapLockProfileSites.begin(); it != mapLockProfileSites.end(); ++it) {
+        const CLockProfileSite& site = it->second;
+        if (site.nAcquired == 0 && site.nContended == 0)
+            continue;
+        CLockProfileStats stats;
+        stats.strName = site.pszName;
+        stats.strSite = strprintf("%s:%d", site.pszFile, site.nLine);
+        stats.nAcquired = site.nAcquired;
+        stats.nContended = site.nContended;
+        stats.nWaitMicros = site.nWaitMicros;
+        stats.nMaxWaitMicros = site.nMaxWaitMicros;
+        stats.nHoldMicros = site.nHoldMicros;
+        stats.nMaxHoldMicros = site.nMaxHoldMicros;
+        vStats.push_back(stats);
+    }
+    return vStats;
+}
+
+void ResetLockProfile()
+{
+    boost::unique_lock<boost::mutex> lock(csLockProfile);
+    for (std::map<LockProfileKey, CLockProfileSite>::iterator it = mapLockProfileSites.begin(); it != mapLockProfileSites.end(); ++it)
+        it->second.Reset();
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
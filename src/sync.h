@@ -7,6 +7,11 @@
 #define BITCOIN_SYNC_H
 
 #include "threadsafety.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
@@ -108,37 +113,147 @@ typedef boost::condition_variable CConditionVariable;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+static const bool DEFAULT_LOCKPROFILING = false;
+
+/** Whether LOCK and TRY_LOCK record how long they wait and hold, per acquisition site */
+extern std::atomic<bool> fLockProfiling;
+
+/** Where a lock is taken, and how much it waited and held there while profiling */
+struct CLockProfileSite
+{
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+
+    std::atomic<uint64_t> nAcquired;
+    //! Acquisitions that had to wait, and TRY_LOCKs that failed
+    std::atomic<uint64_t> nContended;
+    std::atomic<int64_t> nWaitMicros;
+    std::atomic<int64_t> nMaxWaitMicros;
+    std::atomic<int64_t> nHoldMicros;
+    std::atomic<int64_t> nMaxHoldMicros;
+
+    CLockProfileSite(const char* pszNameIn, const char* pszFileIn, int nLineIn);
+    void Reset();
+};
+
+/** A snapshot of one CLockProfileSite */
+struct CLockProfileStats
+{
+    std::string strName;
+    std::string strSite;
+    uint64_t nAcquired;
+    uint64_t nContended;
+    int64_t nWaitMicros;
+    int64_t nMaxWaitMicros;
+    int64_t nHoldMicros;
+    int64_t nMaxHoldMicros;
+};
+
+/** The site of a LOCK or TRY_LOCK; sites live until shutdown, so the pointer stays valid */
+CLockProfileSite* GetLockProfileSite(const char* pszName, const char* pszFile, int nLine);
+void LockProfileAcquired(CLockProfileSite* pSite, bool fContended, int64_t nWaitMicros);
+void LockProfileFailedTry(CLockProfileSite* pSite);
+void LockProfileReleased(CLockProfileSite* pSite, int64_t nHoldMicros);
+/** All sites that were acquired since the last reset */
+std::vector<CLockProfileStats> GetLockProfile();
+void ResetLockProfile();
+
+/** The lock whose hold time the current thread counts, see CLockHoldTimer */
+extern thread_local const void* pLockHoldTimed;
+void LockHoldTimerAcquired();
+void LockHoldTimerReleased();
+
+/**
+ * Counts how long the current thread holds one lock while this object lives,
+ * through LOCK and TRY_LOCK. Recursive locking counts once.
+ */
+class CLockHoldTimer
+{
+private:
+    const void* pPrevLock;
+    int nPrevDepth;
+    int64_t nPrevStartMicros;
+    int64_t nPrevHeldMicros;
+
+public:
+    CLockHoldTimer(const void* cs);
+    ~CLockHoldTimer();
+
+    int64_t GetHeldMicros() const;
+};
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class SCOPED_LOCKABLE CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    //! Set while profiling: where and since when this holds the lock
+    CLockProfileSite* pProfileSite;
+    int64_t nProfileLockedMicros;
 
-    void Enter(const char* pszName, const char* pszFile, int nLine)
+    void ProfiledEnter(const char* pszName, const char* pszFile, int nLine)
     {
-        EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        pProfileSite = GetLockProfileSite(pszName, pszFile, nLine);
+        bool fContended = !lock.try_lock();
+        int64_t nWaitMicros = 0;
+        if (fContended) {
 #ifdef DEBUG_LOCKCONTENTION
-        if (!lock.try_lock()) {
             PrintLockContention(pszName, pszFile, nLine);
 #endif
+            int64_t nWaitStart = GetTimeMicros();
             lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+            nProfileLockedMicros = GetTimeMicros();
+            nWaitMicros = nProfileLockedMicros - nWaitStart;
+        } else {
+            nProfileLockedMicros = GetTimeMicros();
         }
+        LockProfileAcquired(pProfileSite, fContended, nWaitMicros);
+    }
+
+    void Enter(const char* pszName, const char* pszFile, int nLine)
+    {
+        EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        if (fLockProfiling.load(std::memory_order_relaxed)) {
+            ProfiledEnter(pszName, pszFile, nLine);
+        } else {
+#ifdef DEBUG_LOCKCONTENTION
+            if (!lock.try_lock()) {
+                PrintLockContention(pszName, pszFile, nLine);
+#endif
+                lock.lock();
+#ifdef DEBUG_LOCKCONTENTION
+            }
 #endif
+        }
+        if (pLockHoldTimed == (void*)lock.mutex())
+            LockHoldTimerAcquired();
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()), true);
         lock.try_lock();
+        if (fLockProfiling.load(std::memory_order_relaxed)) {
+            pProfileSite = GetLockProfileSite(pszName, pszFile, nLine);
+            if (lock.owns_lock()) {
+                nProfileLockedMicros = GetTimeMicros();
+                LockProfileAcquired(pProfileSite, false, 0);
+            } else {
+                LockProfileFailedTry(pProfileSite);
+                pProfileSite = NULL;
+            }
+        }
         if (!lock.owns_lock())
             LeaveCritical();
+        else if (pLockHoldTimed == (void*)lock.mutex())
+            LockHoldTimerAcquired();
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock), pProfileSite(NULL), nProfileLockedMicros(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -146,7 +261,7 @@ public:
             Enter(pszName, pszFile, nLine);
     }
 
-    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn)
+    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn) : pProfileSite(NULL), nProfileLockedMicros(0)
     {
         if (!pmutexIn) return;
 
@@ -159,8 +274,13 @@ public:
 
     ~CMutexLock() UNLOCK_FUNCTION()
     {
-        if (lock.owns_lock())
+        if (lock.owns_lock()) {
+            if (pProfileSite)
+                LockProfileReleased(pProfileSite, GetTimeMicros() - nProfileLockedMicros);
+            if (pLockHoldTimed == (void*)lock.mutex())
+                LockHoldTimerReleased();
             LeaveCritical();
+        }
     }
 
     operator bool()
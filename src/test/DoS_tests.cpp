@@ -27,7 +27,7 @@ extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
@@ -111,7 +111,7 @@ CTransaction RandomOrphan()
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return *it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -121,6 +121,8 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    LOCK(cs_orphans);
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
@@ -183,6 +185,8 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         size_t sizeBefore = mapOrphanTransactions.size();
         EraseOrphansFor(i);
         BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        BOOST_FOREACH(const PAIRTYPE(uint256, COrphanTx)& item, mapOrphanTransactions)
+            BOOST_CHECK(item.second.fromPeer != i);
     }
 
     // Test LimitOrphanTxSize() function:
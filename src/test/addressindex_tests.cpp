@@ -0,0 +1,259 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "arith_uint256.h"
+#include "indexbuilder.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, TestingSetup)
+
+static std::vector<std::pair<CAddressIndexKey, CAmount> > BlockDeltas(const uint160& hash, int nHeight, CAmount nReceived, CAmount nSpent)
+{
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vect;
+    uint256 txid = ArithToUint256(arith_uint256(nHeight));
+    vect.push_back(std::make_pair(CAddressIndexKey(1, hash, nHeight, 1, txid, 0, false), nReceived));
+    vect.push_back(std::make_pair(CAddressIndexKey(1, hash, nHeight, 1, txid, 1, false), nReceived));
+    if (nSpent)
+        vect.push_back(std::make_pair(CAddressIndexKey(1, hash, nHeight, 2, ArithToUint256(arith_uint256(nHeight + 1000)), 0, true), -nSpent));
+    return vect;
+}
+
+BOOST_AUTO_TEST_CASE(address_balance_follows_connect_and_disconnect)
+{
+    CIndexDB db("addressindex", 1 << 20, true);
+    uint160 hash(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    CAddressBalanceValue value;
+
+    BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(hash, 10, 50, 0)));
+    BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(hash, 12, 20, 30)));
+    // Connecting an already counted block again leaves the balance alone
+    BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(hash, 12, 20, 30)));
+    BOOST_CHECK(db.ReadAddressBalance(hash, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, 110);
+    BOOST_CHECK_EQUAL(value.received, 140);
+    BOOST_CHECK_EQUAL(value.txCount, 3);
+    BOOST_CHECK_EQUAL(value.firstHeight, 10);
+    BOOST_CHECK_EQUAL(value.lastHeight, 12);
+
+    CAddressBalanceValue rebuilt;
+    BOOST_CHECK(db.RebuildAddressBalanceIndex());
+    BOOST_CHECK(db.ReadAddressBalance(hash, 1, rebuilt));
+    BOOST_CHECK_EQUAL(rebuilt.balance, value.balance);
+    BOOST_CHECK_EQUAL(rebuilt.received, value.received);
+    BOOST_CHECK_EQUAL(rebuilt.txCount, value.txCount);
+    BOOST_CHECK_EQUAL(rebuilt.firstHeight, value.firstHeight);
+    BOOST_CHECK_EQUAL(rebuilt.lastHeight, value.lastHeight);
+
+    BOOST_CHECK(db.EraseAddressIndex(BlockDeltas(hash, 12, 20, 30)));
+    BOOST_CHECK(db.ReadAddressBalance(hash, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, 100);
+    BOOST_CHECK_EQUAL(value.received, 100);
+    BOOST_CHECK_EQUAL(value.txCount, 1);
+    BOOST_CHECK_EQUAL(value.lastHeight, 10);
+
+    BOOST_CHECK(db.EraseAddressIndex(BlockDeltas(hash, 10, 50, 0)));
+    BOOST_CHECK(db.ReadAddressBalance(hash, 1, value));
+    BOOST_CHECK(value.IsNull());
+    BOOST_CHECK_EQUAL(value.balance, 0);
+}
+
+BOOST_AUTO_TEST_CASE(address_filter_skips_unknown_addresses)
+{
+    CIndexDB db("addressindex", 1 << 20, true);
+    uint160 hash1(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    uint160 hash2(ParseHex("1112131415161718191a1b1c1d1e1f2021222324"));
+    uint160 unused(ParseHex("2122232425262728292a2b2c2d2e2f3031323334"));
+    std::vector<std::pair<CAddressIndexKey, CAmount> > deltas;
+    CAddressBalanceValue balance;
+    uint32_t id;
+
+    // Built from the ids, then kept up to date as new addresses get one
+    BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(hash1, 10, 50, 0)));
+    BOOST_CHECK(db.LoadAddressFilter());
+    BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(hash2, 11, 20, 0)));
+    BOOST_CHECK(db.ReadAddressIndex(hash1, 1, deltas));
+    BOOST_CHECK_EQUAL(deltas.size(), 2U);
+    BOOST_CHECK(db.ReadAddressBalance(hash2, 1, balance));
+    BOOST_CHECK_EQUAL(balance.balance, 40);
+    BOOST_CHECK(!db.ReadAddressId(unused, 1, id));
+    BOOST_CHECK(db.ReadAddressBalance(unused, 1, balance));
+    BOOST_CHECK(balance.IsNull());
+    // The same hash under another address type is another address
+    BOOST_CHECK(!db.ReadAddressId(hash1, 2, id));
+
+    // The stored copy is used while no address got an id since, and ignored after
+    BOOST_CHECK(db.WriteAddressFilter());
+    BOOST_CHECK(db.LoadAddressFilter());
+    BOOST_CHECK(db.ReadAddressId(hash2, 1, id));
+    BOOST_CHECK(db.WriteAddressFilter());
+    BOOST_CHECK(db.LoadAddressFilter());
+    BOOST_CHECK(db.ReadAddressId(hash1, 1, id));
+    BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(unused, 12, 5, 0)));
+    BOOST_CHECK(db.LoadAddressFilter());
+    BOOST_CHECK(db.ReadAddressId(unused, 1, id));
+    BOOST_CHECK(db.ReadAddressId(hash1, 1, id));
+    BOOST_CHECK(db.ReadAddressId(hash2, 1, id));
+}
+
+BOOST_AUTO_TEST_CASE(multi_address_reads_merge_in_height_order)
+{
+    CIndexDB db("addressindex", 1 << 20, true);
+    std::vector<std::pair<uint160, int> > addresses;
+    for (int i = 0; i < 6; i++) {
+        uint160 hash(ParseHex(strprintf("%040x", i + 1)));
+        addresses.push_back(std::make_pair(hash, 1));
+        // Address i is active at heights i + 1, i + 7, i + 13, ...
+        for (int nHeight = i + 1; nHeight < 60; nHeight += 6)
+            BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(hash, nHeight, 10, 0)));
+    }
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(db.ReadAddressIndex(addresses, 0, 0, 4, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 2 * 59);
+    for (size_t i = 1; i < addressIndex.size(); i++)
+        BOOST_CHECK(addressIndex[i - 1].first.blockHeight <= addressIndex[i].first.blockHeight);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > ranged;
+    BOOST_CHECK(db.ReadAddressIndex(addresses, 10, 20, 3, ranged));
+    BOOST_CHECK_EQUAL(ranged.size(), 2 * 11);
+    BOOST_CHECK_EQUAL(ranged.front().first.blockHeight, 10);
+    BOOST_CHECK_EQUAL(ranged.back().first.blockHeight, 20);
+}
+
+BOOST_AUTO_TEST_CASE(legacy_address_index_is_compacted)
+{
+    CIndexDB db("addressindex", 1 << 20, true);
+    uint160 hash(ParseHex("a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4"));
+    std::vector<std::pair<CAddressIndexKey, CAmount> > legacy = BlockDeltas(hash, 5, 7, 3);
+    for (size_t i = 0; i < legacy.size(); i++)
+        BOOST_CHECK(db.Write(std::make_pair('a', legacy[i].first), legacy[i].second));
+
+    BOOST_CHECK(db.CompactAddressIndex());
+    BOOST_CHECK(db.RebuildAddressBalanceIndex());
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(db.ReadAddressIndex(hash, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), legacy.size());
+    for (size_t i = 0; i < addressIndex.size() && i < legacy.size(); i++) {
+        BOOST_CHECK(addressIndex[i].first.txhash == legacy[i].first.txhash);
+        BOOST_CHECK_EQUAL(addressIndex[i].first.index, legacy[i].first.index);
+        BOOST_CHECK_EQUAL(addressIndex[i].first.spending, legacy[i].first.spending);
+        BOOST_CHECK_EQUAL(addressIndex[i].second, legacy[i].second);
+    }
+    CAddressBalanceValue value;
+    BOOST_CHECK(db.ReadAddressBalance(hash, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, 11);
+    BOOST_CHECK_EQUAL(value.txCount, 2);
+
+    // New addresses get ids after the converted ones
+    uint160 other(ParseHex("0000000000000000000000000000000000000001"));
+    BOOST_CHECK(db.WriteAddressIndex(BlockDeltas(other, 6, 1, 0)));
+    uint32_t id, otherId;
+    BOOST_CHECK(db.ReadAddressId(hash, 1, id));
+    BOOST_CHECK(db.ReadAddressId(other, 1, otherId));
+    BOOST_CHECK(id != otherId);
+}
+
+BOOST_AUTO_TEST_CASE(indexes_move_out_of_the_block_tree)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    uint160 hash(ParseHex("b1b2b3b4b5b6b7b8b9babbbcbdbebfc0c1c2c3c4"));
+    std::vector<std::pair<CAddressIndexKey, CAmount> > legacy = BlockDeltas(hash, 8, 4, 0);
+    for (size_t i = 0; i < legacy.size(); i++)
+        BOOST_CHECK(blocktree.Write(std::make_pair('a', legacy[i].first), legacy[i].second));
+    CSpentIndexKey spentKey(ArithToUint256(arith_uint256(8)), 0);
+    CSpentIndexValue spentValue(ArithToUint256(arith_uint256(9)), 0, 9, 4, 1, hash);
+    BOOST_CHECK(blocktree.Write(std::make_pair('p', spentKey), spentValue));
+    BOOST_CHECK(blocktree.WriteFlag("addressindex", true));
+
+    CIndexDB addressdb("addressindex", 1 << 20, true);
+    CIndexDB spentdb("spentindex", 1 << 20, true);
+    BOOST_CHECK(addressdb.MoveFromBlockTree(blocktree));
+    BOOST_CHECK(spentdb.MoveFromBlockTree(blocktree));
+
+    BOOST_CHECK(!blocktree.Exists(std::make_pair('a', legacy[0].first)));
+    BOOST_CHECK(!blocktree.Exists(std::make_pair('p', spentKey)));
+    bool fFlag = false;
+    BOOST_CHECK(blocktree.ReadFlag("addressindex", fFlag));
+    BOOST_CHECK(fFlag);
+
+    BOOST_CHECK(addressdb.CompactAddressIndex());
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(addressdb.ReadAddressIndex(hash, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), legacy.size());
+    CSpentIndexValue value;
+    BOOST_CHECK(spentdb.ReadSpentIndex(spentKey, value));
+    BOOST_CHECK(value.txid == spentValue.txid);
+    BOOST_CHECK_EQUAL(value.satoshis, 4);
+    // Nothing is moved into the wrong database
+    BOOST_CHECK(!addressdb.ReadSpentIndex(spentKey, value));
+}
+
+BOOST_AUTO_TEST_CASE(spent_index_batch_reads)
+{
+    CIndexDB db("spentindex", 1 << 20, true);
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spent;
+    std::vector<CSpentIndexKey> keys;
+    for (int i = 0; i < 20; i++) {
+        CSpentIndexKey key(ArithToUint256(arith_uint256(i / 4 + 1)), i % 4);
+        keys.push_back(key);
+        // Only the even outputs are spent
+        if (i % 2 == 0)
+            spent.push_back(std::make_pair(key, CSpentIndexValue(ArithToUint256(arith_uint256(100 + i)), 0, i, i * 10, 1, uint160())));
+    }
+    BOOST_CHECK(db.UpdateSpentIndex(spent));
+
+    // Ask in reverse order, with one answer already known from elsewhere
+    std::reverse(keys.begin(), keys.end());
+    std::vector<CSpentIndexValue> values(keys.size());
+    values[0] = CSpentIndexValue(ArithToUint256(arith_uint256(999)), 0, -1, 0, 0, uint160());
+    BOOST_CHECK(db.ReadSpentIndex(keys, values));
+    BOOST_CHECK(values[0].txid == ArithToUint256(arith_uint256(999)));
+    for (size_t i = 1; i < keys.size(); i++) {
+        int n = 19 - i;
+        BOOST_CHECK_EQUAL(values[i].IsNull(), n % 2 == 1);
+        if (n % 2 == 0)
+            BOOST_CHECK_EQUAL(values[i].satoshis, n * 10);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(index_builds_resume_after_restart)
+{
+    CIndexBuildState state;
+    BOOST_CHECK(pblocktree->WriteIndexBuildState("addressindex", CIndexBuildState(500, 120)));
+    BOOST_CHECK(pblocktree->ReadIndexBuildState("addressindex", state));
+    BOOST_CHECK_EQUAL(state.nTargetHeight, 500);
+    BOOST_CHECK_EQUAL(state.nNextHeight, 120);
+    BOOST_CHECK(!state.IsComplete());
+
+    // The build of an index switched off again is dropped
+    BOOST_CHECK(!fAddressIndex);
+    BOOST_CHECK(LoadIndexBuilds(false));
+    BOOST_CHECK(!IsIndexBuilding("addressindex"));
+    BOOST_CHECK(!pblocktree->ReadIndexBuildState("addressindex", state));
+
+    fAddressIndex = true;
+    BOOST_CHECK(pblocktree->WriteIndexBuildState("addressindex", CIndexBuildState(500, 120)));
+    BOOST_CHECK(LoadIndexBuilds(false));
+    BOOST_CHECK(IsIndexBuilding("addressindex"));
+    BOOST_CHECK(!IsIndexBuilding("spentindex"));
+    BOOST_CHECK_EQUAL(GetIndexBuilds()["addressindex"].nNextHeight, 120);
+
+    // Reindexing writes the whole index anyway
+    BOOST_CHECK(LoadIndexBuilds(true));
+    BOOST_CHECK(!IsIndexBuilding("addressindex"));
+    BOOST_CHECK(!pblocktree->ReadIndexBuildState("addressindex", state));
+    fAddressIndex = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,10 +4,13 @@
 
 #include "util.h"
 
+#include "memusage.h"
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
 
@@ -117,4 +120,60 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pool_resource_reuses_and_releases)
+{
+    PoolResource pool;
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+
+    // Blocks given back are handed out again for the same size
+    void* p1 = pool.Allocate(40);
+    void* p2 = pool.Allocate(33);
+    BOOST_CHECK(p1 != p2);
+    BOOST_CHECK_EQUAL((size_t)p1 % PoolResource::ALIGN, 0U);
+    BOOST_CHECK_EQUAL((size_t)p2 % PoolResource::ALIGN, 0U);
+    BOOST_CHECK_EQUAL(pool.GetLiveBlocks(), 2U);
+    pool.Deallocate(p1, 40);
+    BOOST_CHECK(pool.Allocate(37) == p1);
+    pool.Deallocate(p1, 37);
+    pool.Deallocate(p2, 33);
+    BOOST_CHECK_EQUAL(pool.GetLiveBlocks(), 0U);
+
+    // Chunks grow up to their largest size, and all go back at once
+    std::vector<void*> blocks;
+    for (int i = 0; i < 10000; i++)
+        blocks.push_back(pool.Allocate(PoolResource::MAX_BLOCK_SIZE));
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage >= 10000 * PoolResource::MAX_BLOCK_SIZE);
+    BOOST_CHECK(nUsage < 10000 * PoolResource::MAX_BLOCK_SIZE + 2 * PoolResource::MAX_CHUNK_SIZE);
+    for (size_t i = 0; i < blocks.size(); i++)
+        pool.Deallocate(blocks[i], PoolResource::MAX_BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), nUsage);
+    pool.Release();
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_map)
+{
+    typedef boost::unordered_map<int, uint64_t, boost::hash<int>, std::equal_to<int>, pool_allocator<std::pair<const int, uint64_t> > > map_type;
+    PoolResource pool;
+    {
+        map_type map(0, boost::hash<int>(), std::equal_to<int>(), map_type::allocator_type(&pool));
+        for (int i = 0; i < 1000; i++)
+            map[i] = i;
+        // Nodes come from the pool, the bucket array from the heap
+        BOOST_CHECK_EQUAL(pool.GetLiveBlocks(), 1000U);
+        BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), pool.DynamicMemoryUsage() + memusage::MallocUsage(sizeof(void*) * map.bucket_count()));
+        for (int i = 0; i < 1000; i += 2)
+            map.erase(i);
+        BOOST_CHECK_EQUAL(pool.GetLiveBlocks(), 500U);
+        BOOST_CHECK_EQUAL(map[501], 501U);
+    }
+    BOOST_CHECK_EQUAL(pool.GetLiveBlocks(), 0U);
+
+    // Without a pool it is the heap
+    map_type heap;
+    heap[1] = 1;
+    BOOST_CHECK_EQUAL(pool.GetLiveBlocks(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -366,6 +366,20 @@ BOOST_AUTO_TEST_CASE( divide )
     BOOST_CHECK(R2L / MaxL == ZeroL);
     BOOST_CHECK(MaxL / R2L == 1);
     BOOST_CHECK_THROW(R2L / ZeroL, uint_error);
+
+    // Dividends and divisors of every length, quotient times divisor plus remainder
+    for (int i = 0; i < 256; i += 7) {
+        for (int j = 0; j < 256; j += 5) {
+            arith_uint256 a = R1L >> i;
+            arith_uint256 b = (R2L >> j) | OneL;
+            arith_uint256 q = a / b;
+            BOOST_CHECK(q * b <= a);
+            BOOST_CHECK(a - q * b < b);
+        }
+    }
+    arith_uint256 TmpL = R1L;
+    TmpL /= TmpL;
+    BOOST_CHECK(TmpL == OneL);
 }
 
 
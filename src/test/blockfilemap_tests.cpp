@@ -0,0 +1,127 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilemap_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockfilemap_read)
+{
+    const CChainParams& chainparams = Params();
+    const CBlockIndex* pindexGenesis = chainActive.Genesis();
+    CDiskBlockPos pos = pindexGenesis->GetBlockPos();
+    blockFileMaps.SetMaxFiles(2);
+
+    boost::shared_ptr<const CMappedBlockFile> pmap;
+    const char* pbegin;
+    unsigned int nSize;
+    bool fCompressed;
+#ifndef WIN32
+    BOOST_CHECK(blockFileMaps.GetBlock(pos, pmap, pbegin, nSize, fCompressed));
+    BOOST_CHECK_EQUAL(nSize, ::GetSerializeSize(chainparams.GenesisBlock(), SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(!fCompressed);
+#endif
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindexGenesis, chainparams.GetConsensus()));
+    BOOST_CHECK(block.GetHash() == pindexGenesis->GetBlockHash());
+
+    // A block appended after the file was mapped is found in a new mapping
+    CDiskBlockPos posAppended(pos.nFile, boost::filesystem::file_size(GetBlockPosFilename(pos, "blk")));
+    BOOST_CHECK(WriteBlockToDisk(chainparams.GenesisBlock(), posAppended, chainparams.MessageStart()));
+    BOOST_CHECK(ReadBlockFromDisk(block, posAppended, chainparams.GetConsensus(), false));
+    BOOST_CHECK(block.GetHash() == pindexGenesis->GetBlockHash());
+#ifndef WIN32
+    // The mapping handed out before stays readable
+    BOOST_CHECK(pmap && pmap->size() >= pos.nPos + nSize);
+    BOOST_CHECK(blockFileMaps.GetBlock(posAppended, pmap, pbegin, nSize, fCompressed));
+#endif
+
+    // Without mappings the blocks are read from the file
+    blockFileMaps.SetMaxFiles(0);
+    BOOST_CHECK(!blockFileMaps.GetBlock(pos, pmap, pbegin, nSize, fCompressed));
+    BOOST_CHECK(ReadBlockFromDisk(block, posAppended, chainparams.GetConsensus(), false));
+    BOOST_CHECK(block.GetHash() == pindexGenesis->GetBlockHash());
+    blockFileMaps.SetMaxFiles(DEFAULT_BLOCK_MAP_FILES);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_read_raw)
+{
+    const CChainParams& chainparams = Params();
+    const CBlockIndex* pindexGenesis = chainActive.Genesis();
+    CDataStream ssExpected(SER_DISK, CLIENT_VERSION);
+    ssExpected << chainparams.GenesisBlock();
+    std::string strExpected = ssExpected.str();
+
+    // The stored bytes are the disk serialization, from a mapping or from the file
+    for (int nMaxFiles = 0; nMaxFiles <= 2; nMaxFiles += 2) {
+        blockFileMaps.SetMaxFiles(nMaxFiles);
+        CRawBlock rawBlock;
+        BOOST_CHECK(ReadRawBlockFromDisk(rawBlock, pindexGenesis, chainparams.GetConsensus()));
+        BOOST_CHECK(std::string(rawBlock.pbegin, rawBlock.nSize) == strExpected);
+        BOOST_CHECK_EQUAL(rawBlock.vchData.empty(), nMaxFiles > 0 && rawBlock.pmap);
+    }
+
+    // Bytes that are not the block of the index entry are refused
+    CBlockIndex indexOther(*pindexGenesis);
+    CBlockHeader headerOther = chainparams.GenesisBlock().GetBlockHeader();
+    headerOther.nTime++;
+    uint256 hashOther = headerOther.GetHash();
+    indexOther.phashBlock = &hashOther;
+    indexOther.nStatus |= BLOCK_POW_VERIFIED;
+    CRawBlock rawBlock;
+    BOOST_CHECK(!ReadRawBlockFromDisk(rawBlock, &indexOther, chainparams.GetConsensus()));
+    BOOST_CHECK(!ReadRawBlockFromDisk(rawBlock, CDiskBlockPos()));
+    blockFileMaps.SetMaxFiles(DEFAULT_BLOCK_MAP_FILES);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemap_read_compressed)
+{
+    const CChainParams& chainparams = Params();
+    const CBlock& blockGenesis = chainparams.GenesisBlock();
+    CDataStream ssExpected(SER_DISK, CLIENT_VERSION);
+    ssExpected << blockGenesis;
+    std::string strExpected = ssExpected.str();
+
+    fCompressBlocks = true;
+    CDiskBlockPos pos = chainActive.Genesis()->GetBlockPos();
+    pos.nPos = boost::filesystem::file_size(GetBlockPosFilename(pos, "blk"));
+    BOOST_CHECK(WriteBlockToDisk(blockGenesis, pos, chainparams.MessageStart()));
+    fCompressBlocks = DEFAULT_COMPRESS_BLOCKS;
+
+    // Blocks and raw blocks read back as they were, from a mapping or from the file
+    for (int nMaxFiles = 0; nMaxFiles <= 2; nMaxFiles += 2) {
+        blockFileMaps.SetMaxFiles(nMaxFiles);
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, pos, chainparams.GetConsensus(), false));
+        BOOST_CHECK(block.GetHash() == blockGenesis.GetHash());
+        BOOST_CHECK(block.vtx.size() == blockGenesis.vtx.size());
+        for (size_t i = 0; i < block.vtx.size(); i++)
+            BOOST_CHECK(*block.vtx[i] == *blockGenesis.vtx[i]);
+        CRawBlock rawBlock;
+        BOOST_CHECK(ReadRawBlockFromDisk(rawBlock, pos));
+        BOOST_CHECK(std::string(rawBlock.pbegin, rawBlock.nSize) == strExpected);
+        BOOST_CHECK(!rawBlock.pmap);
+    }
+#ifndef WIN32
+    boost::shared_ptr<const CMappedBlockFile> pmap;
+    const char* pbegin;
+    unsigned int nSize;
+    bool fCompressed;
+    BOOST_CHECK(blockFileMaps.GetBlock(pos, pmap, pbegin, nSize, fCompressed));
+    BOOST_CHECK(fCompressed);
+    BOOST_CHECK(nSize < strExpected.size());
+#endif
+    blockFileMaps.SetMaxFiles(DEFAULT_BLOCK_MAP_FILES);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
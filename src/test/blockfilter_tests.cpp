@@ -0,0 +1,159 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "clientversion.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "undo.h"
+#include "uint256.h"
+#include "utilstrencodings.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    GCSFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; ++i) {
+        GCSFilter::Element element1(32);
+        element1[0] = i;
+        included.insert(element1);
+
+        GCSFilter::Element element2(32);
+        element2[1] = i;
+        excluded.insert(element2);
+    }
+
+    GCSFilter filter(GCSFilter::Params(0, 0, 10, 1 << 10), included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    for (const GCSFilter::Element& element : included) {
+        BOOST_CHECK(filter.Match(element));
+        GCSFilter::ElementSet insertedSet(excluded);
+        insertedSet.insert(element);
+        BOOST_CHECK(filter.MatchAny(insertedSet));
+    }
+
+    // Decoding gives back a filter that matches the same
+    GCSFilter decoded(filter.GetParams(), filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 100U);
+    BOOST_CHECK(decoded.GetEncoded() == filter.GetEncoded());
+    for (const GCSFilter::Element& element : included)
+        BOOST_CHECK(decoded.Match(element));
+
+    // Trailing or missing data is rejected
+    std::vector<unsigned char> vLonger(filter.GetEncoded());
+    vLonger.push_back(0);
+    BOOST_CHECK_THROW(GCSFilter(filter.GetParams(), vLonger), std::ios_base::failure);
+    std::vector<unsigned char> vShorter(filter.GetEncoded().begin(), filter.GetEncoded().end() - 2);
+    BOOST_CHECK_THROW(GCSFilter(filter.GetParams(), vShorter), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_default_constructor)
+{
+    GCSFilter filter;
+    BOOST_CHECK_EQUAL(filter.GetN(), 0U);
+    BOOST_CHECK_EQUAL(filter.GetEncoded().size(), 1U);
+    BOOST_CHECK(!filter.Match(GCSFilter::Element(32)));
+
+    GCSFilter empty(GCSFilter::Params(), GCSFilter::ElementSet{});
+    BOOST_CHECK(empty.GetEncoded() == filter.GetEncoded());
+}
+
+// The testnet genesis filter of the BIP 158 test vectors
+BOOST_AUTO_TEST_CASE(blockfilter_bip158_vector)
+{
+    GCSFilter::ElementSet elements;
+    elements.insert(ParseHex("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac"));
+    uint256 blockHash = uint256S("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943");
+
+    BlockFilter filter(BLOCK_FILTER_BASIC, blockHash, elements);
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncodedFilter()), "019dfca8");
+    BOOST_CHECK_EQUAL(filter.ComputeHeader(uint256()).GetHex(), "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    CScript included_scripts[5], excluded_scripts[3];
+
+    // First two are outputs on a single transaction
+    included_scripts[0] << std::vector<unsigned char>(0, 65) << OP_CHECKSIG;
+    included_scripts[1] << OP_DUP << OP_HASH160 << std::vector<unsigned char>(1, 20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    // Third is an output on a second transaction
+    included_scripts[2] << OP_1 << std::vector<unsigned char>(2, 33) << OP_1 << OP_CHECKMULTISIG;
+    // Last two are spent by a single transaction
+    included_scripts[3] << OP_0 << std::vector<unsigned char>(3, 32);
+    included_scripts[4] << OP_4 << OP_ADD << OP_8 << OP_EQUAL;
+
+    // OP_RETURN outputs are left out, and so are scripts the block does not hold
+    excluded_scripts[0] << OP_RETURN << std::vector<unsigned char>(4, 40);
+    excluded_scripts[1] << std::vector<unsigned char>(5, 33) << OP_CHECKSIG;
+    excluded_scripts[2] << OP_2 << OP_EQUAL;
+
+    CMutableTransaction tx_1;
+    tx_1.vout.push_back(CTxOut(100, included_scripts[0]));
+    tx_1.vout.push_back(CTxOut(200, included_scripts[1]));
+    tx_1.vout.push_back(CTxOut(0, CScript()));
+
+    CMutableTransaction tx_2;
+    tx_2.vout.push_back(CTxOut(300, included_scripts[2]));
+    tx_2.vout.push_back(CTxOut(0, excluded_scripts[0]));
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(tx_1));
+    block.vtx.push_back(MakeTransactionRef(tx_2));
+
+    CBlockUndo block_undo;
+    block_undo.vtxundo.push_back(CTxUndo());
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(400, included_scripts[3])));
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(500, included_scripts[4])));
+    // Both an output and a spent script, the filter holds it once
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(600, included_scripts[1])));
+    // Empty scripts are left out
+    block_undo.vtxundo.back().vprevout.push_back(CTxInUndo(CTxOut(700, CScript())));
+
+    GCSFilter::ElementSet elements = BasicFilterElements(block, block_undo);
+    BOOST_CHECK_EQUAL(elements.size(), 5U);
+
+    BlockFilter block_filter(BLOCK_FILTER_BASIC, block, block_undo);
+    const GCSFilter& filter = block_filter.GetFilter();
+    BOOST_CHECK_EQUAL(filter.GetN(), 5U);
+    for (const CScript& script : included_scripts)
+        BOOST_CHECK(filter.Match(GCSFilter::Element(script.begin(), script.end())));
+    for (const CScript& script : excluded_scripts)
+        BOOST_CHECK(!filter.Match(GCSFilter::Element(script.begin(), script.end())));
+
+    // Serialization round trip, as the cfilter message carries it
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << block_filter;
+    BOOST_CHECK_EQUAL(stream.size(), block_filter.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+    BlockFilter block_filter2;
+    stream >> block_filter2;
+    BOOST_CHECK_EQUAL(block_filter2.GetFilterType(), block_filter.GetFilterType());
+    BOOST_CHECK(block_filter2.GetBlockHash() == block_filter.GetBlockHash());
+    BOOST_CHECK(block_filter2.GetEncodedFilter() == block_filter.GetEncodedFilter());
+
+    // Headers chain: each commits to the filter and the header before
+    uint256 header1 = block_filter.ComputeHeader(uint256());
+    uint256 header2 = block_filter.ComputeHeader(header1);
+    BOOST_CHECK(header1 != header2);
+    BOOST_CHECK(header2 == block_filter2.ComputeHeader(header1));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_type_names)
+{
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BLOCK_FILTER_BASIC), "basic");
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BLOCK_FILTER_INVALID), "");
+
+    BlockFilterType filter_type;
+    BOOST_CHECK(BlockFilterTypeByName("basic", filter_type));
+    BOOST_CHECK_EQUAL(filter_type, BLOCK_FILTER_BASIC);
+    BOOST_CHECK(!BlockFilterTypeByName("unknown", filter_type));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,234 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockpipeline.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockpipeline_tests, TestingSetup)
+
+static CBlockUndo MakeUndo(int nOutputs)
+{
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    for (int i = 0; i < nOutputs; i++)
+        blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(i * COIN, CScript() << i), false, i + 1, 1));
+    return blockundo;
+}
+
+static void CheckUndoRecord(CBlockStoreWriter& writer, const CDiskBlockPos& posRecord, int nOutputs)
+{
+    const CChainParams& chainparams = Params();
+    uint256 hashBlock = GetRandHash();
+    CBlockUndo blockundo = MakeUndo(nOutputs);
+    CDiskBlockPos pos = posRecord;
+    BOOST_CHECK(writer.WriteUndo(pos, blockundo, hashBlock, chainparams.MessageStart()));
+    BOOST_CHECK_EQUAL(pos.nPos, posRecord.nPos + 8);
+    BOOST_CHECK(writer.Sync());
+
+    CBlockUndo blockundoRead;
+    BOOST_CHECK(UndoReadFromDisk(blockundoRead, pos, hashBlock));
+    BOOST_CHECK(blockundoRead.vtxundo.size() == 1);
+    BOOST_CHECK(blockundoRead.vtxundo[0].vprevout.size() == (size_t)nOutputs);
+    BOOST_CHECK(blockundoRead.vtxundo[0].vprevout.back().txout == MakeUndo(nOutputs).vtxundo[0].vprevout.back().txout);
+}
+
+BOOST_AUTO_TEST_CASE(blockstorewriter_undo)
+{
+    CBlockStoreWriter writer;
+    boost::thread thread(boost::bind(&CBlockStoreWriter::ThreadWrite, &writer));
+
+    // Records written in the background, each in the space reserved for it
+    CheckUndoRecord(writer, CDiskBlockPos(900, 0), 10);
+    CheckUndoRecord(writer, CDiskBlockPos(900, 4000), 100);
+
+    // Once the thread is gone the records are written right away
+    thread.interrupt();
+    thread.join();
+    CheckUndoRecord(writer, CDiskBlockPos(900, 8000), 5);
+}
+
+BOOST_AUTO_TEST_CASE(blockstorewriter_block)
+{
+    const CChainParams& chainparams = Params();
+    const CBlock& block = chainparams.GenesisBlock();
+    unsigned int nRecordSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION) + 8;
+    CBlockStoreWriter writer;
+    boost::thread thread(boost::bind(&CBlockStoreWriter::ThreadWrite, &writer));
+
+    // Two records behind each other in preallocated space, readable as soon as they are handed over
+    writer.Allocate(CDiskBlockPos(901, 0), 1 << 20, false);
+    CDiskBlockPos pos1(901, 0), pos2(901, nRecordSize);
+    BOOST_CHECK(writer.WriteBlock(pos1, block, chainparams.MessageStart()));
+    BOOST_CHECK(writer.WriteBlock(pos2, block, chainparams.MessageStart()));
+    BOOST_CHECK_EQUAL(pos2.nPos, nRecordSize + 8);
+    CBlock blockRead;
+    BOOST_CHECK(ReadBlockFromDisk(blockRead, pos2, chainparams.GetConsensus()));
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+
+    // Finalizing drops the preallocated space after them
+    writer.Commit(901, true, 2 * nRecordSize, 0);
+    BOOST_CHECK(writer.Sync());
+    FILE* file = OpenBlockFile(CDiskBlockPos(901, 0), true);
+    BOOST_CHECK(file);
+    if (file) {
+        BOOST_CHECK(fseek(file, 0, SEEK_END) == 0);
+        BOOST_CHECK_EQUAL(ftell(file), (long)(2 * nRecordSize));
+        fclose(file);
+    }
+
+    thread.interrupt();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(blockstorewriter_remove)
+{
+    const CChainParams& chainparams = Params();
+    CBlockStoreWriter writer;
+    boost::thread thread(boost::bind(&CBlockStoreWriter::ThreadWrite, &writer));
+
+    CDiskBlockPos pos(902, 0);
+    BOOST_CHECK(writer.WriteBlock(pos, chainparams.GenesisBlock(), chainparams.MessageStart()));
+    CheckUndoRecord(writer, CDiskBlockPos(902, 0), 3);
+    BOOST_CHECK(boost::filesystem::exists(GetBlockPosFilename(pos, "blk")));
+    BOOST_CHECK(boost::filesystem::exists(GetBlockPosFilename(pos, "rev")));
+
+    // Both files go, after what was written to them before
+    writer.Remove(902);
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")));
+    BOOST_CHECK(!boost::filesystem::exists(GetBlockPosFilename(pos, "rev")));
+
+    thread.interrupt();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(blockreadahead_take)
+{
+    const CChainParams& chainparams = Params();
+    CBlockReadAhead readAhead;
+    boost::thread thread(boost::bind(&CBlockReadAhead::ThreadReadAhead, &readAhead, &chainparams.GetConsensus()));
+
+    const CBlockIndex* pindexGenesis = chainActive.Genesis();
+    std::vector<const CBlockIndex*> vpindex(1, pindexGenesis);
+    boost::shared_ptr<const CBlock> pblock;
+    // Nothing is requested until the thread runs
+    for (int i = 0; i < 100 && !pblock; i++) {
+        {
+            LOCK(cs_main);
+            readAhead.Request(vpindex);
+        }
+        pblock = readAhead.Take(pindexGenesis);
+        if (!pblock)
+            MilliSleep(10);
+    }
+    BOOST_CHECK(pblock);
+    if (pblock) {
+        BOOST_CHECK(pblock->GetHash() == pindexGenesis->GetBlockHash());
+        BOOST_CHECK(pblock->fChecked);
+    }
+    // Taken only once, and never a block that was not requested
+    BOOST_CHECK(!readAhead.Take(pindexGenesis));
+
+    // A block that is no longer requested is forgotten
+    {
+        LOCK(cs_main);
+        readAhead.Request(vpindex);
+        readAhead.Request(std::vector<const CBlockIndex*>());
+    }
+    BOOST_CHECK(!readAhead.Take(pindexGenesis));
+
+    thread.interrupt();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(recentblockundo_take)
+{
+    // A chain of four blocks and a fork off the second
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 5; i++)
+        vHashes.push_back(GetRandHash());
+    CBlockIndex index[5];
+    for (int i = 0; i < 5; i++) {
+        index[i].phashBlock = &vHashes[i];
+        index[i].pprev = i == 0 ? NULL : i == 4 ? &index[1] : &index[i - 1];
+    }
+    boost::shared_ptr<const CBlock> pblock(new CBlock());
+    boost::shared_ptr<const CBlockUndo> pundo(new CBlockUndo(MakeUndo(3)));
+
+    CRecentBlockUndo recent;
+    recent.SetMaxBlocks(2);
+    for (int i = 0; i < 4; i++)
+        recent.Add(&index[i], pblock, pundo);
+
+    // Only the last blocks are kept and are taken from the top
+    boost::shared_ptr<const CBlock> pblockTaken;
+    boost::shared_ptr<const CBlockUndo> pundoTaken;
+    BOOST_CHECK(!recent.Take(vHashes[2], pblockTaken, pundoTaken));
+    recent.Add(&index[2], pblock, pundo);
+    recent.Add(&index[3], pblock, pundo);
+    BOOST_CHECK(recent.Take(vHashes[3], pblockTaken, pundoTaken));
+    BOOST_CHECK(pblockTaken == pblock && pundoTaken == pundo);
+    BOOST_CHECK(recent.Take(vHashes[2], pblockTaken, pundoTaken));
+    BOOST_CHECK(!recent.Take(vHashes[1], pblockTaken, pundoTaken));
+
+    // A block on another branch drops the others
+    recent.Add(&index[2], pblock, pundo);
+    recent.Add(&index[4], pblock, pundo);
+    BOOST_CHECK(!recent.Take(vHashes[2], pblockTaken, pundoTaken));
+    recent.Add(&index[4], pblock, pundo);
+    BOOST_CHECK(recent.Take(vHashes[4], pblockTaken, pundoTaken));
+
+    // Nothing is kept when turned off
+    recent.SetMaxBlocks(0);
+    recent.Add(&index[0], pblock, pundo);
+    BOOST_CHECK(!recent.Take(vHashes[0], pblockTaken, pundoTaken));
+}
+
+BOOST_AUTO_TEST_CASE(verifydbreader_take)
+{
+    const CChainParams& chainparams = Params();
+    const CBlockIndex* pindexGenesis = chainActive.Genesis();
+    CVerifyDBReader::Job job;
+    job.hash = pindexGenesis->GetBlockHash();
+    job.nHeight = 0;
+    job.pos = pindexGenesis->GetBlockPos();
+    // The same block under another hash fails at level 0
+    CVerifyDBReader::Job jobBad = job;
+    jobBad.hash = GetRandHash();
+    std::vector<CVerifyDBReader::Job> vJobs(20, job);
+    vJobs[15] = jobBad;
+
+    // Blocks come in the order of the jobs, however many threads check them
+    for (int nThreads = 0; nThreads <= 3; nThreads++) {
+        CVerifyDBReader reader(vJobs, 2, chainparams.GetConsensus(), nThreads);
+        for (size_t i = 0; i < vJobs.size(); i++) {
+            boost::shared_ptr<CBlock> pblock;
+            std::string strError;
+            bool fValid = reader.Take(pblock, strError);
+            BOOST_CHECK_EQUAL(fValid, i != 15);
+            BOOST_CHECK_EQUAL(strError.empty(), i != 15);
+            if (fValid)
+                BOOST_CHECK(pblock && pblock->GetHash() == job.hash);
+        }
+    }
+
+    // Stopping with blocks left to check
+    CVerifyDBReader reader(vJobs, 2, chainparams.GetConsensus(), 2);
+    boost::shared_ptr<CBlock> pblock;
+    std::string strError;
+    BOOST_CHECK(reader.Take(pblock, strError));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
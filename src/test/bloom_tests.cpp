@@ -6,6 +6,7 @@
 
 #include "base58.h"
 #include "clientversion.h"
+#include "consensus/merkle.h"
 #include "key.h"
 #include "merkleblock.h"
 #include "random.h"
@@ -471,10 +472,60 @@ static std::vector<unsigned char> RandomData()
     return std::vector<unsigned char>(r.begin(), r.end());
 }
 
-BOOST_AUTO_TEST_CASE(rolling_bloom)
+BOOST_AUTO_TEST_CASE(merkle_block_data)
+{
+    // A block of 13 transactions, each spending the one before, so that the levels
+    // of its merkle tree have odd widths
+    CBlock block;
+    uint256 hashPrev = GetRandHash();
+    for (int i = 0; i < 13; i++) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(hashPrev, 0);
+        mtx.vin[0].scriptSig = CScript() << RandomData() << RandomData();
+        mtx.vout.resize(2);
+        mtx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        mtx.vout[1].scriptPubKey = CScript() << std::vector<unsigned char>(33, 2) << OP_CHECKSIG;
+        block.vtx.push_back(MakeTransactionRef(mtx));
+        hashPrev = block.vtx.back()->GetHash();
+    }
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    CMerkleBlockData data(block);
+    BOOST_CHECK(data.vTree.size() == 5);
+    BOOST_CHECK(data.vTree.back().size() == 1 && data.vTree.back()[0] == block.hashMerkleRoot);
+
+    // Filtering the data extracted from the block, as blocks served to peers are,
+    // gives the same merkle block and updates the filter the same, for every kind of update
+    for (int nFlags = BLOOM_UPDATE_NONE; nFlags <= BLOOM_UPDATE_P2PUBKEY_ONLY; nFlags++) {
+        CBloomFilter filterBlock(10, 0.000001, 0, nFlags);
+        filterBlock.insert(std::vector<unsigned char>(20, 3));
+        filterBlock.insert(std::vector<unsigned char>(20, 11));
+        CBloomFilter filterData = filterBlock;
+
+        CMerkleBlock merkleBlock(block, filterBlock);
+        CMerkleBlock merkleBlockData(data, filterData);
+        BOOST_CHECK(merkleBlockData.vMatchedTxn == merkleBlock.vMatchedTxn);
+        // Transactions 3 and 11 match on their outputs, and with BLOOM_UPDATE_ALL the ones spending them on their inputs
+        BOOST_CHECK(merkleBlock.vMatchedTxn.size() == (nFlags == BLOOM_UPDATE_ALL ? 4 : 2));
+
+        std::vector<uint256> vMatched;
+        std::vector<unsigned int> vIndex;
+        BOOST_CHECK(merkleBlockData.txn.ExtractMatches(vMatched, vIndex) == block.hashMerkleRoot);
+
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION), ssData(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << merkleBlock << filterBlock;
+        ssData << merkleBlockData << filterData;
+        BOOST_CHECK(ssBlock.str() == ssData.str());
+    }
+}
+
+/* Either kind of rolling filter */
+template <typename RollingFilter>
+static void TestRollingBloom()
 {
     // last-100-entry, 1% false positive:
-    CRollingBloomFilter rb1(100, 0.01);
+    RollingFilter rb1(100, 0.01);
 
     // Overfill:
     static const int DATASIZE=399;
@@ -535,7 +586,7 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     BOOST_CHECK(nHits < 100);
 
     // last-1000-entry, 0.01% false positive:
-    CRollingBloomFilter rb2(1000, 0.001);
+    RollingFilter rb2(1000, 0.001);
     for (int i = 0; i < DATASIZE; i++) {
         rb2.insert(data[i]);
     }
@@ -545,4 +596,48 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    TestRollingBloom<CRollingBloomFilter>();
+}
+
+BOOST_AUTO_TEST_CASE(rolling_blocked_bloom)
+{
+    TestRollingBloom<CRollingBlockedBloomFilter>();
+}
+
+BOOST_AUTO_TEST_CASE(blocked_bloom)
+{
+    CBlockedBloomFilter filter(1000);
+    static const int DATASIZE=1000;
+    std::vector<unsigned char> data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomData();
+        filter.insert(data[i].data(), data[i].size());
+    }
+    for (int i = 0; i < DATASIZE; i++) {
+        BOOST_CHECK(filter.contains(data[i].data(), data[i].size()));
+    }
+
+    // Filled to capacity the false positive rate is below 0.1%, so about 10 of 10,000
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        std::vector<unsigned char> d = RandomData();
+        if (filter.contains(d.data(), d.size()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("BlockedBloomFilter got " << nHits << " false positives (~10 expected)");
+    BOOST_CHECK(nHits < 50);
+
+    // A copy keeps the salt, and so the items
+    CDataStream stream(SER_DISK, CLIENT_VERSION);
+    stream << filter;
+    CBlockedBloomFilter copy(0);
+    stream >> copy;
+    BOOST_CHECK_EQUAL(copy.GetCapacity(), 1000U);
+    for (int i = 0; i < DATASIZE; i++) {
+        BOOST_CHECK(copy.contains(data[i].data(), data[i].size()));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,109 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+static std::atomic<unsigned int> nChecksRun;
+
+struct CCountingCheck
+{
+    bool fOk;
+
+    CCountingCheck(bool fOkIn = true) : fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        nChecksRun++;
+        return fOk;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(checkqueue_work_stealing)
+{
+    CCheckQueue<CCountingCheck> queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 7; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, boost::ref(queue)));
+
+    // Batches of every size, dealt over the worker queues and stolen back
+    for (unsigned int nChecks = 0; nChecks < 1000; nChecks += 37) {
+        nChecksRun = 0;
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        for (unsigned int nAdded = 0; nAdded < nChecks; nAdded += 10) {
+            std::vector<CCountingCheck> vChecks(std::min(10U, nChecks - nAdded));
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nChecksRun.load(), nChecks);
+    }
+
+    // A failure is reported once, and the queue is reusable afterwards
+    for (int i = 0; i < 2; i++) {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(500);
+        vChecks[i * 499].fOk = false;
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(1);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_stats)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, boost::ref(queue)));
+    // Let the workers start, so that the checks are dealt over all four queues
+    CCheckQueueStats stats;
+    do {
+        MilliSleep(1);
+        queue.GetStats(stats);
+    } while (stats.vThreads.size() < 4);
+
+    for (int i = 0; i < 10; i++) {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    queue.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nAdded, 1000U);
+    BOOST_CHECK_EQUAL(stats.nQueued, 0U);
+    BOOST_CHECK(stats.nMaxQueued > 0U && stats.nMaxQueued <= 100U);
+    uint64_t nChecks = 0;
+    BOOST_FOREACH(const CCheckQueueStats::Thread& thread, stats.vThreads) {
+        nChecks += thread.nChecks;
+        BOOST_CHECK(thread.nStolen <= thread.nChecks);
+    }
+    BOOST_CHECK_EQUAL(nChecks, 1000U);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
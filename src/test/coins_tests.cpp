@@ -3,18 +3,22 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "coinswriter.h"
 #include "random.h"
 #include "script/standard.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
 #include "consensus/validation.h"
 
 #include <vector>
 #include <map>
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 namespace
 {
@@ -415,4 +419,178 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+namespace {
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    void WriteLegacyCoins(const uint256 &txid, const CCoins &coins) {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+};
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_keeps_one_record_per_output)
+{
+    CCoinsViewDBTest db;
+    CDataStream ss(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
+    CCoins legacy;
+    ss >> legacy;
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+
+    // Whole transactions of the old format are split up by the upgrade
+    db.WriteLegacyCoins(txid1, legacy);
+    BOOST_CHECK(!db.HaveCoins(txid1));
+    BOOST_CHECK(db.Upgrade());
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid1, coins));
+    BOOST_CHECK(coins == legacy);
+    BOOST_CHECK(db.Upgrade());
+
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    uint256 key;
+    BOOST_CHECK(pcursor->Valid());
+    BOOST_CHECK(pcursor->GetKey(key) && key == txid1);
+    BOOST_CHECK(pcursor->GetValue(coins) && coins == legacy);
+    pcursor->Next();
+    BOOST_CHECK(!pcursor->Valid());
+    pcursor.reset();
+
+    // Spending an output leaves the others alone, spending the last one of a transaction removes it
+    CCoinsViewCache cache(&db);
+    cache.ModifyCoins(txid1)->Spend(4);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txid1, coins));
+    BOOST_CHECK_EQUAL(coins.vout.size(), 17U);
+    for (int i = 0; i < 17; i++) {
+        BOOST_CHECK_EQUAL(coins.IsAvailable(i), i == 16);
+    }
+    BOOST_CHECK(coins.vout[16] == legacy.vout[16]);
+    cache.ModifyCoins(txid1)->Spend(16);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!db.HaveCoins(txid1));
+
+    // New outputs, and outputs that changed since they were written
+    {
+        CCoinsModifier modifier = cache.ModifyNewCoins(txid2, false);
+        modifier->vout = legacy.vout;
+        modifier->nHeight = 5;
+        modifier->nVersion = 2;
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txid2, coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 5U);
+    BOOST_CHECK_EQUAL(coins.nVersion, 2);
+    BOOST_CHECK(coins.IsAvailable(4) && coins.IsAvailable(16));
+    cache.ModifyCoins(txid2)->nHeight = 6;
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.GetCoins(txid2, coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 6U);
+    BOOST_CHECK(coins.vout[4] == legacy.vout[4]);
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch_fills_the_cache)
+{
+    CCoinsViewDBTest db;
+    std::vector<uint256> txids;
+    {
+        CCoinsViewCache writer(&db);
+        for (int i = 0; i < 20; i++) {
+            txids.push_back(GetRandHash());
+            CCoinsModifier coins = writer.ModifyNewCoins(txids.back(), false);
+            coins->vout.resize(2);
+            coins->vout[1].nValue = i + 1;
+            coins->nHeight = i;
+        }
+        BOOST_CHECK(writer.Flush());
+    }
+
+    CCoinsViewCache cache(&db);
+    BOOST_CHECK(cache.AccessCoins(txids[0]) != NULL);
+    std::vector<uint256> wanted(txids);
+    wanted.push_back(txids[3]);  // asked for twice
+    uint256 unknown = GetRandHash();
+    wanted.push_back(unknown);
+    cache.Prefetch(wanted, 4);
+    for (int i = 0; i < 20; i++) {
+        BOOST_CHECK(cache.HaveCoinsInCache(txids[i]));
+        BOOST_CHECK_EQUAL(cache.AccessCoins(txids[i])->vout[1].nValue, i + 1);
+    }
+    BOOST_CHECK(!cache.HaveCoinsInCache(unknown));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 20U);
+
+    // The database answers the same as one GetCoins per txid
+    std::vector<CCoins> coins;
+    std::vector<bool> found;
+    db.GetCoinsMany(wanted, coins, found, 3);
+    BOOST_CHECK(found[5] && coins[5] == *cache.AccessCoins(txids[5]));
+    BOOST_CHECK(!found.back());
+}
+
+
+BOOST_AUTO_TEST_CASE(coins_writer_flushes_in_the_background)
+{
+    CCoinsViewDBTest db;
+    CCoinsViewWriter writer(&db);
+    boost::thread thread(boost::bind(&CCoinsViewWriter::ThreadWrite, &writer));
+    uint256 spent = GetRandHash();
+    uint256 kept = GetRandHash();
+    uint256 created = GetRandHash();
+    uint256 hashFirst = GetRandHash();
+    uint256 hashSecond = GetRandHash();
+    {
+        CCoinsViewCache cache(&writer);
+        cache.ModifyNewCoins(spent, false)->vout.assign(1, CTxOut(1, CScript()));
+        cache.ModifyNewCoins(kept, false)->vout.assign(2, CTxOut(5, CScript()));
+        cache.SetBestBlock(hashFirst);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(db.HaveCoins(spent));
+    BOOST_CHECK(db.GetBestBlock() == hashFirst);
+
+    {
+        CCoinsViewCache cache(&writer);
+        cache.ModifyCoins(spent)->Clear();
+        cache.ModifyCoins(kept)->vout[1].nValue = 7;
+        cache.ModifyNewCoins(created, false)->vout.assign(3, CTxOut(1, CScript()));
+        cache.SetBestBlock(hashSecond);
+        BOOST_CHECK(cache.Flush());
+    }
+    {
+        // Whether the flush is on disk yet or not, reads see it
+        CCoinsViewCache cache(&writer);
+        BOOST_CHECK(!cache.HaveCoins(spent));
+        BOOST_CHECK_EQUAL(cache.AccessCoins(kept)->vout[1].nValue, 7);
+        BOOST_CHECK_EQUAL(cache.AccessCoins(created)->vout.size(), 3U);
+        BOOST_CHECK(cache.GetBestBlock() == hashSecond);
+        std::vector<uint256> wanted;
+        wanted.push_back(spent);
+        wanted.push_back(kept);
+        std::vector<CCoins> coins;
+        std::vector<bool> found;
+        writer.GetCoinsMany(wanted, coins, found, 2);
+        BOOST_CHECK(!found[0]);
+        BOOST_CHECK(found[1] && coins[1].vout[1].nValue == 7);
+    }
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(!db.HaveCoins(spent));
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(kept, coins) && coins.vout[1].nValue == 7);
+    BOOST_CHECK(db.HaveCoins(created));
+    BOOST_CHECK(db.GetBestBlock() == hashSecond);
+
+    // Without the thread a flush is written before BatchWrite returns
+    thread.interrupt();
+    thread.join();
+    {
+        CCoinsViewCache cache(&writer);
+        cache.ModifyCoins(created)->Clear();
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.HaveCoins(created));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,7 +3,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "compressor.h"
+#include "random.h"
+#include "streams.h"
 #include "util.h"
+#include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
 #include <stdint.h>
@@ -62,4 +65,67 @@ BOOST_AUTO_TEST_CASE(compress_amounts)
         BOOST_CHECK(TestDecode(i));
 }
 
+BOOST_AUTO_TEST_CASE(compress_block)
+{
+    CBlock block;
+    block.nVersion = 4;
+    block.nTime = 1476000000;
+    block.nBits = 0x1d00ffff;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 100 << OP_0;
+    coinbase.vout.resize(2);
+    coinbase.vout[0].nValue = 50 * COIN;
+    coinbase.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    coinbase.vout[1].nValue = 0;
+    coinbase.vout[1].scriptPubKey = CScript() << OP_RETURN << ParseHex("aa21a9ed");
+    coinbase.wit.vtxinwit.resize(1);
+    coinbase.wit.vtxinwit[0].scriptWitness.stack.push_back(std::vector<unsigned char>(32, 0));
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+
+    CMutableTransaction spend;
+    spend.nVersion = 2;
+    spend.nLockTime = 500000;
+    spend.vin.resize(3);
+    for (unsigned int i = 0; i < spend.vin.size(); i++) {
+        spend.vin[i].prevout = COutPoint(GetRandHash(), i);
+        spend.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, i) << std::vector<unsigned char>(33, 2);
+    }
+    spend.vin[1].nSequence = 0xfffffffe;
+    spend.vin[2].nSequence = 0;
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 123456789;
+    spend.vout[0].scriptPubKey = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUAL;
+    spend.vout[1].nValue = 1;
+    spend.vout[1].scriptPubKey = CScript() << OP_1 << std::vector<unsigned char>(33, 2) << OP_1 << OP_CHECKMULTISIG;
+    block.vtx.push_back(MakeTransactionRef(spend));
+
+    // The block reads back exactly, witness included, and smaller
+    BOOST_CHECK(CBlockCompressor::CanCompress(block));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CBlockCompressor(block);
+    BOOST_CHECK(ss.size() < ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+    CBlock blockRead;
+    CBlockCompressor compressor(blockRead);
+    ss >> compressor;
+    BOOST_CHECK(ss.empty());
+    CDataStream ssExpected(SER_DISK, CLIENT_VERSION), ssRead(SER_DISK, CLIENT_VERSION);
+    ssExpected << block;
+    ssRead << blockRead;
+    BOOST_CHECK(ssExpected.str() == ssRead.str());
+    BOOST_CHECK(blockRead.vtx[0]->GetWitnessHash() == block.vtx[0]->GetWitnessHash());
+
+    // Outputs CTxOutCompressor cannot store as they are keep the block uncompressed
+    std::vector<unsigned char> vchLong(MAX_SCRIPT_SIZE + 1, OP_NOP);
+    spend.vout[1].scriptPubKey = CScript(vchLong.begin(), vchLong.end());
+    block.vtx[1] = MakeTransactionRef(spend);
+    BOOST_CHECK(!CBlockCompressor::CanCompress(block));
+    spend.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    spend.vout[1].nValue = -1;
+    block.vtx[1] = MakeTransactionRef(spend);
+    BOOST_CHECK(!CBlockCompressor::CanCompress(block));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
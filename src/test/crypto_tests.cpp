@@ -3,16 +3,19 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "crypto/aes.h"
+#include "crypto/muhash.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
+#include <algorithm>
 #include <vector>
 
 #include <boost/assign/list_of.hpp>
@@ -255,6 +258,84 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Every batch size exercises a different mix of the multi-way and the scalar transforms
+    for (int i = 0; i <= 20; i++) {
+        std::vector<unsigned char> in(64 * i), out(32 * i), outInPlace;
+        for (size_t j = 0; j < in.size(); j++)
+            in[j] = insecure_rand() & 0xff;
+        SHA256D64(out.data(), in.data(), i);
+        for (int j = 0; j < i; j++) {
+            unsigned char hash[CHash256::OUTPUT_SIZE];
+            CHash256().Write(&in[64 * j], 64).Finalize(hash);
+            BOOST_CHECK(memcmp(hash, &out[32 * j], 32) == 0);
+        }
+        // As a merkle tree level is hashed
+        outInPlace = in;
+        if (i > 0)
+            SHA256D64(outInPlace.data(), outInPlace.data(), i);
+        BOOST_CHECK(std::equal(out.begin(), out.end(), outInPlace.begin()));
+    }
+}
+
+static uint256 MuHashFinalize(const CMuHash3072& muhash)
+{
+    uint256 hash;
+    muhash.Finalize(hash.begin());
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_testvectors)
+{
+    const unsigned char a = 'a', b = 'b', c = 'c';
+    // SHA256 of the little-endian encodings of 1 and of the product of the hashes of "a" and "b"
+    BOOST_CHECK_EQUAL(MuHashFinalize(CMuHash3072()).GetHex(), "dd5ad2a105c2d29495f577245c357409002329b9f4d6182c0af3dc2f462555c8");
+    CMuHash3072 ab;
+    ab.Insert(&a, 1).Insert(&b, 1);
+    BOOST_CHECK_EQUAL(MuHashFinalize(ab).GetHex(), "986147d68ebf992c19909a4b8f3aa1b8ca67f75428ffb5349498a3d31c3fff15");
+
+    // Neither the order of the changes nor their grouping matter
+    CMuHash3072 bca;
+    bca.Insert(&b, 1).Insert(&c, 1).Insert(&a, 1).Remove(&c, 1);
+    BOOST_CHECK(MuHashFinalize(bca) == MuHashFinalize(ab));
+    CMuHash3072 onlyC, abc(ab);
+    onlyC.Insert(&c, 1);
+    abc *= onlyC;
+    abc /= onlyC;
+    BOOST_CHECK(MuHashFinalize(abc) == MuHashFinalize(ab));
+    BOOST_CHECK(MuHashFinalize(onlyC) != MuHashFinalize(ab));
+
+    unsigned char state[CMuHash3072::STATE_SIZE];
+    bca.GetState(state);
+    CMuHash3072 restored;
+    restored.SetState(state);
+    BOOST_CHECK(MuHashFinalize(restored) == MuHashFinalize(ab));
+
+    // Numbers at and just below the modulus
+    unsigned char data[Num3072::BYTE_SIZE], out[Num3072::BYTE_SIZE];
+    memset(data, 0xff, sizeof(data));
+    for (unsigned char n = 0; n < 3; n++) {
+        // The modulus ends in 0xffef289b
+        data[0] = 0x9b - n;
+        data[1] = 0x28;
+        data[2] = 0xef;
+        Num3072 x(data);
+        Num3072 product = x.GetInverse();
+        product.Multiply(x);
+        product.ToBytes(out);
+        // The modulus itself is zero, which has no inverse
+        BOOST_CHECK_EQUAL(out[0], n == 0 ? 0 : 1);
+        BOOST_CHECK(std::count(out + 1, out + sizeof(out), 0) == sizeof(out) - 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_selftest)
+{
+    // Whichever transforms this CPU selected
+    BOOST_CHECK(SHA256SelfTest());
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -0,0 +1,128 @@
+// Copyright (c) 2012-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+/** The caches are filled with deterministic insecure_rand hashes, so that a
+ * failing run can be repeated. Hit rates are checked against the load put on
+ * the cache rather than exact counts.
+ */
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests);
+
+static void insecure_GetRandHash(uint256& t)
+{
+    uint32_t* ptr = (uint32_t*)t.begin();
+    for (uint8_t j = 0; j < 8; ++j)
+        *(ptr++) = insecure_rand();
+}
+
+static std::vector<uint256> RandomHashes(uint32_t n)
+{
+    std::vector<uint256> hashes(n);
+    for (uint32_t i = 0; i < n; ++i)
+        insecure_GetRandHash(hashes[i]);
+    return hashes;
+}
+
+typedef CuckooCache::cache<uint256, SignatureCacheHasher> SigCacheType;
+
+BOOST_AUTO_TEST_CASE(cuckoocache_no_fakes)
+{
+    seed_insecure_rand(true);
+    SigCacheType cc;
+    cc.setup_bytes(4 << 20);
+    uint256 v;
+    for (int x = 0; x < 100000; ++x) {
+        insecure_GetRandHash(v);
+        cc.insert(v);
+    }
+    for (int x = 0; x < 100000; ++x) {
+        insecure_GetRandHash(v);
+        BOOST_CHECK(!cc.contains(v, false));
+    }
+}
+
+/** The fraction of n_insert = load * capacity hashes still found after inserting them all */
+static double HitRate(size_t megabytes, double load)
+{
+    seed_insecure_rand(true);
+    SigCacheType set;
+    size_t bytes = megabytes * (1 << 20);
+    set.setup_bytes(bytes);
+    uint32_t n_insert = static_cast<uint32_t>(load * (bytes / sizeof(uint256)));
+    std::vector<uint256> hashes = RandomHashes(n_insert);
+    for (uint32_t i = 0; i < n_insert; ++i)
+        set.insert(hashes[i]);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n_insert; ++i)
+        count += set.contains(hashes[i], false);
+    return ((double)count) / ((double)n_insert);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate_ok)
+{
+    // Above a load of 1 only 1 / load of the hashes can fit
+    for (double load = 0.1; load < 2; load *= 2)
+        BOOST_CHECK(HitRate(4, load) * std::max(load, 1.0) > 0.98);
+}
+
+/** Erase a quarter of the first half of the hashes, on nThreads threads at once, then insert the
+ * second half: erased entries are evicted before those of the same generation that were not */
+static void CheckEraseEvictsFirst(size_t megabytes, int nThreads)
+{
+    seed_insecure_rand(true);
+    SigCacheType set;
+    size_t bytes = megabytes * (1 << 20);
+    set.setup_bytes(bytes);
+    uint32_t n_insert = static_cast<uint32_t>(bytes / sizeof(uint256));
+    std::vector<uint256> hashes = RandomHashes(n_insert);
+    boost::shared_mutex mtx;
+
+    for (uint32_t i = 0; i < (n_insert / 2); ++i)
+        set.insert(hashes[i]);
+    // Erasures only take the shared lock, as in the signature cache
+    boost::thread_group threads;
+    for (int t = 0; t < nThreads; ++t) {
+        threads.create_thread([&, t]() {
+            boost::shared_lock<boost::shared_mutex> l(mtx);
+            for (uint32_t i = t; i < (n_insert / 4); i += nThreads)
+                set.contains(hashes[i], true);
+        });
+    }
+    threads.join_all();
+    for (uint32_t i = (n_insert / 2); i < n_insert; ++i)
+        set.insert(hashes[i]);
+
+    size_t count_erased_but_contained = 0, count_stale = 0, count_fresh = 0;
+    for (uint32_t i = 0; i < (n_insert / 4); ++i)
+        count_erased_but_contained += set.contains(hashes[i], false);
+    for (uint32_t i = (n_insert / 4); i < (n_insert / 2); ++i)
+        count_stale += set.contains(hashes[i], false);
+    for (uint32_t i = (n_insert / 2); i < n_insert; ++i)
+        count_fresh += set.contains(hashes[i], false);
+
+    double hit_rate_erased_but_contained = double(count_erased_but_contained) / (double(n_insert) / 4.0);
+    double hit_rate_stale = double(count_stale) / (double(n_insert) / 4.0);
+    double hit_rate_fresh = double(count_fresh) / (double(n_insert) / 2.0);
+    BOOST_CHECK(hit_rate_fresh > 0.99);
+    BOOST_CHECK(hit_rate_stale > 2 * hit_rate_erased_but_contained);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase_ok)
+{
+    CheckEraseEvictsFirst(4, 1);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase_parallel_ok)
+{
+    CheckEraseEvictsFirst(4, 3);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "dbwrapper.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "random.h"
 #include "test/test_bitcoin.h"
@@ -324,4 +325,117 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
 
 
 
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    // Small compressed blocks without a bloom filter, on disk so the tables are written
+    CDBOptions options;
+    options.fCompression = true;
+    options.nBlockSize = 1024;
+    options.nBloomBits = 0;
+    path ph = temp_directory_path() / unique_path();
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, false, false, options);
+        for (int n = 0; n < 2; n++) {
+            CDBBatch batch(dbw);
+            for (int i = 0; i < 20000; i++)
+                batch.Write(make_pair('r', i), string(50, 'a' + i % 26));
+            BOOST_CHECK(dbw.WriteBatch(batch));
+        }
+    }
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, false, false, options);
+        string value;
+        BOOST_CHECK(dbw.Read(make_pair('r', 12345), value));
+        BOOST_CHECK_EQUAL(value, string(50, 'a' + 12345 % 26));
+        BOOST_CHECK(!dbw.Exists(make_pair('r', 20000)));
+    }
+    remove_all(ph);
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_options_from_args)
+{
+    CDBOptions defaults;
+    defaults.fCompression = true;
+
+    mapMultiArgs.clear();
+    CDBOptions options = GetDBOptions("txindex", defaults);
+    BOOST_CHECK(options.fCompression);
+    BOOST_CHECK_EQUAL(options.nBlockSize, DEFAULT_DB_BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, DEFAULT_DB_MAX_OPEN_FILES);
+    BOOST_CHECK_EQUAL(options.nBloomBits, DEFAULT_DB_BLOOM_BITS);
+
+    // A value for the database wins over one for all, in whatever order they are given
+    mapMultiArgs["-dbblocksize"].push_back("txindex:64");
+    mapMultiArgs["-dbblocksize"].push_back("16");
+    mapMultiArgs["-dbcompression"].push_back("0");
+    mapMultiArgs["-dbmaxopenfiles"].push_back("1000000");
+    mapMultiArgs["-dbbloombits"].push_back("chainstate:20");
+    options = GetDBOptions("txindex", defaults);
+    BOOST_CHECK(!options.fCompression);
+    BOOST_CHECK_EQUAL(options.nBlockSize, 64U * 1024);
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, MAX_DB_MAX_OPEN_FILES);
+    BOOST_CHECK_EQUAL(options.nBloomBits, DEFAULT_DB_BLOOM_BITS);
+
+    options = GetDBOptions("chainstate");
+    BOOST_CHECK_EQUAL(options.nBlockSize, 16U * 1024);
+    BOOST_CHECK_EQUAL(options.nBloomBits, 20);
+    mapMultiArgs.clear();
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_stats)
+{
+    CDBLatencyHistogram histogram;
+    histogram.Add(0);
+    histogram.Add(1);
+    histogram.Add(1000);
+    histogram.Add(int64_t(1) << 40);
+    BOOST_CHECK_EQUAL(histogram.GetCount(), 4U);
+    BOOST_CHECK_EQUAL(histogram.GetTotalMicros(), 1001U + (uint64_t(1) << 40));
+    BOOST_CHECK_EQUAL(histogram.GetBucket(0), 1U);
+    BOOST_CHECK_EQUAL(histogram.GetBucket(1), 1U);
+    // 512 <= 1000 < 1024
+    BOOST_CHECK_EQUAL(histogram.GetBucket(10), 1U);
+    BOOST_CHECK_EQUAL(histogram.GetBucket(CDBLatencyHistogram::BUCKETS - 1), 1U);
+
+    path ph = temp_directory_path() / unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false);
+    {
+        CDBBatch batch(dbw);
+        for (int i = 0; i < 10; i++)
+            batch.Write(make_pair('s', i), i);
+        BOOST_CHECK(batch.SizeEstimate() > 0);
+        BOOST_CHECK(dbw.WriteBatch(batch));
+        BOOST_CHECK_EQUAL(dbw.GetStats().nBatchBytes, (uint64_t)batch.SizeEstimate());
+    }
+    BOOST_CHECK(dbw.Write(make_pair('s', 10), 10));
+    const CDBStats& stats = dbw.GetStats();
+    BOOST_CHECK_EQUAL(stats.writeLatency.GetCount(), 2U);
+    BOOST_CHECK(stats.nBatchBytesMax < stats.nBatchBytes);
+
+    // Opening the database read the obfuscation key already
+    uint64_t nReads = stats.readLatency.GetCount();
+    uint64_t nFound = stats.nReadsFound;
+    int value;
+    BOOST_CHECK(dbw.Read(make_pair('s', 3), value));
+    BOOST_CHECK(!dbw.Read(make_pair('s', 11), value));
+    BOOST_CHECK(dbw.Exists(make_pair('s', 4)));
+    BOOST_CHECK_EQUAL(stats.readLatency.GetCount(), nReads + 3);
+    BOOST_CHECK_EQUAL(stats.nReadsFound, nFound + 2);
+
+    boost::scoped_ptr<CDBIterator> it(const_cast<CDBWrapper*>(&dbw)->NewIterator());
+    it->Seek(make_pair('s', 5));
+    int n = 0;
+    for (; it->Valid(); it->Next())
+        n++;
+    BOOST_CHECK_EQUAL(n, 6);
+    BOOST_CHECK_EQUAL(stats.seekLatency.GetCount(), 1U);
+    BOOST_CHECK_EQUAL(stats.nNexts, 6U);
+
+    // The databases open are listed, and LevelDB answers for each
+    int nListed = 0;
+    CDBWrapper::ForEachOpen([&](const CDBWrapper& db) { if (&db == &dbw) nListed++; });
+    BOOST_CHECK_EQUAL(nListed, 1);
+    BOOST_CHECK(!dbw.GetProperty("leveldb.stats").empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,528 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "crypto/ethash/ethashExtension/SHA3.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
+#include "crypto/ethash/ethashlib/ethash.h"
+#include "crypto/ethash/ethashlib/fnv.h"
+#include "crypto/ethash/ethashlib/internal.h"
+#include "crypto/ethash/ethashlib/io.h"
+#include "crypto/ethash/ethashlib/sha3.h"
+#include "pow.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(ethash_tests, BasicTestingSetup)
+
+static std::vector<unsigned> vProgress;
+
+static int RecordProgress(unsigned p)
+{
+    vProgress.push_back(p);
+    return 0;
+}
+
+static int AbortAtTen(unsigned p)
+{
+    return p >= 10 ? 1 : 0;
+}
+
+BOOST_AUTO_TEST_CASE(dag_parallel_matches_serial)
+{
+    // A tiny cache and dataset, large enough to span multiple worker chunks.
+    const uint64_t nCacheSize = 256 * sizeof(node);
+    const uint64_t nFullSize = 10000 * sizeof(node);
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    ethash_light_t light = ethash_light_new_internal(nCacheSize, &seed);
+    BOOST_REQUIRE(light);
+
+    std::vector<node> vSerial(nFullSize / sizeof(node));
+    std::vector<node> vParallel(nFullSize / sizeof(node));
+    unsigned nPrevThreads = ethash_get_dag_threads();
+
+    ethash_set_dag_threads(1);
+    BOOST_CHECK(ethash_compute_full_data(&vSerial[0], nFullSize, light, NULL));
+
+    ethash_set_dag_threads(4);
+    vProgress.clear();
+    BOOST_CHECK(ethash_compute_full_data(&vParallel[0], nFullSize, light, RecordProgress));
+    BOOST_CHECK(memcmp(&vSerial[0], &vParallel[0], nFullSize) == 0);
+
+    // Progress is reported from the calling thread, starting at 0 and increasing.
+    BOOST_REQUIRE(!vProgress.empty());
+    BOOST_CHECK_EQUAL(vProgress.front(), 0U);
+    for (size_t i = 1; i < vProgress.size(); i++)
+        BOOST_CHECK(vProgress[i] > vProgress[i - 1]);
+    BOOST_CHECK_EQUAL(vProgress.back(), 100U);
+
+    // A non-zero callback result stops all workers.
+    BOOST_CHECK(!ethash_compute_full_data(&vParallel[0], nFullSize, light, AbortAtTen));
+
+    ethash_set_dag_threads(nPrevThreads);
+    ethash_light_delete(light);
+}
+
+BOOST_AUTO_TEST_CASE(dag_item_kernel_matches_reference)
+{
+    const uint64_t nCacheSize = 256 * sizeof(node);
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    seed.b[0] = 1;
+    ethash_light_t light = ethash_light_new_internal(nCacheSize, &seed);
+    BOOST_REQUIRE(light);
+    const node* cache = (const node*)light->cache;
+    const uint32_t nCacheNodes = nCacheSize / sizeof(node);
+
+    for (uint32_t nIndex = 0; nIndex < 64; nIndex++) {
+        // Plain FNV reference of the SIMD kernels
+        node ref = cache[nIndex % nCacheNodes];
+        ref.words[0] ^= nIndex;
+        SHA3_512(ref.bytes, ref.bytes, sizeof(node));
+        for (uint32_t i = 0; i < ETHASH_DATASET_PARENTS; i++) {
+            const node& parent = cache[fnv_hash(nIndex ^ i, ref.words[i % NODE_WORDS]) % nCacheNodes];
+            for (unsigned w = 0; w < NODE_WORDS; w++)
+                ref.words[w] = fnv_hash(ref.words[w], parent.words[w]);
+        }
+        SHA3_512(ref.bytes, ref.bytes, sizeof(node));
+
+        node item;
+        ethash_calculate_dag_item(&item, nIndex, light);
+        BOOST_CHECK_MESSAGE(memcmp(&item, &ref, sizeof(node)) == 0, ethash_get_kernel_name());
+    }
+
+    ethash_light_delete(light);
+}
+
+BOOST_AUTO_TEST_CASE(sha3_x4_matches_single)
+{
+    // Lengths below, at and above the SHA3-512 rate of 72 bytes
+    const size_t vLengths[] = {0, 1, 64, 71, 72, 73, 200};
+    for (size_t l = 0; l < sizeof(vLengths) / sizeof(vLengths[0]); l++) {
+        const size_t nLen = vLengths[l];
+        std::vector<uint8_t> vData[4];
+        uint8_t vOut[4][64];
+        uint8_t* pout[4];
+        const uint8_t* pin[4];
+        for (int k = 0; k < 4; k++) {
+            vData[k].resize(nLen + 1);
+            for (size_t i = 0; i < nLen; i++)
+                vData[k][i] = (uint8_t)(i * 7 + k * 31 + nLen);
+            pout[k] = vOut[k];
+            pin[k] = &vData[k][0];
+        }
+        SHA3_512_x4(pout, pin, nLen);
+        for (int k = 0; k < 4; k++) {
+            uint8_t ref[64];
+            SHA3_512(ref, &vData[k][0], nLen);
+            BOOST_CHECK(memcmp(ref, vOut[k], 64) == 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(dag_batched_matches_items)
+{
+    // An item count that is not a multiple of four exercises the remainder.
+    const uint64_t nCacheSize = 256 * sizeof(node);
+    const uint64_t nFullSize = 1030 * sizeof(node);
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    seed.b[0] = 2;
+    ethash_light_t light = ethash_light_new_internal(nCacheSize, &seed);
+    BOOST_REQUIRE(light);
+
+    std::vector<node> vFull(nFullSize / sizeof(node));
+    unsigned nPrevThreads = ethash_get_dag_threads();
+    ethash_set_dag_threads(1);
+    BOOST_CHECK(ethash_compute_full_data(&vFull[0], nFullSize, light, NULL));
+    ethash_set_dag_threads(nPrevThreads);
+
+    for (uint32_t n = 0; n < vFull.size(); n++) {
+        node item;
+        ethash_calculate_dag_item(&item, n, light);
+        BOOST_CHECK(memcmp(&item, &vFull[n], sizeof(node)) == 0);
+    }
+
+    ethash_light_delete(light);
+}
+
+BOOST_AUTO_TEST_CASE(seed_hash_table)
+{
+    BOOST_CHECK(EthashAux::seedHash(0) == uint256());
+    BOOST_CHECK(EthashAux::seedHash(ETHASH_EPOCH_LENGTH - 1) == uint256());
+    const unsigned epochs[] = {1, 2, 100, ETHASH_MAX_EPOCHS - 1, ETHASH_MAX_EPOCHS, ETHASH_MAX_EPOCHS + 1};
+    for (unsigned epoch : epochs) {
+        uint256 seed = EthashAux::seedHash(epoch * ETHASH_EPOCH_LENGTH);
+        BOOST_CHECK(seed == sha3(EthashAux::seedHash((epoch - 1) * ETHASH_EPOCH_LENGTH)));
+        if (epoch < ETHASH_MAX_EPOCHS)
+            BOOST_CHECK_EQUAL(EthashAux::number(seed), (uint64_t)epoch * ETHASH_EPOCH_LENGTH);
+        else
+            BOOST_CHECK_THROW(EthashAux::number(seed), std::invalid_argument);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(regtest_params)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& consensus = Params().GetConsensus();
+    BOOST_CHECK_EQUAL(EthashAux::epochLength(), consensus.nEthashEpochLength);
+    BOOST_CHECK(EthashAux::seedHash(consensus.nEthashEpochLength - 1) == uint256());
+    BOOST_CHECK(EthashAux::seedHash(consensus.nEthashEpochLength) == sha3(uint256()));
+    EthashAux::LightType light = EthashAux::light(EthashAux::seedHash(3 * consensus.nEthashEpochLength / 2));
+    BOOST_CHECK_EQUAL(light->size, consensus.nEthashCacheSize);
+    BOOST_CHECK_EQUAL(ethash_get_datasize(light->light->block_number), consensus.nEthashDatasetSize);
+
+    // The genesis block was mined with these sizes
+    const CBlock& genesis = Params().GenesisBlock();
+    BOOST_CHECK(CheckProofOfWork(genesis.GetPoWHash(), genesis.nBits, consensus));
+
+    SelectParams(CBaseChainParams::MAIN);
+    BOOST_CHECK_EQUAL(EthashAux::epochLength(), ETHASH_EPOCH_LENGTH);
+    BOOST_CHECK(EthashAux::light(EthashAux::seedHash(0))->size > consensus.nEthashCacheSize);
+}
+
+BOOST_AUTO_TEST_CASE(light_cache_lru)
+{
+    // With no budget only the pinned epochs and the newest entry survive.
+    EthashAux::setChainHeight(0);
+    EthashAux::setLightCacheBudget(0);
+    uint64_t nEvictions = EthashAux::lightEvictions();
+
+    EthashAux::LightType light0 = EthashAux::light(EthashAux::seedHash(0));
+    EthashAux::LightType light2 = EthashAux::light(EthashAux::seedHash(2 * ETHASH_EPOCH_LENGTH));
+    BOOST_CHECK_EQUAL(EthashAux::lightEvictions(), nEvictions);
+
+    EthashAux::LightType light3 = EthashAux::light(EthashAux::seedHash(3 * ETHASH_EPOCH_LENGTH));
+    BOOST_CHECK_EQUAL(EthashAux::lightEvictions(), nEvictions + 1);
+    BOOST_CHECK_EQUAL(EthashAux::lightCacheUsage(), light0->size + light3->size);
+
+    // The current epoch is pinned, an evicted one is rebuilt on demand.
+    BOOST_CHECK(EthashAux::light(EthashAux::seedHash(0)) == light0);
+    BOOST_CHECK(EthashAux::light(EthashAux::seedHash(2 * ETHASH_EPOCH_LENGTH)) != light2);
+    BOOST_CHECK_EQUAL(EthashAux::lightEvictions(), nEvictions + 2);
+
+    // Evicted caches stay usable by their holders.
+    BOOST_CHECK(light3->compute(uint256(), 0).value == EthashAux::light(EthashAux::seedHash(3 * ETHASH_EPOCH_LENGTH))->compute(uint256(), 0).value);
+
+    EthashAux::setLightCacheBudget((uint64_t)DEFAULT_ETHASH_LIGHT_CACHE << 20);
+}
+
+BOOST_AUTO_TEST_CASE(eval_cache)
+{
+    uint256 seed = EthashAux::seedHash(0);
+    uint256 header = uint256S("0x1234");
+    uint64_t nHits = EthashAux::evalCacheHits();
+    uint64_t nMisses = EthashAux::evalCacheMisses();
+
+    EthashProofOfWork::Result first = EthashAux::eval(seed, header, 7);
+    BOOST_CHECK_EQUAL(EthashAux::evalCacheMisses(), nMisses + 1);
+    BOOST_CHECK(!first.value.IsNull() && !first.mixHash.IsNull());
+
+    // The same inputs are answered from the cache, with the result of a fresh evaluation
+    EthashProofOfWork::Result second = EthashAux::eval(seed, header, 7);
+    BOOST_CHECK_EQUAL(EthashAux::evalCacheHits(), nHits + 1);
+    BOOST_CHECK(second.value == first.value && second.mixHash == first.mixHash);
+    EthashProofOfWork::Result fresh = EthashAux::light(seed)->compute(header, 7);
+    BOOST_CHECK(fresh.value == first.value && fresh.mixHash == first.mixHash);
+
+    // Any other nonce, header or epoch is evaluated
+    EthashAux::eval(seed, header, 8);
+    EthashAux::eval(seed, uint256S("0x1235"), 7);
+    EthashAux::eval(EthashAux::seedHash(ETHASH_EPOCH_LENGTH), header, 7);
+    BOOST_CHECK_EQUAL(EthashAux::evalCacheMisses(), nMisses + 4);
+    BOOST_CHECK_EQUAL(EthashAux::evalCacheHits(), nHits + 1);
+}
+
+/* Evaluates with the light cache, as a device would with its DAG, or declines or fails on request */
+class TestBackend : public EthashBackend
+{
+public:
+    enum Mode { EVALUATE, DECLINE, FAIL };
+    Mode mode;
+    size_t nEvaluated;
+
+    TestBackend(Mode modeIn) : mode(modeIn), nEvaluated(0) {}
+
+    std::string name() const { return "test"; }
+    bool upload(uint256 const&, void const*, uint64_t) { return false; }
+    void release(uint256 const&) {}
+    bool search(uint256 const&, uint256 const&, uint64_t, uint64_t, uint256 const&, uint64_t&, uint256&) { return false; }
+
+    bool evalBatch(uint256 const& seed, std::vector<EthashInput> const& inputs, std::vector<EthashProofOfWork::Result>& results)
+    {
+        if (mode == FAIL)
+            throw std::runtime_error("device lost");
+        if (mode == DECLINE)
+            return false;
+        for (size_t i = 0; i < inputs.size(); i++)
+            results.push_back(EthashAux::light(seed)->compute(inputs[i].headerHash, inputs[i].nonce));
+        nEvaluated += inputs.size();
+        return true;
+    }
+};
+
+static std::vector<EthashInput> MakeInputs(uint64_t nFirstNonce, size_t nCount)
+{
+    std::vector<EthashInput> inputs;
+    for (size_t i = 0; i < nCount; i++) {
+        EthashInput input;
+        input.headerHash = uint256S("0x5678");
+        input.nonce = nFirstNonce + i;
+        inputs.push_back(input);
+    }
+    return inputs;
+}
+
+BOOST_AUTO_TEST_CASE(eval_batch_backend)
+{
+    uint256 seed = EthashAux::seedHash(0);
+    std::shared_ptr<TestBackend> backend = std::make_shared<TestBackend>(TestBackend::EVALUATE);
+    EthashAux::setBackend(backend);
+    BOOST_CHECK(EthashAux::backend() == backend);
+
+    // Every input is evaluated once, results come in input order
+    std::vector<EthashInput> inputs = MakeInputs(100, 4);
+    std::vector<EthashProofOfWork::Result> results = EthashAux::evalBatch(seed, inputs);
+    BOOST_CHECK_EQUAL(results.size(), inputs.size());
+    BOOST_CHECK_EQUAL(backend->nEvaluated, inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++) {
+        EthashProofOfWork::Result fresh = EthashAux::light(seed)->compute(inputs[i].headerHash, inputs[i].nonce);
+        BOOST_CHECK(results[i].value == fresh.value && results[i].mixHash == fresh.mixHash);
+    }
+
+    // The results are cached: eval no longer computes, the next batch only sends what is new
+    uint64_t nHits = EthashAux::evalCacheHits();
+    EthashProofOfWork::Result cached = EthashAux::eval(seed, inputs[2].headerHash, inputs[2].nonce);
+    BOOST_CHECK_EQUAL(EthashAux::evalCacheHits(), nHits + 1);
+    BOOST_CHECK(cached.value == results[2].value);
+    EthashAux::evalBatch(seed, MakeInputs(102, 4));
+    BOOST_CHECK_EQUAL(backend->nEvaluated, inputs.size() + 2);
+
+    // Whatever the backend declines or fails at is done on the CPU
+    std::vector<EthashInput> more = MakeInputs(200, 3);
+    backend->mode = TestBackend::DECLINE;
+    results = EthashAux::evalBatch(seed, more);
+    backend->mode = TestBackend::FAIL;
+    std::vector<EthashProofOfWork::Result> failed = EthashAux::evalBatch(seed, MakeInputs(300, 3));
+    BOOST_CHECK_EQUAL(backend->nEvaluated, inputs.size() + 2);
+    for (size_t i = 0; i < more.size(); i++) {
+        BOOST_CHECK(results[i].msg.empty() && !results[i].value.IsNull());
+        BOOST_CHECK(failed[i].msg.empty() && !failed[i].value.IsNull());
+        BOOST_CHECK(results[i].value == EthashAux::light(seed)->compute(more[i].headerHash, more[i].nonce).value);
+    }
+
+    EthashAux::setBackend(std::shared_ptr<EthashBackend>());
+    BOOST_CHECK(!EthashAux::backend());
+}
+
+BOOST_AUTO_TEST_CASE(dag_prefetch_threshold)
+{
+    EthashAux::setDagPrefetch(50);
+    BOOST_CHECK(!EthashAux::shouldPrefetch(ETHASH_EPOCH_LENGTH / 2 - 1));
+    BOOST_CHECK(EthashAux::shouldPrefetch(ETHASH_EPOCH_LENGTH / 2));
+    BOOST_CHECK(!EthashAux::shouldPrefetch(ETHASH_EPOCH_LENGTH));
+    BOOST_CHECK(EthashAux::shouldPrefetch(ETHASH_EPOCH_LENGTH * 2 - 1));
+
+    // 0 always prefetches, 100 never does
+    EthashAux::setDagPrefetch(0);
+    BOOST_CHECK(EthashAux::shouldPrefetch(ETHASH_EPOCH_LENGTH));
+    EthashAux::setDagPrefetch(100);
+    BOOST_CHECK(!EthashAux::shouldPrefetch(ETHASH_EPOCH_LENGTH - 1));
+
+    EthashAux::setDagPrefetch(DEFAULT_DAG_PREFETCH);
+    BOOST_CHECK(EthashAux::dagProgress().empty());
+}
+
+BOOST_AUTO_TEST_CASE(dag_in_memory_matches_light)
+{
+    const uint64_t nCacheSize = 256 * sizeof(node);
+    const uint64_t nFullSize = 4096 * sizeof(node);
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    ethash_light_t light = ethash_light_new_internal(nCacheSize, &seed);
+    BOOST_REQUIRE(light);
+    ethash_h256_t header;
+    ethash_h256_reset(&header);
+
+    // Huge pages are optional, both settings must yield a usable DAG.
+    for (int nHuge = 0; nHuge < 2; nHuge++) {
+        ethash_set_dag_memory(false, nHuge);
+        ethash_full_t full = ethash_full_new_internal(NULL, seed, nFullSize, light, NULL);
+        BOOST_REQUIRE(full);
+        BOOST_CHECK(full->file == NULL);
+        for (uint64_t nNonce = 0; nNonce < 16; nNonce++) {
+            ethash_return_value_t fromFull = ethash_full_compute(full, header, nNonce);
+            ethash_return_value_t fromLight = ethash_light_compute_internal(light, nFullSize, header, nNonce);
+            BOOST_CHECK(fromFull.success && fromLight.success);
+            BOOST_CHECK(memcmp(&fromFull.result, &fromLight.result, sizeof(fromFull.result)) == 0);
+        }
+        ethash_full_delete(full);
+    }
+
+    ethash_set_dag_memory(DEFAULT_DAG_FILE, DEFAULT_DAG_HUGEPAGES);
+    ethash_light_delete(light);
+}
+
+BOOST_AUTO_TEST_CASE(full_search_finds_first_below_boundary)
+{
+    const uint64_t nCacheSize = 256 * sizeof(node);
+    const uint64_t nFullSize = 4096 * sizeof(node);
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    ethash_light_t light = ethash_light_new_internal(nCacheSize, &seed);
+    BOOST_REQUIRE(light);
+    ethash_set_dag_memory(false, false);
+    ethash_full_t full = ethash_full_new_internal(NULL, seed, nFullSize, light, NULL);
+    BOOST_REQUIRE(full);
+    ethash_h256_t header;
+    ethash_h256_reset(&header);
+
+    // The lowest result among the first 64 nonces as the boundary
+    const uint64_t nStart = 1000;
+    uint64_t nBest = nStart;
+    ethash_return_value_t best = ethash_full_compute(full, header, nStart);
+    for (uint64_t nNonce = nStart + 1; nNonce < nStart + 64; nNonce++) {
+        ethash_return_value_t r = ethash_full_compute(full, header, nNonce);
+        if (memcmp(r.result.b, best.result.b, 32) < 0) {
+            best = r;
+            nBest = nNonce;
+        }
+    }
+
+    uint64_t nNonce = 0;
+    ethash_return_value_t found;
+    BOOST_CHECK(ethash_full_search(full, header, nStart, 64, &best.result, &nNonce, &found));
+    BOOST_CHECK_EQUAL(nNonce, nBest);
+    BOOST_CHECK(memcmp(&found.mix_hash, &best.mix_hash, sizeof(found.mix_hash)) == 0);
+    BOOST_CHECK(!ethash_full_search(full, header, nStart, nBest - nStart, &best.result, &nNonce, &found));
+
+    // A NUMA replica is an independent copy that finds the same nonce
+    ethash_full_t replica = ethash_full_replicate(full);
+    BOOST_REQUIRE(replica);
+    BOOST_CHECK(replica->data != full->data);
+    BOOST_CHECK(memcmp(replica->data, full->data, nFullSize) == 0);
+    ethash_full_delete(full);
+    nNonce = 0;
+    BOOST_CHECK(ethash_full_search(replica, header, nStart, 64, &best.result, &nNonce, &found));
+    BOOST_CHECK_EQUAL(nNonce, nBest);
+    full = replica;
+
+    ethash_full_delete(full);
+    ethash_set_dag_memory(DEFAULT_DAG_FILE, DEFAULT_DAG_HUGEPAGES);
+    ethash_light_delete(light);
+}
+
+static boost::filesystem::path DagFile(const boost::filesystem::path& dir, const ethash_h256_t& seed)
+{
+    char name[DAG_MUTABLE_NAME_MAX_SIZE];
+    BOOST_REQUIRE(ethash_io_mutable_name(ETHASH_REVISION, &seed, name));
+    return dir / name;
+}
+
+BOOST_AUTO_TEST_CASE(dag_file_shared_and_pruned)
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test_ethash_%%%%%%%%");
+    boost::filesystem::create_directories(dir);
+    const uint64_t nCacheSize = 256 * sizeof(node);
+    const uint64_t nFullSize = 4096 * sizeof(node);
+    ethash_h256_t seed;
+    ethash_h256_reset(&seed);
+    seed.b[0] = 3;
+    ethash_light_t light = ethash_light_new_internal(nCacheSize, &seed);
+    BOOST_REQUIRE(light);
+    ethash_h256_t header;
+    ethash_h256_reset(&header);
+
+    // A new DAG only appears under its final name once complete.
+    ethash_full_t full = ethash_full_new_internal(dir.string().c_str(), seed, nFullSize, light, NULL);
+    BOOST_REQUIRE(full);
+    BOOST_CHECK(boost::filesystem::exists(DagFile(dir, seed)));
+    size_t nFiles = std::distance(boost::filesystem::directory_iterator(dir), boost::filesystem::directory_iterator());
+    BOOST_CHECK_EQUAL(nFiles, 1U);
+
+    // A second user maps the complete file read only and sees the same data.
+    ethash_full_t shared = ethash_full_new_internal(dir.string().c_str(), seed, nFullSize, light, NULL);
+    BOOST_REQUIRE(shared);
+    BOOST_CHECK(memcmp(full->data, shared->data, nFullSize) == 0);
+    ethash_return_value_t r1 = ethash_full_compute(full, header, 7);
+    ethash_return_value_t r2 = ethash_full_compute(shared, header, 7);
+    BOOST_CHECK(memcmp(&r1.result, &r2.result, sizeof(r1.result)) == 0);
+    ethash_full_delete(shared);
+    ethash_full_delete(full);
+    ethash_light_delete(light);
+
+    // Only DAGs older than the previous epoch are removed.
+    ethash_h256_t epochSeed;
+    ethash_h256_reset(&epochSeed);
+    std::vector<boost::filesystem::path> vEpochFiles;
+    for (int nEpoch = 0; nEpoch < 4; nEpoch++) {
+        vEpochFiles.push_back(DagFile(dir, epochSeed));
+        boost::filesystem::ofstream(vEpochFiles.back()) << "dag";
+        SHA3_256(&epochSeed, (uint8_t*)&epochSeed, 32);
+    }
+    ethash_io_remove_stale(dir.string().c_str(), 3);
+    BOOST_CHECK(!boost::filesystem::exists(vEpochFiles[0]));
+    BOOST_CHECK(!boost::filesystem::exists(vEpochFiles[1]));
+    BOOST_CHECK(boost::filesystem::exists(vEpochFiles[2]));
+    BOOST_CHECK(boost::filesystem::exists(vEpochFiles[3]));
+
+    boost::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(light_cache_file_reused_and_checked)
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test_ethash_%%%%%%%%");
+    ethash_set_dag_memory(true, DEFAULT_DAG_HUGEPAGES);
+
+    // The first start computes the cache and saves it.
+    ethash_light_t computed = ethash_light_new_in(dir.string().c_str(), 0);
+    BOOST_REQUIRE(computed);
+    BOOST_CHECK(computed->map == NULL);
+    size_t nFiles = std::distance(boost::filesystem::directory_iterator(dir), boost::filesystem::directory_iterator());
+    BOOST_CHECK_EQUAL(nFiles, 1U);
+    boost::filesystem::path file = boost::filesystem::directory_iterator(dir)->path();
+
+    // The next maps it instead.
+    ethash_light_t mapped = ethash_light_new_in(dir.string().c_str(), 0);
+    BOOST_REQUIRE(mapped);
+    BOOST_CHECK(mapped->map != NULL);
+    BOOST_CHECK_EQUAL(mapped->cache_size, computed->cache_size);
+    BOOST_CHECK(memcmp(mapped->cache, computed->cache, computed->cache_size) == 0);
+    ethash_h256_t header;
+    ethash_h256_reset(&header);
+    ethash_return_value_t r1 = ethash_light_compute(computed, header, 7);
+    ethash_return_value_t r2 = ethash_light_compute(mapped, header, 7);
+    BOOST_CHECK(memcmp(&r1.result, &r2.result, sizeof(r1.result)) == 0);
+    ethash_light_delete(mapped);
+
+    // A damaged file fails its checksum, the cache is computed and saved again.
+    {
+        boost::filesystem::fstream stream(file, std::ios::in | std::ios::out | std::ios::binary);
+        stream.seekg(sizeof(ethash_light_header_t) + 1000);
+        char c = stream.get();
+        stream.seekp(sizeof(ethash_light_header_t) + 1000);
+        stream.put(~c);
+    }
+    ethash_light_t recomputed = ethash_light_new_in(dir.string().c_str(), 0);
+    BOOST_REQUIRE(recomputed);
+    BOOST_CHECK(recomputed->map == NULL);
+    BOOST_CHECK(memcmp(recomputed->cache, computed->cache, computed->cache_size) == 0);
+    ethash_light_delete(recomputed);
+    mapped = ethash_light_new_in(dir.string().c_str(), 0);
+    BOOST_REQUIRE(mapped);
+    BOOST_CHECK(mapped->map != NULL);
+    ethash_light_delete(mapped);
+
+    ethash_light_delete(computed);
+    ethash_set_dag_memory(false, DEFAULT_DAG_HUGEPAGES);
+    boost::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "flathashmap.h"
+
+#include "hasher.h"
+#include "random.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(flathashmap_tests, BasicTestingSetup)
+
+/* Only a few distinct hashes, so that keys pile up in long runs that wrap around the end */
+struct WeakHasher
+{
+    size_t operator()(int n) const { return (n % 5) * 3 + 13; }
+};
+
+template <typename Hasher>
+static void CheckAgainstMap(int nKeys, int nOps)
+{
+    FlatHashMap<int, int, Hasher> flat;
+    std::map<int, int> ref;
+    for (int i = 0; i < nOps; i++) {
+        int nKey = insecure_rand() % nKeys;
+        switch (insecure_rand() % 4) {
+        case 0:
+            flat[nKey] = i;
+            ref[nKey] = i;
+            break;
+        case 1: {
+            bool fInserted = flat.insert(std::make_pair(nKey, i)).second;
+            BOOST_CHECK_EQUAL(fInserted, ref.insert(std::make_pair(nKey, i)).second);
+            break;
+        }
+        case 2:
+            BOOST_CHECK_EQUAL(flat.erase(nKey), ref.erase(nKey));
+            break;
+        case 3: {
+            typename FlatHashMap<int, int, Hasher>::iterator it = flat.find(nKey);
+            if (it != flat.end())
+                flat.erase(it);
+            ref.erase(nKey);
+            break;
+        }
+        }
+        BOOST_CHECK_EQUAL(flat.size(), ref.size());
+    }
+
+    for (int nKey = 0; nKey < nKeys; nKey++) {
+        typename FlatHashMap<int, int, Hasher>::const_iterator it = flat.find(nKey);
+        std::map<int, int>::const_iterator itRef = ref.find(nKey);
+        BOOST_CHECK_EQUAL(it == flat.end(), itRef == ref.end());
+        if (it != flat.end() && itRef != ref.end())
+            BOOST_CHECK_EQUAL(it->second, itRef->second);
+    }
+
+    // Iterating visits every entry once
+    std::map<int, int> visited;
+    for (typename FlatHashMap<int, int, Hasher>::const_iterator it = flat.begin(); it != flat.end(); ++it)
+        BOOST_CHECK(visited.insert(*it).second);
+    BOOST_CHECK(visited == ref);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_random_operations)
+{
+    seed_insecure_rand(true);
+    CheckAgainstMap<std::hash<int> >(1000, 20000);
+    CheckAgainstMap<WeakHasher>(60, 5000);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_uint256)
+{
+    FlatHashMap<uint256, int, SaltedUint256Hasher> map;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(uint256()) == map.end());
+    BOOST_CHECK_EQUAL(map.erase(uint256()), 0U);
+
+    std::vector<uint256> vKeys;
+    for (int i = 0; i < 1000; i++)
+        vKeys.push_back(GetRandHash());
+    map.reserve(vKeys.size());
+    size_t nCapacity = map.capacity();
+    for (size_t i = 0; i < vKeys.size(); i++)
+        BOOST_CHECK(map.emplace(vKeys[i], i).second);
+    // Reserving made room for all of them
+    BOOST_CHECK_EQUAL(map.capacity(), nCapacity);
+    BOOST_CHECK_EQUAL(map.size(), vKeys.size());
+    for (size_t i = 0; i < vKeys.size(); i++) {
+        BOOST_CHECK_EQUAL(map.count(vKeys[i]), 1U);
+        BOOST_CHECK_EQUAL(map[vKeys[i]], (int)i);
+    }
+    BOOST_CHECK_EQUAL(map.count(GetRandHash()), 0U);
+    BOOST_CHECK(memusage::DynamicUsage(map) >= map.capacity() * (sizeof(uint32_t) + sizeof(std::pair<uint256, int>)));
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK_EQUAL(map.capacity(), 0U);
+    BOOST_CHECK(map.begin() == map.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 #include "policy/policy.h"
 #include "txmempool.h"
 #include "util.h"
+#include "utilstrencodings.h"
 
 #include "test/test_bitcoin.h"
 
@@ -411,8 +412,8 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     CheckSort<ancestor_score>(pool, sortedOrder);
 
     /* after tx6 is mined, tx7 should move up in the sort */
-    std::vector<CTransaction> vtx;
-    vtx.push_back(tx6);
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(tx6));
     std::list<CTransaction> dummy;
     pool.removeForBlock(vtx, 1, dummy, false);
 
@@ -449,9 +450,12 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     BOOST_CHECK(pool.exists(tx1.GetHash()));
     BOOST_CHECK(pool.exists(tx2.GetHash()));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // should remove the lower-feerate transaction
+    std::vector<CTransactionRef> vtxEvicted;
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4, NULL, &vtxEvicted); // should remove the lower-feerate transaction
     BOOST_CHECK(pool.exists(tx1.GetHash()));
     BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(vtxEvicted.size(), 1U);
+    BOOST_CHECK(vtxEvicted[0]->GetHash() == tx2.GetHash());
 
     pool.addUnchecked(tx2.GetHash(), entry.FromTx(tx2, &pool));
     CMutableTransaction tx3 = CMutableTransaction();
@@ -548,7 +552,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
     std::list<CTransaction> conflicts;
     SetMockTime(42);
     SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
@@ -578,4 +582,261 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAddressIndexTest)
+{
+    TestMemPoolEntryHelper entry;
+    uint160 hashA(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    uint160 hashB(ParseHex("a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4"));
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(hashA) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txParent.vout[0].nValue = 33000LL;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(2);
+    txChild.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(hashB) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txChild.vout[0].nValue = 11000LL;
+    txChild.vout[1].scriptPubKey = CScript() << OP_HASH160 << ToByteVector(hashB) << OP_EQUAL;
+    txChild.vout[1].nValue = 22000LL;
+
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    *view.ModifyCoins(txParent.GetHash()) = CCoins(txParent, 1);
+
+    CTxMemPool testPool(CFeeRate(0));
+    LOCK(testPool.cs);
+    testPool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+    std::vector<CIndexAddress> vPrevAddresses(1, GetIndexAddress(txParent.vout[0].scriptPubKey));
+    testPool.addAddressIndex(entry.FromTx(txChild), view, vPrevAddresses);
+    testPool.addSpentIndex(entry.FromTx(txChild), view, vPrevAddresses);
+
+    CMempoolAddressIndex::snapshot_type spending = testPool.getAddressDeltas(hashA, 1);
+    BOOST_CHECK_EQUAL(spending->size(), 1);
+    BOOST_CHECK_EQUAL(spending->front().second.amount, -33000LL);
+    BOOST_CHECK(spending->front().second.prevhash == txParent.GetHash());
+    BOOST_CHECK_EQUAL(testPool.getAddressDeltas(hashB, 1)->size(), 1);
+    BOOST_CHECK_EQUAL(testPool.getAddressDeltas(hashB, 2)->size(), 1);
+    BOOST_CHECK(testPool.getAddressDeltas(hashA, 2)->empty());
+
+    CSpentIndexKey key(txParent.GetHash(), 0);
+    CSpentIndexValue value;
+    BOOST_CHECK(testPool.getSpentIndex(key, value));
+    BOOST_CHECK(value.txid == txChild.GetHash());
+    BOOST_CHECK_EQUAL(value.blockHeight, -1);
+    BOOST_CHECK_EQUAL(value.addressType, 1);
+    BOOST_CHECK(value.addressHash == hashA);
+
+    std::vector<CSpentIndexKey> keys;
+    keys.push_back(CSpentIndexKey(txChild.GetHash(), 0));
+    keys.push_back(key);
+    std::vector<CSpentIndexValue> values;
+    testPool.getSpentIndex(keys, values);
+    BOOST_CHECK_EQUAL(values.size(), 2);
+    BOOST_CHECK(values[0].IsNull());
+    BOOST_CHECK(values[1].txid == txChild.GetHash());
+
+    // The block pass classifies the same outputs as the single script helper
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(txParent));
+    vtx.push_back(MakeTransactionRef(txChild));
+    CBlockIndexAddresses outputAddresses(vtx);
+    BOOST_CHECK_EQUAL(outputAddresses.Output(0, 0).type, 1);
+    BOOST_CHECK(outputAddresses.Output(0, 0).hashBytes == hashA);
+    BOOST_CHECK_EQUAL(outputAddresses.Output(1, 0).type, 1);
+    BOOST_CHECK_EQUAL(outputAddresses.Output(1, 1).type, 2);
+    BOOST_CHECK(outputAddresses.Output(1, 1).hashBytes == hashB);
+    BOOST_CHECK_EQUAL(GetIndexAddress(txChild.vin[0].scriptSig).type, 0);
+
+    // Removing the transaction takes its entries out, a list handed out before stays as it was
+    std::list<CTransaction> removed;
+    testPool.removeRecursive(txChild, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK(testPool.getAddressDeltas(hashA, 1)->empty());
+    BOOST_CHECK(testPool.getAddressDeltas(hashB, 1)->empty());
+    BOOST_CHECK_EQUAL(spending->size(), 1);
+    BOOST_CHECK(!testPool.getSpentIndex(key, value));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestryTraversalTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A diamond: tx1 is reached through both tx2 and tx3 from tx4
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        tx1.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx1.vout[i].nValue = 10 * COIN;
+    }
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.FromTx(tx2));
+
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 1);
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.FromTx(tx3));
+
+    CMutableTransaction tx4 = CMutableTransaction();
+    tx4.vin.resize(2);
+    tx4.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx4.vin[1].prevout = COutPoint(tx3.GetHash(), 0);
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 20 * COIN;
+    pool.addUnchecked(tx4.GetHash(), entry.FromTx(tx4));
+
+    CTxMemPool::txiter it4 = pool.mapTx.find(tx4.GetHash());
+    BOOST_CHECK_EQUAL(it4->GetCountWithAncestors(), 4);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx1.GetHash())->GetCountWithDescendants(), 4);
+
+    // Each ancestor is listed once, and both outputs agree
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CTxMemPool::vecEntries vAncestors;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*it4, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+    BOOST_CHECK_EQUAL(vAncestors.size(), 3);
+    CTxMemPool::setEntries setAncestors;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*it4, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+    BOOST_CHECK(setAncestors == CTxMemPool::setEntries(vAncestors.begin(), vAncestors.end()));
+
+    // The ancestor count limit counts tx1 once as well
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*it4, vAncestors, 4, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*it4, vAncestors, 3, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+
+    CTxMemPool::vecEntries vDescendants;
+    pool.CalculateDescendants(pool.mapTx.find(tx1.GetHash()), vDescendants);
+    BOOST_CHECK_EQUAL(vDescendants.size(), 4);
+    BOOST_CHECK(vDescendants[0]->GetTx().GetHash() == tx1.GetHash());
+    BOOST_CHECK(vDescendants.back() == it4);
+
+    // Confirming tx1 takes it out of the ancestor state of the rest once
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(tx1));
+    std::list<CTransaction> dummyConflicted;
+    pool.removeForBlock(vtx, 1, dummyConflicted);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx4.GetHash())->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx2.GetHash())->GetCountWithAncestors(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).Time(100).FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(20000LL).Time(200).FromTx(tx2));
+
+    // A first snapshot holds the whole mempool
+    CMempoolSnapshot snapshot;
+    pool.GetSnapshot(0, snapshot);
+    BOOST_CHECK(snapshot.fComplete);
+    BOOST_CHECK_EQUAL(snapshot.vAdded.size(), 2);
+    BOOST_CHECK(snapshot.vRemoved.empty());
+    BOOST_FOREACH(const CMempoolSnapshotEntry& e, snapshot.vAdded) {
+        if (e.txid == tx2.GetHash()) {
+            BOOST_CHECK_EQUAL(e.nFee, 20000LL);
+            BOOST_CHECK_EQUAL(e.nTime, 200);
+            BOOST_CHECK_EQUAL(e.nCountWithAncestors, 2);
+            BOOST_CHECK_EQUAL(e.nModFeesWithAncestors, 30000LL);
+        }
+    }
+
+    // Nothing changed since
+    uint64_t nSequence = snapshot.nSequence;
+    pool.GetSnapshot(nSequence, snapshot);
+    BOOST_CHECK(!snapshot.fComplete);
+    BOOST_CHECK(snapshot.vAdded.empty() && snapshot.vRemoved.empty());
+
+    // The delta holds what was removed and added since
+    std::list<CTransaction> removed;
+    pool.removeRecursive(tx2, removed);
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.FromTx(tx3));
+    pool.GetSnapshot(nSequence, snapshot);
+    BOOST_CHECK(!snapshot.fComplete);
+    BOOST_CHECK_EQUAL(snapshot.vAdded.size(), 1);
+    BOOST_CHECK(snapshot.vAdded[0].txid == tx3.GetHash());
+    BOOST_CHECK_EQUAL(snapshot.vRemoved.size(), 1);
+    BOOST_CHECK(snapshot.vRemoved[0] == tx2.GetHash());
+
+    // A sequence number the mempool has not reached gets the whole mempool
+    pool.GetSnapshot(snapshot.nSequence + 1, snapshot);
+    BOOST_CHECK(snapshot.fComplete);
+    BOOST_CHECK_EQUAL(snapshot.vAdded.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(DisconnectedBlockTransactionsTest)
+{
+    // Two blocks of two transactions each, the second spending the first
+    std::vector<CTransactionRef> vBlock1, vBlock2;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 10 * COIN;
+    for (int i = 0; i < 4; i++) {
+        tx.vout[0].scriptPubKey = CScript() << i << OP_EQUAL;
+        (i < 2 ? vBlock1 : vBlock2).push_back(MakeTransactionRef(tx));
+        tx.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+    }
+
+    // Disconnected tip first, they come out in block order
+    DisconnectedBlockTransactions disconnectpool;
+    disconnectpool.addForBlock(vBlock2);
+    disconnectpool.addForBlock(vBlock1);
+    BOOST_CHECK(disconnectpool.DynamicMemoryUsage() > 0);
+    std::vector<uint256> vOrder;
+    BOOST_FOREACH(const CTransactionRef& ptx, disconnectpool.GetQueuedTx())
+        vOrder.push_back(ptx->GetHash());
+    BOOST_CHECK_EQUAL(vOrder.size(), 4);
+    BOOST_CHECK(vOrder[0] == vBlock1[0]->GetHash() && vOrder[1] == vBlock1[1]->GetHash());
+    BOOST_CHECK(vOrder[2] == vBlock2[0]->GetHash() && vOrder[3] == vBlock2[1]->GetHash());
+
+    // A block connected again takes its transactions out
+    disconnectpool.removeForBlock(vBlock1);
+    BOOST_CHECK_EQUAL(disconnectpool.GetQueuedTx().size(), 2);
+    BOOST_CHECK(disconnectpool.popLast()->GetHash() == vBlock2[1]->GetHash());
+    BOOST_CHECK_EQUAL(disconnectpool.GetQueuedTx().size(), 1);
+
+    disconnectpool.clear();
+    BOOST_CHECK(disconnectpool.GetQueuedTx().empty());
+    BOOST_CHECK_EQUAL(disconnectpool.DynamicMemoryUsage(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,12 @@
 #include "streams.h"
 #include "net.h"
 #include "chainparams.h"
+#include "crypto/common.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -164,4 +170,165 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(recv_buffer_pool)
+{
+    CRecvBufferPool pool(2048);
+    CSerializeData data;
+
+    // Rounded up to the size class, and handed out again once released
+    pool.Get(data, 300);
+    BOOST_CHECK_EQUAL(data.capacity(), 512U);
+    const char* pch = data.data();
+    data.resize(300);
+    pool.Release(data);
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK_EQUAL(pool.GetIdleBytes(), 512U);
+    pool.Get(data, 400);
+    BOOST_CHECK(data.data() == pch);
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK_EQUAL(pool.GetIdleBytes(), 0U);
+
+    // A buffer between classes only serves the smaller one
+    data.reserve(1000);
+    pool.Release(data);
+    pool.Get(data, 600);
+    BOOST_CHECK_EQUAL(pool.GetIdleBytes(), 1000U);
+    BOOST_CHECK(data.capacity() >= 1024U);
+
+    // No more than the limit is kept idle
+    pool.Release(data);
+    BOOST_CHECK(pool.GetIdleBytes() <= 2048U);
+    CSerializeData data2(4096);
+    pool.Release(data2);
+    BOOST_CHECK(pool.GetIdleBytes() <= 2048U);
+    BOOST_CHECK_EQUAL(data2.capacity(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(cnode_receive_buffer_accounting)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+    size_t nTotalBefore = TotalRecvBufferSize();
+
+    CSerializeData payload(1000, 'x');
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), NetMsgType::TX, payload.size());
+    ss.write(payload.data(), payload.size());
+    {
+        LOCK(pnode->cs_vRecvMsg);
+        // Split in the header and in the payload
+        BOOST_CHECK(pnode->ReceiveMsgBytes(&ss[0], 10));
+        BOOST_CHECK(pnode->ReceiveMsgBytes(&ss[10], 500));
+        BOOST_CHECK(pnode->ReceiveMsgBytes(&ss[510], ss.size() - 510));
+        BOOST_REQUIRE_EQUAL(pnode->vRecvMsg.size(), 1U);
+        const CNetMessage& msg = pnode->vRecvMsg.front();
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), NetMsgType::TX);
+        BOOST_CHECK(std::equal(payload.begin(), payload.end(), msg.vRecv.begin()));
+        BOOST_CHECK_EQUAL(TotalRecvBufferSize(), nTotalBefore + msg.vRecv.capacity());
+
+        pnode->vRecvMsg.clear();
+        BOOST_CHECK_EQUAL(TotalRecvBufferSize(), nTotalBefore);
+    }
+    delete pnode;
+}
+
+BOOST_AUTO_TEST_CASE(cnode_receive_into_payload)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+
+    CSerializeData payload(1000);
+    for (size_t i = 0; i < payload.size(); i++)
+        payload[i] = i % 251;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), NetMsgType::TX, payload.size());
+    ss.write(payload.data(), payload.size());
+    {
+        LOCK(pnode->cs_vRecvMsg);
+        unsigned int nSpace;
+        // No message, then only a header
+        BOOST_CHECK(pnode->GetRecvPayloadBuffer(1, nSpace) == NULL);
+        BOOST_CHECK(pnode->ReceiveMsgBytes(&ss[0], CMessageHeader::HEADER_SIZE + 100));
+        // Less missing than asked for
+        BOOST_CHECK(pnode->GetRecvPayloadBuffer(901, nSpace) == NULL);
+
+        size_t nPos = CMessageHeader::HEADER_SIZE + 100;
+        while (char* pch = pnode->GetRecvPayloadBuffer(1, nSpace)) {
+            unsigned int nBytes = std::min<unsigned int>(nSpace, 300);
+            memcpy(pch, &ss[nPos], nBytes);
+            pnode->ReceivedPayloadBytes(nBytes);
+            nPos += nBytes;
+        }
+        BOOST_CHECK_EQUAL(nPos, ss.size());
+        BOOST_REQUIRE_EQUAL(pnode->vRecvMsg.size(), 1U);
+        const CNetMessage& msg = pnode->vRecvMsg.front();
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK(msg.nTime != 0);
+        BOOST_CHECK(std::equal(payload.begin(), payload.end(), msg.vRecv.begin()));
+    }
+    delete pnode;
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(cnode_send_shared_payload)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CNode* pnode = new CNode(fds[0], CAddress(CService(ipv4Addr, 7777), NODE_NETWORK), "", true);
+
+    // Larger than the socket buffer, so that it is sent in parts
+    CSerializeData data(300000);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = i * 7;
+    CSerializeData dataCopy(data);
+    CSharedPayloadRef payload(new CSharedPayload(data));
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK(payload->size() == dataCopy.size());
+
+    pnode->PushMessage(NetMsgType::PING, (uint64_t)42);
+    pnode->PushMessageShared(NetMsgType::BLOCK, payload);
+    pnode->PushMessageShared(NetMsgType::BLOCK, payload);
+
+    // Read everything, sending the rest of the queue as the socket takes it
+    std::vector<char> vReceived;
+    size_t nExpected = 3 * CMessageHeader::HEADER_SIZE + 8 + 2 * dataCopy.size();
+    while (vReceived.size() < nExpected) {
+        char buf[65536];
+        ssize_t nBytes = recv(fds[1], buf, sizeof(buf), 0);
+        BOOST_REQUIRE(nBytes > 0);
+        vReceived.insert(vReceived.end(), buf, buf + nBytes);
+        LOCK(pnode->cs_vSend);
+        SocketSendData(pnode);
+    }
+    BOOST_CHECK_EQUAL(vReceived.size(), nExpected);
+    BOOST_CHECK(pnode->vSendMsg.empty());
+    BOOST_CHECK_EQUAL(pnode->nSendSize, 0U);
+
+    CDataStream ss(vReceived, SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    uint64_t nNonce;
+    ss >> hdr >> nNonce;
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), NetMsgType::PING);
+    BOOST_CHECK_EQUAL(nNonce, 42U);
+    uint256 hash = Hash(dataCopy.begin(), dataCopy.end());
+    for (int i = 0; i < 2; i++) {
+        ss >> hdr;
+        BOOST_CHECK_EQUAL(hdr.GetCommand(), NetMsgType::BLOCK);
+        BOOST_CHECK_EQUAL(hdr.nMessageSize, dataCopy.size());
+        BOOST_CHECK_EQUAL(hdr.nChecksum, ReadLE32(hash.begin()));
+        BOOST_CHECK(std::equal(dataCopy.begin(), dataCopy.end(), ss.begin()));
+        ss.ignore(dataCopy.size());
+    }
+    BOOST_CHECK(ss.empty());
+
+    delete pnode;
+    close(fds[1]);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -95,4 +95,83 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(CheckProofOfWork_test)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    Consensus::Params params = Params().GetConsensus();
+    const unsigned int nBits = 0x1b0404cb;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits);
+
+    // Inclusive of the target, with the bytes compared from the most significant one
+    BOOST_CHECK(CheckProofOfWork(ArithToUint256(bnTarget), nBits, params));
+    BOOST_CHECK(CheckProofOfWork(ArithToUint256(bnTarget - 1), nBits, params));
+    BOOST_CHECK(CheckProofOfWork(ArithToUint256(arith_uint256(1)), nBits, params));
+    BOOST_CHECK(!CheckProofOfWork(ArithToUint256(bnTarget + 1), nBits, params));
+    BOOST_CHECK(!CheckProofOfWork(ArithToUint256(bnTarget << 1), nBits, params));
+    BOOST_CHECK(!CheckProofOfWork(uint256(), nBits, params));
+
+    // Targets that are out of range, whatever the hash
+    BOOST_CHECK(!CheckProofOfWork(ArithToUint256(arith_uint256(1)), 0, params));
+    BOOST_CHECK(!CheckProofOfWork(ArithToUint256(arith_uint256(1)), 0x04923456, params));
+    BOOST_CHECK(!CheckProofOfWork(ArithToUint256(arith_uint256(1)), 0xff123456, params));
+
+    // A cached target is not reused for another powLimit
+    uint256 target;
+    BOOST_CHECK(DeriveTarget(nBits, params.powLimit, target));
+    BOOST_CHECK(target == ArithToUint256(bnTarget));
+    params.powLimit = ArithToUint256(bnTarget - 1);
+    BOOST_CHECK(!DeriveTarget(nBits, params.powLimit, target));
+    BOOST_CHECK(!CheckProofOfWork(ArithToUint256(arith_uint256(1)), nBits, params));
+}
+
+/* The remembered work of a parent matches walking its ancestors again */
+BOOST_AUTO_TEST_CASE(get_next_work_cached)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& params = Params().GetConsensus();
+    const unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
+    const int nInterval = params.DifficultyAdjustmentInterval();
+
+    const int nBlocks = 3 * nInterval;
+    std::vector<uint256> vHashes(nBlocks);
+    std::vector<CBlockIndex> blocks(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        vHashes[i] = GetRandHash();
+        blocks[i].phashBlock = &vHashes[i];
+        blocks[i].pprev = i ? &blocks[i - 1] : NULL;
+        blocks[i].nHeight = i;
+        blocks[i].nTime = 1269211443 + i * params.nPowTargetSpacing;
+        // Mostly min-difficulty blocks, as on a test network
+        blocks[i].nBits = GetRand(8) ? nProofOfWorkLimit : 0x1f0fffff;
+        blocks[i].BuildSkip();
+    }
+
+    for (int j = 0; j < 1000; j++) {
+        const CBlockIndex* pindexLast = &blocks[GetRand(nBlocks)];
+        CBlockHeader header;
+        header.nTime = pindexLast->nTime + params.nPowTargetSpacing;
+
+        unsigned int nExpected;
+        if ((pindexLast->nHeight + 1) % nInterval != 0) {
+            const CBlockIndex* pindex = pindexLast;
+            while (pindex->pprev && pindex->nHeight % nInterval != 0 && pindex->nBits == nProofOfWorkLimit)
+                pindex = pindex->pprev;
+            nExpected = pindex->nBits;
+        } else {
+            const CBlockIndex* pindexFirst = pindexLast;
+            for (int i = 0; i < nInterval - (pindexLast->nHeight + 1 == nInterval ? 1 : 0); i++)
+                pindexFirst = pindexFirst->pprev;
+            nExpected = CalculateNextWorkRequired(pindexLast, pindexFirst->GetBlockTime(), params);
+        }
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), nExpected);
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), nExpected);
+
+        // A late block may still be mined at the minimum difficulty, remembered parent or not
+        header.nTime = pindexLast->nTime + params.nPowTargetSpacing * 2 + 1;
+        if ((pindexLast->nHeight + 1) % nInterval != 0)
+            BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), nProofOfWorkLimit);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -157,6 +157,20 @@ public:
         pre_vector.swap(pre_vector_alt);
         test();
     }
+
+    void move() {
+        real_vector = std::move(real_vector_alt);
+        real_vector_alt.clear();
+        pre_vector = std::move(pre_vector_alt);
+        pre_vector_alt.clear();
+        test();
+    }
+
+    void copy() {
+        real_vector = real_vector_alt;
+        pre_vector = pre_vector_alt;
+        test();
+    }
 };
 
 BOOST_AUTO_TEST_CASE(PrevectorTestInt)
@@ -221,8 +235,50 @@ BOOST_AUTO_TEST_CASE(PrevectorTestInt)
             if (((r >> 15) % 64) == 3) {
                 test.swap();
             }
+            if (((r >> 15) % 128) == 4) {
+                test.copy();
+            }
+            if (((r >> 15) % 256) == 5) {
+                test.move();
+            }
         }
     }
 }
 
+BOOST_AUTO_TEST_CASE(PrevectorTestArena)
+{
+    typedef prevector<8, int> pretype;
+    std::vector<std::vector<int> > vReal(100);
+    std::vector<pretype> vPre(100);
+    {
+        PrevectorArenaScope arena;
+        for (int i = 0; i < 100; i++) {
+            for (int j = 0; j < i; j++) {
+                vReal[i].push_back(insecure_rand());
+                vPre[i].push_back(vReal[i].back());
+            }
+            BOOST_CHECK(vPre[i].capacity() >= vPre[i].size());
+        }
+        // Larger than the arena hands out, from the heap
+        vReal.push_back(std::vector<int>(PrevectorArena::MAX_BLOCK_SIZE, 7));
+        vPre.push_back(pretype(PrevectorArena::MAX_BLOCK_SIZE, 7));
+        // Moving storage between the arena and the heap
+        vPre[50].swap(vPre[100]);
+        vReal[50].swap(vReal[100]);
+        vPre[60].shrink_to_fit();
+        vPre[70].resize(4);
+        vReal[70].resize(4);
+        vPre[70].shrink_to_fit();
+    }
+    // The vectors outlive their arena, and keep growing on the heap
+    for (int i = 0; i < 100; i += 3) {
+        vReal[i].push_back(i);
+        vPre[i].push_back(i);
+    }
+    std::vector<pretype> vCopy(vPre);
+    vPre.clear();
+    for (size_t i = 0; i < vReal.size(); i++)
+        BOOST_CHECK(vCopy[i] == pretype(vReal[i].begin(), vReal[i].end()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
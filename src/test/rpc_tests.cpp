@@ -12,6 +12,7 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include <univalue.h>
@@ -332,4 +333,48 @@ BOOST_AUTO_TEST_CASE(rpc_convert_values_generatetoaddress)
     BOOST_CHECK_EQUAL(result[2].get_int(), 9);
 }
 
+static void AppendChunk(std::vector<std::string>* pvChunks, const std::string& strChunk)
+{
+    pvChunks->push_back(strChunk);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_stream_writer)
+{
+    std::vector<std::string> vChunks;
+    JSONStreamWriter writer(boost::bind(AppendChunk, &vChunks, _1));
+
+    UniValue expected(UniValue::VOBJ);
+    UniValue arr(UniValue::VARR);
+    writer.BeginObject();
+    writer.Key("a\"b");
+    writer.Value(1);
+    expected.push_back(Pair("a\"b", 1));
+    writer.Key("list");
+    writer.BeginArray();
+    for (int i = 0; i < 20000; i++) {
+        std::string str = strprintf("entry %d", i);
+        writer.Value(str);
+        arr.push_back(str);
+    }
+    writer.BeginObject();
+    writer.EndObject();
+    arr.push_back(UniValue(UniValue::VOBJ));
+    writer.EndArray();
+    expected.push_back(Pair("list", arr));
+    writer.Key("id");
+    writer.Value(NullUniValue);
+    expected.push_back(Pair("id", NullUniValue));
+    writer.EndObject();
+
+    // Big enough to be handed on in several pieces before the end
+    BOOST_CHECK(vChunks.size() > 1);
+    BOOST_CHECK(vChunks[0].size() >= RPC_STREAM_FLUSH_SIZE);
+    std::string strAll;
+    BOOST_FOREACH(const std::string& strChunk, vChunks)
+        strAll += strChunk;
+    strAll += writer.Release();
+    BOOST_CHECK(writer.Release().empty());
+    BOOST_CHECK_EQUAL(strAll, expected.write());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -116,4 +116,94 @@ BOOST_AUTO_TEST_CASE(manythreads)
     BOOST_CHECK_EQUAL(counterSum, 200);
 }
 
+static void pushTask(boost::mutex& mutex, std::vector<int>& order, int n)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    order.push_back(n);
+}
+
+BOOST_AUTO_TEST_CASE(priorities)
+{
+    // Due tasks run most urgent first, then in time order
+    CScheduler scheduler;
+    boost::mutex mutex;
+    std::vector<int> order;
+    boost::chrono::system_clock::time_point past = boost::chrono::system_clock::now() - boost::chrono::seconds(10);
+    scheduler.schedule(boost::bind(&pushTask, boost::ref(mutex), boost::ref(order), 3), past, CScheduler::PRIORITY_LOW);
+    scheduler.schedule(boost::bind(&pushTask, boost::ref(mutex), boost::ref(order), 1), past + boost::chrono::seconds(2), CScheduler::PRIORITY_NORMAL);
+    scheduler.schedule(boost::bind(&pushTask, boost::ref(mutex), boost::ref(order), 0), past + boost::chrono::seconds(1), CScheduler::PRIORITY_HIGH);
+    scheduler.schedule(boost::bind(&pushTask, boost::ref(mutex), boost::ref(order), 2), past + boost::chrono::seconds(3), CScheduler::PRIORITY_NORMAL);
+
+    scheduler.stop(true);
+    scheduler.serviceQueue();
+
+    BOOST_CHECK_EQUAL(order.size(), 4U);
+    for (int i = 0; i < (int)order.size(); i++)
+        BOOST_CHECK_EQUAL(order[i], i);
+}
+
+static void waitTask(boost::mutex& mutex, boost::condition_variable& cond, bool& fReleased, int& nReleased)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    cond.wait_for(lock, boost::chrono::seconds(10), [&fReleased] { return fReleased; });
+    if (fReleased)
+        nReleased++;
+}
+
+static void releaseTask(boost::mutex& mutex, boost::condition_variable& cond, bool& fReleased)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReleased = true;
+    }
+    cond.notify_all();
+}
+
+BOOST_AUTO_TEST_CASE(low_priority_leaves_a_thread)
+{
+    // Two low priority tasks wait for a normal one; they may only take one of the
+    // two threads, so the normal one runs on the other and lets them finish
+    CScheduler scheduler;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fReleased = false;
+    int nReleased = 0;
+    boost::chrono::system_clock::time_point now = boost::chrono::system_clock::now();
+    for (int i = 0; i < 2; i++)
+        scheduler.schedule(boost::bind(&waitTask, boost::ref(mutex), boost::ref(cond), boost::ref(fReleased), boost::ref(nReleased)), now, CScheduler::PRIORITY_LOW);
+    scheduler.schedule(boost::bind(&releaseTask, boost::ref(mutex), boost::ref(cond), boost::ref(fReleased)), now + boost::chrono::milliseconds(50));
+
+    boost::thread_group threads;
+    for (int i = 0; i < 2; i++)
+        threads.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    scheduler.stop(true);
+    threads.join_all();
+
+    BOOST_CHECK_EQUAL(nReleased, 2);
+}
+
+static void countTask(int& n)
+{
+    n++;
+}
+
+BOOST_AUTO_TEST_CASE(task_stats)
+{
+    CScheduler scheduler;
+    int n = 0;
+    boost::chrono::system_clock::time_point now = boost::chrono::system_clock::now();
+    for (int i = 0; i < 3; i++)
+        scheduler.schedule(boost::bind(&countTask, boost::ref(n)), now, CScheduler::PRIORITY_NORMAL, "count");
+    scheduler.schedule(boost::bind(&countTask, boost::ref(n)), now);
+
+    scheduler.stop(true);
+    scheduler.serviceQueue();
+
+    BOOST_CHECK_EQUAL(n, 4);
+    std::map<std::string, CSchedulerTaskStats> stats = scheduler.getTaskStats();
+    BOOST_CHECK_EQUAL(stats.size(), 1U);
+    BOOST_CHECK_EQUAL(stats["count"].nRuns, 3U);
+    BOOST_CHECK(stats["count"].nTotalMicros >= stats["count"].nMaxMicros);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -170,6 +170,8 @@ void DoTest(const CScript& scriptPubKey, const CScript& scriptSig, const CScript
     CMutableTransaction tx2 = tx;
     BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, &scriptWitness, flags, MutableTransactionSignatureChecker(&tx, 0, txCredit.vout[0].nValue), &err) == expect, message);
     BOOST_CHECK_MESSAGE(err == scriptError, std::string(FormatScriptError(err)) + " where " + std::string(FormatScriptError((ScriptError_t)scriptError)) + " expected: " + message);
+    BOOST_CHECK_MESSAGE(VerifyScriptGeneric(scriptSig, scriptPubKey, &scriptWitness, flags, MutableTransactionSignatureChecker(&tx, 0, txCredit.vout[0].nValue), &err) == expect, message);
+    BOOST_CHECK_MESSAGE(err == scriptError, std::string(FormatScriptError(err)) + " where " + std::string(FormatScriptError((ScriptError_t)scriptError)) + " expected from the interpreter: " + message);
 #if defined(HAVE_CONSENSUS_LIB)
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
     stream << tx2;
@@ -1443,4 +1445,129 @@ BOOST_AUTO_TEST_CASE(script_FindAndDelete)
     BOOST_CHECK(s == expect);
 }
 
+static std::vector<unsigned char> SignSpend(const CKey& key, const CScript& scriptCode, const CMutableTransaction& tx, CAmount nValue, SigVersion sigversion)
+{
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(SignatureHash(scriptCode, tx, 0, SIGHASH_ALL, nValue, sigversion), vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+
+    // Leave most signatures valid, break the rest in the ways the checks tell apart
+    switch (insecure_rand() % 8) {
+    case 0: vchSig.clear(); break;
+    case 1: vchSig[vchSig.size() / 2] ^= 1; break;
+    case 2: vchSig.back() = 0; break;
+    case 3: vchSig.insert(vchSig.begin() + 2, 0); break;
+    default: break;
+    }
+    return vchSig;
+}
+
+static CScript PushAll(const std::vector<std::vector<unsigned char> >& vPushes)
+{
+    CScript script;
+    BOOST_FOREACH(const std::vector<unsigned char>& vch, vPushes) {
+        if (insecure_rand() % 16 == 0 && vch.size() < 256) {
+            // Non-minimal push
+            script.insert(script.end(), OP_PUSHDATA1);
+            script.insert(script.end(), (unsigned char)vch.size());
+            script.insert(script.end(), vch.begin(), vch.end());
+        } else {
+            script << vch;
+        }
+    }
+    if (insecure_rand() % 16 == 0)
+        script << OP_NOP;
+    return script;
+}
+
+BOOST_AUTO_TEST_CASE(script_standard_fast_paths)
+{
+    // P2PKH, P2SH multisig and P2WPKH spends skip the interpreter in
+    // VerifyScript; whatever they hold, the outcome must be the interpreter's.
+    static const unsigned int vFlags[] = {
+        SCRIPT_VERIFY_NONE,
+        SCRIPT_VERIFY_P2SH,
+        SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC,
+        SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_LOW_S | SCRIPT_VERIFY_NULLDUMMY | SCRIPT_VERIFY_NULLFAIL,
+        SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS,
+        SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_LOW_S | SCRIPT_VERIFY_NULLDUMMY |
+            SCRIPT_VERIFY_MINIMALDATA | SCRIPT_VERIFY_NULLFAIL | SCRIPT_VERIFY_CLEANSTACK | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_WITNESS_PUBKEYTYPE,
+    };
+    seed_insecure_rand(true);
+    std::vector<CKey> keys(4);
+    for (unsigned int i = 0; i < keys.size(); i++)
+        keys[i].MakeNewKey(i % 2 == 0);
+
+    int nValid = 0;
+    for (int i = 0; i < 600; i++) {
+        const CKey& key = keys[insecure_rand() % keys.size()];
+        CScript scriptPubKey;
+        CScript scriptSig;
+        CScriptWitness witness;
+        CAmount nValue = 1 + insecure_rand() % 1000;
+        CMutableTransaction txCredit = BuildCreditingTransaction(CScript(), nValue);
+        CMutableTransaction tx = BuildSpendingTransaction(CScript(), witness, txCredit);
+
+        std::vector<std::vector<unsigned char> > vPushes;
+        switch (i % 3) {
+        case 0: {
+            // The key signing is occasionally not the one paid to
+            CPubKey pubkey = key.GetPubKey();
+            scriptPubKey = GetScriptForDestination(insecure_rand() % 8 ? pubkey.GetID() : keys[0].GetPubKey().GetID());
+            vPushes.push_back(SignSpend(key, scriptPubKey, tx, nValue, SIGVERSION_BASE));
+            vPushes.push_back(ToByteVector(pubkey));
+            break;
+        }
+        case 1: {
+            int nKeys = 1 + insecure_rand() % 3;
+            int nRequired = 1 + insecure_rand() % nKeys;
+            std::vector<CPubKey> pubkeys;
+            for (int k = 0; k < nKeys; k++)
+                pubkeys.push_back(keys[k].GetPubKey());
+            CScript redeemScript = GetScriptForMultisig(nRequired, pubkeys);
+            scriptPubKey = GetScriptForDestination(CScriptID(redeemScript));
+            vPushes.push_back(std::vector<unsigned char>(insecure_rand() % 8 ? 0 : 1, 1));
+            // Signatures from consecutive keys, sometimes too few or out of order
+            int nSigs = nRequired - (insecure_rand() % 8 == 0);
+            int nFirst = insecure_rand() % (nKeys - nRequired + 1);
+            for (int k = 0; k < nSigs; k++)
+                vPushes.push_back(SignSpend(keys[nFirst + k], redeemScript, tx, nValue, SIGVERSION_BASE));
+            if (nSigs > 1 && insecure_rand() % 8 == 0)
+                std::swap(vPushes[1], vPushes[2]);
+            vPushes.push_back(std::vector<unsigned char>(redeemScript.begin(), redeemScript.end()));
+            break;
+        }
+        case 2: {
+            CPubKey pubkey = key.GetPubKey();
+            scriptPubKey = GetScriptForWitness(GetScriptForDestination(pubkey.GetID()));
+            CScript scriptCode = GetScriptForDestination(pubkey.GetID());
+            witness.stack.push_back(SignSpend(key, scriptCode, tx, nValue, SIGVERSION_WITNESS_V0));
+            witness.stack.push_back(ToByteVector(pubkey));
+            if (insecure_rand() % 16 == 0)
+                vPushes.push_back(std::vector<unsigned char>());
+            break;
+        }
+        }
+        scriptSig = PushAll(vPushes);
+        if (i % 3 != 2 && insecure_rand() % 16 == 0)
+            witness.stack.push_back(std::vector<unsigned char>(1, 1));
+        if (i % 3 == 2 && insecure_rand() % 16 == 0)
+            witness.stack.push_back(std::vector<unsigned char>());
+        tx.vin[0].scriptSig = scriptSig;
+        tx.wit.vtxinwit[0].scriptWitness = witness;
+
+        for (unsigned int f = 0; f < ARRAYLEN(vFlags); f++) {
+            ScriptError err, errGeneric;
+            MutableTransactionSignatureChecker checker(&tx, 0, nValue);
+            bool fResult = VerifyScript(scriptSig, scriptPubKey, &witness, vFlags[f], checker, &err);
+            bool fGeneric = VerifyScriptGeneric(scriptSig, scriptPubKey, &witness, vFlags[f], checker, &errGeneric);
+            BOOST_CHECK_EQUAL(fResult, fGeneric);
+            BOOST_CHECK_MESSAGE(err == errGeneric, std::string(FormatScriptError(err)) + " where " + std::string(FormatScriptError(errGeneric)) + " expected: " + ScriptToAsmStr(scriptSig) + " / " + ScriptToAsmStr(scriptPubKey));
+            nValid += fResult;
+        }
+    }
+    // The mutations must leave plenty of spends valid too
+    BOOST_CHECK(nValid > 600);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
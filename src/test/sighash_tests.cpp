@@ -144,6 +144,8 @@ BOOST_AUTO_TEST_CASE(sighash_test)
         uint256 sh, sho;
         sho = SignatureHashOld(scriptCode, txTo, nIn, nHashType);
         sh = SignatureHash(scriptCode, txTo, nIn, nHashType, 0, SIGVERSION_BASE);
+        PrecomputedTransactionData txdata(txTo);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, 0, SIGVERSION_BASE, &txdata) == sho);
         #if defined(PRINT_SIGHASH_JSON)
         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
         ss << txTo;
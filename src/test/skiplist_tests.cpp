@@ -100,4 +100,35 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blockindexarena_test)
+{
+    CBlockIndexArena arena;
+    std::vector<CBlockIndex*> vIndex;
+    size_t nEntries = 2 * CBlockIndexArena::CHUNK_ENTRIES + 10;
+
+    for (size_t i = 0; i < nEntries; i++) {
+        CBlockIndex index;
+        index.nHeight = i;
+        index.pprev = i ? vIndex.back() : NULL;
+        vIndex.push_back(arena.Allocate(index));
+        vIndex.back()->BuildSkip();
+    }
+    BOOST_CHECK_EQUAL(arena.size(), nEntries);
+
+    for (size_t i = 0; i < nEntries; i++) {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, (int)i);
+        // Entries of one chunk follow each other
+        if (i % CBlockIndexArena::CHUNK_ENTRIES)
+            BOOST_CHECK(vIndex[i] == vIndex[i - 1] + 1);
+    }
+    BOOST_CHECK(vIndex.back()->GetAncestor(5) == vIndex[5]);
+
+    CBlockIndexArena other;
+    other.swap(arena);
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    BOOST_CHECK_EQUAL(other.size(), nEntries);
+    other.Clear();
+    BOOST_CHECK_EQUAL(other.size(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(socketevents_tests, BasicTestingSetup)
+
+#ifndef WIN32
+static int ReadyEvents(const std::vector<std::pair<void*, int> >& vReady, void* pOwner)
+{
+    int nEvents = 0;
+    for (unsigned int i = 0; i < vReady.size(); i++)
+        if (vReady[i].first == pOwner)
+            nEvents |= vReady[i].second;
+    return nEvents;
+}
+
+static void CheckReadiness(CSocketEvents& events)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int nOwner;
+    void* pOwner = &nOwner;
+    std::vector<std::pair<void*, int> > vReady;
+
+    // Nothing to read yet
+    events.Set(fds[0], pOwner, CSocketEvents::EVENT_RECV);
+    events.Wait(0, vReady);
+    BOOST_CHECK_EQUAL(ReadyEvents(vReady, pOwner), 0);
+
+    // Readable once the other end wrote, and until it is read
+    char c = 'x';
+    BOOST_CHECK_EQUAL(write(fds[1], &c, 1), 1);
+    events.Wait(1000, vReady);
+    BOOST_CHECK_EQUAL(ReadyEvents(vReady, pOwner), CSocketEvents::EVENT_RECV);
+    events.Wait(0, vReady);
+    BOOST_CHECK_EQUAL(ReadyEvents(vReady, pOwner), CSocketEvents::EVENT_RECV);
+
+    // Not reported after switching to sending only, and writable straight away
+    events.Set(fds[0], pOwner, CSocketEvents::EVENT_SEND);
+    events.Wait(1000, vReady);
+    BOOST_CHECK_EQUAL(ReadyEvents(vReady, pOwner), CSocketEvents::EVENT_SEND);
+
+    // Nothing after unregistering
+    events.Remove(fds[0], pOwner);
+    events.Wait(0, vReady);
+    BOOST_CHECK_EQUAL(ReadyEvents(vReady, pOwner), 0);
+
+    // A hang-up shows as readable
+    events.Set(fds[0], pOwner, CSocketEvents::EVENT_RECV);
+    BOOST_CHECK_EQUAL(read(fds[0], &c, 1), 1);
+    close(fds[1]);
+    events.Wait(1000, vReady);
+    BOOST_CHECK_EQUAL(ReadyEvents(vReady, pOwner), CSocketEvents::EVENT_RECV);
+    events.Remove(fds[0], pOwner);
+    close(fds[0]);
+}
+
+static void CheckWake(CSocketEvents& events)
+{
+    std::vector<std::pair<void*, int> > vReady;
+    events.Wake();
+    events.Wake();
+    int64_t nStart = GetTimeMillis();
+    events.Wait(10000, vReady);
+    BOOST_CHECK(vReady.empty());
+    BOOST_CHECK(GetTimeMillis() - nStart < 5000);
+    // Drained, so the next wait times out
+    nStart = GetTimeMillis();
+    events.Wait(50, vReady);
+    BOOST_CHECK(vReady.empty());
+    BOOST_CHECK(GetTimeMillis() - nStart >= 40);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_default)
+{
+    CSocketEvents events;
+#if defined(__linux__)
+    BOOST_CHECK_EQUAL(std::string(events.GetMethod()), "epoll");
+#endif
+    CheckReadiness(events);
+    CheckWake(events);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_select)
+{
+    CSocketEvents events("select");
+    BOOST_CHECK_EQUAL(std::string(events.GetMethod()), "select");
+    CheckReadiness(events);
+    CheckWake(events);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,37 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(stratum_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(stratum_nonce)
+{
+    uint64_t nNonce;
+    BOOST_CHECK(ParseStratumNonce("000000000001", 0xabcd, nNonce));
+    BOOST_CHECK_EQUAL(nNonce, 0xabcd000000000001ULL);
+    BOOST_CHECK(ParseStratumNonce("0xffffffffffff", 0, nNonce));
+    BOOST_CHECK_EQUAL(nNonce, 0x0000ffffffffffffULL);
+    BOOST_CHECK(ParseStratumNonce("abc", 1, nNonce));
+    BOOST_CHECK_EQUAL(nNonce, 0x0001000000000abcULL);
+
+    // The miner must not overwrite the extranonce
+    BOOST_CHECK(!ParseStratumNonce("1000000000000", 0, nNonce));
+    BOOST_CHECK(!ParseStratumNonce("", 0, nNonce));
+    BOOST_CHECK(!ParseStratumNonce("0x", 0, nNonce));
+    BOOST_CHECK(!ParseStratumNonce("12345g", 0, nNonce));
+}
+
+BOOST_AUTO_TEST_CASE(stratum_difficulty)
+{
+    arith_uint256 target = ~arith_uint256(0) >> 32;
+    BOOST_CHECK_EQUAL(StratumDifficulty(target), 1.0);
+    BOOST_CHECK_EQUAL(StratumDifficulty(target >> 4), 16.0);
+    BOOST_CHECK_EQUAL(StratumDifficulty(arith_uint256(0)), 0.0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
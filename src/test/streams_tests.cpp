@@ -64,4 +64,42 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
             std::string(ds.begin(), ds.end()));  
 }         
 
+BOOST_AUTO_TEST_CASE(streams_span_reader)
+{
+    CDataStream ds(SER_DISK, CLIENT_VERSION);
+    ds << (uint8_t)1 << (uint32_t)0x12345678 << std::string("span") << (uint64_t)42;
+    std::vector<char> vchPlain(ds.begin(), ds.end());
+
+    CSpanReader reader(&vchPlain[0], &vchPlain[0] + vchPlain.size(), SER_DISK, CLIENT_VERSION);
+    uint8_t a;
+    uint32_t b;
+    std::string c;
+    uint64_t d;
+    reader >> a >> b >> c >> d;
+    BOOST_CHECK_EQUAL(a, 1);
+    BOOST_CHECK_EQUAL(b, 0x12345678U);
+    BOOST_CHECK_EQUAL(c, "span");
+    BOOST_CHECK_EQUAL(d, 42U);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> a, std::ios_base::failure);
+
+    // Undoes the XOR of CDataStream, also for reads that start in the middle of the key
+    std::vector<unsigned char> key;
+    key += 0x0f, 0xf0, 0x3c;
+    ds.Xor(key);
+    std::vector<char> vchXored(ds.begin(), ds.end());
+    CSpanReader xored(&vchXored[0], &vchXored[0] + vchXored.size(), SER_DISK, CLIENT_VERSION, &key);
+    xored >> a >> b >> c >> d;
+    BOOST_CHECK_EQUAL(a, 1);
+    BOOST_CHECK_EQUAL(b, 0x12345678U);
+    BOOST_CHECK_EQUAL(c, "span");
+    BOOST_CHECK_EQUAL(d, 42U);
+
+    CSpanReader skip(&vchXored[0], &vchXored[0] + vchXored.size(), SER_DISK, CLIENT_VERSION, &key);
+    skip.ignore(5);
+    skip >> c;
+    BOOST_CHECK_EQUAL(c, "span");
+    BOOST_CHECK_EQUAL(skip.size(), 8U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "chainparams.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "crypto/ethash/ethashWraper/EthashAux.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
@@ -19,6 +20,7 @@
 #include "ui_interface.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
+#include "script/sigcache.h"
 
 #include "test/testutil.h"
 
@@ -34,10 +36,14 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
         ECC_Start();
         SetupEnvironment();
         SetupNetworking();
+        InitSignatureCache();
+        InitScriptExecutionCache();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(chainName);
         noui_connect();
+        // Keep DAGs and light caches off the disk of whoever runs the tests
+        EthashAux::setDagMemory(false, DEFAULT_DAG_HUGEPAGES);
 }
 
 BasicTestingSetup::~BasicTestingSetup()
@@ -57,6 +63,10 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         mapArgs["-datadir"] = pathTemp.string();
         mempool.setSanityCheck(1.0);
         pblocktree = new CBlockTreeDB(1 << 20, true);
+        ptxindexdb = new CIndexDB("txindex", 1 << 20, true);
+        paddressindexdb = new CIndexDB("addressindex", 1 << 20, true);
+        pspentindexdb = new CIndexDB("spentindex", 1 << 20, true);
+        ptimestampindexdb = new CIndexDB("timestampindex", 1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
         pcoinsTip = new CCoinsViewCache(pcoinsdbview);
         InitBlockIndex(chainparams);
@@ -66,8 +76,10 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
             BOOST_CHECK(ok);
         }
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
-            threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
+            threadGroup.create_thread(boost::bind(&ThreadScriptCheck, -1));
+            threadGroup.create_thread(boost::bind(&ThreadMempoolScriptCheck, -1));
+        }
         RegisterNodeSignals(GetNodeSignals());
 }
 
@@ -80,6 +92,10 @@ TestingSetup::~TestingSetup()
         delete pcoinsTip;
         delete pcoinsdbview;
         delete pblocktree;
+        delete ptxindexdb;
+        delete paddressindexdb;
+        delete pspentindexdb;
+        delete ptimestampindexdb;
         boost::filesystem::remove_all(pathTemp);
 }
 
@@ -92,7 +108,7 @@ TestChain100Setup::TestChain100Setup() : TestingSetup(CBaseChainParams::REGTEST)
     {
         std::vector<CMutableTransaction> noTxns;
         CBlock b = CreateAndProcessBlock(noTxns, scriptPubKey);
-        coinbaseTxns.push_back(b.vtx[0]);
+        coinbaseTxns.push_back(*b.vtx[0]);
     }
 }
 
@@ -110,7 +126,7 @@ TestChain100Setup::CreateAndProcessBlock(const std::vector<CMutableTransaction>&
     // Replace mempool-selected txns with just coinbase plus passed-in txns:
     block.vtx.resize(1);
     BOOST_FOREACH(const CMutableTransaction& tx, txns)
-        block.vtx.push_back(tx);
+        block.vtx.push_back(MakeTransactionRef(tx));
     // IncrementExtraNonce creates a valid coinbase and merkleRoot
     unsigned int extraNonce = 0;
     IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
@@ -135,7 +151,7 @@ CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(CMutableTransaction &tx, CTxMemPo
     return FromTx(txn, pool);
 }
 
-CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(CTransaction &txn, CTxMemPool *pool) {
+CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(const CTransaction &txn, CTxMemPool *pool) {
     bool hasNoDependencies = pool ? pool->HasNoInputsOf(txn) : hadNoDependencies;
     // Hack to assume either its completely dependent on other mempool txs or not at all
     CAmount inChainValue = hasNoDependencies ? txn.GetValueOut() : 0;
@@ -0,0 +1,81 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "chain.h"
+#include "timestampindex.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(timestampindex_tests, BasicTestingSetup)
+
+static void BuildChain(std::vector<CBlockIndex>& vIndex, std::vector<uint256>& vHashes, CBlockIndex* pprev, const unsigned int* pTimes)
+{
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        vIndex[i].pprev = i == 0 ? pprev : &vIndex[i - 1];
+        vIndex[i].nHeight = vIndex[i].pprev ? vIndex[i].pprev->nHeight + 1 : 0;
+        vIndex[i].nTime = pTimes[i];
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].BuildSkip();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(range_follows_the_active_chain)
+{
+    // Block 3 is older than block 2 and block 4 as old as block 3's logical time
+    const unsigned int times[] = {50, 100, 110, 105, 111, 130, 140, 150};
+    std::vector<CBlockIndex> vIndex(8);
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 8; i++)
+        vHashes.push_back(ArithToUint256(arith_uint256(i + 1)));
+    BuildChain(vIndex, vHashes, NULL, times);
+
+    CTimestampRangeIndex index;
+    index.SetTip(&vIndex[7]);
+
+    std::vector<std::pair<uint256, unsigned int> > hashes;
+    index.GetRange(1000, 0, hashes);
+    // The genesis block has no logical timestamp
+    BOOST_CHECK_EQUAL(hashes.size(), 7);
+    BOOST_CHECK(hashes[0].first == vHashes[1]);
+    BOOST_CHECK_EQUAL(hashes[2].second, 111);
+    BOOST_CHECK_EQUAL(hashes[3].second, 112);
+
+    hashes.clear();
+    index.GetRange(130, 111, hashes);
+    BOOST_CHECK_EQUAL(hashes.size(), 2);
+    BOOST_CHECK(hashes[0].first == vHashes[3]);
+    BOOST_CHECK(hashes[1].first == vHashes[4]);
+
+    // A reorg to a branch off block 4 drops the blocks after it
+    const unsigned int forkTimes[] = {200, 210};
+    std::vector<CBlockIndex> vFork(2);
+    std::vector<uint256> vForkHashes;
+    vForkHashes.push_back(ArithToUint256(arith_uint256(100)));
+    vForkHashes.push_back(ArithToUint256(arith_uint256(101)));
+    BuildChain(vFork, vForkHashes, &vIndex[4], forkTimes);
+    index.SetTip(&vFork[1]);
+
+    hashes.clear();
+    index.GetRange(1000, 120, hashes);
+    BOOST_CHECK_EQUAL(hashes.size(), 2);
+    BOOST_CHECK(hashes[0].first == vForkHashes[0]);
+    BOOST_CHECK_EQUAL(hashes[1].second, 210);
+
+    // Disconnecting back to block 2
+    index.SetTip(&vIndex[2]);
+    hashes.clear();
+    index.GetRange(1000, 0, hashes);
+    BOOST_CHECK_EQUAL(hashes.size(), 2);
+
+    index.Clear();
+    hashes.clear();
+    index.GetRange(1000, 0, hashes);
+    BOOST_CHECK(hashes.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
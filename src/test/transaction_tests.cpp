@@ -505,6 +505,49 @@ BOOST_AUTO_TEST_CASE(test_big_witness_transaction) {
     threadGroup.join_all();
 }
 
+BOOST_AUTO_TEST_CASE(test_witness_hash_cache)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout.hash = GetRandHash();
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1;
+
+    // Without a witness the witness hash is the txid
+    CTransaction tx(mtx);
+    BOOST_CHECK(tx.GetWitnessHash() == tx.GetHash());
+
+    mtx.wit.vtxinwit.resize(1);
+    mtx.wit.vtxinwit[0].scriptWitness.stack.push_back(std::vector<unsigned char>(32, 1));
+    CTransaction txWit(mtx);
+    uint256 hashWitness = SerializeHash(txWit, SER_GETHASH, 0);
+    BOOST_CHECK(txWit.GetHash() == tx.GetHash());
+    BOOST_CHECK(txWit.GetWitnessHash() == hashWitness);
+    BOOST_CHECK(txWit.GetWitnessHash() == hashWitness);
+
+    // Copies and moves carry the hashes along
+    CTransaction txCopy(txWit);
+    BOOST_CHECK(txCopy.GetWitnessHash() == hashWitness);
+    CTransaction txMoved(std::move(txCopy));
+    BOOST_CHECK(txMoved.GetHash() == tx.GetHash());
+    BOOST_CHECK(txMoved.GetWitnessHash() == hashWitness);
+    tx = std::move(txMoved);
+    BOOST_CHECK(tx.GetWitnessHash() == hashWitness);
+
+    // A new witness leaves the txid and computes the witness hash again
+    tx.SetWitness(CTxWitness());
+    BOOST_CHECK(tx.GetHash() == txWit.GetHash());
+    BOOST_CHECK(tx.GetWitnessHash() == tx.GetHash());
+    tx.SetWitness(txWit.wit);
+    BOOST_CHECK(tx.GetWitnessHash() == hashWitness);
+
+    // As does reading it
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CTransaction(CMutableTransaction());
+    ss >> tx;
+    BOOST_CHECK(tx.GetWitnessHash() == tx.GetHash());
+}
+
 BOOST_AUTO_TEST_CASE(test_witness)
 {
     CBasicKeyStore keystore, keystore2;
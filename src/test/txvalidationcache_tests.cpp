@@ -83,4 +83,85 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(tx_mempool_parallel_script_checks, TestChain100Setup)
+{
+    // Transactions with many inputs have their scripts checked on the mempool
+    // check threads: a bad signature in any input must still be caught.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Mature the coinbases of the first 5 blocks
+    std::vector<CMutableTransaction> noTxns;
+    for (int i = 0; i < 4; i++)
+        CreateAndProcessBlock(noTxns, scriptPubKey);
+
+    CMutableTransaction spend;
+    spend.vin.resize(5);
+    for (unsigned int i = 0; i < spend.vin.size(); i++) {
+        spend.vin[i].prevout.hash = coinbaseTxns[i].GetHash();
+        spend.vin[i].prevout.n = 0;
+    }
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    for (unsigned int i = 0; i < spend.vin.size(); i++) {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, spend, i, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spend.vin[i].scriptSig << vchSig;
+    }
+
+    // The last input signed with the first input's signature
+    CMutableTransaction badSpend = spend;
+    badSpend.vin[4].scriptSig = spend.vin[0].scriptSig;
+    BOOST_CHECK(!ToMemPool(badSpend));
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    BOOST_CHECK(ToMemPool(spend));
+    BOOST_CHECK(mempool.exists(spend.GetHash()));
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_script_execution_cache, TestChain100Setup)
+{
+    // Once all scripts of a transaction passed inline with cacheFullScriptStore,
+    // CheckInputs skips them for the same flags, but not for other flags.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    LOCK(cs_main);
+    const CTransaction tx(spend);
+    CCoinsViewCache view(pcoinsTip);
+    PrecomputedTransactionData txdata(tx);
+    CValidationState state;
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+
+    // Queued checks are not cached: the scripts did not run yet
+    std::vector<CScriptCheck> checks;
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, true, txdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 1U);
+
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true, true, txdata, NULL));
+    checks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, false, false, txdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 0U);
+
+    checks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags | SCRIPT_VERIFY_LOW_S, false, false, txdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
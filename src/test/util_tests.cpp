@@ -12,10 +12,14 @@
 #include "utilmoneystr.h"
 #include "test/test_bitcoin.h"
 
+#include <map>
 #include <stdint.h>
 #include <vector>
 
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -571,4 +575,69 @@ BOOST_AUTO_TEST_CASE(test_ParseFixedPoint)
     BOOST_CHECK(!ParseFixedPoint("1.", 8, &amount));
 }
 
+BOOST_AUTO_TEST_CASE(util_LockHoldTimer)
+{
+    CCriticalSection cs, csOther;
+    CLockHoldTimer timer(&cs);
+    {
+        LOCK(csOther);
+        MilliSleep(20);
+    }
+    BOOST_CHECK_EQUAL(timer.GetHeldMicros(), 0);
+    {
+        LOCK(cs);
+        {
+            // Recursive locking counts once
+            LOCK(cs);
+            MilliSleep(10);
+        }
+        MilliSleep(10);
+    }
+    int64_t nHeld = timer.GetHeldMicros();
+    BOOST_CHECK(nHeld >= 20000);
+    MilliSleep(20);
+    BOOST_CHECK_EQUAL(timer.GetHeldMicros(), nHeld);
+    {
+        // A nested timer of the same lock adds to the outer one
+        CLockHoldTimer inner(&cs);
+        TRY_LOCK(cs, lockCs);
+        BOOST_CHECK(bool(lockCs));
+        MilliSleep(10);
+    }
+    BOOST_CHECK(timer.GetHeldMicros() >= nHeld + 10000);
+}
+
+static void LockProfiled(CCriticalSection* pcsProfiled)
+{
+    LOCK(*pcsProfiled);
+}
+
+BOOST_AUTO_TEST_CASE(util_LockProfile)
+{
+    CCriticalSection csProfiled;
+    fLockProfiling = true;
+    ResetLockProfile();
+    boost::thread waiter;
+    {
+        LOCK(csProfiled);
+        waiter = boost::thread(boost::bind(&LockProfiled, &csProfiled));
+        MilliSleep(20);
+    }
+    waiter.join();
+    fLockProfiling = false;
+    // Not counted
+    LockProfiled(&csProfiled);
+
+    std::map<std::string, CLockProfileStats> mapStats;
+    BOOST_FOREACH(const CLockProfileStats& stats, GetLockProfile())
+        mapStats[stats.strName] = stats;
+    BOOST_CHECK_EQUAL(mapStats["csProfiled"].nAcquired, 1U);
+    BOOST_CHECK(mapStats["csProfiled"].nHoldMicros >= 20000);
+    BOOST_CHECK_EQUAL(mapStats["*pcsProfiled"].nAcquired, 1U);
+    BOOST_CHECK_EQUAL(mapStats["*pcsProfiled"].nContended, 1U);
+    BOOST_CHECK(mapStats["*pcsProfiled"].nWaitMicros > 0);
+    BOOST_CHECK_EQUAL(mapStats["*pcsProfiled"].nMaxWaitMicros, mapStats["*pcsProfiled"].nWaitMicros);
+    BOOST_CHECK(mapStats["*pcsProfiled"].nMaxHoldMicros <= mapStats["*pcsProfiled"].nHoldMicros);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
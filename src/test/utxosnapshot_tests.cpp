@@ -0,0 +1,68 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "coins.h"
+#include "main.h"
+#include "random.h"
+#include "script/script.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(utxosnapshot_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(utxosnapshot_roundtrip)
+{
+    for (int i = 0; i < 10; i++) {
+        CCoinsModifier coins = pcoinsTip->ModifyNewCoins(GetRandHash(), false);
+        coins->nVersion = 1;
+        coins->vout.resize(i + 1);
+        coins->vout[i].nValue = i + 1;
+        coins->vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    FlushStateToDisk();
+
+    boost::filesystem::path path = pathTemp / "utxo.dat";
+    CUTXOSnapshotHeader header;
+    std::string strError;
+    BOOST_CHECK(WriteUTXOSnapshot(pcoinsTip, path, header, strError));
+    BOOST_CHECK_EQUAL(header.nTransactions, 10U);
+    BOOST_CHECK_EQUAL(header.nHeight, 0);
+    BOOST_CHECK(header.hashBlock == chainActive.Tip()->GetBlockHash());
+    // An existing file is never overwritten
+    CUTXOSnapshotHeader headerAgain;
+    BOOST_CHECK(!WriteUTXOSnapshot(pcoinsTip, path, headerAgain, strError));
+
+    CUTXOSnapshotHeader headerRead;
+    BOOST_CHECK(VerifyUTXOSnapshot(path, headerRead, strError));
+    BOOST_CHECK(headerRead.hashSerialized == header.hashSerialized);
+    BOOST_CHECK_EQUAL(headerRead.nTransactions, header.nTransactions);
+
+    // The records come back as the cursor returned them
+    CUTXOSnapshotReader reader(path);
+    BOOST_CHECK(reader.Open(strError));
+    uint256 txid;
+    CCoins coins;
+    size_t nRecords = 0;
+    while (reader.Next(txid, coins)) {
+        const CCoins* pcoins = pcoinsTip->AccessCoins(txid);
+        BOOST_CHECK(pcoins && *pcoins == coins);
+        nRecords++;
+    }
+    BOOST_CHECK_EQUAL(nRecords, 10U);
+
+    // A changed byte breaks the hash commitment
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_CHECK(file != NULL);
+    fseek(file, -1, SEEK_END);
+    int ch = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(ch ^ 0x01, file);
+    fclose(file);
+    BOOST_CHECK(!VerifyUTXOSnapshot(path, headerRead, strError));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,61 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "timestampindex.h"
+
+#include "chain.h"
+
+#include <algorithm>
+
+void CTimestampRangeIndex::SetTip(const CBlockIndex* pindexTip)
+{
+    LOCK(cs);
+    size_t nHeight = pindexTip ? pindexTip->nHeight + 1 : 0;
+    if (vBlocks.size() > nHeight) {
+        vBlocks.resize(nHeight);
+        vLogicalTimes.resize(nHeight);
+    }
+    // Drop the blocks of the old branch down to the fork point
+    while (!vBlocks.empty() && vBlocks.back() != pindexTip->GetAncestor(vBlocks.size() - 1)) {
+        vBlocks.pop_back();
+        vLogicalTimes.pop_back();
+    }
+
+    std::vector<const CBlockIndex*> vConnect;
+    for (const CBlockIndex* pindex = pindexTip; pindex && (size_t)pindex->nHeight >= vBlocks.size(); pindex = pindex->pprev)
+        vConnect.push_back(pindex);
+    vBlocks.reserve(nHeight);
+    vLogicalTimes.reserve(nHeight);
+    for (std::vector<const CBlockIndex*>::reverse_iterator it = vConnect.rbegin(); it != vConnect.rend(); ++it) {
+        // The same rule ConnectBlock uses for the database entries. The genesis block is
+        // never connected, so it has none and no part in the logical timestamps after it.
+        unsigned int logicalTS = 0;
+        if ((*it)->pprev) {
+            logicalTS = (*it)->nTime;
+            if (logicalTS <= vLogicalTimes.back())
+                logicalTS = vLogicalTimes.back() + 1;
+        }
+        vBlocks.push_back(*it);
+        vLogicalTimes.push_back(logicalTS);
+    }
+}
+
+void CTimestampRangeIndex::Clear()
+{
+    LOCK(cs);
+    vBlocks.clear();
+    vLogicalTimes.clear();
+}
+
+void CTimestampRangeIndex::GetRange(unsigned int high, unsigned int low, std::vector<std::pair<uint256, unsigned int> >& hashes) const
+{
+    LOCK(cs);
+    if (vLogicalTimes.empty())
+        return;
+    std::vector<unsigned int>::const_iterator itBegin = std::lower_bound(vLogicalTimes.begin() + 1, vLogicalTimes.end(), low);
+    std::vector<unsigned int>::const_iterator itEnd = std::lower_bound(itBegin, vLogicalTimes.end(), high);
+    hashes.reserve(hashes.size() + (itEnd - itBegin));
+    for (std::vector<unsigned int>::const_iterator it = itBegin; it != itEnd; ++it)
+        hashes.push_back(std::make_pair(vBlocks[it - vLogicalTimes.begin()]->GetBlockHash(), *it));
+}
@@ -1,8 +1,14 @@
 #ifndef BITCOIN_TIMESTAMPINDEX_H
 #define BITCOIN_TIMESTAMPINDEX_H
 
+#include "sync.h"
 #include "uint256.h"
 
+#include <utility>
+#include <vector>
+
+class CBlockIndex;
+
 struct CTimestampIndexIteratorKey {
     unsigned int timestamp;
 
@@ -123,4 +129,24 @@ struct CTimestampBlockIndexValue {
     }
 };
 
-#endif // BITCOIN_TIMESTAMPINDEX_H
\ No newline at end of file
+/**
+ * The logical timestamps of the active chain by height, computed from the block index.
+ * Logical timestamps rise strictly along a chain, so a range of them is a range of
+ * heights found by binary search, without touching the database or cs_main.
+ */
+class CTimestampRangeIndex
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<unsigned int> vLogicalTimes;
+    std::vector<const CBlockIndex*> vBlocks;
+
+public:
+    /** Follow the active chain to a new tip, dropping the blocks a reorg disconnected */
+    void SetTip(const CBlockIndex* pindexTip);
+    void Clear();
+    /** The active blocks with a logical timestamp in [low, high), oldest first */
+    void GetRange(unsigned int high, unsigned int low, std::vector<std::pair<uint256, unsigned int> >& hashes) const;
+};
+
+#endif // BITCOIN_TIMESTAMPINDEX_H
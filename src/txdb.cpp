@@ -5,43 +5,173 @@
 
 #include "txdb.h"
 
+#include "bloom.h"
+#include "blockfilter.h"
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "undo.h"
+#include "utxostats.h"
 
 #include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
 
 #include <boost/thread.hpp>
 
 using namespace std;
 
-static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
+static const char DB_COINS = 'c'; //!< whole transactions before the per-output format, only read to convert them
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
-static const char DB_ADDRESSINDEX = 'a';
+static const char DB_ADDRESSINDEX = 'a'; //!< deltas before the compact format, only read to convert them
+static const char DB_ADDRESSDELTA = 'd';
+static const char DB_ADDRESSID = 'i';
+static const char DB_ADDRESSIDNEXT = 'I';
+static const char DB_ADDRESSTXPOSITION = 'x';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
+static const char DB_ADDRESSBALANCE = 'A';
+static const char DB_ADDRESSFILTER = 'm';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_BLOCKHASHINDEX = 'z';
 static const char DB_SPENTINDEX = 'p';
+static const char DB_BLOCKFILTER = 'g';
+static const char DB_BLOCKFILTERHEADER = 'h';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_UTXO_STATS = 'S';
 static const char DB_FLAG = 'F';
+static const char DB_INDEXBUILD = 'N';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+namespace {
+/** The key of an unspent output in the coin database */
+struct CCoinKey {
+    uint256 txid;
+    uint32_t n;
+
+    CCoinKey() : n(0) {}
+    CCoinKey(const uint256 &txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/** Read the outputs of txid, from where pcursor is sought to, into coins; false if it has none */
+bool ReadCoinRecords(CDBIterator &cursor, const uint256 &txid, CCoins &coins, unsigned int *pnValueSize = NULL) {
+    coins.Clear();
+    bool fFound = false;
+    while (cursor.Valid()) {
+        std::pair<char, CCoinKey> key;
+        if (!cursor.GetKey(key) || key.first != DB_COIN || key.second.txid != txid)
+            break;
+        CCoinValue value;
+        if (!cursor.GetValue(value))
+            throw std::runtime_error("failed to read a coin database record");
+        if (coins.vout.size() <= key.second.n)
+            coins.vout.resize(key.second.n + 1);
+        coins.vout[key.second.n] = value.out;
+        coins.nHeight = value.nHeight;
+        coins.fCoinBase = value.fCoinBase;
+        coins.nVersion = value.nTxVersion;
+        if (pnValueSize)
+            *pnValueSize += cursor.GetValueSize();
+        fFound = true;
+        cursor.Next();
+    }
+    return fFound;
+}
+}
+
+/** The value of a -db<setting> argument for the database strName, false if it has none */
+static bool GetDBArg(const std::string &strArg, const std::string &strName, int64_t &nValue)
+{
+    std::map<std::string, std::vector<std::string> >::const_iterator it = mapMultiArgs.find(strArg);
+    if (it == mapMultiArgs.end())
+        return false;
+    bool fFound = false;
+    bool fNamed = false;
+    BOOST_FOREACH(const std::string &strValue, it->second) {
+        size_t nColon = strValue.find(':');
+        if (nColon == std::string::npos) {
+            if (fNamed)
+                continue;
+            // A bare flag, such as -dbcompression, means 1
+            nValue = strValue.empty() ? 1 : atoi64(strValue);
+        } else if (strValue.substr(0, nColon) == strName) {
+            nValue = atoi64(strValue.substr(nColon + 1));
+            fNamed = true;
+        } else {
+            continue;
+        }
+        fFound = true;
+    }
+    return fFound;
+}
+
+CDBOptions GetDBOptions(const std::string &strName, const CDBOptions &defaults)
+{
+    CDBOptions options(defaults);
+    int64_t nValue;
+    if (GetDBArg("-dbcompression", strName, nValue))
+        options.fCompression = nValue != 0;
+    if (GetDBArg("-dbblocksize", strName, nValue))
+        options.nBlockSize = std::max(MIN_DB_BLOCK_SIZE_KB, std::min(nValue, MAX_DB_BLOCK_SIZE_KB)) * 1024;
+    if (GetDBArg("-dbmaxopenfiles", strName, nValue))
+        options.nMaxOpenFiles = std::max((int64_t)DEFAULT_DB_MAX_OPEN_FILES, std::min(nValue, (int64_t)MAX_DB_MAX_OPEN_FILES));
+    if (GetDBArg("-dbbloombits", strName, nValue))
+        options.nBloomBits = std::max((int64_t)0, std::min(nValue, (int64_t)MAX_DB_BLOOM_BITS));
+    return options;
+}
+
+/** Index databases compress well and are not obfuscated, so they are compressed by default */
+static CDBOptions GetIndexDBDefaults()
+{
+    CDBOptions options;
+    options.fCompression = true;
+    return options;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, GetDBOptions("chainstate")) 
 {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(make_pair(DB_COIN, CCoinKey(txid, 0)));
+    return ReadCoinRecords(*pcursor, txid, coins);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(make_pair(DB_COIN, CCoinKey(txid, 0)));
+    std::pair<char, CCoinKey> key;
+    return pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COIN && key.second.txid == txid;
+}
+
+void CCoinsViewDB::GetCoinsMany(const std::vector<uint256> &txids, std::vector<CCoins> &coins, std::vector<bool> &found, int nThreads) const {
+    coins.resize(txids.size());
+    // Not a vector<bool>, the threads write next to each other
+    std::vector<char> vFound(txids.size(), 0);
+    ParallelForEach(txids.size(), nThreads, [&](size_t i) {
+        vFound[i] = GetCoins(txids[i], coins[i]);
+        return true;
+    });
+    found.assign(vFound.begin(), vFound.end());
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -51,30 +181,122 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
+bool CCoinsViewDB::ReadUTXOStats(CUTXOStats &stats) const {
+    return db.Read(DB_UTXO_STATS, stats);
+}
+
+bool CCoinsViewDB::WriteUTXOStats(const CUTXOStats &stats) {
+    return db.Write(DB_UTXO_STATS, stats);
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    bool fOk = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return fOk;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    size_t nOutputsWritten = 0;
+    size_t nOutputsErased = 0;
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+            const CCoins &coins = it->second.coins;
+            std::vector<bool> vStored(coins.vout.size(), false);
+            // Only outputs that are spent or differ from their record are written, a fresh
+            // entry has no records at all
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+                pcursor->Seek(make_pair(DB_COIN, CCoinKey(it->first, 0)));
+                while (pcursor->Valid()) {
+                    std::pair<char, CCoinKey> key;
+                    if (!pcursor->GetKey(key) || key.first != DB_COIN || key.second.txid != it->first)
+                        break;
+                    uint32_t n = key.second.n;
+                    if (!coins.IsAvailable(n)) {
+                        batch.Erase(key);
+                        nOutputsErased++;
+                    } else {
+                        CCoinValue value;
+                        vStored[n] = pcursor->GetValue(value) && value == CCoinValue(coins, n);
+                    }
+                    pcursor->Next();
+                }
+            }
+            for (uint32_t n = 0; n < coins.vout.size(); n++) {
+                if (coins.IsAvailable(n) && !vStored[n]) {
+                    batch.Write(make_pair(DB_COIN, CCoinKey(it->first, n)), CCoinValue(coins, n));
+                    nOutputsWritten++;
+                }
+            }
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database, %u outputs written and %u erased...\n",
+        (unsigned int)changed, (unsigned int)count, (unsigned int)nOutputsWritten, (unsigned int)nOutputsErased);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid())
+        return true;
+    std::pair<char, uint256> key;
+    if (!pcursor->GetKey(key) || key.first != DB_COINS)
+        return true;
+
+    LogPrintf("Upgrading the coin database to one record per output...\n");
+    uiInterface.ShowProgress(_("Upgrading coin database..."), 0);
+    CDBBatch batch(db);
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    int nReportDone = 0;
+    // Each batch converts whole transactions, an interrupted upgrade carries on where it stopped
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_COINS)
+            break;
+        CCoins coins;
+        if (!pcursor->GetValue(coins))
+            return error("%s: failed to read the coins of %s", __func__, key.second.ToString());
+        for (uint32_t n = 0; n < coins.vout.size(); n++) {
+            if (coins.IsAvailable(n)) {
+                batch.Write(make_pair(DB_COIN, CCoinKey(key.second, n)), CCoinValue(coins, n));
+                nOutputs++;
+            }
+        }
+        batch.Erase(key);
+        if (++nTransactions % 10000 == 0) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+            // Transactions are ordered by txid, its first byte tells how far along we are
+            int nPercentageDone = (int)(*key.second.begin()) * 100 / 256;
+            uiInterface.ShowProgress(_("Upgrading coin database..."), nPercentageDone);
+            if (nPercentageDone >= nReportDone + 10) {
+                nReportDone = nPercentageDone / 10 * 10;
+                LogPrintf("[%d%%]...", nReportDone);
+            }
+        }
+        pcursor->Next();
+    }
+    if (!db.WriteBatch(batch))
+        return false;
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("%s: converted %u transactions into %u outputs\n", __func__, nTransactions, nOutputs);
+    return !ShutdownRequested();
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, GetDBOptions("blockindex")) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -103,17 +325,28 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
-    // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    i->pcursor->Seek(make_pair(DB_COIN, CCoinKey()));
+    // Gather the outputs of the first transaction
+    i->ReadNext();
     return i;
 }
 
+void CCoinsViewDBCursor::ReadNext()
+{
+    std::pair<char, CCoinKey> key;
+    fValid = pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COIN;
+    if (!fValid)
+        return;
+    txidTmp = key.second.txid;
+    nValueSizeTmp = 0;
+    ReadCoinRecords(*pcursor, txidTmp, coinsTmp, &nValueSizeTmp);
+}
+
 bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
-        key = keyTmp.second;
+    if (fValid) {
+        key = txidTmp;
         return true;
     }
     return false;
@@ -121,24 +354,26 @@ bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 
 bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
 {
-    return pcursor->GetValue(coins);
+    if (!fValid)
+        return false;
+    coins = coinsTmp;
+    return true;
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
 {
-    return pcursor->GetValueSize();
+    return nValueSizeTmp;
 }
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return fValid;
 }
 
 void CCoinsViewDBCursor::Next()
 {
-    pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
-        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    // The cursor is at the first output of the next transaction already
+    ReadNext();
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -153,22 +388,99 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
+//! Size of the records the address filter is kept in
+static const size_t ADDRESS_FILTER_CHUNK_SIZE = 1 << 20;
+
+CIndexDB::CIndexDB(const std::string &strNameIn, size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "indexes" / strNameIn, nCacheSize, fMemory, fWipe, false, GetDBOptions(strNameIn, GetIndexDBDefaults())), strName(strNameIn) {
+}
+
+CIndexDB::~CIndexDB() {
+}
+
+bool CIndexDB::MoveFromBlockTree(CBlockTreeDB &blocktree) {
+    std::string strPrefixes;
+    if (strName == "txindex")
+        strPrefixes = {DB_TXINDEX};
+    else if (strName == "addressindex")
+        strPrefixes = {DB_ADDRESSINDEX, DB_ADDRESSDELTA, DB_ADDRESSID, DB_ADDRESSIDNEXT, DB_ADDRESSTXPOSITION, DB_ADDRESSUNSPENTINDEX, DB_ADDRESSBALANCE};
+    else if (strName == "spentindex")
+        strPrefixes = {DB_SPENTINDEX};
+    else if (strName == "timestampindex")
+        strPrefixes = {DB_TIMESTAMPINDEX, DB_BLOCKHASHINDEX};
+
+    CDBBatch batch(*this);
+    CDBBatch batchErase(blocktree);
+    size_t nMoved = 0;
+    for (char chPrefix : strPrefixes) {
+        boost::scoped_ptr<CDBIterator> pcursor(blocktree.NewIterator());
+        for (pcursor->Seek(chPrefix); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            std::string strKey = pcursor->GetKeyRaw();
+            if (strKey.empty() || strKey[0] != chPrefix)
+                break;
+            batch.WriteRaw(strKey, pcursor->GetValueRaw());
+            batchErase.EraseRaw(strKey);
+            // The copies are synced before the originals go, an interrupted move is picked up again
+            if (++nMoved % 10000 == 0) {
+                if (!WriteBatch(batch, true) || !blocktree.WriteBatch(batchErase))
+                    return false;
+                batch.Clear();
+                batchErase.Clear();
+            }
+        }
+    }
+    if (!WriteBatch(batch, true) || !blocktree.WriteBatch(batchErase))
+        return false;
+    if (nMoved)
+        LogPrintf("%s: moved %u %s entries out of the block tree database\n", __func__, nMoved, strName);
+    return true;
+}
+
+bool CIndexDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+bool CIndexDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
+bool CIndexDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
     return Read(make_pair(DB_SPENTINDEX, key), value);
 }
 
-bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
+bool CIndexDB::ReadSpentIndex(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values) {
+    values.resize(keys.size());
+    std::vector<size_t> vOrder;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (values[i].IsNull())
+            vOrder.push_back(i);
+    }
+    // Seeking in key order keeps the iterator moving forward through the table files
+    std::sort(vOrder.begin(), vOrder.end(), [&keys](size_t a, size_t b) {
+        int nCmp = memcmp(keys[a].txid.begin(), keys[b].txid.begin(), keys[a].txid.size());
+        return nCmp < 0 || (nCmp == 0 && keys[a].outputIndex < keys[b].outputIndex);
+    });
+
+    CDBSnapshot snapshot(*this);
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator(snapshot));
+    for (size_t i : vOrder) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CSpentIndexKey> dbKey(DB_SPENTINDEX, keys[i]);
+        pcursor->Seek(dbKey);
+        std::pair<char, CSpentIndexKey> key;
+        if (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_SPENTINDEX &&
+            key.second.txid == keys[i].txid && key.second.outputIndex == keys[i].outputIndex) {
+            if (!pcursor->GetValue(values[i]))
+                return error("failed to get spent index value");
+        }
+    }
+    return true;
+}
+
+bool CIndexDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
@@ -180,7 +492,7 @@ bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey,
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect) {
+bool CIndexDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
@@ -192,20 +504,39 @@ bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddres
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
-                                          std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
+bool CIndexDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
+                                      std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
+    return ScanAddressUnspentIndex(addressHash, type, NULL,
+        [&unspentOutputs](const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+            unspentOutputs.push_back(make_pair(key, value));
+            return true;
+        });
+}
 
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+bool CIndexDB::ScanAddressUnspentIndex(uint160 addressHash, int type, const CAddressUnspentKey *pFrom,
+                                       const boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> &fn,
+                                       const CDBSnapshot *pSnapshot) {
 
-    pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    // Outputs are only indexed together with the deltas that give their address an id
+    if (!MayHaveAddress(addressHash, type))
+        return true;
+
+    boost::scoped_ptr<CDBIterator> pcursor(pSnapshot ? NewIterator(*pSnapshot) : NewIterator());
+
+    if (pFrom) {
+        pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, *pFrom));
+    } else {
+        pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    }
 
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char, CAddressUnspentKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX && key.second.hashBytes == addressHash) {
+        if (pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX && key.second.type == (unsigned int)type && key.second.hashBytes == addressHash) {
             CAddressUnspentValue nValue;
             if(pcursor->GetValue(nValue)) {
-                unspentOutputs.push_back(make_pair(key.second, nValue));
+                if (!fn(key.second, nValue))
+                    break;
                 pcursor->Next();
             } else {
                 return error("failed to get adddress unspent value");
@@ -219,46 +550,418 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
 
 }
 
-bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+namespace {
+/** The activity of one address within a single block */
+struct CAddressBlockDelta {
+    CAmount balance;
+    CAmount received;
+    std::set<uint256> txids;
+    int height;
+
+    CAddressBlockDelta() : balance(0), received(0), height(0) {}
+};
+
+typedef std::map<std::pair<unsigned int, uint160>, CAddressBlockDelta> AddressBlockDeltaMap;
+
+void GetAddressBlockDeltas(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect, AddressBlockDeltaMap &mapDeltas) {
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        CAddressBlockDelta &delta = mapDeltas[make_pair(it->first.type, it->first.hashBytes)];
+        delta.balance += it->second;
+        if (it->second > 0)
+            delta.received += it->second;
+        delta.txids.insert(it->first.txhash);
+        delta.height = it->first.blockHeight;
+    }
+}
+}
+
+namespace {
+/** Hands out address ids, looking up the ones assigned before and remembering those of the batch being built */
+class CAddressIdAllocator {
+public:
+    CAddressIdAllocator(CIndexDB &dbIn, CDBBatch &batchIn) : db(dbIn), batch(batchIn), nNextId(0), fUpdated(false) {
+        db.Read(DB_ADDRESSIDNEXT, nNextId);
+    }
+
+    uint32_t Get(unsigned int type, const uint160 &hash) {
+        std::pair<unsigned int, uint160> address(type, hash);
+        std::map<std::pair<unsigned int, uint160>, uint32_t>::const_iterator it = mapIds.find(address);
+        if (it != mapIds.end())
+            return it->second;
+        uint32_t id;
+        if (!db.ReadAddressId(hash, type, id)) {
+            id = nNextId++;
+            batch.Write(make_pair(DB_ADDRESSID, CAddressIndexIteratorKey(type, hash)), id);
+            db.AddToAddressFilter(hash, type);
+            fUpdated = true;
+        }
+        mapIds[address] = id;
+        return id;
+    }
+
+    /** Queue the next free id, call before writing the batch */
+    void Flush() {
+        if (fUpdated)
+            batch.Write(DB_ADDRESSIDNEXT, nNextId);
+        fUpdated = false;
+    }
+
+    /** Forget the ids of the batch once it is written */
+    void Clear() {
+        mapIds.clear();
+    }
+
+private:
+    CIndexDB &db;
+    CDBBatch &batch;
+    uint32_t nNextId;
+    bool fUpdated;
+    std::map<std::pair<unsigned int, uint160>, uint32_t> mapIds;
+};
+}
+
+bool CIndexDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+    CAddressIdAllocator ids(*this, batch);
+    std::set<CAddressTxPositionKey> setPositions;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        batch.Write(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(ids.Get(it->first.type, it->first.hashBytes), it->first)), it->second);
+        CAddressTxPositionKey position(it->first.blockHeight, it->first.txindex);
+        if (setPositions.insert(position).second)
+            batch.Write(make_pair(DB_ADDRESSTXPOSITION, position), it->first.txhash);
+    }
+    ids.Flush();
+
+    AddressBlockDeltaMap mapDeltas;
+    GetAddressBlockDeltas(vect, mapDeltas);
+    for (AddressBlockDeltaMap::const_iterator it=mapDeltas.begin(); it!=mapDeltas.end(); it++) {
+        CAddressIndexIteratorKey key(it->first.first, it->first.second);
+        CAddressBalanceValue value;
+        Read(make_pair(DB_ADDRESSBALANCE, key), value);
+        // A block connected again after an unclean shutdown is already counted
+        if (!value.IsNull() && value.lastHeight >= it->second.height)
+            continue;
+        if (value.IsNull())
+            value.firstHeight = it->second.height;
+        value.balance += it->second.balance;
+        value.received += it->second.received;
+        value.txCount += it->second.txids.size();
+        value.lastHeight = it->second.height;
+        batch.Write(make_pair(DB_ADDRESSBALANCE, key), value);
+    }
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect) {
+bool CIndexDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect) {
+    CDBBatch batch(*this);
+    std::map<std::pair<unsigned int, uint160>, uint32_t> mapIds;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        uint32_t id;
+        if (!ReadAddressId(it->first.hashBytes, it->first.type, id))
+            continue;
+        mapIds[make_pair(it->first.type, it->first.hashBytes)] = id;
+        batch.Erase(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(id, it->first)));
+        batch.Erase(make_pair(DB_ADDRESSTXPOSITION, CAddressTxPositionKey(it->first.blockHeight, it->first.txindex)));
+    }
+
+    AddressBlockDeltaMap mapDeltas;
+    GetAddressBlockDeltas(vect, mapDeltas);
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    for (AddressBlockDeltaMap::const_iterator it=mapDeltas.begin(); it!=mapDeltas.end(); it++) {
+        CAddressIndexIteratorKey key(it->first.first, it->first.second);
+        CAddressBalanceValue value;
+        Read(make_pair(DB_ADDRESSBALANCE, key), value);
+        // Nothing to undo if the block was never counted or already taken out
+        if (value.IsNull() || value.lastHeight < it->second.height)
+            continue;
+        value.balance -= it->second.balance;
+        value.received -= it->second.received;
+        value.txCount -= it->second.txids.size();
+        if (value.txCount <= 0) {
+            batch.Erase(make_pair(DB_ADDRESSBALANCE, key));
+            continue;
+        }
+
+        // The entries of this block are still in the index, the one before them is the previous activity
+        value.lastHeight = value.firstHeight;
+        uint32_t id = mapIds[it->first];
+        pcursor->Seek(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(id, it->second.height, 0, 0, false)));
+        if (pcursor->Valid()) {
+            pcursor->Prev();
+            std::pair<char, CAddressDeltaDiskKey> prevKey;
+            if (pcursor->Valid() && pcursor->GetKey(prevKey) && prevKey.first == DB_ADDRESSDELTA && prevKey.second.addressId == id)
+                value.lastHeight = prevKey.second.blockHeight;
+        }
+        batch.Write(make_pair(DB_ADDRESSBALANCE, key), value);
+    }
+    return WriteBatch(batch);
+}
+
+bool CIndexDB::ReadAddressId(uint160 addressHash, int type, uint32_t &id, const CDBSnapshot *pSnapshot) {
+    if (!MayHaveAddress(addressHash, type))
+        return false;
+    return Read(make_pair(DB_ADDRESSID, CAddressIndexIteratorKey(type, addressHash)), id, pSnapshot);
+}
+
+bool CIndexDB::ReadAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value) {
+    value.SetNull();
+    if (!MayHaveAddress(addressHash, type))
+        return true;
+    if (!Read(make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(type, addressHash)), value))
+        value.SetNull();
+    return true;
+}
+
+/** The bytes an address is entered into the address filter with */
+static void AddressFilterKey(const uint160 &addressHash, int type, unsigned char (&key)[21]) {
+    key[0] = (unsigned char)type;
+    memcpy(key + 1, addressHash.begin(), addressHash.size());
+}
+
+bool CIndexDB::MayHaveAddress(const uint160 &addressHash, int type) const {
+    if (!pAddressFilter)
+        return true;
+    unsigned char key[21];
+    AddressFilterKey(addressHash, type, key);
+    return pAddressFilter->contains(key, sizeof(key));
+}
+
+void CIndexDB::AddToAddressFilter(const uint160 &addressHash, int type) {
+    if (!pAddressFilter)
+        return;
+    unsigned char key[21];
+    AddressFilterKey(addressHash, type, key);
+    pAddressFilter->insert(key, sizeof(key));
+}
+
+bool CIndexDB::LoadAddressFilter() {
+    pAddressFilter.reset();
+    uint32_t nIds = 0;
+    Read(DB_ADDRESSIDNEXT, nIds);
+
+    // The copy written at shutdown is current as long as no address got an id since
+    std::pair<uint32_t, uint32_t> header;
+    if (Read(make_pair(DB_ADDRESSFILTER, (uint32_t)0), header) && header.first == nIds) {
+        CDataStream ssFilter(SER_DISK, CLIENT_VERSION);
+        std::vector<unsigned char> vChunk;
+        bool fComplete = true;
+        for (uint32_t i = 1; i <= header.second && fComplete; i++) {
+            fComplete = Read(make_pair(DB_ADDRESSFILTER, i), vChunk);
+            ssFilter.write((const char*)vChunk.data(), vChunk.size());
+        }
+        try {
+            boost::scoped_ptr<CBlockedBloomFilter> pfilter(new CBlockedBloomFilter(0));
+            if (fComplete) {
+                ssFilter >> *pfilter;
+                if (nIds <= pfilter->GetCapacity()) {
+                    pAddressFilter.swap(pfilter);
+                    LogPrintf("%s: loaded the filter of %u addresses\n", __func__, nIds);
+                    return true;
+                }
+            }
+        } catch (const std::exception &e) {
+            LogPrintf("%s: ignoring the stored address filter: %s\n", __func__, e.what());
+        }
+    }
+
+    int64_t nStart = GetTimeMillis();
+    boost::scoped_ptr<CBlockedBloomFilter> pfilter(new CBlockedBloomFilter(std::max((uint64_t)MIN_ADDRESS_FILTER_ELEMENTS, (uint64_t)nIds * 2)));
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_ADDRESSID, CAddressIndexIteratorKey()));
+    size_t nAddresses = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressIndexIteratorKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSID)
+            break;
+        unsigned char filterKey[21];
+        AddressFilterKey(key.second.hashBytes, key.second.type, filterKey);
+        pfilter->insert(filterKey, sizeof(filterKey));
+        nAddresses++;
+        pcursor->Next();
+    }
+    pAddressFilter.swap(pfilter);
+    LogPrintf("%s: built the filter of %u addresses in %dms\n", __func__, nAddresses, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CIndexDB::WriteAddressFilter() {
+    if (!pAddressFilter)
+        return true;
+    uint32_t nIds = 0;
+    Read(DB_ADDRESSIDNEXT, nIds);
+
     CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
+    std::pair<uint32_t, uint32_t> header;
+    if (Read(make_pair(DB_ADDRESSFILTER, (uint32_t)0), header)) {
+        for (uint32_t i = 1; i <= header.second; i++)
+            batch.Erase(make_pair(DB_ADDRESSFILTER, i));
+    }
+
+    CDataStream ssFilter(SER_DISK, CLIENT_VERSION);
+    ssFilter << *pAddressFilter;
+    header = std::make_pair(nIds, (uint32_t)0);
+    for (size_t nPos = 0; nPos < ssFilter.size(); nPos += ADDRESS_FILTER_CHUNK_SIZE) {
+        std::vector<unsigned char> vChunk(ssFilter.begin() + nPos, ssFilter.begin() + std::min(nPos + ADDRESS_FILTER_CHUNK_SIZE, ssFilter.size()));
+        batch.Write(make_pair(DB_ADDRESSFILTER, ++header.second), vChunk);
+    }
+    batch.Write(make_pair(DB_ADDRESSFILTER, (uint32_t)0), header);
+    return WriteBatch(batch, true);
+}
+
+bool CIndexDB::RebuildAddressBalanceIndex() {
+    CDBBatch batch(*this);
+    size_t nBatched = 0;
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey()));
+    while (pcursor->Valid()) {
+        std::pair<char, CAddressIndexIteratorKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSBALANCE)
+            break;
+        batch.Erase(key);
+        pcursor->Next();
+    }
+    if (!WriteBatch(batch))
+        return false;
+    batch.Clear();
+
+    // Every address with activity has an id, its deltas are ordered by height and position in the block
+    boost::scoped_ptr<CDBIterator> pdeltas(NewIterator());
+    pcursor->Seek(make_pair(DB_ADDRESSID, CAddressIndexIteratorKey()));
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressIndexIteratorKey> key;
+        uint32_t id;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSID)
+            break;
+        if (!pcursor->GetValue(id))
+            return error("failed to get address id");
+
+        CAddressBalanceValue value;
+        int nLastTxHeight = -1;
+        unsigned int nLastTxIndex = 0;
+        pdeltas->Seek(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(id, 0, 0, 0, false)));
+        while (pdeltas->Valid()) {
+            std::pair<char, CAddressDeltaDiskKey> delta;
+            if (!pdeltas->GetKey(delta) || delta.first != DB_ADDRESSDELTA || delta.second.addressId != id)
+                break;
+            CAmount nValue;
+            if (!pdeltas->GetValue(nValue))
+                return error("failed to get address index value");
+            if (value.IsNull())
+                value.firstHeight = delta.second.blockHeight;
+            if (delta.second.blockHeight != nLastTxHeight || delta.second.txindex != nLastTxIndex) {
+                nLastTxHeight = delta.second.blockHeight;
+                nLastTxIndex = delta.second.txindex;
+                value.txCount++;
+            }
+            value.balance += nValue;
+            if (nValue > 0)
+                value.received += nValue;
+            value.lastHeight = delta.second.blockHeight;
+            pdeltas->Next();
+        }
+
+        if (!value.IsNull()) {
+            batch.Write(make_pair(DB_ADDRESSBALANCE, key.second), value);
+            if (++nBatched % 10000 == 0) {
+                if (!WriteBatch(batch))
+                    return false;
+                batch.Clear();
+            }
+        }
+        pcursor->Next();
+    }
+    LogPrintf("%s: rebuilt the balances of %u addresses\n", __func__, nBatched);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
-                                    std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                                    int start, int end){
+bool CIndexDB::CompactAddressIndex() {
+    CDBBatch batch(*this);
+    CAddressIdAllocator ids(*this, batch);
+    size_t nConverted = 0;
 
+    // Rewrite the deltas in the compact format a few thousand at a time, so an interrupted
+    // conversion carries on where it stopped
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey()));
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX)
+            break;
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("failed to get address index value");
+
+        batch.Write(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(ids.Get(key.second.type, key.second.hashBytes), key.second)), nValue);
+        batch.Write(make_pair(DB_ADDRESSTXPOSITION, CAddressTxPositionKey(key.second.blockHeight, key.second.txindex)), key.second.txhash);
+        batch.Erase(key);
+        if (++nConverted % 10000 == 0) {
+            ids.Flush();
+            if (!WriteBatch(batch))
+                return false;
+            batch.Clear();
+            ids.Clear();
+        }
+        pcursor->Next();
+    }
+    ids.Flush();
+    LogPrintf("%s: converted %u address index entries\n", __func__, nConverted);
+    return WriteBatch(batch);
+}
+
+bool CIndexDB::ReadAddressIndex(uint160 addressHash, int type,
+                                std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                                int start, int end){
+    return ScanAddressIndex(addressHash, type, start, end, NULL,
+        [&addressIndex](const CAddressIndexKey& key, CAmount nValue) {
+            addressIndex.push_back(make_pair(key, nValue));
+            return true;
+        });
+}
 
-    if(start > 0 && end > 0){
-        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
+bool CIndexDB::ScanAddressIndex(uint160 addressHash, int type, int start, int end, const CAddressIndexKey *pFrom,
+                                const boost::function<bool(const CAddressIndexKey&, CAmount)> &fn,
+                                const CDBSnapshot *pSnapshot){
+
+    uint32_t id;
+    if (!ReadAddressId(addressHash, type, id, pSnapshot))
+        return true;
+
+    boost::scoped_ptr<CDBIterator> pcursor(pSnapshot ? NewIterator(*pSnapshot) : NewIterator());
+
+    if(pFrom && !(start > 0 && end > 0 && pFrom->blockHeight < start)){
+        pcursor->Seek(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(id, *pFrom)));
+    } else if(start > 0 && end > 0){
+        pcursor->Seek(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(id, start, 0, 0, false)));
     } else{
-        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
+        pcursor->Seek(make_pair(DB_ADDRESSDELTA, CAddressDeltaDiskKey(id, 0, 0, 0, false)));
     }
 
+    // Deltas of one transaction are next to each other, its txid is looked up once
+    CAddressTxPositionKey position(-1, 0);
+    uint256 txhash;
     while(pcursor->Valid()){
         boost::this_thread::interruption_point();
-        std::pair<char, CAddressIndexKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX && key.second.hashBytes == addressHash){
+        std::pair<char, CAddressDeltaDiskKey> key;
+        if (pcursor->GetKey(key) && key.first == DB_ADDRESSDELTA && key.second.addressId == id){
             if(end > 0 && key.second.blockHeight > end){
                 break;
             }
             CAmount nValue;
-            if (pcursor->GetValue(nValue)){
-                addressIndex.push_back(make_pair(key.second, nValue));
-                pcursor->Next();
-            } else {
+            if (!pcursor->GetValue(nValue)){
                 return error("failed to get address index value");
             }
+            if (key.second.blockHeight != position.blockHeight || key.second.txindex != position.txindex) {
+                position = CAddressTxPositionKey(key.second.blockHeight, key.second.txindex);
+                if (!Read(make_pair(DB_ADDRESSTXPOSITION, position), txhash, pSnapshot))
+                    return error("failed to get address index transaction");
+            }
+            if (!fn(CAddressIndexKey(type, addressHash, key.second.blockHeight, key.second.txindex, txhash, key.second.index, key.second.spending), nValue))
+                break;
+            pcursor->Next();
         } else{
             break;
         }
@@ -267,13 +970,95 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
+/** Move the sorted runs of vResults into vect as one sorted list, equal entries keep the order of their runs */
+template <typename T, typename Compare>
+static void MergeSortedRuns(std::vector<std::vector<T> > &vResults, std::vector<T> &vect, Compare comp) {
+    std::vector<size_t> vBounds(1, vect.size());
+    for (size_t i = 0; i < vResults.size(); i++) {
+        vect.insert(vect.end(), vResults[i].begin(), vResults[i].end());
+        std::vector<T>().swap(vResults[i]);
+        vBounds.push_back(vect.size());
+    }
+    // Merge neighbouring runs pairwise, halving their number each round
+    while (vBounds.size() > 2) {
+        std::vector<size_t> vMerged(1, vBounds[0]);
+        for (size_t i = 2; i < vBounds.size(); i += 2) {
+            std::inplace_merge(vect.begin() + vBounds[i - 2], vect.begin() + vBounds[i - 1], vect.begin() + vBounds[i], comp);
+            vMerged.push_back(vBounds[i]);
+        }
+        if (vBounds.size() % 2 == 0)
+            vMerged.push_back(vBounds.back());
+        vBounds.swap(vMerged);
+    }
+}
+
+bool CIndexDB::ReadAddressIndex(const std::vector<std::pair<uint160, int> > &addresses, int start, int end, int nThreads,
+                                std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                                const CDBSnapshot *pSnapshot) {
+    // One snapshot for all addresses, a block connected meanwhile shows up in all or none of them
+    std::unique_ptr<CDBSnapshot> ownSnapshot;
+    if (!pSnapshot) {
+        ownSnapshot.reset(new CDBSnapshot(*this));
+        pSnapshot = ownSnapshot.get();
+    }
+    std::vector<std::vector<std::pair<CAddressIndexKey, CAmount> > > vResults(addresses.size());
+    bool fOk = ParallelForEach(addresses.size(), nThreads, [&](size_t i) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > &result = vResults[i];
+        return ScanAddressIndex(addresses[i].first, addresses[i].second, start, end, NULL,
+            [&result](const CAddressIndexKey& key, CAmount nValue) {
+                result.push_back(make_pair(key, nValue));
+                return true;
+            }, pSnapshot);
+    });
+    if (!fOk)
+        return false;
+
+    // Each address is in height order already
+    MergeSortedRuns(vResults, addressIndex,
+        [](const std::pair<CAddressIndexKey, CAmount>& a, const std::pair<CAddressIndexKey, CAmount>& b) {
+            return a.first.blockHeight < b.first.blockHeight ||
+                (a.first.blockHeight == b.first.blockHeight && a.first.txindex < b.first.txindex);
+        });
+    return true;
+}
+
+bool CIndexDB::ReadAddressUnspentIndex(const std::vector<std::pair<uint160, int> > &addresses, int nThreads,
+                                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                                       const CDBSnapshot *pSnapshot) {
+    std::unique_ptr<CDBSnapshot> ownSnapshot;
+    if (!pSnapshot) {
+        ownSnapshot.reset(new CDBSnapshot(*this));
+        pSnapshot = ownSnapshot.get();
+    }
+    std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > vResults(addresses.size());
+    bool fOk = ParallelForEach(addresses.size(), nThreads, [&](size_t i) {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &result = vResults[i];
+        return ScanAddressUnspentIndex(addresses[i].first, addresses[i].second, NULL,
+            [&result](const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+                result.push_back(make_pair(key, value));
+                return true;
+            }, pSnapshot);
+    });
+    if (!fOk)
+        return false;
+
+    // Unspent outputs are keyed by txid, so each address has to be put in height order first
+    auto heightOrder = [](const std::pair<CAddressUnspentKey, CAddressUnspentValue>& a, const std::pair<CAddressUnspentKey, CAddressUnspentValue>& b) {
+        return a.second.blockHeight < b.second.blockHeight;
+    };
+    for (size_t i = 0; i < vResults.size(); i++)
+        std::stable_sort(vResults[i].begin(), vResults[i].end(), heightOrder);
+    MergeSortedRuns(vResults, unspentOutputs, heightOrder);
+    return true;
+}
+
+bool CIndexDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
     CDBBatch batch(*this);
     batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
+bool CIndexDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
 
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
@@ -300,13 +1085,13 @@ bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned i
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
+bool CIndexDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
     CDBBatch batch(*this);
     batch.Write(make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
+bool CIndexDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
 
     CTimestampBlockIndexValue(lts);
     if(!Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
@@ -316,6 +1101,48 @@ bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &lt
     return true;
 }
 
+bool CIndexDB::WriteBlockFilter(const BlockFilter &filter, const uint256 &prevHeader, uint256 &header) {
+    // The header is kept apart from the filter, so that getcfheaders does not read the filters
+    uint256 filterHash = filter.GetHash();
+    header = Hash(filterHash.begin(), filterHash.end(), prevHeader.begin(), prevHeader.end());
+    CDBBatch batch(*this);
+    batch.Write(make_pair(DB_BLOCKFILTER, filter.GetBlockHash()), filter.GetEncodedFilter());
+    batch.Write(make_pair(DB_BLOCKFILTERHEADER, filter.GetBlockHash()), make_pair(filterHash, header));
+    return WriteBatch(batch);
+}
+
+bool CIndexDB::ReadBlockFilter(const uint256 &hash, BlockFilter &filter) {
+    std::vector<unsigned char> vEncoded;
+    if (!Read(make_pair(DB_BLOCKFILTER, hash), vEncoded))
+        return false;
+    try {
+        filter = BlockFilter(BLOCK_FILTER_BASIC, hash, vEncoded);
+    } catch (const std::exception& e) {
+        return error("%s: filter of block %s is corrupt: %s", __func__, hash.ToString(), e.what());
+    }
+    return true;
+}
+
+bool CIndexDB::ReadBlockFilterHeader(const uint256 &hash, uint256 &header, uint256 *pFilterHash) {
+    std::pair<uint256, uint256> value;
+    if (!Read(make_pair(DB_BLOCKFILTERHEADER, hash), value))
+        return false;
+    if (pFilterHash)
+        *pFilterHash = value.first;
+    header = value.second;
+    return true;
+}
+
+bool CIndexDB::ReadPrevBlockFilterHeader(const uint256 &hashPrevBlock, uint256 &header) {
+    header.SetNull();
+    if (hashPrevBlock.IsNull() || ReadBlockFilterHeader(hashPrevBlock, header))
+        return true;
+    const CBlock &genesis = Params().GenesisBlock();
+    if (hashPrevBlock != genesis.GetHash())
+        return false;
+    return WriteBlockFilter(BlockFilter(BLOCK_FILTER_BASIC, genesis, CBlockUndo()), uint256(), header);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -328,51 +1155,95 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteIndexBuildState(const std::string &name, const CIndexBuildState &state) {
+    return Write(std::make_pair(DB_INDEXBUILD, name), state, true);
+}
+
+bool CBlockTreeDB::ReadIndexBuildState(const std::string &name, CIndexBuildState &state) {
+    return Read(std::make_pair(DB_INDEXBUILD, name), state);
+}
+
+bool CBlockTreeDB::EraseIndexBuildState(const std::string &name) {
+    return Erase(std::make_pair(DB_INDEXBUILD, name), true);
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    const std::vector<unsigned char>* pxorKey = dbwrapper_private::GetXorKey(*this);
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_BLOCK_INDEX_LOAD_THREADS));
 
     pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->mixhash         = diskindex.mixhash;
-                pindexNew->nHeight         = diskindex.nHeight;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Litecoin: Disable PoW Sanity check while loading block index from disk.
-                // We use the sha256 hash for the block index for performance reasons, which is recorded for later use.
-                // CheckProofOfWork() uses the Ethash hash which is discarded after a block is accepted.
-                // While it is technically feasible to verify the PoW, doing so takes several minutes as it
-                // requires recomputing every PoW hash during every MIL startup.
-                // We opt instead to simply trust the data that is on your local disk.
-                //if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                //    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+    // The records of a batch are copied into one buffer while the cursor walks them, then
+    // deserialized and hashed, the expensive part, on all threads. Only the map is built
+    // on this one.
+    std::vector<char> vchBatch;
+    std::vector<size_t> vRecordEnd;
+    std::vector<CDiskBlockIndex> vDiskIndex(BLOCK_INDEX_LOAD_BATCH);
+    std::vector<uint256> vBlockHash(BLOCK_INDEX_LOAD_BATCH);
+    bool fDone = false;
+    while (!fDone) {
+        vchBatch.clear();
+        vRecordEnd.clear();
+        while (vRecordEnd.size() < BLOCK_INDEX_LOAD_BATCH) {
+            boost::this_thread::interruption_point();
+            std::pair<char, uint256> key;
+            if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX) {
+                fDone = true;
+                break;
+            }
+            leveldb::Slice slValue = pcursor->GetValueSlice();
+            vchBatch.insert(vchBatch.end(), slValue.data(), slValue.data() + slValue.size());
+            vRecordEnd.push_back(vchBatch.size());
+            pcursor->Next();
+        }
 
-                pcursor->Next();
-            } else {
-                return error("LoadBlockIndex() : failed to read value");
+        size_t nRecords = vRecordEnd.size();
+        size_t nChunks = (nRecords + BLOCK_INDEX_LOAD_CHUNK - 1) / BLOCK_INDEX_LOAD_CHUNK;
+        bool fOk = ParallelForEach(nChunks, nThreads, [&](size_t nChunk) {
+            size_t nEnd = std::min(nRecords, (nChunk + 1) * BLOCK_INDEX_LOAD_CHUNK);
+            for (size_t i = nChunk * BLOCK_INDEX_LOAD_CHUNK; i < nEnd; i++) {
+                const char* pbegin = vchBatch.data() + (i ? vRecordEnd[i - 1] : 0);
+                // Fields the record leaves out keep their defaults, not those of the batch before
+                vDiskIndex[i] = CDiskBlockIndex();
+                try {
+                    CSpanReader ssValue(pbegin, vchBatch.data() + vRecordEnd[i], SER_DISK, CLIENT_VERSION, pxorKey);
+                    ssValue >> vDiskIndex[i];
+                } catch (const std::exception&) {
+                    return false;
+                }
+                vBlockHash[i] = vDiskIndex[i].GetBlockHash();
             }
-        } else {
-            break;
+            return true;
+        });
+        if (!fOk)
+            return error("LoadBlockIndex() : failed to read value");
+
+        for (size_t i = 0; i < nRecords; i++) {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+            // Construct block index object
+            CBlockIndex* pindexNew = insertBlockIndex(vBlockHash[i]);
+            pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->mixhash         = diskindex.mixhash;
+            pindexNew->hashPoW        = diskindex.hashPoW;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            // Recomputing the Ethash hash of every header takes several minutes, so only entries
+            // that stored the Ethash result when they were accepted are checked against their
+            // claimed target. Older entries are trusted as they are on the local disk.
+            if ((pindexNew->nStatus & BLOCK_HAVE_POWHASH) && !CheckProofOfWork(pindexNew->hashPoW, pindexNew->nBits, Params().GetConsensus()))
+                return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
         }
     }
 
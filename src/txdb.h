@@ -18,9 +18,13 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
 
+class BlockFilter;
+class CBlockedBloomFilter;
 class CBlockIndex;
 class CCoinsViewDBCursor;
+class CUTXOStats;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -29,14 +33,36 @@ static const int64_t nDefaultDbCache = 300;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache (MiB)
 static const int64_t nMinDbCache = 4;
-//! Max memory allocated to block tree DB specific cache, if no -txindex (MiB)
+//! Max memory allocated to block tree DB specific cache (MiB)
 static const int64_t nMaxBlockDBCache = 2;
-//! Max memory allocated to block tree DB specific cache, if -txindex (MiB)
+//! Max memory allocated to the -txindex database cache (MiB)
 // Unlike for the UTXO database, for the txindex scenario the leveldb cache make
 // a meaningful difference: https://github.com/bitcoin/bitcoin/pull/8273#issuecomment-229601991
-static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
+static const int64_t nMaxTxIndexDBCache = 1024;
+//! Max memory allocated to the -timestampindex database cache (MiB)
+static const int64_t nMaxTimestampIndexDBCache = 16;
+//! Max memory allocated to the -blockfilterindex database cache (MiB)
+static const int64_t nMaxBlockFilterIndexDBCache = 64;
+//! Memory allocated to the database of a disabled optional index (MiB)
+static const int64_t nMinIndexDBCache = 1;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! The address filter has room for twice the indexed addresses, and at least this many
+static const unsigned int MIN_ADDRESS_FILTER_ELEMENTS = 1 << 20;
+//! Block index entries read from disk before they are deserialized and hashed together at startup
+static const size_t BLOCK_INDEX_LOAD_BATCH = 65536;
+//! Entries one thread deserializes and hashes at a time
+static const size_t BLOCK_INDEX_LOAD_CHUNK = 1024;
+//! Threads loading the block index, at most one per core
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 8;
+
+/**
+ * The LevelDB settings of the database strName (chainstate, blockindex or the name of an
+ * optional index): the given defaults, overridden by -dbcompression, -dbblocksize,
+ * -dbmaxopenfiles and -dbbloombits. Each of those takes <n> for every database or
+ * <name>:<n> for one, which wins over the former.
+ */
+CDBOptions GetDBOptions(const std::string &strName, const CDBOptions &defaults = CDBOptions());
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -63,7 +89,42 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/** Progress of an index that is being built in the background, see indexbuilder.h */
+struct CIndexBuildState
+{
+    int nTargetHeight; // last height to index, later blocks are indexed by ConnectBlock
+    int nNextHeight;   // first height not indexed yet
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(nTargetHeight));
+        READWRITE(VARINT(nNextHeight));
+    }
+
+    CIndexBuildState(int nTargetHeightIn, int nNextHeightIn) : nTargetHeight(nTargetHeightIn), nNextHeight(nNextHeightIn) {}
+
+    CIndexBuildState() {
+        SetNull();
+    }
+
+    void SetNull() {
+        nTargetHeight = 0;
+        nNextHeight = 0;
+    }
+
+    bool IsComplete() const {
+        return nNextHeight > nTargetHeight;
+    }
+};
+
+/** CCoinsView backed by the coin database (chainstate/).
+ *
+ * Every unspent output is a record of its own, keyed by its outpoint, so spending
+ * one output of a transaction only erases that record. The outputs of a transaction
+ * are next to each other and read back into one CCoins.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
@@ -73,12 +134,24 @@ public:
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
+    /** Reads the txids in parallel, LevelDB allows concurrent readers */
+    void GetCoinsMany(const std::vector<uint256> &txids, std::vector<CCoins> &coins, std::vector<bool> &found, int nThreads) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    /** BatchWrite without emptying mapCoins, so others can still read the entries while they are written */
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    /** The UTXO set statistics last written; they are only current if they are for the best block */
+    bool ReadUTXOStats(CUTXOStats &stats) const;
+    bool WriteUTXOStats(const CUTXOStats &stats);
+
+    /** Convert the records of whole transactions from before the per-output format,
+     * false if that failed or was interrupted by a shutdown */
+    bool Upgrade();
 };
 
-/** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
+/** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB, one transaction at a time */
 class CCoinsViewDBCursor: public CCoinsViewCursor
 {
 public:
@@ -86,6 +159,7 @@ public:
 
     bool GetKey(uint256 &key) const;
     bool GetValue(CCoins &coins) const;
+    /** The size of the records of all outputs of the transaction */
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -93,9 +167,15 @@ public:
 
 private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), fValid(false), nValueSizeTmp(0) {}
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    bool fValid;
+    uint256 txidTmp;
+    CCoins coinsTmp;
+    unsigned int nValueSizeTmp;
+
+    /** Gather the outputs of the transaction pcursor is at, and move past them */
+    void ReadNext();
 
     friend class CCoinsViewDB;
 };
@@ -114,25 +194,96 @@ public:
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
+    bool WriteFlag(const std::string &name, bool fValue);
+    bool ReadFlag(const std::string &name, bool &fValue);
+    bool WriteIndexBuildState(const std::string &name, const CIndexBuildState &state);
+    bool ReadIndexBuildState(const std::string &name, CIndexBuildState &state);
+    bool EraseIndexBuildState(const std::string &name);
+    /** Create the entries of the block index through insertBlockIndex; the records are
+     * deserialized and hashed on several threads, a batch at a time */
+    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+};
+
+/** Access to the database of one optional index (indexes/<name>/), where name is
+ * txindex, addressindex, spentindex, timestampindex or blockfilterindex. Each index only uses its own methods.
+ */
+class CIndexDB : public CDBWrapper
+{
+public:
+    CIndexDB(const std::string &strNameIn, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CIndexDB();
+private:
+    CIndexDB(const CIndexDB&);
+    void operator=(const CIndexDB&);
+
+    std::string strName;
+    /** Every address with an id, once loaded; lets lookups of unused addresses skip the database */
+    boost::scoped_ptr<CBlockedBloomFilter> pAddressFilter;
+
+    /** False if the address certainly has no entries in the address index */
+    bool MayHaveAddress(const uint160 &addressHash, int type) const;
+public:
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue& value);
+    /** Fill in the null entries of values for keys, read in key order from one snapshot */
+    bool ReadSpentIndex(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values);
     bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vect);
     bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    /** Pass the unspent outputs of an address to fn in key order, from pFrom if given, until fn returns false */
+    bool ScanAddressUnspentIndex(uint160 addressHash, int type, const CAddressUnspentKey *pFrom,
+                                 const boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> &fn,
+                                 const CDBSnapshot *pSnapshot = NULL);
+    /** Read the unspent outputs of several addresses on up to nThreads threads, merged in height order,
+     * all from pSnapshot if given or else from one snapshot taken now */
+    bool ReadAddressUnspentIndex(const std::vector<std::pair<uint160, int> > &addresses, int nThreads,
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect,
+                                 const CDBSnapshot *pSnapshot = NULL);
+    /** Write the address index deltas of a connected block and add them to the address balances */
     bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
+    /** Erase the address index deltas of a disconnected block and take them out of the address balances */
     bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                         std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                         int start = 0, int end = 0); 
+    /** Pass the index entries of an address to fn in key order, from pFrom if given, until fn returns false */
+    bool ScanAddressIndex(uint160 addressHash, int type, int start, int end, const CAddressIndexKey *pFrom,
+                          const boost::function<bool(const CAddressIndexKey&, CAmount)> &fn,
+                          const CDBSnapshot *pSnapshot = NULL);
+    /** Read the index entries of several addresses on up to nThreads threads, merged in height order,
+     * all from pSnapshot if given or else from one snapshot taken now */
+    bool ReadAddressIndex(const std::vector<std::pair<uint160, int> > &addresses, int start, int end, int nThreads,
+                          std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                          const CDBSnapshot *pSnapshot = NULL);
+    /** Look up the id an address is stored under in the address index, false if it has no activity */
+    bool ReadAddressId(uint160 addressHash, int type, uint32_t &id, const CDBSnapshot *pSnapshot = NULL);
+    bool ReadAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value);
+    /** Set up the address filter, from the copy kept at the last shutdown if no ids were assigned
+     * since, or else from the address ids. Call before the index is read or written concurrently */
+    bool LoadAddressFilter();
+    /** Keep the address filter for the next start, call once nothing writes the index any more */
+    bool WriteAddressFilter();
+    /** Add an address that was given an id to the address filter, if loaded */
+    void AddToAddressFilter(const uint160 &addressHash, int type);
+    /** Recompute every address balance from the address index */
+    bool RebuildAddressBalanceIndex();
+    /** Convert an address index from before the compact key format */
+    bool CompactAddressIndex();
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect);
     bool WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts);
     bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
-    bool WriteFlag(const std::string &name, bool fValue);
-    bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    /** Write the basic filter of a block and its header, chained to prevHeader; returns the header */
+    bool WriteBlockFilter(const BlockFilter &filter, const uint256 &prevHeader, uint256 &header);
+    bool ReadBlockFilter(const uint256 &hash, BlockFilter &filter);
+    bool ReadBlockFilterHeader(const uint256 &hash, uint256 &header, uint256 *pFilterHash = NULL);
+    /** The filter header of the block before a new one, null before the genesis block. The genesis
+     * block is never connected, its filter is written here when the block after it is indexed. */
+    bool ReadPrevBlockFilterHeader(const uint256 &hashPrevBlock, uint256 &header);
+    /** Move the entries of this index out of the block tree database, where they were kept before */
+    bool MoveFromBlockTree(CBlockTreeDB &blocktree);
 };
 
 #endif // BITCOIN_TXDB_H
@@ -16,15 +16,18 @@
 #include "util.h"
 #include "utilmoneystr.h"
 #include "utiltime.h"
+#include "validationinterface.h"
 #include "version.h"
 
+#include <algorithm>
+
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                                  bool poolHasNoInputsOf, CAmount _inChainInputValue,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
-    tx(std::make_shared<CTransaction>(_tx)), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority), entryHeight(_entryHeight),
+    tx(MakeTransactionRef(_tx)), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority), entryHeight(_entryHeight),
     hadNoDependencies(poolHasNoInputsOf), inChainInputValue(_inChainInputValue),
     spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp)
 {
@@ -44,6 +47,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    nVisitedEpoch = 0;
+    nMempoolSequence = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -83,39 +89,45 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    vecEntries stageEntries, vAllDescendants;
+    NewEpoch();
+    BOOST_FOREACH(const txiter childEntry, GetMemPoolChildren(updateIt)) {
+        Visited(childEntry);
+        stageEntries.push_back(childEntry);
+    }
 
     while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        BOOST_FOREACH(const txiter childEntry, setChildren) {
+        const txiter cit = stageEntries.back();
+        vAllDescendants.push_back(cit);
+        stageEntries.pop_back();
+        const vecEntries &vChildren = GetMemPoolChildren(cit);
+        BOOST_FOREACH(const txiter childEntry, vChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
                 // We've already calculated this one, just add the entries for this set
                 // but don't traverse again.
                 BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (!Visited(cacheEntry))
+                        vAllDescendants.push_back(cacheEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
+            } else if (!Visited(childEntry)) {
                 // Schedule for later processing
-                stageEntries.insert(childEntry);
+                stageEntries.push_back(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // vAllDescendants now contains each in-mempool descendant of updateIt once.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
+    vecEntries &vCached = cachedDescendants[updateIt];
+    BOOST_FOREACH(txiter cit, vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            vCached.push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -173,18 +185,32 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
-    setEntries parentHashes;
+    vecEntries vAncestors;
+    bool fWithinLimits = CalculateMemPoolAncestors(entry, vAncestors, limitAncestorCount, limitAncestorSize, limitDescendantCount, limitDescendantSize, errString, fSearchForParents);
+    setAncestors.insert(vAncestors.begin(), vAncestors.end());
+    return fWithinLimits;
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, vecEntries &vAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
+{
+    LOCK(cs);
     const CTransaction &tx = entry.GetTx();
 
+    // vAncestors is also the queue of the walk: the entries from nStage on
+    // have been found but their parents not yet looked at. Visited() keeps
+    // any entry from being queued twice.
+    NewEpoch();
+    vAncestors.clear();
+
     if (fSearchForParents) {
         // Get parents of this transaction that are in the mempool
         // GetMemPoolParents() is only valid for entries in the mempool, so we
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && !Visited(piter)) {
+                vAncestors.push_back(piter);
+                if (vAncestors.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -194,16 +220,16 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH(const txiter &piter, GetMemPoolParents(it)) {
+            Visited(piter);
+            vAncestors.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
-    while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
-
-        setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
+    for (size_t nStage = 0; nStage < vAncestors.size(); nStage++) {
+        txiter stageit = vAncestors[nStage];
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -217,13 +243,13 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
+        const vecEntries & vMemPoolParents = GetMemPoolParents(stageit);
+        BOOST_FOREACH(const txiter &phash, vMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!Visited(phash)) {
+                vAncestors.push_back(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (vAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -233,9 +259,9 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
     return true;
 }
 
-void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, const vecEntries &vAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const vecEntries &parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     BOOST_FOREACH(txiter piter, parentIters) {
         UpdateChild(piter, it, add);
@@ -243,18 +269,18 @@ void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors
     const int64_t updateCount = (add ? 1 : -1);
     const int64_t updateSize = updateCount * it->GetTxSize();
     const CAmount updateFee = updateCount * it->GetModifiedFee();
-    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+    BOOST_FOREACH(txiter ancestorIt, vAncestors) {
         mapTx.modify(ancestorIt, update_descendant_state(updateSize, updateFee, updateCount));
     }
 }
 
-void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncestors)
+void CTxMemPool::UpdateEntryForAncestors(txiter it, const vecEntries &vAncestors)
 {
-    int64_t updateCount = setAncestors.size();
+    int64_t updateCount = vAncestors.size();
     int64_t updateSize = 0;
     CAmount updateFee = 0;
     int64_t updateSigOpsCost = 0;
-    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+    BOOST_FOREACH(txiter ancestorIt, vAncestors) {
         updateSize += ancestorIt->GetTxSize();
         updateFee += ancestorIt->GetModifiedFee();
         updateSigOpsCost += ancestorIt->GetSigOpCost();
@@ -264,8 +290,8 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    BOOST_FOREACH(txiter updateIt, setMemPoolChildren) {
+    const vecEntries &vMemPoolChildren = GetMemPoolChildren(it);
+    BOOST_FOREACH(txiter updateIt, vMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
 }
@@ -282,20 +308,20 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // Here we only update statistics and not data in mapLinks (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
+        vecEntries vDescendants;
         BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-            setEntries setDescendants;
-            CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
+            CalculateDescendants(removeIt, vDescendants);
             int64_t modifySize = -((int64_t)removeIt->GetTxSize());
             CAmount modifyFee = -removeIt->GetModifiedFee();
             int modifySigOps = -removeIt->GetSigOpCost();
-            BOOST_FOREACH(txiter dit, setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+            // vDescendants[0] is removeIt itself: don't update state for self
+            for (size_t i = 1; i < vDescendants.size(); i++) {
+                mapTx.modify(vDescendants[i], update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
             }
         }
     }
+    vecEntries vAncestors;
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-        setEntries setAncestors;
         const CTxMemPoolEntry &entry = *removeIt;
         std::string dummy;
         // Since this is a tx that is already in the mempool, we can call CMPA
@@ -315,10 +341,10 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // differ from the set of mempool parents we'd calculate by searching,
         // and it's important that we use the mapLinks[] notion of ancestor
         // transactions as the set of things to update for removal.
-        CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        CalculateMemPoolAncestors(entry, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
         // Note that UpdateAncestorsOf severs the child links that point to
         // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+        UpdateAncestorsOf(false, removeIt, vAncestors);
     }
     // After updating all the ancestor sizes, we can now sever the link between each
     // transaction being removed and any mempool children (ie, update setMemPoolParents
@@ -349,7 +375,10 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nEpoch(0), fLoaded(false),
+    // Starting from the time makes the sequence numbers of a restarted node
+    // larger than those handed out before, which are then seen as too old
+    nSequence(GetTimeMicros())
 {
     _clear(); //lock free clear
 
@@ -392,7 +421,93 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+bool CTxMemPool::IsLoaded() const
+{
+    LOCK(cs);
+    return fLoaded;
+}
+
+CMempoolSnapshotEntry::CMempoolSnapshotEntry(const CTxMemPoolEntry& entry) :
+    txid(entry.GetTx().GetHash()), nFee(entry.GetFee()), nModifiedFee(entry.GetModifiedFee()),
+    nVsize(entry.GetTxSize()), nTime(entry.GetTime()), nCountWithAncestors(entry.GetCountWithAncestors()),
+    nSizeWithAncestors(entry.GetSizeWithAncestors()), nModFeesWithAncestors(entry.GetModFeesWithAncestors())
+{
+}
+
+void CTxMemPool::GetSnapshot(uint64_t nSinceSequence, CMempoolSnapshot& snapshot) const
+{
+    snapshot.vAdded.clear();
+    snapshot.vRemoved.clear();
+
+    LOCK(cs);
+    snapshot.nSequence = nSequence;
+    snapshot.fComplete = nSinceSequence < nRemovalsKeptFrom || nSinceSequence > nSequence;
+    snapshot.vAdded.reserve(snapshot.fComplete ? mapTx.size() : 0);
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); ++it) {
+        if (snapshot.fComplete || it->nMempoolSequence > nSinceSequence)
+            snapshot.vAdded.push_back(CMempoolSnapshotEntry(*it));
+    }
+    if (!snapshot.fComplete) {
+        std::deque<std::pair<uint64_t, uint256> >::const_iterator it = std::upper_bound(removalLog.begin(), removalLog.end(),
+            nSinceSequence, [](uint64_t n, const std::pair<uint64_t, uint256>& removal) { return n < removal.first; });
+        for (; it != removalLog.end(); ++it)
+            snapshot.vRemoved.push_back(it->second);
+    }
+}
+
+void DisconnectedBlockTransactions::addForBlock(const std::vector<CTransactionRef>& vtx)
+{
+    BOOST_REVERSE_FOREACH(const CTransactionRef& tx, vtx) {
+        if (mapQueuedTx.count(tx->GetHash()))
+            continue;
+        queuedTx.push_front(tx);
+        mapQueuedTx.emplace(tx->GetHash(), queuedTx.begin());
+        cachedInnerUsage += RecursiveDynamicUsage(*tx);
+    }
+}
+
+void DisconnectedBlockTransactions::removeForBlock(const std::vector<CTransactionRef>& vtx)
+{
+    if (queuedTx.empty())
+        return;
+    BOOST_FOREACH(const CTransactionRef& tx, vtx) {
+        FlatHashMap<uint256, std::list<CTransactionRef>::iterator, SaltedTxidHasher>::iterator it = mapQueuedTx.find(tx->GetHash());
+        if (it == mapQueuedTx.end())
+            continue;
+        cachedInnerUsage -= RecursiveDynamicUsage(**it->second);
+        queuedTx.erase(it->second);
+        mapQueuedTx.erase(it);
+    }
+}
+
+CTransactionRef DisconnectedBlockTransactions::popLast()
+{
+    CTransactionRef ptx = queuedTx.back();
+    cachedInnerUsage -= RecursiveDynamicUsage(*ptx);
+    mapQueuedTx.erase(ptx->GetHash());
+    queuedTx.pop_back();
+    return ptx;
+}
+
+void DisconnectedBlockTransactions::clear()
+{
+    queuedTx.clear();
+    mapQueuedTx.clear();
+    cachedInnerUsage = 0;
+}
+
+void CTxMemPool::SetIsLoaded(bool loaded)
+{
+    LOCK(cs);
+    fLoaded = loaded;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate)
+{
+    return addUnchecked(hash, entry, vecEntries(setAncestors.begin(), setAncestors.end()), fCurrentEstimate);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, const vecEntries &vAncestors, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
@@ -437,8 +552,8 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
             UpdateParent(newit, pit, true);
         }
     }
-    UpdateAncestorsOf(true, newit, setAncestors);
-    UpdateEntryForAncestors(newit, setAncestors);
+    UpdateAncestorsOf(true, newit, vAncestors);
+    UpdateEntryForAncestors(newit, vAncestors);
 
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
@@ -446,6 +561,8 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
 
     vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
+    newit->nMempoolSequence = ++nSequence;
+    GetMainSignals().UpdatedMempool(hash, true, nSequence);
 
     return true;
 }
@@ -465,6 +582,9 @@ void CTxMemPool::removeUnchecked(txiter it)
     } else
         vTxHashes.clear();
 
+    removeAddressIndex(hash);
+    removeSpentIndex(hash);
+
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
@@ -472,112 +592,127 @@ void CTxMemPool::removeUnchecked(txiter it)
     mapTx.erase(it);
     nTransactionsUpdated++;
     minerPolicyEstimator->removeTx(hash);
+
+    removalLog.emplace_back(++nSequence, hash);
+    if (removalLog.size() > MEMPOOL_SNAPSHOT_REMOVALS_KEPT) {
+        nRemovalsKeptFrom = removalLog.front().first;
+        removalLog.pop_front();
+    }
+    GetMainSignals().UpdatedMempool(hash, false, nSequence);
 }
 
-void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
+void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, const std::vector<CIndexAddress> &vPrevAddresses)
 {
     LOCK(cs);
     const CTransaction& tx = entry.GetTx();
+    CMempoolAddressIndex::deltas_type deltas;
     std::vector<CMempoolAddressDeltaKey> inserted;
 
     uint256 txhash = tx.GetHash();
     for(unsigned int j = 0; j < tx.vin.size(); j++){
         const CTxIn input = tx.vin[j];
+        const CIndexAddress &address = vPrevAddresses[j];
+        if (address.type == 0)
+            continue;
         const CTxOut &prevout = view.GetOutputFor(input);
-        if(prevout.scriptPubKey.IsPayToScriptHash()){
-            vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
-            CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, j, 1);
-            CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
-        } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()){
-            vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
-            CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, j, 1);
-            CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
-        }
+        CMempoolAddressDeltaKey key(address.type, address.hashBytes, txhash, j, 1);
+        CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
+        deltas.push_back(make_pair(key, delta));
+        inserted.push_back(key);
     }
 
     for(unsigned int k = 0; k < tx.vout.size(); k++){
         const CTxOut &out = tx.vout[k];
-        if(out.scriptPubKey.IsPayToScriptHash()){
-            vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-            CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
-        } else if(out.scriptPubKey.IsPayToPublicKeyHash()){
-            vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-            std::pair<addressDeltaMap::iterator,bool> ret;
-            CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
-        }
+        const CIndexAddress address = GetIndexAddress(out.scriptPubKey);
+        if (address.type == 0)
+            continue;
+        CMempoolAddressDeltaKey key(address.type, address.hashBytes, txhash, k, 0);
+        deltas.push_back(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
+        inserted.push_back(key);
     }
 
+    addressIndex.Add(deltas);
     mapAddressInserted.insert(make_pair(txhash, inserted));
+
+    if (!GetMainSignals().UpdatedMempoolAddresses.empty()) {
+        boost::shared_ptr<CMempoolAddressUpdate> update(new CMempoolAddressUpdate(true, txhash));
+        update->deltas.swap(deltas);
+        GetMainSignals().UpdatedMempoolAddresses(update);
+    }
 }
 
 bool CTxMemPool::getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                                  std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results)
 {
-    LOCK(cs);
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        addressDeltaMap::iterator ait = mapAddress.lower_bound(CMempoolAddressDeltaKey((*it).second, (*it).first));
-        while (ait != mapAddress.end() && (*ait).first.addressBytes == (*it).first && (*ait).first.type == (*it).second) {
-            results.push_back(*ait);ait++;
-        }
+        CMempoolAddressIndex::snapshot_type deltas = addressIndex.Get((*it).first, (*it).second);
+        results.insert(results.end(), deltas->begin(), deltas->end());
     }
     return true;
 }
 
-void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
+CMempoolAddressIndex::snapshot_type CTxMemPool::getAddressDeltas(const uint160 &addressHash, int type) const
+{
+    return addressIndex.Get(addressHash, type);
+}
+
+void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, const std::vector<CIndexAddress> &vPrevAddresses)
 {
     LOCK(cs);
 
     const CTransaction& tx = entry.GetTx();
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spent;
     std::vector<CSpentIndexKey> inserted;
 
     uint256 txhash = tx.GetHash();
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
         const CTxIn input = tx.vin[j];
         const CTxOut &prevout = view.GetOutputFor(input);
-        uint160 addressHash;
-        int addressType;
-
-        if (prevout.scriptPubKey.IsPayToScriptHash()) {
-            addressHash = uint160(vector<unsigned char> (prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-            addressType = 2;
-        } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-            addressHash = uint160(vector<unsigned char> (prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-            addressType = 1;
-        } else {
-            addressHash.SetNull();
-            addressType = 0;
-        }
+        const CIndexAddress &address = vPrevAddresses[j];
 
         CSpentIndexKey key = CSpentIndexKey(input.prevout.hash, input.prevout.n);
-        CSpentIndexValue value = CSpentIndexValue(txhash, j, -1, prevout.nValue, addressType, addressHash);
+        CSpentIndexValue value = CSpentIndexValue(txhash, j, -1, prevout.nValue, address.type, address.hashBytes);
 
-        mapSpent.insert(make_pair(key, value));
+        spent.push_back(make_pair(key, value));
         inserted.push_back(key);
     }
 
+    spentIndex.Add(spent);
     mapSpentInserted.insert(make_pair(txhash, inserted));
 }
 
 bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) 
 {
-    LOCK(cs);
-    mapSpentIndex::iterator it;
+    return spentIndex.Get(key, value);
+}
 
-    it = mapSpent.find(key);
-    if (it !=mapSpent.end()) {
-        value = it->second;
-        return true;
+void CTxMemPool::getSpentIndex(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values) const
+{
+    spentIndex.Get(keys, values);
+}
+
+void CTxMemPool::removeAddressIndex(const uint256 &txhash)
+{
+    addressDeltaMapInserted::iterator it = mapAddressInserted.find(txhash);
+    if (it != mapAddressInserted.end()) {
+        if (GetMainSignals().UpdatedMempoolAddresses.empty()) {
+            addressIndex.Remove(it->second);
+        } else {
+            boost::shared_ptr<CMempoolAddressUpdate> update(new CMempoolAddressUpdate(false, txhash));
+            addressIndex.Remove(it->second, &update->deltas);
+            GetMainSignals().UpdatedMempoolAddresses(update);
+        }
+        mapAddressInserted.erase(it);
     }
+}
 
-    return false;
+void CTxMemPool::removeSpentIndex(const uint256 &txhash)
+{
+    mapSpentIndexInserted::iterator it = mapSpentInserted.find(txhash);
+    if (it != mapSpentInserted.end()) {
+        spentIndex.Remove(txhash, it->second);
+        mapSpentInserted.erase(it);
+    }
 }
 
 // Calculates descendants of entry that are not already in setDescendants, and adds to
@@ -588,22 +723,39 @@ bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    vecEntries stage;
+    if (setDescendants.insert(entryit).second) {
+        stage.push_back(entryit);
     }
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
     while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
-
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        BOOST_FOREACH(const txiter &childiter, setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+        txiter it = stage.back();
+        stage.pop_back();
+
+        const vecEntries &vChildren = GetMemPoolChildren(it);
+        BOOST_FOREACH(const txiter &childiter, vChildren) {
+            if (setDescendants.insert(childiter).second) {
+                stage.push_back(childiter);
+            }
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, vecEntries &vDescendants)
+{
+    LOCK(cs);
+    NewEpoch();
+    vDescendants.clear();
+    Visited(entryit);
+    vDescendants.push_back(entryit);
+    // Entries after i are queued, and have not had their children looked at
+    for (size_t i = 0; i < vDescendants.size(); i++) {
+        const vecEntries &vChildren = GetMemPoolChildren(vDescendants[i]);
+        BOOST_FOREACH(const txiter &childiter, vChildren) {
+            if (!Visited(childiter)) {
+                vDescendants.push_back(childiter);
             }
         }
     }
@@ -700,29 +852,29 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
-void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
+void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight,
                                 std::list<CTransaction>& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, vtx)
     {
-        uint256 hash = tx.GetHash();
+        uint256 hash = tx->GetHash();
 
         indexed_transaction_set::iterator i = mapTx.find(hash);
         if (i != mapTx.end())
             entries.push_back(*i);
     }
-    BOOST_FOREACH(const CTransaction& tx, vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, vtx)
     {
-        txiter it = mapTx.find(tx.GetHash());
+        txiter it = mapTx.find(tx->GetHash());
         if (it != mapTx.end()) {
             setEntries stage;
             stage.insert(it);
             RemoveStaged(stage, true);
         }
-        removeConflicts(tx, conflicts);
-        ClearPrioritisation(tx.GetHash());
+        removeConflicts(*tx, conflicts);
+        ClearPrioritisation(tx->GetHash());
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
@@ -735,12 +887,18 @@ void CTxMemPool::_clear()
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    addressIndex.Clear();
+    mapAddressInserted.clear();
+    spentIndex.Clear();
+    mapSpentInserted.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
+    removalLog.clear();
+    nRemovalsKeptFrom = ++nSequence;
 }
 
 void CTxMemPool::clear()
@@ -801,7 +959,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(vecEntries(setParentCheck.begin(), setParentCheck.end()) == GetMemPoolParents(it));
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -834,7 +992,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(vecEntries(setChildrenCheck.begin(), setChildrenCheck.end()) == GetMemPoolChildren(it));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -844,7 +1002,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         else {
             CValidationState state;
             PrecomputedTransactionData txdata(tx);
-            assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, txdata, NULL));
+            assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, false, txdata, NULL));
             UpdateCoins(tx, mempoolDuplicate, 1000000);
         }
     }
@@ -859,7 +1017,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(stepsSinceLastRemove < waitingOnDependants.size());
         } else {
             PrecomputedTransactionData txdata(entry->GetTx());
-            assert(CheckInputs(entry->GetTx(), state, mempoolDuplicate, false, 0, false, txdata, NULL));
+            assert(CheckInputs(entry->GetTx(), state, mempoolDuplicate, false, 0, false, false, txdata, NULL));
             UpdateCoins(entry->GetTx(), mempoolDuplicate, 1000000);
             stepsSinceLastRemove = 0;
         }
@@ -895,7 +1053,7 @@ namespace {
 class DepthAndScoreComparator
 {
 public:
-    bool operator()(const CTxMemPool::indexed_transaction_set::const_iterator& a, const CTxMemPool::indexed_transaction_set::const_iterator& b)
+    bool operator()(const CTxMemPool::indexed_transaction_set::const_iterator& a, const CTxMemPool::indexed_transaction_set::const_iterator& b) const
     {
         uint64_t counta = a->GetCountWithAncestors();
         uint64_t countb = b->GetCountWithAncestors();
@@ -948,7 +1106,7 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
     return ret;
 }
 
-std::shared_ptr<const CTransaction> CTxMemPool::get(const uint256& hash) const
+CTransactionRef CTxMemPool::get(const uint256& hash) const
 {
     LOCK(cs);
     indexed_transaction_set::const_iterator i = mapTx.find(hash);
@@ -966,24 +1124,21 @@ TxMempoolInfo CTxMemPool::info(const uint256& hash) const
     return TxMempoolInfo{i->GetSharedTx(), i->GetTime(), CFeeRate(i->GetFee(), i->GetTxSize())};
 }
 
+// The estimates are worked out after each block, and reading them takes no lock
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimateFee(nBlocks);
 }
 CFeeRate CTxMemPool::estimateSmartFee(int nBlocks, int *answerFoundAtBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimateSmartFee(nBlocks, answerFoundAtBlocks, *this);
 }
 double CTxMemPool::estimatePriority(int nBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimatePriority(nBlocks);
 }
 double CTxMemPool::estimateSmartPriority(int nBlocks, int *answerFoundAtBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimateSmartPriority(nBlocks, answerFoundAtBlocks, *this);
 }
 
@@ -1033,11 +1188,11 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         if (it != mapTx.end()) {
             mapTx.modify(it, update_fee_delta(deltas.second));
             // Now update all ancestors' modified fees with descendants
-            setEntries setAncestors;
+            vecEntries vAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
             std::string dummy;
-            CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-            BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+            CalculateMemPoolAncestors(*it, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH(txiter ancestorIt, vAncestors) {
                 mapTx.modify(ancestorIt, update_descendant_state(0, nFeeDelta, 0));
             }
         }
@@ -1076,7 +1231,7 @@ bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    shared_ptr<const CTransaction> ptx = mempool.get(txid);
+    CTransactionRef ptx = mempool.get(txid);
     if (ptx) {
         coins = CCoins(*ptx, MEMPOOL_HEIGHT);
         return true;
@@ -1121,34 +1276,41 @@ int CTxMemPool::Expire(int64_t time) {
 bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
     LOCK(cs);
-    setEntries setAncestors;
+    vecEntries vAncestors;
     uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
     std::string dummy;
-    CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
-    return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
+    CalculateMemPoolAncestors(entry, vAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+    return addUnchecked(hash, entry, vAncestors, fCurrentEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::UpdateLink(vecEntries &vLinks, txiter it, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    vecEntries::iterator pos = std::lower_bound(vLinks.begin(), vLinks.end(), it, CompareIteratorByHash());
+    bool fLinked = pos != vLinks.end() && *pos == it;
+    if (add == fLinked)
+        return;
+    cachedInnerUsage -= memusage::DynamicUsage(vLinks);
+    if (add) {
+        vLinks.insert(pos, it);
+    } else {
+        vLinks.erase(pos);
+        if (vLinks.empty())
+            vecEntries().swap(vLinks);
     }
+    cachedInnerUsage += memusage::DynamicUsage(vLinks);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLink(mapLinks[entry].children, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLink(mapLinks[entry].parents, parent, add);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1156,7 +1318,7 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
     return it->second.parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1196,7 +1358,7 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
-void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining) {
+void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining, std::vector<CTransactionRef>* pvEvicted) {
     LOCK(cs);
 
     unsigned nTxnRemoved = 0;
@@ -1223,6 +1385,10 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
             BOOST_FOREACH(txiter it, stage)
                 txn.push_back(it->GetTx());
         }
+        if (pvEvicted) {
+            BOOST_FOREACH(txiter it, stage)
+                pvEvicted->push_back(it->GetSharedTx());
+        }
         RemoveStaged(stage, false);
         if (pvNoSpendsRemaining) {
             BOOST_FOREACH(const CTransaction& tx, txn) {
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <deque>
 #include <list>
 #include <memory>
 #include <set>
@@ -14,7 +15,9 @@
 #include "spentindex.h"
 #include "amount.h"
 #include "coins.h"
+#include "flathashmap.h"
 #include "indirectmap.h"
+#include "mempoolindex.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
@@ -78,7 +81,7 @@ class CTxMemPool;
 class CTxMemPoolEntry
 {
 private:
-    std::shared_ptr<const CTransaction> tx;
+    CTransactionRef tx;
     CAmount nFee;              //!< Cached to avoid expensive parent-transaction lookups
     size_t nTxWeight;          //!< ... and avoid recomputing tx weight (also used for GetTxSize())
     size_t nModSize;           //!< ... and modified size for priority
@@ -116,7 +119,7 @@ public:
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
     const CTransaction& GetTx() const { return *this->tx; }
-    std::shared_ptr<const CTransaction> GetSharedTx() const { return this->tx; }
+    CTransactionRef GetSharedTx() const { return this->tx; }
     /**
      * Fast calculation of lower bound of current priority as update
      * from entry priority. Only inputs that were originally in-chain will age.
@@ -155,6 +158,8 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nVisitedEpoch; //!< Last mempool traversal that reached this entry, see CTxMemPool::Visited
+    mutable uint64_t nMempoolSequence; //!< Sequence number of the mempool that its addition took, see CTxMemPool::GetSnapshot
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -226,7 +231,7 @@ struct mempoolentry_txid
 class CompareTxMemPoolEntryByDescendantScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         bool fUseADescendants = UseDescendantScore(a);
         bool fUseBDescendants = UseDescendantScore(b);
@@ -248,7 +253,7 @@ public:
     }
 
     // Calculate which score to use for an entry (avoiding division).
-    bool UseDescendantScore(const CTxMemPoolEntry &a)
+    bool UseDescendantScore(const CTxMemPoolEntry &a) const
     {
         double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
         double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
@@ -263,7 +268,7 @@ public:
 class CompareTxMemPoolEntryByScore
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
         double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
@@ -277,7 +282,7 @@ public:
 class CompareTxMemPoolEntryByEntryTime
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         return a.GetTime() < b.GetTime();
     }
@@ -286,7 +291,7 @@ public:
 class CompareTxMemPoolEntryByAncestorFee
 {
 public:
-    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
     {
         double aFees = a.GetModFeesWithAncestors();
         double aSize = a.GetSizeWithAncestors();
@@ -320,7 +325,7 @@ class CBlockPolicyEstimator;
 struct TxMempoolInfo
 {
     /** The transaction itself */
-    std::shared_ptr<const CTransaction> tx;
+    CTransactionRef tx;
 
     /** Time the transaction entered the mempool. */
     int64_t nTime;
@@ -329,6 +334,69 @@ struct TxMempoolInfo
     CFeeRate feeRate;
 };
 
+/** Most removals from the mempool remembered for the deltas of CTxMemPool::GetSnapshot */
+static const size_t MEMPOOL_SNAPSHOT_REMOVALS_KEPT = 100000;
+
+/**
+ * What a mempool snapshot tells about each transaction, copied under the
+ * mempool lock and serialized after it is released.
+ */
+struct CMempoolSnapshotEntry
+{
+    uint256 txid;
+    CAmount nFee;
+    CAmount nModifiedFee;
+    uint32_t nVsize;
+    int64_t nTime;
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    CMempoolSnapshotEntry() : nFee(0), nModifiedFee(0), nVsize(0), nTime(0), nCountWithAncestors(0), nSizeWithAncestors(0), nModFeesWithAncestors(0) {}
+    explicit CMempoolSnapshotEntry(const CTxMemPoolEntry& entry);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(txid);
+        READWRITE(nFee);
+        READWRITE(nModifiedFee);
+        READWRITE(nVsize);
+        READWRITE(nTime);
+        READWRITE(nCountWithAncestors);
+        READWRITE(nSizeWithAncestors);
+        READWRITE(nModFeesWithAncestors);
+    }
+};
+
+/**
+ * The transactions added to the mempool after a sequence number and the txids
+ * removed since, or the whole mempool. Removals are to be applied before
+ * additions, as a transaction may have left and come back.
+ */
+struct CMempoolSnapshot
+{
+    //! Sequence number of the mempool when taken, to ask for the next delta with
+    uint64_t nSequence;
+    //! Whether vAdded is the whole mempool rather than a delta
+    bool fComplete;
+    std::vector<CMempoolSnapshotEntry> vAdded;
+    std::vector<uint256> vRemoved;
+
+    CMempoolSnapshot() : nSequence(0), fComplete(false) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nSequence);
+        READWRITE(fComplete);
+        READWRITE(vAdded);
+        READWRITE(vRemoved);
+    }
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -422,6 +490,14 @@ private:
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
+    mutable uint64_t nEpoch; //!< Number of the current traversal, see Visited
+
+    bool fLoaded; //!< Whether the transactions saved at the last shutdown were loaded
+
+    uint64_t nSequence; //!< Bumped by every addition and removal, see GetSnapshot
+    uint64_t nRemovalsKeptFrom; //!< The removals after this sequence number are all in removalLog
+    std::deque<std::pair<uint64_t, uint256> > removalLog; //!< The last removals, with their sequence numbers
+
     void trackPackageRemoved(const CFeeRate& rate);
 
 public:
@@ -472,34 +548,41 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    typedef std::vector<txiter> vecEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
+    /** The direct in-mempool parents or children of entry, in the order of a setEntries */
+    const vecEntries & GetMemPoolParents(txiter entry) const;
+    const vecEntries & GetMemPoolChildren(txiter entry) const;
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, vecEntries, CompareIteratorByHash> cacheMap;
 
+    // Sorted vectors rather than sets: most transactions have a parent or
+    // child or two, which a set would allocate a node for each
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        vecEntries parents;
+        vecEntries children;
     };
 
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
     txlinksMap mapLinks;
 
-    typedef std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> addressDeltaMap;
-    addressDeltaMap mapAddress;
+    //! Locked by shard rather than by cs, so address and spent queries do not wait for transaction acceptance
+    CMempoolAddressIndex addressIndex;
 
     typedef std::map<uint256, std::vector<CMempoolAddressDeltaKey> > addressDeltaMapInserted;
     addressDeltaMapInserted mapAddressInserted;
 
-    typedef std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpentIndex;
-    mapSpentIndex mapSpent;
+    CMempoolSpentIndex spentIndex;
 
     typedef std::map<uint256, std::vector<CSpentIndexKey> > mapSpentIndexInserted;
     mapSpentIndexInserted mapSpentInserted;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
+    /** Add or remove it in the sorted links vLinks, keeping cachedInnerUsage */
+    void UpdateLink(vecEntries &vLinks, txiter it, bool add);
+    void removeAddressIndex(const uint256 &txhash);
+    void removeSpentIndex(const uint256 &txhash);
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
@@ -530,18 +613,23 @@ public:
     // then invoke the second version.
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate = true);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, const vecEntries &vAncestors, bool fCurrentEstimate = true);
 
-    void addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
+    /** vPrevAddresses holds the index address of each spent output, see GetIndexAddress */
+    void addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, const std::vector<CIndexAddress> &vPrevAddresses);
     bool getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                          std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results);
+    /** The mempool deltas of one address as they are now, readable without any lock */
+    CMempoolAddressIndex::snapshot_type getAddressDeltas(const uint160 &addressHash, int type) const;
 
-    void addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
+    void addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view, const std::vector<CIndexAddress> &vPrevAddresses);
     bool getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
+    void getSpentIndex(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values) const;
 
     void removeRecursive(const CTransaction &tx, std::list<CTransaction>& removed);
     void removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
+    void removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight,
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void _clear(); //lock free
@@ -550,6 +638,15 @@ public:
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /** Whether the transactions of the last shutdown are back in the mempool, see LoadMempool */
+    bool IsLoaded() const;
+    void SetIsLoaded(bool loaded);
+    /**
+     * Copy the entries added after nSinceSequence and the txids removed since,
+     * or the whole mempool if nSinceSequence is 0 or the removals since were
+     * not all kept. Only the copying holds the lock.
+     */
+    void GetSnapshot(uint64_t nSinceSequence, CMempoolSnapshot& snapshot) const;
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a block.
@@ -593,11 +690,17 @@ public:
      *    look up parents from mapLinks. Must be true for entries not in the mempool
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
+    /** As above, but replaces the contents of vAncestors with each ancestor once,
+     *  nearest first, without building a set. */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, vecEntries &vAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
 
     /** Populate setDescendants with all in-mempool descendants of hash.
      *  Assumes that setDescendants includes all in-mempool descendants of anything
      *  already in it.  */
     void CalculateDescendants(txiter it, setEntries &setDescendants);
+    /** Replace the contents of vDescendants with it and each of its in-mempool
+     *  descendants once, it first. */
+    void CalculateDescendants(txiter it, vecEntries &vDescendants);
 
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
@@ -610,8 +713,9 @@ public:
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
       *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
       *  which are not in mempool which no longer have any spends in this mempool.
+      *  pvEvicted, if set, gets the transactions removed.
       */
-    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
+    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL, std::vector<CTransactionRef>* pvEvicted=NULL);
 
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
@@ -637,7 +741,7 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
-    std::shared_ptr<const CTransaction> get(const uint256& hash) const;
+    CTransactionRef get(const uint256& hash) const;
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
@@ -683,9 +787,20 @@ private:
             cacheMap &cachedDescendants,
             const std::set<uint256> &setExclude);
     /** Update ancestors of hash to add/remove it as a descendant transaction. */
-    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
+    void UpdateAncestorsOf(bool add, txiter hash, const vecEntries &vAncestors);
     /** Set ancestor state for an entry */
-    void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors);
+    void UpdateEntryForAncestors(txiter it, const vecEntries &vAncestors);
+    /** Start a traversal of the mempool: from now on Visited() reports each
+     *  entry as new only once. Requires cs, and traversals must not overlap. */
+    void NewEpoch() const { ++nEpoch; }
+    /** Whether the current traversal reached it before, marking it reached */
+    bool Visited(txiter it) const
+    {
+        if (it->nVisitedEpoch == nEpoch)
+            return true;
+        it->nVisitedEpoch = nEpoch;
+        return false;
+    }
     /** For each transaction being removed, update ancestors and any direct children.
       * If updateDescendants is true, then also update in-mempool descendants'
       * ancestor state. */
@@ -719,12 +834,44 @@ public:
     bool HaveCoins(const uint256 &txid) const;
 };
 
+/** Most memory the transactions of the blocks disconnected in a reorg may take before going back to the mempool */
+static const size_t MAX_DISCONNECTED_TX_POOL_SIZE = 20 * 1000 * 1000;
+
+/**
+ * The transactions of the blocks disconnected in a reorg, held until the reorg
+ * is done to go back to the mempool in one go, in the order of the blocks that
+ * held them so that parents come before their children. Those of the blocks
+ * connected in the meantime are taken out again.
+ */
+class DisconnectedBlockTransactions
+{
+private:
+    std::list<CTransactionRef> queuedTx;
+    FlatHashMap<uint256, std::list<CTransactionRef>::iterator, SaltedTxidHasher> mapQueuedTx;
+    uint64_t cachedInnerUsage;
+
+public:
+    DisconnectedBlockTransactions() : cachedInnerUsage(0) {}
+
+    /** Add the transactions of a block disconnected before the blocks already added, which followed it */
+    void addForBlock(const std::vector<CTransactionRef>& vtx);
+    /** Take out the transactions of a block connected */
+    void removeForBlock(const std::vector<CTransactionRef>& vtx);
+    /** Take out and return the last transaction, of the first block disconnected */
+    CTransactionRef popLast();
+    void clear();
+
+    size_t DynamicMemoryUsage() const { return cachedInnerUsage; }
+    /** In the order to add them to the mempool in */
+    const std::list<CTransactionRef>& GetQueuedTx() const { return queuedTx; }
+};
+
 // We want to sort transactions by coin age priority
 typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
 
 struct TxCoinAgePriorityCompare
 {
-    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
     {
         if (a.first == b.first)
             return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second)); //Reverse order to make sort less than
@@ -25,6 +25,10 @@ public:
         typ = initialType;
         val = initialStr;
     }
+    UniValue(UniValue::VType initialType, std::string&& initialStr) {
+        typ = initialType;
+        val = std::move(initialStr);
+    }
     UniValue(uint64_t val_) {
         setInt(val_);
     }
@@ -43,10 +47,19 @@ public:
     UniValue(const std::string& val_) {
         setStr(val_);
     }
+    UniValue(std::string&& val_) {
+        typ = VSTR;
+        val = std::move(val_);
+    }
     UniValue(const char *val_) {
         std::string s(val_);
         setStr(s);
     }
+    // Spelled out, as the destructor would otherwise suppress the moves
+    UniValue(const UniValue&) = default;
+    UniValue(UniValue&&) = default;
+    UniValue& operator=(const UniValue&) = default;
+    UniValue& operator=(UniValue&&) = default;
     ~UniValue() {}
 
     void clear();
@@ -84,6 +97,7 @@ public:
     bool isObject() const { return (typ == VOBJ); }
 
     bool push_back(const UniValue& val);
+    bool push_back(UniValue&& val);
     bool push_back(const std::string& val_) {
         UniValue tmpVal(VSTR, val_);
         return push_back(tmpVal);
@@ -95,6 +109,7 @@ public:
     bool push_backV(const std::vector<UniValue>& vec);
 
     bool pushKV(const std::string& key, const UniValue& val);
+    bool pushKV(const std::string& key, UniValue&& val);
     bool pushKV(const std::string& key, const std::string& val) {
         UniValue tmpVal(VSTR, val);
         return pushKV(key, tmpVal);
@@ -136,6 +151,7 @@ private:
     std::vector<UniValue> values;
 
     int findKey(const std::string& key) const;
+    void writeTo(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
     void writeArray(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
     void writeObject(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
 
@@ -154,7 +170,11 @@ public:
 
     enum VType type() const { return getType(); }
     bool push_back(std::pair<std::string,UniValue> pear) {
-        return pushKV(pear.first, pear.second);
+        if (typ != VOBJ)
+            return false;
+        keys.push_back(std::move(pear.first));
+        values.push_back(std::move(pear.second));
+        return true;
     }
     friend const UniValue& find_value( const UniValue& obj, const std::string& name);
 };
@@ -167,60 +187,60 @@ static inline std::pair<std::string,UniValue> Pair(const char *cKey, const char
 {
     std::string key(cKey);
     UniValue uVal(cVal);
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), std::move(uVal));
 }
 
 static inline std::pair<std::string,UniValue> Pair(const char *cKey, std::string strVal)
 {
     std::string key(cKey);
-    UniValue uVal(strVal);
-    return std::make_pair(key, uVal);
+    UniValue uVal(std::move(strVal));
+    return std::make_pair(std::move(key), std::move(uVal));
 }
 
 static inline std::pair<std::string,UniValue> Pair(const char *cKey, uint64_t u64Val)
 {
     std::string key(cKey);
     UniValue uVal(u64Val);
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), std::move(uVal));
 }
 
 static inline std::pair<std::string,UniValue> Pair(const char *cKey, int64_t i64Val)
 {
     std::string key(cKey);
     UniValue uVal(i64Val);
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), std::move(uVal));
 }
 
 static inline std::pair<std::string,UniValue> Pair(const char *cKey, bool iVal)
 {
     std::string key(cKey);
     UniValue uVal(iVal);
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), std::move(uVal));
 }
 
 static inline std::pair<std::string,UniValue> Pair(const char *cKey, int iVal)
 {
     std::string key(cKey);
     UniValue uVal(iVal);
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), std::move(uVal));
 }
 
 static inline std::pair<std::string,UniValue> Pair(const char *cKey, double dVal)
 {
     std::string key(cKey);
     UniValue uVal(dVal);
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), std::move(uVal));
 }
 
 static inline std::pair<std::string,UniValue> Pair(const char *cKey, const UniValue& uVal)
 {
     std::string key(cKey);
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), uVal);
 }
 
 static inline std::pair<std::string,UniValue> Pair(std::string key, const UniValue& uVal)
 {
-    return std::make_pair(key, uVal);
+    return std::make_pair(std::move(key), uVal);
 }
 
 enum jtokentype {
@@ -15,6 +15,13 @@ static bool json_isdigit(int ch)
     return ((ch >= '0') && (ch <= '9'));
 }
 
+// printable ASCII other than '"' and '\\', which a string holds as is
+static inline bool json_isplain(char ch)
+{
+    unsigned char uch = ch;
+    return uch >= 0x20 && uch < 0x80 && uch != '"' && uch != '\\';
+}
+
 // convert hexadecimal string to unsigned integer
 static const char *hatoui(const char *first, const char *last,
                           unsigned int& out)
@@ -114,8 +121,6 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '8':
     case '9': {
         // part 1: int
-        string numStr;
-
         const char *first = raw;
 
         const char *firstDigit = first;
@@ -124,49 +129,38 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
         if ((*firstDigit == '0') && json_isdigit(firstDigit[1]))
             return JTOK_ERR;
 
-        numStr += *raw;                       // copy first char
-        raw++;
+        raw++;                                // skip first char
 
         if ((*first == '-') && (!json_isdigit(*raw)))
             return JTOK_ERR;
 
-        while ((*raw) && json_isdigit(*raw)) {     // copy digits
-            numStr += *raw;
+        while ((*raw) && json_isdigit(*raw))      // skip digits
             raw++;
-        }
 
         // part 2: frac
         if (*raw == '.') {
-            numStr += *raw;                   // copy .
-            raw++;
+            raw++;                            // skip .
 
             if (!json_isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && json_isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while ((*raw) && json_isdigit(*raw)) // skip digits
                 raw++;
-            }
         }
 
         // part 3: exp
         if (*raw == 'e' || *raw == 'E') {
-            numStr += *raw;                   // copy E
-            raw++;
+            raw++;                            // skip E
 
-            if (*raw == '-' || *raw == '+') { // copy +/-
-                numStr += *raw;
+            if (*raw == '-' || *raw == '+')   // skip +/-
                 raw++;
-            }
 
             if (!json_isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && json_isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while ((*raw) && json_isdigit(*raw)) // skip digits
                 raw++;
-            }
         }
 
-        tokenVal = numStr;
+        tokenVal.assign(first, raw);          // copy the number at once
         consumed = (raw - rawStart);
         return JTOK_NUMBER;
         }
@@ -174,10 +168,19 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '"': {
         raw++;                                // skip "
 
-        string valStr;
-        JSONUTF8StringFilter writer(valStr);
+        JSONUTF8StringFilter writer(tokenVal);
 
         while (*raw) {
+            // copy runs of plain ASCII at once, they need no escaping or
+            // UTF-8 checks
+            const char *run = raw;
+            while (json_isplain(*raw))
+                raw++;
+            if (raw != run) {
+                writer.append(run, raw - run);
+                continue;
+            }
+
             if ((unsigned char)*raw < 0x20)
                 return JTOK_ERR;
 
@@ -224,7 +227,6 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
 
         if (!writer.finalize())
             return JTOK_ERR;
-        tokenVal = valStr;
         consumed = (raw - rawStart);
         return JTOK_STRING;
         }
@@ -312,9 +314,8 @@ bool UniValue::read(const char *raw)
                     setArray();
                 stack.push_back(this);
             } else {
-                UniValue tmpVal(utyp);
                 UniValue *top = stack.back();
-                top->values.push_back(tmpVal);
+                top->values.push_back(UniValue(utyp));
 
                 UniValue *newTop = &(top->values.back());
                 stack.push_back(newTop);
@@ -389,7 +390,7 @@ bool UniValue::read(const char *raw)
             }
 
             UniValue *top = stack.back();
-            top->values.push_back(tmpVal);
+            top->values.push_back(std::move(tmpVal));
 
             setExpect(NOT_VALUE);
             break;
@@ -399,9 +400,8 @@ bool UniValue::read(const char *raw)
             if (!stack.size())
                 return false;
 
-            UniValue tmpVal(VNUM, tokenVal);
             UniValue *top = stack.back();
-            top->values.push_back(tmpVal);
+            top->values.push_back(UniValue(VNUM, std::move(tokenVal)));
 
             setExpect(NOT_VALUE);
             break;
@@ -414,12 +414,11 @@ bool UniValue::read(const char *raw)
             UniValue *top = stack.back();
 
             if (expect(OBJ_NAME)) {
-                top->keys.push_back(tokenVal);
+                top->keys.push_back(std::move(tokenVal));
                 clearExpect(OBJ_NAME);
                 setExpect(COLON);
             } else {
-                UniValue tmpVal(VSTR, tokenVal);
-                top->values.push_back(tmpVal);
+                top->values.push_back(UniValue(VSTR, std::move(tokenVal)));
             }
 
             setExpect(NOT_VALUE);
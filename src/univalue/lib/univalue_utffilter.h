@@ -45,6 +45,13 @@ public:
                 push_back_u(codepoint);
         }
     }
+    // Write a run of 7-bit ASCII chars
+    void append(const char *s, size_t len)
+    {
+        if (state) // Not a continuation, invalid
+            is_valid = false;
+        str.append(s, len);
+    }
     // Write codepoint directly, possibly collating surrogate pairs
     void push_back_u(unsigned int codepoint)
     {
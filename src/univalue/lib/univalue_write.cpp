@@ -10,11 +10,8 @@
 
 using namespace std;
 
-static string json_escape(const string& inS)
+static void json_escape(const string& inS, string& outS)
 {
-    string outS;
-    outS.reserve(inS.size() * 2);
-
     for (unsigned int i = 0; i < inS.size(); i++) {
         unsigned char ch = inS[i];
         const char *escStr = escapes[ch];
@@ -24,8 +21,6 @@ static string json_escape(const string& inS)
         else
             outS += ch;
     }
-
-    return outS;
 }
 
 string UniValue::write(unsigned int prettyIndent,
@@ -33,7 +28,13 @@ string UniValue::write(unsigned int prettyIndent,
 {
     string s;
     s.reserve(1024);
+    writeTo(prettyIndent, indentLevel, s);
+    return s;
+}
 
+// Appends to s, so that nested values are not written into strings of their own first
+void UniValue::writeTo(unsigned int prettyIndent, unsigned int indentLevel, string& s) const
+{
     unsigned int modIndent = indentLevel;
     if (modIndent == 0)
         modIndent = 1;
@@ -49,7 +50,9 @@ string UniValue::write(unsigned int prettyIndent,
         writeArray(prettyIndent, modIndent, s);
         break;
     case VSTR:
-        s += "\"" + json_escape(val) + "\"";
+        s += '"';
+        json_escape(val, s);
+        s += '"';
         break;
     case VNUM:
         s += val;
@@ -58,8 +61,6 @@ string UniValue::write(unsigned int prettyIndent,
         s += (val == "1" ? "true" : "false");
         break;
     }
-
-    return s;
 }
 
 static void indentStr(unsigned int prettyIndent, unsigned int indentLevel, string& s)
@@ -76,7 +77,7 @@ void UniValue::writeArray(unsigned int prettyIndent, unsigned int indentLevel, s
     for (unsigned int i = 0; i < values.size(); i++) {
         if (prettyIndent)
             indentStr(prettyIndent, indentLevel, s);
-        s += values[i].write(prettyIndent, indentLevel + 1);
+        values[i].writeTo(prettyIndent, indentLevel + 1, s);
         if (i != (values.size() - 1)) {
             s += ",";
             if (prettyIndent)
@@ -100,10 +101,12 @@ void UniValue::writeObject(unsigned int prettyIndent, unsigned int indentLevel,
     for (unsigned int i = 0; i < keys.size(); i++) {
         if (prettyIndent)
             indentStr(prettyIndent, indentLevel, s);
-        s += "\"" + json_escape(keys[i]) + "\":";
+        s += '"';
+        json_escape(keys[i], s);
+        s += "\":";
         if (prettyIndent)
             s += " ";
-        s += values.at(i).write(prettyIndent, indentLevel + 1);
+        values.at(i).writeTo(prettyIndent, indentLevel + 1, s);
         if (i != (values.size() - 1))
             s += ",";
         if (prettyIndent)
@@ -24,7 +24,7 @@
 #endif
 
 #ifndef WIN32
-// for posix_fallocate
+// for posix_fallocate and fallocate
 #ifdef __linux__
 
 #ifdef _POSIX_C_SOURCE
@@ -36,6 +36,7 @@
 #endif // __linux__
 
 #include <algorithm>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -72,9 +73,16 @@
 #include <sys/prctl.h>
 #endif
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
+#include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
+#include <boost/algorithm/string/split.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/foreach.hpp>
@@ -677,9 +685,13 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
     }
     ftruncate(fileno(file), fst.fst_length);
 #elif defined(__linux__)
-    // Version using posix_fallocate
-    off_t nEndPos = (off_t)offset + length;
-    posix_fallocate(fileno(file), 0, nEndPos);
+    // Only the new range, with fallocate. Where the file system cannot allocate (network
+    // storage often), posix_fallocate would write into every block of it instead, which costs
+    // more than the allocation saves; it is left to the writes then.
+    if (fallocate(fileno(file), 0, offset, length) != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        off_t nEndPos = (off_t)offset + length;
+        posix_fallocate(fileno(file), 0, nEndPos);
+    }
 #else
     // Fallback version
     // TODO: just write one byte per block
@@ -759,6 +771,70 @@ void RenameThread(const char* name)
 #endif
 }
 
+bool SetThreadAffinity(int nCpu)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    if (nCpu < 0 || nCpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(nCpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)nCpu;
+    return false;
+#endif
+}
+
+bool SetThreadAffinity(const std::vector<int>& vCpus)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    BOOST_FOREACH(int nCpu, vCpus) {
+        if (nCpu < 0 || nCpu >= CPU_SETSIZE)
+            return false;
+        CPU_SET(nCpu, &set);
+    }
+    return !vCpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)vCpus;
+    return false;
+#endif
+}
+
+std::vector<std::vector<int> > GetNumaNodeCpus()
+{
+    std::vector<std::vector<int> > vNodes;
+#ifdef __linux__
+    // Nodes are numbered from 0, cpulist reads like "0-7,16-23"
+    for (int nNode = 0; ; nNode++) {
+        boost::filesystem::ifstream file(strprintf("/sys/devices/system/node/node%d/cpulist", nNode));
+        std::string strList;
+        if (!file || !std::getline(file, strList))
+            break;
+        std::vector<int> vCpus;
+        std::vector<std::string> vRanges;
+        boost::split(vRanges, strList, boost::is_any_of(","));
+        BOOST_FOREACH(const std::string& strRange, vRanges) {
+            int nFirst, nLast;
+            size_t nDash = strRange.find('-');
+            if (!ParseInt32(strRange.substr(0, nDash), &nFirst))
+                continue;
+            if (nDash == std::string::npos)
+                nLast = nFirst;
+            else if (!ParseInt32(strRange.substr(nDash + 1), &nLast))
+                continue;
+            for (int nCpu = nFirst; nCpu <= nLast; nCpu++)
+                vCpus.push_back(nCpu);
+        }
+        if (!vCpus.empty())
+            vNodes.push_back(vCpus);
+    }
+#endif
+    return vNodes;
+}
+
 void SetupEnvironment()
 {
     // On most POSIX systems (e.g. Linux, but not BSD) the environment's locale
@@ -799,6 +875,40 @@ int GetNumCores()
 #endif
 }
 
+bool ParallelForEach(size_t nItems, int nThreads, const boost::function<bool(size_t)> &fn)
+{
+    std::atomic<size_t> nNext(0);
+    std::atomic<bool> fOk(true);
+    std::exception_ptr error;
+    boost::mutex csError;
+    auto worker = [&]() {
+        try {
+            size_t i;
+            while (fOk && (i = nNext++) < nItems) {
+                if (!fn(i))
+                    fOk = false;
+            }
+        } catch (...) {
+            boost::lock_guard<boost::mutex> lock(csError);
+            error = std::current_exception();
+            fOk = false;
+        }
+    };
+
+    boost::thread_group threads;
+    try {
+        for (size_t i = 1; i < std::min(nItems, (size_t)std::max(nThreads, 1)); i++)
+            threads.create_thread(worker);
+    } catch (const boost::thread_resource_error&) {
+        // Carry on with the threads we got
+    }
+    worker();
+    threads.join_all();
+    if (error)
+        std::rethrow_exception(error);
+    return fOk;
+}
+
 std::string CopyrightHolders(const std::string& strPrefix)
 {
     std::string strCopyrightHolders = strPrefix + strprintf(_(COPYRIGHT_HOLDERS), _(COPYRIGHT_HOLDERS_SUBSTITUTION));
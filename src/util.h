@@ -26,6 +26,7 @@
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/thread/exceptions.hpp>
 
@@ -209,8 +210,21 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
  */
 int GetNumCores();
 
+/** Call fn for every item below nItems on up to nThreads threads, the calling one included.
+ * Stops handing out items once fn returns false; an exception thrown by fn is rethrown here.
+ */
+bool ParallelForEach(size_t nItems, int nThreads, const boost::function<bool(size_t)> &fn);
+
 void RenameThread(const char* name);
 
+/** Pin the calling thread to CPU nCpu. Returns false where that is not supported. */
+bool SetThreadAffinity(int nCpu);
+/** Pin the calling thread to the CPUs in vCpus. Returns false where that is not supported. */
+bool SetThreadAffinity(const std::vector<int>& vCpus);
+
+/** Return the CPUs of every NUMA node that has any, by node. Empty where the topology is unknown. */
+std::vector<std::vector<int> > GetNumaNodeCpus();
+
 /**
  * .. and a wrapper that just calls func once
  */
@@ -91,20 +91,25 @@ bool ParseUInt64(const std::string& str, uint64_t *out);
  */
 bool ParseDouble(const std::string& str, double *out);
 
+/** The two hex digits of every byte value, one after the other */
+extern const char p_util_hexbyte[513];
+
 template<typename T>
 std::string HexStr(const T itbegin, const T itend, bool fSpaces=false)
 {
     std::string rv;
-    static const char hexmap[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
-                                     '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
-    rv.reserve((itend-itbegin)*3);
+    if (!(itbegin < itend))
+        return rv;
+    rv.resize((itend-itbegin) * (fSpaces ? 3 : 2) - (fSpaces ? 1 : 0));
+    char* out = &rv[0];
     for(T it = itbegin; it < itend; ++it)
     {
-        unsigned char val = (unsigned char)(*it);
+        const char* digits = &p_util_hexbyte[2 * (unsigned char)(*it)];
         if(fSpaces && it != itbegin)
-            rv.push_back(' ');
-        rv.push_back(hexmap[val>>4]);
-        rv.push_back(hexmap[val&15]);
+            *out++ = ' ';
+        out[0] = digits[0];
+        out[1] = digits[1];
+        out += 2;
     }
 
     return rv;
@@ -0,0 +1,173 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "clientversion.h"
+#include "coins.h"
+#include "main.h"
+#include "sync.h"
+#include "tinyformat.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+const unsigned char CUTXOSnapshotHeader::MAGIC[5] = {'u', 't', 'x', 'o', 0xff};
+
+CUTXOSetHasher::CUTXOSetHasher(const uint256& hashBlock) : ss(SER_GETHASH, PROTOCOL_VERSION)
+{
+    ss << hashBlock;
+}
+
+void CUTXOSetHasher::Add(const uint256& txid, const CCoins& coins)
+{
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << VARINT(coins.nHeight * 2 + (coins.fCoinBase ? 1 : 0));
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            ss << VARINT(i+1);
+            ss << out;
+        }
+    }
+    ss << VARINT(0);
+}
+
+bool WriteUTXOSnapshot(CCoinsView* view, const boost::filesystem::path& path, CUTXOSnapshotHeader& header, std::string& strError)
+{
+    if (boost::filesystem::exists(path)) {
+        strError = strprintf("%s already exists", path.string());
+        return false;
+    }
+
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+    header.SetNull();
+    header.hashBlock = pcursor->GetBestBlock();
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(header.hashBlock);
+        if (mi == mapBlockIndex.end()) {
+            strError = "the best block of the UTXO set is not in the block index";
+            return false;
+        }
+        header.nHeight = mi->second->nHeight;
+        header.nChainTx = mi->second->nChainTx;
+    }
+
+    // Written under another name until it is complete, so a snapshot file is never partial
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        strError = strprintf("cannot create %s", pathTmp.string());
+        return false;
+    }
+    try {
+        // The room for the header is taken now, it is written again with the totals at the end
+        fileout << header;
+        CUTXOSetHasher hasher(header.hashBlock);
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            uint256 txid;
+            CCoins coins;
+            if (!pcursor->GetKey(txid) || !pcursor->GetValue(coins))
+                throw std::runtime_error("unable to read the UTXO set");
+            fileout << txid << coins;
+            hasher.Add(txid, coins);
+            header.nTransactions++;
+            pcursor->Next();
+        }
+        header.hashSerialized = hasher.GetHash();
+        if (fseek(fileout.Get(), 0, SEEK_SET) != 0)
+            throw std::ios_base::failure("fseek failed");
+        fileout << header;
+        FileCommit(fileout.Get());
+    } catch (const std::exception& e) {
+        fileout.fclose();
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathTmp, ec);
+        strError = strprintf("error writing %s: %s", path.string(), e.what());
+        return false;
+    }
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("cannot rename %s to %s", pathTmp.string(), path.string());
+        return false;
+    }
+    return true;
+}
+
+bool VerifyUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotHeader& header, std::string& strError)
+{
+    CUTXOSnapshotReader reader(path);
+    if (!reader.Open(strError))
+        return false;
+    header = reader.GetHeader();
+
+    try {
+        CUTXOSetHasher hasher(header.hashBlock);
+        uint256 txid, txidPrev;
+        CCoins coins;
+        uint64_t nRead = 0;
+        while (reader.Next(txid, coins)) {
+            boost::this_thread::interruption_point();
+            // In strict order every txid is there once, which loading the coins relies on
+            if (nRead > 0 && !(txidPrev < txid)) {
+                strError = strprintf("transaction %s is out of order", txid.ToString());
+                return false;
+            }
+            if (coins.IsPruned()) {
+                strError = strprintf("transaction %s has no unspent outputs", txid.ToString());
+                return false;
+            }
+            hasher.Add(txid, coins);
+            txidPrev = txid;
+            nRead++;
+        }
+        if (hasher.GetHash() != header.hashSerialized) {
+            strError = "the contents do not match the hash in the header";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("error reading %s: %s", path.string(), e.what());
+        return false;
+    }
+    return true;
+}
+
+CUTXOSnapshotReader::CUTXOSnapshotReader(const boost::filesystem::path& path) :
+    file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION), nRead(0)
+{
+}
+
+bool CUTXOSnapshotReader::Open(std::string& strError)
+{
+    if (file.IsNull()) {
+        strError = "cannot open the snapshot file";
+        return false;
+    }
+    try {
+        file >> header;
+    } catch (const std::exception& e) {
+        strError = strprintf("cannot read the snapshot header: %s", e.what());
+        return false;
+    }
+    if (header.nVersion != UTXO_SNAPSHOT_VERSION) {
+        strError = strprintf("unsupported snapshot version %d", header.nVersion);
+        return false;
+    }
+    return true;
+}
+
+bool CUTXOSnapshotReader::Next(uint256& txid, CCoins& coins)
+{
+    if (nRead == header.nTransactions)
+        return false;
+    file >> txid >> coins;
+    nRead++;
+    return true;
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOSNAPSHOT_H
+#define BITCOIN_UTXOSNAPSHOT_H
+
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <cstring>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+class CCoins;
+class CCoinsView;
+
+/** Version of the snapshot file format written by dumptxoutset */
+static const int UTXO_SNAPSHOT_VERSION = 1;
+
+/**
+ * The start of a UTXO set snapshot file: where in the chain the set was taken and a hash
+ * committing to its contents. It is followed by nTransactions records of a txid and its
+ * unspent outputs (CCoins), in ascending txid order. The header has a fixed size, so the
+ * snapshot is written in one sequential pass and the header completed at the end.
+ */
+class CUTXOSnapshotHeader
+{
+public:
+    static const unsigned char MAGIC[5];
+
+    int nVersion;
+    uint256 hashBlock;
+    int nHeight;
+    //! Transactions in the chain up to and including hashBlock
+    uint64_t nChainTx;
+    uint64_t nTransactions;
+    //! The hash_serialized gettxoutsetinfo true reports for this set, see CUTXOSetHasher
+    uint256 hashSerialized;
+
+    CUTXOSnapshotHeader() {
+        SetNull();
+    }
+
+    void SetNull() {
+        nVersion = UTXO_SNAPSHOT_VERSION;
+        hashBlock.SetNull();
+        nHeight = 0;
+        nChainTx = 0;
+        nTransactions = 0;
+        hashSerialized.SetNull();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn) {
+        unsigned char pchMagic[sizeof(MAGIC)];
+        memcpy(pchMagic, MAGIC, sizeof(MAGIC));
+        READWRITE(FLATDATA(pchMagic));
+        if (ser_action.ForRead() && memcmp(pchMagic, MAGIC, sizeof(MAGIC)) != 0)
+            throw std::ios_base::failure("not a UTXO snapshot file");
+        READWRITE(nVersion);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nChainTx);
+        READWRITE(nTransactions);
+        READWRITE(hashSerialized);
+    }
+};
+
+/** The hash of a UTXO set one transaction at a time, as gettxoutsetinfo true reports it. It covers
+ * the height, coinbase flag and version of every transaction too, which a snapshot must not be
+ * able to change. The transactions must be added in ascending txid order, as a coins cursor
+ * returns them. */
+class CUTXOSetHasher
+{
+private:
+    CHashWriter ss;
+
+public:
+    CUTXOSetHasher(const uint256& hashBlock);
+
+    void Add(const uint256& txid, const CCoins& coins);
+    uint256 GetHash() { return ss.GetHash(); }
+};
+
+/** Write the UTXO set of view to a new file at path and fill in header. The set is taken
+ * at the best block of view, nHeight and nChainTx are read from the block index. */
+bool WriteUTXOSnapshot(CCoinsView* view, const boost::filesystem::path& path, CUTXOSnapshotHeader& header, std::string& strError);
+
+/** Read through the snapshot at path, checking the order of its records and their hash
+ * against the header, which is returned in header */
+bool VerifyUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotHeader& header, std::string& strError);
+
+/** Sequential reader of the records of a snapshot file */
+class CUTXOSnapshotReader
+{
+private:
+    CAutoFile file;
+    CUTXOSnapshotHeader header;
+    uint64_t nRead;
+
+public:
+    CUTXOSnapshotReader(const boost::filesystem::path& path);
+
+    /** Read the header, false if the file cannot be opened or is not a snapshot */
+    bool Open(std::string& strError);
+    const CUTXOSnapshotHeader& GetHeader() const { return header; }
+    /** The next record, false after the last one. A truncated file throws std::ios_base::failure. */
+    bool Next(uint256& txid, CCoins& coins);
+};
+
+#endif // BITCOIN_UTXOSNAPSHOT_H
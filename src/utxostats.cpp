@@ -0,0 +1,81 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxostats.h"
+
+#include "clientversion.h"
+#include "coins.h"
+#include "streams.h"
+
+void CUTXOStats::SetNull()
+{
+    hashBlock.SetNull();
+    nTransactions = 0;
+    nTransactionOutputs = 0;
+    nSerializedSize = 0;
+    nTotalAmount = 0;
+    muhash = CMuHash3072();
+}
+
+void CUTXOStats::ApplyOutput(const uint256& txid, uint32_t n, const CCoinValue& value, bool fAdd)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txid << VARINT(n) << value;
+    uint64_t nSize = ::GetSerializeSize(value, SER_DISK, CLIENT_VERSION);
+    if (fAdd) {
+        muhash.Insert((const unsigned char*)&ss[0], ss.size());
+        nTransactionOutputs++;
+        nSerializedSize += nSize;
+        nTotalAmount += value.out.nValue;
+    } else {
+        muhash.Remove((const unsigned char*)&ss[0], ss.size());
+        nTransactionOutputs--;
+        nSerializedSize -= nSize;
+        nTotalAmount -= value.out.nValue;
+    }
+}
+
+void CUTXOStats::Update(const uint256& txid, const CCoins& coinsOld, const CCoins& coinsNew)
+{
+    if (!coinsOld.IsPruned()) {
+        nTransactions--;
+        nSerializedSize -= 32;
+    }
+    if (!coinsNew.IsPruned()) {
+        nTransactions++;
+        nSerializedSize += 32;
+    }
+
+    size_t nOutputs = std::max(coinsOld.vout.size(), coinsNew.vout.size());
+    for (uint32_t n = 0; n < nOutputs; n++) {
+        bool fOld = coinsOld.IsAvailable(n);
+        bool fNew = coinsNew.IsAvailable(n);
+        if (!fOld && !fNew)
+            continue;
+        CCoinValue valueOld, valueNew;
+        if (fOld)
+            valueOld = CCoinValue(coinsOld, n);
+        if (fNew)
+            valueNew = CCoinValue(coinsNew, n);
+        // Most outputs of a changed entry are left as they were
+        if (fOld && fNew && valueOld == valueNew)
+            continue;
+        if (fOld)
+            ApplyOutput(txid, n, valueOld, false);
+        if (fNew)
+            ApplyOutput(txid, n, valueNew, true);
+    }
+}
+
+void CUTXOStats::Add(const uint256& txid, const CCoins& coins)
+{
+    Update(txid, CCoins(), coins);
+}
+
+uint256 CUTXOStats::GetSetHash() const
+{
+    uint256 hash;
+    muhash.Finalize(hash.begin());
+    return hash;
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOSTATS_H
+#define BITCOIN_UTXOSTATS_H
+
+#include "amount.h"
+#include "crypto/muhash.h"
+#include "serialize.h"
+#include "uint256.h"
+
+class CCoins;
+struct CCoinValue;
+
+/** Default for -utxostats, following the UTXO set statistics block by block */
+static const bool DEFAULT_UTXO_STATS = true;
+
+/**
+ * Statistics of the unspent output set at a block, which can follow the set as its
+ * entries change: the counts and sizes are sums, and the set hash is a MuHash3072 of
+ * the records of the outputs, each its txid, VARINT(n) and CCoinValue.
+ */
+class CUTXOStats
+{
+private:
+    /** Add or remove the output n of txid */
+    void ApplyOutput(const uint256& txid, uint32_t n, const CCoinValue& value, bool fAdd);
+
+public:
+    //! The block the set is at
+    uint256 hashBlock;
+    //! Transactions with an unspent output
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    //! 32 bytes per transaction and the size of each output record
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    CMuHash3072 muhash;
+
+    CUTXOStats() { SetNull(); }
+
+    void SetNull();
+
+    /** Follow the entry of txid changing from coinsOld to coinsNew; either may be pruned */
+    void Update(const uint256& txid, const CCoins& coinsOld, const CCoins& coinsNew);
+    /** Add an entry, for a set that is being scanned */
+    void Add(const uint256& txid, const CCoins& coins);
+
+    /** The set hash; takes a few milliseconds */
+    uint256 GetSetHash() const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(nTotalAmount);
+        unsigned char state[CMuHash3072::STATE_SIZE];
+        if (!ser_action.ForRead())
+            muhash.GetState(state);
+        READWRITE(FLATDATA(state));
+        if (ser_action.ForRead())
+            muhash.SetState(state);
+    }
+};
+
+#endif // BITCOIN_UTXOSTATS_H
@@ -5,6 +5,19 @@
 
 #include "validationinterface.h"
 
+#include "chain.h"
+#include "consensus/validation.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
 static CMainSignals g_signals;
 
 CMainSignals& GetMainSignals()
@@ -12,9 +25,170 @@ CMainSignals& GetMainSignals()
     return g_signals;
 }
 
-void RegisterValidationInterface(CValidationInterface* pwalletIn) {
-    g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
+/** The callbacks of queued subscribers, run in order by ThreadValidationInterfaceQueue */
+class CValidationQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condAdded;
+    boost::condition_variable condDone;
+    std::deque<boost::function<void ()> > queue;
+    //! Whether the thread runs, and whether it is in a callback
+    bool fRunning;
+    bool fBusy;
+
+public:
+    CValidationQueue() : fRunning(false), fBusy(false) {}
+
+    void Add(const boost::function<void ()>& fn)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fRunning) {
+                queue.push_back(fn);
+                condAdded.notify_one();
+                return;
+            }
+        }
+        fn();
+    }
+
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = true;
+        try {
+            while (true) {
+                while (queue.empty())
+                    condAdded.wait(lock);
+                boost::function<void ()> fn = queue.front();
+                queue.pop_front();
+                fBusy = true;
+                lock.unlock();
+                try {
+                    fn();
+                } catch (...) {
+                    lock.lock();
+                    fBusy = false;
+                    condDone.notify_all();
+                    throw;
+                }
+                boost::this_thread::interruption_point();
+                lock.lock();
+                fBusy = false;
+                condDone.notify_all();
+            }
+        } catch (const boost::thread_interrupted&) {
+            // Whatever is queued was sent before anything sent from now on, which is called directly
+            if (!lock.owns_lock())
+                lock.lock();
+            fBusy = false;
+            fRunning = false;
+            std::deque<boost::function<void ()> > rest;
+            rest.swap(queue);
+            lock.unlock();
+            condDone.notify_all();
+            BOOST_FOREACH(const boost::function<void ()>& fn, rest)
+                fn();
+            throw;
+        }
+    }
+
+    void WaitUntilBelow(size_t nSize)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() + (fBusy ? 1 : 0) > nSize)
+            condDone.wait(lock);
+    }
+};
+
+static CValidationQueue g_queue;
+static std::map<CValidationInterface*, std::vector<boost::signals2::connection> > g_queuedConnections;
+
+void ThreadValidationInterfaceQueue()
+{
+    g_queue.Thread();
+}
+
+void SyncWithValidationInterfaceQueue()
+{
+    g_queue.WaitUntilBelow(0);
+}
+
+void LimitValidationInterfaceQueue()
+{
+    g_queue.WaitUntilBelow(MAX_VALIDATION_QUEUE_SIZE - 1);
+}
+
+void RegisterValidationInterface(CValidationInterface* pwalletIn, bool fQueued) {
+    if (fQueued) {
+        // Each slot copies what its callback needs into the queued call
+        std::vector<boost::signals2::connection>& vConnections = g_queuedConnections[pwalletIn];
+        boost::function<void (const CBlockIndex *, const CBlock *)> updatedBlockTip = boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2);
+        vConnections.push_back(g_signals.UpdatedBlockTip.connect([updatedBlockTip](const CBlockIndex *pindex, const CBlock *pblock) {
+            std::shared_ptr<const CBlock> block(pblock ? new CBlock(*pblock) : NULL);
+            g_queue.Add([updatedBlockTip, pindex, block]() { updatedBlockTip(pindex, block.get()); });
+        }));
+        boost::function<void (const CTransaction &, const CBlockIndex *, const CBlock *)> syncTransaction = boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3);
+        vConnections.push_back(g_signals.SyncTransaction.connect([syncTransaction](const CTransaction &tx, const CBlockIndex *pindex, const CBlock *pblock) {
+            std::shared_ptr<const CTransaction> ptx = std::make_shared<const CTransaction>(tx);
+            std::shared_ptr<const CBlock> block(pblock ? new CBlock(*pblock) : NULL);
+            g_queue.Add([syncTransaction, ptx, pindex, block]() { syncTransaction(*ptx, pindex, block.get()); });
+        }));
+        boost::function<void (const std::vector<CTransactionRef> &, const CBlockIndex *, const CBlock *)> syncTransactions = boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2, _3);
+        vConnections.push_back(g_signals.SyncTransactions.connect([syncTransactions](const std::vector<CTransactionRef> &vtx, const CBlockIndex *pindex, const CBlock *pblock) {
+            // The copies share the transactions, only the references are copied
+            std::shared_ptr<const CBlock> block(pblock ? new CBlock(*pblock) : NULL);
+            std::shared_ptr<const std::vector<CTransactionRef> > pvtx;
+            if (block && &vtx == &pblock->vtx)
+                pvtx = std::shared_ptr<const std::vector<CTransactionRef> >(block, &block->vtx);
+            else
+                pvtx = std::make_shared<const std::vector<CTransactionRef> >(vtx);
+            g_queue.Add([syncTransactions, pvtx, pindex, block]() { syncTransactions(*pvtx, pindex, block.get()); });
+        }));
+        boost::function<void (const uint256 &)> updatedTransaction = boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1);
+        vConnections.push_back(g_signals.UpdatedTransaction.connect([updatedTransaction](const uint256 &hash) {
+            g_queue.Add(boost::bind(updatedTransaction, hash));
+        }));
+        boost::function<void (const CBlockLocator &)> setBestChain = boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1);
+        vConnections.push_back(g_signals.SetBestChain.connect([setBestChain](const CBlockLocator &locator) {
+            g_queue.Add(boost::bind(setBestChain, locator));
+        }));
+        boost::function<void (const uint256 &)> inventory = boost::bind(&CValidationInterface::Inventory, pwalletIn, _1);
+        vConnections.push_back(g_signals.Inventory.connect([inventory](const uint256 &hash) {
+            g_queue.Add(boost::bind(inventory, hash));
+        }));
+        boost::function<void (int64_t)> resendWalletTransactions = boost::bind(&CValidationInterface::ResendWalletTransactions, pwalletIn, _1);
+        vConnections.push_back(g_signals.Broadcast.connect([resendWalletTransactions](int64_t nBestBlockTime) {
+            g_queue.Add(boost::bind(resendWalletTransactions, nBestBlockTime));
+        }));
+        boost::function<void (const CBlock &, const CValidationState &)> blockChecked = boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2);
+        vConnections.push_back(g_signals.BlockChecked.connect([blockChecked](const CBlock &block, const CValidationState &state) {
+            std::shared_ptr<const CBlock> pblock = std::make_shared<const CBlock>(block);
+            g_queue.Add([blockChecked, pblock, state]() { blockChecked(*pblock, state); });
+        }));
+        g_signals.ScriptForMining.connect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
+        boost::function<void (const uint256 &)> resetRequestCount = boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1);
+        vConnections.push_back(g_signals.BlockFound.connect([resetRequestCount](const uint256 &hash) {
+            g_queue.Add(boost::bind(resetRequestCount, hash));
+        }));
+        boost::function<void (const boost::shared_ptr<const CIndexUpdate> &)> updatedIndexes = boost::bind(&CValidationInterface::UpdatedIndexes, pwalletIn, _1);
+        vConnections.push_back(g_signals.UpdatedIndexes.connect([updatedIndexes](const boost::shared_ptr<const CIndexUpdate> &update) {
+            g_queue.Add(boost::bind(updatedIndexes, update));
+        }));
+        boost::function<void (const uint256 &, bool, uint64_t)> updatedMempool = boost::bind(&CValidationInterface::UpdatedMempool, pwalletIn, _1, _2, _3);
+        vConnections.push_back(g_signals.UpdatedMempool.connect([updatedMempool](const uint256 &txhash, bool fAdded, uint64_t nSequence) {
+            g_queue.Add(boost::bind(updatedMempool, txhash, fAdded, nSequence));
+        }));
+        boost::function<void (const boost::shared_ptr<const CMempoolAddressUpdate> &)> updatedMempoolAddresses = boost::bind(&CValidationInterface::UpdatedMempoolAddresses, pwalletIn, _1);
+        vConnections.push_back(g_signals.UpdatedMempoolAddresses.connect([updatedMempoolAddresses](const boost::shared_ptr<const CMempoolAddressUpdate> &update) {
+            g_queue.Add(boost::bind(updatedMempoolAddresses, update));
+        }));
+        return;
+    }
+    g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2));
     g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
+    g_signals.SyncTransactions.connect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2, _3));
     g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
     g_signals.Inventory.connect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
@@ -22,9 +196,21 @@ void RegisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.BlockChecked.connect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
     g_signals.ScriptForMining.connect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
     g_signals.BlockFound.connect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
+    g_signals.UpdatedIndexes.connect(boost::bind(&CValidationInterface::UpdatedIndexes, pwalletIn, _1));
+    g_signals.UpdatedMempool.connect(boost::bind(&CValidationInterface::UpdatedMempool, pwalletIn, _1, _2, _3));
+    g_signals.UpdatedMempoolAddresses.connect(boost::bind(&CValidationInterface::UpdatedMempoolAddresses, pwalletIn, _1));
 }
 
 void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
+    std::map<CValidationInterface*, std::vector<boost::signals2::connection> >::iterator it = g_queuedConnections.find(pwalletIn);
+    if (it != g_queuedConnections.end()) {
+        BOOST_FOREACH(boost::signals2::connection& connection, it->second)
+            connection.disconnect();
+        g_queuedConnections.erase(it);
+    }
+    g_signals.UpdatedMempoolAddresses.disconnect(boost::bind(&CValidationInterface::UpdatedMempoolAddresses, pwalletIn, _1));
+    g_signals.UpdatedMempool.disconnect(boost::bind(&CValidationInterface::UpdatedMempool, pwalletIn, _1, _2, _3));
+    g_signals.UpdatedIndexes.disconnect(boost::bind(&CValidationInterface::UpdatedIndexes, pwalletIn, _1));
     g_signals.BlockFound.disconnect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
     g_signals.ScriptForMining.disconnect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
     g_signals.BlockChecked.disconnect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
@@ -32,11 +218,16 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.Inventory.disconnect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
     g_signals.SetBestChain.disconnect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
+    g_signals.SyncTransactions.disconnect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2, _3));
     g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
-    g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
+    g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2));
 }
 
 void UnregisterAllValidationInterfaces() {
+    g_queuedConnections.clear();
+    g_signals.UpdatedMempoolAddresses.disconnect_all_slots();
+    g_signals.UpdatedMempool.disconnect_all_slots();
+    g_signals.UpdatedIndexes.disconnect_all_slots();
     g_signals.BlockFound.disconnect_all_slots();
     g_signals.ScriptForMining.disconnect_all_slots();
     g_signals.BlockChecked.disconnect_all_slots();
@@ -44,6 +235,7 @@ void UnregisterAllValidationInterfaces() {
     g_signals.Inventory.disconnect_all_slots();
     g_signals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
+    g_signals.SyncTransactions.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
     g_signals.UpdatedBlockTip.disconnect_all_slots();
 }
@@ -51,3 +243,12 @@ void UnregisterAllValidationInterfaces() {
 void SyncWithWallets(const CTransaction &tx, const CBlockIndex *pindex, const CBlock *pblock) {
     g_signals.SyncTransaction(tx, pindex, pblock);
 }
+
+void SyncBlockWithWallets(const std::vector<CTransactionRef> &vtx, const CBlockIndex *pindex, const CBlock *pblock) {
+    g_signals.SyncTransactions(vtx, pindex, pblock);
+}
+
+void CValidationInterface::SyncTransactions(const std::vector<CTransactionRef> &vtx, const CBlockIndex *pindex, const CBlock *pblock) {
+    BOOST_FOREACH(const CTransactionRef &tx, vtx)
+        SyncTransaction(*tx, pindex, pblock);
+}
@@ -6,6 +6,10 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include "primitives/transaction.h"
+
+#include <vector>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -14,26 +18,47 @@ class CBlockIndex;
 struct CBlockLocator;
 class CBlockIndex;
 class CReserveScript;
-class CTransaction;
 class CValidationInterface;
 class CValidationState;
+struct CIndexUpdate;
+struct CMempoolAddressUpdate;
 class uint256;
 
+//! Callbacks queued for subscribers past which LimitValidationInterfaceQueue waits
+static const size_t MAX_VALIDATION_QUEUE_SIZE = 100;
+
 // These functions dispatch to one or all registered wallets
 
-/** Register a wallet to receive updates from core */
-void RegisterValidationInterface(CValidationInterface* pwalletIn);
+/**
+ * Register a wallet to receive updates from core. A queued one gets them on the thread of
+ * ThreadValidationInterfaceQueue instead of on the caller's, in the order they were sent,
+ * with their arguments copied; GetScriptForMining, which returns a result, is still called
+ * directly. Until that thread runs, queued callbacks are called directly too.
+ */
+void RegisterValidationInterface(CValidationInterface* pwalletIn, bool fQueued = false);
 /** Unregister a wallet from core */
 void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlockIndex *pindex, const CBlock* pblock = NULL);
+/** Push the transactions of a connected or disconnected block to all registered wallets at once */
+void SyncBlockWithWallets(const std::vector<CTransactionRef>& vtx, const CBlockIndex *pindex, const CBlock* pblock = NULL);
+
+/** Run the callbacks queued for subscribers, until interrupted; the rest are run on the way out */
+void ThreadValidationInterfaceQueue();
+/** Wait until the callbacks queued so far have run. Must not be called holding cs_main. */
+void SyncWithValidationInterfaceQueue();
+/** Wait until fewer than MAX_VALIDATION_QUEUE_SIZE callbacks are queued. Must not be called holding cs_main. */
+void LimitValidationInterfaceQueue();
 
 class CValidationInterface {
 protected:
-    virtual void UpdatedBlockTip(const CBlockIndex *pindex) {}
+    /** pblock is the new tip's block if it is in memory, else NULL */
+    virtual void UpdatedBlockTip(const CBlockIndex *pindex, const CBlock *pblock) {}
     virtual void SyncTransaction(const CTransaction &tx, const CBlockIndex *pindex, const CBlock *pblock) {}
+    /** The transactions of a block; by default passed to SyncTransaction one at a time */
+    virtual void SyncTransactions(const std::vector<CTransactionRef> &vtx, const CBlockIndex *pindex, const CBlock *pblock);
     virtual void SetBestChain(const CBlockLocator &locator) {}
     virtual void UpdatedTransaction(const uint256 &hash) {}
     virtual void Inventory(const uint256 &hash) {}
@@ -41,16 +66,21 @@ protected:
     virtual void BlockChecked(const CBlock&, const CValidationState&) {}
     virtual void GetScriptForMining(boost::shared_ptr<CReserveScript>&) {};
     virtual void ResetRequestCount(const uint256 &hash) {};
-    friend void ::RegisterValidationInterface(CValidationInterface*);
+    virtual void UpdatedIndexes(const boost::shared_ptr<const CIndexUpdate> &update) {}
+    virtual void UpdatedMempool(const uint256 &txhash, bool fAdded, uint64_t nSequence) {}
+    virtual void UpdatedMempoolAddresses(const boost::shared_ptr<const CMempoolAddressUpdate> &update) {}
+    friend void ::RegisterValidationInterface(CValidationInterface*, bool);
     friend void ::UnregisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterAllValidationInterfaces();
 };
 
 struct CMainSignals {
-    /** Notifies listeners of updated block chain tip */
-    boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
+    /** Notifies listeners of updated block chain tip, and its block if it is in memory */
+    boost::signals2::signal<void (const CBlockIndex *, const CBlock *)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlockIndex *pindex, const CBlock *)> SyncTransaction;
+    /** Notifies listeners of the transactions of a block connected or disconnected, or that conflicted with one */
+    boost::signals2::signal<void (const std::vector<CTransactionRef> &, const CBlockIndex *pindex, const CBlock *)> SyncTransactions;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
     boost::signals2::signal<void (const uint256 &)> UpdatedTransaction;
     /** Notifies listeners of a new active block chain. */
@@ -65,6 +95,12 @@ struct CMainSignals {
     boost::signals2::signal<void (boost::shared_ptr<CReserveScript>&)> ScriptForMining;
     /** Notifies listeners that a block has been successfully mined */
     boost::signals2::signal<void (const uint256 &)> BlockFound;
+    /** Notifies listeners of the optional index entries of a connected or disconnected block */
+    boost::signals2::signal<void (const boost::shared_ptr<const CIndexUpdate> &)> UpdatedIndexes;
+    /** Notifies listeners of a transaction added to or removed from the mempool, with the mempool's sequence number after the change; sent holding mempool.cs */
+    boost::signals2::signal<void (const uint256 &, bool, uint64_t)> UpdatedMempool;
+    /** Notifies listeners of the address index deltas of a transaction added to or removed from the mempool; sent holding mempool.cs */
+    boost::signals2::signal<void (const boost::shared_ptr<const CMempoolAddressUpdate> &)> UpdatedMempoolAddresses;
 };
 
 CMainSignals& GetMainSignals();
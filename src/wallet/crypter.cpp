@@ -162,6 +162,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        mapUnlockedKeys.clear();
     }
 
     NotifyStatusChanged(this);
@@ -175,32 +176,17 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (!SetCrypted())
             return false;
 
-        bool keyPass = false;
-        bool keyFail = false;
+        // One key that decrypts proves the master key, the others are checked
+        // by GetKey when they are first used
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi)
-        {
-            const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CKey key;
-            if (!DecryptKey(vMasterKeyIn, vchCryptedSecret, vchPubKey, key))
-            {
-                keyFail = true;
-                break;
-            }
-            keyPass = true;
-            if (fDecryptionThoroughlyChecked)
-                break;
-        }
-        if (keyPass && keyFail)
-        {
-            LogPrintf("The wallet is probably corrupted: Some keys decrypt but not all.\n");
-            assert(false);
-        }
-        if (keyFail || !keyPass)
+        if (mi == mapCryptedKeys.end())
+            return false;
+        CKey key;
+        if (!DecryptKey(vMasterKeyIn, (*mi).second.second, (*mi).second.first, key))
             return false;
         vMasterKey = vMasterKeyIn;
-        fDecryptionThoroughlyChecked = true;
+        mapUnlockedKeys.clear();
+        mapUnlockedKeys[(*mi).first] = key;
     }
     NotifyStatusChanged(this);
     return true;
@@ -236,6 +222,7 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
             return false;
 
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
+        mapUnlockedKeys.erase(vchPubKey.GetID());
     }
     return true;
 }
@@ -247,12 +234,26 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         if (!IsCrypted())
             return CBasicKeyStore::GetKey(address, keyOut);
 
+        std::map<CKeyID, CKey>::const_iterator it = mapUnlockedKeys.find(address);
+        if (it != mapUnlockedKeys.end())
+        {
+            keyOut = it->second;
+            return true;
+        }
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
         {
             const CPubKey &vchPubKey = (*mi).second.first;
             const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            return DecryptKey(vMasterKey, vchCryptedSecret, vchPubKey, keyOut);
+            if (!DecryptKey(vMasterKey, vchCryptedSecret, vchPubKey, keyOut))
+            {
+                // The master key was checked on unlock, so this key itself is bad
+                if (!vMasterKey.empty())
+                    LogPrintf("The wallet is probably corrupted: key %s does not decrypt\n", address.ToString());
+                return false;
+            }
+            mapUnlockedKeys[address] = keyOut;
+            return true;
         }
     }
     return false;
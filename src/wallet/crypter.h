@@ -128,8 +128,9 @@ private:
     //! if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
 
-    //! keeps track of whether Unlock has run a thorough check before
-    bool fDecryptionThoroughlyChecked;
+    //! keys decrypted and checked against their public key since the wallet was
+    //! unlocked, so that each is decrypted once however many inputs it signs
+    mutable std::map<CKeyID, CKey> mapUnlockedKeys;
 
 protected:
     bool SetCrypted();
@@ -140,7 +141,7 @@ protected:
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
 public:
-    CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
+    CCryptoKeyStore() : fUseCrypto(false)
     {
     }
 
@@ -25,6 +25,30 @@ using namespace std;
 
 
 unsigned int nWalletDBUpdated;
+static boost::mutex csWalletDBUpdated;
+static boost::condition_variable condWalletDBUpdated;
+
+void MarkWalletDBUpdated()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csWalletDBUpdated);
+        nWalletDBUpdated++;
+    }
+    condWalletDBUpdated.notify_all();
+}
+
+bool WaitWalletDBUpdated(unsigned int& nSeen, int64_t nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(csWalletDBUpdated);
+    boost::chrono::steady_clock::time_point until = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(nMilliseconds);
+    while (nWalletDBUpdated == nSeen) {
+        if (condWalletDBUpdated.wait_until(lock, until) == boost::cv_status::timeout)
+            break;
+    }
+    bool fChanged = nWalletDBUpdated != nSeen;
+    nSeen = nWalletDBUpdated;
+    return fChanged;
+}
 
 
 //
@@ -240,7 +264,67 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+static thread_local CDBTxnScope* pcurrentTxnScope = NULL;
+
+CDBTxnScope::CDBTxnScope(const std::string& strFileIn) : ptxn(NULL)
+{
+    if (strFileIn.empty() || pcurrentTxnScope)
+        return;
+    {
+        LOCK(bitdb.cs_db);
+        if (!bitdb.Open(GetDataDir()))
+            return;
+        ptxn = bitdb.TxnBegin();
+        if (!ptxn)
+            return;
+        // Keep ThreadFlushWalletDB from closing the file under the transaction
+        strFile = strFileIn;
+        ++bitdb.mapFileUseCount[strFile];
+    }
+    pcurrentTxnScope = this;
+}
+
+CDBTxnScope::~CDBTxnScope()
+{
+    if (!ptxn)
+        return;
+    if (ptxn->commit(0) != 0)
+        LogPrintf("%s: committing the writes to %s failed\n", __func__, strFile);
+    ptxn = NULL;
+    pcurrentTxnScope = NULL;
+    bitdb.dbenv->txn_checkpoint(0, 0, 0);
+    {
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+    }
+}
+
+bool CDBTxnScope::Commit()
+{
+    if (!ptxn)
+        return true;
+    bool fOk = ptxn->commit(0) == 0;
+    if (!fOk)
+        LogPrintf("%s: committing the writes to %s failed\n", __func__, strFile);
+    ptxn = bitdb.TxnBegin();
+    if (!ptxn) {
+        // Go on writing outside a transaction
+        pcurrentTxnScope = NULL;
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+        return false;
+    }
+    return fOk;
+}
+
+DbTxn* CDBTxnScope::GetTxn(const std::string& strFile)
+{
+    if (!pcurrentTxnScope || pcurrentTxnScope->strFile != strFile)
+        return NULL;
+    return pcurrentTxnScope->ptxn;
+}
+
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL), fScopedTxn(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -297,6 +381,13 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
             bitdb.mapDb[strFile] = pdb;
         }
     }
+
+    // Join the transaction of a CDBTxnScope of this thread, which flushes once it ends
+    activeTxn = CDBTxnScope::GetTxn(strFile);
+    if (activeTxn) {
+        fScopedTxn = true;
+        fFlushOnClose = false;
+    }
 }
 
 void CDB::Flush()
@@ -316,9 +407,10 @@ void CDB::Close()
 {
     if (!pdb)
         return;
-    if (activeTxn)
+    if (activeTxn && !fScopedTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    fScopedTxn = false;
     pdb = NULL;
 
     if (fFlushOnClose)
@@ -25,6 +25,11 @@ static const bool DEFAULT_WALLET_PRIVDB = true;
 
 extern unsigned int nWalletDBUpdated;
 
+/** Count a write to the wallet database, waking ThreadFlushWalletDB */
+void MarkWalletDBUpdated();
+/** Wait until nWalletDBUpdated differs from nSeen or nMilliseconds pass; set nSeen to it and return whether it changed */
+bool WaitWalletDBUpdated(unsigned int& nSeen, int64_t nMilliseconds);
+
 class CDBEnv
 {
 private:
@@ -89,6 +94,34 @@ public:
 
 extern CDBEnv bitdb;
 
+/**
+ * Scope in which the writes of the calling thread to strFile go into one transaction,
+ * committed when the scope ends, with one checkpoint then instead of a commit per write
+ * and a checkpoint per CDB. Writes of other threads wait for the transaction, so open
+ * it with the lock that orders the writers of the file held, cs_wallet for the wallet.
+ * A scope opened inside another one of the thread adds to the outer transaction.
+ */
+class CDBTxnScope
+{
+private:
+    std::string strFile;
+    DbTxn* ptxn;
+
+    CDBTxnScope(const CDBTxnScope&);
+    void operator=(const CDBTxnScope&);
+
+public:
+    explicit CDBTxnScope(const std::string& strFileIn);
+    ~CDBTxnScope();
+
+    /** Commit what was written so far and go on in a new transaction; no CDB of the
+     * thread may be open on the file */
+    bool Commit();
+
+    /** The transaction the writes of the calling thread to strFile go into, if any */
+    static DbTxn* GetTxn(const std::string& strFile);
+};
+
 
 /** RAII class that provides access to a Berkeley database */
 class CDB
@@ -97,6 +130,8 @@ protected:
     Db* pdb;
     std::string strFile;
     DbTxn* activeTxn;
+    //! activeTxn is that of a CDBTxnScope, which commits it
+    bool fScopedTxn;
     bool fReadOnly;
     bool fFlushOnClose;
 
@@ -222,7 +257,7 @@ protected:
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(activeTxn, &pcursor, 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -279,7 +314,7 @@ public:
 
     bool TxnCommit()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fScopedTxn)
             return false;
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
@@ -288,7 +323,7 @@ public:
 
     bool TxnAbort()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fScopedTxn)
             return false;
         int ret = activeTxn->abort();
         activeTxn = NULL;
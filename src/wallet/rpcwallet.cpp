@@ -16,6 +16,7 @@
 #include "timedata.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "validationinterface.h"
 #include "wallet.h"
 #include "walletdb.h"
 
@@ -46,6 +47,9 @@ bool EnsureWalletIsAvailable(bool avoidException)
         else
             return false;
     }
+    // Let the wallet catch up with the validation events queued for it
+    if (GetBoolArg("-asyncwalletsignals", DEFAULT_ASYNC_WALLET_SIGNALS))
+        SyncWithValidationInterfaceQueue();
     return true;
 }
 
@@ -90,7 +94,7 @@ void WalletTxToJSON(const CWalletTx& wtx, UniValue& entry)
     }
     entry.push_back(Pair("bip125-replaceable", rbfStatus));
 
-    BOOST_FOREACH(const PAIRTYPE(string,string)& item, wtx.mapValue)
+    BOOST_FOREACH(const PAIRTYPE(string,string)& item, wtx.GetMapValue())
         entry.push_back(Pair(item.first, item.second));
 }
 
@@ -410,9 +414,9 @@ UniValue sendtoaddress(const UniValue& params, bool fHelp)
     // Wallet comments
     CWalletTx wtx;
     if (params.size() > 2 && !params[2].isNull() && !params[2].get_str().empty())
-        wtx.mapValue["comment"] = params[2].get_str();
+        wtx.MapValue()["comment"] = params[2].get_str();
     if (params.size() > 3 && !params[3].isNull() && !params[3].get_str().empty())
-        wtx.mapValue["to"]      = params[3].get_str();
+        wtx.MapValue()["to"]      = params[3].get_str();
 
     bool fSubtractFeeFromAmount = false;
     if (params.size() > 4)
@@ -608,7 +612,7 @@ UniValue getreceivedbyaddress(const UniValue& params, bool fHelp)
 
     // Tally
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    for (WalletTxMap::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
     {
         const CWalletTx& wtx = (*it).second;
         if (wtx.IsCoinBase() || !CheckFinalTx(wtx))
@@ -662,7 +666,7 @@ UniValue getreceivedbyaccount(const UniValue& params, bool fHelp)
 
     // Tally
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    for (WalletTxMap::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
     {
         const CWalletTx& wtx = (*it).second;
         if (wtx.IsCoinBase() || !CheckFinalTx(wtx))
@@ -741,7 +745,7 @@ UniValue getbalance(const UniValue& params, bool fHelp)
         // (GetBalance() sums up all unspent TxOuts)
         // getbalance and "getbalance * 1 true" should return the same number
         CAmount nBalance = 0;
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+        for (WalletTxMap::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
             if (!CheckFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < 0)
@@ -892,11 +896,11 @@ UniValue sendfrom(const UniValue& params, bool fHelp)
         nMinDepth = params[3].get_int();
 
     CWalletTx wtx;
-    wtx.strFromAccount = strAccount;
+    wtx.SetFromAccount(strAccount);
     if (params.size() > 4 && !params[4].isNull() && !params[4].get_str().empty())
-        wtx.mapValue["comment"] = params[4].get_str();
+        wtx.MapValue()["comment"] = params[4].get_str();
     if (params.size() > 5 && !params[5].isNull() && !params[5].get_str().empty())
-        wtx.mapValue["to"]      = params[5].get_str();
+        wtx.MapValue()["to"]      = params[5].get_str();
 
     EnsureWalletIsUnlocked();
 
@@ -961,9 +965,9 @@ UniValue sendmany(const UniValue& params, bool fHelp)
         nMinDepth = params[2].get_int();
 
     CWalletTx wtx;
-    wtx.strFromAccount = strAccount;
+    wtx.SetFromAccount(strAccount);
     if (params.size() > 3 && !params[3].isNull() && !params[3].get_str().empty())
-        wtx.mapValue["comment"] = params[3].get_str();
+        wtx.MapValue()["comment"] = params[3].get_str();
 
     UniValue subtractFeeFromAmount(UniValue::VARR);
     if (params.size() > 4)
@@ -1195,7 +1199,7 @@ UniValue ListReceived(const UniValue& params, bool fByAccounts)
 
     // Tally
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    for (WalletTxMap::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
     {
         const CWalletTx& wtx = (*it).second;
 
@@ -1475,15 +1479,18 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
     if (!EnsureWalletIsAvailable(fHelp))
         return NullUniValue;
 
-    if (fHelp || params.size() > 4)
+    if (fHelp || params.size() > 5)
         throw runtime_error(
-            "listtransactions ( \"account\" count from includeWatchonly)\n"
+            "listtransactions ( \"account\" count from includeWatchonly before )\n"
             "\nReturns up to 'count' most recent transactions skipping the first 'from' transactions for account 'account'.\n"
             "\nArguments:\n"
             "1. \"account\"    (string, optional) DEPRECATED. The account name. Should be \"*\".\n"
             "2. count          (numeric, optional, default=10) The number of transactions to return\n"
             "3. from           (numeric, optional, default=0) The number of transactions to skip\n"
             "4. includeWatchonly (bool, optional, default=false) Include transactions to watchonly addresses (see 'importaddress')\n"
+            "5. before         (numeric, optional) Only list what the wallet ordered before this 'orderpos'. Pass the\n"
+            "                  'orderpos' of the first (oldest) entry of a page to get the page before it without\n"
+            "                  going through the newer transactions again, 'from' then counts from there\n"
             "\nResult:\n"
             "[\n"
             "  {\n"
@@ -1522,6 +1529,8 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
             "                                          negative amounts).\n"
             "    \"bip125-replaceable\": \"yes|no|unknown\"  (string) Whether this transaction could be replaced due to BIP125 (replace-by-fee);\n"
             "                                                     may be unknown for unconfirmed transactions not in the mempool\n"
+            "    \"orderpos\": n            (numeric) The position of the transaction or move in the wallet's order, shared by\n"
+            "                                          all entries of one transaction\n"
             "  }\n"
             "]\n"
 
@@ -1530,6 +1539,8 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
             + HelpExampleCli("listtransactions", "") +
             "\nList transactions 100 to 120\n"
             + HelpExampleCli("listtransactions", "\"*\" 20 100") +
+            "\nList the 20 transactions before the one with orderpos 1234\n"
+            + HelpExampleCli("listtransactions", "\"*\" 20 0 false 1234") +
             "\nAs a json rpc call\n"
             + HelpExampleRpc("listtransactions", "\"*\", 20, 100")
         );
@@ -1549,36 +1560,42 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
     if(params.size() > 3)
         if(params[3].get_bool())
             filter = filter | ISMINE_WATCH_ONLY;
+    int64_t nBefore = std::numeric_limits<int64_t>::max();
+    if (params.size() > 4)
+        nBefore = params[4].get_int64();
 
     if (nCount < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
-    UniValue ret(UniValue::VARR);
+    vector<UniValue> arrTmp;
 
     const CWallet::TxItems & txOrdered = pwalletMain->wtxOrdered;
 
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    // iterate backwards from the cursor until we have nCount items to return:
+    for (CWallet::TxItems::const_reverse_iterator it(txOrdered.lower_bound(nBefore)); it != txOrdered.rend(); ++it)
     {
+        UniValue entries(UniValue::VARR);
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
+            ListTransactions(*pwtx, strAccount, 0, true, entries, filter);
         CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+            AcentryToJSON(*pacentry, strAccount, entries);
+        BOOST_FOREACH(const UniValue& entry, entries.getValues()) {
+            arrTmp.push_back(entry);
+            arrTmp.back().pushKV("orderpos", (*it).first);
+        }
 
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        if ((int)arrTmp.size() >= (nCount+nFrom)) break;
     }
-    // ret is newest to oldest
+    // arrTmp is newest to oldest
 
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-
-    vector<UniValue> arrTmp = ret.getValues();
+    if (nFrom > (int)arrTmp.size())
+        nFrom = arrTmp.size();
+    if ((nFrom + nCount) > (int)arrTmp.size())
+        nCount = arrTmp.size() - nFrom;
 
     vector<UniValue>::iterator first = arrTmp.begin();
     std::advance(first, nFrom);
@@ -1590,8 +1607,7 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
 
     std::reverse(arrTmp.begin(), arrTmp.end()); // Return oldest to newest
 
-    ret.clear();
-    ret.setArray();
+    UniValue ret(UniValue::VARR);
     ret.push_backV(arrTmp);
 
     return ret;
@@ -1641,7 +1657,7 @@ UniValue listaccounts(const UniValue& params, bool fHelp)
             mapAccountBalances[entry.second.name] = 0;
     }
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    for (WalletTxMap::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
     {
         const CWalletTx& wtx = (*it).second;
         CAmount nFee;
@@ -1750,12 +1766,19 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
 
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        for (WalletTxMap::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions, filter);
+    }
+    else
+    {
+        // Only the transactions in blocks above pindex or not confirmed can be less deep
+        std::vector<const CWalletTx*> vTxs;
+        pwalletMain->GetTxsAboveHeight(pindex->nHeight, vTxs);
+        BOOST_FOREACH(const CWalletTx* pwtx, vTxs)
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions, filter);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -2084,8 +2107,6 @@ UniValue keypoolrefill(const UniValue& params, bool fHelp)
             + HelpExampleRpc("keypoolrefill", "")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
     // 0 is interpreted by TopUpKeyPool() as the default keypool size given by -keypool
     unsigned int kpSize = 0;
     if (params.size() > 0) {
@@ -2094,9 +2115,11 @@ UniValue keypoolrefill(const UniValue& params, bool fHelp)
         kpSize = (unsigned int)params[0].get_int();
     }
 
+    // Without cs_wallet held, so addresses can still be handed out while the keys are generated
     EnsureWalletIsUnlocked();
     pwalletMain->TopUpKeyPool(kpSize);
 
+    LOCK(pwalletMain->cs_wallet);
     if (pwalletMain->GetKeyPoolSize() < kpSize)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error refreshing keypool.");
 
@@ -2494,6 +2517,7 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
             "  \"unconfirmed_balance\": xxx,   (numeric) the total unconfirmed balance of the wallet in " + CURRENCY_UNIT + "\n"
             "  \"immature_balance\": xxxxxx,   (numeric) the total immature balance of the wallet in " + CURRENCY_UNIT + "\n"
             "  \"txcount\": xxxxxxx,           (numeric) the total number of transactions in the wallet\n"
+            "  \"txmemusage\": xxxxx,          (numeric) bytes of memory taken by the transactions of the wallet and their indexes\n"
             "  \"keypoololdest\": xxxxxx,      (numeric) the timestamp (seconds since Unix epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,          (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,        (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
@@ -2513,6 +2537,7 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("unconfirmed_balance", ValueFromAmount(pwalletMain->GetUnconfirmedBalance())));
     obj.push_back(Pair("immature_balance",    ValueFromAmount(pwalletMain->GetImmatureBalance())));
     obj.push_back(Pair("txcount",       (int)pwalletMain->mapWallet.size()));
+    obj.push_back(Pair("txmemusage",    (uint64_t)(pwalletMain->mapWallet.size() * sizeof(CWalletTx) + pwalletMain->GetTxMemoryUsage())));
     obj.push_back(Pair("keypoololdest", pwalletMain->GetOldestKeyPoolTime()));
     obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
     if (pwalletMain->IsCrypted())
@@ -47,7 +47,7 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     ae.strComment = "";
     pwalletMain->AddAccountingEntry(ae, walletdb);
 
-    wtx.mapValue["comment"] = "z";
+    wtx.MapValue()["comment"] = "z";
     pwalletMain->AddToWallet(wtx, false, &walletdb);
     vpwtx.push_back(&pwalletMain->mapWallet[wtx.GetHash()]);
     vpwtx[0]->nTimeReceived = (unsigned int)1333333335;
@@ -84,7 +84,7 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     BOOST_CHECK(results[3].strComment.empty());
 
 
-    wtx.mapValue["comment"] = "y";
+    wtx.MapValue()["comment"] = "y";
     {
         CMutableTransaction tx(wtx);
         --tx.nLockTime;  // Just to change the hash :)
@@ -94,7 +94,7 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     vpwtx.push_back(&pwalletMain->mapWallet[wtx.GetHash()]);
     vpwtx[1]->nTimeReceived = (unsigned int)1333333336;
 
-    wtx.mapValue["comment"] = "x";
+    wtx.MapValue()["comment"] = "x";
     {
         CMutableTransaction tx(wtx);
         --tx.nLockTime;  // Just to change the hash :)
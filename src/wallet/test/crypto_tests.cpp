@@ -235,4 +235,48 @@ BOOST_AUTO_TEST_CASE(decrypt) {
     }
 }
 
+class TestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    using CCryptoKeyStore::EncryptKeys;
+    using CCryptoKeyStore::Unlock;
+};
+
+BOOST_AUTO_TEST_CASE(keystore_unlock) {
+    TestCryptoKeyStore keystore;
+    std::vector<CKey> vKeys(3);
+    for (size_t i = 0; i < vKeys.size(); i++) {
+        vKeys[i].MakeNewKey(true);
+        BOOST_CHECK(keystore.AddKeyPubKey(vKeys[i], vKeys[i].GetPubKey()));
+    }
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vMasterKey[0], vMasterKey.size());
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+    BOOST_CHECK(keystore.IsLocked());
+
+    CKey keyOut;
+    BOOST_CHECK(!keystore.GetKey(vKeys[0].GetPubKey().GetID(), keyOut));
+    BOOST_CHECK(!keystore.Unlock(CKeyingMaterial(WALLET_CRYPTO_KEY_SIZE, 0)));
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+
+    // Twice, the second time from the keys decrypted since the unlock
+    for (int n = 0; n < 2; n++) {
+        for (size_t i = 0; i < vKeys.size(); i++) {
+            BOOST_CHECK(keystore.GetKey(vKeys[i].GetPubKey().GetID(), keyOut));
+            BOOST_CHECK(keyOut == vKeys[i]);
+        }
+    }
+
+    // A key that does not decrypt is only found out when it is used
+    CKey keyBad;
+    keyBad.MakeNewKey(true);
+    std::vector<unsigned char> vchCryptedSecret(48, 0x55);
+    BOOST_CHECK(keystore.AddCryptedKey(keyBad.GetPubKey(), vchCryptedSecret));
+    BOOST_CHECK(!keystore.GetKey(keyBad.GetPubKey().GetID(), keyOut));
+    BOOST_CHECK(keystore.GetKey(vKeys[1].GetPubKey().GetID(), keyOut));
+
+    BOOST_CHECK(keystore.Lock());
+    BOOST_CHECK(!keystore.GetKey(vKeys[1].GetPubKey().GetID(), keyOut));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
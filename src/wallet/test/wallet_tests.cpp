@@ -254,9 +254,11 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(MIN_CHANGE * 100);
 
         // trying to make 100.01 from these three coins
+        // 100 + 0.05 is over by less than a change output is worth, so that is spent without change
+        BOOST_CHECK(MIN_CHANGE * 4 / 100 < CWallet::GetChangeDustThreshold());
         BOOST_CHECK(wallet.SelectCoinsMinConf(MIN_CHANGE * 10001 / 100, 1, 1, 0, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK_EQUAL(nValueRet, MIN_CHANGE * 10105 / 100); // we should get all coins
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+        BOOST_CHECK_EQUAL(nValueRet, MIN_CHANGE * 10005 / 100);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
 
         // but if we try to make 99.9, we should take the bigger of the two small coins to avoid small change
         BOOST_CHECK(wallet.SelectCoinsMinConf(MIN_CHANGE * 9990 / 100, 1, 1, 0, vCoins, setCoinsRet, nValueRet));
@@ -270,7 +272,12 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
              for (uint16_t j = 0; j < 676; j++)
                  add_coin(amt);
              BOOST_CHECK(wallet.SelectCoinsMinConf(2000, 1, 1, 0, vCoins, setCoinsRet, nValueRet));
-             if (amt - 2000 < MIN_CHANGE) {
+             uint16_t nChangeless = std::ceil(2000.0 / amt);
+             if (amt * nChangeless - 2000 < CWallet::GetChangeDustThreshold()) {
+                 // as few inputs as reach the target leave no change worth making:
+                 BOOST_CHECK_EQUAL(nValueRet, amt * nChangeless);
+                 BOOST_CHECK_EQUAL(setCoinsRet.size(), nChangeless);
+             } else if (amt - 2000 < MIN_CHANGE) {
                  // needs more than one input:
                  uint16_t returnSize = std::ceil((2000.0 + MIN_CHANGE)/amt);
                  CAmount returnValue = amt * returnSize;
@@ -351,4 +358,52 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
 }
 
+BOOST_AUTO_TEST_CASE(BranchAndBound)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    CAmount nDust = CWallet::GetChangeDustThreshold();
+
+    // a subset over the target by less than dust is preferred to the smallest bigger coin
+    empty_wallet();
+    add_coin(4 * CENT);
+    add_coin(6 * CENT + nDust / 2);
+    add_coin(30 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(10 * CENT, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT + nDust / 2);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // but not once it is over by as much as dust
+    empty_wallet();
+    add_coin(4 * CENT);
+    add_coin(6 * CENT + nDust);
+    add_coin(30 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(10 * CENT, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 30 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    // the closest of several changeless subsets wins
+    empty_wallet();
+    add_coin(7 * CENT);
+    add_coin(5 * CENT + nDust / 2);
+    add_coin(3 * CENT + nDust / 4);
+    add_coin(2 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(10 * CENT, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT + nDust / 4);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // many equal coins are searched once per count, not once per subset
+    empty_wallet();
+    for (int i = 0; i < 1000; i++)
+        add_coin(3 * CENT);
+    add_coin(1 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(301 * CENT, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 301 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 101U);
+    empty_wallet();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,11 +9,14 @@
 #include "checkpoints.h"
 #include "chain.h"
 #include "coincontrol.h"
+#include "indexbuilder.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "key.h"
 #include "keystore.h"
 #include "main.h"
+#include "memusage.h"
 #include "net.h"
 #include "policy/policy.h"
 #include "primitives/block.h"
@@ -80,7 +83,7 @@ std::string COutput::ToString() const
 const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
 {
     LOCK(cs_wallet);
-    std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    WalletTxMap::const_iterator it = mapWallet.find(hash);
     if (it == mapWallet.end())
         return NULL;
     return &(it->second);
@@ -100,24 +103,8 @@ CPubKey CWallet::GenerateNewKey()
     // use HD key derivation if HD was enabled during wallet creation
     if (!hdChain.masterKeyID.IsNull()) {
         // for now we use a fixed keypath scheme of m/0'/0'/k
-        CKey key;                      //master key seed (256bit)
-        CExtKey masterKey;             //hd master key
-        CExtKey accountKey;            //key at m/0'
-        CExtKey externalChainChildKey; //key at m/0'/0'
-        CExtKey childKey;              //key at m/0'/0'/<n>'
-
-        // try to get the master key
-        if (!GetKey(hdChain.masterKeyID, key))
-            throw std::runtime_error(std::string(__func__) + ": Master key not found");
-
-        masterKey.SetMaster(key.begin(), key.size());
-
-        // derive m/0'
-        // use hardened derivation (child keys >= 0x80000000 are hardened after bip32)
-        masterKey.Derive(accountKey, BIP32_HARDENED_KEY_LIMIT);
-
-        // derive m/0'/0'
-        accountKey.Derive(externalChainChildKey, BIP32_HARDENED_KEY_LIMIT);
+        CExtKey externalChainChildKey = GetExternalChainKey(); //key at m/0'/0'
+        CExtKey childKey;                                      //key at m/0'/0'/<n>'
 
         // derive child key at next index, skip keys already known to the wallet
         do
@@ -147,13 +134,42 @@ CPubKey CWallet::GenerateNewKey()
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
 
+    AddGeneratedKey(secret, pubkey, metadata);
+    return pubkey;
+}
+
+CExtKey CWallet::GetExternalChainKey() const
+{
+    AssertLockHeld(cs_wallet);
+    CKey key;                      //master key seed (256bit)
+    CExtKey masterKey;             //hd master key
+    CExtKey accountKey;            //key at m/0'
+    CExtKey externalChainChildKey; //key at m/0'/0'
+
+    // try to get the master key
+    if (!GetKey(hdChain.masterKeyID, key))
+        throw std::runtime_error(std::string(__func__) + ": Master key not found");
+
+    masterKey.SetMaster(key.begin(), key.size());
+
+    // derive m/0'
+    // use hardened derivation (child keys >= 0x80000000 are hardened after bip32)
+    masterKey.Derive(accountKey, BIP32_HARDENED_KEY_LIMIT);
+
+    // derive m/0'/0'
+    accountKey.Derive(externalChainChildKey, BIP32_HARDENED_KEY_LIMIT);
+    return externalChainChildKey;
+}
+
+void CWallet::AddGeneratedKey(const CKey& secret, const CPubKey& pubkey, const CKeyMetadata& metadata)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
     mapKeyMetadata[pubkey.GetID()] = metadata;
-    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
-        nTimeFirstKey = nCreationTime;
+    if (!nTimeFirstKey || metadata.nCreateTime < nTimeFirstKey)
+        nTimeFirstKey = metadata.nCreateTime;
 
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error(std::string(__func__) + ": AddKey failed");
-    return pubkey;
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
@@ -388,7 +404,7 @@ set<uint256> CWallet::GetConflicts(const uint256& txid) const
     set<uint256> result;
     AssertLockHeld(cs_wallet);
 
-    std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(txid);
+    WalletTxMap::const_iterator it = mapWallet.find(txid);
     if (it == mapWallet.end())
         return result;
     const CWalletTx& wtx = it->second;
@@ -492,13 +508,12 @@ void CWallet::SyncMetaData(pair<TxSpends::iterator, TxSpends::iterator> range)
         CWalletTx* copyTo = &mapWallet[hash];
         if (copyFrom == copyTo) continue;
         if (!copyFrom->IsEquivalentTo(*copyTo)) continue;
-        copyTo->mapValue = copyFrom->mapValue;
-        copyTo->vOrderForm = copyFrom->vOrderForm;
+        // mapValue, vOrderForm and strFromAccount
+        copyTo->CopyExtra(*copyFrom);
         // fTimeReceivedIsTxTime not copied on purpose
         // nTimeReceived not copied on purpose
         copyTo->nTimeSmart = copyFrom->nTimeSmart;
         copyTo->fFromMe = copyFrom->fFromMe;
-        copyTo->strFromAccount = copyFrom->strFromAccount;
         // nOrderPos not copied on purpose
         // cached members not copied on purpose
     }
@@ -517,7 +532,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
     {
         const uint256& wtxid = it->second;
-        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        WalletTxMap::const_iterator mit = mapWallet.find(wtxid);
         if (mit != mapWallet.end()) {
             int depth = mit->second.GetDepthInMainChain();
             if (depth > 0  || (depth == 0 && !mit->second.isAbandoned()))
@@ -527,9 +542,21 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     return false;
 }
 
+bool CWallet::IsSpentConfirmed(const uint256& hash, unsigned int n) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, n));
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        WalletTxMap::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            return true;
+    }
+    return false;
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    MarkBalanceDirty(outpoint.hash);
 
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
@@ -707,7 +734,7 @@ bool CWallet::GetAccountPubkey(CPubKey &pubKey, std::string strAccount, bool bFo
         else {
             // Check if the current key has been used
             CScript scriptPubKey = GetScriptForDestination(account.vchPubKey.GetID());
-            for (map<uint256, CWalletTx>::iterator it = mapWallet.begin();
+            for (WalletTxMap::iterator it = mapWallet.begin();
                  it != mapWallet.end() && account.vchPubKey.IsValid();
                  ++it)
                 BOOST_FOREACH(const CTxOut& txout, (*it).second.vout)
@@ -736,11 +763,19 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        fBalanceAllDirty = true;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
 }
 
+void CWallet::MarkBalanceDirty(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    if (!fBalanceAllDirty)
+        setBalanceDirty.insert(hash);
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
@@ -765,7 +800,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
     {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
-        pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
+        pair<WalletTxMap::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
@@ -869,7 +904,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         if ( !strCmd.empty())
         {
             boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
-            boost::thread t(runCommand, strCmd); // thread runs free
+            if (fBatchNotify)
+                vNotifyCommands.push_back(strCmd);
+            else
+                boost::thread t(runCommand, strCmd); // thread runs free
         }
 
     }
@@ -1036,13 +1074,101 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
     }
 }
 
+static void RunCommands(const std::vector<std::string>& vCommands)
+{
+    BOOST_FOREACH(const std::string& strCommand, vCommands)
+        runCommand(strCommand);
+}
+
+bool CWallet::MayInvolveMe(const CTransaction& tx) const
+{
+    AssertLockHeld(cs_wallet);
+    if (mapWallet.count(tx.GetHash()))
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (mapWallet.count(txin.prevout.hash) || mapTxSpends.count(txin.prevout))
+            return true;
+
+    LOCK(cs_KeyStore);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        CIndexAddress address = GetIndexAddress(txout.scriptPubKey);
+        if (address.type == 1) {
+            if (HaveKey(CKeyID(address.hashBytes)))
+                return true;
+        } else if (address.type == 2) {
+            if (mapScripts.count(CScriptID(address.hashBytes)))
+                return true;
+        } else if (::IsMine(*this, txout.scriptPubKey) != ISMINE_NO) {
+            return true;
+        }
+        if (!setWatchOnly.empty() && setWatchOnly.count(txout.scriptPubKey))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The transactions of a block are added under one acquisition of the locks, skipping those
+ * MayInvolveMe rules out, and their -walletnotify commands are run by a single thread, one
+ * after the other, once they are all in.
+ */
+void CWallet::SyncTransactions(const std::vector<CTransactionRef>& vtx, const CBlockIndex *pindex, const CBlock* pblock)
+{
+    std::vector<std::string> vCommands;
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        // A transaction may also spend from one before it in the block, not in the wallet yet
+        std::vector<const CTransaction*> vMine;
+        std::set<uint256> setMine;
+        BOOST_FOREACH(const CTransactionRef& ptx, vtx) {
+            const CTransaction& tx = *ptx;
+            bool fMine = MayInvolveMe(tx);
+            for (unsigned int i = 0; i < tx.vin.size() && !fMine && !setMine.empty(); i++)
+                fMine = setMine.count(tx.vin[i].prevout.hash) > 0;
+            if (fMine) {
+                vMine.push_back(&tx);
+                setMine.insert(tx.GetHash());
+            }
+        }
+        if (vMine.empty())
+            return;
+
+        // The transactions of the block that are ours are written in one transaction
+        CDBTxnScope txnScope(strWalletFile);
+        fBatchNotify = true;
+        try {
+            BOOST_FOREACH(const CTransaction* ptx, vMine)
+                SyncTransactionLocked(*ptx, pblock);
+        } catch (...) {
+            fBatchNotify = false;
+            vNotifyCommands.clear();
+            throw;
+        }
+        fBatchNotify = false;
+        vCommands.swap(vNotifyCommands);
+    }
+    if (!vCommands.empty())
+        boost::thread t(RunCommands, vCommands); // thread runs free
+}
+
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
+    SyncTransactionLocked(tx, pblock);
+}
+
+void CWallet::SyncTransactionLocked(const CTransaction& tx, const CBlock* pblock)
+{
+    AssertLockHeld(cs_wallet);
 
     if (!AddToWalletIfInvolvingMe(tx, pblock, true))
         return; // Not one of ours
 
+    // Connected or disconnected, its depth changed
+    MarkBalanceDirty(tx.GetHash());
+
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
     // recomputed, also:
@@ -1058,7 +1184,7 @@ isminetype CWallet::IsMine(const CTxIn &txin) const
 {
     {
         LOCK(cs_wallet);
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+        WalletTxMap::const_iterator mi = mapWallet.find(txin.prevout.hash);
         if (mi != mapWallet.end())
         {
             const CWalletTx& prev = (*mi).second;
@@ -1073,7 +1199,7 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
 {
     {
         LOCK(cs_wallet);
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+        WalletTxMap::const_iterator mi = mapWallet.find(txin.prevout.hash);
         if (mi != mapWallet.end())
         {
             const CWalletTx& prev = (*mi).second;
@@ -1302,7 +1428,7 @@ void CWalletTx::GetAmounts(list<COutputEntry>& listReceived,
     nFee = 0;
     listReceived.clear();
     listSent.clear();
-    strSentAccount = strFromAccount;
+    strSentAccount = GetFromAccount();
 
     // Compute fee:
     CAmount nDebit = GetDebit(filter);
@@ -1392,11 +1518,39 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
+bool CWallet::GetIndexAddresses(std::vector<std::pair<uint160, int> >& vAddresses) const
+{
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+
+    LOCK(cs_KeyStore);
+    BOOST_FOREACH(const CKeyID& keyid, setKeys)
+        vAddresses.push_back(std::make_pair(uint160(keyid), 1));
+    BOOST_FOREACH(const ScriptMap::value_type& item, mapScripts)
+        vAddresses.push_back(std::make_pair(uint160(item.first), 2));
+    BOOST_FOREACH(const CScript& script, setWatchOnly)
+    {
+        CIndexAddress address = GetIndexAddress(script);
+        if (address.type == 0)
+            return false;
+        vAddresses.push_back(std::make_pair(address.hashBytes, (int)address.type));
+    }
+    return true;
+}
+
+/**
+ * Scan the active chain from pindexStart for transactions of the wallet. The blocks are
+ * read a batch at a time on -rescanthreads threads, which also find the transactions with
+ * an output of ours; the transactions are then added in chain order, as whether one spends
+ * from the wallet depends on those before it. With -rescanindex and -addressindex only the
+ * blocks the address index has entries of the wallet's scripts in are read.
+ */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
+    int nThreads = std::max(1, (int)GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS));
 
     CBlockIndex* pindex = pindexStart;
     {
@@ -1410,21 +1564,89 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
+
+        std::vector<CBlockIndex*> vBlocks;
+        bool fIndexed = false;
+        std::vector<std::pair<uint160, int> > vAddresses;
+        if (pindex && fAddressIndex && GetBoolArg("-rescanindex", DEFAULT_RESCAN_INDEX) && !IsIndexBuilding("addressindex"))
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+            std::vector<std::pair<CAddressIndexKey, CAmount> > vEntries;
+            if (!GetIndexAddresses(vAddresses))
+                LogPrintf("%s: the wallet watches scripts the address index does not file, scanning every block\n", __func__);
+            else if (GetAddressIndex(vAddresses, vEntries))
+            {
+                std::set<int> setHeights;
+                for (size_t i = 0; i < vEntries.size(); i++)
+                    if (vEntries[i].first.blockHeight >= pindex->nHeight && vEntries[i].first.blockHeight <= chainActive.Height())
+                        setHeights.insert(vEntries[i].first.blockHeight);
+                BOOST_FOREACH(int nHeight, setHeights)
+                    vBlocks.push_back(chainActive[nHeight]);
+                fIndexed = true;
+                LogPrintf("%s: %u blocks from height %d have entries of %u wallet addresses in the address index\n", __func__,
+                          vBlocks.size(), pindex->nHeight, vAddresses.size());
+            }
+        }
+        if (!fIndexed)
+            for (CBlockIndex* pindexScan = pindex; pindexScan; pindexScan = chainActive.Next(pindexScan))
+                vBlocks.push_back(pindexScan);
+
+        // Whether a transaction still has to be looked at when none of its outputs is ours:
+        // it is in the wallet, or spends from or conflicts with a transaction that is
+        auto fnMayInvolveMe = [this](const CTransaction& tx) {
+            if (mapWallet.count(tx.GetHash()))
+                return true;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                if (mapWallet.count(txin.prevout.hash) || mapTxSpends.count(txin.prevout))
+                    return true;
+            return false;
+        };
+
+        // The transactions found in a batch of blocks are written in one transaction
+        CDBTxnScope txnScope(strWalletFile);
+        std::vector<CBlock> vBatch(std::min(vBlocks.size(), (size_t)RESCAN_BATCH_SIZE));
+        std::vector<std::vector<char> > vfMine(vBatch.size());
+        for (size_t nFirst = 0; nFirst < vBlocks.size(); nFirst += vBatch.size())
+        {
+            // Where an RPC job runs the rescan, it can be cancelled
+            boost::this_thread::interruption_point();
+            pindex = vBlocks[nFirst];
+            if (dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            size_t nCount = std::min(vBatch.size(), vBlocks.size() - nFirst);
+            ParallelForEach(nCount, nThreads, [&](size_t i) {
+                CBlock& block = vBatch[i];
+                if (!ReadBlockFromDisk(block, vBlocks[nFirst + i], chainParams.GetConsensus()))
+                    block.vtx.clear();
+                vfMine[i].assign(block.vtx.size(), false);
+                for (size_t j = 0; j < block.vtx.size(); j++)
+                {
+                    BOOST_FOREACH(const CTxOut& txout, block.vtx[j]->vout)
+                    {
+                        if (IsMine(txout) != ISMINE_NO)
+                        {
+                            vfMine[i][j] = true;
+                            break;
+                        }
+                    }
+                }
+                return true;
+            });
+
+            for (size_t i = 0; i < nCount; i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                const CBlock& block = vBatch[i];
+                for (size_t j = 0; j < block.vtx.size(); j++)
+                {
+                    if ((vfMine[i][j] || fnMayInvolveMe(*block.vtx[j])) && AddToWalletIfInvolvingMe(*block.vtx[j], &block, fUpdate))
+                        ret++;
+                }
             }
-            pindex = chainActive.Next(pindex);
+            txnScope.Commit();
+
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
+                pindex = vBlocks[nFirst + nCount - 1];
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
             }
         }
@@ -1438,27 +1660,38 @@ void CWallet::ReacceptWalletTransactions()
     // If transactions aren't being broadcasted, don't let them into local mempool either
     if (!fBroadcastTransactions)
         return;
-    LOCK2(cs_main, cs_wallet);
-    std::map<int64_t, CWalletTx*> mapSorted;
-
-    // Sort pending wallet transactions based on their initial wallet insertion order
-    BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+    std::map<int64_t, uint256> mapSorted;
     {
-        const uint256& wtxid = item.first;
-        CWalletTx& wtx = item.second;
-        assert(wtx.GetHash() == wtxid);
+        LOCK2(cs_main, cs_wallet);
 
-        int nDepth = wtx.GetDepthInMainChain();
+        // Sort pending wallet transactions based on their initial wallet insertion order
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
+            const uint256& wtxid = item.first;
+            CWalletTx& wtx = item.second;
+            assert(wtx.GetHash() == wtxid);
+
+            int nDepth = wtx.GetDepthInMainChain();
 
-        if (!wtx.IsCoinBase() && (nDepth == 0 && !wtx.isAbandoned())) {
-            mapSorted.insert(std::make_pair(wtx.nOrderPos, &wtx));
+            if (!wtx.IsCoinBase() && (nDepth == 0 && !wtx.isAbandoned())) {
+                mapSorted.insert(std::make_pair(wtx.nOrderPos, wtxid));
+            }
         }
     }
 
     // Try to add wallet transactions to memory pool
-    BOOST_FOREACH(PAIRTYPE(const int64_t, CWalletTx*)& item, mapSorted)
+    BOOST_FOREACH(PAIRTYPE(const int64_t, uint256)& item, mapSorted)
     {
-        CWalletTx& wtx = *(item.second);
+        boost::this_thread::interruption_point();
+
+        LOCK2(cs_main, cs_wallet);
+        WalletTxMap::iterator it = mapWallet.find(item.second);
+        if (it == mapWallet.end())
+            continue;
+        CWalletTx& wtx = it->second;
+        // A block or the user may have dealt with it since
+        if (wtx.GetDepthInMainChain() != 0 || wtx.isAbandoned())
+            continue;
 
         LOCK(mempool.cs);
         CValidationState state;
@@ -1466,6 +1699,50 @@ void CWallet::ReacceptWalletTransactions()
     }
 }
 
+bool CWallet::CheckLoadedKeys()
+{
+    std::vector<CPubKey> vKeys;
+    {
+        LOCK(cs_wallet);
+        vKeys.swap(vUncheckedKeys);
+    }
+    if (vKeys.empty())
+        return true;
+
+    // 1 if the key matches, 2 if not, 0 if it could not be had
+    std::vector<char> vResult(vKeys.size(), 0);
+    ParallelForEach(vKeys.size(), std::max(1, GetNumCores()), [&](size_t i) {
+        CKey key;
+        if (GetKey(vKeys[i].GetID(), key))
+            vResult[i] = key.VerifyPubKey(vKeys[i]) ? 1 : 2;
+        return true;
+    });
+
+    unsigned int nBad = 0;
+    for (size_t i = 0; i < vKeys.size(); i++) {
+        if (vResult[i] == 2) {
+            LogPrintf("Error: wallet key %s does not match its public key\n", CBitcoinAddress(vKeys[i].GetID()).ToString());
+            nBad++;
+        }
+    }
+
+    {
+        LOCK(cs_wallet);
+        // Never write a plaintext key into a wallet encrypted meanwhile
+        if (fFileBacked && !IsCrypted()) {
+            CDBTxnScope txnScope(strWalletFile);
+            CWalletDB walletdb(strWalletFile);
+            for (size_t i = 0; i < vKeys.size(); i++) {
+                CKey key;
+                if (vResult[i] == 1 && GetKey(vKeys[i].GetID(), key))
+                    walletdb.RewriteKey(vKeys[i], key.GetPrivKey());
+            }
+        }
+    }
+    LogPrintf("CheckLoadedKeys: checked %u keys from old records, %u do not match\n", vKeys.size(), nBad);
+    return nBad == 0;
+}
+
 bool CWalletTx::RelayWalletTransaction()
 {
     assert(pwallet->GetBroadcastTransactions());
@@ -1494,6 +1771,20 @@ set<uint256> CWalletTx::GetConflicts() const
     return result;
 }
 
+void CWalletTx::MarkDirty()
+{
+    fCreditCached = false;
+    fAvailableCreditCached = false;
+    fWatchDebitCached = false;
+    fWatchCreditCached = false;
+    fAvailableWatchCreditCached = false;
+    fImmatureWatchCreditCached = false;
+    fDebitCached = false;
+    fChangeCached = false;
+    if (pwallet)
+        pwallet->MarkBalanceDirty(GetHash());
+}
+
 CAmount CWalletTx::GetDebit(const isminefilter& filter) const
 {
     if (vin.empty())
@@ -1694,6 +1985,64 @@ bool CWalletTx::IsTrusted() const
     return true;
 }
 
+CWalletTxExtra& CWalletTx::GetMutableExtra()
+{
+    if (!extra)
+        extra = std::make_shared<CWalletTxExtra>();
+    else if (!extra.unique())
+        extra = std::make_shared<CWalletTxExtra>(*extra);
+    return *extra;
+}
+
+const mapValue_t& CWalletTx::GetMapValue() const
+{
+    static const mapValue_t mapEmpty;
+    return extra ? extra->mapValue : mapEmpty;
+}
+
+const std::vector<std::pair<std::string, std::string> >& CWalletTx::GetOrderForm() const
+{
+    static const std::vector<std::pair<std::string, std::string> > vEmpty;
+    return extra ? extra->vOrderForm : vEmpty;
+}
+
+const std::string& CWalletTx::GetFromAccount() const
+{
+    static const std::string strEmpty;
+    return extra ? extra->strFromAccount : strEmpty;
+}
+
+static size_t StringMemoryUsage(const std::string& str)
+{
+    // Short strings are kept in the string object itself
+    return str.capacity() > 15 ? memusage::MallocUsage(str.capacity() + 1) : 0;
+}
+
+size_t CWalletTx::DynamicMemoryUsage() const
+{
+    size_t nUsage = RecursiveDynamicUsage(*(const CTransaction*)this);
+    if (extra) {
+        nUsage += memusage::DynamicUsage(extra) + memusage::DynamicUsage(extra->mapValue) + memusage::DynamicUsage(extra->vOrderForm);
+        nUsage += StringMemoryUsage(extra->strFromAccount);
+        BOOST_FOREACH(const PAIRTYPE(const std::string, std::string)& item, extra->mapValue)
+            nUsage += StringMemoryUsage(item.first) + StringMemoryUsage(item.second);
+        BOOST_FOREACH(const PAIRTYPE(std::string, std::string)& item, extra->vOrderForm)
+            nUsage += StringMemoryUsage(item.first) + StringMemoryUsage(item.second);
+    }
+    return nUsage;
+}
+
+size_t CWallet::GetTxMemoryUsage() const
+{
+    AssertLockHeld(cs_wallet);
+    size_t nUsage = memusage::DynamicUsage(mapWallet) + memusage::DynamicUsage(mapTxSpends) + memusage::DynamicUsage(wtxOrdered);
+    nUsage += memusage::DynamicUsage(mapTxBalances) + memusage::DynamicUsage(setBalanceDirty) + memusage::DynamicUsage(setBalanceVolatile);
+    nUsage += memusage::DynamicUsage(setUnspentTxs) + memusage::DynamicUsage(setTxByHeight) + memusage::DynamicUsage(mapTxHeight);
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        nUsage += item.second.DynamicMemoryUsage();
+    return nUsage;
+}
+
 bool CWalletTx::IsEquivalentTo(const CWalletTx& tx) const
 {
         CMutableTransaction tx1 = *this;
@@ -1761,94 +2110,136 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
  */
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::UpdateDirtyTxs() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    std::set<uint256> setCount;
+    if (fBalanceAllDirty) {
+        balanceTotals = CWalletBalances();
+        mapTxBalances.clear();
+        setBalanceVolatile.clear();
+        setUnspentTxs.clear();
+        setTxByHeight.clear();
+        mapTxHeight.clear();
+        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setCount.insert(setCount.end(), it->first);
+    } else {
+        setCount.swap(setBalanceDirty);
+        setCount.insert(setBalanceVolatile.begin(), setBalanceVolatile.end());
+    }
+    fBalanceAllDirty = false;
+    setBalanceDirty.clear();
+
+    BOOST_FOREACH(const uint256& hash, setCount) {
+        std::map<uint256, CWalletBalances>::iterator itOld = mapTxBalances.find(hash);
+        if (itOld != mapTxBalances.end()) {
+            balanceTotals -= itOld->second;
+            mapTxBalances.erase(itOld);
+        }
+        setBalanceVolatile.erase(hash);
+        setUnspentTxs.erase(hash);
+        std::map<uint256, int>::iterator itHeight = mapTxHeight.find(hash);
+        if (itHeight != mapTxHeight.end()) {
+            setTxByHeight.erase(std::make_pair(itHeight->second, hash));
+            mapTxHeight.erase(itHeight);
+        }
+
+        WalletTxMap::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &(*it).second;
+        BlockMap::const_iterator itBlock = mapBlockIndex.find(pcoin->hashBlock);
+        if (!pcoin->hashUnset() && itBlock != mapBlockIndex.end()) {
+            setTxByHeight.insert(std::make_pair(itBlock->second->nHeight, hash));
+            mapTxHeight[hash] = itBlock->second->nHeight;
+        }
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            if (IsMine(pcoin->vout[i]) != ISMINE_NO && !IsSpentConfirmed(hash, i)) {
+                setUnspentTxs.insert(hash);
+                break;
+            }
+        }
+        CWalletBalances part;
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (pcoin->IsTrusted()) {
+            part.nTrusted = pcoin->GetAvailableCredit();
+            part.nWatchTrusted = pcoin->GetAvailableWatchOnlyCredit();
+        } else if (nDepth == 0 && pcoin->InMempool()) {
+            part.nUntrusted = pcoin->GetAvailableCredit();
+            part.nWatchUntrusted = pcoin->GetAvailableWatchOnlyCredit();
         }
+        part.nImmature = pcoin->GetImmatureCredit();
+        part.nWatchImmature = pcoin->GetImmatureWatchOnlyCredit();
+        if (!part.IsNull()) {
+            balanceTotals += part;
+            mapTxBalances[hash] = part;
+        }
+        if (nDepth <= 0 || pcoin->GetBlocksToMaturity() > 0)
+            setBalanceVolatile.insert(hash);
     }
+}
+
+void CWallet::GetTxsAboveHeight(int nHeight, std::vector<const CWalletTx*>& vTxs) const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTxs();
 
-    return nTotal;
+    // A transaction with a depth of at most 0 is counted again on every call, so it is in
+    // setBalanceVolatile; one with more is in a block of the active chain, at its height
+    std::set<uint256> setTxs(setBalanceVolatile);
+    for (std::set<std::pair<int, uint256> >::const_iterator it = setTxByHeight.lower_bound(std::make_pair(nHeight + 1, uint256())); it != setTxByHeight.end(); ++it)
+        setTxs.insert(it->second);
+
+    vTxs.reserve(setTxs.size());
+    BOOST_FOREACH(const uint256& hash, setTxs) {
+        WalletTxMap::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+            vTxs.push_back(&it->second);
+    }
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTxs();
+    return balanceTotals.nTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTxs();
+    return balanceTotals.nUntrusted;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTxs();
+    return balanceTotals.nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTxs();
+    return balanceTotals.nWatchTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTxs();
+    return balanceTotals.nWatchUntrusted;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateDirtyTxs();
+    return balanceTotals.nWatchImmature;
 }
 
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
@@ -1857,9 +2248,13 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Only the transactions with an output that may be unspent, rather than all of mapWallet
+        UpdateDirtyTxs();
+        BOOST_FOREACH(const uint256& wtxid, setUnspentTxs)
         {
-            const uint256& wtxid = it->first;
+            WalletTxMap::const_iterator it = mapWallet.find(wtxid);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             if (!CheckFinalTx(*pcoin))
@@ -1940,7 +2335,73 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, vector<COutput> vCoins,
+/**
+ * Depth first search for the subset of vValue, sorted by descending value, whose
+ * total is nTargetValue or at most nMaxExcess over it, as close to nTargetValue
+ * as the first nMaxTries nodes of the search tree can find. Each coin is tried
+ * included before excluded; a branch is cut as soon as it overshoots, or can no
+ * longer reach the target with the coins left.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                           const CAmount& nMaxExcess, vector<char>& vfBest, CAmount& nBest, int nMaxTries = MAX_BNB_TRIES)
+{
+    // Indices of the included coins; those below nNext that are not in it are excluded
+    vector<size_t> vSelected;
+    size_t nNext = 0;
+    CAmount nSelected = 0;
+    // Value of the coins from nNext on
+    CAmount nAvailable = nTotalLower;
+    CAmount nBestExcess = nMaxExcess + 1;
+
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nSelected + nAvailable < nTargetValue || nSelected > nTargetValue + nMaxExcess)
+            fBacktrack = true;
+        else if (nSelected >= nTargetValue)
+        {
+            if (nSelected - nTargetValue < nBestExcess)
+            {
+                nBestExcess = nSelected - nTargetValue;
+                vfBest.assign(vValue.size(), false);
+                BOOST_FOREACH(size_t i, vSelected)
+                    vfBest[i] = true;
+                nBest = nSelected;
+                if (nBestExcess == 0)
+                    break;
+            }
+            // Adding coins only adds to the excess
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            if (vSelected.empty())
+                break;
+            // Give the excluded coins after the last included one back, and exclude that one instead
+            while (nNext - 1 > vSelected.back())
+                nAvailable += vValue[--nNext].first;
+            nSelected -= vValue[nNext - 1].first;
+            vSelected.pop_back();
+        }
+        else
+        {
+            const CAmount& nValue = vValue[nNext].first;
+            nAvailable -= nValue;
+            // Including a coin after excluding one of the same value would search the same sums again
+            if (nNext == 0 || nValue != vValue[nNext - 1].first || (!vSelected.empty() && vSelected.back() == nNext - 1))
+            {
+                nSelected += nValue;
+                vSelected.push_back(nNext);
+            }
+            nNext++;
+        }
+    }
+
+    return nBestExcess <= nMaxExcess;
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
@@ -1953,10 +2414,16 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
     vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
+    // Shuffled by reference, each of the tries of SelectCoins starts from the same coins
+    vector<const COutput*> vpCoins;
+    vpCoins.reserve(vCoins.size());
     BOOST_FOREACH(const COutput &output, vCoins)
+        vpCoins.push_back(&output);
+    random_shuffle(vpCoins.begin(), vpCoins.end(), GetRandInt);
+
+    BOOST_FOREACH(const COutput *poutput, vpCoins)
     {
+        const COutput &output = *poutput;
         if (!output.fSpendable)
             continue;
 
@@ -2009,19 +2476,24 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
     std::sort(vValue.begin(), vValue.end(), CompareValueOnly());
     std::reverse(vValue.begin(), vValue.end());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+    // Look for a subset needing no change first, by branch and bound, and solve subset sum by
+    // stochastic approximation if there is none or the search gives up
+    bool fChangeless = SelectCoinsBnB(vValue, nTotalLower, nTargetValue, GetChangeDustThreshold() - 1, vfBest, nBest);
+    if (!fChangeless)
+    {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
+    if (coinLowestLarger.second.first && !fChangeless &&
         ((nBest != nTargetValue && nBest < nTargetValue + MIN_CHANGE) || coinLowestLarger.first <= nBest))
     {
         setCoinsRet.insert(coinLowestLarger.second);
@@ -2071,7 +2543,7 @@ bool CWallet::SelectCoins(const vector<COutput>& vAvailableCoins, const CAmount&
         coinControl->ListSelected(vPresetInputs);
     BOOST_FOREACH(const COutPoint& outpoint, vPresetInputs)
     {
-        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+        WalletTxMap::const_iterator it = mapWallet.find(outpoint.hash);
         if (it != mapWallet.end())
         {
             const CWalletTx* pcoin = &it->second;
@@ -2394,13 +2866,15 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
                 // Sign
                 int nIn = 0;
                 CTransaction txNewConst(txNew);
+                // The signatures UpdateTransaction adds don't change the signature hashes
+                PrecomputedTransactionData txdata(txNewConst);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
                 {
                     bool signSuccess;
                     const CScript& scriptPubKey = coin.first->vout[coin.second].scriptPubKey;
                     SignatureData sigdata;
                     if (sign)
-                        signSuccess = ProduceSignature(TransactionSignatureCreator(this, &txNewConst, nIn, coin.first->vout[coin.second].nValue, SIGHASH_ALL), scriptPubKey, sigdata);
+                        signSuccess = ProduceSignature(TransactionSignatureCreator(this, &txNewConst, nIn, coin.first->vout[coin.second].nValue, SIGHASH_ALL, &txdata), scriptPubKey, sigdata);
                     else
                         signSuccess = ProduceSignature(DummySignatureCreator(this), scriptPubKey, sigdata);
 
@@ -2498,9 +2972,8 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
+            // The key, the transaction and the coins it spends are written in one go
+            CDBTxnScope txnScope(strWalletFile);
             CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r+") : NULL;
 
             // Take key pair from key pool so it won't be used again
@@ -2558,6 +3031,13 @@ CAmount CWallet::GetRequiredFee(unsigned int nTxBytes)
     return std::max(minTxFee.GetFee(nTxBytes), ::minRelayTxFee.GetFee(nTxBytes));
 }
 
+CAmount CWallet::GetChangeDustThreshold()
+{
+    // Sized as a P2PKH output, which is what the key pool hands out for change
+    CScript scriptChange = CScript() << OP_DUP << OP_HASH160 << ToByteVector(uint160()) << OP_EQUALVERIFY << OP_CHECKSIG;
+    return CTxOut(0, scriptChange).GetDustThreshold(::minRelayTxFee);
+}
+
 CAmount CWallet::GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarget, const CTxMemPool& pool)
 {
     // payTxFee is user-set "I want to pay this much"
@@ -2722,6 +3202,7 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
+        CDBTxnScope txnScope(strWalletFile);
         CWalletDB walletdb(strWalletFile);
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
@@ -2729,45 +3210,129 @@ bool CWallet::NewKeyPool()
 
         if (IsLocked())
             return false;
-
-        int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
-        LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
+    }
+    // The new keys are generated the way a top-up does
+    if (!TopUpKeyPool())
+        return false;
+    {
+        LOCK(cs_wallet);
+        LogPrintf("CWallet::NewKeyPool wrote %u new keys\n", setKeyPool.size());
     }
     return true;
 }
 
+void CWallet::AddKeyPoolKey(CWalletDB& walletdb, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet);
+    int64_t nEnd = 1;
+    if (!setKeyPool.empty())
+        nEnd = *(--setKeyPool.end()) + 1;
+    if (!walletdb.WritePool(nEnd, CKeyPool(pubkey)))
+        throw runtime_error(std::string(__func__) + ": writing generated key failed");
+    setKeyPool.insert(nEnd);
+    LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+}
+
+/**
+ * The keys are generated KEYPOOL_TOPUP_BATCH at a time on -keypoolthreads threads, HD ones
+ * at child indexes claimed for the batch beforehand, without holding cs_wallet; only adding
+ * them to the wallet and the pool is done under it. So unless the caller holds cs_wallet,
+ * addresses can be handed out from the pool while a large top-up is running. Top-ups that
+ * find another one running leave the work to it, making a key only if the pool is empty.
+ */
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
-    {
-        LOCK(cs_wallet);
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
 
+    TRY_LOCK(cs_KeyPoolTopUp, lockTopUp);
+    if (!lockTopUp) {
+        LOCK(cs_wallet);
         if (IsLocked())
             return false;
+        if (setKeyPool.empty()) {
+            CDBTxnScope txnScope(strWalletFile);
+            CWalletDB walletdb(strWalletFile);
+            AddKeyPoolKey(walletdb, GenerateNewKey());
+        }
+        return true;
+    }
 
-        CWalletDB walletdb(strWalletFile);
+    int nThreads = std::max(1, (int)GetArg("-keypoolthreads", DEFAULT_KEYPOOL_THREADS));
+    while (true)
+    {
+        unsigned int nKeys;
+        bool fCompressed;
+        CExtKey externalChainChildKey;
+        CKeyID masterKeyID;
+        uint32_t nFirstChild = 0;
+        {
+            LOCK(cs_wallet);
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                break;
+            nKeys = std::min((unsigned int)(nTargetSize + 1 - setKeyPool.size()), KEYPOOL_TOPUP_BATCH);
+
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+            masterKeyID = hdChain.masterKeyID;
+            if (!masterKeyID.IsNull()) {
+                externalChainChildKey = GetExternalChainKey();
+                // Claim the child indexes of the batch, GenerateNewKey goes on after them
+                nFirstChild = hdChain.nExternalChainCounter;
+                hdChain.nExternalChainCounter += nKeys;
+                if (!CWalletDB(strWalletFile).WriteHDChain(hdChain))
+                    throw std::runtime_error(std::string(__func__) + ": Writing HD chain model failed");
+            }
+        }
+
+        int64_t nCreationTime = GetTime();
+        std::vector<CKey> vKeys(nKeys);
+        std::vector<CPubKey> vPubKeys(nKeys);
+        std::vector<CKeyMetadata> vMetadata(nKeys, CKeyMetadata(nCreationTime));
+        ParallelForEach(nKeys, nThreads, [&](size_t i) {
+            if (!masterKeyID.IsNull()) {
+                CExtKey childKey;
+                uint32_t nChild = nFirstChild + i;
+                externalChainChildKey.Derive(childKey, nChild | BIP32_HARDENED_KEY_LIMIT);
+                vKeys[i] = childKey.key;
+                vMetadata[i].hdKeypath     = "m/0'/0'/"+std::to_string(nChild)+"'";
+                vMetadata[i].hdMasterKeyID = masterKeyID;
+            } else {
+                vKeys[i].MakeNewKey(fCompressed);
+            }
+            vPubKeys[i] = vKeys[i].GetPubKey();
+            assert(vKeys[i].VerifyPubKey(vPubKeys[i]));
+            return true;
+        });
 
-        while (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error(std::string(__func__) + ": writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            LOCK(cs_wallet);
+
+            // The wallet may have been locked while the keys were generated
+            if (IsLocked())
+                return false;
+
+            // The keys, their metadata and the pool entries are written in one transaction
+            CDBTxnScope txnScope(strWalletFile);
+            CWalletDB walletdb(strWalletFile);
+
+            // Compressed public keys were introduced in version 0.6.0
+            if (fCompressed)
+                SetMinVersion(FEATURE_COMPRPUBKEY);
+
+            for (unsigned int i = 0; i < nKeys; i++)
+            {
+                // Skip keys already known to the wallet, as GenerateNewKey does
+                if (HaveKey(vPubKeys[i].GetID()))
+                    continue;
+                AddGeneratedKey(vKeys[i], vPubKeys[i], vMetadata[i]);
+                AddKeyPoolKey(walletdb, vPubKeys[i]);
+            }
         }
     }
     return true;
@@ -3002,7 +3567,7 @@ CAmount CWallet::GetAccountBalance(CWalletDB& walletdb, const std::string& strAc
     CAmount nBalance = 0;
 
     // Tally wallet transactions
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    for (WalletTxMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         const CWalletTx& wtx = (*it).second;
         if (!CheckFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < 0)
@@ -3094,7 +3659,7 @@ void CWallet::UpdatedTransaction(const uint256 &hashTx)
     {
         LOCK(cs_wallet);
         // Only notify UI if this transaction is in this wallet
-        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+        WalletTxMap::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end())
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
     }
@@ -3207,7 +3772,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
 
     // find first block that affects those keys, if there are any left
     std::vector<CKeyID> vAffected;
-    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
+    for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
         BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
@@ -3280,6 +3845,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     std::string strUsage = HelpMessageGroup(_("Wallet options:"));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
     strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), DEFAULT_KEYPOOL_SIZE));
+    strUsage += HelpMessageOpt("-keypoolthreads=<n>", strprintf(_("Number of threads generating keys for the key pool (default: %u)"), DEFAULT_KEYPOOL_THREADS));
     strUsage += HelpMessageOpt("-fallbackfee=<amt>", strprintf(_("A fee rate (in %s/kB) that will be used when fee estimation has insufficient data (default: %s)"),
                                                                CURRENCY_UNIT, FormatMoney(DEFAULT_FALLBACK_FEE)));
     strUsage += HelpMessageOpt("-mintxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for transaction creation (default: %s)"),
@@ -3287,6 +3853,9 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
                                                             CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions on startup"));
+    strUsage += HelpMessageOpt("-rescanindex", strprintf(_("With -addressindex, rescan only the blocks it has entries of the wallet's addresses in. "
+                                                           "Outputs paying a bare public key, as mined coins do, are not found this way (default: %u)"), DEFAULT_RESCAN_INDEX));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Number of threads reading blocks for a rescan (default: %u)"), DEFAULT_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet on startup"));
     if (showDebug)
         strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), DEFAULT_SEND_FREE_TRANSACTIONS));
@@ -3304,8 +3873,10 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     {
         strUsage += HelpMessageGroup(_("Wallet debugging/testing options:"));
 
+        strUsage += HelpMessageOpt("-asyncwalletsignals", strprintf("Update the wallet from validation events on a separate thread, waiting for it before wallet RPCs (default: %u)", DEFAULT_ASYNC_WALLET_SIGNALS));
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf("Flush wallet database activity from memory to disk log every <n> megabytes (default: %u)", DEFAULT_WALLET_DBLOGSIZE));
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", DEFAULT_FLUSHWALLET));
+        strUsage += HelpMessageOpt("-walletflushinterval=<n>", strprintf("Flush the wallet once it went <n> seconds without writes (default: %u)", DEFAULT_WALLET_FLUSH_INTERVAL));
         strUsage += HelpMessageOpt("-privdb", strprintf("Sets the DB_PRIVATE flag in the wallet db environment (default: %u)", DEFAULT_WALLET_PRIVDB));
         strUsage += HelpMessageOpt("-walletrejectlongchains", strprintf(_("Wallet will not create transactions that violate mempool chain limits (default: %u"), DEFAULT_WALLET_REJECT_LONG_CHAINS));
     }
@@ -3406,7 +3977,7 @@ bool CWallet::InitLoadWallet()
 
     LogPrintf(" wallet      %15dms\n", GetTimeMillis() - nStart);
 
-    RegisterValidationInterface(walletInstance);
+    RegisterValidationInterface(walletInstance, GetBoolArg("-asyncwalletsignals", DEFAULT_ASYNC_WALLET_SIGNALS));
 
     CBlockIndex *pindexRescan = chainActive.Tip();
     if (GetBoolArg("-rescan", false))
@@ -3445,7 +4016,7 @@ bool CWallet::InitLoadWallet()
         walletInstance->ScanForWalletTransactions(pindexRescan, true);
         LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
         walletInstance->SetBestChain(chainActive.GetLocator());
-        nWalletDBUpdated++;
+        MarkWalletDBUpdated();
 
         // Restore wallet transaction metadata after -zapwallettxes=1
         if (GetBoolArg("-zapwallettxes", false) && GetArg("-zapwallettxes", "1") != "2")
@@ -3455,17 +4026,15 @@ bool CWallet::InitLoadWallet()
             BOOST_FOREACH(const CWalletTx& wtxOld, vWtx)
             {
                 uint256 hash = wtxOld.GetHash();
-                std::map<uint256, CWalletTx>::iterator mi = walletInstance->mapWallet.find(hash);
+                WalletTxMap::iterator mi = walletInstance->mapWallet.find(hash);
                 if (mi != walletInstance->mapWallet.end())
                 {
                     const CWalletTx* copyFrom = &wtxOld;
                     CWalletTx* copyTo = &mi->second;
-                    copyTo->mapValue = copyFrom->mapValue;
-                    copyTo->vOrderForm = copyFrom->vOrderForm;
+                    copyTo->CopyExtra(*copyFrom);
                     copyTo->nTimeReceived = copyFrom->nTimeReceived;
                     copyTo->nTimeSmart = copyFrom->nTimeSmart;
                     copyTo->fFromMe = copyFrom->fFromMe;
-                    copyTo->strFromAccount = copyFrom->strFromAccount;
                     copyTo->nOrderPos = copyFrom->nOrderPos;
                     walletdb.WriteTx(*copyTo);
                 }
@@ -3599,7 +4168,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock& block)
 
     // Locate the transaction
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (*block.vtx[nIndex] == *(CTransaction*)this)
             break;
     if (nIndex == (int)block.vtx.size())
     {
@@ -7,6 +7,7 @@
 #define BITCOIN_WALLET_WALLET_H
 
 #include "amount.h"
+#include "coins.h"
 #include "streams.h"
 #include "tinyformat.h"
 #include "ui_interface.h"
@@ -19,10 +20,12 @@
 
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -47,14 +50,28 @@ static const CAmount DEFAULT_FALLBACK_FEE = 200000;
 static const CAmount DEFAULT_TRANSACTION_MINFEE = 100000;
 //! minimum change amount
 static const CAmount MIN_CHANGE = CENT;
+//! Subsets the branch and bound coin selection tries before falling back to the stochastic one
+static const int MAX_BNB_TRIES = 100000;
 //! Default for -spendzeroconfchange
 static const bool DEFAULT_SPEND_ZEROCONF_CHANGE = true;
 //! Default for -sendfreetransactions
 static const bool DEFAULT_SEND_FREE_TRANSACTIONS = false;
 //! Default for -walletrejectlongchains
 static const bool DEFAULT_WALLET_REJECT_LONG_CHAINS = false;
+//! Default for -asyncwalletsignals
+static const bool DEFAULT_ASYNC_WALLET_SIGNALS = false;
 //! -txconfirmtarget default
 static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 2;
+//! -rescanthreads default
+static const int DEFAULT_RESCAN_THREADS = 4;
+//! -rescanindex default
+static const bool DEFAULT_RESCAN_INDEX = false;
+//! Blocks a rescan reads at a time, on its threads, before adding their transactions in order
+static const unsigned int RESCAN_BATCH_SIZE = 64;
+//! -keypoolthreads default
+static const int DEFAULT_KEYPOOL_THREADS = 4;
+//! Keys a top-up generates at a time, on its threads, before adding them to the pool
+static const unsigned int KEYPOOL_TOPUP_BATCH = 250;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 static const bool DEFAULT_WALLETBROADCAST = true;
@@ -225,31 +242,45 @@ public:
  * A transaction with a bunch of additional info that only the owner cares about.
  * It includes any unrecorded transactions needed to link it back to the block chain.
  */
+/** The metadata of a wallet transaction that few have and that is rarely looked at */
+struct CWalletTxExtra
+{
+    mapValue_t mapValue;
+    std::vector<std::pair<std::string, std::string> > vOrderForm;
+    std::string strFromAccount;
+};
+
+/**
+ * A transaction with information only the wallet cares about. The rarely used metadata is
+ * kept out of line, shared by copies until one of them changes it, and the cache flags are
+ * packed, as a wallet may hold millions of these.
+ */
 class CWalletTx : public CMerkleTx
 {
 private:
     const CWallet* pwallet;
+    //! Null while the transaction has no metadata
+    std::shared_ptr<CWalletTxExtra> extra;
+
+    CWalletTxExtra& GetMutableExtra();
 
 public:
-    mapValue_t mapValue;
-    std::vector<std::pair<std::string, std::string> > vOrderForm;
+    int64_t nOrderPos; //!< position in ordered transaction list
     unsigned int fTimeReceivedIsTxTime;
     unsigned int nTimeReceived; //!< time received by this node
     unsigned int nTimeSmart;
     char fFromMe;
-    std::string strFromAccount;
-    int64_t nOrderPos; //!< position in ordered transaction list
 
     // memory only
-    mutable bool fDebitCached;
-    mutable bool fCreditCached;
-    mutable bool fImmatureCreditCached;
-    mutable bool fAvailableCreditCached;
-    mutable bool fWatchDebitCached;
-    mutable bool fWatchCreditCached;
-    mutable bool fImmatureWatchCreditCached;
-    mutable bool fAvailableWatchCreditCached;
-    mutable bool fChangeCached;
+    mutable bool fDebitCached : 1;
+    mutable bool fCreditCached : 1;
+    mutable bool fImmatureCreditCached : 1;
+    mutable bool fAvailableCreditCached : 1;
+    mutable bool fWatchDebitCached : 1;
+    mutable bool fWatchCreditCached : 1;
+    mutable bool fImmatureWatchCreditCached : 1;
+    mutable bool fAvailableWatchCreditCached : 1;
+    mutable bool fChangeCached : 1;
     mutable CAmount nDebitCached;
     mutable CAmount nCreditCached;
     mutable CAmount nImmatureCreditCached;
@@ -283,13 +314,11 @@ public:
     void Init(const CWallet* pwalletIn)
     {
         pwallet = pwalletIn;
-        mapValue.clear();
-        vOrderForm.clear();
+        extra.reset();
         fTimeReceivedIsTxTime = false;
         nTimeReceived = 0;
         nTimeSmart = 0;
         fFromMe = false;
-        strFromAccount.clear();
         fDebitCached = false;
         fCreditCached = false;
         fImmatureCreditCached = false;
@@ -318,10 +347,14 @@ public:
         if (ser_action.ForRead())
             Init(NULL);
         char fSpent = false;
+        mapValue_t mapValue;
+        std::vector<std::pair<std::string, std::string> > vOrderForm;
 
         if (!ser_action.ForRead())
         {
-            mapValue["fromaccount"] = strFromAccount;
+            mapValue = GetMapValue();
+            vOrderForm = GetOrderForm();
+            mapValue["fromaccount"] = GetFromAccount();
 
             WriteOrderPos(nOrderPos, mapValue);
 
@@ -341,32 +374,42 @@ public:
 
         if (ser_action.ForRead())
         {
-            strFromAccount = mapValue["fromaccount"];
+            std::string strFromAccount = mapValue["fromaccount"];
 
             ReadOrderPos(nOrderPos, mapValue);
 
             nTimeSmart = mapValue.count("timesmart") ? (unsigned int)atoi64(mapValue["timesmart"]) : 0;
-        }
 
-        mapValue.erase("fromaccount");
-        mapValue.erase("version");
-        mapValue.erase("spent");
-        mapValue.erase("n");
-        mapValue.erase("timesmart");
+            mapValue.erase("fromaccount");
+            mapValue.erase("version");
+            mapValue.erase("spent");
+            mapValue.erase("n");
+            mapValue.erase("timesmart");
+
+            if (!mapValue.empty() || !vOrderForm.empty() || !strFromAccount.empty()) {
+                CWalletTxExtra& extraRead = GetMutableExtra();
+                extraRead.mapValue.swap(mapValue);
+                extraRead.vOrderForm.swap(vOrderForm);
+                extraRead.strFromAccount.swap(strFromAccount);
+            }
+        }
     }
 
-    //! make sure balances are recalculated
-    void MarkDirty()
-    {
-        fCreditCached = false;
-        fAvailableCreditCached = false;
-        fWatchDebitCached = false;
-        fWatchCreditCached = false;
-        fAvailableWatchCreditCached = false;
-        fImmatureWatchCreditCached = false;
-        fDebitCached = false;
-        fChangeCached = false;
-    }
+    //! The key-value metadata, such as "comment" and "to"
+    const mapValue_t& GetMapValue() const;
+    mapValue_t& MapValue() { return GetMutableExtra().mapValue; }
+    //! Payment requests and messages from the GUI
+    const std::vector<std::pair<std::string, std::string> >& GetOrderForm() const;
+    std::vector<std::pair<std::string, std::string> >& OrderForm() { return GetMutableExtra().vOrderForm; }
+    const std::string& GetFromAccount() const;
+    void SetFromAccount(const std::string& strAccount) { GetMutableExtra().strFromAccount = strAccount; }
+    //! Take the metadata of an equivalent transaction
+    void CopyExtra(const CWalletTx& other) { extra = other.extra; }
+    //! Memory the transaction takes beyond sizeof(CWalletTx)
+    size_t DynamicMemoryUsage() const;
+
+    //! make sure balances are recalculated, the wallet's totals too
+    void MarkDirty();
 
     void BindWallet(CWallet *pwalletIn)
     {
@@ -410,6 +453,9 @@ public:
     std::set<uint256> GetConflicts() const;
 };
 
+//! The transactions of a wallet, by txid; hashed, as lookups far outnumber walks in txid order
+typedef std::unordered_map<uint256, CWalletTx, SaltedTxidHasher> WalletTxMap;
+
 
 
 
@@ -541,6 +587,46 @@ private:
 };
 
 
+/** What transactions add to the balances of a wallet, as GetBalance and the like report them */
+struct CWalletBalances
+{
+    CAmount nTrusted;
+    CAmount nUntrusted;
+    CAmount nImmature;
+    CAmount nWatchTrusted;
+    CAmount nWatchUntrusted;
+    CAmount nWatchImmature;
+
+    CWalletBalances() : nTrusted(0), nUntrusted(0), nImmature(0), nWatchTrusted(0), nWatchUntrusted(0), nWatchImmature(0) {}
+
+    bool IsNull() const
+    {
+        return !nTrusted && !nUntrusted && !nImmature && !nWatchTrusted && !nWatchUntrusted && !nWatchImmature;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nTrusted += b.nTrusted;
+        nUntrusted += b.nUntrusted;
+        nImmature += b.nImmature;
+        nWatchTrusted += b.nWatchTrusted;
+        nWatchUntrusted += b.nWatchUntrusted;
+        nWatchImmature += b.nWatchImmature;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUntrusted -= b.nUntrusted;
+        nImmature -= b.nImmature;
+        nWatchTrusted -= b.nWatchTrusted;
+        nWatchUntrusted -= b.nWatchUntrusted;
+        nWatchImmature -= b.nWatchImmature;
+        return *this;
+    }
+};
+
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -585,6 +671,68 @@ private:
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
+    /**
+     * The balances, kept as the sum of what each transaction adds to them, so they are
+     * counted again only for the transactions that changed. A transaction is counted again
+     * when it is marked dirty, which it is when it is added, spent, connected or disconnected;
+     * those whose part changes with the tip or the mempool alone, the unconfirmed and
+     * conflicted ones and immature coinbases, are counted again on every call.
+     */
+    mutable CWalletBalances balanceTotals;
+    //! The non-null parts of the transactions
+    mutable std::map<uint256, CWalletBalances> mapTxBalances;
+    mutable std::set<uint256> setBalanceDirty;
+    mutable std::set<uint256> setBalanceVolatile;
+    //! Count every transaction again, as when the wallet is loaded
+    mutable bool fBalanceAllDirty;
+    /**
+     * The transactions AvailableCoins looks at: those with an output of ours that no confirmed
+     * transaction spends, counted again along with the balances. Spends that are not confirmed
+     * come and go with the mempool, so AvailableCoins checks them itself.
+     */
+    mutable std::set<uint256> setUnspentTxs;
+    /**
+     * The transactions by the height of the block they were last seen in, also kept up to
+     * date by UpdateDirtyTxs, as whatever sets hashBlock marks the transaction dirty. The
+     * height of a block hash never changes, so neither does the entry on reorganizations.
+     */
+    mutable std::set<std::pair<int, uint256> > setTxByHeight;
+    mutable std::map<uint256, int> mapTxHeight;
+
+    /** Whether a confirmed transaction of the wallet spends the output n of hash */
+    bool IsSpentConfirmed(const uint256& hash, unsigned int n) const;
+    /** Bring balanceTotals and setUnspentTxs up to date (requires cs_main and cs_wallet) */
+    void UpdateDirtyTxs() const;
+
+    /**
+     * The address index entries of every script of the wallet it files: pay-to-pubkey-hash
+     * for the keys, pay-to-script-hash for the scripts. False if a watch-only script is of
+     * a kind it does not file, so a rescan through the index would miss its transactions.
+     */
+    bool GetIndexAddresses(std::vector<std::pair<uint160, int> >& vAddresses) const;
+
+    //! While set, AddToWallet queues its -walletnotify commands in vNotifyCommands (guarded by cs_wallet)
+    bool fBatchNotify;
+    std::vector<std::string> vNotifyCommands;
+
+    /**
+     * False if tx certainly does not involve the wallet: it is not in the wallet, spends
+     * nothing the wallet knows of, and pays none of its keys and scripts. Outputs paying a key
+     * or script hash are looked up by that hash, without solving them as IsMine does; only
+     * others go through IsMine. (requires cs_wallet)
+     */
+    bool MayInvolveMe(const CTransaction& tx) const;
+    void SyncTransactionLocked(const CTransaction& tx, const CBlock* pblock);
+
+    //! Held by the thread topping up the key pool, so only one generates keys for it
+    CCriticalSection cs_KeyPoolTopUp;
+    /** The HD key at m/0'/0', the keys of the wallet are derived from (requires cs_wallet) */
+    CExtKey GetExternalChainKey() const;
+    /** Add a key made by GenerateNewKey or TopUpKeyPool, with its metadata (requires cs_wallet) */
+    void AddGeneratedKey(const CKey& secret, const CPubKey& pubkey, const CKeyMetadata& metadata);
+    /** Add a key of the wallet at the end of the key pool (requires cs_wallet) */
+    void AddKeyPoolKey(CWalletDB& walletdb, const CPubKey& pubkey);
+
 public:
     /*
      * Main wallet lock.
@@ -600,6 +748,8 @@ public:
 
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
+    //! Keys of old records loaded without checking them against their public key
+    std::vector<CPubKey> vUncheckedKeys;
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
@@ -636,9 +786,11 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        fBalanceAllDirty = true;
+        fBatchNotify = false;
     }
 
-    std::map<uint256, CWalletTx> mapWallet;
+    WalletTxMap mapWallet;
     std::list<CAccountingEntry> laccentries;
 
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
@@ -672,7 +824,7 @@ public:
      * completion the coin set and corresponding actual target value is
      * assembled
      */
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, uint64_t nMaxAncestors, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, uint64_t nMaxAncestors, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -733,11 +885,31 @@ public:
     bool GetAccountPubkey(CPubKey &pubKey, std::string strAccount, bool bForceNew = false);
 
     void MarkDirty();
+    /** Count the balances of a transaction again, whether it is still in mapWallet or not */
+    void MarkBalanceDirty(const uint256& hash) const;
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, const CBlock* pblock);
+    void SyncTransactions(const std::vector<CTransactionRef>& vtx, const CBlockIndex *pindex, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    /**
+     * The transactions that can be less deep in the active chain than a block at nHeight:
+     * those in blocks above it, and those that are not confirmed. In txid order.
+     */
+    void GetTxsAboveHeight(int nHeight, std::vector<const CWalletTx*>& vTxs) const;
+    /** Memory used by the transactions of the wallet and what indexes them (requires cs_wallet) */
+    size_t GetTxMemoryUsage() const;
+    /**
+     * Add the unconfirmed transactions to the mempool, in the order they were added to the
+     * wallet. The locks are taken for one transaction at a time, so this can run in the
+     * background without holding up RPC calls.
+     */
     void ReacceptWalletTransactions();
+    /**
+     * Check the keys in vUncheckedKeys against their public key, and store them again
+     * with a checksum so the next load can skip that. Returns false if any did not match.
+     */
+    bool CheckLoadedKeys();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
     CAmount GetBalance() const;
@@ -776,6 +948,11 @@ public:
      * floating relay fee and user set minimum transaction fee
      */
     static CAmount GetRequiredFee(unsigned int nTxBytes);
+    /**
+     * The smallest change output worth creating at the relay fee; less
+     * than this over the target is left to the fee instead
+     */
+    static CAmount GetChangeDustThreshold();
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
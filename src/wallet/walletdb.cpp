@@ -31,7 +31,7 @@ static uint64_t nAccountingEntryNumber = 0;
 
 bool CWalletDB::WriteName(const string& strAddress, const string& strName)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(make_pair(string("name"), strAddress), strName);
 }
 
@@ -39,37 +39,37 @@ bool CWalletDB::EraseName(const string& strAddress)
 {
     // This should only be used for sending addresses, never for receiving addresses,
     // receiving addresses must always have an address book entry if they're not change return.
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Erase(make_pair(string("name"), strAddress));
 }
 
 bool CWalletDB::WritePurpose(const string& strAddress, const string& strPurpose)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(make_pair(string("purpose"), strAddress), strPurpose);
 }
 
 bool CWalletDB::ErasePurpose(const string& strPurpose)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Erase(make_pair(string("purpose"), strPurpose));
 }
 
 bool CWalletDB::WriteTx(const CWalletTx& wtx)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::make_pair(std::string("tx"), wtx.GetHash()), wtx);
 }
 
 bool CWalletDB::EraseTx(uint256 hash)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Erase(std::make_pair(std::string("tx"), hash));
 }
 
 bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata& keyMeta)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
 
     if (!Write(std::make_pair(std::string("keymeta"), vchPubKey),
                keyMeta, false))
@@ -84,12 +84,24 @@ bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, c
     return Write(std::make_pair(std::string("key"), vchPubKey), std::make_pair(vchPrivKey, Hash(vchKey.begin(), vchKey.end())), false);
 }
 
+bool CWalletDB::RewriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey)
+{
+    MarkWalletDBUpdated();
+
+    std::vector<unsigned char> vchKey;
+    vchKey.reserve(vchPubKey.size() + vchPrivKey.size());
+    vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+    vchKey.insert(vchKey.end(), vchPrivKey.begin(), vchPrivKey.end());
+
+    return Write(std::make_pair(std::string("key"), vchPubKey), std::make_pair(vchPrivKey, Hash(vchKey.begin(), vchKey.end())));
+}
+
 bool CWalletDB::WriteCryptedKey(const CPubKey& vchPubKey,
                                 const std::vector<unsigned char>& vchCryptedSecret,
                                 const CKeyMetadata &keyMeta)
 {
     const bool fEraseUnencryptedKey = true;
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
 
     if (!Write(std::make_pair(std::string("keymeta"), vchPubKey),
             keyMeta))
@@ -107,31 +119,31 @@ bool CWalletDB::WriteCryptedKey(const CPubKey& vchPubKey,
 
 bool CWalletDB::WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::make_pair(std::string("mkey"), nID), kMasterKey, true);
 }
 
 bool CWalletDB::WriteCScript(const uint160& hash, const CScript& redeemScript)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::make_pair(std::string("cscript"), hash), *(const CScriptBase*)(&redeemScript), false);
 }
 
 bool CWalletDB::WriteWatchOnly(const CScript &dest)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::make_pair(std::string("watchs"), *(const CScriptBase*)(&dest)), '1');
 }
 
 bool CWalletDB::EraseWatchOnly(const CScript &dest)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Erase(std::make_pair(std::string("watchs"), *(const CScriptBase*)(&dest)));
 }
 
 bool CWalletDB::WriteBestBlock(const CBlockLocator& locator)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     Write(std::string("bestblock"), CBlockLocator()); // Write empty block locator so versions that require a merkle branch automatically rescan
     return Write(std::string("bestblock_nomerkle"), locator);
 }
@@ -144,13 +156,13 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
 
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::string("orderposnext"), nOrderPosNext);
 }
 
 bool CWalletDB::WriteDefaultKey(const CPubKey& vchPubKey)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::string("defaultkey"), vchPubKey);
 }
 
@@ -161,13 +173,13 @@ bool CWalletDB::ReadPool(int64_t nPool, CKeyPool& keypool)
 
 bool CWalletDB::WritePool(int64_t nPool, const CKeyPool& keypool)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::make_pair(std::string("pool"), nPool), keypool);
 }
 
 bool CWalletDB::ErasePool(int64_t nPool)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Erase(std::make_pair(std::string("pool"), nPool));
 }
 
@@ -263,7 +275,7 @@ DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
     typedef multimap<int64_t, TxPair > TxItems;
     TxItems txByTime;
 
-    for (map<uint256, CWalletTx>::iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+    for (WalletTxMap::iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
         txByTime.insert(make_pair(wtx->nTimeReceived, TxPair(wtx, (CAccountingEntry*)0)));
@@ -337,6 +349,7 @@ public:
     bool fAnyUnordered;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    vector<CPubKey> vUncheckedKeys;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = 0;
@@ -346,6 +359,176 @@ public:
     }
 };
 
+/** Deserialize and check a "tx" record; fUpgrade is set if it is to be written again */
+static bool ReadTxRecord(CDataStream& ssKey, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgrade, string& strErr)
+{
+    uint256 hash;
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    fUpgrade = false;
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            std::string strFromAccount;
+            ssValue >> fTmp >> fUnused >> strFromAccount;
+            wtx.SetFromAccount(strFromAccount);
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgrade = true;
+    }
+    return true;
+}
+
+static void LoadTxRecord(CWallet* pwallet, CWalletScanState& wss, const CWalletTx& wtx, bool fUpgrade)
+{
+    if (fUpgrade)
+        wss.vWalletUpgrade.push_back(wtx.GetHash());
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    pwallet->AddToWallet(wtx, true, NULL);
+}
+
+/**
+ * Deserialize a "key" or "wkey" record. A key stored without the hash of the pair, as old
+ * wallets did, is checked against its public key only if fCheck is set; fChecked tells
+ * whether the key was checked either way.
+ */
+static bool ReadKeyRecord(const string& strType, CDataStream& ssKey, CDataStream& ssValue, bool fCheck,
+                          CPubKey& vchPubKey, CKey& key, bool& fChecked, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid())
+    {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash;
+
+    if (strType == "key")
+    {
+        ssValue >> pkey;
+    } else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try
+    {
+        ssValue >> hash;
+    }
+    catch (...) {}
+
+    fChecked = fCheck;
+
+    if (!hash.IsNull())
+    {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash)
+        {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fChecked = true;
+        fCheck = false;
+    }
+
+    if (!key.Load(pkey, vchPubKey, !fCheck))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
+static bool LoadKeyRecord(CWallet* pwallet, CWalletScanState& wss, const CPubKey& vchPubKey, const CKey& key, bool fChecked, string& strErr)
+{
+    if (!pwallet->LoadKey(key, vchPubKey))
+    {
+        strErr = "Error reading wallet database: LoadKey failed";
+        return false;
+    }
+    if (!fChecked)
+        wss.vUncheckedKeys.push_back(vchPubKey);
+    return true;
+}
+
+/** A record of the wallet database, with what could be worked out of it without the wallet */
+class CWalletRecord
+{
+public:
+    CDataStream ssKey;
+    CDataStream ssValue;
+    string strType;
+    string strErr;
+    //! Whether ParseWalletRecord read the transaction or key of the record, and if that went well
+    bool fParsed;
+    bool fParseOK;
+
+    CWalletTx wtx;
+    bool fUpgradeTx;
+
+    CPubKey vchPubKey;
+    CKey key;
+    bool fKeyChecked;
+
+    CWalletRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION),
+        fParsed(false), fParseOK(false), fUpgradeTx(false), fKeyChecked(false) {}
+};
+
+/**
+ * Do the costly part of reading a transaction or plaintext key record, which needs nothing
+ * from the wallet, so LoadWallet can do it for many records at once. Keys of "key" records
+ * without a checksum are not checked here, but by CWallet::CheckLoadedKeys once the wallet
+ * is up.
+ */
+static void ParseWalletRecord(CWalletRecord& record)
+{
+    try {
+        CDataStream ssKey(record.ssKey);
+        ssKey >> record.strType;
+        if (record.strType == "tx") {
+            record.fParsed = true;
+            record.fParseOK = ReadTxRecord(ssKey, record.ssValue, record.wtx, record.fUpgradeTx, record.strErr);
+        } else if (record.strType == "key" || record.strType == "wkey") {
+            record.fParsed = true;
+            record.fParseOK = ReadKeyRecord(record.strType, ssKey, record.ssValue, record.strType == "wkey",
+                                            record.vchPubKey, record.key, record.fKeyChecked, record.strErr);
+        }
+    } catch (...) {
+        record.fParseOK = false;
+    }
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -369,38 +552,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgrade;
+            if (!ReadTxRecord(ssKey, ssValue, wtx, fUpgrade, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->AddToWallet(wtx, true, NULL);
+            LoadTxRecord(pwallet, wss, wtx, fUpgrade);
         }
         else if (strType == "acentry")
         {
@@ -435,66 +591,14 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "key" || strType == "wkey")
         {
             CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid())
-            {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
             CKey key;
-            CPrivKey pkey;
-            uint256 hash;
-
+            bool fChecked;
             if (strType == "key")
-            {
                 wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try
-            {
-                ssValue >> hash;
-            }
-            catch (...) {}
-
-            bool fSkipCheck = false;
-
-            if (!hash.IsNull())
-            {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash)
-                {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
-                }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
-            {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            if (!ReadKeyRecord(strType, ssKey, ssValue, true, vchPubKey, key, fChecked, strErr))
                 return false;
-            }
-            if (!pwallet->LoadKey(key, vchPubKey))
-            {
-                strErr = "Error reading wallet database: LoadKey failed";
+            if (!LoadKeyRecord(pwallet, wss, vchPubKey, key, fChecked, strErr))
                 return false;
-            }
         }
         else if (strType == "mkey")
         {
@@ -647,39 +751,74 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
-        while (true)
+        // The records are read a batch at a time, deserialized on all cores, and then added
+        // to the wallet in the order of the database
+        int nThreads = std::max(1, GetNumCores());
+        std::vector<CWalletRecord> vRecords(WALLET_LOAD_BATCH_SIZE);
+        bool fEnd = false;
+        while (!fEnd)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            size_t nRecords = 0;
+            while (nRecords < vRecords.size())
             {
-                LogPrintf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                // Read next record
+                CWalletRecord& record = vRecords[nRecords];
+                record = CWalletRecord();
+                int ret = ReadAtCursor(pcursor, record.ssKey, record.ssValue);
+                if (ret == DB_NOTFOUND) {
+                    fEnd = true;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    LogPrintf("Error reading next record from wallet database\n");
+                    return DB_CORRUPT;
+                }
+                nRecords++;
             }
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            ParallelForEach(nRecords, nThreads, [&vRecords](size_t i) {
+                ParseWalletRecord(vRecords[i]);
+                return true;
+            });
+
+            for (size_t i = 0; i < nRecords; i++)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
+                CWalletRecord& record = vRecords[i];
+
+                // Try to be tolerant of single corrupt records:
+                string strType = record.strType, strErr = record.strErr;
+                bool fReadOK;
+                if (!record.fParsed)
+                    fReadOK = ReadKeyValue(pwallet, record.ssKey, record.ssValue, wss, strType, strErr);
+                else if (!record.fParseOK)
+                    fReadOK = false;
+                else if (strType == "tx") {
+                    LoadTxRecord(pwallet, wss, record.wtx, record.fUpgradeTx);
+                    fReadOK = true;
+                } else {
+                    if (strType == "key")
+                        wss.nKeys++;
+                    fReadOK = LoadKeyRecord(pwallet, wss, record.vchPubKey, record.key, record.fKeyChecked, strErr);
+                }
+                if (!fReadOK)
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else
+                    {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!strErr.empty())
+                    LogPrintf("%s\n", strErr);
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
         }
         pcursor->close();
     }
@@ -707,6 +846,11 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     if ((wss.nKeys + wss.nCKeys) != wss.nKeyMeta)
         pwallet->nTimeFirstKey = 1; // 0 would be considered 'no value'
 
+    {
+        LOCK(pwallet->cs_wallet);
+        pwallet->vUncheckedKeys.swap(wss.vUncheckedKeys);
+    }
+
     BOOST_FOREACH(uint256 hash, wss.vWalletUpgrade)
         WriteTx(pwallet->mapWallet[hash]);
 
@@ -819,7 +963,11 @@ DBErrors CWalletDB::ZapSelectTx(CWallet* pwallet, vector<uint256>& vTxHashIn, ve
             break;
         }
         else if ((*it) == hash) {
+            // What it spent may be unspent now
+            BOOST_FOREACH(const CTxIn& txin, pwallet->mapWallet[hash].vin)
+                pwallet->MarkBalanceDirty(txin.prevout.hash);
             pwallet->mapWallet.erase(hash);
+            pwallet->MarkBalanceDirty(hash);
             if(!EraseTx(hash)) {
                 LogPrint("db", "Transaction was found for deletion but returned database error: %s\n", hash.GetHex());
                 delerror = true;
@@ -863,20 +1011,16 @@ void ThreadFlushWalletDB(const string& strFile)
     if (!GetBoolArg("-flushwallet", DEFAULT_FLUSHWALLET))
         return;
 
-    unsigned int nLastSeen = nWalletDBUpdated;
-    unsigned int nLastFlushed = nWalletDBUpdated;
-    int64_t nLastWalletUpdate = GetTime();
+    int64_t nInterval = std::max((int64_t)1, GetArg("-walletflushinterval", DEFAULT_WALLET_FLUSH_INTERVAL)) * 1000;
+    unsigned int nLastFlushed = 0;
+    WaitWalletDBUpdated(nLastFlushed, 0);
     while (true)
     {
-        MilliSleep(500);
-
-        if (nLastSeen != nWalletDBUpdated)
-        {
-            nLastSeen = nWalletDBUpdated;
-            nLastWalletUpdate = GetTime();
-        }
+        // Sleep until something is written, then until nothing was for the interval
+        unsigned int nLastSeen = nLastFlushed;
+        while (!WaitWalletDBUpdated(nLastSeen, 3600 * 1000)) {}
+        while (WaitWalletDBUpdated(nLastSeen, nInterval)) {}
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
             if (lockDb)
@@ -897,7 +1041,7 @@ void ThreadFlushWalletDB(const string& strFile)
                     if (mi != bitdb.mapFileUseCount.end())
                     {
                         LogPrint("db", "Flushing %s\n", strFile);
-                        nLastFlushed = nWalletDBUpdated;
+                        nLastFlushed = nLastSeen;
                         int64_t nStart = GetTimeMillis();
 
                         // Flush wallet file so it's self contained
@@ -1004,19 +1148,19 @@ bool CWalletDB::Recover(CDBEnv& dbenv, const std::string& filename)
 
 bool CWalletDB::WriteDestData(const std::string &address, const std::string &key, const std::string &value)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::make_pair(std::string("destdata"), std::make_pair(address, key)), value);
 }
 
 bool CWalletDB::EraseDestData(const std::string &address, const std::string &key)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Erase(std::make_pair(std::string("destdata"), std::make_pair(address, key)));
 }
 
 
 bool CWalletDB::WriteHDChain(const CHDChain& chain)
 {
-    nWalletDBUpdated++;
+    MarkWalletDBUpdated();
     return Write(std::string("hdchain"), chain);
 }
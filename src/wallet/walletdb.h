@@ -18,6 +18,10 @@
 #include <vector>
 
 static const bool DEFAULT_FLUSHWALLET = true;
+//! -walletflushinterval default, in seconds
+static const int64_t DEFAULT_WALLET_FLUSH_INTERVAL = 2;
+//! Records LoadWallet reads at a time, deserializing them in parallel before adding them in order
+static const size_t WALLET_LOAD_BATCH_SIZE = 1000;
 
 class CAccount;
 class CAccountingEntry;
@@ -132,6 +136,8 @@ public:
     bool EraseTx(uint256 hash);
 
     bool WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata &keyMeta);
+    //! Store a key of an old "key" record again, with the hash that spares checking it on load
+    bool RewriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey);
     bool WriteCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret, const CKeyMetadata &keyMeta);
     bool WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey);
 
@@ -11,7 +11,7 @@ CZMQAbstractNotifier::~CZMQAbstractNotifier()
     assert(!psocket);
 }
 
-bool CZMQAbstractNotifier::NotifyBlock(const CBlockIndex * /*CBlockIndex*/)
+bool CZMQAbstractNotifier::NotifyBlock(const CBlockIndex * /*CBlockIndex*/, const CBlock * /*CBlock*/)
 {
     return true;
 }
@@ -20,3 +20,28 @@ bool CZMQAbstractNotifier::NotifyTransaction(const CTransaction &/*transaction*/
 {
     return true;
 }
+
+bool CZMQAbstractNotifier::NotifyRPCJob(const std::string &/*strJob*/)
+{
+    return true;
+}
+
+bool CZMQAbstractNotifier::NotifyMempool(const uint256 &/*txhash*/, bool /*fAdded*/, uint64_t /*nMempoolSequence*/)
+{
+    return true;
+}
+
+bool CZMQAbstractNotifier::NotifyMempoolAddressDeltas(const CMempoolAddressUpdate &/*update*/)
+{
+    return true;
+}
+
+bool CZMQAbstractNotifier::NotifyBlockAddressDeltas(const CIndexUpdate &/*update*/)
+{
+    return true;
+}
+
+bool CZMQAbstractNotifier::Flush()
+{
+    return true;
+}
@@ -7,15 +7,26 @@
 
 #include "zmqconfig.h"
 
+class CBlock;
 class CBlockIndex;
+struct CIndexUpdate;
+struct CMempoolAddressUpdate;
+class uint256;
 class CZMQAbstractNotifier;
 
+//! Default for -zmqpub<type>hwm, the messages queued for a subscriber past which further ones are dropped
+static const int DEFAULT_ZMQ_SNDHWM = 1000;
+//! Default for -zmqtxbatchms, 0 publishes every transaction as it comes
+static const int64_t DEFAULT_ZMQ_TX_BATCH_MS = 0;
+//! Bytes of a batched message after which it is sent before its time is up
+static const size_t MAX_ZMQ_BATCH_SIZE = 1000000;
+
 typedef CZMQAbstractNotifier* (*CZMQNotifierFactory)();
 
 class CZMQAbstractNotifier
 {
 public:
-    CZMQAbstractNotifier() : psocket(0) { }
+    CZMQAbstractNotifier() : psocket(0), nSendHWM(DEFAULT_ZMQ_SNDHWM), nBatchMillis(0), nSent(0), nDropped(0) { }
     virtual ~CZMQAbstractNotifier();
 
     template <typename T>
@@ -28,17 +39,38 @@ public:
     void SetType(const std::string &t) { type = t; }
     std::string GetAddress() const { return address; }
     void SetAddress(const std::string &a) { address = a; }
+    int GetSendHWM() const { return nSendHWM; }
+    /** Takes effect in Initialize; a socket shared by several notifiers takes that of the first */
+    void SetSendHWM(int n) { nSendHWM = n; }
+    int64_t GetBatchMillis() const { return nBatchMillis; }
+    /** Collect the messages of up to nMillis milliseconds into one, for the notifiers that support it */
+    void SetBatchMillis(int64_t nMillis) { nBatchMillis = nMillis; }
+    uint64_t GetSentCount() const { return nSent; }
+    /** The messages dropped because a subscriber fell nSendHWM messages behind */
+    uint64_t GetDroppedCount() const { return nDropped; }
 
     virtual bool Initialize(void *pcontext) = 0;
     virtual void Shutdown() = 0;
 
-    virtual bool NotifyBlock(const CBlockIndex *pindex);
+    /** pblock is the block of pindex if it is in memory, else NULL */
+    virtual bool NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    virtual bool NotifyRPCJob(const std::string &strJob);
+    /** A transaction added to or removed from the mempool, and the mempool sequence number after that */
+    virtual bool NotifyMempool(const uint256 &txhash, bool fAdded, uint64_t nMempoolSequence);
+    virtual bool NotifyMempoolAddressDeltas(const CMempoolAddressUpdate &update);
+    virtual bool NotifyBlockAddressDeltas(const CIndexUpdate &update);
+    /** Send the batched message, if any */
+    virtual bool Flush();
 
 protected:
     void *psocket;
     std::string type;
     std::string address;
+    int nSendHWM;
+    int64_t nBatchMillis;
+    uint64_t nSent;
+    uint64_t nDropped;
 };
 
 #endif // BITCOIN_ZMQ_ZMQABSTRACTNOTIFIER_H
@@ -9,12 +9,19 @@
 #include "main.h"
 #include "streams.h"
 #include "util.h"
+#include "utilstrencodings.h"
+
+#include <algorithm>
+
+#include <univalue.h>
 
 void zmqError(const char *str)
 {
     LogPrint("zmq", "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
 }
 
+CZMQNotificationInterface* pzmqNotificationInterface = NULL;
+
 CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL)
 {
 }
@@ -39,6 +46,10 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     factories["pubhashtx"] = CZMQAbstractNotifier::Create<CZMQPublishHashTransactionNotifier>;
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
+    factories["pubmininginfo"] = CZMQAbstractNotifier::Create<CZMQPublishMiningInfoNotifier>;
+    factories["pubrpcjob"] = CZMQAbstractNotifier::Create<CZMQPublishRPCJobNotifier>;
+    factories["pubsequence"] = CZMQAbstractNotifier::Create<CZMQPublishSequenceNotifier>;
+    factories["pubaddressdelta"] = CZMQAbstractNotifier::Create<CZMQPublishAddressDeltaNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -50,6 +61,13 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
             CZMQAbstractNotifier *notifier = factory();
             notifier->SetType(i->first);
             notifier->SetAddress(address);
+            std::map<std::string, std::string>::const_iterator hwm = args.find("-zmq" + i->first + "hwm");
+            if (hwm != args.end())
+                notifier->SetSendHWM(std::max(0, atoi(hwm->second)));
+            if (i->first == "pubhashtx" || i->first == "pubrawtx") {
+                std::map<std::string, std::string>::const_iterator batch = args.find("-zmqtxbatchms");
+                notifier->SetBatchMillis(batch != args.end() ? std::max((int64_t)0, atoi64(batch->second)) : DEFAULT_ZMQ_TX_BATCH_MS);
+            }
             notifiers.push_back(notifier);
         }
     }
@@ -110,6 +128,7 @@ bool CZMQNotificationInterface::Initialize()
 void CZMQNotificationInterface::Shutdown()
 {
     LogPrint("zmq", "zmq: Shutdown notification interface\n");
+    LOCK(cs);
     if (pcontext)
     {
         for (std::list<CZMQAbstractNotifier*>::iterator i=notifiers.begin(); i!=notifiers.end(); ++i)
@@ -124,12 +143,13 @@ void CZMQNotificationInterface::Shutdown()
     }
 }
 
-void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
+void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex, const CBlock *pblock)
 {
+    LOCK(cs);
     for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
         CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyBlock(pindex))
+        if (notifier->NotifyBlock(pindex, pblock))
         {
             i++;
         }
@@ -143,6 +163,7 @@ void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
 
 void CZMQNotificationInterface::SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, const CBlock* pblock)
 {
+    LOCK(cs);
     for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
         CZMQAbstractNotifier *notifier = *i;
@@ -157,3 +178,129 @@ void CZMQNotificationInterface::SyncTransaction(const CTransaction& tx, const CB
         }
     }
 }
+
+void CZMQNotificationInterface::UpdatedIndexes(const boost::shared_ptr<const CIndexUpdate> &update)
+{
+    LOCK(cs);
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyBlockAddressDeltas(*update))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
+
+void CZMQNotificationInterface::UpdatedMempool(const uint256 &txhash, bool fAdded, uint64_t nSequence)
+{
+    LOCK(cs);
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyMempool(txhash, fAdded, nSequence))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
+
+void CZMQNotificationInterface::UpdatedMempoolAddresses(const boost::shared_ptr<const CMempoolAddressUpdate> &update)
+{
+    LOCK(cs);
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyMempoolAddressDeltas(*update))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
+
+std::vector<CZMQNotifierStats> CZMQNotificationInterface::GetNotifierStats() const
+{
+    LOCK(cs);
+    std::vector<CZMQNotifierStats> vStats;
+    for (std::list<CZMQAbstractNotifier*>::const_iterator i = notifiers.begin(); i!=notifiers.end(); ++i)
+    {
+        const CZMQAbstractNotifier *notifier = *i;
+        CZMQNotifierStats stats;
+        stats.type = notifier->GetType();
+        stats.address = notifier->GetAddress();
+        stats.nSendHWM = notifier->GetSendHWM();
+        stats.nBatchMillis = notifier->GetBatchMillis();
+        stats.nSent = notifier->GetSentCount();
+        stats.nDropped = notifier->GetDroppedCount();
+        vStats.push_back(stats);
+    }
+    return vStats;
+}
+
+int64_t CZMQNotificationInterface::GetBatchMillis() const
+{
+    LOCK(cs);
+    int64_t nMillis = 0;
+    for (std::list<CZMQAbstractNotifier*>::const_iterator i = notifiers.begin(); i!=notifiers.end(); ++i)
+        nMillis = std::max(nMillis, (*i)->GetBatchMillis());
+    return nMillis;
+}
+
+void CZMQNotificationInterface::ThreadFlushBatches()
+{
+    int64_t nMillis = GetBatchMillis();
+    if (nMillis <= 0)
+        return;
+    while (true)
+    {
+        MilliSleep(nMillis);
+        LOCK(cs);
+        for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+        {
+            CZMQAbstractNotifier *notifier = *i;
+            if (notifier->Flush())
+            {
+                i++;
+            }
+            else
+            {
+                notifier->Shutdown();
+                i = notifiers.erase(i);
+            }
+        }
+    }
+}
+
+void CZMQNotificationInterface::RPCJobFinished(const UniValue& job)
+{
+    std::string strJob = job.write();
+    LOCK(cs);
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyRPCJob(strJob))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
@@ -5,12 +5,27 @@
 #ifndef BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 #define BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 
+#include "sync.h"
 #include "validationinterface.h"
+#include <list>
 #include <string>
 #include <map>
+#include <vector>
 
 class CBlockIndex;
 class CZMQAbstractNotifier;
+class UniValue;
+
+/** What getzmqnotifications reports of a notifier */
+struct CZMQNotifierStats
+{
+    std::string type;
+    std::string address;
+    int nSendHWM;
+    int64_t nBatchMillis;
+    uint64_t nSent;
+    uint64_t nDropped;
+};
 
 class CZMQNotificationInterface : public CValidationInterface
 {
@@ -19,19 +34,36 @@ public:
 
     static CZMQNotificationInterface* CreateWithArguments(const std::map<std::string, std::string> &args);
 
+    /** Publish a job submitted with submitjob as it finishes, see RPCServer::OnJobFinished */
+    void RPCJobFinished(const UniValue& job);
+
+    std::vector<CZMQNotifierStats> GetNotifierStats() const;
+    /** The longest any notifier batches messages, 0 if none does */
+    int64_t GetBatchMillis() const;
+    /** Send the batched messages every GetBatchMillis() milliseconds, until interrupted */
+    void ThreadFlushBatches();
+
 protected:
     bool Initialize();
     void Shutdown();
 
     // CValidationInterface
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, const CBlock* pblock);
-    void UpdatedBlockTip(const CBlockIndex *pindex);
+    void UpdatedBlockTip(const CBlockIndex *pindex, const CBlock *pblock);
+    void UpdatedIndexes(const boost::shared_ptr<const CIndexUpdate> &update);
+    void UpdatedMempool(const uint256 &txhash, bool fAdded, uint64_t nSequence);
+    void UpdatedMempoolAddresses(const boost::shared_ptr<const CMempoolAddressUpdate> &update);
 
 private:
     CZMQNotificationInterface();
 
     void *pcontext;
+    //! Guards notifiers, which are called from the validation queue, RPC and batch flushing threads
+    mutable CCriticalSection cs;
     std::list<CZMQAbstractNotifier*> notifiers;
 };
 
+/** The notification interface when ZMQ notifications are enabled, else NULL */
+extern CZMQNotificationInterface* pzmqNotificationInterface;
+
 #endif // BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
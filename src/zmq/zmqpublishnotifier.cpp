@@ -4,7 +4,11 @@
 
 #include "chainparams.h"
 #include "zmqpublishnotifier.h"
+#include "crypto/common.h"
+#include "indexwriter.h"
 #include "main.h"
+#include "mempoolindex.h"
+#include "miner.h"
 #include "util.h"
 #include "rpc/server.h"
 
@@ -14,8 +18,13 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_MININGINFO = "mininginfo";
+static const char *MSG_RPCJOB      = "rpcjob";
+static const char *MSG_SEQUENCE  = "sequence";
+static const char *MSG_ADDRESSDELTA = "addressdelta";
 
-// Internal function to send multipart message
+// Internal function to send multipart message, without blocking.
+// Returns 0 if sent, EAGAIN if dropped at the high water mark, else -1
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
 {
     va_list args;
@@ -37,9 +46,15 @@ static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
 
         data = va_arg(args, const void*);
 
-        rc = zmq_msg_send(&msg, sock, data ? ZMQ_SNDMORE : 0);
+        rc = zmq_msg_send(&msg, sock, (data ? ZMQ_SNDMORE : 0) | ZMQ_DONTWAIT);
         if (rc == -1)
         {
+            // Once the first part is queued the others are too
+            if (zmq_errno() == EAGAIN)
+            {
+                zmq_msg_close(&msg);
+                return EAGAIN;
+            }
             zmqError("Unable to send ZMQ msg");
             zmq_msg_close(&msg);
             return -1;
@@ -71,7 +86,20 @@ bool CZMQAbstractPublishNotifier::Initialize(void *pcontext)
             return false;
         }
 
-        int rc = zmq_bind(psocket, address.c_str());
+        int rc = zmq_setsockopt(psocket, ZMQ_SNDHWM, &nSendHWM, sizeof(nSendHWM));
+        if (rc!=0)
+        {
+            zmqError("Failed to set outbound message high water mark");
+            zmq_close(psocket);
+            return false;
+        }
+#ifdef ZMQ_XPUB_NODROP
+        // Fail sends at the high water mark instead of dropping them silently, to count them
+        int nodrop = 1;
+        zmq_setsockopt(psocket, ZMQ_XPUB_NODROP, &nodrop, sizeof(nodrop));
+#endif
+
+        rc = zmq_bind(psocket, address.c_str());
         if (rc!=0)
         {
             zmqError("Failed to bind address");
@@ -88,6 +116,7 @@ bool CZMQAbstractPublishNotifier::Initialize(void *pcontext)
         LogPrint("zmq", "zmq: Reusing socket for address %s\n", address);
 
         psocket = i->second->psocket;
+        nSendHWM = i->second->nSendHWM;
         mapPublishNotifiers.insert(std::make_pair(address, this));
 
         return true;
@@ -98,6 +127,8 @@ void CZMQAbstractPublishNotifier::Shutdown()
 {
     assert(psocket);
 
+    Flush();
+
     int count = mapPublishNotifiers.count(address);
 
     // remove this notifier from the list of publishers using this address
@@ -134,6 +165,14 @@ bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const void* d
     int rc = zmq_send_multipart(psocket, command, strlen(command), data, size, msgseq, (size_t)sizeof(uint32_t), (void*)0);
     if (rc == -1)
         return false;
+    if (rc == EAGAIN)
+    {
+        // The gap in sequence numbers tells subscribers they missed it
+        LogPrint("zmq", "zmq: Dropped %s at the high water mark of %s\n", command, address);
+        nDropped++;
+    }
+    else
+        nSent++;
 
     /* increment memory only sequence number after sending */
     nSequence++;
@@ -141,7 +180,31 @@ bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const void* d
     return true;
 }
 
-bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQAbstractPublishNotifier::BatchMessage(const char *command, const void* data, size_t size)
+{
+    if (nBatchMillis <= 0)
+        return SendMessage(command, data, size);
+
+    if (vBatch.empty())
+        nBatchStart = GetTimeMillis();
+    pBatchCommand = command;
+    const unsigned char* pdata = (const unsigned char*)data;
+    vBatch.insert(vBatch.end(), pdata, pdata + size);
+    if (vBatch.size() >= MAX_ZMQ_BATCH_SIZE || GetTimeMillis() - nBatchStart >= nBatchMillis)
+        return Flush();
+    return true;
+}
+
+bool CZMQAbstractPublishNotifier::Flush()
+{
+    if (vBatch.empty())
+        return true;
+    bool ret = SendMessage(pBatchCommand, &vBatch[0], vBatch.size());
+    vBatch.clear();
+    return ret;
+}
+
+bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock)
 {
     uint256 hash = pindex->GetBlockHash();
     LogPrint("zmq", "zmq: Publish hashblock %s\n", hash.GetHex());
@@ -158,13 +221,19 @@ bool CZMQPublishHashTransactionNotifier::NotifyTransaction(const CTransaction &t
     char data[32];
     for (unsigned int i = 0; i < 32; i++)
         data[31 - i] = hash.begin()[i];
-    return SendMessage(MSG_HASHTX, data, 32);
+    return BatchMessage(MSG_HASHTX, data, 32);
 }
 
-bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock)
 {
     LogPrint("zmq", "zmq: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
+    // Publish the bytes that are relayed to peers, serializing the block for both if nobody did yet
+    int nType = (RPCSerializationFlags() & SERIALIZE_TRANSACTION_NO_WITNESS) ? MSG_BLOCK : MSG_WITNESS_BLOCK;
+    CSharedPayloadRef payload = pblock ? GetBlockPayload(*pblock, nType) : GetRecentBlockPayload(pindex->GetBlockHash(), nType);
+    if (payload)
+        return SendMessage(MSG_RAWBLOCK, payload->begin(), payload->size());
+
     const Consensus::Params& consensusParams = Params().GetConsensus();
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
     {
@@ -188,5 +257,75 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     LogPrint("zmq", "zmq: Publish rawtx %s\n", hash.GetHex());
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
     ss << transaction;
-    return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
+    return BatchMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
+}
+
+bool CZMQPublishMiningInfoNotifier::NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock)
+{
+    LogPrint("zmq", "zmq: Publish mininginfo %s\n", pindex->GetBlockHash().GetHex());
+    std::string strMetrics = GetMiningMetrics().write();
+    return SendMessage(MSG_MININGINFO, strMetrics.data(), strMetrics.size());
+}
+
+bool CZMQPublishRPCJobNotifier::NotifyRPCJob(const std::string &strJob)
+{
+    LogPrint("zmq", "zmq: Publish rpcjob %s\n", strJob);
+    return SendMessage(MSG_RPCJOB, strJob.data(), strJob.size());
+}
+
+// Hashes are published in the byte order of hashtx and hashblock
+static void WriteHash(unsigned char* data, const uint256& hash)
+{
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+}
+
+bool CZMQPublishSequenceNotifier::NotifyMempool(const uint256 &txhash, bool fAdded, uint64_t nMempoolSequence)
+{
+    LogPrint("zmq", "zmq: Publish sequence %s %s\n", txhash.GetHex(), fAdded ? "added" : "removed");
+    unsigned char data[32 + 1 + 8];
+    WriteHash(data, txhash);
+    data[32] = fAdded ? 'A' : 'R';
+    WriteLE64(data + 33, nMempoolSequence);
+    return SendMessage(MSG_SEQUENCE, data, sizeof(data));
+}
+
+static const size_t ADDRESS_DELTA_SIZE = 1 + 20 + 32 + 4 + 1 + 8;
+
+static void WriteAddressDelta(unsigned char* data, int type, const uint160& addressBytes, const uint256& txhash, unsigned int index, bool fSpending, CAmount amount)
+{
+    data[0] = type;
+    memcpy(data + 1, addressBytes.begin(), 20);
+    WriteHash(data + 21, txhash);
+    WriteLE32(data + 53, index);
+    data[57] = fSpending;
+    WriteLE64(data + 58, (uint64_t)amount);
+}
+
+bool CZMQPublishAddressDeltaNotifier::NotifyMempoolAddressDeltas(const CMempoolAddressUpdate &update)
+{
+    if (update.deltas.empty())
+        return true;
+    LogPrint("zmq", "zmq: Publish addressdelta %s %s\n", update.txhash.GetHex(), update.fAdded ? "added" : "removed");
+    std::vector<unsigned char> data(33 + update.deltas.size() * ADDRESS_DELTA_SIZE);
+    data[0] = update.fAdded ? 'A' : 'R';
+    WriteHash(&data[1], update.txhash);
+    unsigned char* p = &data[33];
+    for (CMempoolAddressIndex::deltas_type::const_iterator it = update.deltas.begin(); it != update.deltas.end(); ++it, p += ADDRESS_DELTA_SIZE)
+        WriteAddressDelta(p, it->first.type, it->first.addressBytes, it->first.txhash, it->first.index, it->first.spending, it->second.amount);
+    return SendMessage(MSG_ADDRESSDELTA, &data[0], data.size());
+}
+
+bool CZMQPublishAddressDeltaNotifier::NotifyBlockAddressDeltas(const CIndexUpdate &update)
+{
+    if (update.addressIndex.empty())
+        return true;
+    LogPrint("zmq", "zmq: Publish addressdelta %s %s\n", update.hashBlock.GetHex(), update.fConnect ? "connected" : "disconnected");
+    std::vector<unsigned char> data(33 + update.addressIndex.size() * ADDRESS_DELTA_SIZE);
+    data[0] = update.fConnect ? 'C' : 'D';
+    WriteHash(&data[1], update.hashBlock);
+    unsigned char* p = &data[33];
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = update.addressIndex.begin(); it != update.addressIndex.end(); ++it, p += ADDRESS_DELTA_SIZE)
+        WriteAddressDelta(p, it->first.type, it->first.hashBytes, it->first.txhash, it->first.index, it->first.spending, it->second);
+    return SendMessage(MSG_ADDRESSDELTA, &data[0], data.size());
 }
@@ -13,8 +13,13 @@ class CZMQAbstractPublishNotifier : public CZMQAbstractNotifier
 {
 private:
     uint32_t nSequence; //!< upcounting per message sequence number
+    //! The command of the batched message, its data so far and when the first part was added
+    const char *pBatchCommand;
+    std::vector<unsigned char> vBatch;
+    int64_t nBatchStart;
 
 public:
+    CZMQAbstractPublishNotifier() : nSequence(0), pBatchCommand(NULL), nBatchStart(0) {}
 
     /* send zmq multipart message
        parts:
@@ -23,6 +28,10 @@ public:
           * message sequence number
     */
     bool SendMessage(const char *command, const void* data, size_t size);
+    /** Append data to the batched message, sending it once it is nBatchMillis old or
+        MAX_ZMQ_BATCH_SIZE bytes large; without batching, the same as SendMessage */
+    bool BatchMessage(const char *command, const void* data, size_t size);
+    bool Flush();
 
     bool Initialize(void *pcontext);
     void Shutdown();
@@ -31,7 +40,7 @@ public:
 class CZMQPublishHashBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock);
 };
 
 class CZMQPublishHashTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -43,7 +52,7 @@ public:
 class CZMQPublishRawBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock);
 };
 
 class CZMQPublishRawTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -52,4 +61,29 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+class CZMQPublishMiningInfoNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyBlock(const CBlockIndex *pindex, const CBlock *pblock);
+};
+
+class CZMQPublishRPCJobNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyRPCJob(const std::string &strJob);
+};
+
+class CZMQPublishSequenceNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyMempool(const uint256 &txhash, bool fAdded, uint64_t nMempoolSequence);
+};
+
+class CZMQPublishAddressDeltaNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyMempoolAddressDeltas(const CMempoolAddressUpdate &update);
+    bool NotifyBlockAddressDeltas(const CIndexUpdate &update);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H
@@ -0,0 +1,63 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zmq/zmqrpc.h"
+
+#include "rpc/server.h"
+#include "utilstrencodings.h"
+#include "zmq/zmqnotificationinterface.h"
+
+#include <univalue.h>
+
+UniValue getzmqnotifications(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getzmqnotifications\n"
+            "\nReturns the active ZeroMQ notifications and how many messages they sent and dropped.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"type\": \"pubhashtx\",   (string) Type of notification\n"
+            "    \"address\": \"...\",      (string) Address of the publisher\n"
+            "    \"hwm\": n,               (numeric) Messages queued for a subscriber past which further ones are dropped\n"
+            "    \"batchms\": n,           (numeric) Milliseconds of notifications collected into one message, 0 if not batched\n"
+            "    \"sent\": n,              (numeric) Messages sent\n"
+            "    \"dropped\": n            (numeric) Messages dropped at the high water mark\n"
+            "  },\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getzmqnotifications", "")
+            + HelpExampleRpc("getzmqnotifications", "")
+        );
+
+    UniValue result(UniValue::VARR);
+    if (pzmqNotificationInterface) {
+        std::vector<CZMQNotifierStats> vStats = pzmqNotificationInterface->GetNotifierStats();
+        for (std::vector<CZMQNotifierStats>::const_iterator it = vStats.begin(); it != vStats.end(); ++it) {
+            UniValue obj(UniValue::VOBJ);
+            obj.push_back(Pair("type", it->type));
+            obj.push_back(Pair("address", it->address));
+            obj.push_back(Pair("hwm", it->nSendHWM));
+            obj.push_back(Pair("batchms", it->nBatchMillis));
+            obj.push_back(Pair("sent", it->nSent));
+            obj.push_back(Pair("dropped", it->nDropped));
+            result.push_back(obj);
+        }
+    }
+    return result;
+}
+
+static const CRPCCommand commands[] =
+{ //  category              name                      actor (function)         okSafeMode
+  //  --------------------- ------------------------  -----------------------  ----------
+    { "zmq",                "getzmqnotifications",    &getzmqnotifications,    true  },
+};
+
+void RegisterZMQRPCCommands(CRPCTable &tableRPC)
+{
+    for (unsigned int vcidx = 0; vcidx < ARRAYLEN(commands); vcidx++)
+        tableRPC.appendCommand(commands[vcidx].name, &commands[vcidx]);
+}